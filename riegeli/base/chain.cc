@@ -15,6 +15,8 @@
 #include "riegeli/base/chain.h"
 
 #include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
 #include <atomic>
 #include <cstring>
 #include <limits>
@@ -23,9 +25,12 @@
 #include <string>
 #include <type_traits>
 #include <utility>
+#include <vector>
 
 #include "absl/base/optimization.h"
+#include "absl/base/thread_annotations.h"
 #include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
 #include "absl/types/span.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/memory.h"
@@ -45,6 +50,30 @@ void WritePadding(std::ostream& out, size_t pad) {
   }
 }
 
+constexpr size_t IntLog2(size_t value) {
+  return value <= 1 ? 0 : IntLog2(value >> 1) + 1;
+}
+
+// Size of a transparent huge page on common platforms.
+constexpr size_t kHugePageSize = size_t{2} << 20;
+
+// Advises the kernel to back whole huge pages inside [data, data + size) with
+// transparent huge pages. Used for blocks of Chains with
+// Options::set_huge_pages(). Smaller blocks are left alone to avoid inflating
+// their memory usage.
+void AdviseHugePages(char* data, size_t size) {
+#ifdef MADV_HUGEPAGE
+  if (size < kHugePageSize) return;
+  const uintptr_t begin =
+      RoundUp<kHugePageSize>(reinterpret_cast<uintptr_t>(data));
+  const uintptr_t end = (reinterpret_cast<uintptr_t>(data) + size) &
+                        ~uintptr_t{kHugePageSize - 1};
+  if (begin >= end) return;
+  // This is only a hint, so its failure is ignored.
+  madvise(reinterpret_cast<void*>(begin), end - begin, MADV_HUGEPAGE);
+#endif
+}
+
 }  // namespace
 
 class Chain::BlockRef {
@@ -142,20 +171,259 @@ inline void Chain::StringRef::DumpStructure(absl::string_view data,
   out << "string";
 }
 
-inline Chain::Block* Chain::Block::NewInternal(size_t capacity) {
+class Chain::SharedRef {
+ public:
+  explicit SharedRef(std::shared_ptr<const void> owner)
+      : owner_(std::move(owner)) {}
+
+  SharedRef(SharedRef&& src) noexcept;
+  SharedRef& operator=(SharedRef&& src) noexcept;
+
+  void AddUniqueTo(absl::string_view data,
+                   MemoryEstimator* memory_estimator) const;
+  void DumpStructure(absl::string_view data, std::ostream& out) const;
+
+ private:
+  std::shared_ptr<const void> owner_;
+};
+
+inline Chain::SharedRef::SharedRef(SharedRef&& src) noexcept
+    : owner_(std::move(src.owner_)) {}
+
+inline Chain::SharedRef& Chain::SharedRef::operator=(SharedRef&& src) noexcept {
+  owner_ = std::move(src.owner_);
+  return *this;
+}
+
+inline void Chain::SharedRef::AddUniqueTo(
+    absl::string_view data, MemoryEstimator* memory_estimator) const {
+  // Memory of the owner is not known, and it might be shared with objects
+  // other than Chains.
+  memory_estimator->AddMemory(sizeof(*this));
+}
+
+inline void Chain::SharedRef::DumpStructure(absl::string_view data,
+                                            std::ostream& out) const {
+  out << "shared";
+}
+
+// BlockPool recycles memory of internal blocks with capacities between
+// kMinBufferSize() and kMaxBufferSize(), which are rounded up to a power of 2
+// so that blocks of similar sizes share a size class.
+//
+// Each thread keeps a small cache of free blocks of each size class, so that
+// most allocations and deallocations do not synchronize. Threads exchange
+// blocks through a shared free list of a bounded size. Blocks exceeding the
+// bounds go back to the allocator.
+class Chain::BlockPool {
+ public:
+  // Returns the size class for blocks of the given capacity, or kNumSizeClasses
+  // if blocks of this capacity are not pooled.
+  static size_t SizeClass(size_t capacity);
+
+  // Returns the capacity of blocks of the given size class.
+  static size_t Capacity(size_t size_class) {
+    return kMinBufferSize() << size_class;
+  }
+
+  // Returns memory for a block of the given size class.
+  static void* Allocate(size_t size_class);
+
+  // Returns memory of a block of the given size class to the pool.
+  static void Deallocate(void* ptr, size_t size_class);
+
+  static constexpr size_t kNumSizeClasses =
+      IntLog2(kMaxBufferSize() / kMinBufferSize()) + 1;
+
+ private:
+  static_assert((kMinBufferSize() & (kMinBufferSize() - 1)) == 0,
+                "kMinBufferSize() must be a power of 2");
+  static_assert((kMaxBufferSize() & (kMaxBufferSize() - 1)) == 0,
+                "kMaxBufferSize() must be a power of 2");
+
+  // Bounds of memory held in free blocks of each size class.
+  static constexpr size_t kMaxThreadCacheBytes = size_t{128} << 10;
+  static constexpr size_t kMaxThreadCacheBlocks = 64;
+  static constexpr size_t kMaxSharedBytes = size_t{1} << 20;
+
+  struct ThreadCache {
+    ThreadCache() noexcept {}
+    ~ThreadCache();
+
+    std::vector<void*> free_blocks[kNumSizeClasses];
+  };
+
+  struct SharedFreeList {
+    absl::Mutex mutex;
+    std::vector<void*> free_blocks GUARDED_BY(mutex);
+  };
+
+  static size_t NumBytes(size_t size_class) {
+    return Block::kInternalAllocatedOffset() + Capacity(size_class);
+  }
+  static size_t MaxThreadCacheBlocks(size_t size_class) {
+    return UnsignedMax(
+        size_t{1},
+        UnsignedMin(kMaxThreadCacheBytes / Capacity(size_class),
+                    kMaxThreadCacheBlocks));
+  }
+  static size_t MaxSharedBlocks(size_t size_class) {
+    return kMaxSharedBytes / Capacity(size_class);
+  }
+
+  // Returns the cache of the current thread, or nullptr if the thread is
+  // exiting and its cache has already been destroyed.
+  static ThreadCache* thread_cache();
+  static SharedFreeList& shared_free_list(size_t size_class);
+
+  // Moves free blocks from the shared free list to *free_blocks, up to half of
+  // the thread cache capacity.
+  static void Refill(size_t size_class, std::vector<void*>* free_blocks);
+  // Moves free blocks from *free_blocks, starting from index begin, to the
+  // shared free list, freeing those which do not fit there.
+  static void Release(size_t size_class, std::vector<void*>* free_blocks,
+                      size_t begin);
+
+  static void* NewBlock(size_t size_class) {
+    return NewAligned<char, alignof(Block)>(NumBytes(size_class));
+  }
+  static void DeleteBlock(void* ptr, size_t size_class) {
+    DeleteAligned<char, alignof(Block)>(static_cast<char*>(ptr),
+                                        NumBytes(size_class));
+  }
+
+  static thread_local bool thread_cache_destroyed_;
+};
+
+constexpr size_t Chain::BlockPool::kNumSizeClasses;
+constexpr size_t Chain::BlockPool::kMaxThreadCacheBytes;
+constexpr size_t Chain::BlockPool::kMaxThreadCacheBlocks;
+constexpr size_t Chain::BlockPool::kMaxSharedBytes;
+
+thread_local bool Chain::BlockPool::thread_cache_destroyed_ = false;
+
+inline Chain::BlockPool::ThreadCache::~ThreadCache() {
+  for (size_t size_class = 0; size_class < kNumSizeClasses; ++size_class) {
+    Release(size_class, &free_blocks[size_class], 0);
+  }
+  thread_cache_destroyed_ = true;
+}
+
+inline size_t Chain::BlockPool::SizeClass(size_t capacity) {
+  if (capacity < kMinBufferSize() || capacity > kMaxBufferSize()) {
+    return kNumSizeClasses;
+  }
+  size_t size_class = 0;
+  while (Capacity(size_class) < capacity) ++size_class;
+  return size_class;
+}
+
+inline Chain::BlockPool::ThreadCache* Chain::BlockPool::thread_cache() {
+  if (ABSL_PREDICT_FALSE(thread_cache_destroyed_)) return nullptr;
+  static thread_local ThreadCache cache;
+  return &cache;
+}
+
+inline Chain::BlockPool::SharedFreeList& Chain::BlockPool::shared_free_list(
+    size_t size_class) {
+  static SharedFreeList* const kSharedFreeLists =
+      new SharedFreeList[kNumSizeClasses];
+  return kSharedFreeLists[size_class];
+}
+
+void Chain::BlockPool::Refill(size_t size_class,
+                              std::vector<void*>* free_blocks) {
+  SharedFreeList& shared = shared_free_list(size_class);
+  absl::MutexLock lock(&shared.mutex);
+  const size_t length =
+      UnsignedMin(shared.free_blocks.size(),
+                  UnsignedMax(size_t{1}, MaxThreadCacheBlocks(size_class) / 2));
+  free_blocks->insert(free_blocks->end(), shared.free_blocks.end() - length,
+                      shared.free_blocks.end());
+  shared.free_blocks.resize(shared.free_blocks.size() - length);
+}
+
+void Chain::BlockPool::Release(size_t size_class,
+                               std::vector<void*>* free_blocks, size_t begin) {
+  if (begin == free_blocks->size()) return;
+  {
+    SharedFreeList& shared = shared_free_list(size_class);
+    absl::MutexLock lock(&shared.mutex);
+    const size_t length = UnsignedMin(
+        free_blocks->size() - begin,
+        MaxSharedBlocks(size_class) -
+            UnsignedMin(shared.free_blocks.size(),
+                        MaxSharedBlocks(size_class)));
+    shared.free_blocks.insert(shared.free_blocks.end(),
+                              free_blocks->end() - length, free_blocks->end());
+    free_blocks->resize(free_blocks->size() - length);
+  }
+  for (size_t i = begin; i < free_blocks->size(); ++i) {
+    DeleteBlock((*free_blocks)[i], size_class);
+  }
+  free_blocks->resize(begin);
+}
+
+inline void* Chain::BlockPool::Allocate(size_t size_class) {
+  ThreadCache* const cache = thread_cache();
+  if (ABSL_PREDICT_FALSE(cache == nullptr)) return NewBlock(size_class);
+  std::vector<void*>& free_blocks = cache->free_blocks[size_class];
+  if (free_blocks.empty()) {
+    Refill(size_class, &free_blocks);
+    if (free_blocks.empty()) return NewBlock(size_class);
+  }
+  void* const ptr = free_blocks.back();
+  free_blocks.pop_back();
+  return ptr;
+}
+
+inline void Chain::BlockPool::Deallocate(void* ptr, size_t size_class) {
+  ThreadCache* const cache = thread_cache();
+  if (ABSL_PREDICT_FALSE(cache == nullptr)) {
+    DeleteBlock(ptr, size_class);
+    return;
+  }
+  std::vector<void*>& free_blocks = cache->free_blocks[size_class];
+  const size_t max_blocks = MaxThreadCacheBlocks(size_class);
+  if (free_blocks.size() == max_blocks) {
+    // Keep the first half of the cache, release the rest together.
+    Release(size_class, &free_blocks, max_blocks / 2);
+  }
+  if (free_blocks.capacity() < max_blocks) free_blocks.reserve(max_blocks);
+  free_blocks.push_back(ptr);
+}
+
+inline Chain::Block* Chain::Block::NewInternal(size_t capacity,
+                                                bool huge_pages) {
   RIEGELI_ASSERT_GT(capacity, 0u)
       << "Failed precondition of Chain::Block::NewInternal(): zero capacity";
   RIEGELI_CHECK_LE(capacity, Block::kMaxCapacity()) << "Out of memory";
-  return NewAligned<Block>(kInternalAllocatedOffset() + capacity, capacity, 0);
+  const size_t size_class = BlockPool::SizeClass(capacity);
+  if (size_class < BlockPool::kNumSizeClasses) {
+    return new (BlockPool::Allocate(size_class))
+        Block(BlockPool::Capacity(size_class), 0);
+  }
+  Block* const block =
+      NewAligned<Block>(kInternalAllocatedOffset() + capacity, capacity, 0);
+  if (huge_pages) AdviseHugePages(block->allocated_begin_, capacity);
+  return block;
 }
 
-inline Chain::Block* Chain::Block::NewInternalForPrepend(size_t capacity) {
+inline Chain::Block* Chain::Block::NewInternalForPrepend(size_t capacity,
+                                                          bool huge_pages) {
   RIEGELI_ASSERT_GT(capacity, 0u)
       << "Failed precondition of Chain::Block::NewInternalForPrepend(): zero "
          "capacity";
   RIEGELI_CHECK_LE(capacity, Block::kMaxCapacity()) << "Out of memory";
-  return NewAligned<Block>(kInternalAllocatedOffset() + capacity, capacity,
-                           capacity);
+  const size_t size_class = BlockPool::SizeClass(capacity);
+  if (size_class < BlockPool::kNumSizeClasses) {
+    return new (BlockPool::Allocate(size_class))
+        Block(BlockPool::Capacity(size_class), BlockPool::Capacity(size_class));
+  }
+  Block* const block = NewAligned<Block>(kInternalAllocatedOffset() + capacity,
+                                         capacity, capacity);
+  if (huge_pages) AdviseHugePages(block->allocated_begin_, capacity);
+  return block;
 }
 
 inline Chain::Block::Block(size_t capacity, size_t space_before)
@@ -172,7 +440,13 @@ inline void Chain::Block::Unref() {
   if (has_unique_owner() ||
       ref_count_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
     if (is_internal()) {
-      DeleteAligned<Block>(this, kInternalAllocatedOffset() + capacity());
+      const size_t size_class = BlockPool::SizeClass(capacity());
+      if (size_class < BlockPool::kNumSizeClasses) {
+        this->~Block();
+        BlockPool::Deallocate(this, size_class);
+      } else {
+        DeleteAligned<Block>(this, kInternalAllocatedOffset() + capacity());
+      }
     } else {
       external_.methods->delete_block(this);
     }
@@ -354,15 +628,15 @@ inline void Chain::Block::Prepend(absl::string_view src) {
   data_ = absl::string_view(data_begin() - src.size(), size() + src.size());
 }
 
-inline void Chain::Block::AppendTo(Chain* dest, size_t size_hint) {
+inline void Chain::Block::AppendTo(Chain* dest, const Options& options) {
   RIEGELI_CHECK_LE(size(), std::numeric_limits<size_t>::max() - dest->size())
       << "Failed precondition of Chain::Block::AppendTo(Chain*): "
          "Chain size overflow";
-  dest->AppendBlock(this, size_hint);
+  dest->AppendBlock(this, options);
 }
 
 inline void Chain::Block::AppendSubstrTo(absl::string_view substr, Chain* dest,
-                                         size_t size_hint) {
+                                         const Options& options) {
   RIEGELI_ASSERT(substr.data() >= data_begin())
       << "Failed precondition of Chain::Block::AppendSubstrTo(Chain*): "
          "substring not contained in data";
@@ -374,14 +648,14 @@ inline void Chain::Block::AppendSubstrTo(absl::string_view substr, Chain* dest,
       << "Failed precondition of Chain::Block::AppendSubstrTo(Chain*): "
          "Chain size overflow";
   if (substr.size() == size()) {
-    dest->AppendBlock(this, size_hint);
+    dest->AppendBlock(this, options);
     return;
   }
   if (substr.size() <= kMaxBytesToCopy()) {
-    dest->Append(substr, size_hint);
+    dest->Append(substr, options);
     return;
   }
-  dest->AppendExternal(BlockRef(this, true), substr, size_hint);
+  dest->AppendExternal(BlockRef(this, true), substr, options);
 }
 
 Chain::Block* const Chain::BlockIterator::kShortData[1] = {nullptr};
@@ -411,7 +685,7 @@ void Chain::BlockIterator::AppendTo(Chain* dest, size_t size_hint) const {
   if (ABSL_PREDICT_FALSE(ptr_ == kBeginShortData())) {
     dest->Append(chain_->short_data(), size_hint);
   } else {
-    (*ptr_)->AppendTo(dest, size_hint);
+    (*ptr_)->AppendTo(dest, Options().set_size_hint(size_hint));
   }
 }
 
@@ -423,7 +697,7 @@ void Chain::BlockIterator::AppendSubstrTo(absl::string_view substr, Chain* dest,
   if (ABSL_PREDICT_FALSE(ptr_ == kBeginShortData())) {
     dest->Append(substr);
   } else {
-    (*ptr_)->AppendSubstrTo(substr, dest, size_hint);
+    (*ptr_)->AppendSubstrTo(substr, dest, Options().set_size_hint(size_hint));
   }
 }
 
@@ -810,7 +1084,7 @@ inline void Chain::ReserveFrontSlow(size_t extra_capacity) {
 }
 
 inline size_t Chain::NewBlockCapacity(size_t replaced_size, size_t new_size,
-                                      size_t size_hint) const {
+                                      const Options& options) const {
   constexpr size_t kGranularity = 16;
   RIEGELI_ASSERT_LE(replaced_size, size_)
       << "Failed precondition of Chain::NewBlockCapacity(): "
@@ -822,13 +1096,14 @@ inline size_t Chain::NewBlockCapacity(size_t replaced_size, size_t new_size,
   const size_t size_before = size_ - replaced_size;
   return RoundUp<kGranularity>(UnsignedMax(
       replaced_size + new_size,
-      UnsignedMin(size_before < size_hint
-                      ? size_hint - size_before
-                      : UnsignedMax(kMinBufferSize(), size_before / 2),
-                  kMaxBufferSize())));
+      UnsignedMin(size_before < options.size_hint()
+                      ? options.size_hint() - size_before
+                      : UnsignedMax(options.min_block_size(), size_before / 2),
+                  options.max_block_size())));
 }
 
-absl::Span<char> Chain::MakeAppendBuffer(size_t min_length, size_t size_hint) {
+absl::Span<char> Chain::MakeAppendBuffer(size_t min_length,
+                                         const Options& options) {
   RIEGELI_CHECK_LE(min_length, std::numeric_limits<size_t>::max() - size())
       << "Failed precondition of Chain::MakeAppendBuffer(): "
          "Chain size overflow";
@@ -849,11 +1124,14 @@ absl::Span<char> Chain::MakeAppendBuffer(size_t min_length, size_t size_hint) {
       block = Block::NewInternal(kMaxShortDataSize);
       block->AppendWithExplicitSizeToCopy(short_data(), kMaxShortDataSize);
       PushBack(block);
-      block = Block::NewInternal(NewBlockCapacity(0, min_length, size_hint));
+      block = Block::NewInternal(NewBlockCapacity(0, min_length, options),
+                                 options.huge_pages());
     } else {
-      block = Block::NewInternal(NewBlockCapacity(
-          size_, UnsignedMax(min_length, kMaxShortDataSize - size_),
-          size_hint));
+      block = Block::NewInternal(
+          NewBlockCapacity(size_,
+                           UnsignedMax(min_length, kMaxShortDataSize - size_),
+                           options),
+          options.huge_pages());
       block->AppendWithExplicitSizeToCopy(short_data(), kMaxShortDataSize);
     }
     PushBack(block);
@@ -874,14 +1152,16 @@ absl::Span<char> Chain::MakeAppendBuffer(size_t min_length, size_t size_hint) {
         goto new_block;
       }
       block = Block::NewInternal(
-          NewBlockCapacity(last->size(), min_length, size_hint));
+          NewBlockCapacity(last->size(), min_length, options),
+          options.huge_pages());
       block->Append(last->data());
       last->Unref();
       back() = block;
     } else {
     new_block:
       // Append a new block.
-      block = Block::NewInternal(NewBlockCapacity(0, min_length, size_hint));
+      block = Block::NewInternal(NewBlockCapacity(0, min_length, options),
+                                 options.huge_pages());
       PushBack(block);
     }
   }
@@ -893,7 +1173,8 @@ absl::Span<char> Chain::MakeAppendBuffer(size_t min_length, size_t size_hint) {
   return buffer;
 }
 
-absl::Span<char> Chain::MakePrependBuffer(size_t min_length, size_t size_hint) {
+absl::Span<char> Chain::MakePrependBuffer(size_t min_length,
+                                          const Options& options) {
   RIEGELI_CHECK_LE(min_length, std::numeric_limits<size_t>::max() - size())
       << "Failed precondition of Chain::MakePrependBuffer(): "
          "Chain size overflow";
@@ -917,10 +1198,12 @@ absl::Span<char> Chain::MakePrependBuffer(size_t min_length, size_t size_hint) {
       block->AppendWithExplicitSizeToCopy(short_data(), kMaxShortDataSize);
       PushFront(block);
       block = Block::NewInternalForPrepend(
-          NewBlockCapacity(0, min_length, size_hint));
+          NewBlockCapacity(0, min_length, options),
+          options.huge_pages());
     } else {
       block = Block::NewInternalForPrepend(
-          NewBlockCapacity(size_, min_length, size_hint));
+          NewBlockCapacity(size_, min_length, options),
+          options.huge_pages());
       block->Prepend(short_data());
     }
     PushFront(block);
@@ -941,7 +1224,8 @@ absl::Span<char> Chain::MakePrependBuffer(size_t min_length, size_t size_hint) {
         goto new_block;
       }
       block = Block::NewInternalForPrepend(
-          NewBlockCapacity(first->size(), min_length, size_hint));
+          NewBlockCapacity(first->size(), min_length, options),
+          options.huge_pages());
       block->Prepend(first->data());
       first->Unref();
       front() = block;
@@ -949,7 +1233,8 @@ absl::Span<char> Chain::MakePrependBuffer(size_t min_length, size_t size_hint) {
     new_block:
       // Prepend a new block.
       block = Block::NewInternalForPrepend(
-          NewBlockCapacity(0, min_length, size_hint));
+          NewBlockCapacity(0, min_length, options),
+          options.huge_pages());
       PushFront(block);
     }
   }
@@ -961,7 +1246,7 @@ absl::Span<char> Chain::MakePrependBuffer(size_t min_length, size_t size_hint) {
   return buffer;
 }
 
-void Chain::Append(absl::string_view src, size_t size_hint) {
+void Chain::Append(absl::string_view src, const Options& options) {
   RIEGELI_CHECK_LE(src.size(), std::numeric_limits<size_t>::max() - size_)
       << "Failed precondition of Chain::Append(string_view): "
          "Chain size overflow";
@@ -982,11 +1267,14 @@ void Chain::Append(absl::string_view src, size_t size_hint) {
       block = Block::NewInternal(kMaxShortDataSize);
       block->AppendWithExplicitSizeToCopy(short_data(), kMaxShortDataSize);
       PushBack(block);
-      block = Block::NewInternal(NewBlockCapacity(0, src.size(), size_hint));
+      block = Block::NewInternal(NewBlockCapacity(0, src.size(), options),
+                                 options.huge_pages());
     } else {
-      block = Block::NewInternal(NewBlockCapacity(
-          size_, UnsignedMax(src.size(), kMaxShortDataSize - size_),
-          size_hint));
+      block = Block::NewInternal(
+          NewBlockCapacity(size_,
+                           UnsignedMax(src.size(), kMaxShortDataSize - size_),
+                           options),
+          options.huge_pages());
       block->AppendWithExplicitSizeToCopy(short_data(), kMaxShortDataSize);
     }
     PushBack(block);
@@ -1006,7 +1294,8 @@ void Chain::Append(absl::string_view src, size_t size_hint) {
           goto new_block;
         }
         block = Block::NewInternal(
-            NewBlockCapacity(last->size(), src.size(), size_hint));
+            NewBlockCapacity(last->size(), src.size(), options),
+            options.huge_pages());
         block->Append(last->data());
         last->Unref();
         back() = block;
@@ -1018,7 +1307,8 @@ void Chain::Append(absl::string_view src, size_t size_hint) {
         }
       new_block:
         // Append a new block.
-        block = Block::NewInternal(NewBlockCapacity(0, src.size(), size_hint));
+        block = Block::NewInternal(NewBlockCapacity(0, src.size(), options),
+                                   options.huge_pages());
         PushBack(block);
       }
     }
@@ -1027,19 +1317,27 @@ void Chain::Append(absl::string_view src, size_t size_hint) {
   size_ += src.size();
 }
 
-void Chain::Append(std::string&& src, size_t size_hint) {
+void Chain::Append(std::string&& src, const Options& options) {
   RIEGELI_CHECK_LE(src.size(), std::numeric_limits<size_t>::max() - size_)
       << "Failed precondition of Chain::Append(string&&): "
          "Chain size overflow";
-  AppendExternal(StringRef(std::move(src)), size_hint);
+  AppendExternal(StringRef(std::move(src)), options);
+}
+
+void Chain::AppendShared(std::shared_ptr<const void> owner,
+                         absl::string_view data, const Options& options) {
+  RIEGELI_CHECK_LE(data.size(), std::numeric_limits<size_t>::max() - size_)
+      << "Failed precondition of Chain::AppendShared(): "
+         "Chain size overflow";
+  AppendExternal(SharedRef(std::move(owner)), data, options);
 }
 
-void Chain::Append(const Chain& src, size_t size_hint) {
+void Chain::Append(const Chain& src, const Options& options) {
   RIEGELI_CHECK_LE(src.size(), std::numeric_limits<size_t>::max() - size_)
       << "Failed precondition of Chain::Append(Chain): "
          "Chain size overflow";
   if (src.begin_ == src.end_) {
-    Append(src.short_data(), size_hint);
+    Append(src.short_data(), options);
     return;
   }
   Block* const* src_iter = src.begin_;
@@ -1060,7 +1358,7 @@ void Chain::Append(const Chain& src, size_t size_hint) {
                 ? NewBlockCapacity(
                       size_,
                       UnsignedMax(src_first->size(), kMaxShortDataSize - size_),
-                      size_hint)
+                      options)
                 : UnsignedMax(size_ + src_first->size(), kMaxShortDataSize);
         Block* const merged = Block::NewInternal(capacity);
         merged->AppendWithExplicitSizeToCopy(short_data(), kMaxShortDataSize);
@@ -1099,7 +1397,7 @@ void Chain::Append(const Chain& src, size_t size_hint) {
                "Block::kMaxCapacity()";
         const size_t capacity =
             src.end_ - src.begin_ == 1
-                ? NewBlockCapacity(last->size(), src_first->size(), size_hint)
+                ? NewBlockCapacity(last->size(), src_first->size(), options)
                 : last->size() + src_first->size();
         Block* const merged = Block::NewInternal(capacity);
         merged->Append(last->data());
@@ -1154,12 +1452,12 @@ void Chain::Append(const Chain& src, size_t size_hint) {
   size_ += src.size_;
 }
 
-void Chain::Append(Chain&& src, size_t size_hint) {
+void Chain::Append(Chain&& src, const Options& options) {
   RIEGELI_CHECK_LE(src.size(), std::numeric_limits<size_t>::max() - size_)
       << "Failed precondition of Chain::Append(Chain&&): "
          "Chain size overflow";
   if (src.begin_ == src.end_) {
-    Append(src.short_data(), size_hint);
+    Append(src.short_data(), options);
     return;
   }
   Block* const* src_iter = src.begin_;
@@ -1180,7 +1478,7 @@ void Chain::Append(Chain&& src, size_t size_hint) {
                 ? NewBlockCapacity(
                       size_,
                       UnsignedMax(src_first->size(), kMaxShortDataSize - size_),
-                      size_hint)
+                      options)
                 : UnsignedMax(size_ + src_first->size(), kMaxShortDataSize);
         Block* const merged = Block::NewInternal(capacity);
         merged->AppendWithExplicitSizeToCopy(short_data(), kMaxShortDataSize);
@@ -1219,7 +1517,7 @@ void Chain::Append(Chain&& src, size_t size_hint) {
                "Block::kMaxCapacity()";
         const size_t capacity =
             src.end_ - src.begin_ == 1
-                ? NewBlockCapacity(last->size(), src_first->size(), size_hint)
+                ? NewBlockCapacity(last->size(), src_first->size(), options)
                 : last->size() + src_first->size();
         Block* const merged = Block::NewInternal(capacity);
         merged->Append(last->data());
@@ -1276,7 +1574,7 @@ void Chain::Append(Chain&& src, size_t size_hint) {
   src.size_ = 0;
 }
 
-void Chain::Prepend(absl::string_view src, size_t size_hint) {
+void Chain::Prepend(absl::string_view src, const Options& options) {
   RIEGELI_CHECK_LE(src.size(), std::numeric_limits<size_t>::max() - size_)
       << "Failed precondition of Chain::Prepend(string_view): "
          "Chain size overflow";
@@ -1300,10 +1598,12 @@ void Chain::Prepend(absl::string_view src, size_t size_hint) {
       block->AppendWithExplicitSizeToCopy(short_data(), kMaxShortDataSize);
       PushFront(block);
       block = Block::NewInternalForPrepend(
-          NewBlockCapacity(0, src.size(), size_hint));
+          NewBlockCapacity(0, src.size(), options),
+          options.huge_pages());
     } else {
       block = Block::NewInternalForPrepend(
-          NewBlockCapacity(size_, src.size(), size_hint));
+          NewBlockCapacity(size_, src.size(), options),
+          options.huge_pages());
       block->Prepend(short_data());
     }
     PushFront(block);
@@ -1323,7 +1623,8 @@ void Chain::Prepend(absl::string_view src, size_t size_hint) {
           goto new_block;
         }
         block = Block::NewInternalForPrepend(
-            NewBlockCapacity(first->size(), src.size(), size_hint));
+            NewBlockCapacity(first->size(), src.size(), options),
+            options.huge_pages());
         block->Prepend(first->data());
         first->Unref();
         front() = block;
@@ -1336,7 +1637,8 @@ void Chain::Prepend(absl::string_view src, size_t size_hint) {
       new_block:
         // Prepend a new block.
         block = Block::NewInternalForPrepend(
-            NewBlockCapacity(0, src.size(), size_hint));
+            NewBlockCapacity(0, src.size(), options),
+            options.huge_pages());
         PushFront(block);
       }
     }
@@ -1345,19 +1647,27 @@ void Chain::Prepend(absl::string_view src, size_t size_hint) {
   size_ += src.size();
 }
 
-void Chain::Prepend(std::string&& src, size_t size_hint) {
+void Chain::Prepend(std::string&& src, const Options& options) {
   RIEGELI_CHECK_LE(src.size(), std::numeric_limits<size_t>::max() - size_)
       << "Failed precondition of Chain::Prepend(string&&): "
          "Chain size overflow";
-  PrependExternal(StringRef(std::move(src)), size_hint);
+  PrependExternal(StringRef(std::move(src)), options);
+}
+
+void Chain::PrependShared(std::shared_ptr<const void> owner,
+                          absl::string_view data, const Options& options) {
+  RIEGELI_CHECK_LE(data.size(), std::numeric_limits<size_t>::max() - size_)
+      << "Failed precondition of Chain::PrependShared(): "
+         "Chain size overflow";
+  PrependExternal(SharedRef(std::move(owner)), data, options);
 }
 
-void Chain::Prepend(const Chain& src, size_t size_hint) {
+void Chain::Prepend(const Chain& src, const Options& options) {
   RIEGELI_CHECK_LE(src.size(), std::numeric_limits<size_t>::max() - size_)
       << "Failed precondition of Chain::Prepend(Chain): "
          "Chain size overflow";
   if (src.begin_ == src.end_) {
-    Prepend(src.short_data(), size_hint);
+    Prepend(src.short_data(), options);
     return;
   }
   Block* const* src_iter = src.end_;
@@ -1375,7 +1685,7 @@ void Chain::Prepend(const Chain& src, size_t size_hint) {
                "exceeds Block::kMaxCapacity()";
         const size_t capacity =
             src.end_ - src.begin_ == 1
-                ? NewBlockCapacity(size_, src_last->size(), size_hint)
+                ? NewBlockCapacity(size_, src_last->size(), options)
                 : size_ + src_last->size();
         Block* const merged = Block::NewInternalForPrepend(capacity);
         merged->Prepend(short_data());
@@ -1414,7 +1724,7 @@ void Chain::Prepend(const Chain& src, size_t size_hint) {
                "Block::kMaxCapacity()";
         const size_t capacity =
             src.end_ - src.begin_ == 1
-                ? NewBlockCapacity(first->size(), src_last->size(), size_hint)
+                ? NewBlockCapacity(first->size(), src_last->size(), options)
                 : first->size() + src_last->size();
         Block* const merged = Block::NewInternalForPrepend(capacity);
         merged->Prepend(first->data());
@@ -1469,12 +1779,12 @@ void Chain::Prepend(const Chain& src, size_t size_hint) {
   size_ += src.size_;
 }
 
-void Chain::Prepend(Chain&& src, size_t size_hint) {
+void Chain::Prepend(Chain&& src, const Options& options) {
   RIEGELI_CHECK_LE(src.size(), std::numeric_limits<size_t>::max() - size_)
       << "Failed precondition of Chain::Prepend(Chain&&): "
          "Chain size overflow";
   if (src.begin_ == src.end_) {
-    Prepend(src.short_data(), size_hint);
+    Prepend(src.short_data(), options);
     return;
   }
   Block* const* src_iter = src.end_;
@@ -1492,7 +1802,7 @@ void Chain::Prepend(Chain&& src, size_t size_hint) {
                "exceeds Block::kMaxCapacity()";
         const size_t capacity =
             src.end_ - src.begin_ == 1
-                ? NewBlockCapacity(size_, src_last->size(), size_hint)
+                ? NewBlockCapacity(size_, src_last->size(), options)
                 : size_ + src_last->size();
         Block* const merged = Block::NewInternalForPrepend(capacity);
         merged->Prepend(short_data());
@@ -1531,7 +1841,7 @@ void Chain::Prepend(Chain&& src, size_t size_hint) {
                "Block::kMaxCapacity()";
         const size_t capacity =
             src.end_ - src.begin_ == 1
-                ? NewBlockCapacity(first->size(), src_last->size(), size_hint)
+                ? NewBlockCapacity(first->size(), src_last->size(), options)
                 : first->size() + src_last->size();
         Block* const merged = Block::NewInternalForPrepend(capacity);
         merged->Prepend(first->data());
@@ -1588,7 +1898,7 @@ void Chain::Prepend(Chain&& src, size_t size_hint) {
   src.size_ = 0;
 }
 
-inline void Chain::AppendBlock(Block* block, size_t size_hint) {
+inline void Chain::AppendBlock(Block* block, const Options& options) {
   RIEGELI_ASSERT_LE(block->size(), std::numeric_limits<size_t>::max() - size_)
       << "Failed precondition of Chain::AppendBlock(): "
          "Chain size overflow";
@@ -1601,7 +1911,7 @@ inline void Chain::AppendBlock(Block* block, size_t size_hint) {
              "Block::kMaxCapacity()";
       const size_t capacity = NewBlockCapacity(
           size_, UnsignedMax(block->size(), kMaxShortDataSize - size_),
-          size_hint);
+          options);
       Block* const merged = Block::NewInternal(capacity);
       merged->AppendWithExplicitSizeToCopy(short_data(), kMaxShortDataSize);
       merged->Append(block->data());
@@ -1630,7 +1940,8 @@ inline void Chain::AppendBlock(Block* block, size_t size_hint) {
         RIEGELI_ASSERT_LE(block->size(), Block::kMaxCapacity() - last->size())
             << "Sum of sizes of two tiny blocks exceeds Block::kMaxCapacity()";
         Block* const merged = Block::NewInternal(
-            NewBlockCapacity(last->size(), block->size(), size_hint));
+            NewBlockCapacity(last->size(), block->size(), options),
+            options.huge_pages());
         merged->Append(last->data());
         merged->Append(block->data());
         last->Unref();
@@ -1667,12 +1978,12 @@ inline void Chain::AppendBlock(Block* block, size_t size_hint) {
 
 void Chain::RawAppendExternal(Block* (*new_block)(void*, absl::string_view),
                               void* object, absl::string_view data,
-                              size_t size_hint) {
+                              const Options& options) {
   RIEGELI_CHECK_LE(data.size(), std::numeric_limits<size_t>::max() - size_)
       << "Failed precondition of Chain::AppendExternal(): "
          "Chain size overflow";
   if (data.size() <= kMaxBytesToCopy()) {
-    Append(data, size_hint);
+    Append(data, options);
     return;
   }
   if (begin_ == end_) {
@@ -1711,12 +2022,12 @@ void Chain::RawAppendExternal(Block* (*new_block)(void*, absl::string_view),
 
 void Chain::RawPrependExternal(Block* (*new_block)(void*, absl::string_view),
                                void* object, absl::string_view data,
-                               size_t size_hint) {
+                               const Options& options) {
   RIEGELI_CHECK_LE(data.size(), std::numeric_limits<size_t>::max() - size_)
       << "Failed precondition of Chain::PrependExternal(): "
          "Chain size overflow";
   if (data.size() <= kMaxBytesToCopy()) {
-    Prepend(data, size_hint);
+    Prepend(data, options);
     return;
   }
   if (begin_ == end_) {
@@ -1757,9 +2068,6 @@ void Chain::RemoveSuffixSlow(size_t length, size_t size_hint) {
   RIEGELI_ASSERT_GT(length, 0u)
       << "Failed precondition of Chain::RemoveSuffixSlow(): "
          "zero length, use RemoveSuffix() instead";
-  RIEGELI_CHECK_LE(length, size())
-      << "Failed precondition of Chain::RemoveSuffixSlow(): "
-      << "length to remove greater than current size";
   RIEGELI_ASSERT(begin_ != end_)
       << "Failed precondition of Chain::RemoveSuffixSlow(): "
          "no blocks, use RemoveSuffix() instead";
@@ -1799,9 +2107,6 @@ void Chain::RemovePrefixSlow(size_t length, size_t size_hint) {
   RIEGELI_ASSERT_GT(length, 0u)
       << "Failed precondition of Chain::RemovePrefixSlow(): "
          "zero length, use RemovePrefix() instead";
-  RIEGELI_CHECK_LE(length, size())
-      << "Failed precondition of Chain::RemovePrefixSlow(): "
-      << "length to remove greater than current size";
   RIEGELI_ASSERT(begin_ != end_)
       << "Failed precondition of Chain::RemovePrefixSlow(): "
          "no blocks, use RemovePrefix() instead";
@@ -45,7 +45,8 @@ namespace riegeli {
 //
 // Any parameter named size_hint announces in advance the eventual Chain size.
 // Providing it may reduce Chain memory usage. If the size hint turns out to not
-// match reality, nothing breaks.
+// match reality, nothing breaks. Functions which allocate blocks can be given
+// Options instead, which also tune sizes of allocated blocks.
 //
 // A Chain is implemented with a sequence of blocks holding flat data fragments.
 class Chain {
@@ -54,6 +55,88 @@ class Chain {
   class BlockIterator;
   struct PinnedBlock;
 
+  class Options {
+   public:
+    // Not defaulted because of a C++ defect:
+    // https://stackoverflow.com/questions/17430377
+    constexpr Options() noexcept {}
+
+    // Announces in advance the eventual Chain size. This may reduce Chain
+    // memory usage.
+    //
+    // If the size hint turns out to not match reality, nothing breaks.
+    //
+    // Default: 0
+    Options& set_size_hint(size_t size_hint) & {
+      size_hint_ = size_hint;
+      return *this;
+    }
+    Options&& set_size_hint(size_t size_hint) && {
+      return std::move(set_size_hint(size_hint));
+    }
+    size_t size_hint() const { return size_hint_; }
+
+    // Minimal size of a newly allocated block, used while the Chain is small.
+    //
+    // Default: kDefaultMinBlockSize() (128)
+    static constexpr size_t kDefaultMinBlockSize() { return 128; }
+    Options& set_min_block_size(size_t min_block_size) & {
+      RIEGELI_ASSERT_GT(min_block_size, 0u)
+          << "Failed precondition of Chain::Options::set_min_block_size(): "
+             "zero block size";
+      min_block_size_ = min_block_size;
+      return *this;
+    }
+    Options&& set_min_block_size(size_t min_block_size) && {
+      return std::move(set_min_block_size(min_block_size));
+    }
+    size_t min_block_size() const { return min_block_size_; }
+
+    // Maximal size of a newly allocated block, reached when the Chain is large.
+    // Larger blocks make iteration and hashing faster, at the cost of
+    // allocating more memory ahead of data.
+    //
+    // This does not limit blocks appended from other Chains or external
+    // objects, nor blocks holding data longer than this which are appended at
+    // once.
+    //
+    // Default: kDefaultMaxBlockSize() (64K)
+    static constexpr size_t kDefaultMaxBlockSize() { return size_t{64} << 10; }
+    Options& set_max_block_size(size_t max_block_size) & {
+      RIEGELI_ASSERT_GT(max_block_size, 0u)
+          << "Failed precondition of Chain::Options::set_max_block_size(): "
+             "zero block size";
+      max_block_size_ = max_block_size;
+      return *this;
+    }
+    Options&& set_max_block_size(size_t max_block_size) && {
+      return std::move(set_max_block_size(max_block_size));
+    }
+    size_t max_block_size() const { return max_block_size_; }
+
+    // If true, newly allocated blocks of at least 2M are advised to be backed
+    // by transparent huge pages with madvise(MADV_HUGEPAGE), where supported.
+    // This reduces TLB misses when large blocks are scanned repeatedly, at the
+    // cost of memory usage and latency of page faults which can allocate whole
+    // huge pages.
+    //
+    // Default: false
+    Options& set_huge_pages(bool huge_pages) & {
+      huge_pages_ = huge_pages;
+      return *this;
+    }
+    Options&& set_huge_pages(bool huge_pages) && {
+      return std::move(set_huge_pages(huge_pages));
+    }
+    bool huge_pages() const { return huge_pages_; }
+
+   private:
+    size_t size_hint_ = 0;
+    size_t min_block_size_ = kDefaultMinBlockSize();
+    size_t max_block_size_ = kDefaultMaxBlockSize();
+    bool huge_pages_ = false;
+  };
+
   constexpr Chain() noexcept {}
 
   explicit Chain(absl::string_view src);
@@ -99,19 +182,29 @@ class Chain {
   // Use RemoveSuffix()/RemovePrefix() afterwards to trim excessive size.
   absl::Span<char> MakeAppendBuffer(size_t min_length = 0,
                                     size_t size_hint = 0);
+  absl::Span<char> MakeAppendBuffer(size_t min_length, const Options& options);
   absl::Span<char> MakePrependBuffer(size_t min_length = 0,
                                      size_t size_hint = 0);
+  absl::Span<char> MakePrependBuffer(size_t min_length, const Options& options);
 
   void Append(absl::string_view src, size_t size_hint = 0);
+  void Append(absl::string_view src, const Options& options);
   void Append(std::string&& src, size_t size_hint = 0);
+  void Append(std::string&& src, const Options& options);
   void Append(const char* src, size_t size_hint = 0);
   void Append(const Chain& src, size_t size_hint = 0);
+  void Append(const Chain& src, const Options& options);
   void Append(Chain&& src, size_t size_hint = 0);
+  void Append(Chain&& src, const Options& options);
   void Prepend(absl::string_view src, size_t size_hint = 0);
+  void Prepend(absl::string_view src, const Options& options);
   void Prepend(std::string&& src, size_t size_hint = 0);
+  void Prepend(std::string&& src, const Options& options);
   void Prepend(const char* src, size_t size_hint = 0);
   void Prepend(const Chain& src, size_t size_hint = 0);
+  void Prepend(const Chain& src, const Options& options);
   void Prepend(Chain&& src, size_t size_hint = 0);
+  void Prepend(Chain&& src, const Options& options);
 
   // Given an object which represents a string, appends/prepends it by attaching
   // the moved object, avoiding copying the string data.
@@ -145,11 +238,47 @@ class Chain {
   template <typename T>
   void AppendExternal(T object, size_t size_hint = 0);
   template <typename T>
+  void AppendExternal(T object, const Options& options);
+  template <typename T>
   void AppendExternal(T object, absl::string_view data, size_t size_hint = 0);
   template <typename T>
+  void AppendExternal(T object, absl::string_view data,
+                      const Options& options);
+  template <typename T>
   void PrependExternal(T object, size_t size_hint = 0);
   template <typename T>
+  void PrependExternal(T object, const Options& options);
+  template <typename T>
   void PrependExternal(T object, absl::string_view data, size_t size_hint = 0);
+  template <typename T>
+  void PrependExternal(T object, absl::string_view data,
+                       const Options& options);
+
+  // Appends/prepends data owned by an object shared through std::shared_ptr,
+  // avoiding copying the data. The object (actually the last reference to it
+  // held by Chains) is released when no Chain refers to data any longer.
+  //
+  // This is the way to import a buffer owned elsewhere, e.g. a received network
+  // message, or memory of a foreign string type whose owner can be wrapped in
+  // a std::shared_ptr with a custom deleter. data must remain valid and
+  // unchanged while owner is alive.
+  //
+  // In the opposite direction, blocks() exposes the data as fragments without
+  // copying, e.g. to fill a struct iovec array for writev(). The fragments
+  // remain valid while the Chain is not modified; to keep them alive longer,
+  // keep a copy of the Chain (which shares blocks rather than copying data), or
+  // use BlockIterator::Pin().
+  //
+  // AppendShared()/PrependShared() can decide to copy data instead, like
+  // AppendExternal()/PrependExternal().
+  void AppendShared(std::shared_ptr<const void> owner, absl::string_view data,
+                    size_t size_hint = 0);
+  void AppendShared(std::shared_ptr<const void> owner, absl::string_view data,
+                    const Options& options);
+  void PrependShared(std::shared_ptr<const void> owner, absl::string_view data,
+                     size_t size_hint = 0);
+  void PrependShared(std::shared_ptr<const void> owner, absl::string_view data,
+                     const Options& options);
 
   void RemoveSuffix(size_t length, size_t size_hint = 0);
   void RemovePrefix(size_t length, size_t size_hint = 0);
@@ -164,7 +293,9 @@ class Chain {
   template <typename T>
   struct ExternalMethodsFor;
   class Block;
+  class BlockPool;
   class BlockRef;
+  class SharedRef;
   class StringRef;
 
   struct Empty {};
@@ -197,8 +328,12 @@ class Chain {
     Allocated allocated;
   };
 
-  static constexpr size_t kMinBufferSize() { return 128; }
-  static constexpr size_t kMaxBufferSize() { return size_t{64} << 10; }
+  static constexpr size_t kMinBufferSize() {
+    return Options::kDefaultMinBlockSize();
+  }
+  static constexpr size_t kMaxBufferSize() {
+    return Options::kDefaultMaxBlockSize();
+  }
   static constexpr size_t kAllocationCost() { return 256; }
 
   bool has_here() const { return begin_ == block_ptrs_.here; }
@@ -241,16 +376,16 @@ class Chain {
   // If replaced_size > 0, the block will replace an existing block of that
   // size. It requires the capacity of new_size in addition to replaced_size.
   size_t NewBlockCapacity(size_t replaced_size, size_t new_size,
-                          size_t size_hint) const;
+                          const Options& options) const;
 
-  void AppendBlock(Block* block, size_t size_hint);
+  void AppendBlock(Block* block, const Options& options);
 
   void RawAppendExternal(Block* (*new_block)(void*, absl::string_view),
                          void* object, absl::string_view data,
-                         size_t size_hint);
+                         const Options& options);
   void RawPrependExternal(Block* (*new_block)(void*, absl::string_view),
                           void* object, absl::string_view data,
-                          size_t size_hint);
+                          const Options& options);
 
   void RemoveSuffixSlow(size_t length, size_t size_hint);
   void RemovePrefixSlow(size_t length, size_t size_hint);
@@ -463,10 +598,17 @@ class Chain::Block {
   static constexpr size_t kMaxCapacity();
 
   // Creates an internal block for appending.
-  static Block* NewInternal(size_t capacity);
+  //
+  // If huge_pages is true, a large block is advised to be backed by
+  // transparent huge pages (see Options::set_huge_pages()).
+  static Block* NewInternal(size_t capacity, bool huge_pages = false);
 
   // Creates an internal block for prepending.
-  static Block* NewInternalForPrepend(size_t capacity);
+  //
+  // If huge_pages is true, a large block is advised to be backed by
+  // transparent huge pages (see Options::set_huge_pages()).
+  static Block* NewInternalForPrepend(size_t capacity,
+                                      bool huge_pages = false);
 
   // Constructs an internal block. This constructor is public for NewAligned().
   Block(size_t capacity, size_t space_before);
@@ -542,13 +684,15 @@ class Chain::Block {
   bool TryRemoveSuffix(size_t length);
   bool TryRemovePrefix(size_t length);
 
-  void AppendTo(Chain* dest, size_t size_hint);
+  void AppendTo(Chain* dest, const Options& options);
 
-  void AppendSubstrTo(absl::string_view substr, Chain* dest, size_t size_hint);
+  void AppendSubstrTo(absl::string_view substr, Chain* dest,
+                      const Options& options);
 
  private:
   template <typename T>
   friend struct ExternalMethodsFor;
+  friend class BlockPool;
 
   struct External {
     // Type-erased methods of the object.
@@ -1065,37 +1209,111 @@ inline void Chain::UnrefBlocks(Block* const* begin, Block* const* end) {
 
 inline Chain::Blocks Chain::blocks() const { return Blocks(this); }
 
+inline absl::Span<char> Chain::MakeAppendBuffer(size_t min_length,
+                                                size_t size_hint) {
+  return MakeAppendBuffer(min_length, Options().set_size_hint(size_hint));
+}
+
+inline absl::Span<char> Chain::MakePrependBuffer(size_t min_length,
+                                                 size_t size_hint) {
+  return MakePrependBuffer(min_length, Options().set_size_hint(size_hint));
+}
+
+inline void Chain::Append(absl::string_view src, size_t size_hint) {
+  Append(src, Options().set_size_hint(size_hint));
+}
+
+inline void Chain::Append(std::string&& src, size_t size_hint) {
+  Append(std::move(src), Options().set_size_hint(size_hint));
+}
+
 inline void Chain::Append(const char* src, size_t size_hint) {
   Append(absl::string_view(src), size_hint);
 }
 
+inline void Chain::Append(const Chain& src, size_t size_hint) {
+  Append(src, Options().set_size_hint(size_hint));
+}
+
+inline void Chain::Append(Chain&& src, size_t size_hint) {
+  Append(std::move(src), Options().set_size_hint(size_hint));
+}
+
+inline void Chain::AppendShared(std::shared_ptr<const void> owner,
+                                absl::string_view data, size_t size_hint) {
+  AppendShared(std::move(owner), data, Options().set_size_hint(size_hint));
+}
+
+inline void Chain::PrependShared(std::shared_ptr<const void> owner,
+                                 absl::string_view data, size_t size_hint) {
+  PrependShared(std::move(owner), data, Options().set_size_hint(size_hint));
+}
+
+inline void Chain::Prepend(absl::string_view src, size_t size_hint) {
+  Prepend(src, Options().set_size_hint(size_hint));
+}
+
+inline void Chain::Prepend(std::string&& src, size_t size_hint) {
+  Prepend(std::move(src), Options().set_size_hint(size_hint));
+}
+
 inline void Chain::Prepend(const char* src, size_t size_hint) {
   Prepend(absl::string_view(src), size_hint);
 }
 
+inline void Chain::Prepend(const Chain& src, size_t size_hint) {
+  Prepend(src, Options().set_size_hint(size_hint));
+}
+
+inline void Chain::Prepend(Chain&& src, size_t size_hint) {
+  Prepend(std::move(src), Options().set_size_hint(size_hint));
+}
+
 template <typename T>
 void Chain::AppendExternal(T object, size_t size_hint) {
+  AppendExternal(std::move(object), Options().set_size_hint(size_hint));
+}
+
+template <typename T>
+void Chain::AppendExternal(T object, const Options& options) {
   RawAppendExternal(ExternalMethodsFor<T>::NewBlockImplicitData, &object,
-                    object.data(), size_hint);
+                    object.data(), options);
 }
 
 template <typename T>
 void Chain::AppendExternal(T object, absl::string_view data, size_t size_hint) {
+  AppendExternal(std::move(object), data, Options().set_size_hint(size_hint));
+}
+
+template <typename T>
+void Chain::AppendExternal(T object, absl::string_view data,
+                           const Options& options) {
   RawAppendExternal(ExternalMethodsFor<T>::NewBlockExplicitData, &object, data,
-                    size_hint);
+                    options);
 }
 
 template <typename T>
 void Chain::PrependExternal(T object, size_t size_hint) {
+  PrependExternal(std::move(object), Options().set_size_hint(size_hint));
+}
+
+template <typename T>
+void Chain::PrependExternal(T object, const Options& options) {
   RawPrependExternal(ExternalMethodsFor<T>::NewBlockImplicitData, &object,
-                     object.data(), size_hint);
+                     object.data(), options);
 }
 
 template <typename T>
 void Chain::PrependExternal(T object, absl::string_view data,
                             size_t size_hint) {
+  PrependExternal(std::move(object), data, Options().set_size_hint(size_hint));
+}
+
+template <typename T>
+void Chain::PrependExternal(T object, absl::string_view data,
+                            const Options& options) {
   RawPrependExternal(ExternalMethodsFor<T>::NewBlockExplicitData, &object, data,
-                     size_hint);
+                     options);
 }
 
 inline void Chain::RemoveSuffix(size_t length, size_t size_hint) {
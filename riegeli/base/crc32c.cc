@@ -0,0 +1,105 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/base/crc32c.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <cstring>
+
+#include "absl/strings/string_view.h"
+
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+namespace riegeli {
+
+namespace {
+
+#if defined(__SSE4_2__) || defined(__ARM_FEATURE_CRC32)
+
+inline uint32_t Crc32cByte(uint32_t crc, uint8_t byte) {
+#if defined(__SSE4_2__)
+  return _mm_crc32_u8(crc, byte);
+#else
+  return __crc32cb(crc, byte);
+#endif
+}
+
+inline uint32_t Crc32cWord(uint32_t crc, uint64_t word) {
+#if defined(__SSE4_2__) && defined(__x86_64__)
+  return static_cast<uint32_t>(_mm_crc32_u64(crc, word));
+#elif defined(__SSE4_2__)
+  crc = _mm_crc32_u32(crc, static_cast<uint32_t>(word));
+  return _mm_crc32_u32(crc, static_cast<uint32_t>(word >> 32));
+#else
+  return __crc32cd(crc, word);
+#endif
+}
+
+// Both instruction sets process words in little endian order, as loaded on
+// these targets.
+inline uint32_t Crc32cUpdate(uint32_t crc, const char* data, size_t size) {
+  while (size >= sizeof(uint64_t)) {
+    uint64_t word;
+    std::memcpy(&word, data, sizeof(word));
+    crc = Crc32cWord(crc, word);
+    data += sizeof(word);
+    size -= sizeof(word);
+  }
+  while (size > 0) {
+    crc = Crc32cByte(crc, static_cast<uint8_t>(*data++));
+    --size;
+  }
+  return crc;
+}
+
+#else
+
+struct Crc32cTable {
+  Crc32cTable() {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t crc = i;
+      for (int j = 0; j < 8; ++j) {
+        crc = (crc >> 1) ^ (0x82f63b78u & (0u - (crc & 1)));
+      }
+      entries[i] = crc;
+    }
+  }
+
+  uint32_t entries[256];
+};
+
+inline uint32_t Crc32cUpdate(uint32_t crc, const char* data, size_t size) {
+  static const Crc32cTable table;
+  while (size > 0) {
+    crc = table.entries[(crc ^ static_cast<uint8_t>(*data++)) & 0xff] ^
+          (crc >> 8);
+    --size;
+  }
+  return crc;
+}
+
+#endif
+
+}  // namespace
+
+uint32_t Crc32cExtend(uint32_t crc, absl::string_view data) {
+  return ~Crc32cUpdate(~crc, data.data(), data.size());
+}
+
+}  // namespace riegeli
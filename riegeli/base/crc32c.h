@@ -0,0 +1,51 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_BASE_CRC32C_H_
+#define RIEGELI_BASE_CRC32C_H_
+
+#include <stdint.h>
+
+#include "absl/strings/string_view.h"
+
+namespace riegeli {
+
+// Returns the CRC-32C (Castagnoli) checksum of the concatenation of data
+// whose checksum is crc, and of data.
+//
+// The checksum is computed with CPU instructions if the target supports them
+// (SSE4.2 on x86, CRC32 extension on ARM), e.g. with -msse4.2 or
+// -march=native, and with a table otherwise.
+uint32_t Crc32cExtend(uint32_t crc, absl::string_view data);
+
+// Returns the CRC-32C checksum of data.
+inline uint32_t Crc32c(absl::string_view data) { return Crc32cExtend(0, data); }
+
+// Returns a masked representation of crc, as stored in TFRecord files.
+//
+// Computing the checksum of a string which contains checksums is problematic,
+// so stored checksums are masked.
+inline uint32_t MaskCrc32c(uint32_t crc) {
+  return ((crc >> 15) | (crc << 17)) + 0xa282ead8u;
+}
+
+// Returns the checksum whose masked representation is masked_crc.
+inline uint32_t UnmaskCrc32c(uint32_t masked_crc) {
+  const uint32_t rot = masked_crc - 0xa282ead8u;
+  return (rot >> 17) | (rot << 15);
+}
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_BASE_CRC32C_H_
@@ -0,0 +1,218 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_BASE_FLAT_HASH_MAP_H_
+#define RIEGELI_BASE_FLAT_HASH_MAP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <limits>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/memory_estimator.h"
+
+namespace riegeli {
+
+// A hash map with open addressing, for small keys looked up very often.
+//
+// Entries are stored contiguously in insertion order, and iterated in that
+// order. The hash table holds only entry indices with a part of their hashes,
+// so probing rarely touches entries which do not match.
+//
+// Differences from std::unordered_map:
+//  * Entries cannot be erased individually, only by clear().
+//  * Inserting an entry invalidates iterators, pointers, and references to
+//    other entries.
+//  * value_type is std::pair<Key, Value> rather than
+//    std::pair<const Key, Value>; the key must not be changed through an
+//    iterator.
+//
+// Hash should mix all bits of its result, because the table uses its low bits
+// directly.
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class FlatHashMap {
+ public:
+  using key_type = Key;
+  using mapped_type = Value;
+  using value_type = std::pair<Key, Value>;
+  using iterator = typename std::vector<value_type>::iterator;
+  using const_iterator = typename std::vector<value_type>::const_iterator;
+
+  FlatHashMap() noexcept {}
+
+  FlatHashMap(FlatHashMap&&) noexcept = default;
+  FlatHashMap& operator=(FlatHashMap&&) noexcept = default;
+
+  FlatHashMap(const FlatHashMap&) = default;
+  FlatHashMap& operator=(const FlatHashMap&) = default;
+
+  iterator begin() { return entries_.begin(); }
+  const_iterator begin() const { return entries_.begin(); }
+  iterator end() { return entries_.end(); }
+  const_iterator end() const { return entries_.end(); }
+
+  size_t size() const { return entries_.size(); }
+  bool empty() const { return entries_.empty(); }
+
+  // Removes all entries, keeping allocated memory for reuse.
+  void clear();
+
+  // Returns the entry with the given key, or end() if absent.
+  iterator find(const Key& key);
+  const_iterator find(const Key& key) const;
+
+  // Inserts an entry with the given key and value if the key is absent.
+  //
+  // Returns the entry with the key, and whether it was inserted.
+  template <typename... ValueArgs>
+  std::pair<iterator, bool> emplace(const Key& key, ValueArgs&&... value_args);
+
+  // Returns the value for the given key, inserting a default-constructed value
+  // if the key is absent.
+  Value& operator[](const Key& key) { return emplace(key).first->second; }
+
+  // Registers this FlatHashMap with MemoryEstimator, including allocated
+  // capacity. Memory owned by keys and values themselves is not included;
+  // callers add it by iterating over entries if it is significant.
+  void AddUniqueTo(MemoryEstimator* memory_estimator) const;
+
+ private:
+  struct Slot {
+    // Index of the entry in entries_ plus 1, or 0 for an empty slot.
+    uint32_t entry_index_plus_1 = 0;
+    // Low 32 bits of the hash of the key.
+    uint32_t hash_bits = 0;
+  };
+
+  // Minimal number of slots of a non-empty table.
+  static constexpr size_t kMinSlots = 8;
+
+  // Returns the index of the slot with the given key, or of the empty slot
+  // where it would be inserted.
+  //
+  // Precondition: !slots_.empty()
+  size_t FindSlot(const Key& key, size_t hash) const;
+
+  // Rebuilds slots_ with twice as many slots (or kMinSlots).
+  void Grow();
+
+  std::vector<value_type> entries_;
+  // Invariants:
+  //   slots_.size() is 0 or a power of 2
+  //   entries_.size() <= slots_.size() * 3 / 4
+  std::vector<Slot> slots_;
+};
+
+// Implementation details follow.
+
+template <typename Key, typename Value, typename Hash>
+void FlatHashMap<Key, Value, Hash>::clear() {
+  entries_.clear();
+  for (Slot& slot : slots_) slot = Slot();
+}
+
+template <typename Key, typename Value, typename Hash>
+void FlatHashMap<Key, Value, Hash>::AddUniqueTo(
+    MemoryEstimator* memory_estimator) const {
+  memory_estimator->AddMemory(sizeof(FlatHashMap) +
+                              sizeof(value_type) * entries_.capacity() +
+                              sizeof(Slot) * slots_.capacity());
+}
+
+template <typename Key, typename Value, typename Hash>
+inline size_t FlatHashMap<Key, Value, Hash>::FindSlot(const Key& key,
+                                                      size_t hash) const {
+  RIEGELI_ASSERT(!slots_.empty())
+      << "Failed precondition of FlatHashMap::FindSlot(): no slots";
+  const size_t mask = slots_.size() - 1;
+  const uint32_t hash_bits = static_cast<uint32_t>(hash);
+  size_t slot_index = hash & mask;
+  for (;;) {
+    const Slot& slot = slots_[slot_index];
+    if (slot.entry_index_plus_1 == 0) return slot_index;
+    if (slot.hash_bits == hash_bits &&
+        entries_[slot.entry_index_plus_1 - 1].first == key) {
+      return slot_index;
+    }
+    slot_index = (slot_index + 1) & mask;
+  }
+}
+
+template <typename Key, typename Value, typename Hash>
+inline typename FlatHashMap<Key, Value, Hash>::iterator
+FlatHashMap<Key, Value, Hash>::find(const Key& key) {
+  if (ABSL_PREDICT_FALSE(slots_.empty())) return entries_.end();
+  const Slot& slot = slots_[FindSlot(key, Hash()(key))];
+  if (slot.entry_index_plus_1 == 0) return entries_.end();
+  return entries_.begin() + (slot.entry_index_plus_1 - 1);
+}
+
+template <typename Key, typename Value, typename Hash>
+inline typename FlatHashMap<Key, Value, Hash>::const_iterator
+FlatHashMap<Key, Value, Hash>::find(const Key& key) const {
+  if (ABSL_PREDICT_FALSE(slots_.empty())) return entries_.end();
+  const Slot& slot = slots_[FindSlot(key, Hash()(key))];
+  if (slot.entry_index_plus_1 == 0) return entries_.end();
+  return entries_.begin() + (slot.entry_index_plus_1 - 1);
+}
+
+template <typename Key, typename Value, typename Hash>
+template <typename... ValueArgs>
+inline std::pair<typename FlatHashMap<Key, Value, Hash>::iterator, bool>
+FlatHashMap<Key, Value, Hash>::emplace(const Key& key,
+                                       ValueArgs&&... value_args) {
+  if (ABSL_PREDICT_FALSE((entries_.size() + 1) * 4 > slots_.size() * 3)) {
+    Grow();
+  }
+  const size_t hash = Hash()(key);
+  Slot& slot = slots_[FindSlot(key, hash)];
+  if (slot.entry_index_plus_1 != 0) {
+    return std::make_pair(entries_.begin() + (slot.entry_index_plus_1 - 1),
+                          false);
+  }
+  RIEGELI_ASSERT_LT(entries_.size(), std::numeric_limits<uint32_t>::max())
+      << "Failed precondition of FlatHashMap::emplace(): too many entries";
+  entries_.emplace_back(std::piecewise_construct, std::forward_as_tuple(key),
+                        std::forward_as_tuple(
+                            std::forward<ValueArgs>(value_args)...));
+  slot.entry_index_plus_1 = IntCast<uint32_t>(entries_.size());
+  slot.hash_bits = static_cast<uint32_t>(hash);
+  return std::make_pair(entries_.end() - 1, true);
+}
+
+template <typename Key, typename Value, typename Hash>
+void FlatHashMap<Key, Value, Hash>::Grow() {
+  const size_t new_num_slots =
+      slots_.empty() ? size_t{kMinSlots} : slots_.size() * 2;
+  slots_.assign(new_num_slots, Slot());
+  const size_t mask = new_num_slots - 1;
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    const size_t hash = Hash()(entries_[i].first);
+    size_t slot_index = hash & mask;
+    while (slots_[slot_index].entry_index_plus_1 != 0) {
+      slot_index = (slot_index + 1) & mask;
+    }
+    slots_[slot_index].entry_index_plus_1 = IntCast<uint32_t>(i + 1);
+    slots_[slot_index].hash_bits = static_cast<uint32_t>(hash);
+  }
+}
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_BASE_FLAT_HASH_MAP_H_
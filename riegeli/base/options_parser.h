@@ -60,6 +60,10 @@ class ValueParser : public Object {
   // Value parser for integers min_value..max_value.
   static Function Int(int* out, int min_value, int max_value);
 
+  // Value parser for unsigned integers min_value..max_value.
+  static Function UnsignedInt(uint64_t* out, uint64_t min_value,
+                              uint64_t max_value);
+
   // Value parser for integers expressed as reals with optional suffix
   // [BkKMGTPE], min_value..max_value.
   static Function Bytes(uint64_t* out, uint64_t min_value, uint64_t max_value);
@@ -14,59 +14,184 @@
 
 #include "riegeli/base/parallelism.h"
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include <stddef.h>
+#include <algorithm>
+#include <atomic>
 #include <functional>
 #include <thread>
 #include <utility>
+#include <vector>
 
+#include "absl/memory/memory.h"
 #include "absl/synchronization/mutex.h"
-#include "absl/time/time.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/memory.h"
 
 namespace riegeli {
-namespace internal {
+
+namespace {
+
+// The ThreadPool and the index of the worker running on the current thread,
+// or nullptr if the current thread is not a worker thread.
+thread_local const ThreadPool* current_thread_pool = nullptr;
+thread_local size_t current_worker_index = 0;
+
+}  // namespace
+
+ThreadPool::ThreadPool()
+    : ThreadPool(
+          IntCast<int>(std::max(std::thread::hardware_concurrency(), 1u))) {}
+
+ThreadPool::ThreadPool(int num_threads)
+    : ThreadPool(num_threads, std::vector<int>()) {}
+
+ThreadPool::ThreadPool(int num_threads, std::vector<int> cpus)
+    : cpus_(std::move(cpus)) {
+  RIEGELI_ASSERT_GT(num_threads, 0)
+      << "Failed precondition of ThreadPool::ThreadPool(int): "
+         "non-positive number of threads";
+  workers_.reserve(IntCast<size_t>(num_threads));
+  for (int i = 0; i < num_threads; ++i) {
+    workers_.push_back(absl::make_unique<Worker>());
+  }
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    workers_[i]->thread = std::thread([this, i] {
+      if (!cpus_.empty()) {
+        internal::SetCurrentThreadAffinity({cpus_[i % cpus_.size()]});
+      }
+      WorkerLoop(i);
+    });
+  }
+}
 
 ThreadPool::~ThreadPool() {
-  absl::MutexLock lock(&mutex_);
-  exiting_ = true;
-  mutex_.Await(absl::Condition(
-      +[](size_t* num_threads) { return *num_threads == 0; }, &num_threads_));
+  for (const std::unique_ptr<Worker>& worker : workers_) {
+    absl::MutexLock lock(&worker->mutex);
+    worker->exiting = true;
+  }
+  for (const std::unique_ptr<Worker>& worker : workers_) {
+    worker->thread.join();
+  }
 }
 
 void ThreadPool::Schedule(std::function<void()> task) {
+  const size_t index = current_thread_pool == this ? current_worker_index
+                                                   : ExternalWorkerIndex();
+  Worker* const worker = workers_[index].get();
   {
-    absl::MutexLock lock(&mutex_);
-    RIEGELI_ASSERT(!exiting_)
-        << "Failed precondition of ThreadPool::Schedule(): no new threads may "
+    absl::MutexLock lock(&worker->mutex);
+    RIEGELI_ASSERT(!worker->exiting)
+        << "Failed precondition of ThreadPool::Schedule(): no new tasks may "
            "be scheduled while the thread pool is exiting";
-    tasks_.push_back(std::move(task));
-    if (num_idle_threads_ >= tasks_.size()) return;
-    ++num_threads_;
+    worker->tasks.push_back(std::move(task));
   }
-  std::thread([this] {
-    for (;;) {
-      absl::ReleasableMutexLock lock(&mutex_);
-      ++num_idle_threads_;
-      mutex_.AwaitWithTimeout(absl::Condition(
-                                  +[](ThreadPool* self) {
-                                    self->mutex_.AssertHeld();
-                                    return !self->tasks_.empty() ||
-                                           self->exiting_;
-                                  },
-                                  this),
-                              absl::Seconds(60));
-      --num_idle_threads_;
-      if (tasks_.empty() || exiting_) {
-        --num_threads_;
-        return;
+  WakeIdleWorker(index);
+}
+
+inline size_t ThreadPool::ExternalWorkerIndex() {
+  const size_t next = next_worker_.fetch_add(1, std::memory_order_relaxed);
+#ifdef __linux__
+  if (!cpus_.empty()) {
+    const int cpu = sched_getcpu();
+    if (cpu >= 0) {
+      // Start from a different worker each time, so that tasks are spread
+      // among workers pinned to this CPU if there are several.
+      for (size_t i = 0; i < workers_.size(); ++i) {
+        const size_t index = (next + i) % workers_.size();
+        if (cpus_[index % cpus_.size()] == cpu) return index;
       }
-      const std::function<void()> task = std::move(tasks_.front());
-      tasks_.pop_front();
-      lock.Release();
+    }
+  }
+#endif
+  return next % workers_.size();
+}
+
+void ThreadPool::WorkerLoop(size_t index) {
+  current_thread_pool = this;
+  current_worker_index = index;
+  Worker* const worker = workers_[index].get();
+  std::function<void()> task;
+  for (;;) {
+    if (TryPop(worker, &task) || TrySteal(index, &task)) {
+      task();
+      task = nullptr;
+      continue;
+    }
+    worker->idle.store(true);
+    // Look for tasks again after announcing idleness, so that a task scheduled
+    // by a thread which has just decided not to wake this worker is not
+    // missed.
+    if (TrySteal(index, &task)) {
+      worker->idle.store(false);
       task();
+      task = nullptr;
+      continue;
+    }
+    absl::MutexLock lock(&worker->mutex);
+    worker->mutex.Await(absl::Condition(
+        +[](Worker* worker) {
+          worker->mutex.AssertHeld();
+          return !worker->tasks.empty() || worker->wake || worker->exiting;
+        },
+        worker));
+    worker->wake = false;
+    worker->idle.store(false);
+    if (worker->exiting && worker->tasks.empty()) return;
+  }
+}
+
+inline bool ThreadPool::TryPop(Worker* worker, std::function<void()>* task) {
+  absl::MutexLock lock(&worker->mutex);
+  if (worker->tasks.empty()) return false;
+  *task = std::move(worker->tasks.front());
+  worker->tasks.pop_front();
+  return true;
+}
+
+inline bool ThreadPool::TrySteal(size_t index, std::function<void()>* task) {
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    if (TryPop(workers_[(index + i) % workers_.size()].get(), task)) {
+      return true;
     }
-  })
-      .detach();
+  }
+  return false;
+}
+
+inline void ThreadPool::WakeIdleWorker(size_t index) {
+  // If the worker owning the queue is idle, it wakes by itself.
+  if (workers_[index]->idle.load()) return;
+  for (size_t i = 1; i < workers_.size(); ++i) {
+    Worker* const worker = workers_[(index + i) % workers_.size()].get();
+    if (!worker->idle.load()) continue;
+    absl::MutexLock lock(&worker->mutex);
+    if (worker->wake) continue;
+    worker->wake = true;
+    worker->idle.store(false);
+    return;
+  }
+}
+
+namespace internal {
+
+bool SetCurrentThreadAffinity(const std::vector<int>& cpus) {
+  RIEGELI_ASSERT(!cpus.empty())
+      << "Failed precondition of SetCurrentThreadAffinity(): no CPUs";
+#ifdef __linux__
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  for (const int cpu : cpus) {
+    if (cpu >= 0 && cpu < CPU_SETSIZE) CPU_SET(cpu, &cpu_set);
+  }
+  if (CPU_COUNT(&cpu_set) == 0) return false;
+  return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) ==
+         0;
+#else
+  return false;
+#endif
 }
 
 ThreadPool& DefaultThreadPool() {
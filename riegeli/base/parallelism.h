@@ -16,36 +16,109 @@
 #define RIEGELI_BASE_PARALLELISM_H_
 
 #include <stddef.h>
+#include <atomic>
 #include <deque>
 #include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
 
 #include "absl/base/thread_annotations.h"
 #include "absl/synchronization/mutex.h"
 
 namespace riegeli {
-namespace internal {
 
-// A thread pool with lazily created worker threads, without a thread count
-// limit. Worker threads exit after being idle for one minute.
+// A thread pool with a fixed number of worker threads, created eagerly.
+//
+// Each worker thread has its own queue of tasks, protected by its own mutex.
+// Tasks scheduled from a worker thread go to the queue of that worker, other
+// tasks are distributed among queues round-robin. A worker with an empty queue
+// steals tasks from queues of other workers before going to sleep.
+//
+// Tasks should not block waiting for other tasks scheduled on the same thread
+// pool, because all worker threads might be occupied by blocked tasks.
+//
+// Worker threads can be pinned to CPUs. Then a task scheduled from a thread
+// which is not a worker goes to the queue of a worker pinned to the CPU the
+// scheduling thread is running on, if there is one, so that data just
+// produced by the scheduling thread is likely still in the cache of that CPU.
 class ThreadPool {
  public:
-  ThreadPool() {}
+  // Creates a thread pool with one worker thread per hardware thread.
+  ThreadPool();
+
+  // Creates a thread pool with num_threads worker threads.
+  //
+  // Precondition: num_threads > 0
+  explicit ThreadPool(int num_threads);
+
+  // Creates a thread pool with num_threads worker threads, where worker i is
+  // pinned to CPU cpus[i % cpus.size()]. If cpus is empty, workers are not
+  // pinned.
+  //
+  // Pinning is supported only on Linux, elsewhere cpus is ignored. Pinning to
+  // a CPU which is not available to the process is silently ineffective.
+  //
+  // Precondition: num_threads > 0
+  ThreadPool(int num_threads, std::vector<int> cpus);
 
   ThreadPool(const ThreadPool&) = delete;
   ThreadPool& operator=(const ThreadPool&) = delete;
 
+  // Waits for scheduled tasks to complete and joins worker threads.
   ~ThreadPool();
 
+  // Returns the number of worker threads.
+  size_t num_threads() const { return workers_.size(); }
+
+  // Schedules a task to be run by some worker thread.
+  //
+  // Precondition: the ThreadPool is not being destroyed.
   void Schedule(std::function<void()> task);
 
  private:
-  absl::Mutex mutex_;
-  bool exiting_ GUARDED_BY(mutex_) = false;
-  size_t num_threads_ GUARDED_BY(mutex_) = 0;
-  size_t num_idle_threads_ GUARDED_BY(mutex_) = 0;
-  std::deque<std::function<void()>> tasks_ GUARDED_BY(mutex_);
+  struct Worker {
+    absl::Mutex mutex;
+    std::deque<std::function<void()>> tasks GUARDED_BY(mutex);
+    // True if the worker was asked to look for tasks again, possibly in queues
+    // of other workers.
+    bool wake GUARDED_BY(mutex) = false;
+    bool exiting GUARDED_BY(mutex) = false;
+    // True if the worker is sleeping or about to sleep. Read without holding
+    // mutex when looking for a worker to wake.
+    std::atomic<bool> idle{false};
+    std::thread thread;
+  };
+
+  void WorkerLoop(size_t index);
+  // Takes a task from the queue of the given worker.
+  static bool TryPop(Worker* worker, std::function<void()>* task);
+  // Takes a task from the queue of any worker, starting from the given one.
+  bool TrySteal(size_t index, std::function<void()>* task);
+  // Wakes an idle worker, preferring the given one, if any worker is idle.
+  void WakeIdleWorker(size_t index);
+
+  // Returns the index of the worker which should receive a task scheduled from
+  // a thread which is not a worker of this pool.
+  size_t ExternalWorkerIndex();
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::atomic<size_t> next_worker_{0};
+  // CPUs which workers are pinned to, cpus_[i % cpus_.size()] for worker i, or
+  // empty if workers are not pinned.
+  std::vector<int> cpus_;
 };
 
+namespace internal {
+
+// Pins the current thread to the given set of CPUs. Returns false if this is
+// not supported or failed, in which case the affinity is unchanged.
+//
+// Precondition: !cpus.empty()
+bool SetCurrentThreadAffinity(const std::vector<int>& cpus);
+
+// Returns the thread pool shared by the process, used when no ThreadPool is
+// specified explicitly.
 ThreadPool& DefaultThreadPool();
 
 }  // namespace internal
@@ -0,0 +1,126 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_BASE_RECYCLING_POOL_H_
+#define RIEGELI_BASE_RECYCLING_POOL_H_
+
+#include <stddef.h>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+
+namespace riegeli {
+
+// A pool of idle objects of type T which are expensive to create but cheap to
+// reset for a new use, e.g. compression contexts with large internal tables.
+//
+// An object obtained from Get() is returned to the pool when its Handle is
+// destroyed, unless the pool already holds max_size idle objects, in which
+// case the object is deleted.
+//
+// RecyclingPool is thread-safe.
+template <typename T, typename Deleter = std::default_delete<T>>
+class RecyclingPool {
+ public:
+  // Deleter of Handle which returns the object to the pool.
+  class Recycler {
+   public:
+    Recycler() noexcept {}
+
+    explicit Recycler(RecyclingPool* pool) noexcept : pool_(pool) {}
+
+    void operator()(T* ptr) const;
+
+   private:
+    RecyclingPool* pool_ = nullptr;
+  };
+
+  using Handle = std::unique_ptr<T, Recycler>;
+
+  // Returns a pool shared by the process, never destroyed.
+  static RecyclingPool& global();
+
+  explicit RecyclingPool(size_t max_size = 16) noexcept
+      : max_size_(max_size) {}
+
+  RecyclingPool(const RecyclingPool&) = delete;
+  RecyclingPool& operator=(const RecyclingPool&) = delete;
+
+  // Returns an idle object from the pool, or creates a new object with
+  // factory() if there are none. factory() returns std::unique_ptr<T, Deleter>.
+  //
+  // An object from the pool is left in the state of its previous use. The
+  // caller must reset it before use.
+  //
+  // Returns nullptr if factory() returns nullptr.
+  template <typename Factory>
+  Handle Get(Factory factory);
+
+ private:
+  void Put(T* ptr);
+
+  const size_t max_size_;
+  absl::Mutex mutex_;
+  std::vector<std::unique_ptr<T, Deleter>> idle_ GUARDED_BY(mutex_);
+};
+
+// Implementation details follow.
+
+template <typename T, typename Deleter>
+void RecyclingPool<T, Deleter>::Recycler::operator()(T* ptr) const {
+  if (pool_ == nullptr) {
+    Deleter()(ptr);
+    return;
+  }
+  pool_->Put(ptr);
+}
+
+template <typename T, typename Deleter>
+RecyclingPool<T, Deleter>& RecyclingPool<T, Deleter>::global() {
+  static RecyclingPool* const kGlobalPool = new RecyclingPool();
+  return *kGlobalPool;
+}
+
+template <typename T, typename Deleter>
+template <typename Factory>
+typename RecyclingPool<T, Deleter>::Handle RecyclingPool<T, Deleter>::Get(
+    Factory factory) {
+  std::unique_ptr<T, Deleter> object;
+  {
+    absl::MutexLock lock(&mutex_);
+    if (!idle_.empty()) {
+      object = std::move(idle_.back());
+      idle_.pop_back();
+    }
+  }
+  if (object == nullptr) {
+    object = factory();
+    if (object == nullptr) return Handle();
+  }
+  return Handle(object.release(), Recycler(this));
+}
+
+template <typename T, typename Deleter>
+void RecyclingPool<T, Deleter>::Put(T* ptr) {
+  std::unique_ptr<T, Deleter> object(ptr);
+  absl::MutexLock lock(&mutex_);
+  if (idle_.size() < max_size_) idle_.push_back(std::move(object));
+}
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_BASE_RECYCLING_POOL_H_
@@ -0,0 +1,243 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Microbenchmarks of Chain, ChainReader, ChainWriter, and varint decoding.
+//
+// Each benchmark processes kDataSize bytes per iteration, split into pieces
+// whose size is the benchmark argument, and reports bytes per second.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "benchmark/benchmark.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/bytes/chain_reader.h"
+#include "riegeli/bytes/chain_writer.h"
+#include "riegeli/bytes/reader_utils.h"
+#include "riegeli/bytes/varint.h"
+#include "riegeli/bytes/writer_utils.h"
+
+namespace riegeli {
+namespace {
+
+constexpr size_t kDataSize = size_t{1} << 20;
+
+void PieceSizes(benchmark::internal::Benchmark* benchmark) {
+  for (const int piece_size : {1, 16, 256, 4096, 65536}) {
+    benchmark->Arg(piece_size);
+  }
+}
+
+std::string Piece(size_t size) {
+  std::string piece(size, '\0');
+  for (size_t i = 0; i < size; ++i) piece[i] = static_cast<char>('a' + i % 26);
+  return piece;
+}
+
+Chain MakeChain(size_t piece_size) {
+  const std::string piece = Piece(piece_size);
+  Chain chain;
+  for (size_t size = 0; size < kDataSize; size += piece_size) {
+    chain.Append(piece, kDataSize);
+  }
+  return chain;
+}
+
+void BM_ChainAppend(benchmark::State& state) {
+  const size_t piece_size = IntCast<size_t>(state.range(0));
+  const std::string piece = Piece(piece_size);
+  for (auto _ : state) {
+    Chain chain;
+    for (size_t size = 0; size < kDataSize; size += piece_size) {
+      chain.Append(piece);
+    }
+    benchmark::DoNotOptimize(chain);
+  }
+  state.SetBytesProcessed(state.iterations() * int64_t{kDataSize});
+}
+BENCHMARK(BM_ChainAppend)->Apply(PieceSizes);
+
+void BM_ChainAppendChain(benchmark::State& state) {
+  const size_t piece_size = IntCast<size_t>(state.range(0));
+  const Chain piece(Piece(piece_size));
+  for (auto _ : state) {
+    Chain chain;
+    for (size_t size = 0; size < kDataSize; size += piece_size) {
+      chain.Append(piece);
+    }
+    benchmark::DoNotOptimize(chain);
+  }
+  state.SetBytesProcessed(state.iterations() * int64_t{kDataSize});
+}
+BENCHMARK(BM_ChainAppendChain)->Apply(PieceSizes);
+
+void BM_ChainPrepend(benchmark::State& state) {
+  const size_t piece_size = IntCast<size_t>(state.range(0));
+  const std::string piece = Piece(piece_size);
+  for (auto _ : state) {
+    Chain chain;
+    for (size_t size = 0; size < kDataSize; size += piece_size) {
+      chain.Prepend(piece);
+    }
+    benchmark::DoNotOptimize(chain);
+  }
+  state.SetBytesProcessed(state.iterations() * int64_t{kDataSize});
+}
+BENCHMARK(BM_ChainPrepend)->Apply(PieceSizes);
+
+void BM_ChainFlatten(benchmark::State& state) {
+  const Chain chain = MakeChain(IntCast<size_t>(state.range(0)));
+  for (auto _ : state) {
+    std::string flat(chain);
+    benchmark::DoNotOptimize(flat);
+  }
+  state.SetBytesProcessed(state.iterations() *
+                          IntCast<int64_t>(chain.size()));
+}
+BENCHMARK(BM_ChainFlatten)->Apply(PieceSizes);
+
+void BM_ChainWriter(benchmark::State& state) {
+  const size_t piece_size = IntCast<size_t>(state.range(0));
+  const std::string piece = Piece(piece_size);
+  for (auto _ : state) {
+    Chain chain;
+    ChainWriter writer(&chain);
+    for (size_t size = 0; size < kDataSize; size += piece_size) {
+      writer.Write(piece);
+    }
+    RIEGELI_CHECK(writer.Close()) << writer.message();
+    benchmark::DoNotOptimize(chain);
+  }
+  state.SetBytesProcessed(state.iterations() * int64_t{kDataSize});
+}
+BENCHMARK(BM_ChainWriter)->Apply(PieceSizes);
+
+void BM_ChainReader(benchmark::State& state) {
+  const size_t piece_size = IntCast<size_t>(state.range(0));
+  const Chain chain = MakeChain(4096);
+  std::string piece(piece_size, '\0');
+  for (auto _ : state) {
+    ChainReader reader(&chain);
+    while (reader.Read(&piece[0], piece_size)) {
+      benchmark::DoNotOptimize(piece);
+    }
+    RIEGELI_CHECK(reader.Close()) << reader.message();
+  }
+  state.SetBytesProcessed(state.iterations() *
+                          IntCast<int64_t>(chain.size()));
+}
+BENCHMARK(BM_ChainReader)->Apply(PieceSizes);
+
+void BM_ChainReaderToChain(benchmark::State& state) {
+  const size_t piece_size = IntCast<size_t>(state.range(0));
+  const Chain chain = MakeChain(4096);
+  for (auto _ : state) {
+    ChainReader reader(&chain);
+    Chain piece;
+    while (reader.Read(&piece, piece_size)) {
+      benchmark::DoNotOptimize(piece);
+      piece.Clear();
+    }
+    RIEGELI_CHECK(reader.Close()) << reader.message();
+  }
+  state.SetBytesProcessed(state.iterations() *
+                          IntCast<int64_t>(chain.size()));
+}
+BENCHMARK(BM_ChainReaderToChain)->Apply(PieceSizes);
+
+// Returns varints of values below 2^max_bits, with lengths cycling through all
+// possible lengths, with kMaxLengthVarint64() bytes of padding at the end so
+// that they can be decoded from a pointer.
+std::string EncodedVarints(int max_bits, size_t* num_varints) {
+  std::string encoded;
+  *num_varints = 0;
+  for (int bits = 0; encoded.size() < kDataSize; bits = (bits + 7) % max_bits) {
+    const uint64_t value = uint64_t{1} << bits;
+    char buffer[kMaxLengthVarint64()];
+    const char* const end = WriteVarint64(buffer, value);
+    encoded.append(buffer, PtrDistance(buffer, end));
+    ++*num_varints;
+  }
+  encoded.append(kMaxLengthVarint64(), '\0');
+  return encoded;
+}
+
+void BM_ReadVarint32FromArray(benchmark::State& state) {
+  size_t num_varints;
+  const std::string encoded = EncodedVarints(32, &num_varints);
+  for (auto _ : state) {
+    const char* cursor = encoded.data();
+    for (size_t i = 0; i < num_varints; ++i) {
+      uint32_t value;
+      RIEGELI_CHECK(ReadVarint32(&cursor, &value));
+      benchmark::DoNotOptimize(value);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * IntCast<int64_t>(num_varints));
+}
+BENCHMARK(BM_ReadVarint32FromArray);
+
+void BM_ReadVarint64FromArray(benchmark::State& state) {
+  size_t num_varints;
+  const std::string encoded = EncodedVarints(64, &num_varints);
+  for (auto _ : state) {
+    const char* cursor = encoded.data();
+    for (size_t i = 0; i < num_varints; ++i) {
+      uint64_t value;
+      RIEGELI_CHECK(ReadVarint64(&cursor, &value));
+      benchmark::DoNotOptimize(value);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * IntCast<int64_t>(num_varints));
+}
+BENCHMARK(BM_ReadVarint64FromArray);
+
+void BM_ReadVarint32FromReader(benchmark::State& state) {
+  size_t num_varints;
+  const Chain encoded(EncodedVarints(32, &num_varints));
+  for (auto _ : state) {
+    ChainReader reader(&encoded);
+    for (size_t i = 0; i < num_varints; ++i) {
+      uint32_t value;
+      RIEGELI_CHECK(ReadVarint32(&reader, &value));
+      benchmark::DoNotOptimize(value);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * IntCast<int64_t>(num_varints));
+}
+BENCHMARK(BM_ReadVarint32FromReader);
+
+void BM_ReadVarint64FromReader(benchmark::State& state) {
+  size_t num_varints;
+  const Chain encoded(EncodedVarints(64, &num_varints));
+  for (auto _ : state) {
+    ChainReader reader(&encoded);
+    for (size_t i = 0; i < num_varints; ++i) {
+      uint64_t value;
+      RIEGELI_CHECK(ReadVarint64(&reader, &value));
+      benchmark::DoNotOptimize(value);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * IntCast<int64_t>(num_varints));
+}
+BENCHMARK(BM_ReadVarint64FromReader);
+
+}  // namespace
+}  // namespace riegeli
+
+BENCHMARK_MAIN();
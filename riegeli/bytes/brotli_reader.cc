@@ -20,8 +20,11 @@
 
 #include "absl/base/optimization.h"
 #include "absl/strings/str_cat.h"
+#include "absl/types/span.h"
 #include "brotli/decode.h"
 #include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
 #include "riegeli/bytes/reader.h"
 
@@ -122,6 +125,92 @@ bool BrotliReader::PullSlow() {
   }
 }
 
+bool BrotliReader::ReadSlow(Chain* dest, size_t length) {
+  RIEGELI_ASSERT_GT(length, UnsignedMin(available(), kMaxBytesToCopy()))
+      << "Failed precondition of Reader::ReadSlow(Chain*): "
+         "length too small, use Read(Chain*) instead";
+  RIEGELI_ASSERT_LE(length, std::numeric_limits<size_t>::max() - dest->size())
+      << "Failed precondition of Reader::ReadSlow(Chain*): "
+         "Chain size overflow";
+  if (length <= available()) return Reader::ReadSlow(dest, length);
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  const size_t size_hint = dest->size() + length;
+  // Append the output already taken from the decompressor, then let the
+  // decompressor write the remaining data directly into blocks of dest instead
+  // of taking its output and copying it from there.
+  const size_t available_length = available();
+  if (available_length > 0) {
+    dest->Append(absl::string_view(cursor_, available_length), size_hint);
+    length -= available_length;
+  }
+  start_ = nullptr;
+  cursor_ = nullptr;
+  limit_ = nullptr;
+  if (ABSL_PREDICT_FALSE(decompressor_ == nullptr)) return false;
+  if (ABSL_PREDICT_FALSE(length > std::numeric_limits<Position>::max() -
+                                      limit_pos_)) {
+    return FailOverflow();
+  }
+  // The output is decompressed into blocks of bounded size, so that a large
+  // length from untrusted input is not allocated before data are known to be
+  // present.
+  for (;;) {
+    const absl::Span<char> flat_buffer = dest->MakeAppendBuffer(
+        UnsignedMin(length, Chain::Options::kDefaultMaxBlockSize()),
+        size_hint);
+    const size_t buffer_length = UnsignedMin(flat_buffer.size(), length);
+    size_t available_out = buffer_length;
+    uint8_t* next_out = reinterpret_cast<uint8_t*>(flat_buffer.data());
+    bool ok;
+    for (;;) {
+      size_t available_in = src_->available();
+      const uint8_t* next_in =
+          reinterpret_cast<const uint8_t*>(src_->cursor());
+      const BrotliDecoderResult result = BrotliDecoderDecompressStream(
+          decompressor_.get(), &available_in, &next_in, &available_out,
+          &next_out, nullptr);
+      src_->set_cursor(reinterpret_cast<const char*>(next_in));
+      if (ABSL_PREDICT_FALSE(result == BROTLI_DECODER_RESULT_ERROR)) {
+        ok = Fail(absl::StrCat(
+            "BrotliDecoderDecompressStream() failed: ",
+            BrotliDecoderErrorString(
+                BrotliDecoderGetErrorCode(decompressor_.get()))));
+        break;
+      }
+      if (result == BROTLI_DECODER_RESULT_SUCCESS) {
+        decompressor_.reset();
+        ok = true;
+        break;
+      }
+      if (available_out == 0) {
+        ok = true;
+        break;
+      }
+      RIEGELI_ASSERT_EQ(result, BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT)
+          << "BrotliDecoderDecompressStream() returned "
+             "BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT with output space left";
+      if (ABSL_PREDICT_FALSE(!src_->Pull())) {
+        if (ABSL_PREDICT_TRUE(src_->HopeForMore())) {
+          ok = false;
+        } else if (src_->healthy()) {
+          ok = Fail("Truncated Brotli-compressed stream");
+        } else {
+          ok = Fail(*src_);
+        }
+        break;
+      }
+    }
+    const size_t length_read = buffer_length - available_out;
+    limit_pos_ += length_read;
+    dest->RemoveSuffix(flat_buffer.size() - length_read);
+    length -= length_read;
+    if (ABSL_PREDICT_FALSE(!ok)) return false;
+    if (length == 0) return true;
+    // The stream ended before length bytes were read.
+    if (decompressor_ == nullptr) return false;
+  }
+}
+
 bool BrotliReader::HopeForMoreSlow() const {
   RIEGELI_ASSERT_EQ(available(), 0u)
       << "Failed precondition of Reader::HopeForMoreSlow(): "
@@ -130,4 +219,16 @@ bool BrotliReader::HopeForMoreSlow() const {
   return decompressor_ != nullptr;
 }
 
+void BrotliReader::AddUniqueTo(MemoryEstimator* memory_estimator) const {
+  Reader::AddUniqueTo(memory_estimator);
+  memory_estimator->AddMemory(sizeof(BrotliReader) - sizeof(Reader));
+  if (owned_src_ != nullptr) {
+    owned_src_->AddUniqueTo(memory_estimator);
+  } else if (src_ != nullptr) {
+    src_->AddSharedTo(memory_estimator);
+  }
+  // Brotli does not report the size of BrotliDecoderState, which is not
+  // counted.
+}
+
 }  // namespace riegeli
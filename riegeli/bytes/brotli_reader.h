@@ -15,11 +15,14 @@
 #ifndef RIEGELI_BYTES_BROTLI_READER_H_
 #define RIEGELI_BYTES_BROTLI_READER_H_
 
+#include <stddef.h>
 #include <memory>
 #include <utility>
 
 #include "brotli/decode.h"
 #include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
 #include "riegeli/bytes/reader.h"
 
@@ -48,9 +51,13 @@ class BrotliReader final : public Reader {
   BrotliReader(BrotliReader&& src) noexcept;
   BrotliReader& operator=(BrotliReader&& src) noexcept;
 
+  void AddUniqueTo(MemoryEstimator* memory_estimator) const override;
+
  protected:
   void Done() override;
   bool PullSlow() override;
+  using Reader::ReadSlow;
+  bool ReadSlow(Chain* dest, size_t length) override;
   bool HopeForMoreSlow() const override;
 
  private:
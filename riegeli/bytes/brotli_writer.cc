@@ -22,6 +22,7 @@
 #include "absl/strings/string_view.h"
 #include "brotli/encode.h"
 #include "riegeli/base/base.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/bytes/buffered_writer.h"
 #include "riegeli/bytes/writer.h"
 
@@ -147,4 +148,16 @@ inline bool BrotliWriter::WriteInternal(absl::string_view src,
   }
 }
 
+void BrotliWriter::AddUniqueTo(MemoryEstimator* memory_estimator) const {
+  BufferedWriter::AddUniqueTo(memory_estimator);
+  memory_estimator->AddMemory(sizeof(BrotliWriter) - sizeof(BufferedWriter));
+  if (owned_dest_ != nullptr) {
+    owned_dest_->AddUniqueTo(memory_estimator);
+  } else if (dest_ != nullptr) {
+    dest_->AddSharedTo(memory_estimator);
+  }
+  // Brotli does not report the size of BrotliEncoderState, which is not
+  // counted.
+}
+
 }  // namespace riegeli
@@ -22,6 +22,7 @@
 #include "absl/strings/string_view.h"
 #include "brotli/encode.h"
 #include "riegeli/base/base.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/bytes/buffered_writer.h"
 #include "riegeli/bytes/writer.h"
 
@@ -140,6 +141,8 @@ class BrotliWriter final : public BufferedWriter {
 
   bool Flush(FlushType flush_type) override;
 
+  void AddUniqueTo(MemoryEstimator* memory_estimator) const override;
+
  protected:
   void Done() override;
   bool WriteInternal(absl::string_view src) override;
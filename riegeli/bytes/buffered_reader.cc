@@ -24,6 +24,7 @@
 #include "absl/types/span.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/bytes/backward_writer.h"
 #include "riegeli/bytes/reader.h"
 #include "riegeli/bytes/writer.h"
@@ -286,4 +287,11 @@ void BufferedReader::ClearBuffer() {
   buffer_.RemoveSuffix(flat_buffer.size());
 }
 
+void BufferedReader::AddUniqueTo(MemoryEstimator* memory_estimator) const {
+  Reader::AddUniqueTo(memory_estimator);
+  memory_estimator->AddMemory(sizeof(BufferedReader) - sizeof(Reader) -
+                              sizeof(Chain));
+  buffer_.AddUniqueTo(memory_estimator);
+}
+
 }  // namespace riegeli
@@ -20,6 +20,7 @@
 
 #include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
 #include "riegeli/bytes/backward_writer.h"
 #include "riegeli/bytes/reader.h"
@@ -34,6 +35,9 @@ namespace riegeli {
 // BufferedReader accumulates data which has been pulled in a flat buffer.
 // Reading a large enough array bypasses the buffer.
 class BufferedReader : public Reader {
+ public:
+  void AddUniqueTo(MemoryEstimator* memory_estimator) const override;
+
  protected:
   // Creates a closed BufferedReader.
   BufferedReader() noexcept : Reader(State::kClosed) {}
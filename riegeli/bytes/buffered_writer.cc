@@ -21,6 +21,7 @@
 #include "absl/base/optimization.h"
 #include "absl/strings/string_view.h"
 #include "riegeli/base/base.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/bytes/writer.h"
 
 namespace riegeli {
@@ -67,4 +68,10 @@ bool BufferedWriter::WriteSlow(absl::string_view src) {
   return Writer::WriteSlow(src);
 }
 
+void BufferedWriter::AddUniqueTo(MemoryEstimator* memory_estimator) const {
+  Writer::AddUniqueTo(memory_estimator);
+  memory_estimator->AddMemory(sizeof(BufferedWriter) - sizeof(Writer));
+  if (start_ != nullptr) memory_estimator->AddMemory(buffer_size_);
+}
+
 }  // namespace riegeli
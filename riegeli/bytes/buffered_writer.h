@@ -21,6 +21,7 @@
 
 #include "absl/strings/string_view.h"
 #include "riegeli/base/base.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
 #include "riegeli/bytes/writer.h"
 
@@ -33,6 +34,9 @@ namespace riegeli {
 // BufferedWriter accumulates data to be pushed in a flat buffer. Writing a
 // large enough array bypasses the buffer.
 class BufferedWriter : public Writer {
+ public:
+  void AddUniqueTo(MemoryEstimator* memory_estimator) const override;
+
  protected:
   // Creates a closed BufferedWriter.
   BufferedWriter() noexcept : Writer(State::kClosed) {}
@@ -51,7 +51,7 @@ bool ChainBackwardWriter::PushSlow() {
     return FailOverflow();
   }
   start_pos_ = dest_->size();
-  const absl::Span<char> buffer = dest_->MakePrependBuffer(1, size_hint_);
+  const absl::Span<char> buffer = dest_->MakePrependBuffer(1, options_);
   start_ = buffer.data() + buffer.size();
   cursor_ = buffer.data() + buffer.size();
   limit_ = buffer.data();
@@ -72,7 +72,7 @@ bool ChainBackwardWriter::WriteSlow(absl::string_view src) {
     return FailOverflow();
   }
   DiscardBuffer();
-  dest_->Prepend(src, size_hint_);
+  dest_->Prepend(src, options_);
   MakeBuffer();
   return true;
 }
@@ -91,7 +91,7 @@ bool ChainBackwardWriter::WriteSlow(std::string&& src) {
     return FailOverflow();
   }
   DiscardBuffer();
-  dest_->Prepend(std::move(src), size_hint_);
+  dest_->Prepend(std::move(src), options_);
   MakeBuffer();
   return true;
 }
@@ -110,7 +110,7 @@ bool ChainBackwardWriter::WriteSlow(const Chain& src) {
     return FailOverflow();
   }
   DiscardBuffer();
-  dest_->Prepend(src, size_hint_);
+  dest_->Prepend(src, options_);
   MakeBuffer();
   return true;
 }
@@ -121,7 +121,7 @@ bool ChainBackwardWriter::WriteSlow(Chain&& src) {
          "length too small, use Write(Chain&&) instead";
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
   DiscardBuffer();
-  dest_->Prepend(std::move(src), size_hint_);
+  dest_->Prepend(std::move(src), options_);
   MakeBuffer();
   return true;
 }
@@ -49,10 +49,38 @@ class ChainBackwardWriter final : public BackwardWriter {
       return std::move(set_size_hint(size_hint));
     }
 
+    // Minimal size of a block of allocated data.
+    //
+    // This is used initially, while the destination is small.
+    //
+    // Default: Chain::Options::kDefaultMinBlockSize() (128)
+    Options& set_min_block_size(size_t min_block_size) & {
+      chain_options_.set_min_block_size(min_block_size);
+      return *this;
+    }
+    Options&& set_min_block_size(size_t min_block_size) && {
+      return std::move(set_min_block_size(min_block_size));
+    }
+
+    // Maximal size of a block of allocated data.
+    //
+    // Larger blocks make later iteration over the Chain faster, at the cost of
+    // allocating more memory ahead of data.
+    //
+    // Default: Chain::Options::kDefaultMaxBlockSize() (64K)
+    Options& set_max_block_size(size_t max_block_size) & {
+      chain_options_.set_max_block_size(max_block_size);
+      return *this;
+    }
+    Options&& set_max_block_size(size_t max_block_size) && {
+      return std::move(set_max_block_size(max_block_size));
+    }
+
    private:
     friend class ChainBackwardWriter;
 
     Position size_hint_ = 0;
+    Chain::Options chain_options_;
   };
 
   // Creates a closed ChainBackwardWriter.
@@ -90,7 +118,7 @@ class ChainBackwardWriter final : public BackwardWriter {
   //
   // Invariant: if healthy() then dest_ != nullptr
   Chain* dest_ = nullptr;
-  size_t size_hint_ = 0;
+  Chain::Options options_;
 
   // Invariants if healthy():
   //   limit_ == nullptr || limit_ == dest_->blocks().front().data()
@@ -102,8 +130,10 @@ class ChainBackwardWriter final : public BackwardWriter {
 inline ChainBackwardWriter::ChainBackwardWriter(Chain* dest, Options options)
     : BackwardWriter(State::kOpen),
       dest_(RIEGELI_ASSERT_NOTNULL(dest)),
-      size_hint_(
-          UnsignedMin(options.size_hint_, std::numeric_limits<size_t>::max())) {
+      options_(std::move(options.chain_options_)
+                   .set_size_hint(UnsignedMin(
+                       options.size_hint_,
+                       std::numeric_limits<size_t>::max()))) {
   start_pos_ = dest->size();
 }
 
@@ -111,13 +141,13 @@ inline ChainBackwardWriter::ChainBackwardWriter(
     ChainBackwardWriter&& src) noexcept
     : BackwardWriter(std::move(src)),
       dest_(riegeli::exchange(src.dest_, nullptr)),
-      size_hint_(riegeli::exchange(src.size_hint_, 0)) {}
+      options_(riegeli::exchange(src.options_, Chain::Options())) {}
 
 inline ChainBackwardWriter& ChainBackwardWriter::operator=(
     ChainBackwardWriter&& src) noexcept {
   BackwardWriter::operator=(std::move(src));
   dest_ = riegeli::exchange(src.dest_, nullptr);
-  size_hint_ = riegeli::exchange(src.size_hint_, 0);
+  options_ = riegeli::exchange(src.options_, Chain::Options());
   return *this;
 }
 
@@ -15,23 +15,29 @@
 #include "riegeli/bytes/chain_reader.h"
 
 #include <stddef.h>
+#include <algorithm>
 #include <limits>
 #include <utility>
+#include <vector>
 
 #include "absl/base/optimization.h"
 #include "absl/strings/string_view.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/bytes/backward_writer.h"
 #include "riegeli/bytes/reader.h"
 #include "riegeli/bytes/writer.h"
 
 namespace riegeli {
 
+constexpr size_t ChainReader::kMinBlocksForBlockLimits;
+
 void ChainReader::Done() {
   owned_src_ = Chain();
   src_ = &owned_src_;
   iter_ = src_->blocks().cbegin();
+  block_limits_ = std::vector<Position>();
   Reader::Done();
 }
 
@@ -188,7 +194,9 @@ bool ChainReader::SeekSlow(Position new_pos) {
     }
     RIEGELI_ASSERT(healthy()) << "Failed invariant of ChainReader: "
                                  "unhealthy but has non-zero source size";
-    if (src_->size() - new_pos < new_pos - limit_pos_) {
+    if (src_->blocks().size() >= kMinBlocksForBlockLimits) {
+      SeekUsingBlockLimits(new_pos);
+    } else if (src_->size() - new_pos < new_pos - limit_pos_) {
       // Iterate backwards from the end, it is closer.
       iter_ = src_->blocks().cend();
       limit_pos_ = src_->size();
@@ -219,7 +227,9 @@ bool ChainReader::SeekSlow(Position new_pos) {
     RIEGELI_ASSERT(healthy()) << "Failed invariant of ChainReader: "
                                  "unhealthy but has non-zero position";
     Position block_begin = start_pos();
-    if (new_pos < block_begin - new_pos) {
+    if (src_->blocks().size() >= kMinBlocksForBlockLimits) {
+      SeekUsingBlockLimits(new_pos);
+    } else if (new_pos < block_begin - new_pos) {
       // Iterate forwards from the beginning, it is closer.
       iter_ = src_->blocks().cbegin();
       limit_pos_ = iter_->size();
@@ -254,4 +264,38 @@ bool ChainReader::SeekSlow(Position new_pos) {
   return true;
 }
 
+inline void ChainReader::SeekUsingBlockLimits(Position new_pos) {
+  RIEGELI_ASSERT_LE(new_pos, src_->size())
+      << "Failed precondition of ChainReader::SeekUsingBlockLimits(): "
+         "position out of range";
+  if (block_limits_.empty()) {
+    block_limits_.reserve(src_->blocks().size());
+    Position limit = 0;
+    for (const absl::string_view block : src_->blocks()) {
+      limit += block.size();
+      block_limits_.push_back(limit);
+    }
+  }
+  RIEGELI_ASSERT_EQ(block_limits_.size(), src_->blocks().size())
+      << "ChainReader source changed unexpectedly";
+  // The first block ending at or after new_pos, like iterating block by block
+  // would find.
+  const size_t block_index = IntCast<size_t>(
+      std::lower_bound(block_limits_.begin(), block_limits_.end(), new_pos) -
+      block_limits_.begin());
+  RIEGELI_ASSERT_LT(block_index, block_limits_.size())
+      << "ChainReader source changed unexpectedly";
+  iter_ = src_->blocks().cbegin() + block_index;
+  limit_pos_ = block_limits_[block_index];
+}
+
+void ChainReader::AddUniqueTo(MemoryEstimator* memory_estimator) const {
+  Reader::AddUniqueTo(memory_estimator);
+  memory_estimator->AddMemory(sizeof(ChainReader) - sizeof(Reader) -
+                              sizeof(Chain));
+  owned_src_.AddUniqueTo(memory_estimator);
+  if (src_ != &owned_src_) src_->AddSharedTo(memory_estimator);
+  memory_estimator->AddMemory(sizeof(Position) * block_limits_.capacity());
+}
+
 }  // namespace riegeli
@@ -17,10 +17,12 @@
 
 #include <stddef.h>
 #include <utility>
+#include <vector>
 
 #include "absl/base/optimization.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
 #include "riegeli/bytes/backward_writer.h"
 #include "riegeli/bytes/reader.h"
@@ -44,8 +46,12 @@ class ChainReader final : public Reader {
   ChainReader(ChainReader&& src) noexcept;
   ChainReader& operator=(ChainReader&& src) noexcept;
 
+  // Returns the Chain being read from.
+  const Chain* src() const { return src_; }
+
   bool SupportsRandomAccess() const override { return true; }
   bool Size(Position* size) const override;
+  void AddUniqueTo(MemoryEstimator* memory_estimator) const override;
 
  protected:
   void Done() override;
@@ -57,8 +63,18 @@ class ChainReader final : public Reader {
   bool SeekSlow(Position new_pos) override;
 
  private:
+  // Seeking through fewer blocks than this iterates over blocks instead of
+  // building block_limits_.
+  static constexpr size_t kMinBlocksForBlockLimits = 16;
+
   ChainReader(ChainReader&& src, size_t block_index, size_t cursor_index);
 
+  // Sets iter_ and limit_pos_ to the block containing new_pos, using
+  // block_limits_, building it first if needed.
+  //
+  // Precondition: new_pos <= src_->size()
+  void SeekUsingBlockLimits(Position new_pos);
+
   // Invariant: if !healthy() then owned_src_.empty()
   Chain owned_src_;
   // Invariants:
@@ -67,6 +83,10 @@ class ChainReader final : public Reader {
   const Chain* src_ = &owned_src_;
   // Invariant: iter_ is an iterator into src_->blocks()
   Chain::BlockIterator iter_ = src_->blocks().cbegin();
+  // Either empty, or positions of ends of blocks of *src_, which make seeking
+  // a binary search. Built when seeking in a Chain with many blocks, because
+  // random access to large chunks was otherwise linear in their block count.
+  std::vector<Position> block_limits_;
 
   // Invariants:
   //   start_ == (iter_ == src_->blocks().cend() ? nullptr : iter_->data())
@@ -112,7 +132,9 @@ inline ChainReader::ChainReader(ChainReader&& src, size_t block_index,
       src_(src.src_ == &src.owned_src_
                ? &owned_src_
                : riegeli::exchange(src.src_, &src.owned_src_)),
-      iter_(src_->blocks().cbegin() + block_index) {
+      iter_(src_->blocks().cbegin() + block_index),
+      block_limits_(
+          riegeli::exchange(src.block_limits_, std::vector<Position>())) {
   src.iter_ = src.src_->blocks().cbegin();
   if (iter_ != src_->blocks().cend()) {
     start_ = iter_->data();
@@ -137,6 +159,7 @@ inline ChainReader& ChainReader::operator=(ChainReader&& src) noexcept {
   // Set src.iter_ before iter_ to support self-assignment.
   src.iter_ = src.src_->blocks().cbegin();
   iter_ = src_->blocks().cbegin() + block_index;
+  block_limits_ = riegeli::exchange(src.block_limits_, std::vector<Position>());
   if (iter_ != src_->blocks().cend()) {
     start_ = iter_->data();
     cursor_ = start_ + cursor_index;
@@ -24,6 +24,7 @@
 #include "absl/types/span.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/bytes/writer.h"
 
 namespace riegeli {
@@ -51,7 +52,7 @@ bool ChainWriter::PushSlow() {
     return FailOverflow();
   }
   start_pos_ = dest_->size();
-  const absl::Span<char> buffer = dest_->MakeAppendBuffer(1, size_hint_);
+  const absl::Span<char> buffer = dest_->MakeAppendBuffer(1, options_);
   start_ = buffer.data();
   cursor_ = buffer.data();
   limit_ = buffer.data() + buffer.size();
@@ -72,7 +73,7 @@ bool ChainWriter::WriteSlow(absl::string_view src) {
     return FailOverflow();
   }
   DiscardBuffer();
-  dest_->Append(src, size_hint_);
+  dest_->Append(src, options_);
   MakeBuffer();
   return true;
 }
@@ -91,7 +92,7 @@ bool ChainWriter::WriteSlow(std::string&& src) {
     return FailOverflow();
   }
   DiscardBuffer();
-  dest_->Append(std::move(src), size_hint_);
+  dest_->Append(std::move(src), options_);
   MakeBuffer();
   return true;
 }
@@ -110,7 +111,7 @@ bool ChainWriter::WriteSlow(const Chain& src) {
     return FailOverflow();
   }
   DiscardBuffer();
-  dest_->Append(src, size_hint_);
+  dest_->Append(src, options_);
   MakeBuffer();
   return true;
 }
@@ -121,7 +122,7 @@ bool ChainWriter::WriteSlow(Chain&& src) {
          "length too small, use Write(Chain&&) instead";
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
   DiscardBuffer();
-  dest_->Append(std::move(src), size_hint_);
+  dest_->Append(std::move(src), options_);
   MakeBuffer();
   return true;
 }
@@ -148,4 +149,10 @@ inline void ChainWriter::MakeBuffer() {
   limit_ = buffer.data() + buffer.size();
 }
 
+void ChainWriter::AddUniqueTo(MemoryEstimator* memory_estimator) const {
+  Writer::AddUniqueTo(memory_estimator);
+  memory_estimator->AddMemory(sizeof(ChainWriter) - sizeof(Writer));
+  if (dest_ != nullptr) dest_->AddSharedTo(memory_estimator);
+}
+
 }  // namespace riegeli
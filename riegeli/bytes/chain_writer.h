@@ -23,6 +23,7 @@
 #include "absl/strings/string_view.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
 #include "riegeli/bytes/writer.h"
 
@@ -49,10 +50,38 @@ class ChainWriter final : public Writer {
       return std::move(set_size_hint(size_hint));
     }
 
+    // Minimal size of a block of allocated data.
+    //
+    // This is used initially, while the destination is small.
+    //
+    // Default: Chain::Options::kDefaultMinBlockSize() (128)
+    Options& set_min_block_size(size_t min_block_size) & {
+      chain_options_.set_min_block_size(min_block_size);
+      return *this;
+    }
+    Options&& set_min_block_size(size_t min_block_size) && {
+      return std::move(set_min_block_size(min_block_size));
+    }
+
+    // Maximal size of a block of allocated data.
+    //
+    // Larger blocks make later iteration over the Chain faster, at the cost of
+    // allocating more memory ahead of data.
+    //
+    // Default: Chain::Options::kDefaultMaxBlockSize() (64K)
+    Options& set_max_block_size(size_t max_block_size) & {
+      chain_options_.set_max_block_size(max_block_size);
+      return *this;
+    }
+    Options&& set_max_block_size(size_t max_block_size) && {
+      return std::move(set_max_block_size(max_block_size));
+    }
+
    private:
     friend class ChainWriter;
 
     Position size_hint_ = 0;
+    Chain::Options chain_options_;
   };
 
   // Creates a closed ChainWriter.
@@ -67,6 +96,7 @@ class ChainWriter final : public Writer {
   ChainWriter& operator=(ChainWriter&& src) noexcept;
 
   bool Flush(FlushType flush_type) override;
+  void AddUniqueTo(MemoryEstimator* memory_estimator) const override;
 
  protected:
   void Done() override;
@@ -92,7 +122,7 @@ class ChainWriter final : public Writer {
   //
   // Invariant: if healthy() then dest_ != nullptr
   Chain* dest_ = nullptr;
-  size_t size_hint_ = 0;
+  Chain::Options options_;
 
   // Invariants if healthy():
   //   limit_ == nullptr || limit_ == dest_->blocks().back().data() +
@@ -105,20 +135,22 @@ class ChainWriter final : public Writer {
 inline ChainWriter::ChainWriter(Chain* dest, Options options)
     : Writer(State::kOpen),
       dest_(RIEGELI_ASSERT_NOTNULL(dest)),
-      size_hint_(
-          UnsignedMin(options.size_hint_, std::numeric_limits<size_t>::max())) {
+      options_(std::move(options.chain_options_)
+                   .set_size_hint(UnsignedMin(
+                       options.size_hint_,
+                       std::numeric_limits<size_t>::max()))) {
   start_pos_ = dest->size();
 }
 
 inline ChainWriter::ChainWriter(ChainWriter&& src) noexcept
     : Writer(std::move(src)),
       dest_(riegeli::exchange(src.dest_, nullptr)),
-      size_hint_(riegeli::exchange(src.size_hint_, 0)) {}
+      options_(riegeli::exchange(src.options_, Chain::Options())) {}
 
 inline ChainWriter& ChainWriter::operator=(ChainWriter&& src) noexcept {
   Writer::operator=(std::move(src));
   dest_ = riegeli::exchange(src.dest_, nullptr);
-  size_hint_ = riegeli::exchange(src.size_hint_, 0);
+  options_ = riegeli::exchange(src.options_, Chain::Options());
   return *this;
 }
 
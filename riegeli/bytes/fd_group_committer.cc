@@ -0,0 +1,146 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/bytes/fd_group_committer.h"
+
+#include <stdint.h>
+#include <unistd.h>
+#include <cerrno>
+#include <future>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "absl/memory/memory.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "riegeli/base/base.h"
+
+namespace riegeli {
+
+namespace {
+
+// Makes data written to fd durable. Returns false on failure.
+// Returns 0 on success, or errno of the failed sync.
+int SyncData(int fd) {
+  for (;;) {
+#ifdef __linux__
+    // fdatasync() skips metadata which is not needed to read the data back,
+    // e.g. the modification time, saving a disk write.
+    const int result = fdatasync(fd);
+#else
+    const int result = fsync(fd);
+#endif
+    if (ABSL_PREDICT_TRUE(result == 0)) return 0;
+    if (errno != EINTR) return errno;
+  }
+}
+
+}  // namespace
+
+FdGroupCommitter::FdGroupCommitter(int fd, absl::Duration window)
+    : fd_(fd), window_(window) {
+  RIEGELI_ASSERT(window >= absl::ZeroDuration() &&
+                 window < absl::InfiniteDuration())
+      << "Failed precondition of FdGroupCommitter::FdGroupCommitter(): "
+         "window negative or infinite";
+  thread_ = std::thread([this] { SyncLoop(); });
+}
+
+FdGroupCommitter::~FdGroupCommitter() {
+  {
+    absl::MutexLock lock(&mutex_);
+    exiting_ = true;
+  }
+  thread_.join();
+}
+
+std::shared_future<bool> FdGroupCommitter::Commit() {
+  absl::MutexLock lock(&mutex_);
+  RIEGELI_ASSERT(!exiting_)
+      << "Failed precondition of FdGroupCommitter::Commit(): "
+         "FdGroupCommitter is being destroyed";
+  if (pending_ == nullptr) {
+    pending_ = absl::make_unique<std::promise<bool>>();
+    pending_future_ = pending_->get_future().share();
+    pending_since_ = absl::Now();
+  }
+  return pending_future_;
+}
+
+void FdGroupCommitter::Commit(std::promise<bool> done) {
+  absl::MutexLock lock(&mutex_);
+  RIEGELI_ASSERT(!exiting_)
+      << "Failed precondition of FdGroupCommitter::Commit(): "
+         "FdGroupCommitter is being destroyed";
+  if (pending_ == nullptr) {
+    pending_ = absl::make_unique<std::promise<bool>>();
+    pending_future_ = pending_->get_future().share();
+    pending_since_ = absl::Now();
+  }
+  pending_promises_.push_back(std::move(done));
+}
+
+uint64_t FdGroupCommitter::num_syncs() const {
+  absl::MutexLock lock(&mutex_);
+  return num_syncs_;
+}
+
+int FdGroupCommitter::error_code() const {
+  absl::MutexLock lock(&mutex_);
+  return error_code_;
+}
+
+void FdGroupCommitter::SyncLoop() {
+  for (;;) {
+    std::unique_ptr<std::promise<bool>> batch;
+    std::vector<std::promise<bool>> batch_promises;
+    bool failed_before;
+    {
+      absl::MutexLock lock(&mutex_);
+      mutex_.Await(absl::Condition(
+          +[](FdGroupCommitter* self) {
+            self->mutex_.AssertHeld();
+            return self->pending_ != nullptr || self->exiting_;
+          },
+          this));
+      if (pending_ == nullptr) return;
+      // Let more commits join the batch until the window ends. Exiting cuts
+      // the window short, but the batch is still synced.
+      mutex_.AwaitWithDeadline(absl::Condition(&exiting_),
+                               pending_since_ + window_);
+      batch = std::move(pending_);
+      batch_promises = std::move(pending_promises_);
+      pending_promises_.clear();
+      pending_future_ = std::shared_future<bool>();
+      failed_before = error_code_ != 0;
+      if (!failed_before) ++num_syncs_;
+    }
+    bool synced = false;
+    if (!failed_before) {
+      const int error_code = SyncData(fd_);
+      synced = error_code == 0;
+      if (ABSL_PREDICT_FALSE(!synced)) {
+        absl::MutexLock lock(&mutex_);
+        error_code_ = error_code;
+      }
+    }
+    batch->set_value(synced);
+    for (std::promise<bool>& done : batch_promises) done.set_value(synced);
+  }
+}
+
+}  // namespace riegeli
@@ -0,0 +1,112 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_BYTES_FD_GROUP_COMMITTER_H_
+#define RIEGELI_BYTES_FD_GROUP_COMMITTER_H_
+
+#include <stdint.h>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+
+namespace riegeli {
+
+// FdGroupCommitter makes data written to a file descriptor durable, coalescing
+// requests from many threads into fewer fdatasync() calls:
+//
+//   FdGroupCommitter committer(fd, absl::Milliseconds(2));
+//   ...
+//   // In each request, after writing its data to fd:
+//   std::shared_future<bool> durable = committer.Commit();
+//   ...  // Release locks.
+//   if (!durable.get()) { ... }
+//
+// The first Commit() after a sync starts a window of the given length. Commits
+// requested until the window ends share one fdatasync(), which runs in a
+// background thread. A Commit() requested while a sync is in progress waits
+// for the next one, because data it covers might have been written after the
+// sync started.
+//
+// RecordWriter::Options::set_group_committer() uses this for
+// RecordWriter::Flush(FlushType::kFromMachine) and RecordWriter::FlushAsync().
+class FdGroupCommitter {
+ public:
+  // Will make data written to fd durable. The fd must be kept open as long as
+  // the FdGroupCommitter is used.
+  //
+  // window is how long to wait after the first request for more requests to
+  // share the same sync. It can be zero, in which case only requests
+  // arriving while a sync is in progress are coalesced.
+  //
+  // Precondition: window >= 0 and finite
+  explicit FdGroupCommitter(int fd,
+                            absl::Duration window = absl::ZeroDuration());
+
+  FdGroupCommitter(const FdGroupCommitter&) = delete;
+  FdGroupCommitter& operator=(const FdGroupCommitter&) = delete;
+
+  // Completes pending commits and joins the background thread.
+  ~FdGroupCommitter();
+
+  // Requests that data written to the fd so far be made durable.
+  //
+  // The returned future becomes ready when they are durable, with true, or
+  // when syncing failed, with false. It is shared by all commits coalesced
+  // into the same sync. After a failure, error_code() tells the reason.
+  std::shared_future<bool> Commit();
+
+  // Like Commit(), but fulfils done instead of returning a future, so that the
+  // caller does not have to keep a future alive until the sync completes.
+  void Commit(std::promise<bool> done);
+
+  // Returns the number of syncs performed so far, for monitoring how well
+  // commits are coalesced.
+  uint64_t num_syncs() const;
+
+  // Returns errno of the first failed sync, or 0 if no sync failed.
+  //
+  // After a sync fails, later commits fail too without syncing: the kernel may
+  // have dropped the data which failed to be written, so a later successful
+  // sync would not make them durable.
+  int error_code() const;
+
+ private:
+  void SyncLoop();
+
+  int fd_;
+  absl::Duration window_;
+  mutable absl::Mutex mutex_;
+  // The batch of commits which have been requested but whose sync has not
+  // started yet, or nullptr if there are none.
+  std::unique_ptr<std::promise<bool>> pending_ GUARDED_BY(mutex_);
+  std::shared_future<bool> pending_future_ GUARDED_BY(mutex_);
+  // Promises passed to Commit(std::promise<bool>) which are fulfilled together
+  // with pending_.
+  std::vector<std::promise<bool>> pending_promises_ GUARDED_BY(mutex_);
+  // When the first commit of pending_ was requested.
+  absl::Time pending_since_ GUARDED_BY(mutex_);
+  uint64_t num_syncs_ GUARDED_BY(mutex_) = 0;
+  int error_code_ GUARDED_BY(mutex_) = 0;
+  bool exiting_ GUARDED_BY(mutex_) = false;
+  std::thread thread_;
+};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_BYTES_FD_GROUP_COMMITTER_H_
@@ -0,0 +1,110 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Make file offsets 64-bit even on 32-bit systems.
+#undef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+
+#include "riegeli/bytes/fd_growth_waiter.h"
+
+#include <poll.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <algorithm>
+#include <limits>
+#include <string>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "riegeli/base/base.h"
+
+namespace riegeli {
+
+FdGrowthWaiter::FdGrowthWaiter(int fd, absl::Duration poll_interval)
+    : fd_(fd), poll_interval_(poll_interval), size_(CurrentSize()) {
+  RIEGELI_ASSERT(poll_interval > absl::ZeroDuration() &&
+                 poll_interval < absl::InfiniteDuration())
+      << "Failed precondition of FdGrowthWaiter::FdGrowthWaiter(): "
+         "poll interval not positive and finite";
+#ifdef __linux__
+  inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd_ >= 0) {
+    // inotify watches paths, and /proc/self/fd/<fd> resolves to the file
+    // itself even if it was renamed.
+    const std::string path = absl::StrCat("/proc/self/fd/", fd);
+    if (inotify_add_watch(inotify_fd_, path.c_str(),
+                          IN_MODIFY | IN_CLOSE_WRITE) < 0) {
+      close(inotify_fd_);
+      inotify_fd_ = -1;
+    }
+  }
+#endif
+}
+
+FdGrowthWaiter::~FdGrowthWaiter() {
+  if (inotify_fd_ >= 0) close(inotify_fd_);
+}
+
+int64_t FdGrowthWaiter::CurrentSize() const {
+  struct stat stat_info;
+  if (ABSL_PREDICT_FALSE(fstat(fd_, &stat_info) < 0)) return -1;
+  return IntCast<int64_t>(stat_info.st_size);
+}
+
+bool FdGrowthWaiter::Wait(absl::Duration timeout) {
+  const absl::Time deadline = absl::Now() + timeout;
+  for (;;) {
+    const int64_t size = CurrentSize();
+    if (size != size_ || size < 0) {
+      size_ = size;
+      return true;
+    }
+    const absl::Time now = absl::Now();
+    if (now >= deadline) return false;
+    WaitForEvent(std::min(poll_interval_, deadline - now));
+  }
+}
+
+void FdGrowthWaiter::WaitForEvent(absl::Duration wait) {
+  if (inotify_fd_ < 0) {
+    absl::SleepFor(wait);
+    return;
+  }
+  // Round up, so that the deadline is not missed by a fraction of a
+  // millisecond and followed by a busy loop.
+  const int64_t wait_millis = absl::ToInt64Milliseconds(
+      wait + absl::Milliseconds(1) - absl::Nanoseconds(1));
+  struct pollfd poll_fd;
+  poll_fd.fd = inotify_fd_;
+  poll_fd.events = POLLIN;
+  poll_fd.revents = 0;
+  // Errors, including EINTR, are treated like a timeout: the size is checked
+  // again anyway.
+  poll(&poll_fd, 1,
+       IntCast<int>(UnsignedMin(IntCast<uint64_t>(wait_millis),
+                                uint64_t{std::numeric_limits<int>::max()})));
+  // Discard pending events. Their details do not matter because the size is
+  // checked again.
+  char buffer[4096];
+  while (read(inotify_fd_, buffer, sizeof(buffer)) > 0) {
+  }
+}
+
+}  // namespace riegeli
@@ -0,0 +1,81 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_BYTES_FD_GROWTH_WAITER_H_
+#define RIEGELI_BYTES_FD_GROWTH_WAITER_H_
+
+#include <stdint.h>
+
+#include "absl/time/time.h"
+#include "riegeli/base/base.h"
+
+namespace riegeli {
+
+// FdGrowthWaiter waits until a file changes size, for following a file which
+// is being appended to, e.g. with RecordReader::Options::set_tail_wait():
+//
+//   FdGrowthWaiter waiter(fd);
+//   RecordReader record_reader(
+//       absl::make_unique<FdReader>(fd),
+//       RecordReader::Options().set_tail_wait(
+//           [&] {
+//             waiter.Wait(absl::Seconds(1));
+//             return !stop;
+//           }));
+//
+// On Linux the waiter is woken up by inotify as soon as the file is modified.
+// Independently of that, the size is checked every poll_interval, which is the
+// only mechanism if inotify is not available.
+//
+// The size observed by the previous Wait() (or by the constructor) is the
+// reference point, so growth between Wait() calls is not missed.
+class FdGrowthWaiter {
+ public:
+  // Will wait for changes of the file open as fd. The fd must be kept open as
+  // long as the FdGrowthWaiter is used.
+  //
+  // Precondition: poll_interval > 0 and finite
+  explicit FdGrowthWaiter(int fd,
+                          absl::Duration poll_interval = absl::Seconds(1));
+
+  FdGrowthWaiter(const FdGrowthWaiter&) = delete;
+  FdGrowthWaiter& operator=(const FdGrowthWaiter&) = delete;
+
+  ~FdGrowthWaiter();
+
+  // Blocks until the size of the file differs from the size observed by the
+  // previous Wait(), or until timeout passes.
+  //
+  // Return values:
+  //  * true  - the size changed, or it could not be determined
+  //  * false - timeout passed
+  bool Wait(absl::Duration timeout = absl::InfiniteDuration());
+
+ private:
+  // Returns the current size of the file, or -1 if it could not be determined.
+  int64_t CurrentSize() const;
+
+  // Blocks until the file is modified or wait passes.
+  void WaitForEvent(absl::Duration wait);
+
+  int fd_;
+  absl::Duration poll_interval_;
+  int64_t size_;
+  // inotify instance watching the file, or -1 if inotify is not used.
+  int inotify_fd_ = -1;
+};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_BYTES_FD_GROWTH_WAITER_H_
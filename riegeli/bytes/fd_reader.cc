@@ -31,13 +31,21 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <cerrno>
+#include <cstring>
+#include <deque>
 #include <limits>
+#include <memory>
 #include <string>
+#include <thread>
 #include <utility>
+#include <vector>
 
 #include "absl/base/optimization.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/memory/memory.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
 #include "riegeli/base/memory_estimator.h"
@@ -148,6 +156,7 @@ void FdReaderBase::Done() {
     FailOperation(FdHolder::CloseFunctionName(), error_code);
   }
   // filename_ and error_code_ are not cleared.
+  rate_limiter_ = nullptr;
   BufferedReader::Done();
 }
 
@@ -160,24 +169,230 @@ inline bool FdReaderBase::FailOperation(absl::string_view operation,
 
 }  // namespace internal
 
+// ReadAhead keeps reads following the current position in flight, each issued
+// by one of helper threads with pread(). Reads are consumed in the order of
+// positions by PRead(), which has the semantics of pread() as long as it is
+// called for consecutive positions. Reading from another position discards
+// reads in flight and starts reading ahead from that position.
+class FdReader::ReadAhead {
+ public:
+  ReadAhead(int fd, int depth, size_t size);
+
+  ReadAhead(const ReadAhead&) = delete;
+  ReadAhead& operator=(const ReadAhead&) = delete;
+
+  // Waits for reads in flight to complete.
+  ~ReadAhead();
+
+  // Like pread(), but returns data read ahead. On failure returns -1 and sets
+  // *error_code to the errno value.
+  ssize_t PRead(char* dest, size_t length, Position pos, int* error_code);
+
+ private:
+  // A read in flight or completed.
+  struct Segment {
+    // The length requested.
+    size_t max_length = 0;
+    // Valid if done.
+    std::unique_ptr<char[]> data;
+    size_t length = 0;
+    int error_code = 0;
+    // The length already returned by PRead().
+    size_t consumed = 0;
+    bool done = false;
+  };
+
+  void WorkerLoop();
+
+  // Discards reads in flight, to be started again from pos.
+  void Restart(Position pos) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  int fd_;
+  size_t depth_;
+  size_t size_;
+  std::vector<std::thread> workers_;
+  absl::Mutex mutex_;
+  bool exiting_ GUARDED_BY(mutex_) = false;
+  // If true, nothing is read ahead until PRead() is called.
+  bool stopped_ GUARDED_BY(mutex_) = true;
+  // Incremented when segments_ are discarded, so that reads in flight can
+  // recognize that their results are no longer needed.
+  uint64_t generation_ GUARDED_BY(mutex_) = 0;
+  // Position corresponding to the data which will be returned next.
+  Position consumed_pos_ GUARDED_BY(mutex_) = 0;
+  // Position to be read by the next read started.
+  Position next_pos_ GUARDED_BY(mutex_) = 0;
+  // Reads in flight or completed, in the order of positions, at most depth_.
+  // References to elements remain valid until the element is removed or
+  // generation_ changes.
+  std::deque<Segment> segments_ GUARDED_BY(mutex_);
+};
+
+FdReader::ReadAhead::ReadAhead(int fd, int depth, size_t size)
+    : fd_(fd), depth_(IntCast<size_t>(depth)), size_(size) {
+  workers_.reserve(depth_);
+  for (size_t i = 0; i < depth_; ++i) {
+    workers_.emplace_back([this] { WorkerLoop(); });
+  }
+}
+
+FdReader::ReadAhead::~ReadAhead() {
+  {
+    absl::MutexLock lock(&mutex_);
+    exiting_ = true;
+  }
+  for (std::thread& worker : workers_) worker.join();
+}
+
+void FdReader::ReadAhead::WorkerLoop() {
+  mutex_.Lock();
+  for (;;) {
+    mutex_.Await(absl::Condition(
+        +[](ReadAhead* self) {
+          self->mutex_.AssertHeld();
+          return self->exiting_ ||
+                 (!self->stopped_ && self->segments_.size() < self->depth_ &&
+                  self->next_pos_ <
+                      Position{std::numeric_limits<off_t>::max()});
+        },
+        this));
+    if (exiting_) break;
+    segments_.emplace_back();
+    Segment& segment = segments_.back();
+    segment.max_length = IntCast<size_t>(UnsignedMin(
+        size_, Position{std::numeric_limits<off_t>::max()} - next_pos_));
+    const size_t max_length = segment.max_length;
+    const Position pos = next_pos_;
+    next_pos_ += max_length;
+    const uint64_t generation = generation_;
+    mutex_.Unlock();
+    std::unique_ptr<char[]> data(new char[max_length]);
+    ssize_t result;
+    int error_code = 0;
+  again:
+    result = pread(fd_, data.get(),
+                   UnsignedMin(max_length,
+                               size_t{std::numeric_limits<ssize_t>::max()}),
+                   IntCast<off_t>(pos));
+    if (ABSL_PREDICT_FALSE(result < 0)) {
+      error_code = errno;
+      if (error_code == EINTR) goto again;
+    }
+    mutex_.Lock();
+    if (generation == generation_) {
+      segment.data = std::move(data);
+      segment.length = result < 0 ? size_t{0} : IntCast<size_t>(result);
+      segment.error_code = error_code;
+      segment.done = true;
+    }
+  }
+  mutex_.Unlock();
+}
+
+inline void FdReader::ReadAhead::Restart(Position pos) {
+  segments_.clear();
+  ++generation_;
+  consumed_pos_ = pos;
+  next_pos_ = pos;
+  stopped_ = false;
+}
+
+ssize_t FdReader::ReadAhead::PRead(char* dest, size_t length, Position pos,
+                                   int* error_code) {
+  absl::MutexLock lock(&mutex_);
+  if (stopped_ || pos != consumed_pos_) Restart(pos);
+  mutex_.Await(absl::Condition(
+      +[](std::deque<Segment>* segments) {
+        return !segments->empty() && segments->front().done;
+      },
+      &segments_));
+  Segment& segment = segments_.front();
+  if (ABSL_PREDICT_FALSE(segment.error_code != 0)) {
+    *error_code = segment.error_code;
+    // Reading will be retried from the same position.
+    Restart(consumed_pos_);
+    stopped_ = true;
+    return -1;
+  }
+  const size_t length_read =
+      UnsignedMin(length, segment.length - segment.consumed);
+  if (length_read > 0) {  // memcpy(nullptr, _, 0) is undefined.
+    std::memcpy(dest, segment.data.get() + segment.consumed, length_read);
+  }
+  segment.consumed += length_read;
+  consumed_pos_ += length_read;
+  if (segment.consumed == segment.length) {
+    if (segment.length < segment.max_length) {
+      // The source ends, possibly only for now. Reads following this segment
+      // are discarded, and reading will be retried from consumed_pos_.
+      Restart(consumed_pos_);
+      stopped_ = true;
+    } else {
+      segments_.pop_front();
+    }
+  }
+  return IntCast<ssize_t>(length_read);
+}
+
+FdReader::FdReader() noexcept {}
+
 FdReader::FdReader(int fd, Options options)
     : FdReaderBase(fd, options.owns_fd_, options.buffer_size_),
-      sync_pos_(options.sync_pos_) {
+      sync_pos_(options.sync_pos_),
+      drop_cache_behind_(options.drop_cache_behind_) {
+  rate_limiter_ = options.rate_limiter_;
+  rate_priority_ = options.rate_priority_;
   InitializePos();
+  if (options.async_read_ahead_ > 0 && ABSL_PREDICT_TRUE(healthy())) {
+    read_ahead_ = absl::make_unique<ReadAhead>(fd_, options.async_read_ahead_,
+                                               buffer_size_);
+  }
 }
 
 FdReader::FdReader(std::string filename, int flags, Options options)
     : FdReaderBase(std::move(filename), flags, options.buffer_size_),
-      sync_pos_(options.sync_pos_) {
+      sync_pos_(options.sync_pos_),
+      drop_cache_behind_(options.drop_cache_behind_) {
+  rate_limiter_ = options.rate_limiter_;
+  rate_priority_ = options.rate_priority_;
   RIEGELI_ASSERT(options.owns_fd_)
       << "Failed precondition of FdReader::FdReader(string): "
          "file must be owned if FdReader opens it";
-  if (ABSL_PREDICT_TRUE(healthy())) InitializePos();
+  if (ABSL_PREDICT_FALSE(!healthy())) return;
+  InitializePos();
+  if (options.async_read_ahead_ > 0 && ABSL_PREDICT_TRUE(healthy())) {
+    read_ahead_ = absl::make_unique<ReadAhead>(fd_, options.async_read_ahead_,
+                                               buffer_size_);
+  }
+}
+
+FdReader::FdReader(FdReader&& src) noexcept
+    : internal::FdReaderBase(std::move(src)),
+      sync_pos_(riegeli::exchange(src.sync_pos_, false)),
+      drop_cache_behind_(riegeli::exchange(src.drop_cache_behind_, 0)),
+      dropped_end_(riegeli::exchange(src.dropped_end_, 0)),
+      read_ahead_(std::move(src.read_ahead_)) {}
+
+FdReader& FdReader::operator=(FdReader&& src) noexcept {
+  // read_ahead_ must be assigned before the fd is closed by
+  // FdReaderBase::operator=() because its threads may be using the fd.
+  read_ahead_ = std::move(src.read_ahead_);
+  internal::FdReaderBase::operator=(std::move(src));
+  sync_pos_ = riegeli::exchange(src.sync_pos_, false);
+  drop_cache_behind_ = riegeli::exchange(src.drop_cache_behind_, 0);
+  dropped_end_ = riegeli::exchange(src.dropped_end_, 0);
+  return *this;
 }
 
+FdReader::~FdReader() {}
+
 void FdReader::Done() {
+  // Reads in flight must complete before the fd is closed.
+  read_ahead_.reset();
   internal::FdReaderBase::Done();
   sync_pos_ = false;
+  drop_cache_behind_ = 0;
+  dropped_end_ = 0;
 }
 
 inline void FdReader::InitializePos() {
@@ -189,6 +404,21 @@ inline void FdReader::InitializePos() {
     }
     limit_pos_ = IntCast<Position>(result);
   }
+  dropped_end_ = limit_pos_;
+}
+
+inline void FdReader::DropCacheBehind() {
+#ifdef POSIX_FADV_DONTNEED
+  if (limit_pos_ < dropped_end_ ||
+      limit_pos_ - dropped_end_ < 2 * drop_cache_behind_) {
+    return;
+  }
+  const Position drop_end = limit_pos_ - drop_cache_behind_;
+  // This is only a hint, so its failure is ignored.
+  posix_fadvise(fd_, IntCast<off_t>(dropped_end_),
+                IntCast<off_t>(drop_end - dropped_end_), POSIX_FADV_DONTNEED);
+  dropped_end_ = drop_end;
+#endif
 }
 
 bool FdReader::MaybeSyncPos() {
@@ -216,20 +446,32 @@ bool FdReader::ReadInternal(char* dest, size_t min_length, size_t max_length) {
     return FailOverflow();
   }
   for (;;) {
-  again:
-    const ssize_t result = pread(
-        fd_, dest,
-        UnsignedMin(max_length, size_t{std::numeric_limits<ssize_t>::max()}),
-        IntCast<off_t>(limit_pos_));
-    if (ABSL_PREDICT_FALSE(result < 0)) {
-      const int error_code = errno;
-      if (error_code == EINTR) goto again;
-      return FailOperation("pread()", error_code);
+    WaitForRateLimiter();
+    const size_t length_to_read =
+        UnsignedMin(max_length, size_t{std::numeric_limits<ssize_t>::max()});
+    ssize_t result;
+    if (read_ahead_ != nullptr) {
+      int error_code;
+      result =
+          read_ahead_->PRead(dest, length_to_read, limit_pos_, &error_code);
+      if (ABSL_PREDICT_FALSE(result < 0)) {
+        return FailOperation("pread()", error_code);
+      }
+    } else {
+    again:
+      result = pread(fd_, dest, length_to_read, IntCast<off_t>(limit_pos_));
+      if (ABSL_PREDICT_FALSE(result < 0)) {
+        const int error_code = errno;
+        if (error_code == EINTR) goto again;
+        return FailOperation("pread()", error_code);
+      }
     }
     if (ABSL_PREDICT_FALSE(result == 0)) return false;
     RIEGELI_ASSERT_LE(IntCast<size_t>(result), max_length)
         << "pread() read more than requested";
     limit_pos_ += IntCast<size_t>(result);
+    ConsumeRateLimiter(IntCast<size_t>(result));
+    if (drop_cache_behind_ > 0) DropCacheBehind();
     if (IntCast<size_t>(result) >= min_length) return true;
     dest += result;
     min_length -= IntCast<size_t>(result);
@@ -258,6 +500,9 @@ bool FdReader::SeekSlow(Position new_pos) {
   }
   ClearBuffer();
   limit_pos_ = new_pos;
+  // Pages skipped by seeking were not read by this FdReader, so they are not
+  // dropped.
+  dropped_end_ = new_pos;
   PullSlow();
   return true;
 }
@@ -273,6 +518,8 @@ bool FdReader::Size(Position* size) const {
 
 FdStreamReader::FdStreamReader(int fd, Options options)
     : FdReaderBase(fd, true, options.buffer_size_) {
+  rate_limiter_ = options.rate_limiter_;
+  rate_priority_ = options.rate_priority_;
   RIEGELI_ASSERT(options.has_assumed_pos_)
       << "Failed precondition of FdStreamReader::FdStreamReader(int): "
          "assumed file position must be specified "
@@ -282,6 +529,8 @@ FdStreamReader::FdStreamReader(int fd, Options options)
 
 FdStreamReader::FdStreamReader(std::string filename, int flags, Options options)
     : FdReaderBase(std::move(filename), flags, options.buffer_size_) {
+  rate_limiter_ = options.rate_limiter_;
+  rate_priority_ = options.rate_priority_;
   if (ABSL_PREDICT_FALSE(!healthy())) return;
   limit_pos_ = options.assumed_pos_;
 }
@@ -303,6 +552,7 @@ bool FdStreamReader::ReadInternal(char* dest, size_t min_length,
     return FailOverflow();
   }
   for (;;) {
+    WaitForRateLimiter();
   again:
     const ssize_t result = read(
         fd_, dest,
@@ -310,12 +560,17 @@ bool FdStreamReader::ReadInternal(char* dest, size_t min_length,
     if (ABSL_PREDICT_FALSE(result < 0)) {
       const int error_code = errno;
       if (error_code == EINTR) goto again;
+      // The fd is non-blocking and no data are available yet. This is reported
+      // like the end of a growing file: healthy() and HopeForMore() remain
+      // true.
+      if (error_code == EAGAIN || error_code == EWOULDBLOCK) return false;
       return FailOperation("read()", error_code);
     }
     if (ABSL_PREDICT_FALSE(result == 0)) return false;
     RIEGELI_ASSERT_LE(IntCast<size_t>(result), max_length)
         << "read() read more than requested";
     limit_pos_ += IntCast<size_t>(result);
+    ConsumeRateLimiter(IntCast<size_t>(result));
     if (IntCast<size_t>(result) >= min_length) return true;
     dest += result;
     min_length -= IntCast<size_t>(result);
@@ -354,6 +609,11 @@ again:
 
 void FdMMapReader::Done() {
   contents_ = Chain();
+  const int error_code = owned_fd_.Close();
+  if (ABSL_PREDICT_FALSE(error_code != 0) && ABSL_PREDICT_TRUE(healthy())) {
+    FailOperation(internal::FdHolder::CloseFunctionName(), error_code);
+  }
+  fd_ = -1;
   // filename_ and error_code_ are not cleared.
   Reader::Done();
 }
@@ -366,20 +626,41 @@ inline void FdMMapReader::Initialize(int fd, Options options) {
     FailOperation("fstat()", error_code);
     return;
   }
-  if (ABSL_PREDICT_FALSE(IntCast<Position>(stat_info.st_size) >
-                         std::numeric_limits<size_t>::max())) {
+  file_size_ = IntCast<Position>(stat_info.st_size);
+  sequential_ = options.sequential_;
+  populate_ = options.populate_;
+  if (options.window_size_ > 0 && file_size_ > options.window_size_) {
+    const Position page_size = IntCast<Position>(sysconf(_SC_PAGESIZE));
+    window_size_ =
+        (options.window_size_ + page_size - 1) / page_size * page_size;
+    owned_fd_ = std::move(owned_fd);
+    fd_ = fd;
+    MapWindow(0);
+    return;
+  }
+  if (ABSL_PREDICT_FALSE(file_size_ > std::numeric_limits<size_t>::max())) {
     Fail("File is too large for mmap()");
     return;
   }
-  if (stat_info.st_size != 0) {
-    void* const data = mmap(nullptr, IntCast<size_t>(stat_info.st_size),
-                            PROT_READ, MAP_SHARED, fd, 0);
+  if (file_size_ != 0) {
+    int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    if (populate_) flags |= MAP_POPULATE;
+#endif
+    void* const data =
+        mmap(nullptr, IntCast<size_t>(file_size_), PROT_READ, flags, fd, 0);
     if (ABSL_PREDICT_FALSE(data == MAP_FAILED)) {
       const int error_code = errno;
       FailOperation("mmap()", error_code);
       return;
     }
-    contents_.AppendExternal(MMapRef(data, IntCast<size_t>(stat_info.st_size)));
+#ifdef MADV_SEQUENTIAL
+    // This is only a hint, so its failure is ignored.
+    if (sequential_) {
+      madvise(data, IntCast<size_t>(file_size_), MADV_SEQUENTIAL);
+    }
+#endif
+    contents_.AppendExternal(MMapRef(data, IntCast<size_t>(file_size_)));
     start_ = iter()->data();
     cursor_ = iter()->data();
     limit_ = iter()->data() + iter()->size();
@@ -391,6 +672,69 @@ inline void FdMMapReader::Initialize(int fd, Options options) {
   }
 }
 
+bool FdMMapReader::MapWindow(Position new_pos) {
+  RIEGELI_ASSERT(windowed())
+      << "Failed precondition of FdMMapReader::MapWindow(): not windowed";
+  RIEGELI_ASSERT_LE(new_pos, file_size_)
+      << "Failed precondition of FdMMapReader::MapWindow(): "
+         "position exceeds file size";
+  // Release the previous window first, so that two windows are not mapped at
+  // the same time unless data read from the previous one are still referred
+  // to.
+  contents_.Clear();
+  start_ = nullptr;
+  cursor_ = nullptr;
+  limit_ = nullptr;
+  if (new_pos == file_size_) {
+    limit_pos_ = new_pos;
+    return true;
+  }
+  // The window starts at a multiple of window_size_, which is a multiple of
+  // the page size, as required for the offset of mmap().
+  const Position window_begin = new_pos - new_pos % window_size_;
+  if (ABSL_PREDICT_FALSE(window_begin >
+                         Position{std::numeric_limits<off_t>::max()})) {
+    limit_pos_ = window_begin;
+    return FailOverflow();
+  }
+  const size_t length =
+      IntCast<size_t>(UnsignedMin(window_size_, file_size_ - window_begin));
+  int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+  if (populate_) flags |= MAP_POPULATE;
+#endif
+  void* const data = mmap(nullptr, length, PROT_READ, flags, fd_,
+                          IntCast<off_t>(window_begin));
+  if (ABSL_PREDICT_FALSE(data == MAP_FAILED)) {
+    const int error_code = errno;
+    limit_pos_ = window_begin;
+    return FailOperation("mmap()", error_code);
+  }
+  if (sequential_) {
+    // These are only hints, so their failure is ignored.
+#ifdef MADV_SEQUENTIAL
+    madvise(data, length, MADV_SEQUENTIAL);
+#endif
+#ifdef POSIX_FADV_WILLNEED
+    // Start reading the next window in the background, so that reaching it
+    // does not block on page faults.
+    const Position next_begin = window_begin + length;
+    if (next_begin < file_size_) {
+      posix_fadvise(
+          fd_, IntCast<off_t>(next_begin),
+          IntCast<off_t>(UnsignedMin(window_size_, file_size_ - next_begin)),
+          POSIX_FADV_WILLNEED);
+    }
+#endif
+  }
+  contents_.AppendExternal(MMapRef(data, length));
+  start_ = iter()->data();
+  cursor_ = start_ + IntCast<size_t>(new_pos - window_begin);
+  limit_ = start_ + iter()->size();
+  limit_pos_ = window_begin + iter()->size();
+  return true;
+}
+
 inline bool FdMMapReader::FailOperation(absl::string_view operation,
                                         int error_code) {
   error_code_ = error_code;
@@ -408,44 +752,51 @@ bool FdMMapReader::PullSlow() {
   RIEGELI_ASSERT_EQ(available(), 0u)
       << "Failed precondition of Reader::PullSlow(): "
          "data available, use Pull() instead";
-  return false;
+  if (!windowed() || ABSL_PREDICT_FALSE(!healthy()) ||
+      limit_pos_ == file_size_) {
+    return false;
+  }
+  return MapWindow(limit_pos_) && available() > 0;
 }
 
 bool FdMMapReader::ReadSlow(Chain* dest, size_t length) {
   RIEGELI_ASSERT_GT(length, UnsignedMin(available(), kMaxBytesToCopy()))
       << "Failed precondition of Reader::ReadSlow(Chain*): "
          "length too small, use Read(Chain*) instead";
-  const size_t length_to_read = UnsignedMin(length, available());
-  if (ABSL_PREDICT_TRUE(length_to_read > 0)) {  // iter() is undefined if
-                                                // contents_.blocks().size()
-                                                //     != 1.
-    const size_t size_hint = dest->size() + length_to_read;
+  const size_t size_hint = dest->size() + length;
+  do {
+    if (available() == 0 && ABSL_PREDICT_FALSE(!PullSlow())) return false;
+    const size_t length_to_read = UnsignedMin(length, available());
     iter().AppendSubstrTo(absl::string_view(cursor_, length_to_read), dest,
                           size_hint);
     cursor_ += length_to_read;
-  }
-  return length_to_read == length;
+    length -= length_to_read;
+  } while (length > 0);
+  return true;
 }
 
 bool FdMMapReader::CopyToSlow(Writer* dest, Position length) {
   RIEGELI_ASSERT_GT(length, UnsignedMin(available(), kMaxBytesToCopy()))
       << "Failed precondition of Reader::CopyToSlow(Writer*): "
          "length too small, use CopyTo(Writer*) instead";
-  const size_t length_to_copy = UnsignedMin(length, available());
-  bool ok = true;
-  if (length_to_copy == contents_.size()) {
-    cursor_ = limit_;
-    ok = dest->Write(contents_);
-  } else if (ABSL_PREDICT_TRUE(length_to_copy > 0)) {  // iter() is undefined if
-                                                       // contents_.blocks()
-                                                       //     .size() != 1.
-    Chain data;
-    iter().AppendSubstrTo(absl::string_view(cursor_, length_to_copy), &data,
-                          length_to_copy);
-    cursor_ += length_to_copy;
-    ok = dest->Write(std::move(data));
-  }
-  return ok && length_to_copy == length;
+  do {
+    if (available() == 0 && ABSL_PREDICT_FALSE(!PullSlow())) return false;
+    const size_t length_to_copy = UnsignedMin(length, available());
+    bool ok;
+    if (length_to_copy == contents_.size()) {
+      cursor_ = limit_;
+      ok = dest->Write(contents_);
+    } else {
+      Chain data;
+      iter().AppendSubstrTo(absl::string_view(cursor_, length_to_copy), &data,
+                            length_to_copy);
+      cursor_ += length_to_copy;
+      ok = dest->Write(std::move(data));
+    }
+    if (ABSL_PREDICT_FALSE(!ok)) return false;
+    length -= length_to_copy;
+  } while (length > 0);
+  return true;
 }
 
 bool FdMMapReader::CopyToSlow(BackwardWriter* dest, size_t length) {
@@ -453,8 +804,17 @@ bool FdMMapReader::CopyToSlow(BackwardWriter* dest, size_t length) {
       << "Failed precondition of Reader::CopyToSlow(BackwardWriter*): "
          "length too small, use CopyTo(BackwardWriter*) instead";
   if (ABSL_PREDICT_FALSE(length > available())) {
-    cursor_ = limit_;
-    return false;
+    if (!windowed() || ABSL_PREDICT_FALSE(!healthy()) ||
+        length > file_size_ - pos()) {
+      if (windowed() && healthy()) MapWindow(file_size_);
+      cursor_ = limit_;
+      return false;
+    }
+    // The data span windows. Gather them first, because BackwardWriter
+    // needs them all at once.
+    Chain data;
+    if (ABSL_PREDICT_FALSE(!ReadSlow(&data, length))) return false;
+    return dest->Write(std::move(data));
   }
   if (length == contents_.size()) {
     cursor_ = limit_;
@@ -468,7 +828,7 @@ bool FdMMapReader::CopyToSlow(BackwardWriter* dest, size_t length) {
 
 bool FdMMapReader::Size(Position* size) const {
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
-  *size = contents_.size();
+  *size = file_size_;
   return true;
 }
 
@@ -476,18 +836,28 @@ bool FdMMapReader::HopeForMoreSlow() const {
   RIEGELI_ASSERT_EQ(available(), 0u)
       << "Failed precondition of Reader::HopeForMoreSlow(): "
          "data available, use HopeForMore() instead";
-  return false;
+  return windowed() && healthy() && limit_pos_ < file_size_;
 }
 
 bool FdMMapReader::SeekSlow(Position new_pos) {
-  RIEGELI_ASSERT_EQ(start_pos(), 0u)
-      << "Failed invariant of FdMMapReader: non-zero position of buffer start";
-  RIEGELI_ASSERT(new_pos > limit_pos_)
+  RIEGELI_ASSERT(new_pos < start_pos() || new_pos > limit_pos_)
       << "Failed precondition of Reader::SeekSlow(): "
          "position in the buffer, use Seek() instead";
-  // Seeking forwards. Source ends.
-  cursor_ = limit_;
-  return false;
+  if (!windowed()) {
+    RIEGELI_ASSERT_EQ(start_pos(), 0u)
+        << "Failed invariant of FdMMapReader: "
+           "non-zero position of buffer start";
+    // Seeking forwards. Source ends.
+    cursor_ = limit_;
+    return false;
+  }
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (new_pos > file_size_) {
+    // File ends.
+    MapWindow(file_size_);
+    return false;
+  }
+  return MapWindow(new_pos);
 }
 
 }  // namespace riegeli
@@ -17,6 +17,7 @@
 
 #include <fcntl.h>
 #include <stddef.h>
+#include <memory>
 #include <string>
 #include <utility>
 
@@ -28,6 +29,7 @@
 #include "riegeli/bytes/backward_writer.h"
 #include "riegeli/bytes/buffered_reader.h"
 #include "riegeli/bytes/fd_holder.h"
+#include "riegeli/bytes/rate_limiter.h"
 #include "riegeli/bytes/reader.h"
 #include "riegeli/bytes/writer.h"
 
@@ -59,6 +61,15 @@ class FdReaderBase : public BufferedReader {
                                          int error_code);
   virtual bool MaybeSyncPos() { return true; }
 
+  // Waits for rate_limiter_ before reading, unless it is nullptr.
+  void WaitForRateLimiter() {
+    if (rate_limiter_ != nullptr) rate_limiter_->Wait(rate_priority_);
+  }
+  // Reports length bytes read to rate_limiter_, unless it is nullptr.
+  void ConsumeRateLimiter(size_t length) {
+    if (rate_limiter_ != nullptr) rate_limiter_->Consume(length);
+  }
+
   FdHolder owned_fd_;
   int fd_ = -1;
   std::string filename_;
@@ -66,6 +77,9 @@ class FdReaderBase : public BufferedReader {
   //
   // Invariant: if healthy() then error_code_ == 0
   int error_code_ = 0;
+  // If not nullptr, limits the bandwidth of reading.
+  RateLimiter* rate_limiter_ = nullptr;
+  RateLimiter::Priority rate_priority_ = RateLimiter::Priority::kBackground;
 
   // Invariants:
   //   limit_pos_ <= numeric_limits<off_t>::max()
@@ -126,16 +140,78 @@ class FdReader final : public internal::FdReaderBase {
       return std::move(set_sync_pos(sync_pos));
     }
 
+    // If depth > 0, FdReader reads ahead in background: up to depth reads of
+    // buffer_size bytes following the current position are kept in flight,
+    // each issued by its own helper thread, and their results are handed to
+    // the FdReader as they complete. This hides latency of the file system
+    // when reading sequentially, at the cost of reading data which might not
+    // be needed, e.g. before seeking.
+    //
+    // Default: 0 (no read ahead).
+    Options& set_async_read_ahead(int depth) & {
+      RIEGELI_ASSERT_GE(depth, 0)
+          << "Failed precondition of "
+             "FdReader::Options::set_async_read_ahead(): "
+             "negative depth";
+      async_read_ahead_ = depth;
+      return *this;
+    }
+    Options&& set_async_read_ahead(int depth) && {
+      return std::move(set_async_read_ahead(depth));
+    }
+
+    // If window > 0, FdReader drops pages of the file from the page cache
+    // behind the read position with posix_fadvise(POSIX_FADV_DONTNEED), in
+    // steps of window bytes, keeping the last window cached for seeking back
+    // a little. This keeps reading a large file once sequentially, e.g. by a
+    // batch job, from evicting data which other processes need.
+    //
+    // Pages are dropped for all users of the file, so this should not be used
+    // for files which are read concurrently elsewhere.
+    //
+    // Default: 0 (pages are not dropped).
+    Options& set_drop_cache_behind(Position window) & {
+      drop_cache_behind_ = window;
+      return *this;
+    }
+    Options&& set_drop_cache_behind(Position window) && {
+      return std::move(set_drop_cache_behind(window));
+    }
+
+    // Specifies a RateLimiter, possibly shared with other readers and writers,
+    // which limits the bandwidth of reading with the given priority. The
+    // RateLimiter must be kept alive until the FdReader is closed.
+    //
+    // If nullptr, reading is not limited.
+    //
+    // Default: nullptr
+    Options& set_rate_limiter(RateLimiter* rate_limiter,
+                              RateLimiter::Priority priority =
+                                  RateLimiter::Priority::kBackground) & {
+      rate_limiter_ = rate_limiter;
+      rate_priority_ = priority;
+      return *this;
+    }
+    Options&& set_rate_limiter(RateLimiter* rate_limiter,
+                               RateLimiter::Priority priority =
+                                   RateLimiter::Priority::kBackground) && {
+      return std::move(set_rate_limiter(rate_limiter, priority));
+    }
+
    private:
     friend class FdReader;
 
     bool owns_fd_ = true;
     size_t buffer_size_ = kDefaultBufferSize();
     bool sync_pos_ = false;
+    int async_read_ahead_ = 0;
+    Position drop_cache_behind_ = 0;
+    RateLimiter* rate_limiter_ = nullptr;
+    RateLimiter::Priority rate_priority_ = RateLimiter::Priority::kBackground;
   };
 
   // Creates a closed FdReader.
-  FdReader() noexcept {}
+  FdReader() noexcept;
 
   // Will read from fd, starting at its beginning (or current file position if
   // options.set_sync_pos(true) is used).
@@ -152,6 +228,8 @@ class FdReader final : public internal::FdReaderBase {
   FdReader(FdReader&& src) noexcept;
   FdReader& operator=(FdReader&& src) noexcept;
 
+  ~FdReader();
+
   bool SupportsRandomAccess() const override { return true; }
   bool Size(Position* size) const override;
 
@@ -162,9 +240,22 @@ class FdReader final : public internal::FdReaderBase {
   bool SeekSlow(Position new_pos) override;
 
  private:
+  class ReadAhead;
+
   void InitializePos();
 
+  // Drops pages before limit_pos_ - drop_cache_behind_ from the page cache if
+  // at least drop_cache_behind_ bytes of them are not dropped yet.
+  void DropCacheBehind();
+
   bool sync_pos_ = false;
+  // Options::set_drop_cache_behind(), or 0 if pages are not dropped.
+  Position drop_cache_behind_ = 0;
+  // Position before which pages were dropped, or from which reading started.
+  Position dropped_end_ = 0;
+  // Reads in flight if Options::set_async_read_ahead() was used, otherwise
+  // nullptr.
+  std::unique_ptr<ReadAhead> read_ahead_;
 };
 
 // A Reader which reads from a file descriptor which does not have to support
@@ -172,6 +263,13 @@ class FdReader final : public internal::FdReaderBase {
 //
 // Multiple FdStreamReaders may not be used with the same fd at the same time.
 // Reads occur at the current file position (using read()).
+//
+// The fd can be non-blocking (O_NONBLOCK), e.g. a socket served by an event
+// loop. If no data are available, reading returns false with healthy() and
+// HopeForMore() remaining true, and can be retried when the fd becomes
+// readable. A RecordReader reading from such an FdStreamReader treats this like
+// the end of a growing file: an incomplete chunk is kept until the rest of it
+// arrives.
 class FdStreamReader final : public internal::FdReaderBase {
  public:
   class Options {
@@ -209,12 +307,34 @@ class FdStreamReader final : public internal::FdReaderBase {
       return std::move(set_assumed_pos(assumed_pos));
     }
 
+    // Specifies a RateLimiter, possibly shared with other readers and writers,
+    // which limits the bandwidth of reading with the given priority. The
+    // RateLimiter must be kept alive until the FdStreamReader is closed.
+    //
+    // If nullptr, reading is not limited.
+    //
+    // Default: nullptr
+    Options& set_rate_limiter(RateLimiter* rate_limiter,
+                              RateLimiter::Priority priority =
+                                  RateLimiter::Priority::kBackground) & {
+      rate_limiter_ = rate_limiter;
+      rate_priority_ = priority;
+      return *this;
+    }
+    Options&& set_rate_limiter(RateLimiter* rate_limiter,
+                               RateLimiter::Priority priority =
+                                   RateLimiter::Priority::kBackground) && {
+      return std::move(set_rate_limiter(rate_limiter, priority));
+    }
+
    private:
     friend class FdStreamReader;
 
     size_t buffer_size_ = kDefaultBufferSize();
     bool has_assumed_pos_ = false;
     Position assumed_pos_ = 0;
+    RateLimiter* rate_limiter_ = nullptr;
+    RateLimiter::Priority rate_priority_ = RateLimiter::Priority::kBackground;
   };
 
   // Creates a closed FdStreamReader.
@@ -240,11 +360,15 @@ class FdStreamReader final : public internal::FdReaderBase {
 };
 
 // A Reader which reads from a file descriptor by mapping the whole file to
-// memory. It supports random access; the file descriptor must support mmap()
-// and fstat(). The file must not be changed while data read from the file is
-// accessed.
+// memory, or a window of it at a time. It supports random access; the file
+// descriptor must support mmap() and fstat(). The file must not be changed
+// while data read from the file is accessed.
 //
 // Multiple FdMMapReaders can read concurrently from the same fd.
+//
+// Read(string_view*) and Read(Chain*) return data referring to the mapped
+// memory, without copying it. A window stays mapped while such data refer to
+// it.
 class FdMMapReader final : public Reader {
  public:
   class Options {
@@ -254,9 +378,12 @@ class FdMMapReader final : public Reader {
     Options() noexcept {}
 
     // If true, the fd will be owned by the FdMMapReader and will be closed
-    // after construction.
+    // after construction, or when the FdMMapReader is closed if
+    // set_window_size() is used.
     //
-    // If false, the fd will not be closed by the FdMMapReader.
+    // If false, the fd will not be closed by the FdMMapReader. If
+    // set_window_size() is used, the fd must be kept open until the
+    // FdMMapReader is closed.
     //
     // In any case, the memory mapped region is usable even after the fd is
     // closed.
@@ -270,10 +397,58 @@ class FdMMapReader final : public Reader {
       return std::move(set_owns_fd(owns_fd));
     }
 
+    // If true, the kernel is advised that the mapped region will be read
+    // sequentially (madvise(MADV_SEQUENTIAL)), so that it reads ahead
+    // aggressively and drops pages soon after they are read. This suits
+    // scanning a whole file once, but hurts random access.
+    //
+    // Default: false.
+    Options& set_sequential(bool sequential) & {
+      sequential_ = sequential;
+      return *this;
+    }
+    Options&& set_sequential(bool sequential) && {
+      return std::move(set_sequential(sequential));
+    }
+
+    // If 0, the whole file is mapped at once.
+    //
+    // Otherwise, a file larger than window_size is mapped one window of about
+    // window_size bytes at a time, and a window is unmapped when reading moves
+    // past it. This bounds the address space and resident memory used for
+    // large files. If set_sequential(true) is also used, the kernel is asked to
+    // read the next window ahead while the current one is being read.
+    //
+    // Default: 0
+    Options& set_window_size(Position window_size) & {
+      window_size_ = window_size;
+      return *this;
+    }
+    Options&& set_window_size(Position window_size) && {
+      return std::move(set_window_size(window_size));
+    }
+
+    // If true, mapped memory is populated eagerly (MAP_POPULATE), i.e. the
+    // contents of the file, or of each window, are read when it is mapped
+    // rather than when pages are first accessed. This avoids a storm of page
+    // faults for data which will be read anyway.
+    //
+    // Default: false
+    Options& set_populate(bool populate) & {
+      populate_ = populate;
+      return *this;
+    }
+    Options&& set_populate(bool populate) && {
+      return std::move(set_populate(populate));
+    }
+
    private:
     friend class FdMMapReader;
 
     bool owns_fd_ = true;
+    bool sequential_ = false;
+    Position window_size_ = 0;
+    bool populate_ = false;
   };
 
   // Creates a closed FdMMapReader.
@@ -310,10 +485,16 @@ class FdMMapReader final : public Reader {
 
  private:
   void Initialize(int fd, Options options);
+  // Maps the window containing new_pos and positions the cursor at new_pos.
+  //
+  // Precondition: windowed() && new_pos <= file_size_
+  bool MapWindow(Position new_pos);
 
   ABSL_ATTRIBUTE_COLD bool FailOperation(absl::string_view operation,
                                          int error_code);
 
+  bool windowed() const { return window_size_ > 0; }
+
   // Iterator pointing to the block of contents_ which holds the actual data.
   //
   // Precondition: contents_.blocks().size() == 1
@@ -324,12 +505,22 @@ class FdMMapReader final : public Reader {
   //
   // Invariant: if healthy() then error_code_ == 0
   int error_code_ = 0;
+  // The whole file, or the current window if windowed().
   Chain contents_;
+  Position file_size_ = 0;
+  // The remaining fields are used only if windowed(), i.e. if the file is
+  // mapped one window at a time. Otherwise window_size_ == 0 and fd_ == -1.
+  internal::FdHolder owned_fd_;
+  int fd_ = -1;
+  // Window size, rounded up to a multiple of the page size.
+  Position window_size_ = 0;
+  bool sequential_ = false;
+  bool populate_ = false;
 
   // Invariants:
   //   start_ == (contents_.blocks().empty() ? nullptr : iter()->data())
   //   buffer_size() == (contents_.blocks().empty() ? 0 : iter()->size())
-  //   start_pos() == 0
+  //   if !windowed() then start_pos() == 0
 };
 
 // Implementation details follow.
@@ -341,7 +532,9 @@ inline FdReaderBase::FdReaderBase(FdReaderBase&& src) noexcept
       owned_fd_(std::move(src.owned_fd_)),
       fd_(riegeli::exchange(src.fd_, -1)),
       filename_(riegeli::exchange(src.filename_, std::string())),
-      error_code_(riegeli::exchange(src.error_code_, 0)) {}
+      error_code_(riegeli::exchange(src.error_code_, 0)),
+      rate_limiter_(riegeli::exchange(src.rate_limiter_, nullptr)),
+      rate_priority_(src.rate_priority_) {}
 
 inline FdReaderBase& FdReaderBase::operator=(FdReaderBase&& src) noexcept {
   BufferedReader::operator=(std::move(src));
@@ -349,21 +542,13 @@ inline FdReaderBase& FdReaderBase::operator=(FdReaderBase&& src) noexcept {
   fd_ = riegeli::exchange(src.fd_, -1);
   filename_ = riegeli::exchange(src.filename_, std::string());
   error_code_ = riegeli::exchange(src.error_code_, 0);
+  rate_limiter_ = riegeli::exchange(src.rate_limiter_, nullptr);
+  rate_priority_ = src.rate_priority_;
   return *this;
 }
 
 }  // namespace internal
 
-inline FdReader::FdReader(FdReader&& src) noexcept
-    : internal::FdReaderBase(std::move(src)),
-      sync_pos_(riegeli::exchange(src.sync_pos_, false)) {}
-
-inline FdReader& FdReader::operator=(FdReader&& src) noexcept {
-  internal::FdReaderBase::operator=(std::move(src));
-  sync_pos_ = riegeli::exchange(src.sync_pos_, false);
-  return *this;
-}
-
 inline FdStreamReader::FdStreamReader(FdStreamReader&& src) noexcept
     : internal::FdReaderBase(std::move(src)) {}
 
@@ -377,13 +562,25 @@ inline FdMMapReader::FdMMapReader(FdMMapReader&& src) noexcept
     : Reader(std::move(src)),
       filename_(riegeli::exchange(src.filename_, std::string())),
       error_code_(riegeli::exchange(src.error_code_, 0)),
-      contents_(riegeli::exchange(src.contents_, Chain())) {}
+      contents_(riegeli::exchange(src.contents_, Chain())),
+      file_size_(riegeli::exchange(src.file_size_, 0)),
+      owned_fd_(std::move(src.owned_fd_)),
+      fd_(riegeli::exchange(src.fd_, -1)),
+      window_size_(riegeli::exchange(src.window_size_, 0)),
+      sequential_(riegeli::exchange(src.sequential_, false)),
+      populate_(riegeli::exchange(src.populate_, false)) {}
 
 inline FdMMapReader& FdMMapReader::operator=(FdMMapReader&& src) noexcept {
-  Reader::operator=(std::move(src)),
+  Reader::operator=(std::move(src));
   filename_ = riegeli::exchange(src.filename_, std::string());
   error_code_ = riegeli::exchange(src.error_code_, 0);
   contents_ = riegeli::exchange(src.contents_, Chain());
+  file_size_ = riegeli::exchange(src.file_size_, 0);
+  owned_fd_ = std::move(src.owned_fd_);
+  fd_ = riegeli::exchange(src.fd_, -1);
+  window_size_ = riegeli::exchange(src.window_size_, 0);
+  sequential_ = riegeli::exchange(src.sequential_, false);
+  populate_ = riegeli::exchange(src.populate_, false);
   return *this;
 }
 
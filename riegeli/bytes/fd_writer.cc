@@ -18,6 +18,11 @@
 #define _XOPEN_SOURCE 500
 #endif
 
+// Make pwritev(), O_DIRECT, fallocate(), and sync_file_range() available.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 // Make file offsets 64-bit even on 32-bit systems.
 #undef _FILE_OFFSET_BITS
 #define _FILE_OFFSET_BITS 64
@@ -25,19 +30,27 @@
 #include "riegeli/bytes/fd_writer.h"
 
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <stddef.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <cerrno>
+#include <cstring>
 #include <limits>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "absl/base/optimization.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/string_view.h"
 #include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/memory.h"
 #include "riegeli/base/str_error.h"
 #include "riegeli/bytes/buffered_writer.h"
 #include "riegeli/bytes/fd_holder.h"
@@ -87,6 +100,7 @@ void FdWriterBase::Done() {
     FailOperation(FdHolder::CloseFunctionName(), error_code);
   }
   // filename_ and error_code_ are not cleared.
+  rate_limiter_ = nullptr;
   BufferedWriter::Done();
 }
 
@@ -117,23 +131,72 @@ bool FdWriterBase::Flush(FlushType flush_type) {
 
 FdWriter::FdWriter(int fd, Options options)
     : FdWriterBase(fd, options.owns_fd_, options.buffer_size_),
-      sync_pos_(options.sync_pos_) {
+      sync_pos_(options.sync_pos_),
+      preallocate_increment_(options.preallocate_increment_),
+      drop_cache_behind_(options.drop_cache_behind_) {
+  rate_limiter_ = options.rate_limiter_;
+  rate_priority_ = options.rate_priority_;
   InitializePos(O_WRONLY | O_APPEND);
+  if (options.direct_io_ && ABSL_PREDICT_TRUE(healthy())) {
+    InitializeDirectIo(options.owns_fd_);
+  }
+  if (options.preallocate_initial_size_ > 0 && ABSL_PREDICT_TRUE(healthy())) {
+    preallocate_ = true;
+    Preallocate(
+        SaturatingAdd(start_pos_, options.preallocate_initial_size_));
+  }
 }
 
 FdWriter::FdWriter(std::string filename, int flags, Options options)
     : FdWriterBase(std::move(filename), flags, options.permissions_,
                    options.buffer_size_),
-      sync_pos_(options.sync_pos_) {
+      sync_pos_(options.sync_pos_),
+      preallocate_increment_(options.preallocate_increment_),
+      drop_cache_behind_(options.drop_cache_behind_) {
+  rate_limiter_ = options.rate_limiter_;
+  rate_priority_ = options.rate_priority_;
   RIEGELI_ASSERT(options.owns_fd_)
       << "Failed precondition of FdWriter::FdWriter(string): "
          "file must be owned if FdWriter opens it";
-  if (ABSL_PREDICT_TRUE(healthy())) InitializePos(flags);
+  if (ABSL_PREDICT_FALSE(!healthy())) return;
+  InitializePos(flags);
+  if (options.direct_io_ && ABSL_PREDICT_TRUE(healthy())) {
+    InitializeDirectIo(true);
+  }
+  if (options.preallocate_initial_size_ > 0 && ABSL_PREDICT_TRUE(healthy())) {
+    preallocate_ = true;
+    Preallocate(
+        SaturatingAdd(start_pos_, options.preallocate_initial_size_));
+  }
 }
 
 void FdWriter::Done() {
+  if (direct_io_ && ABSL_PREDICT_TRUE(PushInternal()) &&
+      direct_buffer_ != nullptr) {
+    WriteOutDirect(true);
+  }
+  if (clear_direct_io_) {
+    // The file status flags are shared with the fd which the caller keeps.
+    SetDirectIo(false);
+  }
+  if (preallocated_end_ > 0 && ABSL_PREDICT_TRUE(PushInternal())) {
+    TrimPreallocated();
+  }
   internal::FdWriterBase::Done();
   sync_pos_ = false;
+  direct_io_ = false;
+  clear_direct_io_ = false;
+  preallocate_ = false;
+  preallocate_increment_ = 0;
+  preallocated_end_ = 0;
+  drop_cache_behind_ = 0;
+  written_back_end_ = 0;
+  dropped_end_ = 0;
+  DeleteDirectBuffer();
+  direct_buffer_size_ = 0;
+  direct_buffer_pos_ = 0;
+  direct_begin_ = 0;
+  direct_end_ = 0;
 }
 
 inline void FdWriter::InitializePos(int flags) {
@@ -153,6 +216,117 @@ inline void FdWriter::InitializePos(int flags) {
     }
     start_pos_ = IntCast<Position>(stat_info.st_size);
   }
+  written_back_end_ = start_pos_;
+  dropped_end_ = start_pos_;
+}
+
+inline void FdWriter::InitializeDirectIo(bool owns_fd) {
+#ifdef O_DIRECT
+  if (!owns_fd) {
+    const int flags = fcntl(fd_, F_GETFL);
+    if (ABSL_PREDICT_FALSE(flags < 0)) {
+      FailOperation("fcntl()", errno);
+      return;
+    }
+    clear_direct_io_ = (flags & O_DIRECT) == 0;
+  }
+  if (ABSL_PREDICT_FALSE(!SetDirectIo(true))) return;
+  direct_io_ = true;
+#else
+  Fail("O_DIRECT is not supported on this platform");
+#endif
+}
+
+inline bool FdWriter::SetDirectIo(bool direct_io) {
+#ifdef O_DIRECT
+  const int flags = fcntl(fd_, F_GETFL);
+  if (ABSL_PREDICT_FALSE(flags < 0)) {
+    limit_ = start_;
+    return FailOperation("fcntl()", errno);
+  }
+  if (ABSL_PREDICT_FALSE(
+          fcntl(fd_, F_SETFL,
+                direct_io ? flags | O_DIRECT : flags & ~O_DIRECT) < 0)) {
+    limit_ = start_;
+    return FailOperation("fcntl()", errno);
+  }
+#endif
+  return true;
+}
+
+void FdWriter::Preallocate(Position end) {
+  RIEGELI_ASSERT(preallocate_)
+      << "Failed precondition of FdWriter::Preallocate(): "
+         "preallocation disabled";
+#ifdef FALLOC_FL_KEEP_SIZE
+  const Position begin = UnsignedMax(preallocated_end_, start_pos_);
+  const Position new_end = UnsignedMin(
+      UnsignedMax(end, SaturatingAdd(begin, preallocate_increment_)),
+      Position{std::numeric_limits<off_t>::max()});
+  if (new_end > begin) {
+  again:
+    if (ABSL_PREDICT_FALSE(fallocate(fd_, FALLOC_FL_KEEP_SIZE,
+                                     IntCast<off_t>(begin),
+                                     IntCast<off_t>(new_end - begin)) < 0)) {
+      if (errno == EINTR) goto again;
+      // Reserving space is only an optimization, and writing reports real
+      // errors.
+      preallocate_ = false;
+      return;
+    }
+    preallocated_end_ = new_end;
+  }
+  if (preallocate_increment_ == 0) preallocate_ = false;
+#else
+  preallocate_ = false;
+#endif
+}
+
+void FdWriter::TrimPreallocated() {
+  struct stat stat_info;
+  if (ABSL_PREDICT_FALSE(fstat(fd_, &stat_info) < 0)) {
+    FailOperation("fstat()", errno);
+    return;
+  }
+  if (preallocated_end_ <= IntCast<Position>(stat_info.st_size)) return;
+again:
+  // Truncating to the current size releases blocks reserved beyond it.
+  if (ABSL_PREDICT_FALSE(ftruncate(fd_, stat_info.st_size) < 0)) {
+    const int error_code = errno;
+    if (error_code == EINTR) goto again;
+    FailOperation("ftruncate()", error_code);
+  }
+}
+
+inline void FdWriter::DropCacheBehind(Position end) {
+#ifdef SYNC_FILE_RANGE_WRITE
+  if (end < written_back_end_ ||
+      end - written_back_end_ < drop_cache_behind_) {
+    return;
+  }
+  // These are only hints, so their failure is ignored. Errors of writeback
+  // are reported by fsync().
+  const Position new_written_back_end =
+      end - (end - written_back_end_) % drop_cache_behind_;
+  sync_file_range(fd_, IntCast<off_t>(written_back_end_),
+                  IntCast<off_t>(new_written_back_end - written_back_end_),
+                  SYNC_FILE_RANGE_WRITE);
+  written_back_end_ = new_written_back_end;
+  // Pages can be dropped only after their writeback completes. Lagging one
+  // window behind gives writeback time to complete, so that waiting for it
+  // rarely blocks.
+  const Position drop_end = written_back_end_ - drop_cache_behind_;
+  if (drop_end > dropped_end_) {
+    sync_file_range(fd_, IntCast<off_t>(dropped_end_),
+                    IntCast<off_t>(drop_end - dropped_end_),
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(fd_, IntCast<off_t>(dropped_end_),
+                  IntCast<off_t>(drop_end - dropped_end_),
+                  POSIX_FADV_DONTNEED);
+    dropped_end_ = drop_end;
+  }
+#endif
 }
 
 bool FdWriter::MaybeSyncPos() {
@@ -185,12 +359,23 @@ bool FdWriter::WriteInternal(absl::string_view src) {
     limit_ = start_;
     return FailOverflow();
   }
+  if (direct_io_) return WriteDirect(src);
+  if (ABSL_PREDICT_FALSE(!WriteToFd(src, start_pos_))) return false;
+  start_pos_ += src.size();
+  return true;
+}
+
+inline bool FdWriter::WriteToFd(absl::string_view src, Position pos) {
+  if (preallocate_ && pos + src.size() > preallocated_end_) {
+    Preallocate(pos + src.size());
+  }
   do {
+    WaitForRateLimiter();
   again:
     const ssize_t result = pwrite(
         fd_, src.data(),
         UnsignedMin(src.size(), size_t{std::numeric_limits<ssize_t>::max()}),
-        IntCast<off_t>(start_pos_));
+        IntCast<off_t>(pos));
     if (ABSL_PREDICT_FALSE(result < 0)) {
       const int error_code = errno;
       if (error_code == EINTR) goto again;
@@ -200,12 +385,174 @@ bool FdWriter::WriteInternal(absl::string_view src) {
     RIEGELI_ASSERT_GT(result, 0) << "pwrite() returned 0";
     RIEGELI_ASSERT_LE(IntCast<size_t>(result), src.size())
         << "pwrite() wrote more than requested";
-    start_pos_ += IntCast<size_t>(result);
+    ConsumeRateLimiter(IntCast<size_t>(result));
+    pos += IntCast<size_t>(result);
     src.remove_prefix(IntCast<size_t>(result));
   } while (!src.empty());
+  if (drop_cache_behind_ > 0) DropCacheBehind(pos);
   return true;
 }
 
+bool FdWriter::WriteSlow(const Chain& src) {
+  RIEGELI_ASSERT_GT(src.size(), UnsignedMin(available(), kMaxBytesToCopy()))
+      << "Failed precondition of Writer::WriteSlow(Chain): "
+         "length too small, use Write(Chain) instead";
+  if (direct_io_ || src.size() < buffer_size_) {
+    // Writing through the buffer is cheaper than a separate syscall.
+    return Writer::WriteSlow(src);
+  }
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(src.size() >
+                         Position{std::numeric_limits<off_t>::max()} - pos())) {
+    limit_ = start_;
+    return FailOverflow();
+  }
+  if (preallocate_ && pos() + src.size() > preallocated_end_) {
+    Preallocate(pos() + src.size());
+  }
+  // Write buffered data and blocks of src together.
+  std::vector<struct iovec> iov;
+  iov.reserve(1 + src.blocks().size());
+  const size_t buffered_length = written_to_buffer();
+  if (buffered_length > 0) iov.push_back(iovec{start_, buffered_length});
+  for (absl::string_view fragment : src.blocks()) {
+    // iovec is used for both reading and writing, so iov_base is not const.
+    if (!fragment.empty()) {
+      iov.push_back(
+          iovec{const_cast<char*>(fragment.data()), fragment.size()});
+    }
+  }
+  cursor_ = start_;
+  size_t index = 0;
+  while (index < iov.size()) {
+    WaitForRateLimiter();
+  again:
+    const ssize_t result =
+        pwritev(fd_, &iov[index],
+                IntCast<int>(UnsignedMin(iov.size() - index, size_t{IOV_MAX})),
+                IntCast<off_t>(start_pos_));
+    if (ABSL_PREDICT_FALSE(result < 0)) {
+      const int error_code = errno;
+      if (error_code == EINTR) goto again;
+      limit_ = start_;
+      return FailOperation("pwritev()", error_code);
+    }
+    RIEGELI_ASSERT_GT(result, 0) << "pwritev() returned 0";
+    ConsumeRateLimiter(IntCast<size_t>(result));
+    start_pos_ += IntCast<size_t>(result);
+    size_t length_written = IntCast<size_t>(result);
+    while (length_written > 0) {
+      RIEGELI_ASSERT_LT(index, iov.size())
+          << "pwritev() wrote more than requested";
+      if (length_written < iov[index].iov_len) {
+        iov[index].iov_base =
+            static_cast<char*>(iov[index].iov_base) + length_written;
+        iov[index].iov_len -= length_written;
+        break;
+      }
+      length_written -= iov[index].iov_len;
+      ++index;
+    }
+  }
+  if (drop_cache_behind_ > 0) DropCacheBehind(start_pos_);
+  return true;
+}
+
+inline bool FdWriter::WriteDirect(absl::string_view src) {
+  if (direct_buffer_ == nullptr) {
+    direct_buffer_size_ =
+        UnsignedMax(RoundUp<kDirectIoAlignment()>(buffer_size_),
+                    kDirectIoAlignment());
+    direct_buffer_ =
+        NewAligned<char, kDirectIoAlignment()>(direct_buffer_size_);
+    ResetDirectBuffer();
+  }
+  RIEGELI_ASSERT_EQ(direct_buffer_pos_ + direct_end_, start_pos_)
+      << "Failed invariant of FdWriter: "
+         "direct buffer does not end at the current position";
+  while (!src.empty()) {
+    if (direct_end_ == direct_buffer_size_) {
+      if (ABSL_PREDICT_FALSE(!WriteOutDirect(false))) return false;
+    }
+    const size_t length =
+        UnsignedMin(src.size(), direct_buffer_size_ - direct_end_);
+    std::memcpy(direct_buffer_ + direct_end_, src.data(), length);
+    direct_end_ += length;
+    start_pos_ += length;
+    src.remove_prefix(length);
+  }
+  return true;
+}
+
+bool FdWriter::WriteOutDirect(bool all) {
+  RIEGELI_ASSERT(direct_buffer_ != nullptr)
+      << "Failed precondition of FdWriter::WriteOutDirect(): "
+         "no direct buffer";
+  const size_t aligned_end = direct_end_ - direct_end_ % kDirectIoAlignment();
+  size_t begin = direct_begin_;
+  if (begin > 0) {
+    // The beginning of the first block is not staged, so the rest of the block
+    // cannot be written with O_DIRECT.
+    const size_t head_end = UnsignedMin(kDirectIoAlignment(), direct_end_);
+    if (head_end > begin) {
+      if (ABSL_PREDICT_FALSE(!SetDirectIo(false))) return false;
+      if (ABSL_PREDICT_FALSE(!WriteToFd(
+              absl::string_view(direct_buffer_ + begin, head_end - begin),
+              direct_buffer_pos_ + begin))) {
+        return false;
+      }
+      if (ABSL_PREDICT_FALSE(!SetDirectIo(true))) return false;
+    }
+    begin = head_end;
+  }
+  if (aligned_end > begin) {
+    if (ABSL_PREDICT_FALSE(!WriteToFd(
+            absl::string_view(direct_buffer_ + begin, aligned_end - begin),
+            direct_buffer_pos_ + begin))) {
+      return false;
+    }
+    begin = aligned_end;
+  }
+  if (all && direct_end_ > begin) {
+    if (ABSL_PREDICT_FALSE(!SetDirectIo(false))) return false;
+    if (ABSL_PREDICT_FALSE(!WriteToFd(
+            absl::string_view(direct_buffer_ + begin, direct_end_ - begin),
+            direct_buffer_pos_ + begin))) {
+      return false;
+    }
+    if (ABSL_PREDICT_FALSE(!SetDirectIo(true))) return false;
+  }
+  if (aligned_end > 0) {
+    // Keep the partial block at the end, to be written again with O_DIRECT
+    // when complete.
+    const size_t tail_length = direct_end_ - aligned_end;
+    std::memmove(direct_buffer_, direct_buffer_ + aligned_end, tail_length);
+    direct_buffer_pos_ += aligned_end;
+    direct_begin_ = 0;
+    direct_end_ = tail_length;
+  }
+  return true;
+}
+
+inline void FdWriter::ResetDirectBuffer() {
+  RIEGELI_ASSERT(direct_buffer_ != nullptr)
+      << "Failed precondition of FdWriter::ResetDirectBuffer(): "
+         "no direct buffer";
+  direct_begin_ = IntCast<size_t>(start_pos_ % kDirectIoAlignment());
+  direct_end_ = direct_begin_;
+  direct_buffer_pos_ = start_pos_ - direct_begin_;
+}
+
+bool FdWriter::Flush(FlushType flush_type) {
+  if (direct_io_) {
+    if (ABSL_PREDICT_FALSE(!PushInternal())) return false;
+    if (direct_buffer_ != nullptr) {
+      if (ABSL_PREDICT_FALSE(!WriteOutDirect(true))) return false;
+    }
+  }
+  return FdWriterBase::Flush(flush_type);
+}
+
 bool FdWriter::SeekSlow(Position new_pos) {
   RIEGELI_ASSERT(new_pos < start_pos_ || new_pos > pos())
       << "Failed precondition of Writer::SeekSlow(): "
@@ -213,6 +560,9 @@ bool FdWriter::SeekSlow(Position new_pos) {
   if (ABSL_PREDICT_FALSE(!PushInternal())) return false;
   RIEGELI_ASSERT_EQ(written_to_buffer(), 0u)
       << "BufferedWriter::PushInternal() did not empty the buffer";
+  if (direct_buffer_ != nullptr) {
+    if (ABSL_PREDICT_FALSE(!WriteOutDirect(true))) return false;
+  }
   if (new_pos >= start_pos_) {
     // Seeking forwards.
     struct stat stat_info;
@@ -224,10 +574,16 @@ bool FdWriter::SeekSlow(Position new_pos) {
     if (ABSL_PREDICT_FALSE(new_pos > IntCast<Position>(stat_info.st_size))) {
       // File ends.
       start_pos_ = IntCast<Position>(stat_info.st_size);
+      if (direct_buffer_ != nullptr) ResetDirectBuffer();
       return false;
     }
   }
   start_pos_ = new_pos;
+  if (direct_buffer_ != nullptr) ResetDirectBuffer();
+  // Pages around new_pos were not written by this FdWriter yet, so they are
+  // not dropped.
+  written_back_end_ = new_pos;
+  dropped_end_ = new_pos;
   return true;
 }
 
@@ -244,6 +600,9 @@ bool FdWriter::Truncate() {
   if (ABSL_PREDICT_FALSE(!PushInternal())) return false;
   RIEGELI_ASSERT_EQ(written_to_buffer(), 0u)
       << "BufferedWriter::PushInternal() did not empty the buffer";
+  if (direct_buffer_ != nullptr) {
+    if (ABSL_PREDICT_FALSE(!WriteOutDirect(true))) return false;
+  }
 again:
   if (ABSL_PREDICT_FALSE(ftruncate(fd_, IntCast<off_t>(start_pos_)) < 0)) {
     const int error_code = errno;
@@ -251,11 +610,15 @@ again:
     limit_ = start_;
     return FailOperation("ftruncate()", error_code);
   }
+  // ftruncate() released any space reserved beyond start_pos_.
+  preallocated_end_ = UnsignedMin(preallocated_end_, start_pos_);
   return true;
 }
 
 FdStreamWriter::FdStreamWriter(int fd, Options options)
     : FdWriterBase(fd, options.owns_fd_, options.buffer_size_) {
+  rate_limiter_ = options.rate_limiter_;
+  rate_priority_ = options.rate_priority_;
   RIEGELI_ASSERT(options.has_assumed_pos_)
       << "Failed precondition of FdStreamWriter::FdStreamWriter(int): "
          "assumed file position must be specified "
@@ -266,6 +629,8 @@ FdStreamWriter::FdStreamWriter(int fd, Options options)
 FdStreamWriter::FdStreamWriter(std::string filename, int flags, Options options)
     : FdWriterBase(std::move(filename), flags, options.permissions_,
                    options.buffer_size_) {
+  rate_limiter_ = options.rate_limiter_;
+  rate_priority_ = options.rate_priority_;
   RIEGELI_ASSERT(options.owns_fd_)
       << "Failed precondition of FdStreamWriter::FdStreamWriter(string): "
          "file must be owned if FdStreamWriter opens it";
@@ -283,6 +648,29 @@ FdStreamWriter::FdStreamWriter(std::string filename, int flags, Options options)
   }
 }
 
+void FdStreamWriter::Done() {
+  if (ABSL_PREDICT_TRUE(PushInternal())) {
+    while (!pending_.empty()) {
+      if (ABSL_PREDICT_FALSE(!WritePending())) break;
+      if (pending_.empty()) break;
+      // The fd is non-blocking and writing would block. Wait until it becomes
+      // writable, because there is no later opportunity to write.
+      struct pollfd poll_fd;
+      poll_fd.fd = fd_;
+      poll_fd.events = POLLOUT;
+      poll_fd.revents = 0;
+      if (ABSL_PREDICT_FALSE(poll(&poll_fd, 1, -1) < 0)) {
+        const int error_code = errno;
+        if (error_code == EINTR) continue;
+        FailOperation("poll()", error_code);
+        break;
+      }
+    }
+  }
+  pending_ = Chain();
+  internal::FdWriterBase::Done();
+}
+
 bool FdStreamWriter::WriteInternal(absl::string_view src) {
   RIEGELI_ASSERT(!src.empty())
       << "Failed precondition of BufferedWriter::WriteInternal(): "
@@ -299,24 +687,242 @@ bool FdStreamWriter::WriteInternal(absl::string_view src) {
     limit_ = start_;
     return FailOverflow();
   }
-  do {
-  again:
+  if (ABSL_PREDICT_FALSE(!pending_.empty())) {
+    if (ABSL_PREDICT_FALSE(!WritePending())) {
+      limit_ = start_;
+      return false;
+    }
+  }
+  start_pos_ += src.size();
+  if (ABSL_PREDICT_TRUE(pending_.empty())) {
+    if (ABSL_PREDICT_FALSE(!WriteNonBlocking(&src))) {
+      limit_ = start_;
+      return false;
+    }
+    if (ABSL_PREDICT_TRUE(src.empty())) return true;
+  }
+  // Writing would block. Keep the rest of src, which is about to be
+  // overwritten in the buffer.
+  pending_.Append(src);
+  return true;
+}
+
+bool FdStreamWriter::WritePending() {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  size_t length_written = 0;
+  bool ok = true;
+  for (absl::string_view fragment : pending_.blocks()) {
+    const size_t fragment_size = fragment.size();
+    ok = WriteNonBlocking(&fragment);
+    length_written += fragment_size - fragment.size();
+    if (!ok || !fragment.empty()) break;
+  }
+  pending_.RemovePrefix(length_written);
+  return ok;
+}
+
+inline bool FdStreamWriter::WriteNonBlocking(absl::string_view* src) {
+  while (!src->empty()) {
+    WaitForRateLimiter();
     const ssize_t result = write(
-        fd_, src.data(),
-        UnsignedMin(src.size(), size_t{std::numeric_limits<ssize_t>::max()}));
+        fd_, src->data(),
+        UnsignedMin(src->size(), size_t{std::numeric_limits<ssize_t>::max()}));
     if (ABSL_PREDICT_FALSE(result < 0)) {
       const int error_code = errno;
-      if (error_code == EINTR) goto again;
-      limit_ = start_;
+      if (error_code == EINTR) continue;
+      if (error_code == EAGAIN || error_code == EWOULDBLOCK) return true;
       return FailOperation("write()", error_code);
     }
     RIEGELI_ASSERT_GT(result, 0) << "write() returned 0";
-    RIEGELI_ASSERT_LE(IntCast<size_t>(result), src.size())
+    RIEGELI_ASSERT_LE(IntCast<size_t>(result), src->size())
         << "write() wrote more than requested";
-    start_pos_ += IntCast<size_t>(result);
-    src.remove_prefix(IntCast<size_t>(result));
-  } while (!src.empty());
+    ConsumeRateLimiter(IntCast<size_t>(result));
+    src->remove_prefix(IntCast<size_t>(result));
+  }
   return true;
 }
 
+FdMMapWriter::FdMMapWriter(int fd, Options options)
+    : Writer(State::kOpen),
+      owned_fd_(options.owns_fd_ ? fd : -1),
+      fd_(fd),
+      filename_(fd == 1 ? "/dev/stdout"
+                        : fd == 2 ? "/dev/stderr"
+                                  : absl::StrCat("/proc/self/fd/", fd)) {
+  RIEGELI_ASSERT_GE(fd, 0)
+      << "Failed precondition of FdMMapWriter::FdMMapWriter(int): "
+         "negative file descriptor";
+  Initialize(options);
+}
+
+FdMMapWriter::FdMMapWriter(std::string filename, int flags, Options options)
+    : Writer(State::kOpen), filename_(std::move(filename)) {
+  RIEGELI_ASSERT((flags & O_ACCMODE) == O_RDWR)
+      << "Failed precondition of FdMMapWriter::FdMMapWriter(string): "
+         "flags must include O_RDWR";
+  RIEGELI_ASSERT(options.owns_fd_)
+      << "Failed precondition of FdMMapWriter::FdMMapWriter(string): "
+         "file must be owned if FdMMapWriter opens it";
+again:
+  fd_ = open(filename_.c_str(), flags, options.permissions_);
+  if (ABSL_PREDICT_FALSE(fd_ < 0)) {
+    const int error_code = errno;
+    if (error_code == EINTR) goto again;
+    FailOperation("open()", error_code);
+    return;
+  }
+  owned_fd_ = internal::FdHolder(fd_);
+  Initialize(options);
+}
+
+void FdMMapWriter::Done() {
+  Unmap();
+  if (fd_ >= 0 && file_size_ != data_end_) {
+    // Remove the extension beyond data, even after a failure.
+    if (ABSL_PREDICT_FALSE(ftruncate(fd_, IntCast<off_t>(data_end_)) < 0) &&
+        ABSL_PREDICT_TRUE(healthy())) {
+      FailOperation("ftruncate()", errno);
+    }
+  }
+  const int error_code = owned_fd_.Close();
+  if (ABSL_PREDICT_FALSE(error_code != 0) && ABSL_PREDICT_TRUE(healthy())) {
+    FailOperation(internal::FdHolder::CloseFunctionName(), error_code);
+  }
+  fd_ = -1;
+  window_size_ = 0;
+  file_size_ = 0;
+  data_end_ = 0;
+  // filename_ and error_code_ are not cleared.
+  Writer::Done();
+}
+
+inline void FdMMapWriter::Initialize(Options options) {
+  struct stat stat_info;
+  if (ABSL_PREDICT_FALSE(fstat(fd_, &stat_info) < 0)) {
+    const int error_code = errno;
+    FailOperation("fstat()", error_code);
+    return;
+  }
+  file_size_ = IntCast<Position>(stat_info.st_size);
+  data_end_ = file_size_;
+  const Position page_size = IntCast<Position>(sysconf(_SC_PAGESIZE));
+  window_size_ = (UnsignedMin(options.window_size_,
+                              Position{std::numeric_limits<off_t>::max()} -
+                                  page_size) +
+                  page_size - 1) /
+                 page_size * page_size;
+  if (ABSL_PREDICT_FALSE(window_size_ > std::numeric_limits<size_t>::max())) {
+    Fail("Window is too large for mmap()");
+    return;
+  }
+  // The first window is mapped by PushSlow().
+  start_pos_ = file_size_;
+}
+
+inline bool FdMMapWriter::FailOperation(absl::string_view operation,
+                                        int error_code) {
+  error_code_ = error_code;
+  return Fail(absl::StrCat(operation, " failed: ", StrError(error_code),
+                           ", writing ", filename_));
+}
+
+bool FdMMapWriter::Unmap() {
+  if (start_ == nullptr) return true;
+  const Position pos_before = pos();
+  data_end_ = UnsignedMax(data_end_, pos_before);
+  const int result = munmap(start_, IntCast<size_t>(window_size_));
+  const int error_code = errno;
+  start_ = nullptr;
+  cursor_ = nullptr;
+  limit_ = nullptr;
+  start_pos_ = pos_before;
+  if (ABSL_PREDICT_FALSE(result < 0)) {
+    return FailOperation("munmap()", error_code);
+  }
+  return true;
+}
+
+bool FdMMapWriter::TruncateToData() {
+  if (file_size_ == data_end_) return true;
+  if (ABSL_PREDICT_FALSE(ftruncate(fd_, IntCast<off_t>(data_end_)) < 0)) {
+    return FailOperation("ftruncate()", errno);
+  }
+  file_size_ = data_end_;
+  return true;
+}
+
+bool FdMMapWriter::MapWindow(Position new_pos) {
+  if (ABSL_PREDICT_FALSE(!Unmap())) return false;
+  // The window starts at a multiple of window_size_, which is a multiple of
+  // the page size, as required for the offset of mmap().
+  const Position window_begin = new_pos - new_pos % window_size_;
+  if (ABSL_PREDICT_FALSE(window_size_ >
+                         Position{std::numeric_limits<off_t>::max()} -
+                             window_begin)) {
+    return FailOverflow();
+  }
+  const Position window_end = window_begin + window_size_;
+  if (file_size_ < window_end) {
+    // Unlike ftruncate(), posix_fallocate() reserves disk space, so that
+    // running out of space is reported here instead of by SIGBUS when the
+    // mapped memory is written.
+    for (;;) {
+      const int error_code =
+          posix_fallocate(fd_, IntCast<off_t>(file_size_),
+                          IntCast<off_t>(window_end - file_size_));
+      if (ABSL_PREDICT_TRUE(error_code == 0)) break;
+      if (error_code != EINTR) {
+        return FailOperation("posix_fallocate()", error_code);
+      }
+    }
+    file_size_ = window_end;
+  }
+  void* const data =
+      mmap(nullptr, IntCast<size_t>(window_size_), PROT_READ | PROT_WRITE,
+           MAP_SHARED, fd_, IntCast<off_t>(window_begin));
+  if (ABSL_PREDICT_FALSE(data == MAP_FAILED)) {
+    return FailOperation("mmap()", errno);
+  }
+  start_ = static_cast<char*>(data);
+  cursor_ = start_ + IntCast<size_t>(new_pos - window_begin);
+  limit_ = start_ + IntCast<size_t>(window_size_);
+  start_pos_ = window_begin;
+  return true;
+}
+
+bool FdMMapWriter::PushSlow() {
+  RIEGELI_ASSERT_EQ(available(), 0u)
+      << "Failed precondition of Writer::PushSlow(): "
+         "space available, use Push() instead";
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  return MapWindow(pos());
+}
+
+bool FdMMapWriter::Flush(FlushType flush_type) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  switch (flush_type) {
+    case FlushType::kFromObject:
+    case FlushType::kFromProcess:
+      // Data are already in the page cache, but the file size includes the
+      // extension beyond data.
+      return Unmap() && TruncateToData();
+    case FlushType::kFromMachine:
+      if (start_ != nullptr) {
+        while (ABSL_PREDICT_FALSE(
+            msync(start_, written_to_buffer(), MS_SYNC) < 0)) {
+          const int error_code = errno;
+          if (error_code != EINTR) return FailOperation("msync()", error_code);
+        }
+      }
+      if (ABSL_PREDICT_FALSE(!Unmap() || !TruncateToData())) return false;
+      while (ABSL_PREDICT_FALSE(fsync(fd_) < 0)) {
+        const int error_code = errno;
+        if (error_code != EINTR) return FailOperation("fsync()", error_code);
+      }
+      return true;
+  }
+  RIEGELI_ASSERT_UNREACHABLE()
+      << "Unknown flush type: " << static_cast<int>(flush_type);
+}
+
 }  // namespace riegeli
@@ -24,8 +24,11 @@
 #include "absl/base/attributes.h"
 #include "absl/strings/string_view.h"
 #include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/memory.h"
 #include "riegeli/bytes/buffered_writer.h"
 #include "riegeli/bytes/fd_holder.h"
+#include "riegeli/bytes/rate_limiter.h"
 #include "riegeli/bytes/writer.h"
 
 namespace riegeli {
@@ -58,6 +61,15 @@ class FdWriterBase : public BufferedWriter {
                                          int error_code);
   virtual bool MaybeSyncPos() { return true; }
 
+  // Waits for rate_limiter_ before writing, unless it is nullptr.
+  void WaitForRateLimiter() {
+    if (rate_limiter_ != nullptr) rate_limiter_->Wait(rate_priority_);
+  }
+  // Reports length bytes written to rate_limiter_, unless it is nullptr.
+  void ConsumeRateLimiter(size_t length) {
+    if (rate_limiter_ != nullptr) rate_limiter_->Consume(length);
+  }
+
   FdHolder owned_fd_;
   int fd_ = -1;
   std::string filename_;
@@ -65,6 +77,9 @@ class FdWriterBase : public BufferedWriter {
   //
   // Invariant: if healthy() then error_code_ == 0
   int error_code_ = 0;
+  // If not nullptr, limits the bandwidth of writing.
+  RateLimiter* rate_limiter_ = nullptr;
+  RateLimiter::Priority rate_priority_ = RateLimiter::Priority::kBackground;
 
   // Invariants:
   //   start_pos_ <= numeric_limits<off_t>::max()
@@ -137,6 +152,96 @@ class FdWriter final : public internal::FdWriterBase {
       return std::move(set_sync_pos(sync_pos));
     }
 
+    // If true, FdWriter writes with O_DIRECT, bypassing the page cache. This
+    // is useful for writing large amounts of data which will not be read soon,
+    // to avoid evicting other data from the page cache.
+    //
+    // Data are staged in a buffer aligned to kDirectIoAlignment(), of
+    // buffer_size rounded up to a multiple of kDirectIoAlignment(), and written
+    // in whole aligned blocks. A partial block at the beginning, or at the end
+    // when flushing, is written with O_DIRECT temporarily cleared from the file
+    // status flags, which are shared with duplicates of the fd.
+    //
+    // If the fd is not owned, O_DIRECT is cleared again when the FdWriter is
+    // closed, unless it was already set.
+    //
+    // Default: false.
+    Options& set_direct_io(bool direct_io) & {
+      direct_io_ = direct_io;
+      return *this;
+    }
+    Options&& set_direct_io(bool direct_io) && {
+      return std::move(set_direct_io(direct_io));
+    }
+
+    // If initial_size > 0, FdWriter reserves disk space for initial_size bytes
+    // from the initial position, and whenever writing goes past the reserved
+    // space, reserves increment bytes more (or enough for the write if it is
+    // larger). This lets the filesystem allocate large contiguous extents for
+    // a file growing by appending, instead of updating metadata on every write
+    // and fragmenting the file.
+    //
+    // Space is reserved with fallocate(FALLOC_FL_KEEP_SIZE), so the file size
+    // reflects only data written, and readers of a partially written file see
+    // no garbage at its end. Space reserved beyond the end of data is released
+    // by ftruncate() on Close().
+    //
+    // Reserving space is only an optimization. If the platform or the
+    // filesystem does not support it, or the disk has no room for a whole
+    // increment, FdWriter stops reserving space and writes normally.
+    //
+    // If increment == 0, only the initial space is reserved.
+    //
+    // Default: 0, 0 (no preallocation).
+    Options& set_preallocate(Position initial_size, Position increment) & {
+      preallocate_initial_size_ = initial_size;
+      preallocate_increment_ = increment;
+      return *this;
+    }
+    Options&& set_preallocate(Position initial_size, Position increment) && {
+      return std::move(set_preallocate(initial_size, increment));
+    }
+
+    // If window > 0, FdWriter drops written pages from the page cache behind
+    // the write position, in steps of window bytes. Writeback of each window
+    // is started with sync_file_range() as soon as it is written, and the
+    // window before it is waited for and dropped with
+    // posix_fadvise(POSIX_FADV_DONTNEED). This keeps writing a large file
+    // which will not be read soon, e.g. by a batch job, from evicting data
+    // which other processes need, and bounds the amount of dirty data.
+    //
+    // This is meant for writing sequentially. Where sync_file_range() is not
+    // available, this option has no effect.
+    //
+    // Default: 0 (pages are not dropped).
+    Options& set_drop_cache_behind(Position window) & {
+      drop_cache_behind_ = window;
+      return *this;
+    }
+    Options&& set_drop_cache_behind(Position window) && {
+      return std::move(set_drop_cache_behind(window));
+    }
+
+    // Specifies a RateLimiter, possibly shared with other readers and writers,
+    // which limits the bandwidth of writing with the given priority. The
+    // RateLimiter must be kept alive until the FdWriter is closed.
+    //
+    // If nullptr, writing is not limited.
+    //
+    // Default: nullptr
+    Options& set_rate_limiter(RateLimiter* rate_limiter,
+                              RateLimiter::Priority priority =
+                                  RateLimiter::Priority::kBackground) & {
+      rate_limiter_ = rate_limiter;
+      rate_priority_ = priority;
+      return *this;
+    }
+    Options&& set_rate_limiter(RateLimiter* rate_limiter,
+                               RateLimiter::Priority priority =
+                                   RateLimiter::Priority::kBackground) && {
+      return std::move(set_rate_limiter(rate_limiter, priority));
+    }
+
    private:
     friend class FdWriter;
 
@@ -144,8 +249,18 @@ class FdWriter final : public internal::FdWriterBase {
     mode_t permissions_ = 0666;
     size_t buffer_size_ = kDefaultBufferSize();
     bool sync_pos_ = false;
+    bool direct_io_ = false;
+    Position preallocate_initial_size_ = 0;
+    Position preallocate_increment_ = 0;
+    Position drop_cache_behind_ = 0;
+    RateLimiter* rate_limiter_ = nullptr;
+    RateLimiter::Priority rate_priority_ = RateLimiter::Priority::kBackground;
   };
 
+  // Alignment of file positions, lengths, and buffer addresses of writes with
+  // O_DIRECT.
+  static constexpr size_t kDirectIoAlignment() { return 4096; }
+
   // Creates a closed FdWriter.
   FdWriter() noexcept {}
 
@@ -166,6 +281,9 @@ class FdWriter final : public internal::FdWriterBase {
   FdWriter(FdWriter&& src) noexcept;
   FdWriter& operator=(FdWriter&& src) noexcept;
 
+  ~FdWriter();
+
+  bool Flush(FlushType flush_type) override;
   bool SupportsRandomAccess() const override { return true; }
   bool Size(Position* size) const override;
   bool Truncate() override;
@@ -173,13 +291,89 @@ class FdWriter final : public internal::FdWriterBase {
  protected:
   void Done() override;
   bool MaybeSyncPos() override;
+  // Writes a large Chain with pwritev() directly from its blocks, together
+  // with buffered data, unless direct I/O is used.
+  bool WriteSlow(const Chain& src) override;
   bool WriteInternal(absl::string_view src) override;
   bool SeekSlow(Position new_pos) override;
 
  private:
   void InitializePos(int flags);
+  void InitializeDirectIo(bool owns_fd);
+
+  // Reserves disk space up to end, or further by preallocate_increment_.
+  //
+  // Precondition: preallocate_
+  void Preallocate(Position end);
+
+  // Releases disk space reserved beyond the end of the file.
+  void TrimPreallocated();
+
+  // Starts writeback of whole windows of drop_cache_behind_ bytes before end,
+  // and drops pages from the page cache one window behind them.
+  void DropCacheBehind(Position end);
+
+  // Writes src at pos with pwrite(), not changing start_pos_.
+  bool WriteToFd(absl::string_view src, Position pos);
+
+  // Sets or clears O_DIRECT in the file status flags.
+  bool SetDirectIo(bool direct_io);
+
+  // Appends src to direct_buffer_, writing it out when full.
+  bool WriteDirect(absl::string_view src);
+
+  // Writes out data staged in direct_buffer_: whole aligned blocks with
+  // O_DIRECT, a partial block at the beginning without O_DIRECT, and if all is
+  // true, also a partial block at the end without O_DIRECT. The partial block
+  // at the end is kept in direct_buffer_, to be written again with O_DIRECT
+  // when complete.
+  //
+  // Precondition: direct_buffer_ != nullptr
+  bool WriteOutDirect(bool all);
+
+  // Makes direct_buffer_ empty, corresponding to start_pos_.
+  //
+  // Precondition: direct_buffer_ != nullptr
+  void ResetDirectBuffer();
+
+  void DeleteDirectBuffer();
 
   bool sync_pos_ = false;
+  bool direct_io_ = false;
+  // If true, O_DIRECT was set by this FdWriter on an fd which it does not own,
+  // and Done() clears it.
+  bool clear_direct_io_ = false;
+  // If true, disk space is reserved ahead of writing, up to preallocated_end_.
+  bool preallocate_ = false;
+  Position preallocate_increment_ = 0;
+  // End of disk space reserved by Preallocate(), or 0 if none.
+  Position preallocated_end_ = 0;
+  // Options::set_drop_cache_behind(), or 0 if pages are not dropped.
+  Position drop_cache_behind_ = 0;
+  // Position before which writeback was started by DropCacheBehind().
+  Position written_back_end_ = 0;
+  // Position before which pages were dropped by DropCacheBehind().
+  //
+  // Invariant: dropped_end_ <= written_back_end_
+  Position dropped_end_ = 0;
+  // Staged data if direct_io_, allocated with
+  // NewAligned<char, kDirectIoAlignment()>(direct_buffer_size_) when needed.
+  char* direct_buffer_ = nullptr;
+  // Invariant: direct_buffer_size_ % kDirectIoAlignment() == 0
+  size_t direct_buffer_size_ = 0;
+  // File position corresponding to direct_buffer_[0].
+  //
+  // Invariant: direct_buffer_pos_ % kDirectIoAlignment() == 0
+  Position direct_buffer_pos_ = 0;
+  // Range of direct_buffer_ holding staged data. direct_begin_ is non-zero if
+  // staging began at a position which is not aligned.
+  //
+  // Invariants if direct_buffer_ != nullptr:
+  //   direct_begin_ <= direct_end_ <= direct_buffer_size_
+  //   direct_begin_ < kDirectIoAlignment()
+  //   direct_buffer_pos_ + direct_end_ == start_pos_
+  size_t direct_begin_ = 0;
+  size_t direct_end_ = 0;
 };
 
 // A Writer which writes to a file descriptor which does not have to support
@@ -189,6 +383,13 @@ class FdWriter final : public internal::FdWriterBase {
 // rarely useful because they would need to avoid writing concurrently, and to
 // Flush() before allowing another FdStreamWriter to write. Writes occur at the
 // current file position (using write()).
+//
+// The fd can be non-blocking (O_NONBLOCK), e.g. a socket served by an event
+// loop. Data which cannot be written without blocking are then kept pending in
+// the FdStreamWriter instead of failing, and writing continues to succeed.
+// The caller should watch pending_size() to bound memory usage, and call
+// WritePending() when the fd becomes writable. Flush() does not wait for
+// pending data; Close() does.
 class FdStreamWriter final : public internal::FdWriterBase {
  public:
   class Options {
@@ -248,6 +449,26 @@ class FdStreamWriter final : public internal::FdWriterBase {
       return std::move(set_assumed_pos(assumed_pos));
     }
 
+    // Specifies a RateLimiter, possibly shared with other readers and writers,
+    // which limits the bandwidth of writing with the given priority. The
+    // RateLimiter must be kept alive until the FdStreamWriter is closed.
+    //
+    // If nullptr, writing is not limited.
+    //
+    // Default: nullptr
+    Options& set_rate_limiter(RateLimiter* rate_limiter,
+                              RateLimiter::Priority priority =
+                                  RateLimiter::Priority::kBackground) & {
+      rate_limiter_ = rate_limiter;
+      rate_priority_ = priority;
+      return *this;
+    }
+    Options&& set_rate_limiter(RateLimiter* rate_limiter,
+                               RateLimiter::Priority priority =
+                                   RateLimiter::Priority::kBackground) && {
+      return std::move(set_rate_limiter(rate_limiter, priority));
+    }
+
    private:
     friend class FdStreamWriter;
 
@@ -256,6 +477,8 @@ class FdStreamWriter final : public internal::FdWriterBase {
     size_t buffer_size_ = kDefaultBufferSize();
     bool has_assumed_pos_ = false;
     Position assumed_pos_ = 0;
+    RateLimiter* rate_limiter_ = nullptr;
+    RateLimiter::Priority rate_priority_ = RateLimiter::Priority::kBackground;
   };
 
   // Creates a closed FdStreamWriter.
@@ -279,8 +502,183 @@ class FdStreamWriter final : public internal::FdWriterBase {
   FdStreamWriter(FdStreamWriter&& src) noexcept;
   FdStreamWriter& operator=(FdStreamWriter&& src) noexcept;
 
+  // Returns the amount of data written to the FdStreamWriter but not yet to
+  // the fd because the fd is non-blocking and writing would block.
+  size_t pending_size() const { return pending_.size(); }
+
+  // Writes pending data to the fd, as much as possible without blocking.
+  //
+  // Return values:
+  //  * true  - success (pending_size() == 0 unless writing would block)
+  //  * false - failure (!healthy())
+  bool WritePending();
+
  protected:
+  void Done() override;
   bool WriteInternal(absl::string_view src) override;
+
+ private:
+  // Writes the prefix of src which can be written without blocking, and
+  // removes it from src.
+  bool WriteNonBlocking(absl::string_view* src);
+
+  // Data accepted by WriteInternal() but not written to the fd yet, in
+  // addition to the buffer. start_pos_ includes them.
+  Chain pending_;
+};
+
+// A Writer which writes to a file descriptor by mapping a window of the file
+// to memory at a time. Push() exposes the mapped memory as the buffer, so data
+// are written directly to the page cache, without copying them through a
+// separate buffer and without a system call per buffer.
+//
+// Whenever writing reaches the end of the file, the file is extended with
+// posix_fallocate() to the end of the next window, and the window is mapped. On
+// Flush() and Close() the window is unmapped and the file is truncated to the
+// end of data. Between them, readers of the file see zeros after the data
+// written so far, also if the process crashes.
+//
+// Writing starts at the end of file and is sequential; Seek() is not
+// supported. The fd must support mmap(), fstat(), and ftruncate(), and must be
+// open for reading and writing, because mmap() with PROT_WRITE requires that.
+//
+// Flush(FlushType::kFromMachine) uses msync() for the current window, and
+// fsync() for earlier windows and the file size. Since Flush() unmaps the
+// window, frequent flushes make writing slower.
+class FdMMapWriter final : public Writer {
+ public:
+  class Options {
+   public:
+    // Not defaulted because of a C++ defect:
+    // https://stackoverflow.com/questions/17430377
+    Options() noexcept {}
+
+    // If true, the fd will be owned by the FdMMapWriter and will be closed
+    // when the FdMMapWriter is closed.
+    //
+    // If false, the fd must be alive until closing the FdMMapWriter.
+    //
+    // Default: true.
+    Options& set_owns_fd(bool owns_fd) & {
+      owns_fd_ = owns_fd;
+      return *this;
+    }
+    Options&& set_owns_fd(bool owns_fd) && {
+      return std::move(set_owns_fd(owns_fd));
+    }
+
+    // Permissions to use in case a new file is created (9 bits). The effective
+    // permissions are modified by the process's umask.
+    Options& set_permissions(mode_t permissions) & {
+      permissions_ = permissions;
+      return *this;
+    }
+    Options&& set_permissions(mode_t permissions) && {
+      return std::move(set_permissions(permissions));
+    }
+
+    // Sets the size of a window mapped at a time, which is also the increment
+    // by which the file is extended. It is rounded up to a multiple of the
+    // page size.
+    //
+    // A larger window makes mapping and extending less frequent, at the cost
+    // of address space.
+    //
+    // Default: 64M
+    Options& set_window_size(Position window_size) & {
+      RIEGELI_ASSERT_GT(window_size, 0u)
+          << "Failed precondition of "
+             "FdMMapWriter::Options::set_window_size(): "
+             "zero window size";
+      window_size_ = window_size;
+      return *this;
+    }
+    Options&& set_window_size(Position window_size) && {
+      return std::move(set_window_size(window_size));
+    }
+
+   private:
+    friend class FdMMapWriter;
+
+    bool owns_fd_ = true;
+    mode_t permissions_ = 0666;
+    Position window_size_ = Position{64} << 20;
+  };
+
+  // Creates a closed FdMMapWriter.
+  FdMMapWriter() noexcept : Writer(State::kClosed) {}
+
+  // Will write to fd, starting at the end of file.
+  explicit FdMMapWriter(int fd, Options options = Options());
+
+  // Opens a file for writing.
+  //
+  // flags is the second argument of open, typically one of:
+  //  * O_RDWR | O_CREAT | O_TRUNC
+  //  * O_RDWR | O_CREAT | O_APPEND
+  //
+  // flags must include O_RDWR.
+  // options.set_owns_fd(false) must not be used.
+  FdMMapWriter(std::string filename, int flags, Options options = Options());
+
+  FdMMapWriter(FdMMapWriter&& src) noexcept;
+  FdMMapWriter& operator=(FdMMapWriter&& src) noexcept;
+
+  ~FdMMapWriter();
+
+  const std::string& filename() const { return filename_; }
+  int error_code() const { return error_code_; }
+
+  bool Flush(FlushType flush_type) override;
+
+ protected:
+  void Done() override;
+  bool PushSlow() override;
+
+ private:
+  void Initialize(Options options);
+
+  // Unmaps the current window, extends the file if needed, and maps the
+  // window containing new_pos, positioning the cursor at new_pos.
+  bool MapWindow(Position new_pos);
+
+  // Unmaps the current window if any, updating data_end_.
+  //
+  // Return values:
+  //  * true  - success
+  //  * false - failure (!healthy())
+  bool Unmap();
+
+  // Truncates the file to data_end_, removing the extension beyond data.
+  //
+  // Precondition: the window is unmapped
+  //
+  // Return values:
+  //  * true  - success
+  //  * false - failure (!healthy())
+  bool TruncateToData();
+
+  ABSL_ATTRIBUTE_COLD bool FailOperation(absl::string_view operation,
+                                         int error_code);
+
+  internal::FdHolder owned_fd_;
+  int fd_ = -1;
+  std::string filename_;
+  // errno value from a failed operation, or 0 if none.
+  //
+  // Invariant: if healthy() then error_code_ == 0
+  int error_code_ = 0;
+  // Window size, rounded up to a multiple of the page size.
+  Position window_size_ = 0;
+  // Size of the file, including the extension beyond data.
+  Position file_size_ = 0;
+  // End of data, excluding data in the current window.
+  Position data_end_ = 0;
+
+  // Invariants if start_ != nullptr:
+  //   start_ is the beginning of a mapped window of window_size_ bytes
+  //   start_pos_ % window_size_ == 0
+  //   start_pos_ + window_size_ <= file_size_
 };
 
 // Implementation details follow.
@@ -292,7 +690,9 @@ inline FdWriterBase::FdWriterBase(FdWriterBase&& src) noexcept
       owned_fd_(std::move(src.owned_fd_)),
       fd_(riegeli::exchange(src.fd_, -1)),
       filename_(riegeli::exchange(src.filename_, std::string())),
-      error_code_(riegeli::exchange(src.error_code_, 0)) {}
+      error_code_(riegeli::exchange(src.error_code_, 0)),
+      rate_limiter_(riegeli::exchange(src.rate_limiter_, nullptr)),
+      rate_priority_(src.rate_priority_) {}
 
 inline FdWriterBase& FdWriterBase::operator=(FdWriterBase&& src) noexcept {
   BufferedWriter::operator=(std::move(src));
@@ -300,6 +700,8 @@ inline FdWriterBase& FdWriterBase::operator=(FdWriterBase&& src) noexcept {
   fd_ = riegeli::exchange(src.fd_, -1);
   filename_ = riegeli::exchange(src.filename_, std::string());
   error_code_ = riegeli::exchange(src.error_code_, 0);
+  rate_limiter_ = riegeli::exchange(src.rate_limiter_, nullptr);
+  rate_priority_ = src.rate_priority_;
   return *this;
 }
 
@@ -307,23 +709,97 @@ inline FdWriterBase& FdWriterBase::operator=(FdWriterBase&& src) noexcept {
 
 inline FdWriter::FdWriter(FdWriter&& src) noexcept
     : internal::FdWriterBase(std::move(src)),
-      sync_pos_(riegeli::exchange(src.sync_pos_, false)) {}
+      sync_pos_(riegeli::exchange(src.sync_pos_, false)),
+      direct_io_(riegeli::exchange(src.direct_io_, false)),
+      clear_direct_io_(riegeli::exchange(src.clear_direct_io_, false)),
+      preallocate_(riegeli::exchange(src.preallocate_, false)),
+      preallocate_increment_(riegeli::exchange(src.preallocate_increment_, 0)),
+      preallocated_end_(riegeli::exchange(src.preallocated_end_, 0)),
+      drop_cache_behind_(riegeli::exchange(src.drop_cache_behind_, 0)),
+      written_back_end_(riegeli::exchange(src.written_back_end_, 0)),
+      dropped_end_(riegeli::exchange(src.dropped_end_, 0)),
+      direct_buffer_(riegeli::exchange(src.direct_buffer_, nullptr)),
+      direct_buffer_size_(riegeli::exchange(src.direct_buffer_size_, 0)),
+      direct_buffer_pos_(riegeli::exchange(src.direct_buffer_pos_, 0)),
+      direct_begin_(riegeli::exchange(src.direct_begin_, 0)),
+      direct_end_(riegeli::exchange(src.direct_end_, 0)) {}
 
 inline FdWriter& FdWriter::operator=(FdWriter&& src) noexcept {
+  // Exchange src.direct_buffer_ early to support self-assignment.
+  char* const direct_buffer = riegeli::exchange(src.direct_buffer_, nullptr);
+  DeleteDirectBuffer();
   internal::FdWriterBase::operator=(std::move(src));
   sync_pos_ = riegeli::exchange(src.sync_pos_, false);
+  direct_io_ = riegeli::exchange(src.direct_io_, false);
+  clear_direct_io_ = riegeli::exchange(src.clear_direct_io_, false);
+  preallocate_ = riegeli::exchange(src.preallocate_, false);
+  preallocate_increment_ = riegeli::exchange(src.preallocate_increment_, 0);
+  preallocated_end_ = riegeli::exchange(src.preallocated_end_, 0);
+  drop_cache_behind_ = riegeli::exchange(src.drop_cache_behind_, 0);
+  written_back_end_ = riegeli::exchange(src.written_back_end_, 0);
+  dropped_end_ = riegeli::exchange(src.dropped_end_, 0);
+  direct_buffer_ = direct_buffer;
+  direct_buffer_size_ = riegeli::exchange(src.direct_buffer_size_, 0);
+  direct_buffer_pos_ = riegeli::exchange(src.direct_buffer_pos_, 0);
+  direct_begin_ = riegeli::exchange(src.direct_begin_, 0);
+  direct_end_ = riegeli::exchange(src.direct_end_, 0);
   return *this;
 }
 
+inline FdWriter::~FdWriter() { DeleteDirectBuffer(); }
+
+inline void FdWriter::DeleteDirectBuffer() {
+  if (direct_buffer_ != nullptr) {
+    DeleteAligned<char, kDirectIoAlignment()>(direct_buffer_,
+                                              direct_buffer_size_);
+    direct_buffer_ = nullptr;
+  }
+}
+
 inline FdStreamWriter::FdStreamWriter(FdStreamWriter&& src) noexcept
-    : internal::FdWriterBase(std::move(src)) {}
+    : internal::FdWriterBase(std::move(src)),
+      pending_(riegeli::exchange(src.pending_, Chain())) {}
 
 inline FdStreamWriter& FdStreamWriter::operator=(
     FdStreamWriter&& src) noexcept {
   internal::FdWriterBase::operator=(std::move(src));
+  pending_ = riegeli::exchange(src.pending_, Chain());
   return *this;
 }
 
+inline FdMMapWriter::FdMMapWriter(FdMMapWriter&& src) noexcept
+    : Writer(std::move(src)),
+      owned_fd_(std::move(src.owned_fd_)),
+      fd_(riegeli::exchange(src.fd_, -1)),
+      filename_(riegeli::exchange(src.filename_, std::string())),
+      error_code_(riegeli::exchange(src.error_code_, 0)),
+      window_size_(riegeli::exchange(src.window_size_, 0)),
+      file_size_(riegeli::exchange(src.file_size_, 0)),
+      data_end_(riegeli::exchange(src.data_end_, 0)) {}
+
+inline FdMMapWriter& FdMMapWriter::operator=(FdMMapWriter&& src) noexcept {
+  // Take the window of src before unmapping this one, to support
+  // self-assignment.
+  char* const start = riegeli::exchange(src.start_, nullptr);
+  char* const cursor = riegeli::exchange(src.cursor_, nullptr);
+  char* const limit = riegeli::exchange(src.limit_, nullptr);
+  Unmap();
+  Writer::operator=(std::move(src));
+  start_ = start;
+  cursor_ = cursor;
+  limit_ = limit;
+  owned_fd_ = std::move(src.owned_fd_);
+  fd_ = riegeli::exchange(src.fd_, -1);
+  filename_ = riegeli::exchange(src.filename_, std::string());
+  error_code_ = riegeli::exchange(src.error_code_, 0);
+  window_size_ = riegeli::exchange(src.window_size_, 0);
+  file_size_ = riegeli::exchange(src.file_size_, 0);
+  data_end_ = riegeli::exchange(src.data_end_, 0);
+  return *this;
+}
+
+inline FdMMapWriter::~FdMMapWriter() { Unmap(); }
+
 }  // namespace riegeli
 
 #endif  // RIEGELI_BYTES_FD_WRITER_H_
@@ -0,0 +1,145 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/bytes/lz4_reader.h"
+
+#include <stddef.h>
+#include <limits>
+#include <memory>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/str_cat.h"
+#include "lz4frame.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/base/recycling_pool.h"
+#include "riegeli/bytes/buffered_reader.h"
+#include "riegeli/bytes/reader.h"
+
+namespace riegeli {
+
+Lz4Reader::Lz4Reader(Reader* src, Options options)
+    : BufferedReader(options.buffer_size_),
+      src_(RIEGELI_ASSERT_NOTNULL(src)),
+      decompressor_(RecyclingPool<LZ4F_dctx, LZ4F_dctxDeleter>::global().Get(
+          [] {
+            LZ4F_dctx* decompressor = nullptr;
+            if (ABSL_PREDICT_FALSE(LZ4F_isError(LZ4F_createDecompressionContext(
+                    &decompressor, LZ4F_VERSION)))) {
+              decompressor = nullptr;
+            }
+            return std::unique_ptr<LZ4F_dctx, LZ4F_dctxDeleter>(decompressor);
+          })) {
+  if (ABSL_PREDICT_FALSE(decompressor_ == nullptr)) {
+    Fail("LZ4F_createDecompressionContext() failed");
+    return;
+  }
+  // A LZ4F_dctx from the pool is reset here.
+  LZ4F_resetDecompressionContext(decompressor_.get());
+}
+
+void Lz4Reader::Done() {
+  if (!Pull() && ABSL_PREDICT_FALSE(decompressor_ != nullptr)) {
+    Fail("Truncated LZ4-compressed stream");
+  }
+  if (owned_src_ != nullptr) {
+    if (ABSL_PREDICT_TRUE(healthy())) {
+      if (ABSL_PREDICT_FALSE(!owned_src_->Close())) Fail(*owned_src_);
+    }
+    owned_src_.reset();
+  }
+  src_ = nullptr;
+  decompressor_.reset();
+  BufferedReader::Done();
+}
+
+bool Lz4Reader::PullSlow() {
+  RIEGELI_ASSERT_EQ(available(), 0u)
+      << "Failed precondition of Reader::PullSlow(): "
+         "data available, use Pull() instead";
+  // After all data have been decompressed, skip BufferedReader::PullSlow()
+  // to avoid allocating the buffer in case it was not allocated yet.
+  if (ABSL_PREDICT_FALSE(decompressor_ == nullptr)) return false;
+  return BufferedReader::PullSlow();
+}
+
+bool Lz4Reader::ReadInternal(char* dest, size_t min_length,
+                             size_t max_length) {
+  RIEGELI_ASSERT_GT(min_length, 0u)
+      << "Failed precondition of BufferedReader::ReadInternal(): "
+         "nothing to read";
+  RIEGELI_ASSERT_GE(max_length, min_length)
+      << "Failed precondition of BufferedReader::ReadInternal(): "
+         "max_length < min_length";
+  RIEGELI_ASSERT(healthy())
+      << "Failed precondition of BufferedReader::ReadInternal(): "
+         "Object unhealthy";
+  if (ABSL_PREDICT_FALSE(max_length >
+                         std::numeric_limits<Position>::max() - limit_pos_)) {
+    return FailOverflow();
+  }
+  if (ABSL_PREDICT_FALSE(decompressor_ == nullptr)) return false;
+  size_t length_read = 0;
+  for (;;) {
+    size_t src_length = src_->available();
+    size_t dest_length = max_length - length_read;
+    const size_t result =
+        LZ4F_decompress(decompressor_.get(), dest + length_read, &dest_length,
+                        src_->cursor(), &src_length, nullptr);
+    src_->set_cursor(src_->cursor() + src_length);
+    length_read += dest_length;
+    if (ABSL_PREDICT_FALSE(result == 0)) {
+      decompressor_.reset();
+      limit_pos_ += length_read;
+      return length_read >= min_length;
+    }
+    if (ABSL_PREDICT_FALSE(LZ4F_isError(result))) {
+      Fail(absl::StrCat("LZ4F_decompress() failed: ",
+                        LZ4F_getErrorName(result)));
+      limit_pos_ += length_read;
+      return length_read >= min_length;
+    }
+    if (length_read >= min_length) {
+      limit_pos_ += length_read;
+      return true;
+    }
+    if (src_->available() == 0 && ABSL_PREDICT_FALSE(!src_->Pull())) {
+      limit_pos_ += length_read;
+      if (ABSL_PREDICT_TRUE(src_->HopeForMore())) return false;
+      if (src_->healthy()) return Fail("Truncated LZ4-compressed stream");
+      return Fail(*src_);
+    }
+  }
+}
+
+bool Lz4Reader::HopeForMoreSlow() const {
+  RIEGELI_ASSERT_EQ(available(), 0u)
+      << "Failed precondition of Reader::HopeForMoreSlow(): "
+         "data available, use HopeForMore() instead";
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  return decompressor_ != nullptr;
+}
+
+void Lz4Reader::AddUniqueTo(MemoryEstimator* memory_estimator) const {
+  BufferedReader::AddUniqueTo(memory_estimator);
+  memory_estimator->AddMemory(sizeof(Lz4Reader) - sizeof(BufferedReader));
+  if (owned_src_ != nullptr) {
+    owned_src_->AddUniqueTo(memory_estimator);
+  } else if (src_ != nullptr) {
+    src_->AddSharedTo(memory_estimator);
+  }
+  // LZ4 does not report the size of LZ4F_dctx, which is not counted.
+}
+
+}  // namespace riegeli
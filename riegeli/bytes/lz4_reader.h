@@ -0,0 +1,120 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_BYTES_LZ4_READER_H_
+#define RIEGELI_BYTES_LZ4_READER_H_
+
+#include <stddef.h>
+#include <memory>
+#include <utility>
+
+#include "lz4frame.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/base/recycling_pool.h"
+#include "riegeli/bytes/buffered_reader.h"
+#include "riegeli/bytes/reader.h"
+
+namespace riegeli {
+
+// A Reader which decompresses data with LZ4 (frame format) after getting it
+// from another Reader.
+class Lz4Reader final : public BufferedReader {
+ public:
+  class Options {
+   public:
+    // Not defaulted because of a C++ defect:
+    // https://stackoverflow.com/questions/17430377
+    Options() noexcept {}
+
+    static constexpr size_t kDefaultBufferSize() { return size_t{64} << 10; }
+    Options& set_buffer_size(size_t buffer_size) & {
+      RIEGELI_ASSERT_GT(buffer_size, 0u)
+          << "Failed precondition of Lz4Reader::Options::set_buffer_size(): "
+             "zero buffer size";
+      buffer_size_ = buffer_size;
+      return *this;
+    }
+    Options&& set_buffer_size(size_t buffer_size) && {
+      return std::move(set_buffer_size(buffer_size));
+    }
+
+   private:
+    friend class Lz4Reader;
+
+    size_t buffer_size_ = kDefaultBufferSize();
+  };
+
+  // Creates a closed Lz4Reader.
+  Lz4Reader() noexcept {}
+
+  // Will read LZ4-compressed stream from the byte Reader which is owned by this
+  // Lz4Reader and will be closed and deleted when the Lz4Reader is closed.
+  explicit Lz4Reader(std::unique_ptr<Reader> src, Options options = Options());
+
+  // Will read LZ4-compressed stream from the byte Reader which is not owned by
+  // this Lz4Reader and must be kept alive but not accessed until closing the
+  // Lz4Reader.
+  explicit Lz4Reader(Reader* src, Options options = Options());
+
+  Lz4Reader(Lz4Reader&& src) noexcept;
+  Lz4Reader& operator=(Lz4Reader&& src) noexcept;
+
+  void AddUniqueTo(MemoryEstimator* memory_estimator) const override;
+
+ protected:
+  void Done() override;
+  bool PullSlow() override;
+  bool ReadInternal(char* dest, size_t min_length, size_t max_length) override;
+  bool HopeForMoreSlow() const override;
+
+ private:
+  struct LZ4F_dctxDeleter {
+    void operator()(LZ4F_dctx* ptr) const {
+      LZ4F_freeDecompressionContext(ptr);
+    }
+  };
+
+  std::unique_ptr<Reader> owned_src_;
+  // Invariant: if healthy() then src_ != nullptr
+  Reader* src_ = nullptr;
+  // If healthy() but decompressor_ == nullptr then all data have been
+  // decompressed. In this case LZ4F_decompress() must not be called again.
+  RecyclingPool<LZ4F_dctx, LZ4F_dctxDeleter>::Handle decompressor_;
+};
+
+// Implementation details follow.
+
+inline Lz4Reader::Lz4Reader(std::unique_ptr<Reader> src, Options options)
+    : Lz4Reader(src.get(), options) {
+  owned_src_ = std::move(src);
+}
+
+inline Lz4Reader::Lz4Reader(Lz4Reader&& src) noexcept
+    : BufferedReader(std::move(src)),
+      owned_src_(std::move(src.owned_src_)),
+      src_(riegeli::exchange(src.src_, nullptr)),
+      decompressor_(std::move(src.decompressor_)) {}
+
+inline Lz4Reader& Lz4Reader::operator=(Lz4Reader&& src) noexcept {
+  BufferedReader::operator=(std::move(src));
+  owned_src_ = std::move(src.owned_src_);
+  src_ = riegeli::exchange(src.src_, nullptr);
+  decompressor_ = std::move(src.decompressor_);
+  return *this;
+}
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_BYTES_LZ4_READER_H_
@@ -0,0 +1,224 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/bytes/lz4_writer.h"
+
+#include <stddef.h>
+#include <limits>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "lz4frame.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/base/recycling_pool.h"
+#include "riegeli/bytes/buffered_writer.h"
+#include "riegeli/bytes/writer.h"
+
+namespace riegeli {
+
+namespace {
+
+LZ4F_blockSizeID_t BlockSizeId(Position size_hint) {
+  if (size_hint == 0) return LZ4F_default;
+  if (size_hint <= Position{64} << 10) return LZ4F_max64KB;
+  if (size_hint <= Position{256} << 10) return LZ4F_max256KB;
+  if (size_hint <= Position{1} << 20) return LZ4F_max1MB;
+  return LZ4F_max4MB;
+}
+
+}  // namespace
+
+Lz4Writer::Lz4Writer(Writer* dest, Options options)
+    : BufferedWriter(options.buffer_size_),
+      dest_(RIEGELI_ASSERT_NOTNULL(dest)) {
+  preferences_.frameInfo.blockSizeID = BlockSizeId(options.size_hint_);
+  preferences_.frameInfo.blockMode = LZ4F_blockLinked;
+  preferences_.frameInfo.contentChecksumFlag = LZ4F_noContentChecksum;
+  preferences_.compressionLevel = options.compression_level_;
+}
+
+Lz4Writer& Lz4Writer::operator=(Lz4Writer&& src) noexcept {
+  BufferedWriter::operator=(std::move(src));
+  owned_dest_ = std::move(src.owned_dest_);
+  dest_ = riegeli::exchange(src.dest_, nullptr);
+  preferences_ = src.preferences_;
+  // Reuse this LZ4F_cctx if src does not have one, because reusing it is faster
+  // than creating it again. LZ4F_compressBegin() resets it.
+  if (src.compressor_ != nullptr || ABSL_PREDICT_FALSE(!healthy())) {
+    compressor_ = std::move(src.compressor_);
+  }
+  frame_started_ = riegeli::exchange(src.frame_started_, false);
+  compressed_buffer_ = riegeli::exchange(src.compressed_buffer_, std::string());
+  return *this;
+}
+
+void Lz4Writer::Done() {
+  PushInternal();
+  RIEGELI_ASSERT_EQ(written_to_buffer(), 0u)
+      << "BufferedWriter::PushInternal() did not empty the buffer";
+  if (ABSL_PREDICT_TRUE(healthy()) && ABSL_PREDICT_TRUE(EnsureFrameStarted())) {
+    CompressToDest(LZ4F_compressBound(0, &preferences_),
+                   [this](char* dest, size_t dest_size) {
+                     return LZ4F_compressEnd(compressor_.get(), dest, dest_size,
+                                             nullptr);
+                   },
+                   "LZ4F_compressEnd()");
+  }
+  if (owned_dest_ != nullptr) {
+    if (ABSL_PREDICT_TRUE(healthy())) {
+      if (ABSL_PREDICT_FALSE(!owned_dest_->Close())) Fail(*owned_dest_);
+    }
+    owned_dest_.reset();
+  }
+  dest_ = nullptr;
+  // Do not reset compressor_. It might be reused if a fresh Lz4Writer is
+  // assigned to *this.
+  frame_started_ = false;
+  compressed_buffer_ = std::string();
+  BufferedWriter::Done();
+}
+
+inline bool Lz4Writer::EnsureFrameStarted() {
+  if (ABSL_PREDICT_FALSE(compressor_ == nullptr)) {
+    compressor_ = RecyclingPool<LZ4F_cctx, LZ4F_cctxDeleter>::global().Get([] {
+      LZ4F_cctx* compressor = nullptr;
+      if (ABSL_PREDICT_FALSE(LZ4F_isError(
+              LZ4F_createCompressionContext(&compressor, LZ4F_VERSION)))) {
+        compressor = nullptr;
+      }
+      return std::unique_ptr<LZ4F_cctx, LZ4F_cctxDeleter>(compressor);
+    });
+    if (ABSL_PREDICT_FALSE(compressor_ == nullptr)) {
+      return Fail("LZ4F_createCompressionContext() failed");
+    }
+  }
+  if (frame_started_) return true;
+  // A LZ4F_cctx from the pool is reset here.
+  if (ABSL_PREDICT_FALSE(!CompressToDest(
+          LZ4F_HEADER_SIZE_MAX,
+          [this](char* dest, size_t dest_size) {
+            return LZ4F_compressBegin(compressor_.get(), dest, dest_size,
+                                      &preferences_);
+          },
+          "LZ4F_compressBegin()"))) {
+    return false;
+  }
+  frame_started_ = true;
+  return true;
+}
+
+template <typename Function>
+bool Lz4Writer::CompressToDest(size_t max_length, Function function,
+                               absl::string_view function_name) {
+  if (dest_->available() >= max_length) {
+    const size_t result = function(dest_->cursor(), dest_->available());
+    if (ABSL_PREDICT_FALSE(LZ4F_isError(result))) {
+      limit_ = start_;
+      return Fail(
+          absl::StrCat(function_name, " failed: ", LZ4F_getErrorName(result)));
+    }
+    dest_->set_cursor(dest_->cursor() + result);
+    return true;
+  }
+  if (compressed_buffer_.size() < max_length) {
+    compressed_buffer_.resize(max_length);
+  }
+  const size_t result = function(&compressed_buffer_[0], max_length);
+  if (ABSL_PREDICT_FALSE(LZ4F_isError(result))) {
+    limit_ = start_;
+    return Fail(
+        absl::StrCat(function_name, " failed: ", LZ4F_getErrorName(result)));
+  }
+  if (ABSL_PREDICT_FALSE(!dest_->Write(
+          absl::string_view(compressed_buffer_.data(), result)))) {
+    limit_ = start_;
+    return Fail(*dest_);
+  }
+  return true;
+}
+
+bool Lz4Writer::Flush(FlushType flush_type) {
+  if (ABSL_PREDICT_FALSE(!PushInternal())) return false;
+  RIEGELI_ASSERT_EQ(written_to_buffer(), 0u)
+      << "BufferedWriter::PushInternal() did not empty the buffer";
+  if (ABSL_PREDICT_FALSE(!EnsureFrameStarted())) return false;
+  if (ABSL_PREDICT_FALSE(!CompressToDest(
+          LZ4F_compressBound(0, &preferences_),
+          [this](char* dest, size_t dest_size) {
+            return LZ4F_flush(compressor_.get(), dest, dest_size, nullptr);
+          },
+          "LZ4F_flush()"))) {
+    return false;
+  }
+  if (ABSL_PREDICT_FALSE(!dest_->Flush(flush_type))) {
+    if (dest_->healthy()) return false;
+    limit_ = start_;
+    return Fail(*dest_);
+  }
+  return true;
+}
+
+bool Lz4Writer::WriteInternal(absl::string_view src) {
+  RIEGELI_ASSERT(!src.empty())
+      << "Failed precondition of BufferedWriter::WriteInternal(): "
+         "nothing to write";
+  RIEGELI_ASSERT(healthy())
+      << "Failed precondition of BufferedWriter::WriteInternal(): "
+         "Object unhealthy";
+  RIEGELI_ASSERT_EQ(written_to_buffer(), 0u)
+      << "Failed precondition of BufferedWriter::WriteInternal(): "
+         "buffer not cleared";
+  if (ABSL_PREDICT_FALSE(src.size() >
+                         std::numeric_limits<Position>::max() - limit_pos())) {
+    limit_ = start_;
+    return FailOverflow();
+  }
+  if (ABSL_PREDICT_FALSE(!EnsureFrameStarted())) return false;
+  // LZ4F_compressUpdate() needs output space for the worst case, so large
+  // input is compressed in pieces to bound it.
+  while (!src.empty()) {
+    const absl::string_view piece = src.substr(0, size_t{64} << 10);
+    if (ABSL_PREDICT_FALSE(!CompressToDest(
+            LZ4F_compressBound(piece.size(), &preferences_),
+            [this, piece](char* dest, size_t dest_size) {
+              return LZ4F_compressUpdate(compressor_.get(), dest, dest_size,
+                                         piece.data(), piece.size(), nullptr);
+            },
+            "LZ4F_compressUpdate()"))) {
+      return false;
+    }
+    start_pos_ += piece.size();
+    src.remove_prefix(piece.size());
+  }
+  return true;
+}
+
+void Lz4Writer::AddUniqueTo(MemoryEstimator* memory_estimator) const {
+  BufferedWriter::AddUniqueTo(memory_estimator);
+  memory_estimator->AddMemory(sizeof(Lz4Writer) - sizeof(BufferedWriter));
+  if (owned_dest_ != nullptr) {
+    owned_dest_->AddUniqueTo(memory_estimator);
+  } else if (dest_ != nullptr) {
+    dest_->AddSharedTo(memory_estimator);
+  }
+  memory_estimator->AddMemory(compressed_buffer_.capacity());
+  // LZ4 does not report the size of LZ4F_cctx, which is not counted.
+}
+
+}  // namespace riegeli
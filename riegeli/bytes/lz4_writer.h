@@ -0,0 +1,176 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_BYTES_LZ4_WRITER_H_
+#define RIEGELI_BYTES_LZ4_WRITER_H_
+
+#include <stddef.h>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "absl/strings/string_view.h"
+#include "lz4frame.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/base/recycling_pool.h"
+#include "riegeli/bytes/buffered_writer.h"
+#include "riegeli/bytes/writer.h"
+
+namespace riegeli {
+
+// A Writer which compresses data with LZ4 (frame format) before passing it to
+// another Writer.
+//
+// LZ4 trades compression density for speed: decompression runs at several
+// GB/s, which makes it suitable for data which is read back often.
+class Lz4Writer final : public BufferedWriter {
+ public:
+  class Options {
+   public:
+    // Not defaulted because of a C++ defect:
+    // https://stackoverflow.com/questions/17430377
+    Options() noexcept {}
+
+    // Tunes the tradeoff between compression density and compression speed
+    // (higher = better density but slower). Levels from 3 use the LZ4HC
+    // algorithm, which makes compression much slower but not decompression.
+    //
+    // compression_level must be between kMinCompressionLevel() (0) and
+    // kMaxCompressionLevel() (12). Default: kDefaultCompressionLevel() (0).
+    static constexpr int kMinCompressionLevel() { return 0; }
+    static constexpr int kMaxCompressionLevel() { return 12; }
+    static constexpr int kDefaultCompressionLevel() { return 0; }
+    Options& set_compression_level(int compression_level) & {
+      RIEGELI_ASSERT_GE(compression_level, kMinCompressionLevel())
+          << "Failed precondition of "
+             "Lz4Writer::Options::set_compression_level(): "
+             "compression level out of range";
+      RIEGELI_ASSERT_LE(compression_level, kMaxCompressionLevel())
+          << "Failed precondition of "
+             "Lz4Writer::Options::set_compression_level(): "
+             "compression level out of range";
+      compression_level_ = compression_level;
+      return *this;
+    }
+    Options&& set_compression_level(int compression_level) && {
+      return std::move(set_compression_level(compression_level));
+    }
+
+    static constexpr size_t kDefaultBufferSize() { return size_t{64} << 10; }
+    Options& set_buffer_size(size_t buffer_size) & {
+      RIEGELI_ASSERT_GT(buffer_size, 0u)
+          << "Failed precondition of Lz4Writer::Options::set_buffer_size(): "
+             "zero buffer size";
+      buffer_size_ = buffer_size;
+      return *this;
+    }
+    Options&& set_buffer_size(size_t buffer_size) && {
+      return std::move(set_buffer_size(buffer_size));
+    }
+
+    // Announce in advance the destination size. This selects the LZ4 block
+    // size, so that small data do not need large compression buffers.
+    //
+    // If the size hint turns out to not match reality, nothing breaks.
+    Options& set_size_hint(Position size_hint) & {
+      size_hint_ = size_hint;
+      return *this;
+    }
+    Options&& set_size_hint(Position size_hint) && {
+      return std::move(set_size_hint(size_hint));
+    }
+
+   private:
+    friend class Lz4Writer;
+
+    int compression_level_ = kDefaultCompressionLevel();
+    size_t buffer_size_ = kDefaultBufferSize();
+    Position size_hint_ = 0;
+  };
+
+  // Creates a closed Lz4Writer.
+  Lz4Writer() noexcept {}
+
+  // Will write LZ4-compressed stream to the byte Writer which is owned by this
+  // Lz4Writer and will be closed and deleted when the Lz4Writer is closed.
+  explicit Lz4Writer(std::unique_ptr<Writer> dest, Options options = Options());
+
+  // Will write LZ4-compressed stream to the byte Writer which is not owned by
+  // this Lz4Writer and must be kept alive but not accessed until closing the
+  // Lz4Writer, except that it is allowed to read its destination directly
+  // after Flush().
+  explicit Lz4Writer(Writer* dest, Options options = Options());
+
+  Lz4Writer(Lz4Writer&& src) noexcept;
+  Lz4Writer& operator=(Lz4Writer&& src) noexcept;
+
+  bool Flush(FlushType flush_type) override;
+
+  void AddUniqueTo(MemoryEstimator* memory_estimator) const override;
+
+ protected:
+  void Done() override;
+  bool WriteInternal(absl::string_view src) override;
+
+ private:
+  struct LZ4F_cctxDeleter {
+    void operator()(LZ4F_cctx* ptr) const { LZ4F_freeCompressionContext(ptr); }
+  };
+
+  // Creates compressor_ if needed, and writes the frame header if it was not
+  // written yet.
+  bool EnsureFrameStarted();
+
+  // Calls function(dest, dest_size) which writes at most max_length bytes to
+  // dest and returns their length or an LZ4F error code. The output is written
+  // to dest_, through compressed_buffer_ if dest_ has less than max_length
+  // bytes available.
+  template <typename Function>
+  bool CompressToDest(size_t max_length, Function function,
+                      absl::string_view function_name);
+
+  std::unique_ptr<Writer> owned_dest_;
+  // Invariant: if healthy() then dest_ != nullptr
+  Writer* dest_ = nullptr;
+  LZ4F_preferences_t preferences_ = LZ4F_preferences_t();
+  // If healthy() but compressor_ == nullptr then compressor_ was not created
+  // yet.
+  RecyclingPool<LZ4F_cctx, LZ4F_cctxDeleter>::Handle compressor_;
+  // If true, the frame header was written to dest_.
+  bool frame_started_ = false;
+  // Output of compression if dest_ does not have enough space available.
+  std::string compressed_buffer_;
+};
+
+// Implementation details follow.
+
+inline Lz4Writer::Lz4Writer(std::unique_ptr<Writer> dest, Options options)
+    : Lz4Writer(dest.get(), options) {
+  owned_dest_ = std::move(dest);
+}
+
+inline Lz4Writer::Lz4Writer(Lz4Writer&& src) noexcept
+    : BufferedWriter(std::move(src)),
+      owned_dest_(std::move(src.owned_dest_)),
+      dest_(riegeli::exchange(src.dest_, nullptr)),
+      preferences_(src.preferences_),
+      compressor_(std::move(src.compressor_)),
+      frame_started_(riegeli::exchange(src.frame_started_, false)),
+      compressed_buffer_(
+          riegeli::exchange(src.compressed_buffer_, std::string())) {}
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_BYTES_LZ4_WRITER_H_
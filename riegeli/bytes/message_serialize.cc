@@ -15,8 +15,10 @@
 #include "riegeli/bytes/message_serialize.h"
 
 #include <stddef.h>
+#include <stdint.h>
 #include <limits>
 
+#include "google/protobuf/io/coded_stream.h"
 #include "google/protobuf/io/zero_copy_stream.h"
 #include "google/protobuf/message_lite.h"
 #include "absl/base/optimization.h"
@@ -100,6 +102,22 @@ bool SerializePartialToWriter(const google::protobuf::MessageLite& message,
   return message.SerializePartialToZeroCopyStream(&output_stream);
 }
 
+bool SerializePartialWithCachedSizesToWriter(
+    const google::protobuf::MessageLite& message, Writer* output) {
+  const size_t size = IntCast<size_t>(message.GetCachedSize());
+  if (ABSL_PREDICT_TRUE(output->available() >= size)) {
+    // Fast path: the array serializer writes directly to the buffer.
+    char* const cursor = output->cursor();
+    message.SerializeWithCachedSizesToArray(reinterpret_cast<uint8_t*>(cursor));
+    output->set_cursor(cursor + size);
+    return true;
+  }
+  WriterOutputStream output_stream(output);
+  google::protobuf::io::CodedOutputStream coded_stream(&output_stream);
+  message.SerializeWithCachedSizes(&coded_stream);
+  return !coded_stream.HadError();
+}
+
 bool SerializeToChain(const google::protobuf::MessageLite& message, Chain* output) {
   output->Clear();
   return AppendToChain(message, output);
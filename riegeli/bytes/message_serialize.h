@@ -27,6 +27,15 @@ bool SerializeToWriter(const google::protobuf::MessageLite& message, Writer* out
 bool SerializePartialToWriter(const google::protobuf::MessageLite& message,
                               Writer* output);
 
+// Like SerializePartialToWriter(), but uses sizes cached by the last call to
+// message.ByteSizeLong() instead of computing them again. If the message fits
+// in the buffer of output, it is serialized there directly.
+//
+// Precondition: message.ByteSizeLong() was called after the last modification
+// of the message, and it returned at most numeric_limits<int>::max()
+bool SerializePartialWithCachedSizesToWriter(
+    const google::protobuf::MessageLite& message, Writer* output);
+
 // Serializes the message and store it in the given Chain. All required fields
 // must be set. The Chain is cleared on failure.
 bool SerializeToChain(const google::protobuf::MessageLite& message, Chain* output);
@@ -0,0 +1,295 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/bytes/range_reader.h"
+
+#include <stddef.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/base/parallelism.h"
+#include "riegeli/bytes/reader.h"
+
+namespace riegeli {
+
+struct RangeReader::Request {
+  Request(Position pos, size_t length) : pos(pos), length(length) {}
+
+  const Position pos;
+  const size_t length;
+
+  absl::Mutex mutex;
+  // The number of reads of this range in progress: the original one, and
+  // possibly a hedged one.
+  int running GUARDED_BY(mutex) = 0;
+  bool done GUARDED_BY(mutex) = false;
+  // Whether a hedged read was issued. Used only by the RangeReader.
+  bool hedged = false;
+
+  // Set when done becomes true, then not changed.
+  bool ok = false;
+  Chain data;
+  std::string message;
+};
+
+RangeReader::RangeReader(const RangeSource* src, Options options)
+    : Reader(State::kOpen),
+      src_(RIEGELI_ASSERT_NOTNULL(src)),
+      block_size_(options.block_size_),
+      max_requests_(options.max_requests_),
+      hedge_delay_(options.hedge_delay_),
+      thread_pool_(options.thread_pool_) {
+  std::string message;
+  if (ABSL_PREDICT_FALSE(!src_->Size(&size_, &message))) {
+    Fail(absl::StrCat("Getting size failed: ", message));
+  }
+}
+
+RangeReader::~RangeReader() { AwaitRequests(); }
+
+void RangeReader::Done() {
+  AwaitRequests();
+  src_ = nullptr;
+  block_size_ = 0;
+  max_requests_ = 0;
+  thread_pool_ = nullptr;
+  size_ = 0;
+  num_requests_ = 1;
+  requests_.clear();
+  block_index_ = 0;
+  abandoned_ = std::vector<std::shared_ptr<Request>>();
+  Reader::Done();
+}
+
+inline ThreadPool& RangeReader::thread_pool() const {
+  return thread_pool_ != nullptr ? *thread_pool_
+                                 : internal::DefaultThreadPool();
+}
+
+void RangeReader::ExecuteRequest(const RangeSource* src,
+                                 const std::shared_ptr<Request>& request) {
+  Chain data;
+  std::string message;
+  const bool ok = src->ReadRange(request->pos, request->length, &data,
+                                 &message);
+  absl::MutexLock lock(&request->mutex);
+  --request->running;
+  if (request->done) return;
+  // A failure is not final while another read of the same range may succeed.
+  if (ABSL_PREDICT_FALSE(!ok) && request->running > 0) return;
+  request->ok = ok;
+  request->data = std::move(data);
+  request->message = std::move(message);
+  request->done = true;
+}
+
+void RangeReader::IssueRequests() {
+  Position pos = requests_.empty()
+                     ? limit_pos_
+                     : requests_.back()->pos + requests_.back()->length;
+  while (requests_.size() < num_requests_ && pos < size_) {
+    const size_t length = IntCast<size_t>(UnsignedMin(
+        block_size_ - IntCast<size_t>(pos % block_size_), size_ - pos));
+    std::shared_ptr<Request> request = std::make_shared<Request>(pos, length);
+    {
+      absl::MutexLock lock(&request->mutex);
+      ++request->running;
+    }
+    const RangeSource* const src = src_;
+    thread_pool().Schedule(
+        [src, request] { ExecuteRequest(src, request); });
+    requests_.push_back(std::move(request));
+    pos += length;
+  }
+}
+
+bool RangeReader::AwaitFront() {
+  Request& request = *requests_.front();
+  request.mutex.Lock();
+  if (hedge_delay_ != absl::InfiniteDuration() && !request.hedged &&
+      !request.mutex.AwaitWithTimeout(absl::Condition(&request.done),
+                                      hedge_delay_)) {
+    request.hedged = true;
+    ++request.running;
+    request.mutex.Unlock();
+    const RangeSource* const src = src_;
+    const std::shared_ptr<Request> shared_request = requests_.front();
+    thread_pool().Schedule(
+        [src, shared_request] { ExecuteRequest(src, shared_request); });
+    request.mutex.Lock();
+  }
+  request.mutex.Await(absl::Condition(&request.done));
+  request.mutex.Unlock();
+  if (ABSL_PREDICT_FALSE(!request.ok)) {
+    return Fail(absl::StrCat("Reading range at ", request.pos, " failed: ",
+                             request.message));
+  }
+  if (ABSL_PREDICT_FALSE(request.data.size() != request.length)) {
+    return Fail(absl::StrCat("Reading range at ", request.pos, " returned ",
+                             request.data.size(), " bytes instead of ",
+                             request.length, ", source truncated?"));
+  }
+  return true;
+}
+
+void RangeReader::SetBuffer(Position new_pos) {
+  const Request& request = *requests_.front();
+  RIEGELI_ASSERT_GE(new_pos, request.pos)
+      << "Failed precondition of RangeReader::SetBuffer(): "
+         "position before the request";
+  RIEGELI_ASSERT_LT(new_pos, request.pos + request.length)
+      << "Failed precondition of RangeReader::SetBuffer(): "
+         "position after the request";
+  Position block_begin = request.pos;
+  block_index_ = 0;
+  for (Chain::BlockIterator iter = request.data.blocks().cbegin();
+       iter != request.data.blocks().cend(); ++iter, ++block_index_) {
+    if (new_pos - block_begin < iter->size()) {
+      start_ = iter->data();
+      cursor_ = start_ + IntCast<size_t>(new_pos - block_begin);
+      limit_ = start_ + iter->size();
+      limit_pos_ = block_begin + iter->size();
+      return;
+    }
+    block_begin += iter->size();
+  }
+  RIEGELI_ASSERT_UNREACHABLE()
+      << "RangeReader::SetBuffer(): position not found in request data";
+}
+
+void RangeReader::DropFront() {
+  std::shared_ptr<Request> request = std::move(requests_.front());
+  requests_.pop_front();
+  {
+    absl::MutexLock lock(&request->mutex);
+    if (request->running == 0) return;
+  }
+  // Forget abandoned requests which have finished, so that abandoned_ does not
+  // grow with the number of seeks.
+  abandoned_.erase(
+      std::remove_if(abandoned_.begin(), abandoned_.end(),
+                     [](const std::shared_ptr<Request>& abandoned) {
+                       absl::MutexLock lock(&abandoned->mutex);
+                       return abandoned->running == 0;
+                     }),
+      abandoned_.end());
+  abandoned_.push_back(std::move(request));
+}
+
+void RangeReader::AwaitRequests() {
+  const auto await = [](Request* request) {
+    absl::MutexLock lock(&request->mutex);
+    request->mutex.Await(absl::Condition(
+        +[](int* running) { return *running == 0; }, &request->running));
+  };
+  for (const std::shared_ptr<Request>& request : requests_) {
+    await(request.get());
+  }
+  for (const std::shared_ptr<Request>& request : abandoned_) {
+    await(request.get());
+  }
+  abandoned_.clear();
+}
+
+bool RangeReader::PullSlow() {
+  RIEGELI_ASSERT_EQ(available(), 0u)
+      << "Failed precondition of Reader::PullSlow(): "
+         "data available, use Pull() instead";
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (!requests_.empty() && start_ != nullptr) {
+    // The buffer points into requests_.front()->data.
+    const Chain& data = requests_.front()->data;
+    while (++block_index_ < data.blocks().size()) {
+      const Chain::BlockIterator iter = data.blocks().cbegin() + block_index_;
+      if (ABSL_PREDICT_TRUE(!iter->empty())) {
+        start_ = iter->data();
+        cursor_ = start_;
+        limit_ = start_ + iter->size();
+        limit_pos_ += iter->size();
+        return true;
+      }
+    }
+    DropFront();
+    // Reading is sequential, so read further ahead.
+    num_requests_ = UnsignedMin(num_requests_ * 2, max_requests_);
+  }
+  start_ = nullptr;
+  cursor_ = nullptr;
+  limit_ = nullptr;
+  IssueRequests();
+  if (requests_.empty()) return false;
+  if (ABSL_PREDICT_FALSE(!AwaitFront())) return false;
+  SetBuffer(limit_pos_);
+  return true;
+}
+
+bool RangeReader::SeekSlow(Position new_pos) {
+  RIEGELI_ASSERT(new_pos < start_pos() || new_pos > limit_pos_)
+      << "Failed precondition of Reader::SeekSlow(): "
+         "position in the buffer, use Seek() instead";
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  bool ok = true;
+  if (ABSL_PREDICT_FALSE(new_pos > size_)) {
+    new_pos = size_;
+    ok = false;
+  }
+  start_ = nullptr;
+  cursor_ = nullptr;
+  limit_ = nullptr;
+  // Requests before new_pos will not be needed.
+  while (!requests_.empty() &&
+         requests_.front()->pos + requests_.front()->length <= new_pos) {
+    DropFront();
+  }
+  if (!requests_.empty() && requests_.front()->pos <= new_pos) {
+    // new_pos has been requested.
+    if (ABSL_PREDICT_FALSE(!AwaitFront())) return false;
+    SetBuffer(new_pos);
+    return ok;
+  }
+  // Random access: requests issued so far will not be needed, and reading
+  // ahead starts again from a single request.
+  while (!requests_.empty()) DropFront();
+  num_requests_ = 1;
+  limit_pos_ = new_pos;
+  return ok;
+}
+
+bool RangeReader::Size(Position* size) const {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  *size = size_;
+  return true;
+}
+
+void RangeReader::AddUniqueTo(MemoryEstimator* memory_estimator) const {
+  Reader::AddUniqueTo(memory_estimator);
+  memory_estimator->AddMemory(sizeof(RangeReader) - sizeof(Reader));
+  for (const std::shared_ptr<Request>& request : requests_) {
+    // Data of requests in flight are approximated by their length.
+    memory_estimator->AddMemory(sizeof(Request) + request->length);
+  }
+}
+
+}  // namespace riegeli
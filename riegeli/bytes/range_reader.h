@@ -0,0 +1,278 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_BYTES_RANGE_READER_H_
+#define RIEGELI_BYTES_RANGE_READER_H_
+
+#include <stddef.h>
+#include <deque>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/time/time.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/base/object.h"
+#include "riegeli/bytes/reader.h"
+
+namespace riegeli {
+
+class ThreadPool;
+
+// A source of data which is read by ranges, e.g. a client of an object store
+// or of an HTTP server supporting range requests.
+//
+// The source is not expected to change while it is being read. Reusing
+// connections between requests is up to the implementation.
+class RangeSource {
+ public:
+  virtual ~RangeSource() = default;
+
+  // Reads length bytes at pos, appending them to *dest. Fewer bytes are read
+  // only if the source ends.
+  //
+  // This must be thread-safe: RangeReader issues several requests
+  // concurrently.
+  //
+  // Return values:
+  //  * true  - success
+  //  * false - failure (*message is set)
+  virtual bool ReadRange(Position pos, size_t length, Chain* dest,
+                         std::string* message) const = 0;
+
+  // Returns the size of the source.
+  //
+  // Return values:
+  //  * true  - success (*size is set)
+  //  * false - failure (*message is set)
+  virtual bool Size(Position* size, std::string* message) const = 0;
+};
+
+// A Reader which reads from a RangeSource, keeping several range requests in
+// flight.
+//
+// Reading sequentially issues requests for the following blocks ahead of time,
+// with the number of requests in flight growing up to
+// Options::set_max_requests() as long as reading stays sequential. Seeking
+// outside of the blocks already requested starts again from one request, so
+// that random access does not fetch data which will not be read.
+//
+// With Options::set_hedge_delay(), if a block being waited for takes longer
+// than the delay, a second request for it is issued and the first response is
+// used. This cuts tail latency at the cost of occasional duplicate requests.
+//
+// Requests are executed by threads of a ThreadPool, which are blocked for their
+// duration.
+class RangeReader final : public Reader {
+ public:
+  class Options {
+   public:
+    // Not defaulted because of a C++ defect:
+    // https://stackoverflow.com/questions/17430377
+    Options() noexcept {}
+
+    // The size of a range request. Requests are aligned to multiples of
+    // block_size, except that the first request after a seek starts at the
+    // seek position.
+    //
+    // Default: 1M
+    Options& set_block_size(size_t block_size) & {
+      RIEGELI_ASSERT_GT(block_size, 0u)
+          << "Failed precondition of RangeReader::Options::set_block_size(): "
+             "zero block size";
+      block_size_ = block_size;
+      return *this;
+    }
+    Options&& set_block_size(size_t block_size) && {
+      return std::move(set_block_size(block_size));
+    }
+
+    // The maximal number of requests in flight while reading sequentially,
+    // including the one being waited for.
+    //
+    // Default: 8
+    Options& set_max_requests(size_t max_requests) & {
+      RIEGELI_ASSERT_GT(max_requests, 0u)
+          << "Failed precondition of "
+             "RangeReader::Options::set_max_requests(): "
+             "zero number of requests";
+      max_requests_ = max_requests;
+      return *this;
+    }
+    Options&& set_max_requests(size_t max_requests) && {
+      return std::move(set_max_requests(max_requests));
+    }
+
+    // If a block being waited for did not arrive after hedge_delay, a second
+    // request for it is issued, and whichever response comes first is used.
+    //
+    // absl::InfiniteDuration() disables hedging.
+    //
+    // Default: absl::InfiniteDuration()
+    Options& set_hedge_delay(absl::Duration hedge_delay) & {
+      RIEGELI_ASSERT(hedge_delay >= absl::ZeroDuration())
+          << "Failed precondition of "
+             "RangeReader::Options::set_hedge_delay(): "
+             "negative delay";
+      hedge_delay_ = hedge_delay;
+      return *this;
+    }
+    Options&& set_hedge_delay(absl::Duration hedge_delay) && {
+      return std::move(set_hedge_delay(hedge_delay));
+    }
+
+    // Specifies the thread pool executing requests. The thread pool must be
+    // kept alive until the RangeReader is closed.
+    //
+    // Requests block threads of the pool while waiting for responses, so a
+    // dedicated thread pool avoids delaying other work.
+    //
+    // If nullptr, a thread pool shared by the process is used.
+    //
+    // Default: nullptr
+    Options& set_thread_pool(ThreadPool* thread_pool) & {
+      thread_pool_ = thread_pool;
+      return *this;
+    }
+    Options&& set_thread_pool(ThreadPool* thread_pool) && {
+      return std::move(set_thread_pool(thread_pool));
+    }
+
+   private:
+    friend class RangeReader;
+
+    size_t block_size_ = size_t{1} << 20;
+    size_t max_requests_ = 8;
+    absl::Duration hedge_delay_ = absl::InfiniteDuration();
+    ThreadPool* thread_pool_ = nullptr;
+  };
+
+  // Creates a closed RangeReader.
+  RangeReader() noexcept : Reader(State::kClosed) {}
+
+  // Will read from src, which must be kept alive until the RangeReader is
+  // closed. Closing waits for requests in flight.
+  explicit RangeReader(const RangeSource* src, Options options = Options());
+
+  RangeReader(RangeReader&& src) noexcept;
+  RangeReader& operator=(RangeReader&& src) noexcept;
+
+  ~RangeReader();
+
+  bool SupportsRandomAccess() const override { return true; }
+  bool Size(Position* size) const override;
+  void AddUniqueTo(MemoryEstimator* memory_estimator) const override;
+
+ protected:
+  void Done() override;
+  bool PullSlow() override;
+  bool SeekSlow(Position new_pos) override;
+
+ private:
+  struct Request;
+
+  // Reads the range of request from src and completes request, unless it has
+  // been completed by another read of the same range.
+  static void ExecuteRequest(const RangeSource* src,
+                             const std::shared_ptr<Request>& request);
+
+  ThreadPool& thread_pool() const;
+
+  // Issues requests following those in requests_, or starting at limit_pos_
+  // if there are none, until there are num_requests_ of them or the source
+  // ends.
+  void IssueRequests();
+
+  // Waits for requests_.front(), hedging it if it takes longer than
+  // hedge_delay_.
+  //
+  // If the result is false then !healthy().
+  bool AwaitFront();
+
+  // Sets the buffer to the block of requests_.front()->data containing
+  // new_pos.
+  //
+  // Precondition: requests_.front() is complete and contains new_pos.
+  void SetBuffer(Position new_pos);
+
+  // Removes requests_.front(), keeping it in abandoned_ if it is still being
+  // read.
+  void DropFront();
+
+  // Waits until no requests are being read.
+  void AwaitRequests();
+
+  // Invariant: if healthy() then src_ != nullptr
+  const RangeSource* src_ = nullptr;
+  size_t block_size_ = 0;
+  size_t max_requests_ = 0;
+  absl::Duration hedge_delay_;
+  ThreadPool* thread_pool_ = nullptr;
+  Position size_ = 0;
+  // The number of requests to keep in flight, growing while reading
+  // sequentially.
+  size_t num_requests_ = 1;
+  // Requests for consecutive ranges. The buffer, if not empty, points into
+  // requests_.front()->data.
+  std::deque<std::shared_ptr<Request>> requests_;
+  // Index of the block of requests_.front()->data which the buffer points to.
+  size_t block_index_ = 0;
+  // Requests no longer needed which might still be being read. They are
+  // waited for when closing, because they use src_.
+  std::vector<std::shared_ptr<Request>> abandoned_;
+};
+
+// Implementation details follow.
+
+inline RangeReader::RangeReader(RangeReader&& src) noexcept
+    : Reader(std::move(src)),
+      src_(riegeli::exchange(src.src_, nullptr)),
+      block_size_(riegeli::exchange(src.block_size_, 0)),
+      max_requests_(riegeli::exchange(src.max_requests_, 0)),
+      hedge_delay_(src.hedge_delay_),
+      thread_pool_(riegeli::exchange(src.thread_pool_, nullptr)),
+      size_(riegeli::exchange(src.size_, 0)),
+      num_requests_(riegeli::exchange(src.num_requests_, 1)),
+      requests_(std::move(src.requests_)),
+      block_index_(riegeli::exchange(src.block_index_, 0)),
+      abandoned_(std::move(src.abandoned_)) {
+  src.requests_.clear();
+  src.abandoned_.clear();
+}
+
+inline RangeReader& RangeReader::operator=(RangeReader&& src) noexcept {
+  // Requests of this RangeReader may still be using its src_.
+  AwaitRequests();
+  Reader::operator=(std::move(src));
+  src_ = riegeli::exchange(src.src_, nullptr);
+  block_size_ = riegeli::exchange(src.block_size_, 0);
+  max_requests_ = riegeli::exchange(src.max_requests_, 0);
+  hedge_delay_ = src.hedge_delay_;
+  thread_pool_ = riegeli::exchange(src.thread_pool_, nullptr);
+  size_ = riegeli::exchange(src.size_, 0);
+  num_requests_ = riegeli::exchange(src.num_requests_, 1);
+  requests_ = std::move(src.requests_);
+  src.requests_.clear();
+  block_index_ = riegeli::exchange(src.block_index_, 0);
+  abandoned_ = std::move(src.abandoned_);
+  src.abandoned_.clear();
+  return *this;
+}
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_BYTES_RANGE_READER_H_
@@ -0,0 +1,101 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/bytes/rate_limiter.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "riegeli/base/base.h"
+
+namespace riegeli {
+
+RateLimiter::RateLimiter(Options options)
+    : burst_size_(static_cast<double>(options.burst_size_)),
+      bytes_per_second_(static_cast<double>(options.bytes_per_second_)),
+      tokens_(burst_size_),
+      last_refill_(std::chrono::steady_clock::now()) {}
+
+void RateLimiter::set_bytes_per_second(Position bytes_per_second) {
+  RIEGELI_ASSERT_GT(bytes_per_second, 0u)
+      << "Failed precondition of RateLimiter::set_bytes_per_second(): "
+         "zero rate";
+  absl::MutexLock lock(&mutex_);
+  // Tokens accumulated so far are counted with the old rate.
+  Refill(std::chrono::steady_clock::now());
+  bytes_per_second_ = static_cast<double>(bytes_per_second);
+  changed_.SignalAll();
+}
+
+Position RateLimiter::bytes_per_second() const {
+  absl::MutexLock lock(&mutex_);
+  return static_cast<Position>(bytes_per_second_);
+}
+
+absl::Duration RateLimiter::wait_time() const {
+  absl::MutexLock lock(&mutex_);
+  return wait_time_;
+}
+
+absl::Duration RateLimiter::background_wait_time() const {
+  absl::MutexLock lock(&mutex_);
+  return background_wait_time_;
+}
+
+inline void RateLimiter::Refill(std::chrono::steady_clock::time_point now) {
+  const double elapsed =
+      std::chrono::duration<double>(now - last_refill_).count();
+  last_refill_ = now;
+  tokens_ = std::min(tokens_ + elapsed * bytes_per_second_, burst_size_);
+}
+
+void RateLimiter::Wait(Priority priority) {
+  const bool foreground = priority == Priority::kForeground;
+  absl::MutexLock lock(&mutex_);
+  const std::chrono::steady_clock::time_point begin =
+      std::chrono::steady_clock::now();
+  std::chrono::steady_clock::time_point now = begin;
+  if (foreground) ++foreground_waiting_;
+  for (;;) {
+    Refill(now);
+    const bool tokens_available = tokens_ > 0.0;
+    if (tokens_available && (foreground || foreground_waiting_ == 0)) break;
+    if (tokens_available) {
+      // Tokens are left for waiting foreground transfers. Wait until they
+      // proceed.
+      changed_.Wait(&mutex_);
+    } else {
+      // Wait until at least one token accumulates, or the rate changes.
+      changed_.WaitWithTimeout(
+          &mutex_, absl::Seconds((1.0 - tokens_) / bytes_per_second_));
+    }
+    now = std::chrono::steady_clock::now();
+  }
+  if (foreground && --foreground_waiting_ == 0) changed_.SignalAll();
+  if (now != begin) {
+    const absl::Duration waited = absl::FromChrono(now - begin);
+    wait_time_ += waited;
+    if (!foreground) background_wait_time_ += waited;
+  }
+}
+
+void RateLimiter::Consume(Position length) {
+  absl::MutexLock lock(&mutex_);
+  Refill(std::chrono::steady_clock::now());
+  tokens_ -= static_cast<double>(length);
+}
+
+}  // namespace riegeli
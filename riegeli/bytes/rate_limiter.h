@@ -0,0 +1,158 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_BYTES_RATE_LIMITER_H_
+#define RIEGELI_BYTES_RATE_LIMITER_H_
+
+#include <chrono>
+#include <utility>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "riegeli/base/base.h"
+
+namespace riegeli {
+
+// RateLimiter limits the bandwidth of I/O performed by several objects, e.g.
+// so that background compaction or scanning does not saturate a disk needed
+// by serving.
+//
+// It is a token bucket: tokens accumulate at bytes_per_second up to
+// burst_size, and each transfer takes as many tokens as bytes transferred. A
+// transfer may proceed when some tokens are available, and may take more
+// tokens than available, leaving a debt which delays further transfers. Hence
+// a transfer larger than burst_size is not split, but the average rate is
+// still respected.
+//
+// Transfers have a priority. While a foreground transfer waits for tokens,
+// background transfers do not proceed, so that foreground transfers get the
+// tokens as soon as they are available.
+//
+// A RateLimiter is attached with Options::set_rate_limiter() of FdReader,
+// FdStreamReader, FdWriter, FdStreamWriter, or RecordWriter, and must be kept
+// alive until they are closed.
+//
+// RateLimiter is thread-safe.
+class RateLimiter {
+ public:
+  enum class Priority {
+    // A transfer which something is waiting for, e.g. serving a request.
+    kForeground,
+    // A transfer which can be delayed, e.g. compaction, backups, or scans.
+    kBackground,
+  };
+
+  class Options {
+   public:
+    // Not defaulted because of a C++ defect:
+    // https://stackoverflow.com/questions/17430377
+    Options() noexcept {}
+
+    // Sets the rate at which tokens accumulate.
+    //
+    // Default: 64M
+    Options& set_bytes_per_second(Position bytes_per_second) & {
+      RIEGELI_ASSERT_GT(bytes_per_second, 0u)
+          << "Failed precondition of "
+             "RateLimiter::Options::set_bytes_per_second(): "
+             "zero rate";
+      bytes_per_second_ = bytes_per_second;
+      return *this;
+    }
+    Options&& set_bytes_per_second(Position bytes_per_second) && {
+      return std::move(set_bytes_per_second(bytes_per_second));
+    }
+
+    // Sets the maximal number of tokens accumulated while there are no
+    // transfers, i.e. how much can be transferred at once after being idle.
+    //
+    // Default: 1M
+    Options& set_burst_size(Position burst_size) & {
+      RIEGELI_ASSERT_GT(burst_size, 0u)
+          << "Failed precondition of RateLimiter::Options::set_burst_size(): "
+             "zero burst size";
+      burst_size_ = burst_size;
+      return *this;
+    }
+    Options&& set_burst_size(Position burst_size) && {
+      return std::move(set_burst_size(burst_size));
+    }
+
+   private:
+    friend class RateLimiter;
+
+    Position bytes_per_second_ = Position{64} << 20;
+    Position burst_size_ = Position{1} << 20;
+  };
+
+  explicit RateLimiter(Options options = Options());
+
+  RateLimiter(const RateLimiter&) = delete;
+  RateLimiter& operator=(const RateLimiter&) = delete;
+
+  // Changes the rate at which tokens accumulate. Waiting transfers are
+  // reconsidered with the new rate.
+  //
+  // Precondition: bytes_per_second > 0
+  void set_bytes_per_second(Position bytes_per_second);
+  Position bytes_per_second() const;
+
+  // Waits until a transfer with the given priority may proceed.
+  //
+  // The transfer should then be reported with Consume(), with its actual
+  // length.
+  void Wait(Priority priority);
+
+  // Takes tokens for length bytes transferred, possibly leaving a debt.
+  void Consume(Position length);
+
+  // Equivalent to Wait(priority) followed by Consume(length), for transfers
+  // whose length is known in advance.
+  void Acquire(Position length, Priority priority);
+
+  // Returns the total time spent in Wait() by all transfers, and how much of
+  // it was spent by background transfers.
+  absl::Duration wait_time() const;
+  absl::Duration background_wait_time() const;
+
+ private:
+  // Adds tokens accumulated since the last refill.
+  void Refill(std::chrono::steady_clock::time_point now)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  const double burst_size_;
+  mutable absl::Mutex mutex_;
+  // Signalled when the rate changes, and when the last waiting foreground
+  // transfer proceeds.
+  absl::CondVar changed_;
+  double bytes_per_second_ GUARDED_BY(mutex_);
+  // Available tokens, negative if there is a debt.
+  double tokens_ GUARDED_BY(mutex_);
+  std::chrono::steady_clock::time_point last_refill_ GUARDED_BY(mutex_);
+  int foreground_waiting_ GUARDED_BY(mutex_) = 0;
+  absl::Duration wait_time_ GUARDED_BY(mutex_);
+  absl::Duration background_wait_time_ GUARDED_BY(mutex_);
+};
+
+// Implementation details follow.
+
+inline void RateLimiter::Acquire(Position length, Priority priority) {
+  Wait(priority);
+  Consume(length);
+}
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_BYTES_RATE_LIMITER_H_
@@ -25,6 +25,7 @@
 #include "absl/types/span.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/bytes/backward_writer.h"
 #include "riegeli/bytes/writer.h"
 
@@ -182,4 +183,12 @@ bool Reader::SeekSlow(Position new_pos) {
   return true;
 }
 
+void Reader::AddUniqueTo(MemoryEstimator* memory_estimator) const {
+  memory_estimator->AddMemory(sizeof(Reader));
+}
+
+void Reader::AddSharedTo(MemoryEstimator* memory_estimator) const {
+  if (memory_estimator->AddObject(this)) AddUniqueTo(memory_estimator);
+}
+
 }  // namespace riegeli
@@ -26,6 +26,7 @@
 #include "absl/strings/string_view.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
 #include "riegeli/bytes/backward_writer.h"
 #include "riegeli/bytes/writer.h"
@@ -187,6 +188,15 @@ class Reader : public Object {
   //  * false - failure (healthy() is unchanged)
   virtual bool Size(Position* size) const { return false; }
 
+  // Registers this Reader with MemoryEstimator, including its buffer and
+  // objects it owns or reads from.
+  //
+  // By default only sizeof(Reader) is registered. Derived classes which hold
+  // significant memory override this, calling AddUniqueTo() of their base class
+  // and adding the rest of their size and their subobjects.
+  virtual void AddUniqueTo(MemoryEstimator* memory_estimator) const;
+  void AddSharedTo(MemoryEstimator* memory_estimator) const;
+
  protected:
   // Creates a Reader with the given initial state.
   explicit Reader(State state) noexcept : Object(state) {}
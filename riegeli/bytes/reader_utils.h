@@ -69,6 +69,20 @@ bool ReadVarint64Slow(Reader* src, uint64_t* data);
 char* CopyVarint32Slow(Reader* src, char* dest);
 char* CopyVarint64Slow(Reader* src, char* dest);
 
+// Loads a number stored in little endian order, independently of the native
+// byte order. Compilers merge this into a single load where possible.
+inline uint32_t LoadLittleEndian32(const char* src) {
+  return uint32_t{static_cast<uint8_t>(src[0])} |
+         uint32_t{static_cast<uint8_t>(src[1])} << 8 |
+         uint32_t{static_cast<uint8_t>(src[2])} << 16 |
+         uint32_t{static_cast<uint8_t>(src[3])} << 24;
+}
+
+inline uint64_t LoadLittleEndian64(const char* src) {
+  return uint64_t{LoadLittleEndian32(src)} |
+         uint64_t{LoadLittleEndian32(src + 4)} << 32;
+}
+
 }  // namespace internal
 
 inline bool ReadByte(Reader* src, uint8_t* data) {
@@ -83,7 +97,32 @@ inline bool ReadVarint32(const char** src, uint32_t* data) {
   const char* cursor = *src;
   uint32_t acc = static_cast<uint8_t>(*cursor++);
   if (ABSL_PREDICT_FALSE(acc >= 0x80)) {
-    // More than a single byte.
+    // More than a single byte. Find the last byte among the first 4 bytes
+    // at once instead of examining bytes one by one.
+    const uint32_t word = internal::LoadLittleEndian32(*src);
+    const uint32_t last_bits = ~word & uint32_t{0x80808080};
+    if (ABSL_PREDICT_TRUE(last_bits != 0)) {
+      // Covers all bytes up to and including the last byte.
+      const uint32_t mask = ((last_bits & (~last_bits + 1)) << 1) - 1;
+      // One byte of mask & 0x0101... per byte; the multiplication sums them.
+      const size_t length = static_cast<size_t>(
+          ((mask & uint32_t{0x01010101}) * uint32_t{0x01010101}) >> 24);
+      *src += length;
+      if (ABSL_PREDICT_FALSE((word & mask & ~(mask >> 8)) == 0)) {
+        // Overlong representation.
+        return false;
+      }
+      uint32_t value = word & mask & uint32_t{0x7f7f7f7f};
+      // Squeeze out the continuation bits: first within pairs of bytes, then
+      // within the pair of 16-bit halves.
+      value = ((value & uint32_t{0x7f007f00}) >> 1) |
+              (value & uint32_t{0x007f007f});
+      value = ((value & uint32_t{0x3fff0000}) >> 2) |
+              (value & uint32_t{0x00003fff});
+      *data = value;
+      return true;
+    }
+    // All first 4 bytes have the continuation bit set.
     uint32_t byte;
     int shift = 0;
     do {
@@ -116,7 +155,36 @@ inline bool ReadVarint64(const char** src, uint64_t* data) {
   const char* cursor = *src;
   uint64_t acc = static_cast<uint8_t>(*cursor++);
   if (ABSL_PREDICT_FALSE(acc >= 0x80)) {
-    // More than a single byte.
+    // More than a single byte. Find the last byte among the first 8 bytes
+    // at once instead of examining bytes one by one.
+    const uint64_t word = internal::LoadLittleEndian64(*src);
+    const uint64_t last_bits = ~word & uint64_t{0x8080808080808080};
+    if (ABSL_PREDICT_TRUE(last_bits != 0)) {
+      // Covers all bytes up to and including the last byte.
+      const uint64_t mask = ((last_bits & (~last_bits + 1)) << 1) - 1;
+      // One byte of mask & 0x0101... per byte; the multiplication sums them.
+      const size_t length =
+          static_cast<size_t>(((mask & uint64_t{0x0101010101010101}) *
+                               uint64_t{0x0101010101010101}) >>
+                              56);
+      *src += length;
+      if (ABSL_PREDICT_FALSE((word & mask & ~(mask >> 8)) == 0)) {
+        // Overlong representation.
+        return false;
+      }
+      uint64_t value = word & mask & uint64_t{0x7f7f7f7f7f7f7f7f};
+      // Squeeze out the continuation bits: first within pairs of bytes, then
+      // within pairs of 16-bit halves, then within pairs of 32-bit halves.
+      value = ((value & uint64_t{0x7f007f007f007f00}) >> 1) |
+              (value & uint64_t{0x007f007f007f007f});
+      value = ((value & uint64_t{0x3fff00003fff0000}) >> 2) |
+              (value & uint64_t{0x00003fff00003fff});
+      value = ((value & uint64_t{0x0fffffff00000000}) >> 4) |
+              (value & uint64_t{0x000000000fffffff});
+      *data = value;
+      return true;
+    }
+    // All first 8 bytes have the continuation bit set.
     uint64_t byte;
     int shift = 0;
     do {
@@ -22,6 +22,7 @@
 #include "absl/strings/string_view.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
 
 namespace riegeli {
@@ -74,4 +75,12 @@ bool Writer::WriteSlow(Chain&& src) {
   return WriteSlow(src);
 }
 
+void Writer::AddUniqueTo(MemoryEstimator* memory_estimator) const {
+  memory_estimator->AddMemory(sizeof(Writer));
+}
+
+void Writer::AddSharedTo(MemoryEstimator* memory_estimator) const {
+  if (memory_estimator->AddObject(this)) AddUniqueTo(memory_estimator);
+}
+
 }  // namespace riegeli
@@ -26,6 +26,7 @@
 #include "absl/strings/string_view.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
 
 namespace riegeli {
@@ -172,6 +173,15 @@ class Writer : public Object {
   //  * false (when !healthy()) - failure (!healthy())
   virtual bool Truncate() { return false; }
 
+  // Registers this Writer with MemoryEstimator, including its buffer and
+  // objects it owns or writes to.
+  //
+  // By default only sizeof(Writer) is registered. Derived classes which hold
+  // significant memory override this, calling AddUniqueTo() of their base class
+  // and adding the rest of their size and their subobjects.
+  virtual void AddUniqueTo(MemoryEstimator* memory_estimator) const;
+  void AddSharedTo(MemoryEstimator* memory_estimator) const;
+
  protected:
   // Creates a Writer with the given initial state.
   explicit Writer(State state) noexcept : Object(state) {}
@@ -20,10 +20,47 @@
 
 #include "absl/base/optimization.h"
 #include "absl/strings/string_view.h"
+#include "absl/types/span.h"
 #include "riegeli/base/base.h"
 #include "riegeli/bytes/writer.h"
 
 namespace riegeli {
+
+namespace {
+
+template <typename T>
+bool WriteVarints(Writer* dest, absl::Span<const T> data) {
+  const T* iter = data.data();
+  const T* const end = iter + data.size();
+  while (iter != end) {
+    // Values whose varints surely fit in the buffer.
+    const size_t batch = UnsignedMin(dest->available() / kMaxLengthVarint64(),
+                                     PtrDistance(iter, end));
+    if (ABSL_PREDICT_FALSE(batch == 0)) {
+      if (ABSL_PREDICT_FALSE(!WriteVarint64(dest, uint64_t{*iter++}))) {
+        return false;
+      }
+      continue;
+    }
+    char* cursor = dest->cursor();
+    for (const T* const batch_end = iter + batch; iter != batch_end; ++iter) {
+      cursor = internal::WriteVarint64Wide(cursor, uint64_t{*iter});
+    }
+    dest->set_cursor(cursor);
+  }
+  return true;
+}
+
+}  // namespace
+
+bool WriteVarints32(Writer* dest, absl::Span<const uint32_t> data) {
+  return WriteVarints(dest, data);
+}
+
+bool WriteVarints64(Writer* dest, absl::Span<const uint64_t> data) {
+  return WriteVarints(dest, data);
+}
+
 namespace internal {
 
 bool WriteVarint32Slow(Writer* dest, uint32_t data) {
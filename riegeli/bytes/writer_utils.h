@@ -20,6 +20,7 @@
 #include <cstring>
 
 #include "absl/base/optimization.h"
+#include "absl/types/span.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/port.h"
 #include "riegeli/bytes/varint.h"
@@ -40,6 +41,12 @@ char* WriteVarint64(char* dest, uint64_t data);
 bool WriteVarint32(Writer* dest, uint32_t data);
 bool WriteVarint64(Writer* dest, uint64_t data);
 
+// Writes varints of all values, like WriteVarint32() or WriteVarint64() for
+// each value, but checking for available space once per batch of values, e.g.
+// for record sizes.
+bool WriteVarints32(Writer* dest, absl::Span<const uint32_t> data);
+bool WriteVarints64(Writer* dest, absl::Span<const uint64_t> data);
+
 bool WriteZeros(Writer* dest, Position length);
 
 // Implementation details follow.
@@ -51,6 +58,43 @@ bool WriteVarint64Slow(Writer* dest, uint64_t data);
 
 bool WriteZerosSlow(Writer* dest, Position length);
 
+// Stores a number in little endian order, independently of the native byte
+// order. Compilers merge this into a single store where possible.
+inline void StoreLittleEndian64(char* dest, uint64_t data) {
+  for (int i = 0; i < 8; ++i) {
+    dest[i] = static_cast<char>(data >> (i * 8));
+  }
+}
+
+// Like WriteVarint64(char*), but writes a varint of up to 8 bytes as a single
+// word, so at least kMaxLengthVarint64() bytes of space at dest[] must be
+// available. Bytes after the varint are overwritten with unspecified values.
+inline char* WriteVarint64Wide(char* dest, uint64_t data) {
+  if (ABSL_PREDICT_TRUE(data < 0x80)) {
+    *dest = static_cast<char>(data);
+    return dest + 1;
+  }
+  if (ABSL_PREDICT_FALSE(data >= uint64_t{1} << 56)) {
+    // 9 or 10 bytes do not fit in a word.
+    return WriteVarint64(dest, data);
+  }
+  // Spread 7-bit groups to bytes: first within pairs of 28-bit halves, then
+  // within pairs of 14-bit quarters, then within pairs of 7-bit groups. This
+  // is the reverse of squeezing out continuation bits in ReadVarint64().
+  uint64_t value = ((data & uint64_t{0x00fffffff0000000}) << 4) |
+                   (data & uint64_t{0x000000000fffffff});
+  value = ((value & uint64_t{0x0fffc0000fffc000}) << 2) |
+          (value & uint64_t{0x00003fff00003fff});
+  value = ((value & uint64_t{0x3f803f803f803f80}) << 1) |
+          (value & uint64_t{0x007f007f007f007f});
+  const size_t length = LengthVarint64(data);
+  // Continuation bits of all bytes except for the last one.
+  value |= uint64_t{0x8080808080808080} &
+           ((uint64_t{1} << ((length - 1) * 8)) - 1);
+  StoreLittleEndian64(dest, value);
+  return dest + length;
+}
+
 }  // namespace internal
 
 inline bool WriteByte(Writer* dest, uint8_t data) {
@@ -116,7 +160,11 @@ inline char* WriteVarint64(char* dest, uint64_t data) {
 }
 
 inline bool WriteVarint32(Writer* dest, uint32_t data) {
-  if (ABSL_PREDICT_TRUE(dest->available() >= kMaxLengthVarint32())) {
+  if (ABSL_PREDICT_TRUE(dest->available() >= kMaxLengthVarint64())) {
+    dest->set_cursor(internal::WriteVarint64Wide(dest->cursor(), data));
+    return true;
+  }
+  if (dest->available() >= kMaxLengthVarint32()) {
     dest->set_cursor(WriteVarint32(dest->cursor(), data));
     return true;
   }
@@ -125,7 +173,7 @@ inline bool WriteVarint32(Writer* dest, uint32_t data) {
 
 inline bool WriteVarint64(Writer* dest, uint64_t data) {
   if (ABSL_PREDICT_TRUE(dest->available() >= kMaxLengthVarint64())) {
-    dest->set_cursor(WriteVarint64(dest->cursor(), data));
+    dest->set_cursor(internal::WriteVarint64Wide(dest->cursor(), data));
     return true;
   }
   return internal::WriteVarint64Slow(dest, data);
@@ -0,0 +1,188 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/bytes/zlib_writer.h"
+
+#include <stddef.h>
+#include <limits>
+#include <string>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/bytes/buffered_writer.h"
+#include "riegeli/bytes/writer.h"
+#include "zconf.h"
+#include "zlib.h"
+
+namespace riegeli {
+
+ZLibWriter::ZLibWriter(Writer* dest, Options options)
+    : BufferedWriter(options.buffer_size_),
+      dest_(RIEGELI_ASSERT_NOTNULL(dest)),
+      window_log_(options.window_log_),
+      compressor_(new z_stream()) {
+  compressor_->next_in = nullptr;
+  compressor_->avail_in = 0;
+  compressor_->zalloc = nullptr;
+  compressor_->zfree = nullptr;
+  compressor_->opaque = nullptr;
+  int window_bits = options.window_log_;
+  switch (options.header_) {
+    case Header::kZlib:
+      break;
+    case Header::kGzip:
+      window_bits += 16;
+      break;
+    case Header::kRaw:
+      window_bits = -window_bits;
+      break;
+  }
+  const int result =
+      deflateInit2(compressor_.get(), options.compression_level_, Z_DEFLATED,
+                   window_bits, 8, Z_DEFAULT_STRATEGY);
+  if (ABSL_PREDICT_FALSE(result != Z_OK)) {
+    FailOperation("deflateInit2()", result);
+    // deflateEnd() must not be called if deflateInit2() failed.
+    delete compressor_.release();
+  }
+}
+
+void ZLibWriter::Done() {
+  if (ABSL_PREDICT_TRUE(healthy())) {
+    const size_t buffered_length = written_to_buffer();
+    cursor_ = start_;
+    WriteInternal(absl::string_view(start_, buffered_length), Z_FINISH);
+  }
+  if (owned_dest_ != nullptr) {
+    if (ABSL_PREDICT_TRUE(healthy())) {
+      if (ABSL_PREDICT_FALSE(!owned_dest_->Close())) Fail(*owned_dest_);
+    }
+    owned_dest_.reset();
+  }
+  dest_ = nullptr;
+  window_log_ = 0;
+  compressor_.reset();
+  BufferedWriter::Done();
+}
+
+inline bool ZLibWriter::FailOperation(absl::string_view operation,
+                                      int zlib_code) {
+  std::string message = absl::StrCat(operation, " failed");
+  const char* const details =
+      compressor_ != nullptr && compressor_->msg != nullptr ? compressor_->msg
+                                                            : zError(zlib_code);
+  if (details != nullptr) absl::StrAppend(&message, ": ", details);
+  return Fail(message);
+}
+
+bool ZLibWriter::Flush(FlushType flush_type) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  const size_t buffered_length = written_to_buffer();
+  cursor_ = start_;
+  if (ABSL_PREDICT_FALSE(!WriteInternal(
+          absl::string_view(start_, buffered_length), Z_SYNC_FLUSH))) {
+    return false;
+  }
+  if (ABSL_PREDICT_FALSE(!dest_->Flush(flush_type))) {
+    if (dest_->healthy()) return false;
+    limit_ = start_;
+    return Fail(*dest_);
+  }
+  return true;
+}
+
+bool ZLibWriter::WriteInternal(absl::string_view src) {
+  RIEGELI_ASSERT(!src.empty())
+      << "Failed precondition of BufferedWriter::WriteInternal(): "
+         "nothing to write";
+  RIEGELI_ASSERT(healthy())
+      << "Failed precondition of BufferedWriter::WriteInternal(): "
+         "Object unhealthy";
+  RIEGELI_ASSERT_EQ(written_to_buffer(), 0u)
+      << "Failed precondition of BufferedWriter::WriteInternal(): "
+         "buffer not cleared";
+  return WriteInternal(src, Z_NO_FLUSH);
+}
+
+inline bool ZLibWriter::WriteInternal(absl::string_view src, int flush) {
+  RIEGELI_ASSERT(healthy())
+      << "Failed precondition of ZLibWriter::WriteInternal(): "
+         "Object unhealthy";
+  RIEGELI_ASSERT_EQ(written_to_buffer(), 0u)
+      << "Failed precondition of ZLibWriter::WriteInternal(): "
+         "buffer not cleared";
+  if (ABSL_PREDICT_FALSE(src.size() >
+                         std::numeric_limits<Position>::max() - limit_pos())) {
+    limit_ = start_;
+    return FailOverflow();
+  }
+  compressor_->next_in =
+      const_cast<z_const Bytef*>(reinterpret_cast<const Bytef*>(src.data()));
+  for (;;) {
+    if (ABSL_PREDICT_FALSE(dest_->available() == 0)) {
+      if (ABSL_PREDICT_FALSE(!dest_->Push())) {
+        limit_ = start_;
+        return Fail(*dest_);
+      }
+    }
+    // avail_in and avail_out are limited to uInt, so a large src is fed in
+    // parts.
+    const size_t remaining_in = PtrDistance(
+        reinterpret_cast<const char*>(compressor_->next_in),
+        src.data() + src.size());
+    compressor_->avail_in =
+        UnsignedMin(remaining_in, std::numeric_limits<uInt>::max());
+    compressor_->next_out = reinterpret_cast<Bytef*>(dest_->cursor());
+    compressor_->avail_out =
+        UnsignedMin(dest_->available(), std::numeric_limits<uInt>::max());
+    const int result = deflate(compressor_.get(), flush);
+    dest_->set_cursor(reinterpret_cast<char*>(compressor_->next_out));
+    if (result == Z_STREAM_END) break;
+    // Z_BUF_ERROR means that no progress was possible, which is not fatal.
+    if (ABSL_PREDICT_FALSE(result != Z_OK && result != Z_BUF_ERROR)) {
+      limit_ = start_;
+      return FailOperation("deflate()", result);
+    }
+    // When deflate() leaves output space, it consumed all input given to it
+    // and completed the flush.
+    if (compressor_->avail_out > 0 && flush != Z_FINISH &&
+        reinterpret_cast<const char*>(compressor_->next_in) ==
+            src.data() + src.size()) {
+      break;
+    }
+  }
+  start_pos_ += src.size();
+  return true;
+}
+
+void ZLibWriter::AddUniqueTo(MemoryEstimator* memory_estimator) const {
+  BufferedWriter::AddUniqueTo(memory_estimator);
+  memory_estimator->AddMemory(sizeof(ZLibWriter) - sizeof(BufferedWriter));
+  if (owned_dest_ != nullptr) {
+    owned_dest_->AddUniqueTo(memory_estimator);
+  } else if (dest_ != nullptr) {
+    dest_->AddSharedTo(memory_estimator);
+  }
+  if (compressor_ != nullptr) {
+    // Memory used by deflate, as documented in zconf.h, with memLevel 8.
+    memory_estimator->AddMemory(sizeof(z_stream) +
+                                (size_t{1} << (window_log_ + 2)) +
+                                (size_t{1} << (8 + 9)));
+  }
+}
+
+}  // namespace riegeli
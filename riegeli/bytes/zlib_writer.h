@@ -0,0 +1,207 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_BYTES_ZLIB_WRITER_H_
+#define RIEGELI_BYTES_ZLIB_WRITER_H_
+
+#include <stddef.h>
+#include <memory>
+#include <utility>
+
+#include "absl/base/attributes.h"
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/bytes/buffered_writer.h"
+#include "riegeli/bytes/writer.h"
+#include "zlib.h"
+
+namespace riegeli {
+
+// A Writer which compresses data with zlib (Deflate) before passing it to
+// another Writer. Depending on Options::set_header(), the compressed stream is
+// in zlib format, gzip format, or raw Deflate; ZLibReader reads all of them.
+//
+// The zlib library can be replaced by an API-compatible implementation, e.g.
+// zlib-ng in compatibility mode, to use faster compression routines.
+class ZLibWriter final : public BufferedWriter {
+ public:
+  // What kind of a header is written around compressed data.
+  enum class Header {
+    kZlib,  // zlib header and trailer (RFC 1950)
+    kGzip,  // gzip header and trailer (RFC 1952)
+    kRaw,   // no header (raw Deflate, RFC 1951)
+  };
+
+  class Options {
+   public:
+    // Not defaulted because of a C++ defect:
+    // https://stackoverflow.com/questions/17430377
+    Options() noexcept {}
+
+    // Tunes the tradeoff between compression density and compression speed
+    // (higher = better density but slower).
+    //
+    // compression_level must be between kMinCompressionLevel() (0) and
+    // kMaxCompressionLevel() (9). Level 0 stores data uncompressed.
+    // Default: kDefaultCompressionLevel() (6).
+    static constexpr int kMinCompressionLevel() { return Z_NO_COMPRESSION; }
+    static constexpr int kMaxCompressionLevel() { return Z_BEST_COMPRESSION; }
+    static constexpr int kDefaultCompressionLevel() { return 6; }
+    Options& set_compression_level(int compression_level) & {
+      RIEGELI_ASSERT_GE(compression_level, kMinCompressionLevel())
+          << "Failed precondition of "
+             "ZLibWriter::Options::set_compression_level(): "
+             "compression level out of range";
+      RIEGELI_ASSERT_LE(compression_level, kMaxCompressionLevel())
+          << "Failed precondition of "
+             "ZLibWriter::Options::set_compression_level(): "
+             "compression level out of range";
+      compression_level_ = compression_level;
+      return *this;
+    }
+    Options&& set_compression_level(int level) && {
+      return std::move(set_compression_level(level));
+    }
+
+    // Logarithm of the LZ77 sliding window size. This tunes the tradeoff
+    // between compression density and memory usage (higher = better density but
+    // more memory).
+    //
+    // window_log must be between kMinWindowLog() (9) and kMaxWindowLog() (15).
+    // Default: kDefaultWindowLog() (15).
+    static constexpr int kMinWindowLog() { return 9; }
+    static constexpr int kMaxWindowLog() { return MAX_WBITS; }
+    static constexpr int kDefaultWindowLog() { return MAX_WBITS; }
+    Options& set_window_log(int window_log) & {
+      RIEGELI_ASSERT_GE(window_log, kMinWindowLog())
+          << "Failed precondition of ZLibWriter::Options::set_window_log(): "
+             "window log out of range";
+      RIEGELI_ASSERT_LE(window_log, kMaxWindowLog())
+          << "Failed precondition of ZLibWriter::Options::set_window_log(): "
+             "window log out of range";
+      window_log_ = window_log;
+      return *this;
+    }
+    Options&& set_window_log(int window_log) && {
+      return std::move(set_window_log(window_log));
+    }
+
+    // What kind of a header is written. Use Header::kGzip for consumers which
+    // expect .gz files.
+    //
+    // Default: Header::kZlib.
+    Options& set_header(Header header) & {
+      header_ = header;
+      return *this;
+    }
+    Options&& set_header(Header header) && {
+      return std::move(set_header(header));
+    }
+
+    Options& set_buffer_size(size_t buffer_size) & {
+      RIEGELI_ASSERT_GT(buffer_size, 0u)
+          << "Failed precondition of ZLibWriter::Options::set_buffer_size(): "
+             "zero buffer size";
+      buffer_size_ = buffer_size;
+      return *this;
+    }
+    Options&& set_buffer_size(size_t buffer_size) && {
+      return std::move(set_buffer_size(buffer_size));
+    }
+
+   private:
+    friend class ZLibWriter;
+
+    int compression_level_ = kDefaultCompressionLevel();
+    int window_log_ = kDefaultWindowLog();
+    Header header_ = Header::kZlib;
+    size_t buffer_size_ = kDefaultBufferSize();
+  };
+
+  // Creates a closed ZLibWriter.
+  ZLibWriter() noexcept {}
+
+  // Will write zlib-compressed stream to the byte Writer which is owned by this
+  // ZLibWriter and will be closed and deleted when the ZLibWriter is closed.
+  explicit ZLibWriter(std::unique_ptr<Writer> dest,
+                      Options options = Options());
+
+  // Will write zlib-compressed stream to the byte Writer which is not owned by
+  // this ZLibWriter and must be kept alive but not accessed until closing the
+  // ZLibWriter, except that it is allowed to read its destination directly
+  // after Flush().
+  explicit ZLibWriter(Writer* dest, Options options = Options());
+
+  ZLibWriter(ZLibWriter&& src) noexcept;
+  ZLibWriter& operator=(ZLibWriter&& src) noexcept;
+
+  bool Flush(FlushType flush_type) override;
+
+  void AddUniqueTo(MemoryEstimator* memory_estimator) const override;
+
+ protected:
+  void Done() override;
+  bool WriteInternal(absl::string_view src) override;
+
+ private:
+  // z_stream is kept behind a pointer because deflate state points back to it,
+  // so it cannot be moved.
+  struct ZStreamDeleter {
+    void operator()(z_stream* ptr) const {
+      deflateEnd(ptr);
+      delete ptr;
+    }
+  };
+
+  ABSL_ATTRIBUTE_COLD bool FailOperation(absl::string_view operation,
+                                         int zlib_code);
+
+  // Compresses src, and then performs flush (Z_NO_FLUSH, Z_SYNC_FLUSH, or
+  // Z_FINISH).
+  bool WriteInternal(absl::string_view src, int flush);
+
+  std::unique_ptr<Writer> owned_dest_;
+  // Invariant: if healthy() then dest_ != nullptr
+  Writer* dest_ = nullptr;
+  int window_log_ = 0;
+  std::unique_ptr<z_stream, ZStreamDeleter> compressor_;
+};
+
+// Implementation details follow.
+
+inline ZLibWriter::ZLibWriter(std::unique_ptr<Writer> dest, Options options)
+    : ZLibWriter(dest.get(), options) {
+  owned_dest_ = std::move(dest);
+}
+
+inline ZLibWriter::ZLibWriter(ZLibWriter&& src) noexcept
+    : BufferedWriter(std::move(src)),
+      owned_dest_(std::move(src.owned_dest_)),
+      dest_(riegeli::exchange(src.dest_, nullptr)),
+      window_log_(riegeli::exchange(src.window_log_, 0)),
+      compressor_(std::move(src.compressor_)) {}
+
+inline ZLibWriter& ZLibWriter::operator=(ZLibWriter&& src) noexcept {
+  BufferedWriter::operator=(std::move(src));
+  owned_dest_ = std::move(src.owned_dest_);
+  dest_ = riegeli::exchange(src.dest_, nullptr);
+  window_log_ = riegeli::exchange(src.window_log_, 0);
+  compressor_ = std::move(src.compressor_);
+  return *this;
+}
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_BYTES_ZLIB_WRITER_H_
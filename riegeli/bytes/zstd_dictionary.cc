@@ -0,0 +1,85 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Make ZSTD_getDictID_fromDict(), ZSTD_createCDict_advanced(), and
+// ZSTD_createDDict_byReference() available.
+#define ZSTD_STATIC_LINKING_ONLY
+
+#include "riegeli/bytes/zstd_dictionary.h"
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "absl/base/call_once.h"
+#include "absl/base/optimization.h"
+#include "absl/synchronization/mutex.h"
+#include "riegeli/base/base.h"
+#include "zstd.h"
+
+namespace riegeli {
+
+ZstdDictionary::ZstdDictionary(std::string data)
+    : data_(std::move(data)),
+      id_(ZSTD_getDictID_fromDict(data_.data(), data_.size())) {}
+
+ZstdDictionary::~ZstdDictionary() {}
+
+const ZSTD_CDict* ZstdDictionary::PrepareCompressionDictionary(
+    int compression_level, int window_log) const {
+  absl::MutexLock lock(&mutex_);
+  for (const CompressionDictionary& entry : compression_dictionaries_) {
+    if (entry.compression_level == compression_level &&
+        entry.window_log == window_log) {
+      return entry.cdict.get();
+    }
+  }
+  ZSTD_compressionParameters params =
+      ZSTD_getCParams(compression_level, 0, data_.size());
+  if (window_log >= 0) params.windowLog = IntCast<unsigned>(window_log);
+  std::unique_ptr<ZSTD_CDict, ZSTD_CDictDeleter> cdict(
+      ZSTD_createCDict_advanced(data_.data(), data_.size(), ZSTD_dlm_byRef,
+                                ZSTD_dct_auto, params, ZSTD_defaultCMem));
+  if (ABSL_PREDICT_FALSE(cdict == nullptr)) return nullptr;
+  compression_dictionaries_.push_back(
+      CompressionDictionary{compression_level, window_log, std::move(cdict)});
+  return compression_dictionaries_.back().cdict.get();
+}
+
+const ZSTD_DDict* ZstdDictionary::PrepareDecompressionDictionary() const {
+  absl::call_once(decompression_dictionary_once_, [this] {
+    decompression_dictionary_.reset(
+        ZSTD_createDDict_byReference(data_.data(), data_.size()));
+  });
+  return decompression_dictionary_.get();
+}
+
+bool ZstdDictionaryRegistry::Add(
+    std::shared_ptr<const ZstdDictionary> dictionary) {
+  RIEGELI_ASSERT(dictionary != nullptr)
+      << "Failed precondition of ZstdDictionaryRegistry::Add(): "
+         "null dictionary";
+  const uint32_t id = dictionary->id();
+  if (ABSL_PREDICT_FALSE(id == 0)) return false;
+  return dictionaries_.emplace(id, std::move(dictionary)).second;
+}
+
+const ZstdDictionary* ZstdDictionaryRegistry::Find(uint32_t id) const {
+  const auto iter = dictionaries_.find(id);
+  if (iter == dictionaries_.end()) return nullptr;
+  return iter->second.get();
+}
+
+}  // namespace riegeli
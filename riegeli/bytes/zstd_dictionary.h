@@ -0,0 +1,129 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_BYTES_ZSTD_DICTIONARY_H_
+#define RIEGELI_BYTES_ZSTD_DICTIONARY_H_
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "absl/base/call_once.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "zstd.h"
+
+namespace riegeli {
+
+// A Zstd dictionary, e.g. trained with "zstd --train" on samples of data to be
+// compressed, together with its digested forms used by ZstdWriter and
+// ZstdReader.
+//
+// A dictionary improves compression density of small compressed streams,
+// which otherwise start without any context. The same dictionary must be
+// available for decompression. A dictionary in the Zstd format carries an id,
+// which is written to headers of compressed streams, so that ZstdReader can
+// find the dictionary in a ZstdDictionaryRegistry.
+//
+// Digesting a dictionary is expensive, so a ZstdDictionary should be created
+// once and shared. ZstdDictionary is thread-safe.
+class ZstdDictionary {
+ public:
+  // Creates a dictionary from its contents. If data are not in the Zstd
+  // dictionary format, they are used as raw content and id() is 0.
+  explicit ZstdDictionary(std::string data);
+
+  ZstdDictionary(const ZstdDictionary&) = delete;
+  ZstdDictionary& operator=(const ZstdDictionary&) = delete;
+
+  ~ZstdDictionary();
+
+  // Returns the dictionary id, or 0 if the dictionary has no id.
+  uint32_t id() const { return id_; }
+
+  absl::string_view data() const { return data_; }
+
+  // Returns the dictionary digested for compression with the given parameters
+  // (window_log can be ZstdWriter::Options::kDefaultWindowLog()). Digested
+  // forms are cached and owned by the ZstdDictionary.
+  //
+  // Returns nullptr on failure.
+  const ZSTD_CDict* PrepareCompressionDictionary(int compression_level,
+                                                 int window_log) const;
+
+  // Returns the dictionary digested for decompression, owned by the
+  // ZstdDictionary.
+  //
+  // Returns nullptr on failure.
+  const ZSTD_DDict* PrepareDecompressionDictionary() const;
+
+ private:
+  struct ZSTD_CDictDeleter {
+    void operator()(ZSTD_CDict* ptr) const { ZSTD_freeCDict(ptr); }
+  };
+  struct ZSTD_DDictDeleter {
+    void operator()(ZSTD_DDict* ptr) const { ZSTD_freeDDict(ptr); }
+  };
+
+  struct CompressionDictionary {
+    int compression_level;
+    int window_log;
+    std::unique_ptr<ZSTD_CDict, ZSTD_CDictDeleter> cdict;
+  };
+
+  std::string data_;
+  uint32_t id_;
+  mutable absl::Mutex mutex_;
+  // Usually there is one entry, so a vector is searched linearly.
+  mutable std::vector<CompressionDictionary> compression_dictionaries_
+      GUARDED_BY(mutex_);
+  mutable absl::once_flag decompression_dictionary_once_;
+  mutable std::unique_ptr<ZSTD_DDict, ZSTD_DDictDeleter>
+      decompression_dictionary_;
+};
+
+// A set of Zstd dictionaries indexed by their ids, used by ZstdReader to find
+// the dictionary named by a compressed stream.
+//
+// ZstdDictionaryRegistry is thread-compatible: Add() must not be called
+// concurrently with other functions, Find() may be called concurrently.
+class ZstdDictionaryRegistry {
+ public:
+  ZstdDictionaryRegistry() noexcept {}
+
+  ZstdDictionaryRegistry(const ZstdDictionaryRegistry&) = delete;
+  ZstdDictionaryRegistry& operator=(const ZstdDictionaryRegistry&) = delete;
+
+  // Registers a dictionary under its id.
+  //
+  // Return values:
+  //  * true  - success
+  //  * false - failure (the dictionary has no id, or a dictionary with the
+  //                     same id is already registered)
+  bool Add(std::shared_ptr<const ZstdDictionary> dictionary);
+
+  // Returns the dictionary with the given id, or nullptr if there is none.
+  const ZstdDictionary* Find(uint32_t id) const;
+
+ private:
+  std::unordered_map<uint32_t, std::shared_ptr<const ZstdDictionary>>
+      dictionaries_;
+};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_BYTES_ZSTD_DICTIONARY_H_
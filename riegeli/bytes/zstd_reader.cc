@@ -12,46 +12,178 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
-// Make ZSTD_DCtx_setMaxWindowSize() and ZSTD_WINDOWLOG_MAX available.
+// Make ZSTD_DCtx_setMaxWindowSize(), ZSTD_WINDOWLOG_MAX, and
+// ZSTD_getFrameHeader() available.
 #define ZSTD_STATIC_LINKING_ONLY
 
 #include "riegeli/bytes/zstd_reader.h"
 
 #include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <cstring>
 #include <limits>
+#include <memory>
+#include <string>
+#include <vector>
 
 #include "absl/base/optimization.h"
 #include "absl/strings/str_cat.h"
 #include "riegeli/base/base.h"
+#include "riegeli/base/endian.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/base/recycling_pool.h"
 #include "riegeli/bytes/buffered_reader.h"
 #include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/zstd_dictionary.h"
 #include "zstd.h"
 
 namespace riegeli {
 
+namespace {
+
+// Magic numbers of the Zstd seekable format: of the skippable frame holding
+// the seek table, and of its footer.
+constexpr uint32_t kSkippableFrameMagic = 0x184D2A5E;
+constexpr uint32_t kSeekTableFooterMagic = 0x8F92EAB1;
+
+// Sizes of parts of the seek table: skippable frame header, footer, and an
+// entry without and with a checksum.
+constexpr size_t kSkippableHeaderSize = 8;
+constexpr size_t kSeekTableFooterSize = 9;
+constexpr size_t kSeekTableEntrySize = 8;
+constexpr size_t kSeekTableEntryWithChecksumSize = 12;
+// Seek table descriptor flag for entries with checksums.
+constexpr uint8_t kSeekTableChecksumFlag = 0x80;
+
+uint32_t DecodeLittleEndian32(const char* src) {
+  uint32_t word;
+  std::memcpy(&word, src, sizeof(word));
+  return ReadLittleEndian32(word);
+}
+
+}  // namespace
+
 ZstdReader::ZstdReader(Reader* src, Options options)
     : BufferedReader(options.buffer_size_),
       src_(RIEGELI_ASSERT_NOTNULL(src)),
-      decompressor_(ZSTD_createDStream()) {
-  if (ABSL_PREDICT_FALSE(decompressor_ == nullptr)) {
-    Fail("ZSTD_createDStream() failed");
-    return;
+      dictionaries_(options.dictionaries_),
+      frame_header_pending_(dictionaries_ != nullptr),
+      seekable_(options.seekable_),
+      src_begin_(src->pos()) {
+  if (ABSL_PREDICT_FALSE(!InitializeDecompressor())) return;
+  if (seekable_) ReadSeekTable();
+}
+
+inline bool ZstdReader::InitializeDecompressor() {
+  if (decompressor_ == nullptr) {
+    decompressor_ =
+        RecyclingPool<ZSTD_DStream, ZSTD_DStreamDeleter>::global().Get([] {
+          return std::unique_ptr<ZSTD_DStream, ZSTD_DStreamDeleter>(
+              ZSTD_createDStream());
+        });
+    if (ABSL_PREDICT_FALSE(decompressor_ == nullptr)) {
+      return Fail("ZSTD_createDStream() failed");
+    }
   }
   {
+    // A ZSTD_DStream from the pool is reset here.
     const size_t result = ZSTD_initDStream(decompressor_.get());
     if (ABSL_PREDICT_FALSE(ZSTD_isError(result))) {
-      Fail(absl::StrCat("ZSTD_initDStream() failed: ",
-                        ZSTD_getErrorName(result)));
+      return Fail(absl::StrCat("ZSTD_initDStream() failed: ",
+                               ZSTD_getErrorName(result)));
     }
   }
   {
     const size_t result = ZSTD_DCtx_setMaxWindowSize(
         decompressor_.get(), size_t{1} << ZSTD_WINDOWLOG_MAX);
     if (ABSL_PREDICT_FALSE(ZSTD_isError(result))) {
-      Fail(absl::StrCat("ZSTD_DCtx_setMaxWindowSize() failed: ",
-                        ZSTD_getErrorName(result)));
+      return Fail(absl::StrCat("ZSTD_DCtx_setMaxWindowSize() failed: ",
+                               ZSTD_getErrorName(result)));
     }
   }
+  // ZSTD_initDStream() forgot the dictionary, so it is selected again for the
+  // next frame.
+  frame_header_pending_ = dictionaries_ != nullptr;
+  frame_header_.clear();
+  return true;
+}
+
+inline bool ZstdReader::ReadSeekTable() {
+  if (ABSL_PREDICT_FALSE(!src_->SupportsRandomAccess())) {
+    return Fail(
+        "Seekable Zstd-compressed stream requires a source which supports "
+        "random access");
+  }
+  Position src_end;
+  if (ABSL_PREDICT_FALSE(!src_->Size(&src_end))) {
+    if (!src_->healthy()) return Fail(*src_);
+    return Fail(
+        "Getting the size of the seekable Zstd-compressed stream failed");
+  }
+  if (ABSL_PREDICT_FALSE(src_end < src_begin_ ||
+                         src_end - src_begin_ <
+                             kSkippableHeaderSize + kSeekTableFooterSize)) {
+    return Fail("Truncated seekable Zstd-compressed stream");
+  }
+  char footer[kSeekTableFooterSize];
+  if (ABSL_PREDICT_FALSE(!src_->Seek(src_end - kSeekTableFooterSize) ||
+                         !src_->Read(footer, kSeekTableFooterSize))) {
+    if (!src_->healthy()) return Fail(*src_);
+    return Fail("Truncated seekable Zstd-compressed stream");
+  }
+  if (ABSL_PREDICT_FALSE(DecodeLittleEndian32(footer + 5) !=
+                         kSeekTableFooterMagic)) {
+    return Fail("Zstd seek table not found");
+  }
+  const uint32_t num_frames = DecodeLittleEndian32(footer);
+  const uint8_t descriptor = static_cast<uint8_t>(footer[4]);
+  const size_t entry_size = (descriptor & kSeekTableChecksumFlag) != 0
+                                ? kSeekTableEntryWithChecksumSize
+                                : kSeekTableEntrySize;
+  const Position entries_size = Position{num_frames} * entry_size;
+  if (ABSL_PREDICT_FALSE(src_end - src_begin_ < kSkippableHeaderSize +
+                                                    entries_size +
+                                                    kSeekTableFooterSize)) {
+    return Fail("Truncated seekable Zstd-compressed stream");
+  }
+  const Position table_begin =
+      src_end - kSeekTableFooterSize - entries_size - kSkippableHeaderSize;
+  std::string table;
+  if (ABSL_PREDICT_FALSE(!src_->Seek(table_begin) ||
+                         !src_->Read(&table, IntCast<size_t>(
+                                                 kSkippableHeaderSize +
+                                                 entries_size)))) {
+    if (!src_->healthy()) return Fail(*src_);
+    return Fail("Truncated seekable Zstd-compressed stream");
+  }
+  if (ABSL_PREDICT_FALSE(
+          DecodeLittleEndian32(&table[0]) != kSkippableFrameMagic ||
+          DecodeLittleEndian32(&table[4]) !=
+              entries_size + kSeekTableFooterSize)) {
+    return Fail("Invalid Zstd seek table");
+  }
+  compressed_frame_begins_.reserve(size_t{num_frames} + 1);
+  frame_begins_.reserve(size_t{num_frames} + 1);
+  Position compressed_pos = 0;
+  Position pos = 0;
+  compressed_frame_begins_.push_back(compressed_pos);
+  frame_begins_.push_back(pos);
+  for (size_t i = 0; i < num_frames; ++i) {
+    const char* const entry = &table[kSkippableHeaderSize + i * entry_size];
+    compressed_pos += DecodeLittleEndian32(entry);
+    pos += DecodeLittleEndian32(entry + 4);
+    compressed_frame_begins_.push_back(compressed_pos);
+    frame_begins_.push_back(pos);
+  }
+  if (ABSL_PREDICT_FALSE(compressed_pos != table_begin - src_begin_)) {
+    return Fail("Invalid Zstd seek table");
+  }
+  if (ABSL_PREDICT_FALSE(!src_->Seek(src_begin_))) {
+    if (!src_->healthy()) return Fail(*src_);
+    return Fail("Truncated seekable Zstd-compressed stream");
+  }
+  return true;
 }
 
 void ZstdReader::Done() {
@@ -65,6 +197,13 @@ void ZstdReader::Done() {
     owned_src_.reset();
   }
   src_ = nullptr;
+  dictionaries_ = nullptr;
+  frame_header_pending_ = false;
+  frame_header_ = std::string();
+  seekable_ = false;
+  src_begin_ = 0;
+  compressed_frame_begins_ = std::vector<Position>();
+  frame_begins_ = std::vector<Position>();
   decompressor_.reset();
   BufferedReader::Done();
 }
@@ -95,6 +234,9 @@ bool ZstdReader::ReadInternal(char* dest, size_t min_length,
     return FailOverflow();
   }
   if (ABSL_PREDICT_FALSE(decompressor_ == nullptr)) return false;
+  if (ABSL_PREDICT_FALSE(frame_header_pending_)) {
+    if (ABSL_PREDICT_FALSE(!SelectDictionary())) return false;
+  }
   ZSTD_outBuffer output = {dest, max_length, 0};
   for (;;) {
     ZSTD_inBuffer input = {src_->cursor(), src_->available(), 0};
@@ -102,23 +244,30 @@ bool ZstdReader::ReadInternal(char* dest, size_t min_length,
         ZSTD_decompressStream(decompressor_.get(), &output, &input);
     src_->set_cursor(static_cast<const char*>(input.src) + input.pos);
     if (ABSL_PREDICT_FALSE(result == 0)) {
-      decompressor_.reset();
-      limit_pos_ += output.pos;
-      return output.pos >= min_length;
-    }
-    if (ABSL_PREDICT_FALSE(ZSTD_isError(result))) {
+      if (!seekable_ || limit_pos_ + output.pos >= frame_begins_.back()) {
+        decompressor_.reset();
+        limit_pos_ += output.pos;
+        return output.pos >= min_length;
+      }
+      // A frame of the seekable format ended, and the next frame follows.
+      if (output.pos >= min_length) {
+        limit_pos_ += output.pos;
+        return true;
+      }
+      if (input.pos < input.size) continue;
+    } else if (ABSL_PREDICT_FALSE(ZSTD_isError(result))) {
       Fail(absl::StrCat("ZSTD_decompressStream() failed: ",
                         ZSTD_getErrorName(result)));
       limit_pos_ += output.pos;
       return output.pos >= min_length;
-    }
-    if (output.pos >= min_length) {
+    } else if (output.pos >= min_length) {
       limit_pos_ += output.pos;
       return true;
+    } else {
+      RIEGELI_ASSERT_EQ(input.pos, input.size)
+          << "ZSTD_decompressStream() returned but there are still input "
+             "data and output space";
     }
-    RIEGELI_ASSERT_EQ(input.pos, input.size)
-        << "ZSTD_decompressStream() returned but there are still input data "
-           "and output space";
     if (ABSL_PREDICT_FALSE(!src_->Pull())) {
       limit_pos_ += output.pos;
       if (ABSL_PREDICT_TRUE(src_->HopeForMore())) return false;
@@ -128,6 +277,123 @@ bool ZstdReader::ReadInternal(char* dest, size_t min_length,
   }
 }
 
+inline bool ZstdReader::SelectDictionary() {
+  ZSTD_frameHeader frame_header;
+  for (;;) {
+    const size_t result = ZSTD_getFrameHeader(
+        &frame_header, frame_header_.data(), frame_header_.size());
+    if (ABSL_PREDICT_FALSE(ZSTD_isError(result))) {
+      return Fail(absl::StrCat("ZSTD_getFrameHeader() failed: ",
+                               ZSTD_getErrorName(result)));
+    }
+    if (result == 0) break;
+    // result is the length of the frame header, or a lower bound of it.
+    while (frame_header_.size() < result) {
+      if (ABSL_PREDICT_FALSE(!src_->Pull())) {
+        if (ABSL_PREDICT_TRUE(src_->HopeForMore())) return false;
+        if (src_->healthy()) return Fail("Truncated Zstd-compressed stream");
+        return Fail(*src_);
+      }
+      const size_t length =
+          std::min(src_->available(), result - frame_header_.size());
+      frame_header_.append(src_->cursor(), length);
+      src_->set_cursor(src_->cursor() + length);
+    }
+  }
+  if (frame_header.dictID != 0) {
+    const ZstdDictionary* const dictionary =
+        dictionaries_->Find(frame_header.dictID);
+    if (ABSL_PREDICT_FALSE(dictionary == nullptr)) {
+      return Fail(
+          absl::StrCat("Zstd dictionary not found: ", frame_header.dictID));
+    }
+    const ZSTD_DDict* const ddict =
+        dictionary->PrepareDecompressionDictionary();
+    if (ABSL_PREDICT_FALSE(ddict == nullptr)) {
+      return Fail("ZSTD_createDDict_byReference() failed");
+    }
+    {
+      const size_t result =
+          ZSTD_DCtx_reset(decompressor_.get(), ZSTD_reset_session_only);
+      if (ABSL_PREDICT_FALSE(ZSTD_isError(result))) {
+        return Fail(absl::StrCat("ZSTD_DCtx_reset() failed: ",
+                                 ZSTD_getErrorName(result)));
+      }
+    }
+    {
+      const size_t result = ZSTD_DCtx_refDDict(decompressor_.get(), ddict);
+      if (ABSL_PREDICT_FALSE(ZSTD_isError(result))) {
+        return Fail(absl::StrCat("ZSTD_DCtx_refDDict() failed: ",
+                                 ZSTD_getErrorName(result)));
+      }
+    }
+    {
+      const size_t result = ZSTD_DCtx_setMaxWindowSize(
+          decompressor_.get(), size_t{1} << ZSTD_WINDOWLOG_MAX);
+      if (ABSL_PREDICT_FALSE(ZSTD_isError(result))) {
+        return Fail(absl::StrCat("ZSTD_DCtx_setMaxWindowSize() failed: ",
+                                 ZSTD_getErrorName(result)));
+      }
+    }
+  }
+  // Let the decompressor consume the frame header. It produces no output yet.
+  ZSTD_inBuffer input = {frame_header_.data(), frame_header_.size(), 0};
+  ZSTD_outBuffer output = {nullptr, 0, 0};
+  const size_t result =
+      ZSTD_decompressStream(decompressor_.get(), &output, &input);
+  if (ABSL_PREDICT_FALSE(ZSTD_isError(result))) {
+    return Fail(absl::StrCat("ZSTD_decompressStream() failed: ",
+                             ZSTD_getErrorName(result)));
+  }
+  RIEGELI_ASSERT_EQ(input.pos, input.size)
+      << "ZSTD_decompressStream() did not consume the frame header";
+  frame_header_pending_ = false;
+  frame_header_ = std::string();
+  return true;
+}
+
+bool ZstdReader::SeekSlow(Position new_pos) {
+  RIEGELI_ASSERT(new_pos < start_pos() || new_pos > limit_pos_)
+      << "Failed precondition of Reader::SeekSlow(): "
+         "position in the buffer, use Seek() instead";
+  if (!seekable_) return BufferedReader::SeekSlow(new_pos);
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  // frame_index is the index of the frame holding new_pos, or the number of
+  // frames if new_pos is at or after the end.
+  const size_t frame_index =
+      std::upper_bound(frame_begins_.begin(), frame_begins_.end() - 1,
+                       new_pos) -
+      frame_begins_.begin() - 1;
+  if (new_pos > limit_pos_ && decompressor_ != nullptr &&
+      frame_begins_[frame_index] <= limit_pos_) {
+    // Seeking forwards within the frame being decompressed, or to the
+    // beginning of the next frame.
+    return BufferedReader::SeekSlow(new_pos);
+  }
+  ClearBuffer();
+  if (ABSL_PREDICT_FALSE(
+          !src_->Seek(src_begin_ + compressed_frame_begins_[frame_index]))) {
+    if (!src_->healthy()) return Fail(*src_);
+    return Fail("Truncated seekable Zstd-compressed stream");
+  }
+  limit_pos_ = frame_begins_[frame_index];
+  if (frame_index == frame_begins_.size() - 1) {
+    // Seeking to the end or past it.
+    decompressor_.reset();
+    return new_pos == limit_pos_;
+  }
+  if (ABSL_PREDICT_FALSE(!InitializeDecompressor())) return false;
+  if (new_pos == limit_pos_) return true;
+  return BufferedReader::SeekSlow(new_pos);
+}
+
+bool ZstdReader::Size(Position* size) const {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (!seekable_) return BufferedReader::Size(size);
+  *size = frame_begins_.back();
+  return true;
+}
+
 bool ZstdReader::HopeForMoreSlow() const {
   RIEGELI_ASSERT_EQ(available(), 0u)
       << "Failed precondition of Reader::HopeForMoreSlow(): "
@@ -136,4 +402,21 @@ bool ZstdReader::HopeForMoreSlow() const {
   return decompressor_ != nullptr;
 }
 
+void ZstdReader::AddUniqueTo(MemoryEstimator* memory_estimator) const {
+  BufferedReader::AddUniqueTo(memory_estimator);
+  memory_estimator->AddMemory(sizeof(ZstdReader) - sizeof(BufferedReader));
+  if (owned_src_ != nullptr) {
+    owned_src_->AddUniqueTo(memory_estimator);
+  } else if (src_ != nullptr) {
+    src_->AddSharedTo(memory_estimator);
+  }
+  memory_estimator->AddMemory(frame_header_.capacity());
+  memory_estimator->AddMemory(
+      sizeof(Position) *
+      (compressed_frame_begins_.capacity() + frame_begins_.capacity()));
+  if (decompressor_ != nullptr) {
+    memory_estimator->AddMemory(ZSTD_sizeof_DStream(decompressor_.get()));
+  }
+}
+
 }  // namespace riegeli
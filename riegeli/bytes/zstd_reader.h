@@ -17,11 +17,16 @@
 
 #include <stddef.h>
 #include <memory>
+#include <string>
 #include <utility>
+#include <vector>
 
 #include "riegeli/base/base.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/base/recycling_pool.h"
 #include "riegeli/bytes/buffered_reader.h"
 #include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/zstd_dictionary.h"
 #include "zstd.h"
 
 namespace riegeli {
@@ -36,6 +41,22 @@ class ZstdReader final : public BufferedReader {
     // https://stackoverflow.com/questions/17430377
     Options() noexcept {}
 
+    // Zstd dictionaries to decompress with. The compressed stream header is
+    // read first, and the dictionary with the id stored there is looked up.
+    // The registry must be kept alive until the ZstdReader is closed.
+    //
+    // If nullptr, or if the compressed stream does not name a dictionary, no
+    // dictionary is used.
+    //
+    // Default: nullptr
+    Options& set_dictionaries(const ZstdDictionaryRegistry* dictionaries) & {
+      dictionaries_ = dictionaries;
+      return *this;
+    }
+    Options&& set_dictionaries(const ZstdDictionaryRegistry* dictionaries) && {
+      return std::move(set_dictionaries(dictionaries));
+    }
+
     static size_t kDefaultBufferSize() { return ZSTD_DStreamOutSize(); }
     Options& set_buffer_size(size_t buffer_size) & {
       RIEGELI_ASSERT_GT(buffer_size, 0u)
@@ -48,10 +69,30 @@ class ZstdReader final : public BufferedReader {
       return std::move(set_buffer_size(buffer_size));
     }
 
+    // If true, the compressed stream must be in the Zstd seekable format, as
+    // written with ZstdWriter::Options::set_seekable_frame_size(), and it must
+    // extend to the end of the source, which must support random access.
+    //
+    // The seek table is read when the ZstdReader is opened. Then
+    // SupportsRandomAccess() is true, Size() is known, and seeking
+    // decompresses only from the beginning of the frame holding the new
+    // position.
+    //
+    // Default: false
+    Options& set_seekable(bool seekable) & {
+      seekable_ = seekable;
+      return *this;
+    }
+    Options&& set_seekable(bool seekable) && {
+      return std::move(set_seekable(seekable));
+    }
+
    private:
     friend class ZstdReader;
 
+    const ZstdDictionaryRegistry* dictionaries_ = nullptr;
     size_t buffer_size_ = kDefaultBufferSize();
+    bool seekable_ = false;
   };
 
   // Creates a closed ZstdReader.
@@ -70,24 +111,60 @@ class ZstdReader final : public BufferedReader {
   ZstdReader(ZstdReader&& src) noexcept;
   ZstdReader& operator=(ZstdReader&& src) noexcept;
 
+  bool SupportsRandomAccess() const override { return seekable_; }
+  bool Size(Position* size) const override;
+
+  void AddUniqueTo(MemoryEstimator* memory_estimator) const override;
+
  protected:
   void Done() override;
   bool PullSlow() override;
   bool ReadInternal(char* dest, size_t min_length, size_t max_length) override;
   bool HopeForMoreSlow() const override;
+  bool SeekSlow(Position new_pos) override;
 
  private:
   struct ZSTD_DStreamDeleter {
     void operator()(ZSTD_DStream* ptr) const { ZSTD_freeDStream(ptr); }
   };
 
+  // Reads the frame header into frame_header_, and initializes decompressor_
+  // with the dictionary named there.
+  //
+  // Return values:
+  //  * true  - success (frame_header_pending_ is false)
+  //  * false - failure or the source has no more data yet (not healthy() or
+  //            frame_header_pending_ is still true)
+  bool SelectDictionary();
+
+  // Creates decompressor_ if needed, and resets it to begin a frame.
+  bool InitializeDecompressor();
+
+  // Reads the seek table of the seekable format from the end of *src_ into
+  // frame_begins_.
+  bool ReadSeekTable();
+
   std::unique_ptr<Reader> owned_src_;
   // Invariant: if healthy() then src_ != nullptr
   Reader* src_ = nullptr;
+  const ZstdDictionaryRegistry* dictionaries_ = nullptr;
+  // If true, the dictionary is selected after reading the frame header.
+  bool frame_header_pending_ = false;
+  // Frame header read so far if frame_header_pending_.
+  std::string frame_header_;
+  // If true, the Zstd seekable format is used.
+  bool seekable_ = false;
+  // Position in *src_ of the beginning of the compressed stream.
+  Position src_begin_ = 0;
+  // If seekable_, beginnings of frames, followed by the end of the last frame:
+  // positions relative to src_begin_ of compressed frames, and positions of
+  // uncompressed data.
+  std::vector<Position> compressed_frame_begins_;
+  std::vector<Position> frame_begins_;
   // If healthy() but decompressor_ == nullptr then all data have been
   // decompressed. In this case ZSTD_decompressStream() must not be called
   // again.
-  std::unique_ptr<ZSTD_DStream, ZSTD_DStreamDeleter> decompressor_;
+  RecyclingPool<ZSTD_DStream, ZSTD_DStreamDeleter>::Handle decompressor_;
 };
 
 // Implementation details follow.
@@ -101,12 +178,27 @@ inline ZstdReader::ZstdReader(ZstdReader&& src) noexcept
     : BufferedReader(std::move(src)),
       owned_src_(std::move(src.owned_src_)),
       src_(riegeli::exchange(src.src_, nullptr)),
+      dictionaries_(riegeli::exchange(src.dictionaries_, nullptr)),
+      frame_header_pending_(
+          riegeli::exchange(src.frame_header_pending_, false)),
+      frame_header_(riegeli::exchange(src.frame_header_, std::string())),
+      seekable_(riegeli::exchange(src.seekable_, false)),
+      src_begin_(riegeli::exchange(src.src_begin_, 0)),
+      compressed_frame_begins_(std::move(src.compressed_frame_begins_)),
+      frame_begins_(std::move(src.frame_begins_)),
       decompressor_(std::move(src.decompressor_)) {}
 
 inline ZstdReader& ZstdReader::operator=(ZstdReader&& src) noexcept {
   BufferedReader::operator=(std::move(src));
   owned_src_ = std::move(src.owned_src_);
   src_ = riegeli::exchange(src.src_, nullptr);
+  dictionaries_ = riegeli::exchange(src.dictionaries_, nullptr);
+  frame_header_pending_ = riegeli::exchange(src.frame_header_pending_, false);
+  frame_header_ = riegeli::exchange(src.frame_header_, std::string());
+  seekable_ = riegeli::exchange(src.seekable_, false);
+  src_begin_ = riegeli::exchange(src.src_begin_, 0);
+  compressed_frame_begins_ = std::move(src.compressed_frame_begins_);
+  frame_begins_ = std::move(src.frame_begins_);
   decompressor_ = std::move(src.decompressor_);
   return *this;
 }
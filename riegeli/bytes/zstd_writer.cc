@@ -12,25 +12,46 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
-// Make ZSTD_WINDOWLOG_MIN, ZSTD_WINDOWLOG_MAX, ZSTD_getParams(), and
-// ZSTD_initCStream_advanced() available.
+// Make ZSTD_WINDOWLOG_MIN, ZSTD_WINDOWLOG_MAX, and ZSTD_getParams()
+// available.
 #define ZSTD_STATIC_LINKING_ONLY
 
 #include "riegeli/bytes/zstd_writer.h"
 
 #include <stddef.h>
+#include <stdint.h>
 #include <limits>
+#include <memory>
+#include <string>
 
 #include "absl/base/optimization.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/string_view.h"
 #include "riegeli/base/base.h"
+#include "riegeli/base/endian.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/base/recycling_pool.h"
 #include "riegeli/bytes/buffered_writer.h"
 #include "riegeli/bytes/writer.h"
+#include "riegeli/bytes/zstd_dictionary.h"
 #include "zstd.h"
 
 namespace riegeli {
 
+namespace {
+
+// Magic numbers of the Zstd seekable format: of the skippable frame holding
+// the seek table, and of its footer.
+constexpr uint32_t kSkippableFrameMagic = 0x184D2A5E;
+constexpr uint32_t kSeekTableFooterMagic = 0x8F92EAB1;
+
+void AppendLittleEndian32(uint32_t value, std::string* dest) {
+  const uint32_t word = WriteLittleEndian32(value);
+  dest->append(reinterpret_cast<const char*>(&word), sizeof(word));
+}
+
+}  // namespace
+
 // These methods are defined here instead of in zstd_writer.h because
 // ZSTD_WINDOWLOG_{MIN,MAX} require ZSTD_STATIC_LINKING_ONLY.
 int ZstdWriter::Options::kMinWindowLog() { return ZSTD_WINDOWLOG_MIN; }
@@ -42,7 +63,14 @@ ZstdWriter& ZstdWriter::operator=(ZstdWriter&& src) noexcept {
   dest_ = riegeli::exchange(src.dest_, nullptr);
   compression_level_ = riegeli::exchange(src.compression_level_, 0);
   window_log_ = riegeli::exchange(src.window_log_, 0),
+  dictionary_ = riegeli::exchange(src.dictionary_, nullptr);
+  parallelism_ = riegeli::exchange(src.parallelism_, 0);
   size_hint_ = riegeli::exchange(src.size_hint_, 0);
+  seekable_frame_size_ = riegeli::exchange(src.seekable_frame_size_, 0);
+  frame_size_so_far_ = riegeli::exchange(src.frame_size_so_far_, 0);
+  frame_begin_pos_ = riegeli::exchange(src.frame_begin_pos_, 0);
+  num_frames_ = riegeli::exchange(src.num_frames_, 0);
+  seek_table_ = riegeli::exchange(src.seek_table_, std::string());
   if (src.compressor_ != nullptr || ABSL_PREDICT_FALSE(!healthy())) {
     compressor_ = std::move(src.compressor_);
   } else if (compressor_ != nullptr) {
@@ -58,7 +86,14 @@ void ZstdWriter::Done() {
   RIEGELI_ASSERT_EQ(written_to_buffer(), 0u)
       << "BufferedWriter::PushInternal() did not empty the buffer";
   if (ABSL_PREDICT_TRUE(healthy())) {
-    FlushInternal(ZSTD_endStream, "ZSTD_endStream()");
+    if (seekable_frame_size_ > 0) {
+      // The last frame is ended unless it is empty, but there is always at
+      // least one frame, so that the stream is a valid Zstd stream.
+      if (frame_size_so_far_ > 0 || num_frames_ == 0) EndSeekableFrame();
+      if (ABSL_PREDICT_TRUE(healthy())) WriteSeekTable();
+    } else {
+      FlushInternal(ZSTD_e_end, "ZSTD_compressStream2(ZSTD_e_end)");
+    }
   }
   if (owned_dest_ != nullptr) {
     if (ABSL_PREDICT_TRUE(healthy())) {
@@ -74,7 +109,12 @@ void ZstdWriter::Done() {
 
 inline bool ZstdWriter::EnsureCStreamCreated() {
   if (ABSL_PREDICT_FALSE(compressor_ == nullptr)) {
-    compressor_.reset(ZSTD_createCStream());
+    // A ZSTD_CStream from the pool is reset by InitializeCStream().
+    compressor_ =
+        RecyclingPool<ZSTD_CStream, ZSTD_CStreamDeleter>::global().Get([] {
+          return std::unique_ptr<ZSTD_CStream, ZSTD_CStreamDeleter>(
+              ZSTD_createCStream());
+        });
     if (ABSL_PREDICT_FALSE(compressor_ == nullptr)) {
       return Fail("ZSTD_createCStream() failed");
     }
@@ -84,16 +124,64 @@ inline bool ZstdWriter::EnsureCStreamCreated() {
 }
 
 inline bool ZstdWriter::InitializeCStream() {
+  // A ZSTD_CStream from the pool might have parameters set by a previous user.
+  {
+    const size_t result = ZSTD_CCtx_reset(compressor_.get(),
+                                          ZSTD_reset_session_and_parameters);
+    if (ABSL_PREDICT_FALSE(ZSTD_isError(result))) {
+      return Fail(absl::StrCat("ZSTD_CCtx_reset() failed: ",
+                               ZSTD_getErrorName(result)));
+    }
+  }
+  if (parallelism_ > 0) {
+    if (ABSL_PREDICT_FALSE(!SetParameter(ZSTD_c_nbWorkers, parallelism_))) {
+      return false;
+    }
+  }
+  if (dictionary_ != nullptr) {
+    // Without an id in the frame header, the dictionary could not be found
+    // for decompression.
+    if (ABSL_PREDICT_FALSE(dictionary_->id() == 0)) {
+      return Fail("Zstd dictionary has no id");
+    }
+    const ZSTD_CDict* const cdict =
+        dictionary_->PrepareCompressionDictionary(compression_level_,
+                                                  window_log_);
+    if (ABSL_PREDICT_FALSE(cdict == nullptr)) {
+      return Fail("ZSTD_createCDict_advanced() failed");
+    }
+    const size_t result = ZSTD_CCtx_refCDict(compressor_.get(), cdict);
+    if (ABSL_PREDICT_FALSE(ZSTD_isError(result))) {
+      return Fail(absl::StrCat("ZSTD_CCtx_refCDict() failed: ",
+                               ZSTD_getErrorName(result)));
+    }
+    return true;
+  }
   ZSTD_parameters params = ZSTD_getParams(
       compression_level_, IntCast<unsigned long long>(size_hint_), 0);
   if (window_log_ >= 0) {
     params.cParams.windowLog = IntCast<unsigned>(window_log_);
   }
-  const size_t result = ZSTD_initCStream_advanced(
-      compressor_.get(), nullptr, 0, params, ZSTD_CONTENTSIZE_UNKNOWN);
+  return SetParameter(ZSTD_c_windowLog,
+                      IntCast<int>(params.cParams.windowLog)) &&
+         SetParameter(ZSTD_c_chainLog, IntCast<int>(params.cParams.chainLog)) &&
+         SetParameter(ZSTD_c_hashLog, IntCast<int>(params.cParams.hashLog)) &&
+         SetParameter(ZSTD_c_searchLog,
+                      IntCast<int>(params.cParams.searchLog)) &&
+         SetParameter(ZSTD_c_minMatch, IntCast<int>(params.cParams.minMatch)) &&
+         SetParameter(ZSTD_c_targetLength,
+                      IntCast<int>(params.cParams.targetLength)) &&
+         SetParameter(ZSTD_c_strategy,
+                      static_cast<int>(params.cParams.strategy));
+}
+
+inline bool ZstdWriter::SetParameter(ZSTD_cParameter parameter, int value) {
+  const size_t result =
+      ZSTD_CCtx_setParameter(compressor_.get(), parameter, value);
   if (ABSL_PREDICT_FALSE(ZSTD_isError(result))) {
-    return Fail(absl::StrCat("ZSTD_initCStream_advanced() failed: ",
-                             ZSTD_getErrorName(result)));
+    return Fail(absl::StrCat("ZSTD_CCtx_setParameter(",
+                             static_cast<int>(parameter), ", ", value,
+                             ") failed: ", ZSTD_getErrorName(result)));
   }
   return true;
 }
@@ -102,8 +190,8 @@ bool ZstdWriter::Flush(FlushType flush_type) {
   if (ABSL_PREDICT_FALSE(!PushInternal())) return false;
   RIEGELI_ASSERT_EQ(written_to_buffer(), 0u)
       << "BufferedWriter::PushInternal() did not empty the buffer";
-  if (ABSL_PREDICT_FALSE(
-          !FlushInternal(ZSTD_flushStream, "ZSTD_flushStream()"))) {
+  if (ABSL_PREDICT_FALSE(!FlushInternal(
+          ZSTD_e_flush, "ZSTD_compressStream2(ZSTD_e_flush)"))) {
     return false;
   }
   if (ABSL_PREDICT_FALSE(!dest_->Flush(flush_type))) {
@@ -130,22 +218,40 @@ bool ZstdWriter::WriteInternal(absl::string_view src) {
     return FailOverflow();
   }
   if (ABSL_PREDICT_FALSE(!EnsureCStreamCreated())) return false;
+  if (seekable_frame_size_ > 0) {
+    // Split src at frame boundaries.
+    while (src.size() >= seekable_frame_size_ - frame_size_so_far_) {
+      const size_t length =
+          IntCast<size_t>(seekable_frame_size_ - frame_size_so_far_);
+      if (ABSL_PREDICT_FALSE(!CompressInternal(src.substr(0, length)))) {
+        return false;
+      }
+      src.remove_prefix(length);
+      if (ABSL_PREDICT_FALSE(!EndSeekableFrame())) return false;
+    }
+    if (src.empty()) return true;
+  }
+  return CompressInternal(src);
+}
+
+inline bool ZstdWriter::CompressInternal(absl::string_view src) {
   ZSTD_inBuffer input = {src.data(), src.size(), 0};
   for (;;) {
     ZSTD_outBuffer output = {dest_->cursor(), dest_->available(), 0};
-    const size_t result =
-        ZSTD_compressStream(compressor_.get(), &output, &input);
+    const size_t result = ZSTD_compressStream2(compressor_.get(), &output,
+                                               &input, ZSTD_e_continue);
     dest_->set_cursor(static_cast<char*>(output.dst) + output.pos);
     if (ABSL_PREDICT_FALSE(ZSTD_isError(result))) {
       limit_ = start_;
-      return Fail(absl::StrCat("ZSTD_compressStream() failed: ",
+      return Fail(absl::StrCat("ZSTD_compressStream2() failed: ",
                                ZSTD_getErrorName(result)));
     }
     if (output.pos < output.size) {
-      RIEGELI_ASSERT_EQ(input.pos, input.size)
-          << "ZSTD_compressStream() returned but there are still input data "
-             "and output space";
+      // With parallelism > 0, ZSTD_compressStream2() can return before
+      // consuming all input data, while workers are busy.
+      if (input.pos < input.size) continue;
       start_pos_ += input.pos;
+      frame_size_so_far_ += input.pos;
       return true;
     }
     if (ABSL_PREDICT_FALSE(!dest_->Push())) {
@@ -155,8 +261,7 @@ bool ZstdWriter::WriteInternal(absl::string_view src) {
   }
 }
 
-template <typename Function>
-bool ZstdWriter::FlushInternal(Function function,
+bool ZstdWriter::FlushInternal(ZSTD_EndDirective end_op,
                                absl::string_view function_name) {
   RIEGELI_ASSERT(healthy())
       << "Failed precondition of ZstdWriter::FlushInternal(): "
@@ -167,7 +272,9 @@ bool ZstdWriter::FlushInternal(Function function,
   if (ABSL_PREDICT_FALSE(!EnsureCStreamCreated())) return false;
   for (;;) {
     ZSTD_outBuffer output = {dest_->cursor(), dest_->available(), 0};
-    const size_t result = function(compressor_.get(), &output);
+    ZSTD_inBuffer input = {nullptr, 0, 0};
+    const size_t result =
+        ZSTD_compressStream2(compressor_.get(), &output, &input, end_op);
     dest_->set_cursor(static_cast<char*>(output.dst) + output.pos);
     if (result == 0) return true;
     if (ABSL_PREDICT_FALSE(ZSTD_isError(result))) {
@@ -184,4 +291,63 @@ bool ZstdWriter::FlushInternal(Function function,
   }
 }
 
+inline bool ZstdWriter::EndSeekableFrame() {
+  if (ABSL_PREDICT_FALSE(!FlushInternal(ZSTD_e_end,
+                                        "ZSTD_compressStream2(ZSTD_e_end)"))) {
+    return false;
+  }
+  const Position compressed_size = dest_->pos() - frame_begin_pos_;
+  if (ABSL_PREDICT_FALSE(
+          compressed_size > std::numeric_limits<uint32_t>::max() ||
+          num_frames_ == std::numeric_limits<uint32_t>::max())) {
+    limit_ = start_;
+    return Fail("Zstd seek table overflow");
+  }
+  AppendLittleEndian32(IntCast<uint32_t>(compressed_size), &seek_table_);
+  AppendLittleEndian32(IntCast<uint32_t>(frame_size_so_far_), &seek_table_);
+  ++num_frames_;
+  frame_size_so_far_ = 0;
+  frame_begin_pos_ = dest_->pos();
+  return true;
+}
+
+inline bool ZstdWriter::WriteSeekTable() {
+  // Skippable frame header, entries, and footer: number of frames, seek table
+  // descriptor (no checksums), and magic number.
+  const size_t footer_size = 9;
+  if (ABSL_PREDICT_FALSE(seek_table_.size() >
+                         std::numeric_limits<uint32_t>::max() - footer_size)) {
+    limit_ = start_;
+    return Fail("Zstd seek table overflow");
+  }
+  std::string header;
+  AppendLittleEndian32(kSkippableFrameMagic, &header);
+  AppendLittleEndian32(IntCast<uint32_t>(seek_table_.size() + footer_size),
+                       &header);
+  AppendLittleEndian32(num_frames_, &seek_table_);
+  seek_table_.push_back('\0');
+  AppendLittleEndian32(kSeekTableFooterMagic, &seek_table_);
+  if (ABSL_PREDICT_FALSE(!dest_->Write(header)) ||
+      ABSL_PREDICT_FALSE(!dest_->Write(seek_table_))) {
+    limit_ = start_;
+    return Fail(*dest_);
+  }
+  seek_table_ = std::string();
+  return true;
+}
+
+void ZstdWriter::AddUniqueTo(MemoryEstimator* memory_estimator) const {
+  BufferedWriter::AddUniqueTo(memory_estimator);
+  memory_estimator->AddMemory(sizeof(ZstdWriter) - sizeof(BufferedWriter));
+  if (owned_dest_ != nullptr) {
+    owned_dest_->AddUniqueTo(memory_estimator);
+  } else if (dest_ != nullptr) {
+    dest_->AddSharedTo(memory_estimator);
+  }
+  memory_estimator->AddMemory(seek_table_.capacity());
+  if (compressor_ != nullptr) {
+    memory_estimator->AddMemory(ZSTD_sizeof_CStream(compressor_.get()));
+  }
+}
+
 }  // namespace riegeli
@@ -16,13 +16,18 @@
 #define RIEGELI_BYTES_ZSTD_WRITER_H_
 
 #include <stddef.h>
+#include <stdint.h>
 #include <memory>
+#include <string>
 #include <utility>
 
 #include "absl/strings/string_view.h"
 #include "riegeli/base/base.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/base/recycling_pool.h"
 #include "riegeli/bytes/buffered_writer.h"
 #include "riegeli/bytes/writer.h"
+#include "riegeli/bytes/zstd_dictionary.h"
 #include "zstd.h"
 
 namespace riegeli {
@@ -89,6 +94,49 @@ class ZstdWriter final : public BufferedWriter {
       return std::move(set_window_log(window_log));
     }
 
+    // Zstd dictionary to compress with. Its id is stored in the compressed
+    // stream header, and the same dictionary must be used for decompression.
+    // The dictionary must have an id, i.e. be in the Zstd dictionary format,
+    // otherwise writing fails. The dictionary must be kept alive until the
+    // ZstdWriter is closed.
+    //
+    // With a dictionary, parameters derived from compression_level and
+    // window_log are digested together with the dictionary once, so size_hint
+    // does not affect them.
+    //
+    // If nullptr, no dictionary is used.
+    //
+    // Default: nullptr
+    Options& set_dictionary(const ZstdDictionary* dictionary) & {
+      dictionary_ = dictionary;
+      return *this;
+    }
+    Options&& set_dictionary(const ZstdDictionary* dictionary) && {
+      return std::move(set_dictionary(dictionary));
+    }
+
+    // Number of worker threads compressing parts of the stream in parallel, in
+    // addition to the thread writing to the ZstdWriter. This speeds up
+    // compression of large streams, at the cost of slightly lower compression
+    // density and more memory.
+    //
+    // If 0, compression is done by the thread writing to the ZstdWriter.
+    //
+    // The Zstd library must be built with multithreading support
+    // (ZSTD_MULTITHREAD) for parallelism > 0, otherwise writing fails.
+    //
+    // Default: 0
+    Options& set_parallelism(int parallelism) & {
+      RIEGELI_ASSERT_GE(parallelism, 0)
+          << "Failed precondition of ZstdWriter::Options::set_parallelism(): "
+             "negative parallelism";
+      parallelism_ = parallelism;
+      return *this;
+    }
+    Options&& set_parallelism(int parallelism) && {
+      return std::move(set_parallelism(parallelism));
+    }
+
     static size_t kDefaultBufferSize() { return ZSTD_CStreamInSize(); }
     Options& set_buffer_size(size_t buffer_size) & {
       RIEGELI_ASSERT_GT(buffer_size, 0u)
@@ -114,13 +162,44 @@ class ZstdWriter final : public BufferedWriter {
       return std::move(set_size_hint(size_hint));
     }
 
+    // If frame_size > 0, the compressed stream is written in the Zstd seekable
+    // format: a sequence of independent frames, each holding frame_size bytes
+    // of uncompressed data (the last one possibly less), followed by a seek
+    // table in a skippable frame. ZstdReader::Options::set_seekable() can then
+    // seek in it by decompressing only from the beginning of the frame holding
+    // the new position. Other Zstd decoders read the stream normally.
+    //
+    // Smaller frames make seeking faster but compression density worse.
+    //
+    // frame_size must be at most kMaxSeekableFrameSize() (1 GiB), so that
+    // sizes in the seek table fit in 32 bits.
+    //
+    // Default: 0 (a single frame without a seek table).
+    static constexpr Position kMaxSeekableFrameSize() {
+      return Position{1} << 30;
+    }
+    Options& set_seekable_frame_size(Position frame_size) & {
+      RIEGELI_ASSERT_LE(frame_size, kMaxSeekableFrameSize())
+          << "Failed precondition of "
+             "ZstdWriter::Options::set_seekable_frame_size(): "
+             "frame size out of range";
+      seekable_frame_size_ = frame_size;
+      return *this;
+    }
+    Options&& set_seekable_frame_size(Position frame_size) && {
+      return std::move(set_seekable_frame_size(frame_size));
+    }
+
    private:
     friend class ZstdWriter;
 
     int compression_level_ = kDefaultCompressionLevel();
     int window_log_ = kDefaultWindowLog();
+    const ZstdDictionary* dictionary_ = nullptr;
+    int parallelism_ = 0;
     size_t buffer_size_ = kDefaultBufferSize();
     Position size_hint_ = 0;
+    Position seekable_frame_size_ = 0;
   };
 
   // Creates a closed ZstdWriter.
@@ -142,6 +221,8 @@ class ZstdWriter final : public BufferedWriter {
 
   bool Flush(FlushType flush_type) override;
 
+  void AddUniqueTo(MemoryEstimator* memory_estimator) const override;
+
  protected:
   void Done() override;
   bool WriteInternal(absl::string_view src) override;
@@ -153,19 +234,44 @@ class ZstdWriter final : public BufferedWriter {
 
   bool EnsureCStreamCreated();
   bool InitializeCStream();
+  bool SetParameter(ZSTD_cParameter parameter, int value);
+
+  // Compresses src into the current frame.
+  bool CompressInternal(absl::string_view src);
+
+  bool FlushInternal(ZSTD_EndDirective end_op,
+                     absl::string_view function_name);
+
+  // Ends the current frame of the seekable format and appends its entry to
+  // seek_table_.
+  bool EndSeekableFrame();
 
-  template <typename Function>
-  bool FlushInternal(Function function, absl::string_view function_name);
+  // Writes the seek table of the seekable format after the last frame.
+  bool WriteSeekTable();
 
   std::unique_ptr<Writer> owned_dest_;
   // Invariant: if healthy() then dest_ != nullptr
   Writer* dest_ = nullptr;
   int compression_level_ = 0;
   int window_log_ = 0;
+  const ZstdDictionary* dictionary_ = nullptr;
+  int parallelism_ = 0;
   Position size_hint_ = 0;
+  // Options::set_seekable_frame_size(), or 0 if the seekable format is not
+  // used.
+  Position seekable_frame_size_ = 0;
+  // Uncompressed size of the current frame of the seekable format.
+  Position frame_size_so_far_ = 0;
+  // Position in *dest_ of the beginning of the current frame of the seekable
+  // format.
+  Position frame_begin_pos_ = 0;
+  // Number of frames of the seekable format ended so far.
+  uint32_t num_frames_ = 0;
+  // Entries of the seek table of the seekable format, for frames ended so far.
+  std::string seek_table_;
   // If healthy() but compressor_ == nullptr then compressor_ was not created
   // yet.
-  std::unique_ptr<ZSTD_CStream, ZSTD_CStreamDeleter> compressor_;
+  RecyclingPool<ZSTD_CStream, ZSTD_CStreamDeleter>::Handle compressor_;
 };
 
 // Implementation details follow.
@@ -180,7 +286,11 @@ inline ZstdWriter::ZstdWriter(Writer* dest, Options options)
       dest_(RIEGELI_ASSERT_NOTNULL(dest)),
       compression_level_(options.compression_level_),
       window_log_(options.window_log_),
-      size_hint_(options.size_hint_) {}
+      dictionary_(options.dictionary_),
+      parallelism_(options.parallelism_),
+      size_hint_(options.size_hint_),
+      seekable_frame_size_(options.seekable_frame_size_),
+      frame_begin_pos_(dest->pos()) {}
 
 inline ZstdWriter::ZstdWriter(ZstdWriter&& src) noexcept
     : BufferedWriter(std::move(src)),
@@ -188,7 +298,14 @@ inline ZstdWriter::ZstdWriter(ZstdWriter&& src) noexcept
       dest_(riegeli::exchange(src.dest_, nullptr)),
       compression_level_(riegeli::exchange(src.compression_level_, 0)),
       window_log_(riegeli::exchange(src.window_log_, 0)),
+      dictionary_(riegeli::exchange(src.dictionary_, nullptr)),
+      parallelism_(riegeli::exchange(src.parallelism_, 0)),
       size_hint_(riegeli::exchange(src.size_hint_, 0)),
+      seekable_frame_size_(riegeli::exchange(src.seekable_frame_size_, 0)),
+      frame_size_so_far_(riegeli::exchange(src.frame_size_so_far_, 0)),
+      frame_begin_pos_(riegeli::exchange(src.frame_begin_pos_, 0)),
+      num_frames_(riegeli::exchange(src.num_frames_, 0)),
+      seek_table_(riegeli::exchange(src.seek_table_, std::string())),
       compressor_(std::move(src.compressor_)) {}
 
 }  // namespace riegeli
@@ -0,0 +1,253 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/chunk_encoding/adaptive_encoder.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "google/protobuf/message_lite.h"
+#include "absl/base/optimization.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/bytes/chain_reader.h"
+#include "riegeli/bytes/chain_writer.h"
+#include "riegeli/bytes/lz4_writer.h"
+#include "riegeli/bytes/message_serialize.h"
+#include "riegeli/bytes/writer.h"
+#include "riegeli/chunk_encoding/chunk_encoder.h"
+#include "riegeli/chunk_encoding/compressor_options.h"
+#include "riegeli/chunk_encoding/types.h"
+
+namespace riegeli {
+
+namespace {
+
+// The sample consists of kNumSlices slices of length kSliceLength, evenly
+// spaced over the records, or of all records if they are not longer.
+constexpr size_t kNumSlices = 8;
+constexpr size_t kSliceLength = size_t{16} << 10;
+
+// Data estimated to shrink to more than kMaxCompressedRatio of their length
+// are not compressed.
+constexpr double kMaxCompressedRatio = 0.9;
+// Data which LZ4 shrinks to more than kMaxStronglyCompressedRatio of their
+// length, and whose bytes are close to uniformly distributed, are compressed
+// with LZ4: stronger compression mostly adds entropy coding, which would gain
+// little.
+constexpr double kMaxStronglyCompressedRatio = 2.0 / 3.0;
+
+// Returns the order-0 entropy of data divided by 8 bits, i.e. a lower bound of
+// the compressed to uncompressed length ratio achievable by entropy coding of
+// bytes alone.
+double EntropyRatio(const Chain& data) {
+  uint64_t counts[256] = {};
+  for (const absl::string_view fragment : data.blocks()) {
+    for (const char c : fragment) ++counts[static_cast<unsigned char>(c)];
+  }
+  const double size = static_cast<double>(data.size());
+  double entropy = 0.0;
+  for (const uint64_t count : counts) {
+    if (count == 0) continue;
+    const double probability = static_cast<double>(count) / size;
+    entropy -= probability * std::log2(probability);
+  }
+  return entropy / 8.0;
+}
+
+}  // namespace
+
+void AdaptiveEncoder::Done() {
+  records_ = Chain();
+  records_writer_ = ChainWriter();
+  limits_ = std::vector<size_t>();
+  ChunkEncoder::Done();
+}
+
+void AdaptiveEncoder::Reset() {
+  ChunkEncoder::Reset();
+  records_.Clear();
+  records_writer_ = ChainWriter(&records_);
+  limits_.clear();
+}
+
+bool AdaptiveEncoder::AddRecord(const google::protobuf::MessageLite& record) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(!record.IsInitialized())) {
+    return Fail(absl::StrCat("Failed to serialize message of type ",
+                             record.GetTypeName(),
+                             " because it is missing required fields: ",
+                             record.InitializationErrorString()));
+  }
+  const size_t size = record.ByteSizeLong();
+  if (ABSL_PREDICT_FALSE(size > size_t{std::numeric_limits<int>::max()})) {
+    return Fail(absl::StrCat(
+        "Failed to serialize message of type ", record.GetTypeName(),
+        " because it exceeds maximum protobuf size of 2GB: ", size));
+  }
+  if (ABSL_PREDICT_FALSE(num_records_ ==
+                         UnsignedMin(limits_.max_size(),
+                                     std::numeric_limits<uint64_t>::max()))) {
+    return Fail("Too many records");
+  }
+  ++num_records_;
+  // ByteSizeLong() above cached the sizes of the message and its submessages.
+  if (ABSL_PREDICT_FALSE(
+          !SerializePartialWithCachedSizesToWriter(record, &records_writer_))) {
+    return Fail(records_writer_);
+  }
+  limits_.push_back(IntCast<size_t>(records_writer_.pos()));
+  return true;
+}
+
+bool AdaptiveEncoder::AddRecord(absl::string_view record) {
+  return AddRecordImpl(record);
+}
+
+bool AdaptiveEncoder::AddRecord(std::string&& record) {
+  return AddRecordImpl(std::move(record));
+}
+
+bool AdaptiveEncoder::AddRecord(const Chain& record) {
+  return AddRecordImpl(record);
+}
+
+bool AdaptiveEncoder::AddRecord(Chain&& record) {
+  return AddRecordImpl(std::move(record));
+}
+
+template <typename Record>
+bool AdaptiveEncoder::AddRecordImpl(Record&& record) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(num_records_ ==
+                         UnsignedMin(limits_.max_size(),
+                                     std::numeric_limits<uint64_t>::max()))) {
+    return Fail("Too many records");
+  }
+  ++num_records_;
+  if (ABSL_PREDICT_FALSE(
+          !records_writer_.Write(std::forward<Record>(record)))) {
+    return Fail(records_writer_);
+  }
+  limits_.push_back(IntCast<size_t>(records_writer_.pos()));
+  return true;
+}
+
+bool AdaptiveEncoder::AddRecords(Chain records, std::vector<size_t> limits) {
+  RIEGELI_ASSERT_EQ(limits.empty() ? 0u : limits.back(), records.size())
+      << "Failed precondition of ChunkEncoder::AddRecords(): "
+         "record end positions do not match concatenated record values";
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(limits.size() >
+                         UnsignedMin(limits_.max_size(),
+                                     std::numeric_limits<uint64_t>::max()) -
+                             num_records_)) {
+    return Fail("Too many records");
+  }
+  num_records_ += IntCast<uint64_t>(limits.size());
+  if (ABSL_PREDICT_FALSE(!records_writer_.Write(std::move(records)))) {
+    return Fail(records_writer_);
+  }
+  if (limits_.empty()) {
+    limits_ = std::move(limits);
+  } else {
+    const size_t base = limits_.back();
+    for (auto& limit : limits) limit += base;
+    limits_.insert(limits_.cend(), limits.begin(), limits.end());
+  }
+  return true;
+}
+
+CompressorOptions AdaptiveEncoder::ChooseCompression() const {
+  if (options_.compression_type() == CompressionType::kNone ||
+      records_.empty()) {
+    return options_;
+  }
+  Chain sample;
+  ChainReader records_reader(&records_);
+  if (records_.size() <= kNumSlices * kSliceLength) {
+    sample = records_;
+  } else {
+    for (size_t i = 0; i < kNumSlices; ++i) {
+      records_reader.Seek((records_.size() - kSliceLength) * i /
+                          (kNumSlices - 1));
+      records_reader.Read(&sample, kSliceLength);
+    }
+  }
+  Chain compressed;
+  ChainWriter compressed_writer(&compressed);
+  Lz4Writer sample_writer(&compressed_writer,
+                          Lz4Writer::Options().set_size_hint(sample.size()));
+  if (ABSL_PREDICT_FALSE(!sample_writer.Write(sample)) ||
+      ABSL_PREDICT_FALSE(!sample_writer.Close()) ||
+      ABSL_PREDICT_FALSE(!compressed_writer.Close())) {
+    // Sampling is only a heuristic.
+    return options_;
+  }
+  const double lz4_ratio = static_cast<double>(compressed.size()) /
+                           static_cast<double>(sample.size());
+  const double entropy_ratio = EntropyRatio(sample);
+  if (lz4_ratio > kMaxCompressedRatio && entropy_ratio > kMaxCompressedRatio) {
+    return CompressorOptions(options_).set_uncompressed().set_window_log(
+        CompressorOptions::kDefaultWindowLog());
+  }
+  if (lz4_ratio > kMaxStronglyCompressedRatio &&
+      entropy_ratio > kMaxCompressedRatio &&
+      options_.compression_type() != CompressionType::kLz4) {
+    return CompressorOptions(options_).set_lz4().set_window_log(
+        CompressorOptions::kDefaultWindowLog());
+  }
+  return options_;
+}
+
+bool AdaptiveEncoder::EncodeAndClose(Writer* dest, uint64_t* num_records,
+                                     uint64_t* decoded_data_size) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(!records_writer_.Close())) {
+    return Fail(records_writer_);
+  }
+  const std::unique_ptr<ChunkEncoder> encoder =
+      make_encoder_(ChooseCompression());
+  RIEGELI_ASSERT(encoder->GetChunkType() == chunk_type_)
+      << "Failed precondition of AdaptiveEncoder::AdaptiveEncoder(): "
+         "chunk type does not match encoders";
+  if (ABSL_PREDICT_FALSE(
+          !encoder->AddRecords(std::move(records_), std::move(limits_))) ||
+      ABSL_PREDICT_FALSE(
+          !encoder->EncodeAndClose(dest, num_records, decoded_data_size))) {
+    Fail(*encoder);
+  }
+  return Close();
+}
+
+void AdaptiveEncoder::AddUniqueTo(MemoryEstimator* memory_estimator) const {
+  ChunkEncoder::AddUniqueTo(memory_estimator);
+  memory_estimator->AddMemory(sizeof(AdaptiveEncoder) - sizeof(ChunkEncoder) -
+                              sizeof(Chain) - sizeof(ChainWriter));
+  // records_writer_ writes to records_, so both are registered as shared.
+  records_writer_.AddSharedTo(memory_estimator);
+  records_.AddSharedTo(memory_estimator);
+  memory_estimator->AddMemory(sizeof(size_t) * limits_.capacity());
+}
+
+}  // namespace riegeli
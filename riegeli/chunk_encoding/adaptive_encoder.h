@@ -0,0 +1,118 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_CHUNK_ENCODING_ADAPTIVE_ENCODER_H_
+#define RIEGELI_CHUNK_ENCODING_ADAPTIVE_ENCODER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "google/protobuf/message_lite.h"
+#include "absl/strings/string_view.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/bytes/chain_writer.h"
+#include "riegeli/bytes/writer.h"
+#include "riegeli/chunk_encoding/chunk_encoder.h"
+#include "riegeli/chunk_encoding/compressor_options.h"
+#include "riegeli/chunk_encoding/types.h"
+
+namespace riegeli {
+
+// AdaptiveEncoder chooses compression of each chunk separately, depending on
+// how compressible its records are. Like DeferredEncoder, it collects records
+// in AddRecord(), deferring encoding to EncodeAndClose().
+//
+// A sample of the records is compressed with LZ4, and the entropy of its bytes
+// is measured. Then:
+//  * if neither suggests that the sample shrinks by at least 10% (e.g. already
+//    compressed images), the chunk is not compressed
+//  * if LZ4 shrinks the sample by less than a third and bytes are close to
+//    uniformly distributed, the chunk is compressed with LZ4, because stronger
+//    compression would gain little for its cost
+//  * otherwise the chunk is compressed with the given options
+//
+// If the given options are uncompressed, nothing is sampled.
+class AdaptiveEncoder final : public ChunkEncoder {
+ public:
+  // Creates the encoder of a chunk once its compression is chosen.
+  using EncoderFactory =
+      std::function<std::unique_ptr<ChunkEncoder>(const CompressorOptions&)>;
+
+  // Creates an empty AdaptiveEncoder.
+  //
+  // chunk_type must be the chunk type of encoders created by make_encoder.
+  AdaptiveEncoder(CompressorOptions options, ChunkType chunk_type,
+                  EncoderFactory make_encoder);
+
+  void Reset() override;
+
+  using ChunkEncoder::AddRecord;
+  bool AddRecord(const google::protobuf::MessageLite& record) override;
+  bool AddRecord(absl::string_view record) override;
+  bool AddRecord(std::string&& record) override;
+  bool AddRecord(const Chain& record) override;
+  bool AddRecord(Chain&& record) override;
+
+  bool AddRecords(Chain records, std::vector<size_t> limits) override;
+
+  bool EncodeAndClose(Writer* dest, uint64_t* num_records,
+                      uint64_t* decoded_data_size) override;
+
+  ChunkType GetChunkType() const override { return chunk_type_; }
+
+  void AddUniqueTo(MemoryEstimator* memory_estimator) const override;
+
+ protected:
+  void Done() override;
+
+ private:
+  template <typename Record>
+  bool AddRecordImpl(Record&& record);
+
+  // Returns compression options for records_.
+  CompressorOptions ChooseCompression() const;
+
+  CompressorOptions options_;
+  ChunkType chunk_type_;
+  EncoderFactory make_encoder_;
+  // Concatenated record values.
+  Chain records_;
+  ChainWriter records_writer_;
+  // Sorted record end positions.
+  //
+  // Invariant: limits_.size() == num_records_
+  std::vector<size_t> limits_;
+
+  // Invariant: records_writer_.pos() == (limits_.empty() ? 0 : limits_.back())
+};
+
+// Implementation details follow.
+
+inline AdaptiveEncoder::AdaptiveEncoder(CompressorOptions options,
+                                        ChunkType chunk_type,
+                                        EncoderFactory make_encoder)
+    : options_(std::move(options)),
+      chunk_type_(chunk_type),
+      make_encoder_(std::move(make_encoder)),
+      records_writer_(&records_) {}
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_CHUNK_ENCODING_ADAPTIVE_ENCODER_H_
@@ -0,0 +1,215 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/chunk_encoding/aliased_fields.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <initializer_list>
+#include <utility>
+#include <vector>
+
+#include "google/protobuf/message_lite.h"
+#include "absl/base/optimization.h"
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/bytes/chain_reader.h"
+#include "riegeli/bytes/message_parse.h"
+#include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/reader_utils.h"
+#include "riegeli/bytes/varint.h"
+#include "riegeli/bytes/writer_utils.h"
+#include "riegeli/chunk_encoding/field_filter.h"
+#include "riegeli/chunk_encoding/transpose_internal.h"
+
+namespace riegeli {
+
+namespace {
+
+// The same limit of nesting of submessages and groups as in proto parsing.
+constexpr int kMaxDepth = 100;
+
+bool SkipValue(Reader* src, uint32_t tag, int depth);
+
+// Skips fields of a group up to its end group tag.
+bool SkipGroup(Reader* src, uint32_t start_tag, int depth) {
+  if (ABSL_PREDICT_FALSE(depth >= kMaxDepth)) return false;
+  for (;;) {
+    uint32_t tag;
+    if (ABSL_PREDICT_FALSE(!ReadVarint32(src, &tag)) ||
+        ABSL_PREDICT_FALSE(!internal::ValidTag(tag))) {
+      return false;
+    }
+    if (static_cast<internal::WireType>(tag & 7) ==
+        internal::WireType::kEndGroup) {
+      return tag == start_tag + (internal::WireType::kEndGroup -
+                                 internal::WireType::kStartGroup);
+    }
+    if (ABSL_PREDICT_FALSE(!SkipValue(src, tag, depth + 1))) return false;
+  }
+}
+
+// Skips the value of a field whose tag was already read.
+bool SkipValue(Reader* src, uint32_t tag, int depth) {
+  switch (static_cast<internal::WireType>(tag & 7)) {
+    case internal::WireType::kVarint: {
+      uint64_t value;
+      return ReadVarint64(src, &value);
+    }
+    case internal::WireType::kFixed32:
+      return src->Skip(sizeof(uint32_t));
+    case internal::WireType::kFixed64:
+      return src->Skip(sizeof(uint64_t));
+    case internal::WireType::kLengthDelimited: {
+      uint32_t length;
+      return ReadVarint32(src, &length) && src->Skip(length);
+    }
+    case internal::WireType::kStartGroup:
+      return SkipGroup(src, tag, depth);
+    default:
+      return false;
+  }
+}
+
+// Appends data of src between from and to, leaving src positioned at to.
+void AppendRange(ChainReader* src, Position from, Position to, Chain* dest) {
+  if (!src->Seek(from)) {
+    RIEGELI_ASSERT_UNREACHABLE()
+        << "Seeking message data failed: " << src->message();
+  }
+  if (!src->Read(dest, IntCast<size_t>(to - from))) {
+    RIEGELI_ASSERT_UNREACHABLE()
+        << "Reading message data failed: " << src->message();
+  }
+}
+
+}  // namespace
+
+AliasedFields::AliasedFields(std::initializer_list<Field> fields) {
+  for (const Field& field : fields) AddField(field);
+}
+
+AliasedFields& AliasedFields::AddField(Field field) & {
+  RIEGELI_ASSERT(!field.path().empty())
+      << "Failed precondition of AliasedFields::AddField(): "
+         "the root message can not be aliased";
+  fields_.push_back(std::move(field));
+  values_.emplace_back();
+  return *this;
+}
+
+void AliasedFields::ClearValues() {
+  for (std::vector<Chain>& values : values_) values.clear();
+}
+
+inline AliasedFields::Match AliasedFields::Find(const Field::Path& path,
+                                                size_t* index) const {
+  Match match = Match::kNone;
+  for (size_t i = 0; i < fields_.size(); ++i) {
+    const Field::Path& field_path = fields_[i].path();
+    if (field_path.size() < path.size() ||
+        !std::equal(path.begin(), path.end(), field_path.begin())) {
+      continue;
+    }
+    if (field_path.size() == path.size()) {
+      *index = i;
+      return Match::kField;
+    }
+    match = Match::kParent;
+  }
+  return match;
+}
+
+bool AliasedFields::Split(ChainReader* src, Position limit, Field::Path* path,
+                          int depth, Chain* dest) {
+  if (ABSL_PREDICT_FALSE(depth >= kMaxDepth)) return false;
+  // Data between copied and the current field are appended to *dest unchanged
+  // when a field which needs handling is found, sharing memory with src.
+  Position copied = src->pos();
+  while (src->pos() < limit) {
+    const Position field_begin = src->pos();
+    uint32_t tag;
+    if (ABSL_PREDICT_FALSE(!ReadVarint32(src, &tag)) ||
+        ABSL_PREDICT_FALSE(!internal::ValidTag(tag))) {
+      return false;
+    }
+    if (static_cast<internal::WireType>(tag & 7) !=
+        internal::WireType::kLengthDelimited) {
+      if (ABSL_PREDICT_FALSE(!SkipValue(src, tag, depth))) return false;
+      continue;
+    }
+    uint32_t length;
+    if (ABSL_PREDICT_FALSE(!ReadVarint32(src, &length)) ||
+        ABSL_PREDICT_FALSE(length > limit - UnsignedMin(src->pos(), limit))) {
+      return false;
+    }
+    const Position value_begin = src->pos();
+    const Position value_end = value_begin + length;
+    path->push_back(tag >> 3);
+    size_t index;
+    const Match match = Find(*path, &index);
+    if (match == Match::kNone) {
+      path->pop_back();
+      if (!src->Skip(length)) {
+        RIEGELI_ASSERT_UNREACHABLE()
+            << "Skipping message data failed: " << src->message();
+      }
+      continue;
+    }
+    AppendRange(src, copied, field_begin, dest);
+    if (match == Match::kField) {
+      values_[index].emplace_back();
+      AppendRange(src, value_begin, value_end, &values_[index].back());
+    } else {
+      // The submessage contains aliased fields. Its remaining fields need a
+      // new length.
+      Chain submessage;
+      if (!src->Seek(value_begin)) {
+        RIEGELI_ASSERT_UNREACHABLE()
+            << "Seeking message data failed: " << src->message();
+      }
+      if (ABSL_PREDICT_FALSE(
+              !Split(src, value_end, path, depth + 1, &submessage))) {
+        return false;
+      }
+      char header[kMaxLengthVarint32() * 2];
+      char* const header_end = WriteVarint32(
+          WriteVarint32(header, tag), IntCast<uint32_t>(submessage.size()));
+      dest->Append(absl::string_view(header, PtrDistance(header, header_end)));
+      dest->Append(std::move(submessage));
+    }
+    path->pop_back();
+    copied = src->pos();
+  }
+  if (ABSL_PREDICT_FALSE(src->pos() != limit)) return false;
+  AppendRange(src, copied, limit, dest);
+  return true;
+}
+
+bool ParsePartialWithAliasedFields(google::protobuf::MessageLite* message,
+                                   const Chain& data,
+                                   AliasedFields* aliased_fields) {
+  aliased_fields->ClearValues();
+  ChainReader src(&data);
+  Field::Path path;
+  Chain rest;
+  const bool ok = aliased_fields->Split(&src, data.size(), &path, 0, &rest);
+  src.Close();
+  if (ABSL_PREDICT_FALSE(!ok)) return false;
+  return ParsePartialFromChain(message, rest);
+}
+
+}  // namespace riegeli
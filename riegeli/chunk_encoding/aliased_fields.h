@@ -0,0 +1,146 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_CHUNK_ENCODING_ALIASED_FIELDS_H_
+#define RIEGELI_CHUNK_ENCODING_ALIASED_FIELDS_H_
+
+#include <stddef.h>
+#include <initializer_list>
+#include <utility>
+#include <vector>
+
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/chunk_encoding/field_filter.h"
+
+namespace google {
+namespace protobuf {
+class MessageLite;
+}  // namespace protobuf
+}  // namespace google
+
+namespace riegeli {
+
+class ChainReader;
+
+// Specifies string or bytes fields of a proto message to be aliased while
+// parsing, and holds their values in the message parsed last.
+//
+// Parsing a message copies string and bytes fields to std::string members.
+// An aliased field is instead left unset in the message, and its values are
+// Chains sharing memory with the data being parsed, e.g. with record values
+// decoded by ChunkDecoder. The memory is kept alive by reference counts, so
+// the values remain valid after the data is gone, e.g. after RecordReader
+// moves to the next chunk. This avoids copying large values such as images.
+// Small values and fragments are copied anyway, as Chain does.
+class AliasedFields {
+ public:
+  // Aliases no fields. Fields can be added by AddField().
+  AliasedFields() noexcept {}
+
+  // Aliases the specified fields.
+  AliasedFields(std::initializer_list<Field> fields);
+
+  AliasedFields(AliasedFields&& src) noexcept;
+  AliasedFields& operator=(AliasedFields&& src) noexcept;
+
+  // Adds a field to alias. Its index for values() is the number of fields
+  // added before.
+  //
+  // The field path must not be empty. The field must have wire type
+  // length-delimited, i.e. be a string or bytes field; a packed repeated field
+  // or a submessage would be aliased as its encoded contents.
+  AliasedFields& AddField(Field field) &;
+  AliasedFields&& AddField(Field field) &&;
+
+  size_t num_fields() const { return fields_.size(); }
+
+  // Returns the field with the given index.
+  const Field& field(size_t index) const;
+
+  // Returns values of the field with the given index in the message parsed
+  // last, in the order of their occurrence: none if the field was absent,
+  // several if the field is repeated or occurs in a repeated submessage.
+  const std::vector<Chain>& values(size_t index) const;
+  std::vector<Chain>* mutable_values(size_t index);
+
+  // Clears values of all fields, keeping the fields.
+  void ClearValues();
+
+ private:
+  enum class Match { kNone, kParent, kField };
+
+  // Returns whether path is the path of a field (setting *index to the index
+  // of the field), a proper prefix of the path of a field, or neither.
+  Match Find(const Field::Path& path, size_t* index) const;
+
+  // Appends to *dest the fields of the message in src from its current
+  // position up to limit, except for aliased fields, whose values are appended
+  // to values_ instead. path is the path of the message, and is restored on
+  // success.
+  bool Split(ChainReader* src, Position limit, Field::Path* path, int depth,
+             Chain* dest);
+
+  friend bool ParsePartialWithAliasedFields(
+      google::protobuf::MessageLite* message, const Chain& data,
+      AliasedFields* aliased_fields);
+
+  std::vector<Field> fields_;
+  std::vector<std::vector<Chain>> values_;
+};
+
+// Parses a message contained in a Chain like ParsePartialFromChain(), except
+// that values of fields specified by *aliased_fields are stored in
+// aliased_fields->values() instead of being parsed into message.
+bool ParsePartialWithAliasedFields(google::protobuf::MessageLite* message,
+                                   const Chain& data,
+                                   AliasedFields* aliased_fields);
+
+// Implementation details follow.
+
+inline AliasedFields::AliasedFields(AliasedFields&& src) noexcept
+    : fields_(std::move(src.fields_)), values_(std::move(src.values_)) {}
+
+inline AliasedFields& AliasedFields::operator=(AliasedFields&& src) noexcept {
+  fields_ = std::move(src.fields_);
+  values_ = std::move(src.values_);
+  return *this;
+}
+
+inline AliasedFields&& AliasedFields::AddField(Field field) && {
+  return std::move(AddField(std::move(field)));
+}
+
+inline const Field& AliasedFields::field(size_t index) const {
+  RIEGELI_ASSERT_LT(index, fields_.size())
+      << "Failed precondition of AliasedFields::field(): index out of range";
+  return fields_[index];
+}
+
+inline const std::vector<Chain>& AliasedFields::values(size_t index) const {
+  RIEGELI_ASSERT_LT(index, values_.size())
+      << "Failed precondition of AliasedFields::values(): index out of range";
+  return values_[index];
+}
+
+inline std::vector<Chain>* AliasedFields::mutable_values(size_t index) {
+  RIEGELI_ASSERT_LT(index, values_.size())
+      << "Failed precondition of AliasedFields::mutable_values(): "
+         "index out of range";
+  return &values_[index];
+}
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_CHUNK_ENCODING_ALIASED_FIELDS_H_
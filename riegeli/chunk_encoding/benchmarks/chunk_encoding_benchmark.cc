@@ -0,0 +1,276 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Microbenchmarks of hashing, chunk encoders, TransposeDecoder, and
+// compressors, using records from synthetic_records.h.
+//
+// Benchmarks parameterized by compression take two arguments: the compression
+// type (see Compression below) and the compression level.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "benchmark/benchmark.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/bytes/backward_writer.h"
+#include "riegeli/bytes/chain_backward_writer.h"
+#include "riegeli/bytes/chain_reader.h"
+#include "riegeli/bytes/chain_writer.h"
+#include "riegeli/bytes/reader_utils.h"
+#include "riegeli/chunk_encoding/benchmarks/synthetic_records.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/compressor.h"
+#include "riegeli/chunk_encoding/compressor_options.h"
+#include "riegeli/chunk_encoding/decompressor.h"
+#include "riegeli/chunk_encoding/field_filter.h"
+#include "riegeli/chunk_encoding/hash.h"
+#include "riegeli/chunk_encoding/record_limits.h"
+#include "riegeli/chunk_encoding/simple_encoder.h"
+#include "riegeli/chunk_encoding/transpose_decoder.h"
+#include "riegeli/chunk_encoding/transpose_encoder.h"
+#include "riegeli/chunk_encoding/types.h"
+
+namespace riegeli {
+namespace benchmarks {
+namespace {
+
+constexpr size_t kNumRecords = 10000;
+constexpr uint64_t kBucketSize = uint64_t{1} << 20;
+
+enum class Compression { kNone, kBrotli, kZstd, kLz4 };
+
+CompressorOptions MakeCompressorOptions(const benchmark::State& state) {
+  const int level = IntCast<int>(state.range(1));
+  switch (static_cast<Compression>(state.range(0))) {
+    case Compression::kNone:
+      return CompressorOptions().set_uncompressed();
+    case Compression::kBrotli:
+      return CompressorOptions().set_brotli(level);
+    case Compression::kZstd:
+      return CompressorOptions().set_zstd(level);
+    case Compression::kLz4:
+      return CompressorOptions().set_lz4(level);
+  }
+  RIEGELI_ASSERT_UNREACHABLE()
+      << "Unknown compression: " << static_cast<int>(state.range(0));
+}
+
+std::string CompressionLabel(const benchmark::State& state) {
+  switch (static_cast<Compression>(state.range(0))) {
+    case Compression::kNone:
+      return "uncompressed";
+    case Compression::kBrotli:
+      return absl::StrCat("brotli:", state.range(1));
+    case Compression::kZstd:
+      return absl::StrCat("zstd:", state.range(1));
+    case Compression::kLz4:
+      return absl::StrCat("lz4:", state.range(1));
+  }
+  RIEGELI_ASSERT_UNREACHABLE()
+      << "Unknown compression: " << static_cast<int>(state.range(0));
+}
+
+void Compressions(benchmark::internal::Benchmark* benchmark) {
+  benchmark->Args({static_cast<int>(Compression::kNone), 0});
+  for (const int level : {1, 6, 9}) {
+    benchmark->Args({static_cast<int>(Compression::kBrotli), level});
+  }
+  for (const int level : {1, 3, 9}) {
+    benchmark->Args({static_cast<int>(Compression::kZstd), level});
+  }
+  for (const int level : {1, 9}) {
+    benchmark->Args({static_cast<int>(Compression::kLz4), level});
+  }
+}
+
+const std::vector<std::string>& ProtoRecords() {
+  static const std::vector<std::string>* const records =
+      new std::vector<std::string>(SyntheticProtoRecords(kNumRecords));
+  return *records;
+}
+
+const std::vector<std::string>& TextRecords() {
+  static const std::vector<std::string>* const records =
+      new std::vector<std::string>(SyntheticTextRecords(kNumRecords, 100));
+  return *records;
+}
+
+int64_t TotalSize(const std::vector<std::string>& records) {
+  int64_t size = 0;
+  for (const std::string& record : records) {
+    size += IntCast<int64_t>(record.size());
+  }
+  return size;
+}
+
+void BM_HashString(benchmark::State& state) {
+  const std::string data(IntCast<size_t>(state.range(0)), 'x');
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(internal::Hash(data));
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_HashString)->Range(16, 1 << 20);
+
+void BM_HashChain(benchmark::State& state) {
+  const std::string block(IntCast<size_t>(state.range(0)), 'x');
+  Chain data;
+  while (data.size() < (size_t{1} << 20)) data.Append(block);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(internal::Hash(data));
+  }
+  state.SetBytesProcessed(state.iterations() * IntCast<int64_t>(data.size()));
+}
+BENCHMARK(BM_HashChain)->Range(256, 1 << 16);
+
+void EncodeChunk(ChunkEncoder* encoder, const std::vector<std::string>& records,
+                 Chunk* chunk) {
+  for (const std::string& record : records) {
+    RIEGELI_CHECK(encoder->AddRecord(record)) << encoder->message();
+  }
+  RIEGELI_CHECK(encoder->EncodeAndClose(chunk)) << encoder->message();
+}
+
+void BM_SimpleEncoder(benchmark::State& state) {
+  const std::vector<std::string>& records = ProtoRecords();
+  const CompressorOptions options = MakeCompressorOptions(state);
+  size_t encoded_size = 0;
+  for (auto _ : state) {
+    SimpleEncoder encoder(options, 0);
+    Chunk chunk;
+    EncodeChunk(&encoder, records, &chunk);
+    encoded_size = chunk.data.size();
+  }
+  state.SetBytesProcessed(state.iterations() * TotalSize(records));
+  state.SetLabel(absl::StrCat(CompressionLabel(state),
+                              " encoded_size:", encoded_size));
+}
+BENCHMARK(BM_SimpleEncoder)->Apply(Compressions);
+
+void BM_TransposeEncoder(benchmark::State& state) {
+  const std::vector<std::string>& records = ProtoRecords();
+  const CompressorOptions options = MakeCompressorOptions(state);
+  size_t encoded_size = 0;
+  for (auto _ : state) {
+    TransposeEncoder encoder(options, kBucketSize);
+    Chunk chunk;
+    EncodeChunk(&encoder, records, &chunk);
+    encoded_size = chunk.data.size();
+  }
+  state.SetBytesProcessed(state.iterations() * TotalSize(records));
+  state.SetLabel(absl::StrCat(CompressionLabel(state),
+                              " encoded_size:", encoded_size));
+}
+BENCHMARK(BM_TransposeEncoder)->Apply(Compressions);
+
+void TransposeDecode(benchmark::State& state, const FieldFilter& field_filter) {
+  const std::vector<std::string>& records = ProtoRecords();
+  Chunk chunk;
+  {
+    TransposeEncoder encoder(MakeCompressorOptions(state), kBucketSize);
+    EncodeChunk(&encoder, records, &chunk);
+  }
+  TransposeDecoder decoder;
+  RecordLimits limits;
+  for (auto _ : state) {
+    ChainReader src(&chunk.data);
+    uint8_t chunk_type;
+    RIEGELI_CHECK(ReadByte(&src, &chunk_type));
+    RIEGELI_CHECK(static_cast<ChunkType>(chunk_type) == ChunkType::kTransposed);
+    Chain values;
+    ChainBackwardWriter dest(&values);
+    limits.clear();
+    RIEGELI_CHECK(decoder.Reset(&src, chunk.header.num_records(),
+                                chunk.header.decoded_data_size(), field_filter,
+                                nullptr, 0, &dest, &limits))
+        << decoder.message();
+    RIEGELI_CHECK(dest.Close()) << dest.message();
+    benchmark::DoNotOptimize(values);
+  }
+  state.SetBytesProcessed(state.iterations() * TotalSize(records));
+  state.SetLabel(CompressionLabel(state));
+}
+
+void BM_TransposeDecode(benchmark::State& state) {
+  TransposeDecode(state, FieldFilter::All());
+}
+BENCHMARK(BM_TransposeDecode)->Apply(Compressions);
+
+void BM_TransposeDecodeFilteredId(benchmark::State& state) {
+  TransposeDecode(state, FieldFilter({Field({kIdField})}));
+}
+BENCHMARK(BM_TransposeDecodeFilteredId)->Apply(Compressions);
+
+void BM_TransposeDecodeFilteredNested(benchmark::State& state) {
+  TransposeDecode(
+      state, FieldFilter({Field({kLocationField, kLocationCountryField})}));
+}
+BENCHMARK(BM_TransposeDecodeFilteredNested)->Apply(Compressions);
+
+Chain Compress(const CompressorOptions& options,
+               const std::vector<std::string>& records) {
+  internal::Compressor compressor(options);
+  for (const std::string& record : records) {
+    RIEGELI_CHECK(compressor.writer()->Write(record))
+        << compressor.writer()->message();
+  }
+  Chain compressed;
+  ChainWriter dest(&compressed);
+  RIEGELI_CHECK(compressor.EncodeAndClose(&dest)) << compressor.message();
+  RIEGELI_CHECK(dest.Close()) << dest.message();
+  return compressed;
+}
+
+void BM_Compress(benchmark::State& state) {
+  const std::vector<std::string>& records = TextRecords();
+  const CompressorOptions options = MakeCompressorOptions(state);
+  size_t compressed_size = 0;
+  for (auto _ : state) {
+    compressed_size = Compress(options, records).size();
+  }
+  state.SetBytesProcessed(state.iterations() * TotalSize(records));
+  state.SetLabel(absl::StrCat(CompressionLabel(state),
+                              " compressed_size:", compressed_size));
+}
+BENCHMARK(BM_Compress)->Apply(Compressions);
+
+void BM_Decompress(benchmark::State& state) {
+  const std::vector<std::string>& records = TextRecords();
+  const CompressorOptions options = MakeCompressorOptions(state);
+  const Chain compressed = Compress(options, records);
+  const size_t size = IntCast<size_t>(TotalSize(records));
+  for (auto _ : state) {
+    ChainReader src(&compressed);
+    internal::Decompressor decompressor(&src, options.compression_type());
+    Chain decompressed;
+    RIEGELI_CHECK(decompressor.reader()->Read(&decompressed, size))
+        << decompressor.reader()->message();
+    RIEGELI_CHECK(decompressor.VerifyEndAndClose()) << decompressor.message();
+    benchmark::DoNotOptimize(decompressed);
+  }
+  state.SetBytesProcessed(state.iterations() * TotalSize(records));
+  state.SetLabel(CompressionLabel(state));
+}
+BENCHMARK(BM_Decompress)->Apply(Compressions);
+
+}  // namespace
+}  // namespace benchmarks
+}  // namespace riegeli
+
+BENCHMARK_MAIN();
@@ -0,0 +1,165 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/chunk_encoding/benchmarks/synthetic_records.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/endian.h"
+#include "riegeli/bytes/varint.h"
+#include "riegeli/bytes/writer_utils.h"
+
+namespace riegeli {
+namespace benchmarks {
+
+namespace {
+
+// Only the raw output of std::mt19937_64 is used because it is fully specified
+// by the standard, unlike std::uniform_int_distribution and friends.
+class Random {
+ public:
+  explicit Random(uint64_t seed) : engine_(seed) {}
+
+  // Returns a value in [0, bound).
+  uint64_t Uniform(uint64_t bound) { return engine_() % bound; }
+
+  // Returns a value in [0, 2^max_bits), biased towards small values.
+  uint64_t Skewed(int max_bits) {
+    const int bits = IntCast<int>(Uniform(IntCast<uint64_t>(max_bits) + 1));
+    return bits == 0 ? uint64_t{0} : engine_() >> (64 - bits);
+  }
+
+ private:
+  std::mt19937_64 engine_;
+};
+
+constexpr absl::string_view kWords[] = {
+    "alpha",  "bravo",   "charlie", "delta",  "echo",    "foxtrot", "golf",
+    "hotel",  "india",   "juliett", "kilo",   "lima",    "mike",    "november",
+    "oscar",  "papa",    "quebec",  "romeo",  "sierra",  "tango",   "uniform",
+    "victor", "whiskey", "xray",    "yankee", "zulu"};
+
+constexpr absl::string_view kCountries[] = {"CH", "DE", "FR", "GB", "JP",
+                                            "PL", "US"};
+
+absl::string_view RandomWord(Random* random) {
+  return kWords[random->Uniform(sizeof(kWords) / sizeof(kWords[0]))];
+}
+
+void AppendVarint(uint64_t value, std::string* dest) {
+  char buffer[kMaxLengthVarint64()];
+  const char* const end = WriteVarint64(buffer, value);
+  dest->append(buffer, PtrDistance(buffer, end));
+}
+
+void AppendTag(uint32_t field, int wire_type, std::string* dest) {
+  AppendVarint((uint64_t{field} << 3) | IntCast<uint64_t>(wire_type), dest);
+}
+
+void AppendFixed32(uint32_t field, uint32_t value, std::string* dest) {
+  AppendTag(field, 5, dest);
+  const uint32_t word = WriteLittleEndian32(value);
+  dest->append(reinterpret_cast<const char*>(&word), sizeof(word));
+}
+
+void AppendFixed64(uint32_t field, uint64_t value, std::string* dest) {
+  AppendTag(field, 1, dest);
+  const uint64_t word = WriteLittleEndian64(value);
+  dest->append(reinterpret_cast<const char*>(&word), sizeof(word));
+}
+
+void AppendLengthDelimited(uint32_t field, absl::string_view value,
+                           std::string* dest) {
+  AppendTag(field, 2, dest);
+  AppendVarint(value.size(), dest);
+  dest->append(value.data(), value.size());
+}
+
+// Appends words separated by spaces until dest has at least size bytes.
+void AppendText(size_t size, Random* random, std::string* dest) {
+  while (dest->size() < size) {
+    if (!dest->empty()) dest->push_back(' ');
+    const absl::string_view word = RandomWord(random);
+    dest->append(word.data(), word.size());
+  }
+}
+
+}  // namespace
+
+std::vector<std::string> SyntheticProtoRecords(size_t num_records,
+                                               uint64_t seed) {
+  Random random(seed);
+  std::vector<std::string> records;
+  records.reserve(num_records);
+  uint64_t timestamp = uint64_t{1500000000000};
+  for (size_t i = 0; i < num_records; ++i) {
+    std::string record;
+    AppendTag(kIdField, 0, &record);
+    AppendVarint(i * 7 + random.Uniform(7), &record);
+    std::string name;
+    AppendText(IntCast<size_t>(random.Uniform(24)), &random, &name);
+    AppendLengthDelimited(kNameField, name, &record);
+    const size_t num_values = IntCast<size_t>(random.Uniform(9));
+    for (size_t j = 0; j < num_values; ++j) {
+      AppendTag(kValuesField, 0, &record);
+      AppendVarint(random.Skewed(31), &record);
+    }
+    if (random.Uniform(4) != 0) {
+      std::string location;
+      AppendFixed32(kLocationLatitudeField,
+                    IntCast<uint32_t>(random.Uniform(180000000)), &location);
+      timestamp += random.Skewed(20);
+      AppendFixed64(kLocationTimestampField, timestamp, &location);
+      AppendLengthDelimited(
+          kLocationCountryField,
+          kCountries[random.Uniform(sizeof(kCountries) /
+                                    sizeof(kCountries[0]))],
+          &location);
+      AppendLengthDelimited(kLocationField, location, &record);
+    }
+    std::string payload(IntCast<size_t>(random.Uniform(64)), '\0');
+    for (char& byte : payload) {
+      byte = static_cast<char>(random.Skewed(8));
+    }
+    AppendLengthDelimited(kPayloadField, payload, &record);
+    records.push_back(std::move(record));
+  }
+  return records;
+}
+
+std::vector<std::string> SyntheticTextRecords(size_t num_records,
+                                              size_t average_size,
+                                              uint64_t seed) {
+  Random random(seed);
+  std::vector<std::string> records;
+  records.reserve(num_records);
+  for (size_t i = 0; i < num_records; ++i) {
+    std::string record;
+    AppendText(average_size / 2 +
+                   IntCast<size_t>(random.Uniform(average_size + 1)),
+               &random, &record);
+    records.push_back(std::move(record));
+  }
+  return records;
+}
+
+}  // namespace benchmarks
+}  // namespace riegeli
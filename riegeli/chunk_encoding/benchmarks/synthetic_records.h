@@ -0,0 +1,73 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_CHUNK_ENCODING_BENCHMARKS_SYNTHETIC_RECORDS_H_
+#define RIEGELI_CHUNK_ENCODING_BENCHMARKS_SYNTHETIC_RECORDS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace riegeli {
+namespace benchmarks {
+
+// Field tags of synthetic records, which are serialized protos of this
+// message:
+//
+//   message SyntheticRecord {
+//     message Location {
+//       fixed32 latitude = 1;
+//       fixed64 timestamp = 2;
+//       string country = 3;
+//     }
+//     uint64 id = 1;
+//     string name = 2;
+//     repeated int32 values = 3;
+//     Location location = 4;
+//     bytes payload = 5;
+//   }
+//
+// The message is not compiled. Records are serialized directly, so that
+// benchmarks do not depend on the protobuf compiler.
+constexpr uint32_t kIdField = 1;
+constexpr uint32_t kNameField = 2;
+constexpr uint32_t kValuesField = 3;
+constexpr uint32_t kLocationField = 4;
+constexpr uint32_t kLocationLatitudeField = 1;
+constexpr uint32_t kLocationTimestampField = 2;
+constexpr uint32_t kLocationCountryField = 3;
+constexpr uint32_t kPayloadField = 5;
+
+// Returns num_records synthetic records.
+//
+// The records are a pure function of num_records and seed, identical on every
+// platform, so that results of separate runs are comparable. Their structure
+// is stable and their contents are moderately compressible, like typical logs.
+std::vector<std::string> SyntheticProtoRecords(size_t num_records,
+                                               uint64_t seed = 1);
+
+// Returns num_records records which are not protos, with lengths varying
+// around average_size and moderately compressible contents.
+//
+// The records are a pure function of the arguments, identical on every
+// platform.
+std::vector<std::string> SyntheticTextRecords(size_t num_records,
+                                              size_t average_size,
+                                              uint64_t seed = 1);
+
+}  // namespace benchmarks
+}  // namespace riegeli
+
+#endif  // RIEGELI_CHUNK_ENCODING_BENCHMARKS_SYNTHETIC_RECORDS_H_
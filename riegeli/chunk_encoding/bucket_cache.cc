@@ -0,0 +1,82 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/chunk_encoding/bucket_cache.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <utility>
+
+#include "absl/synchronization/mutex.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+
+namespace riegeli {
+
+BucketCache::BucketCache(size_t max_bytes) : max_bytes_(max_bytes) {}
+
+inline size_t BucketCache::EntrySize(const Buffers& buffers) {
+  size_t size_bytes = sizeof(Entry) + buffers.size() * sizeof(Chain);
+  for (const Chain& buffer : buffers) size_bytes += buffer.size();
+  return size_bytes;
+}
+
+std::shared_ptr<const BucketCache::Buffers> BucketCache::Find(
+    uint64_t chunk_hash, uint32_t bucket_index) {
+  const Key key{chunk_hash, bucket_index};
+  absl::MutexLock lock(&mutex_);
+  const auto iter = index_.find(key);
+  if (iter == index_.end()) return nullptr;
+  // Mark the entry as the most recently used.
+  entries_.splice(entries_.begin(), entries_, iter->second);
+  return iter->second->buffers;
+}
+
+void BucketCache::Insert(uint64_t chunk_hash, uint32_t bucket_index,
+                         std::shared_ptr<const Buffers> buffers) {
+  const Key key{chunk_hash, bucket_index};
+  const size_t size_bytes = EntrySize(*buffers);
+  // A bucket larger than the whole cache would only evict everything else.
+  if (size_bytes > max_bytes_) return;
+  absl::MutexLock lock(&mutex_);
+  const auto iter = index_.find(key);
+  if (iter != index_.end()) {
+    size_bytes_ -= iter->second->size_bytes;
+    entries_.erase(iter->second);
+    index_.erase(iter);
+  }
+  entries_.push_front(Entry{key, std::move(buffers), size_bytes});
+  index_.emplace(key, entries_.begin());
+  size_bytes_ += size_bytes;
+  EvictExcess();
+}
+
+size_t BucketCache::size_bytes() const {
+  absl::MutexLock lock(&mutex_);
+  return size_bytes_;
+}
+
+void BucketCache::EvictExcess() {
+  while (size_bytes_ > max_bytes_) {
+    RIEGELI_ASSERT(!entries_.empty())
+        << "Failed invariant of BucketCache: positive size without entries";
+    const Entry& entry = entries_.back();
+    size_bytes_ -= entry.size_bytes;
+    index_.erase(entry.key);
+    entries_.pop_back();
+  }
+}
+
+}  // namespace riegeli
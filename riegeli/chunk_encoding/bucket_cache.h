@@ -0,0 +1,113 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_CHUNK_ENCODING_BUCKET_CACHE_H_
+#define RIEGELI_CHUNK_ENCODING_BUCKET_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+
+namespace riegeli {
+
+// A cache of decompressed buckets of transposed chunks, which lets reading
+// the same chunks again with a field filter avoid decompressing buckets again.
+// Least recently used buckets are evicted when the total size of cached
+// buckets exceeds the given limit.
+//
+// Buckets are identified by the data hash of their chunk and their index in the
+// chunk, so a BucketCache may be shared between readers of the same file or of
+// different files, and cached buckets stay valid when a file is opened again.
+//
+// A BucketCache is attached with ChunkDecoder::Options::set_bucket_cache() or
+// RecordReader::Options::set_bucket_cache(), and must be kept alive until the
+// decoder or reader is closed.
+//
+// BucketCache is thread-safe.
+class BucketCache {
+ public:
+  // Decompressed buffers of a bucket, in the order of the bucket.
+  using Buffers = std::vector<Chain>;
+
+  // Creates an empty BucketCache holding buckets of at most max_bytes in total.
+  explicit BucketCache(size_t max_bytes);
+
+  BucketCache(const BucketCache&) = delete;
+  BucketCache& operator=(const BucketCache&) = delete;
+
+  // Returns the bucket with the given index in the chunk with the given data
+  // hash, or nullptr if it is not cached.
+  std::shared_ptr<const Buffers> Find(uint64_t chunk_hash,
+                                      uint32_t bucket_index);
+
+  // Caches a bucket with the given index in the chunk with the given data hash,
+  // evicting least recently used buckets as needed. If the bucket is already
+  // cached, it is replaced.
+  void Insert(uint64_t chunk_hash, uint32_t bucket_index,
+              std::shared_ptr<const Buffers> buffers);
+
+  // Returns the total size of cached buckets.
+  size_t size_bytes() const;
+
+ private:
+  struct Key {
+    uint64_t chunk_hash;
+    uint32_t bucket_index;
+
+    friend bool operator==(const Key& a, const Key& b) {
+      return a.chunk_hash == b.chunk_hash && a.bucket_index == b.bucket_index;
+    }
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key& key) const {
+      return static_cast<size_t>(
+          key.chunk_hash ^
+          uint64_t{key.bucket_index} * uint64_t{0x9e3779b97f4a7c15});
+    }
+  };
+
+  struct Entry {
+    Key key;
+    std::shared_ptr<const Buffers> buffers;
+    size_t size_bytes;
+  };
+
+  // Returns the number of bytes accounted for an entry.
+  static size_t EntrySize(const Buffers& buffers);
+
+  // Evicts least recently used entries until size_bytes_ <= max_bytes_.
+  void EvictExcess() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  const size_t max_bytes_;
+  mutable absl::Mutex mutex_;
+  // Entries ordered from the most recently used.
+  std::list<Entry> entries_ GUARDED_BY(mutex_);
+  std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index_
+      GUARDED_BY(mutex_);
+  // Invariant: size_bytes_ is the sum of entries_[].size_bytes
+  size_t size_bytes_ GUARDED_BY(mutex_) = 0;
+};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_CHUNK_ENCODING_BUCKET_CACHE_H_
@@ -34,11 +34,25 @@ ChunkHeader::ChunkHeader(const Chain& data, uint64_t num_records,
   set_header_hash(computed_header_hash());
 }
 
+ChunkHeader::ChunkHeader(uint64_t data_size, uint64_t data_hash,
+                         uint64_t num_records, uint64_t decoded_data_size) {
+  set_data_size(data_size);
+  set_data_hash(data_hash);
+  set_num_records(num_records);
+  set_decoded_data_size(decoded_data_size);
+  set_header_hash(computed_header_hash());
+}
+
 uint64_t ChunkHeader::computed_header_hash() const {
   return internal::Hash(absl::string_view(
       reinterpret_cast<const char*>(words_ + 1), size() - sizeof(uint64_t)));
 }
 
+bool Chunk::VerifyData() const {
+  return data.size() == header.data_size() &&
+         internal::Hash(data) == header.data_hash();
+}
+
 bool Chunk::WriteTo(Writer* dest) const {
   if (ABSL_PREDICT_FALSE(
           !dest->Write(absl::string_view(header.bytes(), header.size())))) {
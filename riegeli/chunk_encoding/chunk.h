@@ -33,6 +33,11 @@ class ChunkHeader {
   ChunkHeader(const Chain& data, uint64_t num_records,
               uint64_t decoded_data_size);
 
+  // Creates a header of chunk data with the given size and hash, e.g. of a
+  // chunk nested in another chunk.
+  ChunkHeader(uint64_t data_size, uint64_t data_hash, uint64_t num_records,
+              uint64_t decoded_data_size);
+
   ChunkHeader(const ChunkHeader& src) noexcept {
     std::memcpy(words_, src.words_, sizeof(words_));
   }
@@ -72,6 +77,9 @@ class ChunkHeader {
 struct Chunk {
   void Reset() { data.Clear(); }
 
+  // Returns true if data match header.data_size() and header.data_hash().
+  bool VerifyData() const;
+
   bool WriteTo(Writer* dest) const;
   bool ReadFrom(Reader* src);
 
@@ -16,72 +16,204 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <deque>
+#include <limits>
+#include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "google/protobuf/message_lite.h"
 #include "absl/base/optimization.h"
+#include "absl/memory/memory.h"
 #include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
 #include "riegeli/bytes/chain_backward_writer.h"
 #include "riegeli/bytes/chain_reader.h"
 #include "riegeli/bytes/limiting_reader.h"
 #include "riegeli/bytes/message_parse.h"
 #include "riegeli/bytes/reader_utils.h"
+#include "riegeli/bytes/zstd_dictionary.h"
+#include "riegeli/chunk_encoding/aliased_fields.h"
 #include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/decompressor.h"
+#include "riegeli/chunk_encoding/record_limits.h"
 #include "riegeli/chunk_encoding/simple_decoder.h"
 #include "riegeli/chunk_encoding/transpose_decoder.h"
 #include "riegeli/chunk_encoding/types.h"
 
 namespace riegeli {
 
+namespace {
+
+// Reads length bytes from src, replacing *dest with a single block.
+bool ReadFlat(Reader* src, size_t length, Chain* dest) {
+  dest->Clear();
+  if (length == 0) return true;
+  const absl::Span<char> buffer = dest->MakeAppendBuffer(length, length);
+  if (ABSL_PREDICT_FALSE(!src->Read(buffer.data(), length))) return false;
+  dest->RemoveSuffix(buffer.size() - length);
+  return true;
+}
+
+// Replaces *values with a single block with the same contents if it has
+// several blocks.
+void Flatten(Chain* values) {
+  if (values->blocks().size() <= 1) return;
+  Chain flat;
+  const absl::Span<char> buffer =
+      flat.MakeAppendBuffer(values->size(), values->size());
+  values->CopyTo(buffer.data());
+  flat.RemoveSuffix(buffer.size() - values->size());
+  *values = std::move(flat);
+}
+
+}  // namespace
+
 ChunkDecoder::ChunkDecoder(Options options)
     : Object(State::kOpen),
       skip_errors_(options.skip_errors_),
       field_filter_(std::move(options.field_filter_)),
+      zstd_dictionaries_(options.zstd_dictionaries_),
+      verify_data_on_failure_(options.verify_data_on_failure_),
+      verify_data_(options.verify_data_),
+      parallelism_(options.parallelism_),
+      streaming_block_size_(options.streaming_block_size_),
+      flat_values_(options.flat_values_),
+      bucket_cache_(options.bucket_cache_),
       values_reader_(Chain()) {}
 
 ChunkDecoder::ChunkDecoder(ChunkDecoder&& src) noexcept
     : Object(std::move(src)),
       skip_errors_(src.skip_errors_),
       field_filter_(std::move(src.field_filter_)),
+      zstd_dictionaries_(src.zstd_dictionaries_),
+      verify_data_on_failure_(src.verify_data_on_failure_),
+      verify_data_(src.verify_data_),
+      parallelism_(src.parallelism_),
+      streaming_block_size_(src.streaming_block_size_),
+      flat_values_(src.flat_values_),
+      bucket_cache_(src.bucket_cache_),
       limits_(std::move(src.limits_)),
       values_reader_(
           riegeli::exchange(src.values_reader_, ChainReader(Chain()))),
       index_(riegeli::exchange(src.index_, 0)),
+      values_begin_index_(riegeli::exchange(src.values_begin_index_, 0)),
+      values_end_index_(riegeli::exchange(src.values_end_index_, 0)),
+      values_begin_(riegeli::exchange(src.values_begin_, 0)),
       record_scratch_(riegeli::exchange(src.record_scratch_, std::string())),
-      skipped_records_(riegeli::exchange(src.skipped_records_, 0)) {}
+      records_scratch_(std::move(src.records_scratch_)),
+      skipped_records_(riegeli::exchange(src.skipped_records_, 0)),
+      record_continues_(riegeli::exchange(src.record_continues_, false)),
+      has_continuation_(riegeli::exchange(src.has_continuation_, false)),
+      continuation_last_(riegeli::exchange(src.continuation_last_, false)),
+      continuation_(riegeli::exchange(src.continuation_, Chain())),
+      transpose_decoder_(std::move(src.transpose_decoder_)),
+      blocked_decoder_(std::move(src.blocked_decoder_)),
+      streaming_chunk_(std::move(src.streaming_chunk_)),
+      streaming_src_(std::move(src.streaming_src_)),
+      streaming_decoder_(std::move(src.streaming_decoder_)),
+      streaming_index_(riegeli::exchange(src.streaming_index_, 0)) {}
 
 ChunkDecoder& ChunkDecoder::operator=(ChunkDecoder&& src) noexcept {
   Object::operator=(std::move(src));
   skip_errors_ = src.skip_errors_;
   field_filter_ = std::move(src.field_filter_);
+  zstd_dictionaries_ = src.zstd_dictionaries_;
+  verify_data_on_failure_ = src.verify_data_on_failure_;
+  verify_data_ = src.verify_data_;
+  parallelism_ = src.parallelism_;
+  streaming_block_size_ = src.streaming_block_size_;
+  flat_values_ = src.flat_values_;
+  bucket_cache_ = src.bucket_cache_;
   limits_ = std::move(src.limits_);
   values_reader_ = riegeli::exchange(src.values_reader_, ChainReader(Chain()));
   index_ = riegeli::exchange(src.index_, 0);
+  values_begin_index_ = riegeli::exchange(src.values_begin_index_, 0);
+  values_end_index_ = riegeli::exchange(src.values_end_index_, 0);
+  values_begin_ = riegeli::exchange(src.values_begin_, 0);
   record_scratch_ = riegeli::exchange(src.record_scratch_, std::string());
+  records_scratch_ = std::move(src.records_scratch_);
   skipped_records_ = riegeli::exchange(src.skipped_records_, 0);
+  record_continues_ = riegeli::exchange(src.record_continues_, false);
+  has_continuation_ = riegeli::exchange(src.has_continuation_, false);
+  continuation_last_ = riegeli::exchange(src.continuation_last_, false);
+  continuation_ = riegeli::exchange(src.continuation_, Chain());
+  transpose_decoder_ = std::move(src.transpose_decoder_);
+  blocked_decoder_ = std::move(src.blocked_decoder_);
+  // streaming_decoder_ must be assigned before streaming_src_ and
+  // streaming_chunk_ because it reads from them.
+  streaming_decoder_ = std::move(src.streaming_decoder_);
+  streaming_src_ = std::move(src.streaming_src_);
+  streaming_chunk_ = std::move(src.streaming_chunk_);
+  streaming_index_ = riegeli::exchange(src.streaming_index_, 0);
   return *this;
 }
 
 void ChunkDecoder::Done() {
-  limits_ = std::vector<size_t>();
+  limits_ = RecordLimits();
   values_reader_ = ChainReader();
   index_ = 0;
+  values_begin_index_ = 0;
+  values_end_index_ = 0;
+  values_begin_ = 0;
   record_scratch_ = std::string();
+  records_scratch_ = std::deque<std::string>();
+  record_continues_ = false;
+  has_continuation_ = false;
+  continuation_last_ = false;
+  continuation_ = Chain();
+  transpose_decoder_.reset();
+  blocked_decoder_.reset();
+  streaming_decoder_.reset();
+  streaming_src_.reset();
+  streaming_chunk_.reset();
+  streaming_index_ = 0;
 }
 
 void ChunkDecoder::Reset() {
   limits_.clear();
   values_reader_ = ChainReader(Chain());
   index_ = 0;
+  values_begin_index_ = 0;
+  values_end_index_ = 0;
+  values_begin_ = 0;
+  record_continues_ = false;
+  has_continuation_ = false;
+  continuation_last_ = false;
+  continuation_.Clear();
+  if (blocked_decoder_ != nullptr) blocked_decoder_->Close();
+  if (streaming_decoder_ != nullptr) streaming_decoder_->Close();
+  streaming_src_.reset();
+  streaming_chunk_.reset();
+  streaming_index_ = 0;
   MarkHealthy();
 }
 
+void ChunkDecoder::Reset(Options options) {
+  skip_errors_ = options.skip_errors_;
+  field_filter_ = std::move(options.field_filter_);
+  zstd_dictionaries_ = options.zstd_dictionaries_;
+  verify_data_on_failure_ = options.verify_data_on_failure_;
+  verify_data_ = options.verify_data_;
+  parallelism_ = options.parallelism_;
+  streaming_block_size_ = options.streaming_block_size_;
+  flat_values_ = options.flat_values_;
+  bucket_cache_ = options.bucket_cache_;
+  skipped_records_ = 0;
+  Reset();
+}
+
 bool ChunkDecoder::Reset(const Chunk& chunk) {
   Reset();
+  if (verify_data_ && ABSL_PREDICT_FALSE(!chunk.VerifyData())) {
+    return Fail("Corrupted Riegeli/records file");
+  }
   ChainReader data_reader(&chunk.data);
   uint8_t chunk_type_byte;
   const ChunkType chunk_type = ReadByte(&data_reader, &chunk_type_byte)
@@ -94,15 +226,44 @@ bool ChunkDecoder::Reset(const Chunk& chunk) {
                          record_scratch_.max_size())) {
     return Fail("Too large chunk");
   }
+  limits_.Reset(IntCast<size_t>(chunk.header.decoded_data_size()));
   limits_.reserve(IntCast<size_t>(chunk.header.num_records()));
+  if (chunk_type == ChunkType::kSimple && streaming_block_size_ > 0) {
+    // Record values are decompressed when their records are read.
+    streaming_chunk_ = absl::make_unique<Chunk>(chunk);
+    if (ABSL_PREDICT_FALSE(!StartStreaming())) {
+      limits_.clear();  // Ensure that index() == num_records().
+      streaming_chunk_.reset();
+      if (verify_data_on_failure_ && !chunk.VerifyData()) {
+        // The decoding failure is caused by corrupted data. Report the cause.
+        MarkHealthy();
+        return Fail("Corrupted Riegeli/records file");
+      }
+      return false;
+    }
+    return true;
+  }
   Chain values;
   if (ABSL_PREDICT_FALSE(
           !Parse(chunk_type, chunk.header, &data_reader, &values))) {
     limits_.clear();  // Ensure that index() == num_records().
+    if (verify_data_on_failure_ && !chunk.VerifyData()) {
+      // The decoding failure is caused by corrupted data. Report the cause.
+      MarkHealthy();
+      return Fail("Corrupted Riegeli/records file");
+    }
     return false;
   }
   RIEGELI_ASSERT_EQ(limits_.size(), chunk.header.num_records())
       << "Wrong number of record end positions";
+  if (chunk_type == ChunkType::kBlockedSimple) {
+    // Blocks of record values are decompressed when their records are read.
+    return true;
+  }
+  if (has_continuation_) {
+    // A further fragment of a record is read by ReadContinuation().
+    return true;
+  }
   RIEGELI_ASSERT_EQ(limits_.empty() ? size_t{0} : limits_.back(), values.size())
       << "Wrong last record end position";
   if (field_filter_.include_all()) {
@@ -113,6 +274,35 @@ bool ChunkDecoder::Reset(const Chunk& chunk) {
         << "Wrong decoded data size";
   }
   values_reader_ = ChainReader(std::move(values));
+  values_end_index_ = num_records();
+  return true;
+}
+
+void ChunkDecoder::Reset(RecordLimits limits, Chain values) {
+  RIEGELI_ASSERT_EQ(limits.empty() ? size_t{0} : limits.back(), values.size())
+      << "Failed precondition of ChunkDecoder::Reset(): "
+         "record end positions do not match concatenated record values";
+  Reset();
+  limits_ = std::move(limits);
+  values_reader_ = ChainReader(std::move(values));
+  values_end_index_ = num_records();
+}
+
+bool ChunkDecoder::GetDecoded(RecordLimits* limits, Chain* values) const {
+  if (values_begin_index_ != 0 || values_end_index_ != num_records()) {
+    return false;
+  }
+  *limits = limits_;
+  *values = *values_reader_.src();
+  return true;
+}
+
+bool ChunkDecoder::ReadContinuation(Chain* fragment, bool* last) {
+  if (!has_continuation_) return false;
+  *fragment = std::move(continuation_);
+  continuation_.Clear();
+  *last = continuation_last_;
+  has_continuation_ = false;
   return true;
 }
 
@@ -121,17 +311,33 @@ bool ChunkDecoder::Parse(ChunkType chunk_type, const ChunkHeader& header,
   switch (chunk_type) {
     case ChunkType::kPadding:
       return true;
+    case ChunkType::kIndex:
+      // An index chunk contains no records. It is interpreted by ChunkIndex.
+      if (ABSL_PREDICT_FALSE(header.num_records() != 0 ||
+                             header.decoded_data_size() != 0)) {
+        return Fail("Invalid index chunk");
+      }
+      return true;
+    case ChunkType::kSummary:
+      // A summary chunk contains no records. It is interpreted by FileSummary.
+      if (ABSL_PREDICT_FALSE(header.num_records() != 0 ||
+                             header.decoded_data_size() != 0)) {
+        return Fail("Invalid summary chunk");
+      }
+      return true;
     case ChunkType::kSimple: {
       SimpleDecoder simple_decoder;
-      if (ABSL_PREDICT_FALSE(!simple_decoder.Reset(src, header.num_records(),
-                                                   header.decoded_data_size(),
-                                                   &limits_))) {
+      if (ABSL_PREDICT_FALSE(!simple_decoder.Reset(
+              src, header.num_records(), header.decoded_data_size(),
+              zstd_dictionaries_, &limits_))) {
         return Fail("Invalid simple chunk", simple_decoder);
       }
+      Reader* const values = simple_decoder.reader();
+      const size_t size = IntCast<size_t>(header.decoded_data_size());
       dest->Clear();
-      if (ABSL_PREDICT_FALSE(!simple_decoder.reader()->Read(
-              dest, IntCast<size_t>(header.decoded_data_size())))) {
-        return Fail("Reading record values failed", *simple_decoder.reader());
+      if (ABSL_PREDICT_FALSE(!(flat_values_ ? ReadFlat(values, size, dest)
+                                            : values->Read(dest, size)))) {
+        return Fail("Reading record values failed", *values);
       }
       if (ABSL_PREDICT_FALSE(!simple_decoder.VerifyEndAndClose())) {
         return Fail(simple_decoder);
@@ -141,61 +347,569 @@ bool ChunkDecoder::Parse(ChunkType chunk_type, const ChunkHeader& header,
       }
       return true;
     }
+    case ChunkType::kBlockedSimple: {
+      if (blocked_decoder_ == nullptr) {
+        blocked_decoder_ = absl::make_unique<SimpleDecoder>();
+      }
+      if (ABSL_PREDICT_FALSE(!blocked_decoder_->ResetBlocked(
+              src, header.num_records(), header.decoded_data_size(),
+              zstd_dictionaries_, &limits_))) {
+        return Fail("Invalid blocked simple chunk", *blocked_decoder_);
+      }
+      if (ABSL_PREDICT_FALSE(!src->VerifyEndAndClose())) {
+        return Fail("Invalid blocked simple chunk", *src);
+      }
+      return true;
+    }
     case ChunkType::kTransposed: {
-      TransposeDecoder transpose_decoder;
+      // The TransposeDecoder is kept across chunks to reuse their state
+      // machine if it does not change.
+      if (transpose_decoder_ == nullptr) {
+        transpose_decoder_ = absl::make_unique<TransposeDecoder>();
+      }
       dest->Clear();
       ChainBackwardWriter dest_writer(
           dest, ChainBackwardWriter::Options().set_size_hint(
                     field_filter_.include_all() ? header.decoded_data_size()
                                                 : uint64_t{0}));
-      const bool ok = transpose_decoder.Reset(
+      const bool ok = transpose_decoder_->Reset(
           src, header.num_records(), header.decoded_data_size(), field_filter_,
-          &dest_writer, &limits_);
+          zstd_dictionaries_, parallelism_, &dest_writer, &limits_,
+          bucket_cache_, header.data_hash());
       if (ABSL_PREDICT_FALSE(!dest_writer.Close())) return Fail(dest_writer);
       if (ABSL_PREDICT_FALSE(!ok)) {
-        return Fail("Invalid transposed chunk", transpose_decoder);
+        return Fail("Invalid transposed chunk", *transpose_decoder_);
       }
       if (ABSL_PREDICT_FALSE(!src->VerifyEndAndClose())) {
         return Fail("Invalid transposed chunk", *src);
       }
+      if (flat_values_) Flatten(dest);
       return true;
     }
+    case ChunkType::kDeduplicated:
+      return ParseDeduplicated(header, src, dest);
+    case ChunkType::kDelta:
+      return ParseDelta(header, src, dest);
+    case ChunkType::kFragment:
+      return ParseFragment(header, src, dest);
   }
   return Fail(
       absl::StrCat("Unknown chunk type: ", static_cast<unsigned>(chunk_type)));
 }
 
-bool ChunkDecoder::ReadRecord(google::protobuf::MessageLite* record) {
+bool ChunkDecoder::ParseFragment(const ChunkHeader& header, ChainReader* src,
+                                 Chain* dest) {
+  uint8_t flags;
+  if (ABSL_PREDICT_FALSE(!ReadByte(src, &flags))) {
+    return Fail("Reading fragment flags failed", *src);
+  }
+  if (ABSL_PREDICT_FALSE(
+          (flags & ~(internal::kFirstFragment | internal::kLastFragment)) !=
+          0)) {
+    return Fail(absl::StrCat("Invalid fragment flags: ",
+                             static_cast<unsigned>(flags)));
+  }
+  const bool first = (flags & internal::kFirstFragment) != 0;
+  const bool last = (flags & internal::kLastFragment) != 0;
+  if (ABSL_PREDICT_FALSE(header.num_records() != (first ? 1u : 0u))) {
+    return Fail("Invalid fragment chunk");
+  }
+  uint8_t compression_type_byte;
+  if (ABSL_PREDICT_FALSE(!ReadByte(src, &compression_type_byte))) {
+    return Fail("Reading compression type failed", *src);
+  }
+  internal::Decompressor decompressor(
+      src, static_cast<CompressionType>(compression_type_byte),
+      zstd_dictionaries_);
+  if (ABSL_PREDICT_FALSE(!decompressor.healthy())) return Fail(decompressor);
+  dest->Clear();
+  // Data are read in pieces of bounded size, so that a corrupted
+  // decoded_data_size does not allocate memory for data which are not present.
+  Position remaining = header.decoded_data_size();
+  while (remaining > 0) {
+    const size_t length = IntCast<size_t>(
+        UnsignedMin(remaining, Chain::Options::kDefaultMaxBlockSize()));
+    if (ABSL_PREDICT_FALSE(!decompressor.reader()->Read(dest, length))) {
+      return Fail("Reading fragment failed", *decompressor.reader());
+    }
+    remaining -= length;
+  }
+  if (ABSL_PREDICT_FALSE(!decompressor.VerifyEndAndClose())) {
+    return Fail(decompressor);
+  }
+  if (ABSL_PREDICT_FALSE(!src->VerifyEndAndClose())) {
+    return Fail("Invalid fragment chunk", *src);
+  }
+  if (first) {
+    limits_.push_back(dest->size());
+    record_continues_ = !last;
+    if (flat_values_) Flatten(dest);
+  } else {
+    continuation_ = std::move(*dest);
+    dest->Clear();
+    has_continuation_ = true;
+    continuation_last_ = last;
+  }
+  return true;
+}
+
+bool ChunkDecoder::ParseDeduplicated(const ChunkHeader& header,
+                                     ChainReader* src, Chain* dest) {
+  uint8_t compression_type_byte;
+  if (ABSL_PREDICT_FALSE(!ReadByte(src, &compression_type_byte))) {
+    return Fail("Reading compression type failed", *src);
+  }
+  const CompressionType compression_type =
+      static_cast<CompressionType>(compression_type_byte);
+  uint64_t references_size;
+  if (ABSL_PREDICT_FALSE(!ReadVarint64(src, &references_size))) {
+    return Fail("Reading size of references failed", *src);
+  }
+  if (ABSL_PREDICT_FALSE(references_size >
+                         std::numeric_limits<Position>::max() - src->pos())) {
+    return Fail("Size of references too large");
+  }
+  std::vector<uint64_t> references;
+  references.reserve(IntCast<size_t>(header.num_records()));
+  {
+    LimitingReader compressed_references_reader(src,
+                                                src->pos() + references_size);
+    internal::Decompressor references_decompressor(
+        &compressed_references_reader, compression_type, zstd_dictionaries_);
+    if (ABSL_PREDICT_FALSE(!references_decompressor.healthy())) {
+      compressed_references_reader.Close();
+      return Fail(references_decompressor);
+    }
+    while (references.size() != header.num_records()) {
+      uint64_t reference;
+      if (ABSL_PREDICT_FALSE(
+              !ReadVarint64(references_decompressor.reader(), &reference))) {
+        compressed_references_reader.Close();
+        return Fail("Reading reference failed",
+                    *references_decompressor.reader());
+      }
+      references.push_back(reference);
+    }
+    if (ABSL_PREDICT_FALSE(!references_decompressor.VerifyEndAndClose())) {
+      compressed_references_reader.Close();
+      return Fail(references_decompressor);
+    }
+    if (ABSL_PREDICT_FALSE(!compressed_references_reader.VerifyEndAndClose())) {
+      return Fail(compressed_references_reader);
+    }
+  }
+  uint64_t num_distinct_records;
+  if (ABSL_PREDICT_FALSE(!ReadVarint64(src, &num_distinct_records))) {
+    return Fail("Reading number of distinct records failed", *src);
+  }
+  uint64_t distinct_data_size;
+  if (ABSL_PREDICT_FALSE(!ReadVarint64(src, &distinct_data_size))) {
+    return Fail("Reading decoded size of distinct records failed", *src);
+  }
+  uint8_t base_chunk_type_byte;
+  if (ABSL_PREDICT_FALSE(!ReadByte(src, &base_chunk_type_byte))) {
+    return Fail("Reading chunk type of distinct records failed", *src);
+  }
+  const ChunkType base_chunk_type =
+      static_cast<ChunkType>(base_chunk_type_byte);
+  if (ABSL_PREDICT_FALSE(base_chunk_type != ChunkType::kSimple &&
+                         base_chunk_type != ChunkType::kTransposed)) {
+    return Fail(absl::StrCat("Invalid chunk type of distinct records: ",
+                             static_cast<unsigned>(base_chunk_type)));
+  }
+  if (ABSL_PREDICT_FALSE(num_distinct_records > header.num_records() ||
+                         distinct_data_size > header.decoded_data_size())) {
+    return Fail("Invalid deduplicated chunk");
+  }
+  // The hash of the whole chunk identifies buckets of distinct records in
+  // bucket_cache_.
+  const ChunkHeader base_header(header.data_size(), header.data_hash(),
+                                num_distinct_records, distinct_data_size);
+  Chain distinct_values;
+  if (ABSL_PREDICT_FALSE(!Parse(base_chunk_type, base_header, src,
+                                &distinct_values))) {
+    return false;
+  }
+  const RecordLimits distinct_limits = std::move(limits_);
+  ChainReader distinct_values_reader(&distinct_values);
+  dest->Clear();
+  limits_.Reset(IntCast<size_t>(header.decoded_data_size()));
+  limits_.reserve(references.size());
+  for (const uint64_t reference : references) {
+    if (ABSL_PREDICT_FALSE(reference >= distinct_limits.size())) {
+      return Fail("Reference to distinct record out of range");
+    }
+    const size_t index = IntCast<size_t>(reference);
+    const size_t begin = index == 0 ? size_t{0} : distinct_limits[index - 1];
+    if (ABSL_PREDICT_FALSE(
+            !distinct_values_reader.Seek(begin) ||
+            !distinct_values_reader.Read(dest,
+                                         distinct_limits[index] - begin))) {
+      return Fail("Reading distinct record failed", distinct_values_reader);
+    }
+    limits_.push_back(dest->size());
+  }
+  if (ABSL_PREDICT_FALSE(field_filter_.include_all() &&
+                         dest->size() != header.decoded_data_size())) {
+    return Fail("Decoded data size does not match distinct records");
+  }
+  if (flat_values_) Flatten(dest);
+  return true;
+}
+
+bool ChunkDecoder::ParseDelta(const ChunkHeader& header, ChainReader* src,
+                              Chain* dest) {
+  uint8_t compression_type_byte;
+  if (ABSL_PREDICT_FALSE(!ReadByte(src, &compression_type_byte))) {
+    return Fail("Reading compression type failed", *src);
+  }
+  const CompressionType compression_type =
+      static_cast<CompressionType>(compression_type_byte);
+  uint64_t patches_size;
+  if (ABSL_PREDICT_FALSE(!ReadVarint64(src, &patches_size))) {
+    return Fail("Reading size of patches failed", *src);
+  }
+  if (ABSL_PREDICT_FALSE(patches_size >
+                         std::numeric_limits<Position>::max() - src->pos())) {
+    return Fail("Size of patches too large");
+  }
+  // For each record: 0, or 1 + the number of runs followed by the record size
+  // and the runs.
+  std::vector<uint64_t> patches;
+  {
+    LimitingReader compressed_patches_reader(src, src->pos() + patches_size);
+    internal::Decompressor patches_decompressor(
+        &compressed_patches_reader, compression_type, zstd_dictionaries_);
+    if (ABSL_PREDICT_FALSE(!patches_decompressor.healthy())) {
+      compressed_patches_reader.Close();
+      return Fail(patches_decompressor);
+    }
+    Reader* const patches_reader = patches_decompressor.reader();
+    for (uint64_t i = 0; i < header.num_records(); ++i) {
+      uint64_t marker;
+      if (ABSL_PREDICT_FALSE(!ReadVarint64(patches_reader, &marker))) {
+        compressed_patches_reader.Close();
+        return Fail("Reading patch failed", *patches_reader);
+      }
+      patches.push_back(marker);
+      if (marker == 0) continue;
+      if (ABSL_PREDICT_FALSE(marker - 1 >
+                             std::numeric_limits<uint64_t>::max() / 2)) {
+        compressed_patches_reader.Close();
+        return Fail("Invalid patch");
+      }
+      // The record size, then a pair of varints for each run.
+      for (uint64_t j = 0; j < 1 + (marker - 1) * 2; ++j) {
+        uint64_t value;
+        if (ABSL_PREDICT_FALSE(!ReadVarint64(patches_reader, &value))) {
+          compressed_patches_reader.Close();
+          return Fail("Reading patch failed", *patches_reader);
+        }
+        patches.push_back(value);
+      }
+    }
+    if (ABSL_PREDICT_FALSE(!patches_decompressor.VerifyEndAndClose())) {
+      compressed_patches_reader.Close();
+      return Fail(patches_decompressor);
+    }
+    if (ABSL_PREDICT_FALSE(!compressed_patches_reader.VerifyEndAndClose())) {
+      return Fail(compressed_patches_reader);
+    }
+  }
+  uint64_t base_data_size;
+  if (ABSL_PREDICT_FALSE(!ReadVarint64(src, &base_data_size))) {
+    return Fail("Reading decoded size of base records failed", *src);
+  }
+  uint8_t base_chunk_type_byte;
+  if (ABSL_PREDICT_FALSE(!ReadByte(src, &base_chunk_type_byte))) {
+    return Fail("Reading chunk type of base records failed", *src);
+  }
+  const ChunkType base_chunk_type =
+      static_cast<ChunkType>(base_chunk_type_byte);
+  if (ABSL_PREDICT_FALSE(base_chunk_type != ChunkType::kSimple &&
+                         base_chunk_type != ChunkType::kTransposed)) {
+    return Fail(absl::StrCat("Invalid chunk type of base records: ",
+                             static_cast<unsigned>(base_chunk_type)));
+  }
+  if (ABSL_PREDICT_FALSE(base_data_size > header.decoded_data_size())) {
+    return Fail("Invalid delta chunk");
+  }
+  // Base records hold fragments of records, which can not be filtered by
+  // fields. Records are returned with all fields, which field_filter_ allows.
+  const ChunkHeader base_header(header.data_size(), header.data_hash(),
+                                header.num_records(), base_data_size);
+  Chain base_values;
+  FieldFilter field_filter = FieldFilter::All();
+  std::swap(field_filter_, field_filter);
+  const bool ok = Parse(base_chunk_type, base_header, src, &base_values);
+  std::swap(field_filter_, field_filter);
+  if (ABSL_PREDICT_FALSE(!ok)) return false;
+  const RecordLimits base_limits = std::move(limits_);
+  if (ABSL_PREDICT_FALSE(base_limits.size() != header.num_records())) {
+    return Fail("Invalid delta chunk");
+  }
+  ChainReader base_values_reader(&base_values);
+  dest->Clear();
+  limits_.Reset(IntCast<size_t>(header.decoded_data_size()));
+  limits_.reserve(base_limits.size());
+  std::string previous;
+  std::string record;
+  std::vector<uint64_t>::const_iterator patch = patches.cbegin();
+  for (size_t index = 0; index < base_limits.size(); ++index) {
+    const size_t base_size =
+        base_limits[index] - (index == 0 ? size_t{0} : base_limits[index - 1]);
+    record.clear();
+    const uint64_t marker = *patch++;
+    if (marker == 0) {
+      if (ABSL_PREDICT_FALSE(!base_values_reader.Read(&record, base_size))) {
+        return Fail("Reading base record failed", base_values_reader);
+      }
+    } else {
+      const uint64_t size = *patch++;
+      if (ABSL_PREDICT_FALSE(size >
+                             header.decoded_data_size() - dest->size())) {
+        return Fail("Decoded data size does not match patched records");
+      }
+      size_t literal_size = 0;
+      for (uint64_t run = 0; run < marker - 1; ++run) {
+        const uint64_t copy = *patch++;
+        const uint64_t literal = *patch++;
+        // Bytes are copied from the same position in the previous record, so
+        // they must not extend past its end.
+        if (ABSL_PREDICT_FALSE(copy > previous.size() -
+                                          UnsignedMin(record.size(),
+                                                      previous.size()))) {
+          return Fail("Invalid delta run");
+        }
+        if (ABSL_PREDICT_FALSE(literal > base_size - literal_size ||
+                               copy + literal > size - record.size())) {
+          return Fail("Invalid delta run");
+        }
+        if (copy > 0) {
+          record.append(previous, record.size(), IntCast<size_t>(copy));
+        }
+        if (ABSL_PREDICT_FALSE(!base_values_reader.Read(
+                &record, IntCast<size_t>(literal)))) {
+          return Fail("Reading base record failed", base_values_reader);
+        }
+        literal_size += IntCast<size_t>(literal);
+      }
+      // The tail is copied from the previous record as far as it extends, and
+      // the rest is taken from the remaining literal bytes.
+      const size_t tail = IntCast<size_t>(size) - record.size();
+      const size_t tail_copy = UnsignedMin(
+          tail, previous.size() - UnsignedMin(record.size(), previous.size()));
+      if (ABSL_PREDICT_FALSE(tail - tail_copy != base_size - literal_size)) {
+        return Fail("Invalid patch");
+      }
+      if (tail_copy > 0) record.append(previous, record.size(), tail_copy);
+      if (ABSL_PREDICT_FALSE(
+              !base_values_reader.Read(&record, tail - tail_copy))) {
+        return Fail("Reading base record failed", base_values_reader);
+      }
+    }
+    dest->Append(record, IntCast<size_t>(header.decoded_data_size()));
+    limits_.push_back(dest->size());
+    std::swap(previous, record);
+  }
+  if (ABSL_PREDICT_FALSE(dest->size() != header.decoded_data_size())) {
+    return Fail("Decoded data size does not match patched records");
+  }
+  if (flat_values_) Flatten(dest);
+  return true;
+}
+
+bool ChunkDecoder::StartStreaming() {
+  RIEGELI_ASSERT(streaming_chunk_ != nullptr)
+      << "Failed precondition of ChunkDecoder::StartStreaming(): "
+         "no chunk being decompressed incrementally";
+  if (streaming_decoder_ == nullptr) {
+    streaming_decoder_ = absl::make_unique<SimpleDecoder>();
+  }
+  streaming_src_ = absl::make_unique<ChainReader>(&streaming_chunk_->data);
+  streaming_index_ = 0;
+  // Skip the chunk type.
+  if (!streaming_src_->Skip(1)) {
+    RIEGELI_ASSERT_UNREACHABLE()
+        << "Failed skipping chunk type: " << streaming_src_->message();
+  }
+  if (ABSL_PREDICT_FALSE(!streaming_decoder_->Reset(
+          streaming_src_.get(), streaming_chunk_->header.num_records(),
+          streaming_chunk_->header.decoded_data_size(), zstd_dictionaries_,
+          &limits_))) {
+    return Fail("Invalid simple chunk", *streaming_decoder_);
+  }
+  return true;
+}
+
+inline bool ChunkDecoder::ReadStreamingBlock() {
+  RIEGELI_ASSERT(streaming_decoder_ != nullptr)
+      << "Failed invariant of ChunkDecoder: "
+         "no decoder of a chunk being decompressed incrementally";
+  if (index_ < streaming_index_ && ABSL_PREDICT_FALSE(!StartStreaming())) {
+    index_ = num_records();
+    DropBlock();
+    return false;
+  }
+  const size_t begin_pos =
+      index_ == 0 ? size_t{0} : limits_[IntCast<size_t>(index_ - 1)];
+  const size_t streaming_pos =
+      streaming_index_ == 0 ? size_t{0}
+                            : limits_[IntCast<size_t>(streaming_index_ - 1)];
+  uint64_t end_index = index_ + 1;
+  while (end_index < num_records() &&
+         limits_[IntCast<size_t>(end_index)] - begin_pos <=
+             streaming_block_size_) {
+    ++end_index;
+  }
+  const size_t end_pos = limits_[IntCast<size_t>(end_index - 1)];
+  Reader* const values = streaming_decoder_->reader();
+  Chain block;
+  if (ABSL_PREDICT_FALSE(
+          !values->Skip(begin_pos - streaming_pos) ||
+          !(flat_values_ ? ReadFlat(values, end_pos - begin_pos, &block)
+                         : values->Read(&block, end_pos - begin_pos)))) {
+    return StreamingFailed(values->healthy() ? nullptr : values);
+  }
+  if (end_index == num_records()) {
+    if (ABSL_PREDICT_FALSE(!streaming_decoder_->VerifyEndAndClose())) {
+      return StreamingFailed(streaming_decoder_.get());
+    }
+    if (ABSL_PREDICT_FALSE(!streaming_src_->VerifyEndAndClose())) {
+      return StreamingFailed(streaming_src_.get());
+    }
+  }
+  streaming_index_ = end_index;
+  values_begin_index_ = index_;
+  values_end_index_ = end_index;
+  values_begin_ = begin_pos;
+  values_reader_ = ChainReader(std::move(block));
+  return true;
+}
+
+bool ChunkDecoder::StreamingFailed(const Object* src) {
+  const uint64_t num_skipped = num_records() - index_;
+  index_ = num_records();
+  DropBlock();
+  if (!skip_errors_) {
+    if (src == nullptr) {
+      return Fail("Invalid simple chunk: record values end prematurely");
+    }
+    return Fail("Invalid simple chunk", *src);
+  }
+  skipped_records_ = SaturatingAdd(skipped_records_, num_skipped);
+  return false;
+}
+
+bool ChunkDecoder::ReadBlock() {
+  if (index_ == num_records()) return false;
+  if (streaming_chunk_ != nullptr) return ReadStreamingBlock();
+  RIEGELI_ASSERT(blocked_decoder_ != nullptr && blocked_decoder_->healthy())
+      << "Failed invariant of ChunkDecoder: "
+         "record values missing outside of a blocked simple chunk";
+  uint64_t begin_index, end_index;
+  const size_t block =
+      blocked_decoder_->FindBlock(index_, &begin_index, &end_index);
+  Chain values;
+  if (ABSL_PREDICT_FALSE(!blocked_decoder_->ReadBlock(block, &values))) {
+    const uint64_t num_skipped = num_records() - index_;
+    index_ = num_records();
+    DropBlock();
+    if (!skip_errors_) {
+      return Fail("Invalid blocked simple chunk", *blocked_decoder_);
+    }
+    skipped_records_ = SaturatingAdd(skipped_records_, num_skipped);
+    return false;
+  }
+  if (flat_values_) Flatten(&values);
+  values_begin_index_ = begin_index;
+  values_end_index_ = end_index;
+  values_begin_ =
+      begin_index == 0 ? size_t{0} : limits_[IntCast<size_t>(begin_index - 1)];
+  values_reader_ = ChainReader(std::move(values));
+  const size_t start =
+      index_ == 0 ? size_t{0} : limits_[IntCast<size_t>(index_ - 1)];
+  if (!values_reader_.Seek(start - values_begin_)) {
+    RIEGELI_ASSERT_UNREACHABLE()
+        << "Failed seeking values reader: " << values_reader_.message();
+  }
+  return true;
+}
+
+void ChunkDecoder::DropBlock() {
+  values_reader_ = ChainReader(Chain());
+  values_begin_index_ = index_;
+  values_end_index_ = index_;
+  values_begin_ =
+      index_ == 0 ? size_t{0} : limits_[IntCast<size_t>(index_ - 1)];
+}
+
+inline bool ChunkDecoder::ParseRecord(google::protobuf::MessageLite* record,
+                                      AliasedFields* aliased_fields,
+                                      size_t limit) {
+  const size_t length = limit - IntCast<size_t>(values_reader_.pos());
+  if (aliased_fields != nullptr) {
+    // Read the record as a Chain sharing memory with record values, so that
+    // aliased values share it too.
+    Chain value;
+    if (!values_reader_.Read(&value, length)) {
+      RIEGELI_ASSERT_UNREACHABLE()
+          << "Failed reading record from values reader: "
+          << values_reader_.message();
+    }
+    return ParsePartialWithAliasedFields(record, value, aliased_fields);
+  }
+  if (ABSL_PREDICT_TRUE(values_reader_.available() >= length)) {
+    // The record is contiguous in the current block of values, which is the
+    // common case because values are decoded into large blocks. Parse it in
+    // place, avoiding a LimitingReader and a ZeroCopyInputStream adapter.
+    const char* const cursor = values_reader_.cursor();
+    values_reader_.set_cursor(cursor + length);
+    return ParsePartialFromStringView(record,
+                                      absl::string_view(cursor, length));
+  }
+  LimitingReader message_reader(&values_reader_, limit);
+  if (ABSL_PREDICT_TRUE(ParsePartialFromReader(record, &message_reader))) {
+    RIEGELI_ASSERT_EQ(message_reader.pos(), limit)
+        << "Record was not read up to its end";
+    if (!message_reader.Close()) {
+      RIEGELI_ASSERT_UNREACHABLE()
+          << "Closing message reader failed: " << message_reader.message();
+    }
+    return true;
+  }
+  message_reader.Close();
+  if (!values_reader_.Seek(limit)) {
+    RIEGELI_ASSERT_UNREACHABLE()
+        << "Seeking record values failed: " << values_reader_.message();
+  }
+  return false;
+}
+
+bool ChunkDecoder::ReadRecordAliasing(google::protobuf::MessageLite* record,
+                                      AliasedFields* aliased_fields) {
   for (;;) {
-    if (ABSL_PREDICT_FALSE(index_ == num_records())) return false;
+    if (ABSL_PREDICT_FALSE(index_ == values_end_index_)) {
+      if (!ReadBlock()) return false;
+    }
     const size_t start = IntCast<size_t>(values_reader_.pos());
-    const size_t limit = limits_[IntCast<size_t>(index_++)];
+    const size_t limit = limits_[IntCast<size_t>(index_++)] - values_begin_;
     RIEGELI_ASSERT_LE(start, limit)
         << "Failed invariant of ChunkDecoder: record end positions not sorted";
-    LimitingReader message_reader(&values_reader_, limit);
-    if (ABSL_PREDICT_TRUE(ParsePartialFromReader(record, &message_reader))) {
-      RIEGELI_ASSERT_EQ(message_reader.pos(), limit)
-          << "Record was not read up to its end";
-      if (!message_reader.Close()) {
-        RIEGELI_ASSERT_UNREACHABLE()
-            << "Closing message reader failed: " << message_reader.message();
-      }
+    if (ABSL_PREDICT_TRUE(ParseRecord(record, aliased_fields, limit))) {
       if (ABSL_PREDICT_TRUE(record->IsInitialized())) return true;
       if (!skip_errors_) {
         index_ = num_records();
+        DropBlock();
         return Fail(absl::StrCat("Failed to parse message of type ",
                                  record->GetTypeName(),
                                  " because it is missing required fields: ",
                                  record->InitializationErrorString()));
       }
     } else {
-      message_reader.Close();
-      if (!values_reader_.Seek(limit)) {
-        RIEGELI_ASSERT_UNREACHABLE()
-            << "Seeking record values failed: " << values_reader_.message();
-      }
       if (!skip_errors_) {
         index_ = num_records();
+        DropBlock();
         return Fail(absl::StrCat("Failed to parse message of type ",
                                  record->GetTypeName()));
       }
@@ -204,4 +918,64 @@ bool ChunkDecoder::ReadRecord(google::protobuf::MessageLite* record) {
   }
 }
 
+size_t ChunkDecoder::ReadRecords(size_t max_num_records,
+                                 std::vector<absl::string_view>* records) {
+  records->clear();
+  records_scratch_.clear();
+  if (index_ == values_end_index_) {
+    if (!ReadBlock()) return 0;
+  }
+  const size_t num_records_read = IntCast<size_t>(
+      UnsignedMin(uint64_t{max_num_records}, values_end_index_ - index_));
+  records->reserve(num_records_read);
+  for (size_t i = 0; i < num_records_read; ++i) {
+    const size_t start = IntCast<size_t>(values_reader_.pos());
+    const size_t limit = limits_[IntCast<size_t>(index_++)] - values_begin_;
+    RIEGELI_ASSERT_LE(start, limit)
+        << "Failed invariant of ChunkDecoder: record end positions not sorted";
+    const size_t length = limit - start;
+    if (ABSL_PREDICT_TRUE(values_reader_.available() >= length)) {
+      records->emplace_back(values_reader_.cursor(), length);
+      values_reader_.set_cursor(values_reader_.cursor() + length);
+      continue;
+    }
+    records_scratch_.emplace_back();
+    if (!values_reader_.Read(&records_scratch_.back(), length)) {
+      RIEGELI_ASSERT_UNREACHABLE()
+          << "Failed reading record from values reader: "
+          << values_reader_.message();
+    }
+    records->emplace_back(records_scratch_.back());
+  }
+  return num_records_read;
+}
+
+void ChunkDecoder::AddUniqueTo(MemoryEstimator* memory_estimator) const {
+  memory_estimator->AddMemory(sizeof(ChunkDecoder) - sizeof(ChainReader) -
+                              sizeof(Chain));
+  continuation_.AddUniqueTo(memory_estimator);
+  limits_.AddUniqueTo(memory_estimator);
+  values_reader_.AddUniqueTo(memory_estimator);
+  memory_estimator->AddMemory(record_scratch_.capacity());
+  for (const std::string& record : records_scratch_) {
+    memory_estimator->AddMemory(sizeof(std::string) + record.capacity());
+  }
+  if (transpose_decoder_ != nullptr) {
+    transpose_decoder_->AddUniqueTo(memory_estimator);
+  }
+  if (blocked_decoder_ != nullptr) {
+    blocked_decoder_->AddUniqueTo(memory_estimator);
+  }
+  if (streaming_chunk_ != nullptr) {
+    memory_estimator->AddMemory(sizeof(Chunk));
+    streaming_chunk_->data.AddUniqueTo(memory_estimator);
+  }
+  if (streaming_src_ != nullptr) {
+    memory_estimator->AddMemory(sizeof(ChainReader));
+  }
+  if (streaming_decoder_ != nullptr) {
+    streaming_decoder_->AddUniqueTo(memory_estimator);
+  }
+}
+
 }  // namespace riegeli
@@ -17,17 +17,24 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <deque>
+#include <memory>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "absl/base/attributes.h"
 #include "absl/base/optimization.h"
 #include "absl/strings/string_view.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
 #include "riegeli/bytes/chain_reader.h"
 #include "riegeli/chunk_encoding/field_filter.h"
+#include "riegeli/chunk_encoding/record_limits.h"
+#include "riegeli/chunk_encoding/simple_decoder.h"
+#include "riegeli/chunk_encoding/transpose_decoder.h"
 #include "riegeli/chunk_encoding/types.h"
 
 // Forward declarations to reduce the amount of includes going into public
@@ -42,8 +49,11 @@ namespace riegeli {
 
 // Forward declarations to reduce the amount of includes going into public
 // record_reader.h.
+class AliasedFields;
+class BucketCache;
 class Chunk;
 class ChunkHeader;
+class ZstdDictionaryRegistry;
 
 class ChunkDecoder : public Object {
  public:
@@ -79,11 +89,142 @@ class ChunkDecoder : public Object {
       return std::move(set_field_filter(std::move(field_filter)));
     }
 
+    // Specifies Zstd dictionaries used to decompress chunks compressed with a
+    // dictionary. The registry must be kept alive until the ChunkDecoder is
+    // closed.
+    //
+    // If nullptr, decompressing such chunks fails.
+    //
+    // Default: nullptr
+    Options& set_zstd_dictionaries(
+        const ZstdDictionaryRegistry* zstd_dictionaries) & {
+      zstd_dictionaries_ = zstd_dictionaries;
+      return *this;
+    }
+    Options&& set_zstd_dictionaries(
+        const ZstdDictionaryRegistry* zstd_dictionaries) && {
+      return std::move(set_zstd_dictionaries(zstd_dictionaries));
+    }
+
+    // If true, when Reset(Chunk) fails to decode the chunk, the hash of chunk
+    // data is verified, and a mismatch is reported as corruption instead of
+    // the decoding failure.
+    //
+    // This is meant for chunks read without verifying data hashes, see
+    // ChunkReader::Options::set_verify_data_hashes().
+    //
+    // Default: false
+    Options& set_verify_data_on_failure(bool verify_data_on_failure) & {
+      verify_data_on_failure_ = verify_data_on_failure;
+      return *this;
+    }
+    Options&& set_verify_data_on_failure(bool verify_data_on_failure) && {
+      return std::move(set_verify_data_on_failure(verify_data_on_failure));
+    }
+
+    // If true, Reset(Chunk) verifies the hash of chunk data before decoding
+    // the chunk, and reports a mismatch as corruption.
+    //
+    // This is meant for chunks read without verifying data hashes in order to
+    // verify them in the thread decoding the chunk, see
+    // ChunkReader::ReadChunkWithoutVerifying().
+    //
+    // Default: false
+    Options& set_verify_data(bool verify_data) & {
+      verify_data_ = verify_data;
+      return *this;
+    }
+    Options&& set_verify_data(bool verify_data) && {
+      return std::move(set_verify_data(verify_data));
+    }
+
+    // Sets the maximum number of additional threads decompressing buckets of
+    // a single transposed chunk in parallel. This reduces latency of decoding
+    // a large chunk if the field filter includes all fields.
+    //
+    // If parallelism is 0, buckets are decompressed by the thread decoding the
+    // chunk.
+    //
+    // Default: 0
+    Options& set_parallelism(int parallelism) & {
+      RIEGELI_ASSERT_GE(parallelism, 0)
+          << "Failed precondition of ChunkDecoder::Options::set_parallelism(): "
+             "negative parallelism";
+      parallelism_ = parallelism;
+      return *this;
+    }
+    Options&& set_parallelism(int parallelism) && {
+      return std::move(set_parallelism(parallelism));
+    }
+
+    // If positive, record values of a simple chunk (written with
+    // RecordWriter::Options::set_transpose(false)) are decompressed
+    // incrementally, about this many bytes at a time, as records are read.
+    // The first record is then available before the whole chunk is
+    // decompressed, and memory usage is bounded by the compressed chunk and
+    // record sizes instead of the decoded chunk.
+    //
+    // Seeking backwards within such a chunk decompresses it again from the
+    // beginning.
+    //
+    // If 0, the whole chunk is decompressed by Reset(Chunk).
+    //
+    // Default: 0
+    Options& set_streaming_block_size(size_t streaming_block_size) & {
+      streaming_block_size_ = streaming_block_size;
+      return *this;
+    }
+    Options&& set_streaming_block_size(size_t streaming_block_size) && {
+      return std::move(set_streaming_block_size(streaming_block_size));
+    }
+
+    // If true, record values are kept in contiguous memory, so that
+    // ReadRecord(absl::string_view*), ReadRecords(), and ForEachRecord() never
+    // copy a record which would otherwise straddle a boundary between pieces
+    // of decoded data.
+    //
+    // Values of simple chunks are decompressed directly into one buffer.
+    // Values of other chunks are copied into one buffer if decoding produced
+    // several pieces.
+    //
+    // Default: false
+    Options& set_flat_values(bool flat_values) & {
+      flat_values_ = flat_values;
+      return *this;
+    }
+    Options&& set_flat_values(bool flat_values) && {
+      return std::move(set_flat_values(flat_values));
+    }
+
+    // Specifies a cache of decompressed buckets of transposed chunks, used
+    // when the field filter does not include all fields. This makes reading
+    // the same chunks again with a field filter cheaper, e.g. when several
+    // passes over a file read different fields. The cache must be kept alive
+    // until the ChunkDecoder is closed, and may be shared between decoders.
+    //
+    // If nullptr, buckets are decompressed each time a chunk is decoded.
+    //
+    // Default: nullptr
+    Options& set_bucket_cache(BucketCache* bucket_cache) & {
+      bucket_cache_ = bucket_cache;
+      return *this;
+    }
+    Options&& set_bucket_cache(BucketCache* bucket_cache) && {
+      return std::move(set_bucket_cache(bucket_cache));
+    }
+
    private:
     friend class ChunkDecoder;
 
     bool skip_errors_ = false;
     FieldFilter field_filter_ = FieldFilter::All();
+    const ZstdDictionaryRegistry* zstd_dictionaries_ = nullptr;
+    bool verify_data_on_failure_ = false;
+    bool verify_data_ = false;
+    int parallelism_ = 0;
+    size_t streaming_block_size_ = 0;
+    bool flat_values_ = false;
+    BucketCache* bucket_cache_ = nullptr;
   };
 
   // Creates an empty ChunkDecoder.
@@ -95,6 +236,11 @@ class ChunkDecoder : public Object {
   // Resets the ChunkDecoder to an empty chunk.
   void Reset();
 
+  // Resets the ChunkDecoder to an empty chunk, changing its options. Decoders
+  // kept for reuse and allocated memory are retained, which makes this cheaper
+  // than creating a new ChunkDecoder.
+  void Reset(Options options);
+
   // Resets the ChunkDecoder and parses the chunk.
   //
   // Return values:
@@ -102,63 +248,225 @@ class ChunkDecoder : public Object {
   //  * false - failure (!healthy())
   bool Reset(const Chunk& chunk);
 
+  // Resets the ChunkDecoder to a chunk decoded earlier, given record end
+  // positions and concatenated record values, as returned by GetDecoded().
+  void Reset(RecordLimits limits, Chain values);
+
+  // Sets *limits and *values to record end positions and concatenated record
+  // values of the whole chunk, e.g. for caching them.
+  //
+  // Returns false if record values of the whole chunk are not available (for a
+  // kBlockedSimple chunk with several blocks, or a kSimple chunk being
+  // decompressed incrementally).
+  bool GetDecoded(RecordLimits* limits, Chain* values) const;
+
+  // Returns true if the only record of the chunk is the first fragment of a
+  // record written incrementally (RecordWriter::BeginRecord()), which continues
+  // in following chunks. RecordReader joins the fragments.
+  bool record_continues() const { return record_continues_; }
+
+  // If the chunk holds a further fragment of a record written incrementally,
+  // and thus no records, moves the fragment to *fragment, sets *last to whether
+  // the record ends there, and returns true. Otherwise returns false.
+  bool ReadContinuation(Chain* fragment, bool* last);
+
   // Reads the next record.
   //
   // ReadRecord(MessageLite*) parses raw bytes to a proto message after reading.
-  // The remaining overloads read raw bytes (they never generate a new failure).
-  // For ReadRecord(string_view*) the string_view is valid until the next
-  // non-const operation on this ChunkDecoder.
+  // The remaining overloads read raw bytes (they generate a new failure only if
+  // a block of record values of a kBlockedSimple chunk cannot be decompressed
+  // and skip_errors is false). For ReadRecord(string_view*) the string_view is
+  // valid until the next non-const operation on this ChunkDecoder.
   //
   // If key != nullptr, *key is set to the record index on success.
   //
   // Return values:
   //  * true                    - success (*record is set, healthy())
   //  * false (when healthy())  - chunk ends
-  //  * false (when !healthy()) - failure (only for ReadRecord(MessageLite*)
-  //                              when skip_errors is false, or if !healthy()
-  //                              on entry)
+  //  * false (when !healthy()) - failure (only when skip_errors is false, or
+  //                              if !healthy() on entry)
   bool ReadRecord(google::protobuf::MessageLite* record);
   bool ReadRecord(absl::string_view* record);
   bool ReadRecord(std::string* record);
   bool ReadRecord(Chain* record);
 
+  // Like ReadRecord(MessageLite*), but fields specified by *aliased_fields are
+  // not parsed into *record. Their values are stored in
+  // aliased_fields->values(), sharing memory with record values of the chunk,
+  // which stays alive as long as the values do.
+  //
+  // If aliased_fields == nullptr, this is equivalent to
+  // ReadRecord(MessageLite*).
+  bool ReadRecordAliasing(google::protobuf::MessageLite* record,
+                          AliasedFields* aliased_fields);
+
+  // Reads up to max_num_records next records as raw bytes, replacing the
+  // contents of *records. The string_views are valid until the next non-const
+  // operation on this ChunkDecoder.
+  //
+  // Records are read only up to the end of a block of record values of a
+  // kBlockedSimple chunk, or of a part of a kSimple chunk being decompressed
+  // incrementally, so fewer records can be read even if the chunk has more.
+  //
+  // Returns the number of records read, 0 if the chunk ends or on failure.
+  size_t ReadRecords(size_t max_num_records,
+                     std::vector<absl::string_view>* records);
+
+  // Like ReadRecords(), but instead of collecting the records, calls
+  // function(absl::string_view record) for each of them. The string_view is
+  // valid only during the call, and function must not use this ChunkDecoder.
+  //
+  // This avoids filling a vector and, with the function inlined into the loop,
+  // leaves only a few instructions of overhead per record, which matters for
+  // tiny records.
+  //
+  // Returns the number of records read, 0 if the chunk ends or on failure.
+  template <typename Function>
+  size_t ForEachRecord(size_t max_num_records, Function&& function);
+
   uint64_t index() const { return index_; }
+
+  // Sets the index of the next record to read.
+  //
+  // For a kBlockedSimple chunk, the block of record values containing that
+  // record is decompressed only when the record is read, so a point lookup
+  // decompresses only its block.
   void SetIndex(uint64_t index);
   uint64_t num_records() const { return IntCast<uint64_t>(limits_.size()); }
 
   // Returns the number of records skipped because they could not be parsed.
   Position skipped_records() const { return skipped_records_; }
 
+  // Registers this ChunkDecoder with MemoryEstimator, including record values
+  // of the current chunk and decoders kept for reuse.
+  void AddUniqueTo(MemoryEstimator* memory_estimator) const;
+
  protected:
   void Done() override;
 
  private:
   bool Parse(ChunkType chunk_type, const ChunkHeader& header, ChainReader* src,
              Chain* dest);
+  // Parses a ChunkType::kDeduplicated chunk: its distinct records, which are
+  // then expanded to all records.
+  // Parses a ChunkType::kFragment chunk: the first fragment of a record is
+  // parsed as its only record, a further fragment as continuation_.
+  bool ParseFragment(const ChunkHeader& header, ChainReader* src, Chain* dest);
+  bool ParseDeduplicated(const ChunkHeader& header, ChainReader* src,
+                         Chain* dest);
+  // Parses a ChunkType::kDelta chunk: its base records, which are then
+  // expanded to all records by applying patches against previous records.
+  bool ParseDelta(const ChunkHeader& header, ChainReader* src, Chain* dest);
+
+  // Starts decompressing streaming_chunk_ from the beginning, reading record
+  // sizes to limits_.
+  bool StartStreaming();
+
+  // Makes record values of the records from index_, up to about
+  // streaming_block_size_ bytes, available in values_reader_, continuing
+  // decompression of streaming_chunk_.
+  //
+  // Return values are as for ReadBlock().
+  bool ReadStreamingBlock();
+
+  // Handles a failure of ReadStreamingBlock() caused by src, or by record
+  // values ending prematurely if src == nullptr. Always returns false.
+  ABSL_ATTRIBUTE_COLD bool StreamingFailed(const Object* src);
+
+  // Makes record values of the block containing the record at index_ available
+  // in values_reader_.
+  //
+  // Return values:
+  //  * true                    - success
+  //  * false (when healthy())  - chunk ends, or the block was skipped because
+  //                              skip_errors is true
+  //  * false (when !healthy()) - failure
+  bool ReadBlock();
+
+  // Drops record values of the current block, so that the block containing
+  // the record at index_ will be read by ReadBlock().
+  void DropBlock();
+
+  // Parses the record ending at limit in values_reader_ into *record, aliasing
+  // fields specified by *aliased_fields unless it is nullptr, and leaves
+  // values_reader_ positioned at limit whether or not parsing succeeds.
+  bool ParseRecord(google::protobuf::MessageLite* record,
+                   AliasedFields* aliased_fields, size_t limit);
 
   bool skip_errors_;
   FieldFilter field_filter_;
+  const ZstdDictionaryRegistry* zstd_dictionaries_;
+  bool verify_data_on_failure_;
+  bool verify_data_;
+  int parallelism_;
+  size_t streaming_block_size_;
+  bool flat_values_;
+  BucketCache* bucket_cache_;
   // Invariants:
   //   limits_ are sorted
-  //   (limits_.empty() ? 0 : limits_.back()) == size of values_reader_
-  //   (index_ == 0 ? 0 : limits_[index_ - 1]) == values_reader_.pos()
-  std::vector<size_t> limits_;
+  //   (values_end_index_ == 0 ? 0 : limits_[values_end_index_ - 1]) ==
+  //       values_begin_ + size of values_reader_
+  //   (index_ == 0 ? 0 : limits_[index_ - 1]) ==
+  //       values_begin_ + values_reader_.pos()
+  RecordLimits limits_;
+  // Record values of records from values_begin_index_ to values_end_index_.
+  // This is the whole chunk, except for a kBlockedSimple chunk where this is
+  // a single block, or nothing until the block is read.
   ChainReader values_reader_;
   // Invariants:
-  //   index_ <= num_records()
+  //   values_begin_index_ <= index_ <= values_end_index_ <= num_records()
   //   if !healthy() then index_ == num_records()
   uint64_t index_ = 0;
+  uint64_t values_begin_index_ = 0;
+  uint64_t values_end_index_ = 0;
+  // Invariant:
+  //   values_begin_ ==
+  //       (values_begin_index_ == 0 ? 0 : limits_[values_begin_index_ - 1])
+  size_t values_begin_ = 0;
   std::string record_scratch_;
+  // Copies of records read by ReadRecords() which are not contiguous in
+  // values_reader_. A deque keeps earlier strings in place when adding more.
+  std::deque<std::string> records_scratch_;
   // Number of records skipped because they could not be parsed.
   Position skipped_records_ = 0;
+  // If true, the only record is the first fragment of a record which continues
+  // in following chunks.
+  bool record_continues_ = false;
+  // If true, continuation_ holds a further fragment of a record, and
+  // continuation_last_ tells whether the record ends there.
+  bool has_continuation_ = false;
+  bool continuation_last_ = false;
+  Chain continuation_;
+  // Decoder of transposed chunks, kept to reuse the state machine of the
+  // previous chunk. Created lazily.
+  std::unique_ptr<TransposeDecoder> transpose_decoder_;
+  // Decoder of the current kBlockedSimple chunk, holding its compressed
+  // blocks. Created lazily.
+  std::unique_ptr<SimpleDecoder> blocked_decoder_;
+  // The current kSimple chunk being decompressed incrementally, or nullptr if
+  // none. Kept to restart decompression after seeking backwards.
+  std::unique_ptr<Chunk> streaming_chunk_;
+  // Reads streaming_chunk_->data for streaming_decoder_.
+  std::unique_ptr<ChainReader> streaming_src_;
+  // Decoder of streaming_chunk_. Created lazily.
+  std::unique_ptr<SimpleDecoder> streaming_decoder_;
+  // The number of records whose values were already read from
+  // streaming_decoder_.
+  uint64_t streaming_index_ = 0;
 };
 
 // Implementation details follow.
 
+inline bool ChunkDecoder::ReadRecord(google::protobuf::MessageLite* record) {
+  return ReadRecordAliasing(record, nullptr);
+}
+
 inline bool ChunkDecoder::ReadRecord(absl::string_view* record) {
-  if (ABSL_PREDICT_FALSE(index_ == limits_.size())) return false;
+  if (ABSL_PREDICT_FALSE(index_ == values_end_index_)) {
+    if (!ReadBlock()) return false;
+  }
   const size_t start = IntCast<size_t>(values_reader_.pos());
-  const size_t limit = limits_[IntCast<size_t>(index_++)];
+  const size_t limit = limits_[IntCast<size_t>(index_++)] - values_begin_;
   RIEGELI_ASSERT_LE(start, limit)
       << "Failed invariant of ChunkDecoder: record end positions not sorted";
   if (!values_reader_.Read(record, &record_scratch_, limit - start)) {
@@ -169,9 +477,11 @@ inline bool ChunkDecoder::ReadRecord(absl::string_view* record) {
 }
 
 inline bool ChunkDecoder::ReadRecord(std::string* record) {
-  if (ABSL_PREDICT_FALSE(index_ == num_records())) return false;
+  if (ABSL_PREDICT_FALSE(index_ == values_end_index_)) {
+    if (!ReadBlock()) return false;
+  }
   const size_t start = IntCast<size_t>(values_reader_.pos());
-  const size_t limit = limits_[IntCast<size_t>(index_++)];
+  const size_t limit = limits_[IntCast<size_t>(index_++)] - values_begin_;
   RIEGELI_ASSERT_LE(start, limit)
       << "Failed invariant of ChunkDecoder: record end positions not sorted";
   record->clear();
@@ -183,9 +493,11 @@ inline bool ChunkDecoder::ReadRecord(std::string* record) {
 }
 
 inline bool ChunkDecoder::ReadRecord(Chain* record) {
-  if (ABSL_PREDICT_FALSE(index_ == num_records())) return false;
+  if (ABSL_PREDICT_FALSE(index_ == values_end_index_)) {
+    if (!ReadBlock()) return false;
+  }
   const size_t start = IntCast<size_t>(values_reader_.pos());
-  const size_t limit = limits_[IntCast<size_t>(index_++)];
+  const size_t limit = limits_[IntCast<size_t>(index_++)] - values_begin_;
   RIEGELI_ASSERT_LE(start, limit)
       << "Failed invariant of ChunkDecoder: record end positions not sorted";
   record->Clear();
@@ -196,11 +508,47 @@ inline bool ChunkDecoder::ReadRecord(Chain* record) {
   return true;
 }
 
+template <typename Function>
+size_t ChunkDecoder::ForEachRecord(size_t max_num_records,
+                                   Function&& function) {
+  if (ABSL_PREDICT_FALSE(index_ == values_end_index_)) {
+    if (!ReadBlock()) return 0;
+  }
+  const size_t num_records_read = IntCast<size_t>(
+      UnsignedMin(uint64_t{max_num_records}, values_end_index_ - index_));
+  for (size_t i = 0; i < num_records_read; ++i) {
+    const size_t start = IntCast<size_t>(values_reader_.pos());
+    const size_t limit = limits_[IntCast<size_t>(index_++)] - values_begin_;
+    RIEGELI_ASSERT_LE(start, limit)
+        << "Failed invariant of ChunkDecoder: record end positions not sorted";
+    const size_t length = limit - start;
+    if (ABSL_PREDICT_TRUE(values_reader_.available() >= length)) {
+      const char* const cursor = values_reader_.cursor();
+      values_reader_.set_cursor(cursor + length);
+      function(absl::string_view(cursor, length));
+      continue;
+    }
+    absl::string_view record;
+    if (!values_reader_.Read(&record, &record_scratch_, length)) {
+      RIEGELI_ASSERT_UNREACHABLE()
+          << "Failed reading record from values reader: "
+          << values_reader_.message();
+    }
+    function(record);
+  }
+  return num_records_read;
+}
+
 inline void ChunkDecoder::SetIndex(uint64_t index) {
   index_ = UnsignedMin(index, num_records());
+  if (ABSL_PREDICT_FALSE(index_ < values_begin_index_ ||
+                         index_ > values_end_index_)) {
+    DropBlock();
+    return;
+  }
   const size_t start =
       index_ == 0 ? size_t{0} : limits_[IntCast<size_t>(index_ - 1)];
-  if (!values_reader_.Seek(start)) {
+  if (!values_reader_.Seek(start - values_begin_)) {
     RIEGELI_ASSERT_UNREACHABLE()
         << "Failed seeking values reader: " << values_reader_.message();
   }
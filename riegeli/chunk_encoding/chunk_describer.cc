@@ -0,0 +1,572 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/chunk_encoding/chunk_describer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <chrono>
+#include <limits>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/memory/memory.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/object.h"
+#include "riegeli/bytes/chain_reader.h"
+#include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/reader_utils.h"
+#include "riegeli/bytes/string_reader.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/chunk_decoder.h"
+#include "riegeli/chunk_encoding/decompressor.h"
+#include "riegeli/chunk_encoding/field_filter.h"
+#include "riegeli/chunk_encoding/transpose_internal.h"
+#include "riegeli/chunk_encoding/types.h"
+
+namespace riegeli {
+
+namespace {
+
+constexpr uint32_t kInvalidPos = std::numeric_limits<uint32_t>::max();
+
+// What a state of the state machine does, as far as describing fields is
+// concerned.
+enum class NodeKind {
+  kNoOp,
+  kNonProto,
+  kMessageStart,
+  kSubmessageStart,
+  kSubmessageEnd,
+  kStartGroup,
+  kEndGroup,
+  kField,
+};
+
+struct Node {
+  NodeKind kind = NodeKind::kNoOp;
+  // Field number, or 0 if none.
+  uint32_t field = 0;
+  // Index of the data buffer, or kInvalidPos if none.
+  uint32_t buffer_index = kInvalidPos;
+  uint32_t next_node = 0;
+  // If true, the transition to next_node is taken without reading a
+  // transition byte.
+  bool implicit = false;
+  // The field the node belongs to, set when the node is first visited.
+  ChunkDescription::FieldDescription* field_description = nullptr;
+};
+
+}  // namespace
+
+ChunkDescriber::ChunkDescriber(Options options)
+    : Object(State::kOpen),
+      measure_decode_time_(options.measure_decode_time_),
+      zstd_dictionaries_(options.zstd_dictionaries_) {}
+
+bool ChunkDescriber::Describe(const Chunk& chunk, ChunkDescription* dest) {
+  MarkHealthy();
+  *dest = ChunkDescription();
+  dest->num_records = chunk.header.num_records();
+  dest->data_size = chunk.header.data_size();
+  dest->decoded_data_size = chunk.header.decoded_data_size();
+  ChainReader src_reader(&chunk.data);
+  uint8_t chunk_type_byte;
+  dest->chunk_type = ReadByte(&src_reader, &chunk_type_byte)
+                         ? static_cast<ChunkType>(chunk_type_byte)
+                         : ChunkType::kPadding;
+  if (dest->chunk_type == ChunkType::kTransposed) {
+    if (ABSL_PREDICT_FALSE(!DescribeTransposed(&src_reader, dest, nullptr))) {
+      return false;
+    }
+    if (ABSL_PREDICT_FALSE(!src_reader.VerifyEndAndClose())) {
+      return Fail("Invalid transposed chunk", src_reader);
+    }
+  }
+  if (measure_decode_time_) {
+    if (ABSL_PREDICT_FALSE(!MeasureDecodeTime(chunk, FieldFilter::All(),
+                                              &dest->decode_nanos))) {
+      return false;
+    }
+    for (ChunkDescription::FieldDescription& field : dest->fields) {
+      // Non-proto records cannot be selected by a FieldFilter.
+      if (field.path.empty()) continue;
+      Field filter_field;
+      for (const uint32_t field_number : field.path) {
+        filter_field.AddTag(field_number);
+      }
+      FieldFilter field_filter;
+      field_filter.AddField(std::move(filter_field));
+      if (ABSL_PREDICT_FALSE(
+              !MeasureDecodeTime(chunk, field_filter, &field.decode_nanos))) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool ChunkDescriber::ReadTransposedBuffers(
+    const Chunk& chunk, std::vector<TransposedBuffer>* dest) {
+  MarkHealthy();
+  dest->clear();
+  ChainReader src_reader(&chunk.data);
+  uint8_t chunk_type_byte;
+  if (!ReadByte(&src_reader, &chunk_type_byte) ||
+      static_cast<ChunkType>(chunk_type_byte) != ChunkType::kTransposed) {
+    return true;
+  }
+  ChunkDescription description;
+  if (ABSL_PREDICT_FALSE(
+          !DescribeTransposed(&src_reader, &description, dest))) {
+    dest->clear();
+    return false;
+  }
+  if (ABSL_PREDICT_FALSE(!src_reader.VerifyEndAndClose())) {
+    dest->clear();
+    return Fail("Invalid transposed chunk", src_reader);
+  }
+  return true;
+}
+
+inline bool ChunkDescriber::MeasureDecodeTime(const Chunk& chunk,
+                                              const FieldFilter& field_filter,
+                                              uint64_t* decode_nanos) {
+  ChunkDecoder chunk_decoder(ChunkDecoder::Options()
+                                 .set_field_filter(field_filter)
+                                 .set_zstd_dictionaries(zstd_dictionaries_));
+  const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  if (ABSL_PREDICT_FALSE(!chunk_decoder.Reset(chunk))) {
+    return Fail(chunk_decoder);
+  }
+  *decode_nanos =
+      IntCast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - start)
+                            .count());
+  return true;
+}
+
+inline bool ChunkDescriber::DescribeTransposed(
+    Reader* src, ChunkDescription* dest,
+    std::vector<TransposedBuffer>* buffers) {
+  uint8_t compression_type_byte;
+  if (ABSL_PREDICT_FALSE(!ReadByte(src, &compression_type_byte))) {
+    return Fail("Reading compression type failed", *src);
+  }
+  const bool per_bucket_compression =
+      (compression_type_byte & internal::kPerBucketCompression()) != 0;
+  dest->compression_type = static_cast<CompressionType>(
+      compression_type_byte & ~internal::kPerBucketCompression());
+
+  uint64_t header_size;
+  if (ABSL_PREDICT_FALSE(!ReadVarint64(src, &header_size))) {
+    return Fail("Reading header size failed", *src);
+  }
+  if (ABSL_PREDICT_FALSE(header_size > std::numeric_limits<size_t>::max())) {
+    return Fail("Header too large");
+  }
+  dest->header_size = header_size;
+  Chain compressed_header;
+  if (ABSL_PREDICT_FALSE(
+          !src->Read(&compressed_header, IntCast<size_t>(header_size)))) {
+    return Fail("Reading header failed", *src);
+  }
+  internal::Decompressor header_decompressor(
+      absl::make_unique<ChainReader>(std::move(compressed_header)),
+      dest->compression_type, zstd_dictionaries_);
+  if (ABSL_PREDICT_FALSE(!header_decompressor.healthy())) {
+    return Fail(header_decompressor);
+  }
+  std::string header;
+  if (ABSL_PREDICT_FALSE(!ReadAll(header_decompressor.reader(), &header))) {
+    return Fail("Reading header failed", *header_decompressor.reader());
+  }
+  if (ABSL_PREDICT_FALSE(!header_decompressor.VerifyEndAndClose())) {
+    return Fail(header_decompressor);
+  }
+  StringReader header_reader(&header);
+
+  // Buckets and buffers.
+  uint32_t num_buckets, num_buffers;
+  if (ABSL_PREDICT_FALSE(!ReadVarint32(&header_reader, &num_buckets))) {
+    return Fail("Reading number of buckets failed", header_reader);
+  }
+  if (ABSL_PREDICT_FALSE(!ReadVarint32(&header_reader, &num_buffers))) {
+    return Fail("Reading number of buffers failed", header_reader);
+  }
+  if (ABSL_PREDICT_FALSE(num_buckets > dest->buckets.max_size())) {
+    return Fail("Too many buckets");
+  }
+  std::vector<uint64_t> buffer_sizes;
+  std::vector<uint32_t> bucket_indices;
+  if (ABSL_PREDICT_FALSE(num_buffers > buffer_sizes.max_size())) {
+    return Fail("Too many buffers");
+  }
+  if (num_buckets == 0 && ABSL_PREDICT_FALSE(num_buffers != 0)) {
+    return Fail("Too few buckets");
+  }
+  dest->buckets.resize(num_buckets);
+  std::vector<Chain> buckets;
+  buckets.reserve(num_buckets);
+  for (ChunkDescription::Bucket& bucket : dest->buckets) {
+    if (ABSL_PREDICT_FALSE(
+            !ReadVarint64(&header_reader, &bucket.compressed_size))) {
+      return Fail("Reading bucket length failed", header_reader);
+    }
+    if (ABSL_PREDICT_FALSE(bucket.compressed_size >
+                           std::numeric_limits<size_t>::max())) {
+      return Fail("Bucket too large");
+    }
+    buckets.emplace_back();
+    if (ABSL_PREDICT_FALSE(!src->Read(
+            &buckets.back(), IntCast<size_t>(bucket.compressed_size)))) {
+      return Fail("Reading bucket failed", *src);
+    }
+  }
+  for (ChunkDescription::Bucket& bucket : dest->buckets) {
+    bucket.compression_type = dest->compression_type;
+    if (per_bucket_compression) {
+      uint8_t bucket_compression_type_byte;
+      if (ABSL_PREDICT_FALSE(
+              !ReadByte(&header_reader, &bucket_compression_type_byte))) {
+        return Fail("Reading bucket compression type failed", header_reader);
+      }
+      bucket.compression_type =
+          static_cast<CompressionType>(bucket_compression_type_byte);
+    }
+  }
+  // Buffers are assigned to buckets by decompressed sizes of buckets, as in
+  // TransposeDecoder::ParseBuffersForFitering().
+  buffer_sizes.reserve(num_buffers);
+  bucket_indices.reserve(num_buffers);
+  uint32_t bucket_index = 0;
+  uint64_t remaining_bucket_size = 0;
+  if (num_buckets > 0 &&
+      ABSL_PREDICT_FALSE(!internal::Decompressor::UncompressedSize(
+          buckets[0], dest->buckets[0].compression_type,
+          &remaining_bucket_size))) {
+    return Fail("Reading uncompressed size failed");
+  }
+  for (uint32_t buffer_index = 0; buffer_index < num_buffers; ++buffer_index) {
+    uint64_t buffer_size;
+    if (ABSL_PREDICT_FALSE(!ReadVarint64(&header_reader, &buffer_size))) {
+      return Fail("Reading buffer length failed", header_reader);
+    }
+    if (ABSL_PREDICT_FALSE(buffer_size > remaining_bucket_size)) {
+      return Fail("Buffer does not fit in bucket");
+    }
+    remaining_bucket_size -= buffer_size;
+    buffer_sizes.push_back(buffer_size);
+    bucket_indices.push_back(bucket_index);
+    dest->buckets[bucket_index].decompressed_size += buffer_size;
+    ++dest->buckets[bucket_index].num_buffers;
+    while (remaining_bucket_size == 0 && bucket_index + 1 < num_buckets) {
+      ++bucket_index;
+      if (ABSL_PREDICT_FALSE(!internal::Decompressor::UncompressedSize(
+              buckets[bucket_index],
+              dest->buckets[bucket_index].compression_type,
+              &remaining_bucket_size))) {
+        return Fail("Reading uncompressed size failed");
+      }
+    }
+  }
+  if (ABSL_PREDICT_FALSE(num_buckets > 0 && bucket_index + 1 < num_buckets)) {
+    return Fail("Too few buckets");
+  }
+  if (ABSL_PREDICT_FALSE(remaining_bucket_size > 0)) {
+    return Fail("End of data expected");
+  }
+
+  // State machine, parsed as in TransposeDecoder::ParseStateMachine().
+  uint32_t state_machine_size;
+  if (ABSL_PREDICT_FALSE(!ReadVarint32(&header_reader, &state_machine_size))) {
+    return Fail("Reading state machine size failed", header_reader);
+  }
+  dest->state_machine_size = state_machine_size;
+  std::vector<uint32_t> tags;
+  if (ABSL_PREDICT_FALSE(state_machine_size > tags.max_size())) {
+    return Fail("State machine too large");
+  }
+  tags.reserve(state_machine_size);
+  size_t num_subtypes = 0;
+  for (uint32_t i = 0; i < state_machine_size; ++i) {
+    uint32_t tag;
+    if (ABSL_PREDICT_FALSE(!ReadVarint32(&header_reader, &tag))) {
+      return Fail("Reading field tag failed", header_reader);
+    }
+    tags.push_back(tag);
+    if (internal::ValidTag(tag) && internal::HasSubtype(tag)) ++num_subtypes;
+  }
+  std::vector<Node> nodes(state_machine_size);
+  for (Node& node : nodes) {
+    if (ABSL_PREDICT_FALSE(!ReadVarint32(&header_reader, &node.next_node))) {
+      return Fail("Reading next node index failed", header_reader);
+    }
+    if (node.next_node >= state_machine_size) {
+      node.next_node -= state_machine_size;
+      node.implicit = true;
+    }
+    if (ABSL_PREDICT_FALSE(node.next_node >= state_machine_size)) {
+      return Fail("Node index too large");
+    }
+  }
+  std::string subtypes;
+  if (ABSL_PREDICT_FALSE(!header_reader.Read(&subtypes, num_subtypes))) {
+    return Fail("Reading subtypes failed", header_reader);
+  }
+  size_t subtype_index = 0;
+  bool has_nonproto_op = false;
+  for (uint32_t i = 0; i < state_machine_size; ++i) {
+    uint32_t tag = tags[i];
+    Node& node = nodes[i];
+    switch (static_cast<internal::MessageId>(tag)) {
+      case internal::MessageId::kNoOp:
+        break;
+      case internal::MessageId::kNonProto:
+      case internal::MessageId::kNonProtoColumns:
+        node.kind = NodeKind::kNonProto;
+        if (ABSL_PREDICT_FALSE(
+                !ReadVarint32(&header_reader, &node.buffer_index))) {
+          return Fail("Reading buffer index failed", header_reader);
+        }
+        if (static_cast<internal::MessageId>(tag) ==
+            internal::MessageId::kNonProtoColumns) {
+          uint32_t width;
+          if (ABSL_PREDICT_FALSE(!ReadVarint32(&header_reader, &width))) {
+            return Fail("Reading non-proto record size failed",
+                        header_reader);
+          }
+        }
+        has_nonproto_op = true;
+        break;
+      case internal::MessageId::kStartOfMessage:
+        node.kind = NodeKind::kMessageStart;
+        break;
+      case internal::MessageId::kStartOfSubmessage:
+        node.kind = NodeKind::kSubmessageStart;
+        break;
+      default: {
+        internal::Subtype subtype = internal::Subtype::kTrivial;
+        if (static_cast<internal::WireType>(tag & 7) ==
+            internal::WireType::kSubmessage) {
+          tag -= internal::WireType::kSubmessage -
+                 internal::WireType::kLengthDelimited;
+          subtype = internal::Subtype::kLengthDelimitedEndOfSubmessage;
+        }
+        const bool is_packed = static_cast<internal::WireType>(tag & 7) ==
+                               internal::WireType::kPackedString;
+        if (is_packed) {
+          tag -= internal::WireType::kPackedString -
+                 internal::WireType::kLengthDelimited;
+        }
+        if (ABSL_PREDICT_FALSE(!internal::ValidTag(tag))) {
+          return Fail("Invalid tag");
+        }
+        if (internal::HasSubtype(tag)) {
+          subtype = static_cast<internal::Subtype>(subtypes[subtype_index++]);
+        }
+        node.field = tag >> 3;
+        switch (static_cast<internal::WireType>(tag & 7)) {
+          case internal::WireType::kStartGroup:
+            node.kind = NodeKind::kStartGroup;
+            break;
+          case internal::WireType::kEndGroup:
+            node.kind = NodeKind::kEndGroup;
+            break;
+          default:
+            node.kind =
+                subtype == internal::Subtype::kLengthDelimitedEndOfSubmessage
+                    ? NodeKind::kSubmessageEnd
+                    : NodeKind::kField;
+        }
+        if (internal::HasDataBuffer(tag, subtype)) {
+          if (ABSL_PREDICT_FALSE(
+                  !ReadVarint32(&header_reader, &node.buffer_index))) {
+            return Fail("Reading buffer index failed", header_reader);
+          }
+        }
+        if (is_packed) {
+          uint32_t layout;
+          if (ABSL_PREDICT_FALSE(!ReadVarint32(&header_reader, &layout))) {
+            return Fail("Reading packed layout failed", header_reader);
+          }
+        }
+      }
+    }
+    if (ABSL_PREDICT_FALSE(node.buffer_index != kInvalidPos &&
+                           node.buffer_index >= num_buffers)) {
+      return Fail("Buffer index too large");
+    }
+  }
+  if (ABSL_PREDICT_FALSE(has_nonproto_op && num_buffers == 0)) {
+    return Fail("Missing buffer for non-proto records");
+  }
+  uint32_t first_node;
+  if (ABSL_PREDICT_FALSE(!ReadVarint32(&header_reader, &first_node))) {
+    return Fail("Reading first node index failed", header_reader);
+  }
+  if (ABSL_PREDICT_FALSE(first_node >= state_machine_size)) {
+    return Fail("First node index too large");
+  }
+  if (ABSL_PREDICT_FALSE(!header_reader.VerifyEndAndClose())) {
+    return Fail(header_reader);
+  }
+
+  // Transitions are followed as in TransposeDecoder::Decode(), tracking the
+  // path of open submessages instead of writing records. Records are decoded
+  // backwards, so the end of a submessage opens it.
+  const Position transitions_begin = src->pos();
+  internal::Decompressor transitions(src, dest->compression_type,
+                                     zstd_dictionaries_);
+  if (ABSL_PREDICT_FALSE(!transitions.healthy())) return Fail(transitions);
+  std::map<Field::Path, ChunkDescription::FieldDescription> fields;
+  // The path of the root message and then open submessages.
+  Field::Path path;
+  std::vector<ChunkDescription::FieldDescription*> buffer_fields(num_buffers,
+                                                                 nullptr);
+  // The maximal number of states visited without reading a transition byte
+  // unless there is an implicit loop: up to 4 explicit states, each following
+  // a chain of implicit states.
+  const uint64_t max_states_per_transition = uint64_t{5} * state_machine_size;
+  uint64_t states_since_transition = 0;
+  uint32_t node_index = first_node;
+  uint32_t num_iters = nodes[node_index].implicit ? 1 : 0;
+  for (;;) {
+    Node& node = nodes[node_index];
+    switch (node.kind) {
+      case NodeKind::kNoOp:
+        break;
+      case NodeKind::kMessageStart:
+        if (ABSL_PREDICT_FALSE(!path.empty())) {
+          return Fail("Submessages still open");
+        }
+        break;
+      case NodeKind::kSubmessageStart:
+      case NodeKind::kStartGroup:
+        if (ABSL_PREDICT_FALSE(path.empty())) {
+          return Fail("Submessage stack underflow");
+        }
+        path.pop_back();
+        break;
+      case NodeKind::kNonProto:
+      case NodeKind::kSubmessageEnd:
+      case NodeKind::kEndGroup:
+      case NodeKind::kField:
+        if (ABSL_PREDICT_FALSE(node.kind == NodeKind::kNonProto &&
+                               !path.empty())) {
+          return Fail("Submessages still open");
+        }
+        if (node.field_description == nullptr) {
+          Field::Path field_path = path;
+          if (node.kind != NodeKind::kNonProto) {
+            field_path.push_back(node.field);
+          }
+          node.field_description = &fields[field_path];
+          node.field_description->path = std::move(field_path);
+        }
+        ++node.field_description->num_occurrences;
+        if (node.buffer_index != kInvalidPos &&
+            buffer_fields[node.buffer_index] == nullptr) {
+          buffer_fields[node.buffer_index] = node.field_description;
+        }
+        if (node.kind == NodeKind::kSubmessageEnd ||
+            node.kind == NodeKind::kEndGroup) {
+          path.push_back(node.field);
+        }
+        break;
+    }
+    node_index = node.next_node;
+    if (num_iters == 0) {
+      uint8_t transition_byte;
+      if (!ReadByte(transitions.reader(), &transition_byte)) break;
+      ++dest->num_transitions;
+      states_since_transition = 0;
+      node_index += transition_byte >> 2;
+      if (ABSL_PREDICT_FALSE(node_index >= state_machine_size)) {
+        return Fail("Invalid transition");
+      }
+      num_iters = transition_byte & 3;
+      if (nodes[node_index].implicit) ++num_iters;
+    } else {
+      if (!nodes[node_index].implicit) --num_iters;
+      if (ABSL_PREDICT_FALSE(++states_since_transition >
+                             max_states_per_transition)) {
+        return Fail("Nodes contain an implicit loop");
+      }
+    }
+  }
+  if (ABSL_PREDICT_FALSE(!transitions.VerifyEndAndClose())) {
+    return Fail(transitions);
+  }
+  dest->transitions_size = src->pos() - transitions_begin;
+  if (ABSL_PREDICT_FALSE(!path.empty())) {
+    return Fail("Submessages still open");
+  }
+  if (has_nonproto_op) {
+    // The last buffer holds lengths of non-proto records.
+    buffer_fields.back() = &fields[Field::Path()];
+  }
+
+  for (uint32_t buffer_index = 0; buffer_index < num_buffers; ++buffer_index) {
+    ChunkDescription::FieldDescription* const field =
+        buffer_fields[buffer_index];
+    if (field == nullptr || buffer_sizes[buffer_index] == 0) continue;
+    const ChunkDescription::Bucket& bucket =
+        dest->buckets[bucket_indices[buffer_index]];
+    field->buffer_size += buffer_sizes[buffer_index];
+    field->compressed_size += static_cast<double>(bucket.compressed_size) *
+                              static_cast<double>(buffer_sizes[buffer_index]) /
+                              static_cast<double>(bucket.decompressed_size);
+  }
+  if (buffers != nullptr) {
+    uint32_t buffer_index = 0;
+    for (uint32_t bucket_index = 0; bucket_index < num_buckets;
+         ++bucket_index) {
+      internal::Decompressor bucket_decompressor(
+          absl::make_unique<ChainReader>(std::move(buckets[bucket_index])),
+          dest->buckets[bucket_index].compression_type, zstd_dictionaries_);
+      if (ABSL_PREDICT_FALSE(!bucket_decompressor.healthy())) {
+        return Fail(bucket_decompressor);
+      }
+      for (; buffer_index < num_buffers &&
+             bucket_indices[buffer_index] == bucket_index;
+           ++buffer_index) {
+        Chain data;
+        if (ABSL_PREDICT_FALSE(!bucket_decompressor.reader()->Read(
+                &data, IntCast<size_t>(buffer_sizes[buffer_index])))) {
+          return Fail("Reading buffer failed", *bucket_decompressor.reader());
+        }
+        if (buffer_fields[buffer_index] == nullptr) continue;
+        buffers->emplace_back();
+        buffers->back().path = buffer_fields[buffer_index]->path;
+        buffers->back().data = std::move(data);
+      }
+      if (ABSL_PREDICT_FALSE(!bucket_decompressor.VerifyEndAndClose())) {
+        return Fail(bucket_decompressor);
+      }
+    }
+  }
+  dest->fields.reserve(fields.size());
+  for (auto& path_and_field : fields) {
+    dest->fields.push_back(std::move(path_and_field.second));
+  }
+  return true;
+}
+
+}  // namespace riegeli
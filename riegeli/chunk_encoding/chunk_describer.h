@@ -0,0 +1,208 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_CHUNK_ENCODING_CHUNK_DESCRIBER_H_
+#define RIEGELI_CHUNK_ENCODING_CHUNK_DESCRIBER_H_
+
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/object.h"
+#include "riegeli/bytes/reader.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/field_filter.h"
+#include "riegeli/chunk_encoding/types.h"
+
+namespace riegeli {
+
+class ZstdDictionaryRegistry;
+
+// Sizes of the parts of a chunk, for tuning how records are written, e.g.
+// which fields are worth keeping in separate buckets, or which compression
+// pays off for them.
+struct ChunkDescription {
+  // A bucket of a transposed chunk, i.e. a group of data buffers compressed
+  // together.
+  struct Bucket {
+    CompressionType compression_type = CompressionType::kNone;
+    // The size of the bucket in the chunk.
+    uint64_t compressed_size = 0;
+    // The total size of data buffers of the bucket.
+    uint64_t decompressed_size = 0;
+    uint32_t num_buffers = 0;
+  };
+
+  // A proto field of a transposed chunk, identified by its path. Non-proto
+  // records are described as a field with an empty path.
+  struct FieldDescription {
+    // Field numbers descending from the root message.
+    Field::Path path;
+    // The number of occurrences of the field in records of the chunk.
+    uint64_t num_occurrences = 0;
+    // The total size of data buffers of the field. Inline varints and
+    // submessages have no data buffers, their contents are described by other
+    // fields, and their tags are reconstructed from transitions.
+    uint64_t buffer_size = 0;
+    // The compressed size of data buffers of the field, estimated by dividing
+    // the compressed size of each bucket among its buffers proportionally to
+    // their sizes.
+    double compressed_size = 0.0;
+    // The time of decoding the chunk with a FieldFilter including only this
+    // field, in nanoseconds, or 0 if not measured.
+    uint64_t decode_nanos = 0;
+  };
+
+  ChunkType chunk_type = ChunkType::kPadding;
+  uint64_t num_records = 0;
+  // The size of chunk data, excluding the chunk header.
+  uint64_t data_size = 0;
+  // The total size of records.
+  uint64_t decoded_data_size = 0;
+  // The time of decoding all records of the chunk, in nanoseconds, or 0 if not
+  // measured.
+  uint64_t decode_nanos = 0;
+
+  // The remaining members are set only for transposed chunks.
+
+  // Compression type of the header and transitions.
+  CompressionType compression_type = CompressionType::kNone;
+  // The size of the header in the chunk, which holds sizes of buckets and
+  // buffers, and the state machine.
+  uint64_t header_size = 0;
+  // The size of transitions in the chunk, and their size after decompression,
+  // which is the number of transitions.
+  uint64_t transitions_size = 0;
+  uint64_t num_transitions = 0;
+  // The number of states of the state machine.
+  uint32_t state_machine_size = 0;
+  std::vector<Bucket> buckets;
+  // Fields sorted by their paths.
+  std::vector<FieldDescription> fields;
+};
+
+// A data buffer of a transposed chunk, holding values of one field. Buffers of
+// a field are compressed well together, and e.g. a Zstd dictionary for
+// transposed chunks should be trained on them rather than on whole records.
+struct TransposedBuffer {
+  // The field the buffer belongs to, as in ChunkDescription::FieldDescription.
+  Field::Path path;
+  // Decompressed contents of the buffer.
+  Chain data;
+};
+
+// Describes chunks for ChunkDescription, without keeping their records.
+//
+// Sizes of fields of transposed chunks are found by following transitions of
+// the state machine while tracking open submessages, like TransposeDecoder
+// does, but without decompressing buckets or reconstructing records.
+//
+// A ChunkDescriber is thread-compatible. Chunks can be described in parallel
+// by separate ChunkDescribers.
+class ChunkDescriber : public Object {
+ public:
+  class Options {
+   public:
+    // Not defaulted because of a C++ defect:
+    // https://stackoverflow.com/questions/17430377
+    Options() noexcept {}
+
+    // If true, chunks are also decoded with ChunkDecoder to measure the time
+    // of decoding them, and transposed chunks are decoded once for each field,
+    // with a FieldFilter including only that field. This is much slower than
+    // describing sizes.
+    //
+    // Default: false
+    Options& set_measure_decode_time(bool measure_decode_time) & {
+      measure_decode_time_ = measure_decode_time;
+      return *this;
+    }
+    Options&& set_measure_decode_time(bool measure_decode_time) && {
+      return std::move(set_measure_decode_time(measure_decode_time));
+    }
+
+    // Specifies Zstd dictionaries used to decompress chunks compressed with a
+    // dictionary. The registry must be kept alive until the ChunkDescriber is
+    // closed.
+    //
+    // If nullptr, describing such chunks fails.
+    //
+    // Default: nullptr
+    Options& set_zstd_dictionaries(
+        const ZstdDictionaryRegistry* zstd_dictionaries) & {
+      zstd_dictionaries_ = zstd_dictionaries;
+      return *this;
+    }
+    Options&& set_zstd_dictionaries(
+        const ZstdDictionaryRegistry* zstd_dictionaries) && {
+      return std::move(set_zstd_dictionaries(zstd_dictionaries));
+    }
+
+   private:
+    friend class ChunkDescriber;
+
+    bool measure_decode_time_ = false;
+    const ZstdDictionaryRegistry* zstd_dictionaries_ = nullptr;
+  };
+
+  explicit ChunkDescriber(Options options = Options());
+
+  ChunkDescriber(const ChunkDescriber&) = delete;
+  ChunkDescriber& operator=(const ChunkDescriber&) = delete;
+
+  // Sets *dest to the description of chunk.
+  //
+  // A failure affects only this call: healthy() is restored by the next call.
+  //
+  // Return values:
+  //  * true  - success (*dest is set, healthy())
+  //  * false - failure (!healthy())
+  bool Describe(const Chunk& chunk, ChunkDescription* dest);
+
+  // Sets *dest to data buffers of chunk, decompressing its buckets, if chunk
+  // is transposed. Otherwise clears *dest. Buffers which no state of the state
+  // machine reads are omitted.
+  //
+  // Decoding time is not measured.
+  //
+  // A failure affects only this call: healthy() is restored by the next call.
+  //
+  // Return values:
+  //  * true  - success (*dest is set, healthy())
+  //  * false - failure (!healthy())
+  bool ReadTransposedBuffers(const Chunk& chunk,
+                             std::vector<TransposedBuffer>* dest);
+
+ protected:
+  void Done() override {}
+
+ private:
+  // Each of these functions returns false with !healthy() on failure.
+
+  // If buffers is not nullptr, also sets *buffers as in
+  // ReadTransposedBuffers().
+  bool DescribeTransposed(Reader* src, ChunkDescription* dest,
+                          std::vector<TransposedBuffer>* buffers);
+  bool MeasureDecodeTime(const Chunk& chunk, const FieldFilter& field_filter,
+                         uint64_t* decode_nanos);
+
+  bool measure_decode_time_;
+  const ZstdDictionaryRegistry* zstd_dictionaries_;
+};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_CHUNK_ENCODING_CHUNK_DESCRIBER_H_
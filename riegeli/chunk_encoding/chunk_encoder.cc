@@ -17,14 +17,17 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <limits>
+#include <string>
+#include <utility>
 
 #include "google/protobuf/message_lite.h"
 #include "absl/base/optimization.h"
 #include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/bytes/chain_writer.h"
-#include "riegeli/bytes/message_serialize.h"
 #include "riegeli/bytes/writer_utils.h"
 #include "riegeli/chunk_encoding/chunk.h"
 
@@ -44,7 +47,19 @@ bool ChunkEncoder::AddRecord(const google::protobuf::MessageLite& record) {
         "Failed to serialize message of type ", record.GetTypeName(),
         " because it exceeds maximum protobuf size of 2GB: ", size));
   }
-  return AddRecord(SerializePartialAsChain(record));
+  // ByteSizeLong() above cached the sizes of the message and its submessages,
+  // so the array serializer can be used without computing them again. The
+  // result is flat, so TransposeEncoder can parse it in place.
+  if (size <= kMaxBytesToCopy()) {
+    char buffer[kMaxBytesToCopy()];
+    record.SerializeWithCachedSizesToArray(reinterpret_cast<uint8_t*>(buffer));
+    return AddRecord(absl::string_view(buffer, size));
+  }
+  std::string serialized;
+  serialized.resize(size);
+  record.SerializeWithCachedSizesToArray(
+      reinterpret_cast<uint8_t*>(&serialized[0]));
+  return AddRecord(std::move(serialized));
 }
 
 bool ChunkEncoder::AddRecord(Chain&& record) {
@@ -69,4 +84,8 @@ bool ChunkEncoder::EncodeAndClose(Chunk* chunk) {
   return true;
 }
 
+void ChunkEncoder::AddUniqueTo(MemoryEstimator* memory_estimator) const {
+  memory_estimator->AddMemory(sizeof(ChunkEncoder));
+}
+
 }  // namespace riegeli
@@ -23,6 +23,7 @@
 #include "google/protobuf/message_lite.h"
 #include "absl/strings/string_view.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
 #include "riegeli/bytes/writer.h"
 #include "riegeli/chunk_encoding/chunk.h"
@@ -91,6 +92,14 @@ class ChunkEncoder : public Object {
   // Returns the chunk type to write in a chunk header.
   virtual ChunkType GetChunkType() const = 0;
 
+  // Registers this ChunkEncoder with MemoryEstimator, including records added
+  // so far and compression state.
+  //
+  // By default only sizeof(ChunkEncoder) is registered. Derived classes
+  // override this, calling AddUniqueTo() of their base class and adding the
+  // rest of their size and their subobjects.
+  virtual void AddUniqueTo(MemoryEstimator* memory_estimator) const;
+
  protected:
   void Done() override;
 
@@ -0,0 +1,371 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/chunk_encoding/chunk_transcoder.h"
+
+#include <stdint.h>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/memory/memory.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/object.h"
+#include "riegeli/bytes/chain_reader.h"
+#include "riegeli/bytes/chain_writer.h"
+#include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/reader_utils.h"
+#include "riegeli/bytes/writer.h"
+#include "riegeli/bytes/writer_utils.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/compressor.h"
+#include "riegeli/chunk_encoding/compressor_options.h"
+#include "riegeli/chunk_encoding/decompressor.h"
+#include "riegeli/chunk_encoding/transpose_internal.h"
+#include "riegeli/chunk_encoding/types.h"
+
+namespace riegeli {
+
+ChunkTranscoder::ChunkTranscoder(Options options)
+    : Object(State::kOpen),
+      compressor_options_(std::move(options.compressor_options_)),
+      zstd_dictionaries_(options.zstd_dictionaries_) {}
+
+bool ChunkTranscoder::Transcode(const Chunk& src, Chunk* dest) {
+  MarkHealthy();
+  ChainReader src_reader(&src.data);
+  uint8_t chunk_type_byte;
+  const ChunkType chunk_type = ReadByte(&src_reader, &chunk_type_byte)
+                                   ? static_cast<ChunkType>(chunk_type_byte)
+                                   : ChunkType::kPadding;
+  if (chunk_type != ChunkType::kSimple &&
+      chunk_type != ChunkType::kBlockedSimple &&
+      chunk_type != ChunkType::kTransposed) {
+    *dest = src;
+    return true;
+  }
+  Chain data;
+  ChainWriter data_writer(&data);
+  if (ABSL_PREDICT_FALSE(!WriteByte(&data_writer, chunk_type_byte))) {
+    return Fail(data_writer);
+  }
+  if (ABSL_PREDICT_FALSE(
+          !(chunk_type == ChunkType::kTransposed
+                ? TranscodeTransposed(&src_reader, &data_writer)
+                : TranscodeSimple(chunk_type, src.header.num_records(),
+                                  &src_reader, &data_writer)))) {
+    return false;
+  }
+  if (ABSL_PREDICT_FALSE(!src_reader.VerifyEndAndClose())) {
+    return Fail("Invalid chunk", src_reader);
+  }
+  if (ABSL_PREDICT_FALSE(!data_writer.Close())) return Fail(data_writer);
+  dest->header = ChunkHeader(data, src.header.num_records(),
+                             src.header.decoded_data_size());
+  dest->data = std::move(data);
+  return true;
+}
+
+inline bool ChunkTranscoder::Decompress(Chain src,
+                                        CompressionType compression_type,
+                                        Chain* dest) {
+  internal::Decompressor decompressor(
+      absl::make_unique<ChainReader>(std::move(src)), compression_type,
+      zstd_dictionaries_);
+  if (ABSL_PREDICT_FALSE(!decompressor.healthy())) return Fail(decompressor);
+  if (ABSL_PREDICT_FALSE(!ReadAll(decompressor.reader(), dest))) {
+    return Fail("Decompressing failed", *decompressor.reader());
+  }
+  if (ABSL_PREDICT_FALSE(!decompressor.VerifyEndAndClose())) {
+    return Fail(decompressor);
+  }
+  return true;
+}
+
+inline bool ChunkTranscoder::Compress(Chain src, Writer* dest) {
+  internal::Compressor compressor(compressor_options_, src.size());
+  if (ABSL_PREDICT_FALSE(!compressor.writer()->Write(std::move(src)))) {
+    return Fail(*compressor.writer());
+  }
+  if (ABSL_PREDICT_FALSE(!compressor.EncodeAndClose(dest))) {
+    return Fail(compressor);
+  }
+  return true;
+}
+
+inline bool ChunkTranscoder::Recompress(Chain src,
+                                        CompressionType compression_type,
+                                        Writer* dest) {
+  Chain decompressed;
+  return Decompress(std::move(src), compression_type, &decompressed) &&
+         Compress(std::move(decompressed), dest);
+}
+
+inline bool ChunkTranscoder::TranscodeSimple(ChunkType chunk_type,
+                                             uint64_t num_records, Reader* src,
+                                             Writer* dest) {
+  uint8_t compression_type_byte;
+  if (ABSL_PREDICT_FALSE(!ReadByte(src, &compression_type_byte))) {
+    return Fail("Reading compression type failed", *src);
+  }
+  const CompressionType compression_type =
+      static_cast<CompressionType>(compression_type_byte);
+  if (ABSL_PREDICT_FALSE(!WriteByte(
+          dest,
+          static_cast<uint8_t>(compressor_options_.compression_type())))) {
+    return Fail(*dest);
+  }
+
+  uint64_t sizes_size;
+  if (ABSL_PREDICT_FALSE(!ReadVarint64(src, &sizes_size))) {
+    return Fail("Reading size of sizes failed", *src);
+  }
+  if (sizes_size == 0 && num_records > 0) {
+    // All records have the same size, stored once and not compressed.
+    uint64_t size;
+    if (ABSL_PREDICT_FALSE(!ReadVarint64(src, &size))) {
+      return Fail("Reading record size failed", *src);
+    }
+    if (ABSL_PREDICT_FALSE(!WriteVarint64(dest, 0)) ||
+        ABSL_PREDICT_FALSE(!WriteVarint64(dest, size))) {
+      return Fail(*dest);
+    }
+  } else {
+    if (ABSL_PREDICT_FALSE(sizes_size > std::numeric_limits<size_t>::max())) {
+      return Fail("Size of sizes too large");
+    }
+    Chain sizes;
+    if (ABSL_PREDICT_FALSE(!src->Read(&sizes, IntCast<size_t>(sizes_size)))) {
+      return Fail("Reading sizes failed", *src);
+    }
+    Chain compressed_sizes;
+    ChainWriter compressed_sizes_writer(&compressed_sizes);
+    if (ABSL_PREDICT_FALSE(!Recompress(std::move(sizes), compression_type,
+                                       &compressed_sizes_writer))) {
+      return false;
+    }
+    if (ABSL_PREDICT_FALSE(!compressed_sizes_writer.Close())) {
+      return Fail(compressed_sizes_writer);
+    }
+    if (ABSL_PREDICT_FALSE(!WriteVarint64(
+            dest, IntCast<uint64_t>(compressed_sizes.size()))) ||
+        ABSL_PREDICT_FALSE(!dest->Write(std::move(compressed_sizes)))) {
+      return Fail(*dest);
+    }
+  }
+
+  if (chunk_type == ChunkType::kSimple) {
+    Chain values;
+    if (ABSL_PREDICT_FALSE(!ReadAll(src, &values))) {
+      return Fail("Reading values failed", *src);
+    }
+    return Recompress(std::move(values), compression_type, dest);
+  }
+
+  // Each block of values is compressed separately, so that blocks can still
+  // be decompressed independently.
+  uint64_t num_blocks;
+  if (ABSL_PREDICT_FALSE(!ReadVarint64(src, &num_blocks))) {
+    return Fail("Reading number of blocks failed", *src);
+  }
+  if (ABSL_PREDICT_FALSE(num_blocks > num_records)) {
+    return Fail("Too many blocks");
+  }
+  std::vector<uint64_t> block_num_records;
+  std::vector<uint64_t> block_sizes;
+  block_num_records.reserve(IntCast<size_t>(num_blocks));
+  block_sizes.reserve(IntCast<size_t>(num_blocks));
+  for (uint64_t i = 0; i < num_blocks; ++i) {
+    uint64_t num_records_in_block, compressed_size;
+    if (ABSL_PREDICT_FALSE(!ReadVarint64(src, &num_records_in_block)) ||
+        ABSL_PREDICT_FALSE(!ReadVarint64(src, &compressed_size))) {
+      return Fail("Reading block location failed", *src);
+    }
+    if (ABSL_PREDICT_FALSE(compressed_size >
+                           std::numeric_limits<size_t>::max())) {
+      return Fail("Compressed block too large");
+    }
+    block_num_records.push_back(num_records_in_block);
+    block_sizes.push_back(compressed_size);
+  }
+  Chain compressed_blocks;
+  ChainWriter compressed_blocks_writer(&compressed_blocks);
+  for (uint64_t& block_size : block_sizes) {
+    Chain block;
+    if (ABSL_PREDICT_FALSE(!src->Read(&block, IntCast<size_t>(block_size)))) {
+      return Fail("Reading block failed", *src);
+    }
+    const Position pos_before = compressed_blocks_writer.pos();
+    if (ABSL_PREDICT_FALSE(!Recompress(std::move(block), compression_type,
+                                       &compressed_blocks_writer))) {
+      return false;
+    }
+    block_size = IntCast<uint64_t>(compressed_blocks_writer.pos() - pos_before);
+  }
+  if (ABSL_PREDICT_FALSE(!compressed_blocks_writer.Close())) {
+    return Fail(compressed_blocks_writer);
+  }
+  if (ABSL_PREDICT_FALSE(!WriteVarint64(dest, num_blocks))) return Fail(*dest);
+  for (size_t i = 0; i < block_sizes.size(); ++i) {
+    if (ABSL_PREDICT_FALSE(!WriteVarint64(dest, block_num_records[i])) ||
+        ABSL_PREDICT_FALSE(!WriteVarint64(dest, block_sizes[i]))) {
+      return Fail(*dest);
+    }
+  }
+  if (ABSL_PREDICT_FALSE(!dest->Write(std::move(compressed_blocks)))) {
+    return Fail(*dest);
+  }
+  return true;
+}
+
+inline bool ChunkTranscoder::TranscodeTransposed(Reader* src, Writer* dest) {
+  uint8_t compression_type_byte;
+  if (ABSL_PREDICT_FALSE(!ReadByte(src, &compression_type_byte))) {
+    return Fail("Reading compression type failed", *src);
+  }
+  // Buckets compressed individually are all recompressed with
+  // compressor_options_, so the transcoded chunk does not store compression
+  // types of buckets.
+  const bool per_bucket_compression =
+      (compression_type_byte & internal::kPerBucketCompression()) != 0;
+  const CompressionType compression_type = static_cast<CompressionType>(
+      compression_type_byte & ~internal::kPerBucketCompression());
+  if (ABSL_PREDICT_FALSE(!WriteByte(
+          dest,
+          static_cast<uint8_t>(compressor_options_.compression_type())))) {
+    return Fail(*dest);
+  }
+
+  uint64_t header_size;
+  if (ABSL_PREDICT_FALSE(!ReadVarint64(src, &header_size))) {
+    return Fail("Reading header size failed", *src);
+  }
+  if (ABSL_PREDICT_FALSE(header_size > std::numeric_limits<size_t>::max())) {
+    return Fail("Header too large");
+  }
+  Chain compressed_header;
+  if (ABSL_PREDICT_FALSE(
+          !src->Read(&compressed_header, IntCast<size_t>(header_size)))) {
+    return Fail("Reading header failed", *src);
+  }
+  Chain header;
+  if (ABSL_PREDICT_FALSE(!Decompress(std::move(compressed_header),
+                                     compression_type, &header))) {
+    return false;
+  }
+
+  // The header starts with numbers of buckets and buffers, compressed lengths
+  // of buckets, and possibly their compression types, which change. The rest
+  // of the header, i.e. lengths of buffers and the state machine, is kept.
+  ChainReader header_reader(&header);
+  uint32_t num_buckets, num_buffers;
+  if (ABSL_PREDICT_FALSE(!ReadVarint32(&header_reader, &num_buckets))) {
+    return Fail("Reading number of buckets failed", header_reader);
+  }
+  if (ABSL_PREDICT_FALSE(!ReadVarint32(&header_reader, &num_buffers))) {
+    return Fail("Reading number of buffers failed", header_reader);
+  }
+  Chain new_header;
+  ChainWriter new_header_writer(&new_header);
+  if (ABSL_PREDICT_FALSE(!WriteVarint32(&new_header_writer, num_buckets)) ||
+      ABSL_PREDICT_FALSE(!WriteVarint32(&new_header_writer, num_buffers))) {
+    return Fail(new_header_writer);
+  }
+  std::vector<uint64_t> bucket_lengths;
+  if (ABSL_PREDICT_FALSE(num_buckets > bucket_lengths.max_size())) {
+    return Fail("Too many buckets");
+  }
+  bucket_lengths.reserve(num_buckets);
+  for (uint32_t i = 0; i < num_buckets; ++i) {
+    uint64_t bucket_length;
+    if (ABSL_PREDICT_FALSE(!ReadVarint64(&header_reader, &bucket_length))) {
+      return Fail("Reading bucket length failed", header_reader);
+    }
+    if (ABSL_PREDICT_FALSE(bucket_length >
+                           std::numeric_limits<size_t>::max())) {
+      return Fail("Bucket too large");
+    }
+    bucket_lengths.push_back(bucket_length);
+  }
+  std::vector<CompressionType> bucket_compression_types(num_buckets,
+                                                        compression_type);
+  if (per_bucket_compression) {
+    for (CompressionType& bucket_compression_type : bucket_compression_types) {
+      uint8_t bucket_compression_type_byte;
+      if (ABSL_PREDICT_FALSE(
+              !ReadByte(&header_reader, &bucket_compression_type_byte))) {
+        return Fail("Reading bucket compression type failed", header_reader);
+      }
+      bucket_compression_type =
+          static_cast<CompressionType>(bucket_compression_type_byte);
+    }
+  }
+  Chain data;
+  ChainWriter data_writer(&data);
+  for (uint32_t i = 0; i < num_buckets; ++i) {
+    Chain bucket;
+    if (ABSL_PREDICT_FALSE(
+            !src->Read(&bucket, IntCast<size_t>(bucket_lengths[i])))) {
+      return Fail("Reading bucket failed", *src);
+    }
+    const Position pos_before = data_writer.pos();
+    if (ABSL_PREDICT_FALSE(!Recompress(std::move(bucket),
+                                       bucket_compression_types[i],
+                                       &data_writer))) {
+      return false;
+    }
+    if (ABSL_PREDICT_FALSE(!WriteVarint64(
+            &new_header_writer,
+            IntCast<uint64_t>(data_writer.pos() - pos_before)))) {
+      return Fail(new_header_writer);
+    }
+  }
+  if (ABSL_PREDICT_FALSE(!CopyAll(&header_reader, &new_header_writer))) {
+    return Fail("Copying header failed", header_reader);
+  }
+  if (ABSL_PREDICT_FALSE(!new_header_writer.Close())) {
+    return Fail(new_header_writer);
+  }
+  // Transitions follow the buckets until the end of the chunk.
+  Chain transitions;
+  if (ABSL_PREDICT_FALSE(!ReadAll(src, &transitions))) {
+    return Fail("Reading transitions failed", *src);
+  }
+  if (ABSL_PREDICT_FALSE(!Recompress(std::move(transitions), compression_type,
+                                     &data_writer))) {
+    return false;
+  }
+  if (ABSL_PREDICT_FALSE(!data_writer.Close())) return Fail(data_writer);
+
+  Chain compressed_new_header;
+  ChainWriter compressed_new_header_writer(&compressed_new_header);
+  if (ABSL_PREDICT_FALSE(!Compress(std::move(new_header),
+                                   &compressed_new_header_writer))) {
+    return false;
+  }
+  if (ABSL_PREDICT_FALSE(!compressed_new_header_writer.Close())) {
+    return Fail(compressed_new_header_writer);
+  }
+  if (ABSL_PREDICT_FALSE(!WriteVarint64(
+          dest, IntCast<uint64_t>(compressed_new_header.size()))) ||
+      ABSL_PREDICT_FALSE(!dest->Write(std::move(compressed_new_header))) ||
+      ABSL_PREDICT_FALSE(!dest->Write(std::move(data)))) {
+    return Fail(*dest);
+  }
+  return true;
+}
+
+}  // namespace riegeli
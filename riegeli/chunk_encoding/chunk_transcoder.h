@@ -0,0 +1,130 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_CHUNK_ENCODING_CHUNK_TRANSCODER_H_
+#define RIEGELI_CHUNK_ENCODING_CHUNK_TRANSCODER_H_
+
+#include <stdint.h>
+#include <utility>
+
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/object.h"
+#include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/writer.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/compressor_options.h"
+#include "riegeli/chunk_encoding/types.h"
+
+namespace riegeli {
+
+class ZstdDictionaryRegistry;
+
+// Changes compression of chunks without decoding their records.
+//
+// Each compressed stream of a chunk is decompressed and compressed again with
+// different CompressorOptions, while the rest of the chunk is kept. In
+// particular a transposed chunk keeps its buffers, buckets, and state machine,
+// so transcoding it is much cheaper than decoding its records and running
+// TransposeEncoder again. This makes it cheap to write files with fast
+// compression and to recompress them later, e.g. when they are archived.
+//
+// Simple, blocked simple, and transposed chunks are transcoded. Other chunks,
+// e.g. padding, metadata, and deduplicated chunks, are copied unchanged.
+//
+// A ChunkTranscoder is thread-compatible. Chunks can be transcoded in parallel
+// by separate ChunkTranscoders.
+class ChunkTranscoder : public Object {
+ public:
+  class Options {
+   public:
+    // Not defaulted because of a C++ defect:
+    // https://stackoverflow.com/questions/17430377
+    Options() noexcept {}
+
+    // Specifies the compression of transcoded chunks.
+    //
+    // Default: CompressorOptions()
+    Options& set_compressor_options(CompressorOptions compressor_options) & {
+      compressor_options_ = std::move(compressor_options);
+      return *this;
+    }
+    Options&& set_compressor_options(CompressorOptions compressor_options) && {
+      return std::move(set_compressor_options(std::move(compressor_options)));
+    }
+
+    // Specifies Zstd dictionaries used to decompress chunks compressed with a
+    // dictionary. The registry must be kept alive until the ChunkTranscoder is
+    // closed.
+    //
+    // If nullptr, transcoding such chunks fails.
+    //
+    // Default: nullptr
+    Options& set_zstd_dictionaries(
+        const ZstdDictionaryRegistry* zstd_dictionaries) & {
+      zstd_dictionaries_ = zstd_dictionaries;
+      return *this;
+    }
+    Options&& set_zstd_dictionaries(
+        const ZstdDictionaryRegistry* zstd_dictionaries) && {
+      return std::move(set_zstd_dictionaries(zstd_dictionaries));
+    }
+
+   private:
+    friend class ChunkTranscoder;
+
+    CompressorOptions compressor_options_;
+    const ZstdDictionaryRegistry* zstd_dictionaries_ = nullptr;
+  };
+
+  explicit ChunkTranscoder(Options options = Options());
+
+  ChunkTranscoder(const ChunkTranscoder&) = delete;
+  ChunkTranscoder& operator=(const ChunkTranscoder&) = delete;
+
+  // Sets *dest to src with compressed streams recompressed. The number of
+  // records and the decoded data are unchanged.
+  //
+  // A failure affects only this call: healthy() is restored by the next call.
+  //
+  // Return values:
+  //  * true  - success (*dest is set, healthy())
+  //  * false - failure (!healthy())
+  bool Transcode(const Chunk& src, Chunk* dest);
+
+ protected:
+  void Done() override {}
+
+ private:
+  // Each of these functions returns false with !healthy() on failure.
+
+  // Decompresses src compressed with compression_type to *dest.
+  bool Decompress(Chain src, CompressionType compression_type, Chain* dest);
+  // Compresses src with compressor_options_, writing to *dest.
+  bool Compress(Chain src, Writer* dest);
+  // Decompresses src compressed with compression_type, and writes it to *dest
+  // compressed with compressor_options_.
+  bool Recompress(Chain src, CompressionType compression_type, Writer* dest);
+
+  bool TranscodeSimple(ChunkType chunk_type, uint64_t num_records,
+                       Reader* src, Writer* dest);
+  bool TranscodeTransposed(Reader* src, Writer* dest);
+
+  CompressorOptions compressor_options_;
+  const ZstdDictionaryRegistry* zstd_dictionaries_;
+};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_CHUNK_ENCODING_CHUNK_TRANSCODER_H_
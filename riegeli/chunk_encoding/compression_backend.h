@@ -0,0 +1,63 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_CHUNK_ENCODING_COMPRESSION_BACKEND_H_
+#define RIEGELI_CHUNK_ENCODING_COMPRESSION_BACKEND_H_
+
+#include <string>
+
+#include "riegeli/base/chain.h"
+
+namespace riegeli {
+
+class CompressorOptions;
+
+// An alternative implementation of compression used for chunk data, e.g. one
+// which offloads compression to an accelerator device.
+//
+// A backend compresses whole buffers rather than streams: the Compressor
+// collects uncompressed data and hands them to the backend when the chunk is
+// encoded. The compressed output must be in the same format as produced by
+// the built-in compressor for options.compression_type(), so that it is read
+// back by the regular Decompressor; the backend only changes how it is
+// produced.
+//
+// Compress() may be called concurrently from multiple threads, e.g. by
+// RecordWriter with parallelism, which encodes several chunks at a time. This
+// lets a backend batch concurrent requests before submitting them to a device.
+class CompressionBackend {
+ public:
+  virtual ~CompressionBackend() = default;
+
+  // Returns true if the backend can compress with these options. Otherwise the
+  // built-in compressor is used.
+  //
+  // This must be thread-safe.
+  virtual bool Supports(const CompressorOptions& options) const = 0;
+
+  // Compresses src to *dest, with options for which Supports() returned true.
+  // *dest is empty on entry.
+  //
+  // This must be thread-safe.
+  //
+  // Return values:
+  //  * true  - success
+  //  * false - failure (*message is set)
+  virtual bool Compress(const CompressorOptions& options, const Chain& src,
+                        Chain* dest, std::string* message) const = 0;
+};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_CHUNK_ENCODING_COMPRESSION_BACKEND_H_
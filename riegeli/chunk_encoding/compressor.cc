@@ -14,20 +14,25 @@
 
 #include "riegeli/chunk_encoding/compressor.h"
 
+#include <stddef.h>
 #include <stdint.h>
 #include <new>
+#include <string>
 #include <utility>
 
 #include "absl/base/optimization.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
 #include "riegeli/base/memory.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
 #include "riegeli/bytes/brotli_writer.h"
 #include "riegeli/bytes/chain_writer.h"
+#include "riegeli/bytes/lz4_writer.h"
 #include "riegeli/bytes/writer.h"
 #include "riegeli/bytes/writer_utils.h"
 #include "riegeli/bytes/zstd_writer.h"
+#include "riegeli/chunk_encoding/compression_backend.h"
 #include "riegeli/chunk_encoding/compressor_options.h"
 #include "riegeli/chunk_encoding/types.h"
 
@@ -38,7 +43,16 @@ Compressor::Compressor(CompressorOptions options, uint64_t size_hint)
     : Object(State::kOpen),
       options_(std::move(options)),
       size_hint_(size_hint),
+      backend_(options_.compression_type() != CompressionType::kNone &&
+                       options_.backend() != nullptr &&
+                       options_.backend()->Supports(options_)
+                   ? options_.backend()
+                   : nullptr),
       compressed_writer_(&compressed_, GetChainWriterOptions()) {
+  if (backend_ != nullptr) {
+    writer_ = &compressed_writer_;
+    return;
+  }
   switch (options_.compression_type()) {
     case CompressionType::kNone:
       writer_ = &compressed_writer_;
@@ -53,6 +67,10 @@ Compressor::Compressor(CompressorOptions options, uint64_t size_hint)
           ZstdWriter(&compressed_writer_, GetZstdWriterOptions());
       writer_ = &zstd_writer_;
       return;
+    case CompressionType::kLz4:
+      new (&lz4_writer_) Lz4Writer(&compressed_writer_, GetLz4WriterOptions());
+      writer_ = &lz4_writer_;
+      return;
   }
   RIEGELI_ASSERT_UNREACHABLE()
       << "Unknown compression type: "
@@ -60,6 +78,7 @@ Compressor::Compressor(CompressorOptions options, uint64_t size_hint)
 }
 
 Compressor::~Compressor() {
+  if (backend_ != nullptr) return;
   switch (options_.compression_type()) {
     case CompressionType::kNone:
       return;
@@ -69,6 +88,9 @@ Compressor::~Compressor() {
     case CompressionType::kZstd:
       zstd_writer_.~ZstdWriter();
       return;
+    case CompressionType::kLz4:
+      lz4_writer_.~Lz4Writer();
+      return;
   }
   RIEGELI_ASSERT_UNREACHABLE()
       << "Unknown compression type: "
@@ -79,6 +101,7 @@ void Compressor::Reset() {
   MarkHealthy();
   compressed_.Clear();
   compressed_writer_ = ChainWriter(&compressed_, GetChainWriterOptions());
+  if (backend_ != nullptr) return;
   switch (options_.compression_type()) {
     case CompressionType::kNone:
       return;
@@ -89,6 +112,9 @@ void Compressor::Reset() {
     case CompressionType::kZstd:
       zstd_writer_ = ZstdWriter(&compressed_writer_, GetZstdWriterOptions());
       return;
+    case CompressionType::kLz4:
+      lz4_writer_ = Lz4Writer(&compressed_writer_, GetLz4WriterOptions());
+      return;
   }
   RIEGELI_ASSERT_UNREACHABLE()
       << "Unknown compression type: "
@@ -96,9 +122,12 @@ void Compressor::Reset() {
 }
 
 inline ChainWriter::Options Compressor::GetChainWriterOptions() const {
-  return ChainWriter::Options().set_size_hint(
-      options_.compression_type() == CompressionType::kNone ? size_hint_
-                                                            : uint64_t{0});
+  return ChainWriter::Options()
+      .set_size_hint(options_.compression_type() == CompressionType::kNone ||
+                             backend_ != nullptr
+                         ? size_hint_
+                         : uint64_t{0})
+      .set_max_block_size(options_.max_block_size());
 }
 
 inline BrotliWriter::Options Compressor::GetBrotliWriterOptions() const {
@@ -112,6 +141,14 @@ inline ZstdWriter::Options Compressor::GetZstdWriterOptions() const {
   return ZstdWriter::Options()
       .set_compression_level(options_.compression_level())
       .set_window_log(options_.window_log())
+      .set_dictionary(options_.zstd_dictionary())
+      .set_parallelism(options_.parallelism())
+      .set_size_hint(size_hint_);
+}
+
+inline Lz4Writer::Options Compressor::GetLz4WriterOptions() const {
+  return Lz4Writer::Options()
+      .set_compression_level(options_.compression_level())
       .set_size_hint(size_hint_);
 }
 
@@ -122,6 +159,7 @@ void Compressor::Done() {
 }
 
 inline void Compressor::CloseCompressor() {
+  if (backend_ != nullptr) return;
   switch (options_.compression_type()) {
     case CompressionType::kNone:
       return;
@@ -131,6 +169,9 @@ inline void Compressor::CloseCompressor() {
     case CompressionType::kZstd:
       if (ABSL_PREDICT_FALSE(!zstd_writer_.Close())) Fail(zstd_writer_);
       return;
+    case CompressionType::kLz4:
+      if (ABSL_PREDICT_FALSE(!lz4_writer_.Close())) Fail(lz4_writer_);
+      return;
   }
   RIEGELI_ASSERT_UNREACHABLE()
       << "Unknown compression type: "
@@ -141,6 +182,15 @@ bool Compressor::EncodeAndClose(Writer* dest) {
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
   const Position uncompressed_size = writer_->pos();
   if (ABSL_PREDICT_FALSE(!writer_->Close())) return Fail(*writer_);
+  if (backend_ != nullptr) {
+    Chain compressed;
+    std::string message;
+    if (ABSL_PREDICT_FALSE(!backend_->Compress(options_, compressed_,
+                                               &compressed, &message))) {
+      return Fail(message);
+    }
+    compressed_ = std::move(compressed);
+  }
   if (options_.compression_type() != CompressionType::kNone) {
     if (ABSL_PREDICT_FALSE(!compressed_writer_.Close())) {
       return Fail(compressed_writer_);
@@ -156,5 +206,32 @@ bool Compressor::EncodeAndClose(Writer* dest) {
   return Close();
 }
 
+void Compressor::AddUniqueTo(MemoryEstimator* memory_estimator) const {
+  // compressed_, compressed_writer_, and the active compressing Writer register
+  // their own sizes. They refer to each other, so they are registered as
+  // shared, which makes each of them counted once.
+  size_t subobjects_size = sizeof(Chain) + sizeof(ChainWriter);
+  switch (backend_ != nullptr ? CompressionType::kNone
+                              : options_.compression_type()) {
+    case CompressionType::kNone:
+      break;
+    case CompressionType::kBrotli:
+      subobjects_size += sizeof(BrotliWriter);
+      brotli_writer_.AddSharedTo(memory_estimator);
+      break;
+    case CompressionType::kZstd:
+      subobjects_size += sizeof(ZstdWriter);
+      zstd_writer_.AddSharedTo(memory_estimator);
+      break;
+    case CompressionType::kLz4:
+      subobjects_size += sizeof(Lz4Writer);
+      lz4_writer_.AddSharedTo(memory_estimator);
+      break;
+  }
+  memory_estimator->AddMemory(sizeof(Compressor) - subobjects_size);
+  compressed_writer_.AddSharedTo(memory_estimator);
+  compressed_.AddSharedTo(memory_estimator);
+}
+
 }  // namespace internal
 }  // namespace riegeli
@@ -20,11 +20,14 @@
 
 #include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
 #include "riegeli/bytes/brotli_writer.h"
 #include "riegeli/bytes/chain_writer.h"
+#include "riegeli/bytes/lz4_writer.h"
 #include "riegeli/bytes/writer.h"
 #include "riegeli/bytes/zstd_writer.h"
+#include "riegeli/chunk_encoding/compression_backend.h"
 #include "riegeli/chunk_encoding/compressor_options.h"
 #include "riegeli/chunk_encoding/types.h"
 
@@ -62,6 +65,10 @@ class Compressor final : public Object {
   //  * false - failure (!healthy())
   bool EncodeAndClose(Writer* dest);
 
+  // Registers this Compressor with MemoryEstimator, including compressed data
+  // accumulated so far and the state of the compression library.
+  void AddUniqueTo(MemoryEstimator* memory_estimator) const;
+
  protected:
   void Done() override;
 
@@ -69,11 +76,17 @@ class Compressor final : public Object {
   ChainWriter::Options GetChainWriterOptions() const;
   BrotliWriter::Options GetBrotliWriterOptions() const;
   ZstdWriter::Options GetZstdWriterOptions() const;
+  Lz4Writer::Options GetLz4WriterOptions() const;
 
   void CloseCompressor();
 
   CompressorOptions options_;
   uint64_t size_hint_ = 0;
+  // options_.backend() if it supports options_, otherwise nullptr.
+  //
+  // If not nullptr, compressed_ holds uncompressed data until EncodeAndClose(),
+  // and no member of the union below is active.
+  const CompressionBackend* backend_ = nullptr;
   Chain compressed_;
   // Invariant: compressed_writer_ writes to compressed_
   ChainWriter compressed_writer_;
@@ -82,14 +95,18 @@ class Compressor final : public Object {
   union {
     BrotliWriter brotli_writer_;
     ZstdWriter zstd_writer_;
+    Lz4Writer lz4_writer_;
   };
   // Invariants:
+  //   if backend_ != nullptr then writer_ == &compressed_writer_
   //   if options_.compression_type() == CompressionType::kNone
   //       then writer_ == &compressed_writer_
   //   if options_.compression_type() == CompressionType::kBrotli
   //       then writer_ == &brotli_writer_
   //   if options_.compression_type() == CompressionType::kZstd
   //       then writer_ == &zstd_writer_
+  //   if options_.compression_type() == CompressionType::kLz4
+  //       then writer_ == &lz4_writer_
   Writer* writer_;
 };
 
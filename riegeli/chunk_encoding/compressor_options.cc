@@ -21,6 +21,7 @@
 #include "riegeli/base/base.h"
 #include "riegeli/base/options_parser.h"
 #include "riegeli/bytes/brotli_writer.h"
+#include "riegeli/bytes/lz4_writer.h"
 #include "riegeli/bytes/zstd_writer.h"
 
 namespace riegeli {
@@ -32,25 +33,36 @@ bool CompressorOptions::Parse(absl::string_view text, std::string* message) {
     OptionsParser options_parser;
     options_parser.AddOption(
         "uncompressed",
-        ValueParser::And(ValueParser::FailIfSeen("brotli", "zstd"),
-                         [this](ValueParser* value_parser) {
-                           compression_type_ = CompressionType::kNone;
-                           return true;
-                         }));
+        ValueParser::And(
+            ValueParser::FailIfSeen("brotli", "zstd", "lz4"),
+            [this](ValueParser* value_parser) {
+              compression_type_ = CompressionType::kNone;
+              return true;
+            }));
     options_parser.AddOption(
         "brotli",
-        ValueParser::And(ValueParser::FailIfSeen("uncompressed", "zstd"),
-                         [this](ValueParser* value_parser) {
-                           compression_type_ = CompressionType::kBrotli;
-                           return true;
-                         }));
+        ValueParser::And(
+            ValueParser::FailIfSeen("uncompressed", "zstd", "lz4"),
+            [this](ValueParser* value_parser) {
+              compression_type_ = CompressionType::kBrotli;
+              return true;
+            }));
     options_parser.AddOption(
         "zstd",
-        ValueParser::And(ValueParser::FailIfSeen("uncompressed", "brotli"),
-                         [this](ValueParser* value_parser) {
-                           compression_type_ = CompressionType::kZstd;
-                           return true;
-                         }));
+        ValueParser::And(
+            ValueParser::FailIfSeen("uncompressed", "brotli", "lz4"),
+            [this](ValueParser* value_parser) {
+              compression_type_ = CompressionType::kZstd;
+              return true;
+            }));
+    options_parser.AddOption(
+        "lz4",
+        ValueParser::And(
+            ValueParser::FailIfSeen("uncompressed", "brotli", "zstd"),
+            [this](ValueParser* value_parser) {
+              compression_type_ = CompressionType::kLz4;
+              return true;
+            }));
     options_parser.AddOption("window_log",
                              [](ValueParser* value_parser) { return true; });
     if (ABSL_PREDICT_FALSE(!options_parser.Parse(text))) {
@@ -79,6 +91,17 @@ bool CompressorOptions::Parse(absl::string_view text, std::string* message) {
           ValueParser::Int(&compression_level_,
                            ZstdWriter::Options::kMinCompressionLevel(),
                            ZstdWriter::Options::kMaxCompressionLevel())));
+  options_parser.AddOption(
+      "lz4",
+      ValueParser::And(
+          ValueParser::FailIfSeen("window_log"),
+          ValueParser::Or(
+              ValueParser::Empty(
+                  &compression_level_,
+                  Lz4Writer::Options::kDefaultCompressionLevel()),
+              ValueParser::Int(&compression_level_,
+                               Lz4Writer::Options::kMinCompressionLevel(),
+                               Lz4Writer::Options::kMaxCompressionLevel()))));
   options_parser.AddOption("window_log", [&] {
     switch (compression_type_) {
       case CompressionType::kNone:
@@ -94,6 +117,8 @@ bool CompressorOptions::Parse(absl::string_view text, std::string* message) {
             ValueParser::Enum(&window_log_, {{"auto", kDefaultWindowLog()}}),
             ValueParser::Int(&window_log_, ZstdWriter::Options::kMinWindowLog(),
                              ZstdWriter::Options::kMaxWindowLog()));
+      case CompressionType::kLz4:
+        return ValueParser::FailIfSeen("lz4");
     }
     RIEGELI_ASSERT_UNREACHABLE() << "Unknown compression type: "
                                  << static_cast<unsigned>(compression_type_);
@@ -111,6 +136,10 @@ int CompressorOptions::window_log() const {
       RIEGELI_ASSERT_UNREACHABLE()
           << "Failed precondition of CompressorOptions::window_log(): "
              "uncompressed";
+    case CompressionType::kLz4:
+      RIEGELI_ASSERT_UNREACHABLE()
+          << "Failed precondition of CompressorOptions::window_log(): "
+             "lz4 has no window log";
     case CompressionType::kBrotli:
       if (window_log_ == kDefaultWindowLog()) {
         return BrotliWriter::Options::kDefaultWindowLog();
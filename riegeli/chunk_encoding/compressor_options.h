@@ -15,13 +15,18 @@
 #ifndef RIEGELI_CHUNK_ENCODING_COMPRESSOR_OPTIONS_H_
 #define RIEGELI_CHUNK_ENCODING_COMPRESSOR_OPTIONS_H_
 
+#include <stddef.h>
 #include <string>
 #include <utility>
 
 #include "absl/strings/string_view.h"
 #include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
 #include "riegeli/bytes/brotli_writer.h"
+#include "riegeli/bytes/lz4_writer.h"
+#include "riegeli/bytes/zstd_dictionary.h"
 #include "riegeli/bytes/zstd_writer.h"
+#include "riegeli/chunk_encoding/compression_backend.h"
 #include "riegeli/chunk_encoding/types.h"
 
 namespace riegeli {
@@ -39,9 +44,11 @@ class CompressorOptions {
   //     "uncompressed" |
   //     "brotli" (":" brotli_level)? |
   //     "zstd" (":" zstd_level)? |
+  //     "lz4" (":" lz4_level)? |
   //     "window_log" ":" window_log
   //   brotli_level ::= integer 0..11 (default 9)
   //   zstd_level ::= integer 1..22 (default 9)
+  //   lz4_level ::= integer 0..12 (default 0)
   //   window_log ::= "auto" or integer 10..31
   //
   // Return values:
@@ -119,6 +126,39 @@ class CompressorOptions {
     return std::move(set_zstd(compression_level));
   }
 
+  // Changes compression algorithm to LZ4. Sets compression level which tunes
+  // the tradeoff between compression density and compression speed (higher =
+  // better density but slower).
+  //
+  // LZ4 compresses less densely than Brotli and Zstd, but decompresses much
+  // faster.
+  //
+  // compression_level must be between kMinLz4() (0) and kMaxLz4() (12).
+  // Default: kDefaultLz4() (0).
+  static constexpr int kMinLz4() {
+    return Lz4Writer::Options::kMinCompressionLevel();
+  }
+  static constexpr int kMaxLz4() {
+    return Lz4Writer::Options::kMaxCompressionLevel();
+  }
+  static constexpr int kDefaultLz4() {
+    return Lz4Writer::Options::kDefaultCompressionLevel();
+  }
+  CompressorOptions& set_lz4(int compression_level = kDefaultLz4()) & {
+    RIEGELI_ASSERT_GE(compression_level, kMinLz4())
+        << "Failed precondition of CompressorOptions::set_lz4(): "
+           "compression level out of range";
+    RIEGELI_ASSERT_LE(compression_level, kMaxLz4())
+        << "Failed precondition of CompressorOptions::set_lz4(): "
+           "compression level out of range";
+    compression_type_ = CompressionType::kLz4;
+    compression_level_ = compression_level;
+    return *this;
+  }
+  CompressorOptions&& set_lz4(int compression_level = kDefaultLz4()) && {
+    return std::move(set_lz4(compression_level));
+  }
+
   CompressionType compression_type() const { return compression_type_; }
 
   int compression_level() const { return compression_level_; }
@@ -130,7 +170,7 @@ class CompressorOptions {
   // Special value kDefaultWindowLog() (-1) means to keep the default
   // (brotli: 22, zstd: derived from compression level and chunk size).
   //
-  // For uncompressed, window_log must be kDefaultWindowLog() (-1).
+  // For uncompressed and lz4, window_log must be kDefaultWindowLog() (-1).
   //
   // For brotli, window_log must be kDefaultWindowLog() (-1) or between
   // BrotliWriter::Options::kMinWindowLog() (10) and
@@ -169,13 +209,120 @@ class CompressorOptions {
 
   // Returns window_log translated for BrotliWriter or ZstdWriter.
   //
-  // Precondition: compression_type_ != CompressionType::kNone
+  // Precondition:
+  //   compression_type_ == CompressionType::kBrotli ||
+  //   compression_type_ == CompressionType::kZstd
   int window_log() const;
 
+  // Zstd dictionary to compress with if the compression algorithm is Zstd.
+  // This improves compression density of small chunks. The dictionary must be
+  // kept alive until compression is finished.
+  //
+  // Its id is stored in headers of compressed Zstd streams. Decompression must
+  // be given the same dictionary, e.g. in a ZstdDictionaryRegistry passed to
+  // ChunkDecoder::Options::set_zstd_dictionaries().
+  //
+  // If nullptr, no dictionary is used.
+  //
+  // Default: nullptr
+  CompressorOptions& set_zstd_dictionary(const ZstdDictionary* dictionary) & {
+    zstd_dictionary_ = dictionary;
+    return *this;
+  }
+  CompressorOptions&& set_zstd_dictionary(
+      const ZstdDictionary* dictionary) && {
+    return std::move(set_zstd_dictionary(dictionary));
+  }
+
+  const ZstdDictionary* zstd_dictionary() const { return zstd_dictionary_; }
+
+  // Maximal size of a block of compressed data buffered in memory. Compressed
+  // data of a chunk are made of such blocks, so larger blocks make hashing and
+  // writing the chunk faster, at the cost of allocating more memory ahead of
+  // data.
+  //
+  // Default: Chain::Options::kDefaultMaxBlockSize() (64K)
+  CompressorOptions& set_max_block_size(size_t max_block_size) & {
+    RIEGELI_ASSERT_GT(max_block_size, 0u)
+        << "Failed precondition of CompressorOptions::set_max_block_size(): "
+           "zero block size";
+    max_block_size_ = max_block_size;
+    return *this;
+  }
+  CompressorOptions&& set_max_block_size(size_t max_block_size) && {
+    return std::move(set_max_block_size(max_block_size));
+  }
+
+  size_t max_block_size() const { return max_block_size_; }
+
+  // Number of threads compressing a single chunk in parallel, in addition to
+  // the thread encoding the chunk. This reduces latency of encoding large
+  // chunks, e.g. a chunk cut off by each Flush().
+  //
+  // For zstd, parts of the compressed stream are compressed in parallel; this
+  // pays off for streams of several MB. For transposed chunks, buckets are
+  // compressed in parallel. Other cases are not affected.
+  //
+  // If 0, compression is done by the thread encoding the chunk.
+  //
+  // Default: 0
+  CompressorOptions& set_parallelism(int parallelism) & {
+    RIEGELI_ASSERT_GE(parallelism, 0)
+        << "Failed precondition of CompressorOptions::set_parallelism(): "
+           "negative parallelism";
+    parallelism_ = parallelism;
+    return *this;
+  }
+  CompressorOptions&& set_parallelism(int parallelism) && {
+    return std::move(set_parallelism(parallelism));
+  }
+
+  int parallelism() const { return parallelism_; }
+
+  // Alternative implementation of compression, e.g. offloading it to an
+  // accelerator device. It is used instead of the built-in compressor if its
+  // Supports() returns true for these options. The backend must be kept alive
+  // until compression is finished.
+  //
+  // The compressed format does not change, so decompression does not need the
+  // backend.
+  //
+  // If nullptr, the built-in compressor is always used.
+  //
+  // Default: nullptr
+  CompressorOptions& set_backend(const CompressionBackend* backend) & {
+    backend_ = backend;
+    return *this;
+  }
+  CompressorOptions&& set_backend(const CompressionBackend* backend) && {
+    return std::move(set_backend(backend));
+  }
+
+  const CompressionBackend* backend() const { return backend_; }
+
+  // Returns true if compression with both options works in the same way.
+  friend bool operator==(const CompressorOptions& a,
+                         const CompressorOptions& b) {
+    return a.compression_type_ == b.compression_type_ &&
+           a.compression_level_ == b.compression_level_ &&
+           a.window_log_ == b.window_log_ &&
+           a.zstd_dictionary_ == b.zstd_dictionary_ &&
+           a.max_block_size_ == b.max_block_size_ &&
+           a.parallelism_ == b.parallelism_ && a.backend_ == b.backend_;
+  }
+  friend bool operator!=(const CompressorOptions& a,
+                         const CompressorOptions& b) {
+    return !(a == b);
+  }
+
  private:
   CompressionType compression_type_ = CompressionType::kBrotli;
   int compression_level_ = kDefaultBrotli();
   int window_log_ = kDefaultWindowLog();
+  const ZstdDictionary* zstd_dictionary_ = nullptr;
+  size_t max_block_size_ = Chain::Options::kDefaultMaxBlockSize();
+  int parallelism_ = 0;
+  const CompressionBackend* backend_ = nullptr;
 };
 
 }  // namespace riegeli
@@ -14,25 +14,56 @@
 
 #include "riegeli/chunk_encoding/decompressor.h"
 
+#include <stddef.h>
 #include <stdint.h>
+#include <memory>
+#include <string>
 #include <utility>
 
 #include "absl/base/optimization.h"
 #include "absl/memory/memory.h"
 #include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
+#include "riegeli/base/recycling_pool.h"
 #include "riegeli/bytes/brotli_reader.h"
 #include "riegeli/bytes/chain_reader.h"
+#include "riegeli/bytes/lz4_reader.h"
 #include "riegeli/bytes/reader.h"
 #include "riegeli/bytes/reader_utils.h"
+#include "riegeli/bytes/zstd_dictionary.h"
 #include "riegeli/bytes/zstd_reader.h"
 #include "riegeli/chunk_encoding/types.h"
+#include "zstd.h"
 
 namespace riegeli {
 namespace internal {
 
+namespace {
+
+// The decompressed size is stored in front of compressed data, so the buffer
+// of a BufferedReader can be sized to hold all decompressed data. Then it is
+// filled by a single allocation, and reading the data as a Chain shares that
+// block instead of copying it.
+//
+// The size is capped because it is read from data which might be corrupted.
+constexpr uint64_t kMaxBufferSize = uint64_t{16} << 20;
+
+size_t BufferSize(uint64_t decompressed_size, size_t default_buffer_size) {
+  if (decompressed_size == 0) return default_buffer_size;
+  return IntCast<size_t>(UnsignedMin(decompressed_size, kMaxBufferSize));
+}
+
+struct ZSTD_DCtxDeleter {
+  void operator()(ZSTD_DCtx* ptr) const { ZSTD_freeDCtx(ptr); }
+};
+
+}  // namespace
+
 bool Decompressor::UncompressedSize(const Chain& compressed_data,
                                     CompressionType compression_type,
                                     uint64_t* uncompressed_size) {
@@ -45,12 +76,14 @@ bool Decompressor::UncompressedSize(const Chain& compressed_data,
 }
 
 Decompressor::Decompressor(std::unique_ptr<Reader> src,
-                           CompressionType compression_type)
-    : Decompressor(src.get(), compression_type) {
+                           CompressionType compression_type,
+                           const ZstdDictionaryRegistry* zstd_dictionaries)
+    : Decompressor(src.get(), compression_type, zstd_dictionaries) {
   owned_src_ = std::move(src);
 }
 
-Decompressor::Decompressor(Reader* src, CompressionType compression_type)
+Decompressor::Decompressor(Reader* src, CompressionType compression_type,
+                           const ZstdDictionaryRegistry* zstd_dictionaries)
     : Object(State::kOpen) {
   RIEGELI_ASSERT_NOTNULL(src);
   if (compression_type == CompressionType::kNone) {
@@ -70,7 +103,22 @@ Decompressor::Decompressor(Reader* src, CompressionType compression_type)
       reader_ = owned_reader_.get();
       return;
     case CompressionType::kZstd:
-      owned_reader_ = absl::make_unique<ZstdReader>(src);
+      if (DecompressZstdAtOnce(src, decompressed_size, zstd_dictionaries)) {
+        return;
+      }
+      owned_reader_ = absl::make_unique<ZstdReader>(
+          src, ZstdReader::Options()
+                   .set_dictionaries(zstd_dictionaries)
+                   .set_buffer_size(BufferSize(
+                       decompressed_size,
+                       ZstdReader::Options::kDefaultBufferSize())));
+      reader_ = owned_reader_.get();
+      return;
+    case CompressionType::kLz4:
+      owned_reader_ = absl::make_unique<Lz4Reader>(
+          src, Lz4Reader::Options().set_buffer_size(
+                   BufferSize(decompressed_size,
+                              Lz4Reader::Options::kDefaultBufferSize())));
       reader_ = owned_reader_.get();
       return;
   }
@@ -78,6 +126,86 @@ Decompressor::Decompressor(Reader* src, CompressionType compression_type)
                     static_cast<unsigned>(compression_type)));
 }
 
+bool Decompressor::DecompressZstdAtOnce(
+    Reader* src, uint64_t decompressed_size,
+    const ZstdDictionaryRegistry* zstd_dictionaries) {
+  // The whole compressed stream must be known to end where the source ends,
+  // and the decompressed size is capped because it might be corrupted.
+  if (decompressed_size > kMaxBufferSize || !src->SupportsRandomAccess()) {
+    return false;
+  }
+  Position src_size;
+  if (!src->Size(&src_size) || src_size < src->pos() ||
+      src_size - src->pos() > kMaxBufferSize) {
+    return false;
+  }
+  const size_t compressed_size = IntCast<size_t>(src_size - src->pos());
+  // If the compressed stream is flat in the buffer of src, it is used there.
+  absl::string_view compressed;
+  std::string scratch;
+  if (ABSL_PREDICT_FALSE(!src->Read(&compressed, &scratch, compressed_size))) {
+    if (!src->healthy()) {
+      Fail(*src);
+    } else {
+      Fail("Truncated Zstd-compressed data");
+    }
+    return true;
+  }
+  const RecyclingPool<ZSTD_DCtx, ZSTD_DCtxDeleter>::Handle decompressor =
+      RecyclingPool<ZSTD_DCtx, ZSTD_DCtxDeleter>::global().Get([] {
+        return std::unique_ptr<ZSTD_DCtx, ZSTD_DCtxDeleter>(ZSTD_createDCtx());
+      });
+  if (ABSL_PREDICT_FALSE(decompressor == nullptr)) {
+    Fail("ZSTD_createDCtx() failed");
+    return true;
+  }
+  Chain decompressed;
+  const absl::Span<char> buffer = decompressed.MakeAppendBuffer(
+      IntCast<size_t>(decompressed_size), IntCast<size_t>(decompressed_size));
+  size_t result;
+  const unsigned dictionary_id =
+      ZSTD_getDictID_fromFrame(compressed.data(), compressed.size());
+  if (dictionary_id == 0) {
+    // One-shot decompression resets the session, so a ZSTD_DCtx from the pool
+    // needs no other reset.
+    result = ZSTD_decompressDCtx(decompressor.get(), buffer.data(),
+                                 IntCast<size_t>(decompressed_size),
+                                 compressed.data(), compressed.size());
+  } else {
+    const ZstdDictionary* const dictionary =
+        zstd_dictionaries == nullptr ? nullptr
+                                     : zstd_dictionaries->Find(dictionary_id);
+    if (ABSL_PREDICT_FALSE(dictionary == nullptr)) {
+      Fail(absl::StrCat("Zstd dictionary not found: ", dictionary_id));
+      return true;
+    }
+    const ZSTD_DDict* const ddict =
+        dictionary->PrepareDecompressionDictionary();
+    if (ABSL_PREDICT_FALSE(ddict == nullptr)) {
+      Fail("ZSTD_createDDict_byReference() failed");
+      return true;
+    }
+    result = ZSTD_decompress_usingDDict(decompressor.get(), buffer.data(),
+                                        IntCast<size_t>(decompressed_size),
+                                        compressed.data(), compressed.size(),
+                                        ddict);
+  }
+  if (ABSL_PREDICT_FALSE(ZSTD_isError(result))) {
+    Fail(absl::StrCat("ZSTD_decompressDCtx() failed: ",
+                      ZSTD_getErrorName(result)));
+    return true;
+  }
+  if (ABSL_PREDICT_FALSE(result != decompressed_size)) {
+    Fail(absl::StrCat("Zstd-compressed data decompressed to ", result,
+                      " bytes instead of ", decompressed_size));
+    return true;
+  }
+  decompressed.RemoveSuffix(buffer.size() - result);
+  owned_reader_ = absl::make_unique<ChainReader>(std::move(decompressed));
+  reader_ = owned_reader_.get();
+  return true;
+}
+
 void Decompressor::Done() {
   if (owned_reader_ != nullptr) {
     if (ABSL_PREDICT_TRUE(healthy())) {
@@ -108,5 +236,13 @@ bool Decompressor::VerifyEndAndClose() {
   return Close();
 }
 
+void Decompressor::AddUniqueTo(MemoryEstimator* memory_estimator) const {
+  memory_estimator->AddMemory(sizeof(Decompressor));
+  // owned_reader_ reads from owned_src_ if it is present, so both are
+  // registered as shared.
+  if (owned_reader_ != nullptr) owned_reader_->AddSharedTo(memory_estimator);
+  if (owned_src_ != nullptr) owned_src_->AddSharedTo(memory_estimator);
+}
+
 }  // namespace internal
 }  // namespace riegeli
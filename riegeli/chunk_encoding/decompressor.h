@@ -21,8 +21,10 @@
 
 #include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
 #include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/zstd_dictionary.h"
 #include "riegeli/chunk_encoding/types.h"
 
 namespace riegeli {
@@ -52,7 +54,12 @@ class Decompressor final : public Object {
   //
   // If compression_type is not kNone, reads uncompressed size as a varint from
   // the beginning of compressed data.
-  Decompressor(std::unique_ptr<Reader> src, CompressionType compression_type);
+  //
+  // If compression_type is kZstd, zstd_dictionaries (if not nullptr) provide
+  // the dictionary named by the compressed stream, and must be kept alive until
+  // closing the Decompressor.
+  Decompressor(std::unique_ptr<Reader> src, CompressionType compression_type,
+               const ZstdDictionaryRegistry* zstd_dictionaries = nullptr);
 
   // Will read compressed stream from the byte Reader which is not owned by this
   // Decompressor and must be kept alive but not accessed until closing the
@@ -60,7 +67,12 @@ class Decompressor final : public Object {
   //
   // If compression_type is not kNone, reads uncompressed size as a varint from
   // the beginning of compressed data.
-  Decompressor(Reader* src, CompressionType compression_type);
+  //
+  // If compression_type is kZstd, zstd_dictionaries (if not nullptr) provide
+  // the dictionary named by the compressed stream, and must be kept alive until
+  // closing the Decompressor.
+  Decompressor(Reader* src, CompressionType compression_type,
+               const ZstdDictionaryRegistry* zstd_dictionaries = nullptr);
 
   Decompressor(Decompressor&& src) noexcept;
   Decompressor& operator=(Decompressor&& src) noexcept;
@@ -80,10 +92,26 @@ class Decompressor final : public Object {
   //                     or the Decompressor was not healthy before closing)
   bool VerifyEndAndClose();
 
+  // Registers this Decompressor with MemoryEstimator, including the state of
+  // the decompression library.
+  void AddUniqueTo(MemoryEstimator* memory_estimator) const;
+
  protected:
   void Done() override;
 
  private:
+  // If the compressed stream of src is available in memory, decompresses it
+  // with Zstd at once into a flat buffer of decompressed_size, avoiding the
+  // buffer management of a streaming ZstdReader, and makes reader_ read the
+  // result.
+  //
+  // Return values:
+  //  * true  - the stream was handled (reader_ is set, or !healthy())
+  //  * false - the stream should be decompressed with a ZstdReader; src is
+  //            unchanged
+  bool DecompressZstdAtOnce(Reader* src, uint64_t decompressed_size,
+                            const ZstdDictionaryRegistry* zstd_dictionaries);
+
   std::unique_ptr<Reader> owned_src_;
   std::unique_ptr<Reader> owned_reader_;
   Reader* reader_ = nullptr;
@@ -0,0 +1,207 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/chunk_encoding/deduplicating_encoder.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/bytes/chain_reader.h"
+#include "riegeli/bytes/chain_writer.h"
+#include "riegeli/bytes/writer.h"
+#include "riegeli/bytes/writer_utils.h"
+#include "riegeli/chunk_encoding/compressor.h"
+#include "riegeli/chunk_encoding/hash.h"
+#include "riegeli/chunk_encoding/types.h"
+
+namespace riegeli {
+
+DeduplicatingEncoder::DeduplicatingEncoder(
+    CompressorOptions options, std::unique_ptr<ChunkEncoder> base_encoder)
+    : options_(std::move(options)),
+      base_encoder_(std::move(base_encoder)),
+      references_compressor_(options_) {}
+
+void DeduplicatingEncoder::Done() {
+  // base_encoder_ is kept, so that Reset() can reuse it for the next chunk.
+  records_ = Chain();
+  limits_ = std::vector<size_t>();
+  record_indices_ = std::unordered_multimap<uint64_t, size_t>();
+  decoded_data_size_ = 0;
+  references_compressor_.Close();
+  ChunkEncoder::Done();
+}
+
+void DeduplicatingEncoder::Reset() {
+  ChunkEncoder::Reset();
+  base_encoder_->Reset();
+  records_.Clear();
+  limits_.clear();
+  record_indices_.clear();
+  decoded_data_size_ = 0;
+  references_compressor_.Reset();
+}
+
+bool DeduplicatingEncoder::AddRecord(absl::string_view record) {
+  return AddRecordImpl(record);
+}
+
+bool DeduplicatingEncoder::AddRecord(std::string&& record) {
+  return AddRecordImpl(std::move(record));
+}
+
+bool DeduplicatingEncoder::AddRecord(const Chain& record) {
+  return AddRecordImpl(record);
+}
+
+bool DeduplicatingEncoder::AddRecord(Chain&& record) {
+  return AddRecordImpl(std::move(record));
+}
+
+template <typename Record>
+bool DeduplicatingEncoder::DistinctRecordEquals(size_t index,
+                                                const Record& record) const {
+  const size_t begin = index == 0 ? size_t{0} : limits_[index - 1];
+  const size_t size = limits_[index] - begin;
+  if (size != record.size()) return false;
+  ChainReader records_reader(&records_);
+  Chain distinct_record;
+  records_reader.Seek(begin);
+  records_reader.Read(&distinct_record, size);
+  return distinct_record == record;
+}
+
+template <typename Record>
+bool DeduplicatingEncoder::AddRecordImpl(Record&& record) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(num_records_ ==
+                         UnsignedMin(limits_.max_size(),
+                                     std::numeric_limits<uint64_t>::max()))) {
+    return Fail("Too many records");
+  }
+  if (ABSL_PREDICT_FALSE(record.size() > std::numeric_limits<uint64_t>::max() -
+                                             decoded_data_size_)) {
+    return Fail("Decoded data size too large");
+  }
+  ++num_records_;
+  decoded_data_size_ += record.size();
+  const uint64_t hash = internal::Hash(record);
+  size_t index = limits_.size();
+  const auto candidates = record_indices_.equal_range(hash);
+  for (auto iter = candidates.first; iter != candidates.second; ++iter) {
+    if (DistinctRecordEquals(iter->second, record)) {
+      index = iter->second;
+      break;
+    }
+  }
+  if (index == limits_.size()) {
+    records_.Append(std::forward<Record>(record));
+    limits_.push_back(records_.size());
+    record_indices_.emplace(hash, index);
+  }
+  if (ABSL_PREDICT_FALSE(!WriteVarint64(references_compressor_.writer(),
+                                        IntCast<uint64_t>(index)))) {
+    return Fail(*references_compressor_.writer());
+  }
+  return true;
+}
+
+bool DeduplicatingEncoder::AddRecords(Chain records,
+                                      std::vector<size_t> limits) {
+  RIEGELI_ASSERT_EQ(limits.empty() ? 0u : limits.back(), records.size())
+      << "Failed precondition of ChunkEncoder::AddRecords(): "
+         "record end positions do not match concatenated record values";
+  ChainReader records_reader(&records);
+  for (const size_t limit : limits) {
+    Chain record;
+    records_reader.Read(&record, limit - IntCast<size_t>(records_reader.pos()));
+    if (ABSL_PREDICT_FALSE(!AddRecordImpl(std::move(record)))) return false;
+  }
+  return true;
+}
+
+bool DeduplicatingEncoder::EncodeAndClose(Writer* dest, uint64_t* num_records,
+                                          uint64_t* decoded_data_size) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  *num_records = num_records_;
+  *decoded_data_size = decoded_data_size_;
+
+  if (ABSL_PREDICT_FALSE(!WriteByte(
+          dest, static_cast<uint8_t>(options_.compression_type())))) {
+    return Fail(*dest);
+  }
+  Chain compressed_references;
+  ChainWriter compressed_references_writer(&compressed_references);
+  if (ABSL_PREDICT_FALSE(!references_compressor_.EncodeAndClose(
+          &compressed_references_writer))) {
+    return Fail(references_compressor_);
+  }
+  if (ABSL_PREDICT_FALSE(!compressed_references_writer.Close())) {
+    return Fail(compressed_references_writer);
+  }
+  if (ABSL_PREDICT_FALSE(!WriteVarint64(
+          dest, IntCast<uint64_t>(compressed_references.size()))) ||
+      ABSL_PREDICT_FALSE(!dest->Write(std::move(compressed_references))) ||
+      ABSL_PREDICT_FALSE(
+          !WriteVarint64(dest, IntCast<uint64_t>(limits_.size()))) ||
+      ABSL_PREDICT_FALSE(
+          !WriteVarint64(dest, IntCast<uint64_t>(records_.size()))) ||
+      ABSL_PREDICT_FALSE(!WriteByte(
+          dest, static_cast<uint8_t>(base_encoder_->GetChunkType())))) {
+    return Fail(*dest);
+  }
+
+  uint64_t base_num_records;
+  uint64_t base_decoded_data_size;
+  if (ABSL_PREDICT_FALSE(!base_encoder_->AddRecords(std::move(records_),
+                                                    std::move(limits_))) ||
+      ABSL_PREDICT_FALSE(!base_encoder_->EncodeAndClose(
+          dest, &base_num_records, &base_decoded_data_size))) {
+    Fail(*base_encoder_);
+  }
+  return Close();
+}
+
+ChunkType DeduplicatingEncoder::GetChunkType() const {
+  return ChunkType::kDeduplicated;
+}
+
+void DeduplicatingEncoder::AddUniqueTo(
+    MemoryEstimator* memory_estimator) const {
+  ChunkEncoder::AddUniqueTo(memory_estimator);
+  memory_estimator->AddMemory(sizeof(DeduplicatingEncoder) -
+                              sizeof(ChunkEncoder) - sizeof(Chain) -
+                              sizeof(internal::Compressor));
+  base_encoder_->AddUniqueTo(memory_estimator);
+  records_.AddUniqueTo(memory_estimator);
+  memory_estimator->AddMemory(sizeof(size_t) * limits_.capacity());
+  // Approximate memory of nodes and buckets of record_indices_.
+  memory_estimator->AddMemory(
+      (sizeof(std::pair<const uint64_t, size_t>) + 2 * sizeof(void*)) *
+          record_indices_.size() +
+      sizeof(void*) * record_indices_.bucket_count());
+  references_compressor_.AddUniqueTo(memory_estimator);
+}
+
+}  // namespace riegeli
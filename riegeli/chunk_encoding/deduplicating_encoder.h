@@ -0,0 +1,109 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_CHUNK_ENCODING_DEDUPLICATING_ENCODER_H_
+#define RIEGELI_CHUNK_ENCODING_DEDUPLICATING_ENCODER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/bytes/writer.h"
+#include "riegeli/chunk_encoding/chunk_encoder.h"
+#include "riegeli/chunk_encoding/compressor.h"
+#include "riegeli/chunk_encoding/compressor_options.h"
+#include "riegeli/chunk_encoding/types.h"
+
+namespace riegeli {
+
+// DeduplicatingEncoder stores each distinct record of a chunk once. Distinct
+// records are encoded by the base encoder, and each record is written as a
+// reference to its distinct record. This makes chunks of highly redundant
+// records (e.g. repeated log entries) smaller, and saves compressing the
+// repetitions.
+//
+// Records are recognized as identical by their hash, verified by comparing
+// their contents.
+//
+// Like DeferredEncoder, DeduplicatingEncoder passes records to the base
+// encoder in EncodeAndClose().
+//
+// Format of chunk data (ChunkType::kDeduplicated):
+//  - Compression type of references
+//  - Size of references (compressed), varint64
+//  - References (compressed): for each record, the index of its distinct
+//    record, varint64
+//  - Number of distinct records, varint64
+//  - Decoded size of distinct records, varint64
+//  - Chunk type of distinct records, ChunkType::kSimple or
+//    ChunkType::kTransposed
+//  - Chunk data of distinct records, without their chunk type
+class DeduplicatingEncoder : public ChunkEncoder {
+ public:
+  // Creates an empty DeduplicatingEncoder. References are compressed with
+  // options.
+  DeduplicatingEncoder(CompressorOptions options,
+                       std::unique_ptr<ChunkEncoder> base_encoder);
+
+  void Reset() override;
+
+  using ChunkEncoder::AddRecord;
+  bool AddRecord(absl::string_view record) override;
+  bool AddRecord(std::string&& record) override;
+  bool AddRecord(const Chain& record) override;
+  bool AddRecord(Chain&& record) override;
+
+  bool AddRecords(Chain records, std::vector<size_t> limits) override;
+
+  bool EncodeAndClose(Writer* dest, uint64_t* num_records,
+                      uint64_t* decoded_data_size) override;
+
+  ChunkType GetChunkType() const override;
+
+  void AddUniqueTo(MemoryEstimator* memory_estimator) const override;
+
+ protected:
+  void Done() override;
+
+ private:
+  template <typename Record>
+  bool AddRecordImpl(Record&& record);
+
+  // Returns true if the distinct record with this index is equal to record.
+  template <typename Record>
+  bool DistinctRecordEquals(size_t index, const Record& record) const;
+
+  CompressorOptions options_;
+  std::unique_ptr<ChunkEncoder> base_encoder_;
+  // Concatenated values of distinct records.
+  Chain records_;
+  // Sorted end positions of distinct records.
+  std::vector<size_t> limits_;
+  // Indices of distinct records in limits_, keyed by their hash.
+  std::unordered_multimap<uint64_t, size_t> record_indices_;
+  uint64_t decoded_data_size_ = 0;
+  // References to distinct records, written as varints.
+  internal::Compressor references_compressor_;
+};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_CHUNK_ENCODING_DEDUPLICATING_ENCODER_H_
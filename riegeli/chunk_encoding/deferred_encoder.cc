@@ -27,9 +27,11 @@
 #include "absl/strings/string_view.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/bytes/chain_reader.h"
 #include "riegeli/bytes/chain_writer.h"
 #include "riegeli/bytes/message_serialize.h"
+#include "riegeli/chunk_encoding/record_limits.h"
 #include "riegeli/chunk_encoding/types.h"
 
 namespace riegeli {
@@ -37,8 +39,7 @@ namespace riegeli {
 void DeferredEncoder::Done() {
   base_encoder_.reset();
   records_ = Chain();
-  records_writer_ = ChainWriter();
-  limits_ = std::vector<size_t>();
+  limits_ = RecordLimits();
   ChunkEncoder::Done();
 }
 
@@ -46,7 +47,6 @@ void DeferredEncoder::Reset() {
   ChunkEncoder::Reset();
   base_encoder_->Reset();
   records_.Clear();
-  records_writer_ = ChainWriter(&records_);
   limits_.clear();
 }
 
@@ -69,11 +69,22 @@ bool DeferredEncoder::AddRecord(const google::protobuf::MessageLite& record) {
                                      std::numeric_limits<uint64_t>::max()))) {
     return Fail("Too many records");
   }
+  if (ABSL_PREDICT_FALSE(size > std::numeric_limits<size_t>::max() -
+                                     records_.size())) {
+    return Fail("Decoded data size too large");
+  }
   ++num_records_;
-  if (ABSL_PREDICT_FALSE(!SerializePartialToWriter(record, &records_writer_))) {
-    return Fail(records_writer_);
+  ChainWriter records_writer(
+      &records_, ChainWriter::Options().set_size_hint(records_.size() + size));
+  // ByteSizeLong() above cached the sizes of the message and its submessages.
+  if (ABSL_PREDICT_FALSE(
+          !SerializePartialWithCachedSizesToWriter(record, &records_writer))) {
+    return Fail(records_writer);
+  }
+  if (ABSL_PREDICT_FALSE(!records_writer.Close())) {
+    return Fail(records_writer);
   }
-  limits_.push_back(IntCast<size_t>(records_writer_.pos()));
+  limits_.push_back(records_.size());
   return true;
 }
 
@@ -101,12 +112,15 @@ bool DeferredEncoder::AddRecordImpl(Record&& record) {
                                      std::numeric_limits<uint64_t>::max()))) {
     return Fail("Too many records");
   }
-  ++num_records_;
-  if (ABSL_PREDICT_FALSE(
-          !records_writer_.Write(std::forward<Record>(record)))) {
-    return Fail(records_writer_);
+  if (ABSL_PREDICT_FALSE(record.size() > std::numeric_limits<size_t>::max() -
+                                             records_.size())) {
+    return Fail("Decoded data size too large");
   }
-  limits_.push_back(IntCast<size_t>(records_writer_.pos()));
+  ++num_records_;
+  // Chain::Append() takes over std::string&& and blocks of Chain&& without
+  // copying, except for short records which are cheaper to copy.
+  records_.Append(std::forward<Record>(record));
+  limits_.push_back(records_.size());
   return true;
 }
 
@@ -121,29 +135,42 @@ bool DeferredEncoder::AddRecords(Chain records, std::vector<size_t> limits) {
                              num_records_)) {
     return Fail("Too many records");
   }
-  num_records_ += IntCast<uint64_t>(limits.size());
-  if (ABSL_PREDICT_FALSE(!records_writer_.Write(std::move(records)))) {
-    return Fail(records_writer_);
-  }
-  if (limits_.empty()) {
-    limits_ = std::move(limits);
-  } else {
-    const size_t base = limits_.back();
-    for (auto& limit : limits) limit += base;
-    limits_.insert(limits_.cend(), limits.begin(), limits.end());
+  if (ABSL_PREDICT_FALSE(records.size() > std::numeric_limits<size_t>::max() -
+                                              records_.size())) {
+    return Fail("Decoded data size too large");
   }
+  num_records_ += IntCast<uint64_t>(limits.size());
+  const size_t base = records_.size();
+  records_.Append(std::move(records));
+  for (const size_t limit : limits) limits_.push_back(base + limit);
   return true;
 }
 
 bool DeferredEncoder::EncodeAndClose(Writer* dest, uint64_t* num_records,
                                      uint64_t* decoded_data_size) {
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
-  if (ABSL_PREDICT_FALSE(!records_writer_.Close())) {
-    return Fail(records_writer_);
+  // Records are passed to the base encoder in batches, reading limits from
+  // their compact representation, so that limits of the whole chunk are never
+  // held as size_t. Values of each batch share blocks of records_.
+  static constexpr size_t kBatchSize = size_t{4} << 10;
+  ChainReader records_reader(&records_);
+  for (size_t begin = 0; begin < limits_.size(); begin += kBatchSize) {
+    const size_t end = begin + UnsignedMin(limits_.size() - begin, kBatchSize);
+    const size_t base = IntCast<size_t>(records_reader.pos());
+    std::vector<size_t> batch_limits;
+    batch_limits.reserve(end - begin);
+    for (size_t i = begin; i < end; ++i) {
+      batch_limits.push_back(limits_[i] - base);
+    }
+    Chain batch;
+    records_reader.Read(&batch, limits_[end - 1] - base);
+    if (ABSL_PREDICT_FALSE(!base_encoder_->AddRecords(
+            std::move(batch), std::move(batch_limits)))) {
+      Fail(*base_encoder_);
+      return Close();
+    }
   }
-  if (ABSL_PREDICT_FALSE(!base_encoder_->AddRecords(std::move(records_),
-                                                    std::move(limits_))) ||
-      ABSL_PREDICT_FALSE(!base_encoder_->EncodeAndClose(dest, num_records,
+  if (ABSL_PREDICT_FALSE(!base_encoder_->EncodeAndClose(dest, num_records,
                                                         decoded_data_size))) {
     Fail(*base_encoder_);
   }
@@ -154,4 +181,13 @@ ChunkType DeferredEncoder::GetChunkType() const {
   return base_encoder_->GetChunkType();
 }
 
+void DeferredEncoder::AddUniqueTo(MemoryEstimator* memory_estimator) const {
+  ChunkEncoder::AddUniqueTo(memory_estimator);
+  memory_estimator->AddMemory(sizeof(DeferredEncoder) - sizeof(ChunkEncoder) -
+                              sizeof(Chain));
+  base_encoder_->AddUniqueTo(memory_estimator);
+  records_.AddUniqueTo(memory_estimator);
+  limits_.AddUniqueTo(memory_estimator);
+}
+
 }  // namespace riegeli
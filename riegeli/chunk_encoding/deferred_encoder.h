@@ -25,16 +25,20 @@
 #include "google/protobuf/message_lite.h"
 #include "absl/strings/string_view.h"
 #include "riegeli/base/chain.h"
-#include "riegeli/bytes/chain_writer.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/bytes/writer.h"
 #include "riegeli/chunk_encoding/chunk_encoder.h"
+#include "riegeli/chunk_encoding/record_limits.h"
 #include "riegeli/chunk_encoding/types.h"
 
 namespace riegeli {
 
 // DeferredEncoder performs a minimal amount of the encoding work in
 // AddRecord(), deferring as much as possible to EncodeAndClose().
-// It does more memory copying than the base encoder though.
+//
+// Records passed as std::string&& or Chain&& are not copied: their ownership is
+// transferred to the concatenated record values, which are then passed to the
+// base encoder as a whole.
 class DeferredEncoder : public ChunkEncoder {
  public:
   explicit DeferredEncoder(std::unique_ptr<ChunkEncoder> base_encoder);
@@ -55,6 +59,8 @@ class DeferredEncoder : public ChunkEncoder {
 
   ChunkType GetChunkType() const override;
 
+  void AddUniqueTo(MemoryEstimator* memory_estimator) const override;
+
  protected:
   void Done() override;
 
@@ -65,20 +71,19 @@ class DeferredEncoder : public ChunkEncoder {
   std::unique_ptr<ChunkEncoder> base_encoder_;
   // Concatenated record values.
   Chain records_;
-  ChainWriter records_writer_;
   // Sorted record end positions.
   //
   // Invariant: limits_.size() == num_records_
-  std::vector<size_t> limits_;
+  RecordLimits limits_;
 
-  // Invariant: records_writer_.pos() == (limits_.empty() ? 0 : limits_.back())
+  // Invariant: records_.size() == (limits_.empty() ? 0 : limits_.back())
 };
 
 // Implementation details follow.
 
 inline DeferredEncoder::DeferredEncoder(
     std::unique_ptr<ChunkEncoder> base_encoder)
-    : base_encoder_(std::move(base_encoder)), records_writer_(&records_) {}
+    : base_encoder_(std::move(base_encoder)) {}
 
 }  // namespace riegeli
 
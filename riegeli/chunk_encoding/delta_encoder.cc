@@ -0,0 +1,288 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/chunk_encoding/delta_encoder.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <limits>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/bytes/chain_reader.h"
+#include "riegeli/bytes/chain_writer.h"
+#include "riegeli/bytes/writer.h"
+#include "riegeli/bytes/writer_utils.h"
+#include "riegeli/chunk_encoding/compressor.h"
+#include "riegeli/chunk_encoding/types.h"
+
+namespace riegeli {
+
+namespace {
+
+// Differing bytes separated by fewer equal bytes than this are joined into one
+// literal run, because a run costs at least two bytes of varints.
+constexpr size_t kMinCopy = 4;
+
+inline absl::string_view Flatten(absl::string_view record,
+                                 std::string*) {
+  return record;
+}
+
+inline absl::string_view Flatten(const std::string& record,
+                                 std::string*) {
+  return record;
+}
+
+inline absl::string_view Flatten(const Chain& record, std::string* scratch) {
+  scratch->clear();
+  record.AppendTo(scratch);
+  return *scratch;
+}
+
+}  // namespace
+
+DeltaEncoder::DeltaEncoder(CompressorOptions options,
+                           std::unique_ptr<ChunkEncoder> base_encoder)
+    : options_(std::move(options)),
+      base_encoder_(std::move(base_encoder)),
+      patches_compressor_(options_) {}
+
+void DeltaEncoder::Done() {
+  // base_encoder_ is kept, so that Reset() can reuse it for the next chunk.
+  decoded_data_size_ = 0;
+  base_decoded_data_size_ = 0;
+  previous_ = std::string();
+  record_scratch_ = std::string();
+  literals_ = std::string();
+  runs_ = std::vector<Run>();
+  patches_compressor_.Close();
+  ChunkEncoder::Done();
+}
+
+void DeltaEncoder::Reset() {
+  ChunkEncoder::Reset();
+  base_encoder_->Reset();
+  decoded_data_size_ = 0;
+  base_decoded_data_size_ = 0;
+  previous_.clear();
+  patches_compressor_.Reset();
+}
+
+bool DeltaEncoder::AddRecord(absl::string_view record) {
+  return AddRecordImpl(record);
+}
+
+bool DeltaEncoder::AddRecord(std::string&& record) {
+  return AddRecordImpl(std::move(record));
+}
+
+bool DeltaEncoder::AddRecord(const Chain& record) {
+  return AddRecordImpl(record);
+}
+
+bool DeltaEncoder::AddRecord(Chain&& record) {
+  return AddRecordImpl(std::move(record));
+}
+
+inline bool DeltaEncoder::FindPatch(absl::string_view record) {
+  runs_.clear();
+  if (previous_.empty()) return false;
+  const size_t common = UnsignedMin(record.size(), previous_.size());
+  // The patch costs the record size, the runs, the literal bytes, and the
+  // number of runs, which is added at the end.
+  size_t cost = LengthVarint64(IntCast<uint64_t>(record.size()));
+  // The cost of storing the record whole with its marker. Finding the patch
+  // stops when it can no longer be smaller.
+  const size_t max_cost = record.size() + 1;
+  size_t pos = 0;
+  size_t i = 0;
+  while (i < common) {
+    if (record[i] == previous_[i]) {
+      ++i;
+      continue;
+    }
+    const size_t begin = i;
+    size_t equal = 0;
+    while (i < common && equal < kMinCopy) {
+      if (record[i] == previous_[i]) {
+        ++equal;
+      } else {
+        equal = 0;
+      }
+      ++i;
+    }
+    const size_t end = i - equal;
+    runs_.push_back(Run{begin - pos, end - begin});
+    cost += LengthVarint64(IntCast<uint64_t>(begin - pos)) +
+            LengthVarint64(IntCast<uint64_t>(end - begin)) + (end - begin);
+    if (cost >= max_cost) return false;
+    pos = end;
+  }
+  if (record.size() > previous_.size()) {
+    // Bytes after the end of the previous record are literal.
+    if (!runs_.empty() && pos == previous_.size()) {
+      cost -= LengthVarint64(IntCast<uint64_t>(runs_.back().literal));
+      runs_.back().literal += record.size() - pos;
+      cost += LengthVarint64(IntCast<uint64_t>(runs_.back().literal));
+    } else {
+      runs_.push_back(
+          Run{previous_.size() - pos, record.size() - previous_.size()});
+      cost += LengthVarint64(IntCast<uint64_t>(previous_.size() - pos)) +
+              LengthVarint64(
+                  IntCast<uint64_t>(record.size() - previous_.size()));
+    }
+    cost += record.size() - previous_.size();
+  }
+  cost += LengthVarint64(IntCast<uint64_t>(runs_.size()) + 1);
+  return cost < max_cost;
+}
+
+inline bool DeltaEncoder::WritePatch(absl::string_view record) {
+  Writer* const patches_writer = patches_compressor_.writer();
+  if (ABSL_PREDICT_FALSE(!WriteVarint64(
+          patches_writer, IntCast<uint64_t>(runs_.size()) + 1)) ||
+      ABSL_PREDICT_FALSE(
+          !WriteVarint64(patches_writer, IntCast<uint64_t>(record.size())))) {
+    return Fail(*patches_writer);
+  }
+  literals_.clear();
+  size_t pos = 0;
+  for (const Run& run : runs_) {
+    if (ABSL_PREDICT_FALSE(
+            !WriteVarint64(patches_writer, IntCast<uint64_t>(run.copy))) ||
+        ABSL_PREDICT_FALSE(
+            !WriteVarint64(patches_writer, IntCast<uint64_t>(run.literal)))) {
+      return Fail(*patches_writer);
+    }
+    pos += run.copy;
+    literals_.append(record.data() + pos, run.literal);
+    pos += run.literal;
+  }
+  base_decoded_data_size_ += literals_.size();
+  if (ABSL_PREDICT_FALSE(
+          !base_encoder_->AddRecord(absl::string_view(literals_)))) {
+    return Fail(*base_encoder_);
+  }
+  return true;
+}
+
+template <typename Record>
+bool DeltaEncoder::AddRecordImpl(Record&& record) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(num_records_ ==
+                         std::numeric_limits<uint64_t>::max())) {
+    return Fail("Too many records");
+  }
+  if (ABSL_PREDICT_FALSE(record.size() > std::numeric_limits<uint64_t>::max() -
+                                             decoded_data_size_)) {
+    return Fail("Decoded data size too large");
+  }
+  ++num_records_;
+  decoded_data_size_ += record.size();
+  const absl::string_view flat = Flatten(record, &record_scratch_);
+  if (FindPatch(flat)) {
+    if (ABSL_PREDICT_FALSE(!WritePatch(flat))) return false;
+    previous_.assign(flat.data(), flat.size());
+    return true;
+  }
+  previous_.assign(flat.data(), flat.size());
+  Writer* const patches_writer = patches_compressor_.writer();
+  if (ABSL_PREDICT_FALSE(!WriteByte(patches_writer, uint8_t{0}))) {
+    return Fail(*patches_writer);
+  }
+  base_decoded_data_size_ += flat.size();
+  if (ABSL_PREDICT_FALSE(
+          !base_encoder_->AddRecord(std::forward<Record>(record)))) {
+    return Fail(*base_encoder_);
+  }
+  return true;
+}
+
+bool DeltaEncoder::AddRecords(Chain records, std::vector<size_t> limits) {
+  RIEGELI_ASSERT_EQ(limits.empty() ? 0u : limits.back(), records.size())
+      << "Failed precondition of ChunkEncoder::AddRecords(): "
+         "record end positions do not match concatenated record values";
+  ChainReader records_reader(&records);
+  for (const size_t limit : limits) {
+    Chain record;
+    records_reader.Read(&record, limit - IntCast<size_t>(records_reader.pos()));
+    if (ABSL_PREDICT_FALSE(!AddRecordImpl(std::move(record)))) return false;
+  }
+  return true;
+}
+
+bool DeltaEncoder::EncodeAndClose(Writer* dest, uint64_t* num_records,
+                                  uint64_t* decoded_data_size) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  *num_records = num_records_;
+  *decoded_data_size = decoded_data_size_;
+
+  if (ABSL_PREDICT_FALSE(!WriteByte(
+          dest, static_cast<uint8_t>(options_.compression_type())))) {
+    return Fail(*dest);
+  }
+  Chain compressed_patches;
+  ChainWriter compressed_patches_writer(&compressed_patches);
+  if (ABSL_PREDICT_FALSE(
+          !patches_compressor_.EncodeAndClose(&compressed_patches_writer))) {
+    return Fail(patches_compressor_);
+  }
+  if (ABSL_PREDICT_FALSE(!compressed_patches_writer.Close())) {
+    return Fail(compressed_patches_writer);
+  }
+  if (ABSL_PREDICT_FALSE(!WriteVarint64(
+          dest, IntCast<uint64_t>(compressed_patches.size()))) ||
+      ABSL_PREDICT_FALSE(!dest->Write(std::move(compressed_patches))) ||
+      ABSL_PREDICT_FALSE(!WriteVarint64(dest, base_decoded_data_size_)) ||
+      ABSL_PREDICT_FALSE(!WriteByte(
+          dest, static_cast<uint8_t>(base_encoder_->GetChunkType())))) {
+    return Fail(*dest);
+  }
+
+  uint64_t base_num_records;
+  uint64_t base_decoded_data_size;
+  if (ABSL_PREDICT_FALSE(!base_encoder_->EncodeAndClose(
+          dest, &base_num_records, &base_decoded_data_size))) {
+    return Fail(*base_encoder_);
+  }
+  RIEGELI_ASSERT_EQ(base_num_records, num_records_)
+      << "Base encoder of DeltaEncoder lost records";
+  RIEGELI_ASSERT_EQ(base_decoded_data_size, base_decoded_data_size_)
+      << "Base encoder of DeltaEncoder changed record sizes";
+  return Close();
+}
+
+ChunkType DeltaEncoder::GetChunkType() const { return ChunkType::kDelta; }
+
+void DeltaEncoder::AddUniqueTo(MemoryEstimator* memory_estimator) const {
+  ChunkEncoder::AddUniqueTo(memory_estimator);
+  memory_estimator->AddMemory(sizeof(DeltaEncoder) - sizeof(ChunkEncoder) -
+                              sizeof(internal::Compressor));
+  base_encoder_->AddUniqueTo(memory_estimator);
+  memory_estimator->AddMemory(previous_.capacity() +
+                              record_scratch_.capacity() +
+                              literals_.capacity());
+  memory_estimator->AddMemory(sizeof(Run) * runs_.capacity());
+  patches_compressor_.AddUniqueTo(memory_estimator);
+}
+
+}  // namespace riegeli
@@ -0,0 +1,129 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_CHUNK_ENCODING_DELTA_ENCODER_H_
+#define RIEGELI_CHUNK_ENCODING_DELTA_ENCODER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/bytes/writer.h"
+#include "riegeli/chunk_encoding/chunk_encoder.h"
+#include "riegeli/chunk_encoding/compressor.h"
+#include "riegeli/chunk_encoding/compressor_options.h"
+#include "riegeli/chunk_encoding/types.h"
+
+namespace riegeli {
+
+// DeltaEncoder stores a record which differs from the previous record of the
+// chunk only in a few places (e.g. a timestamp or a counter) as a patch: runs
+// of bytes copied from the previous record at the same positions, alternating
+// with runs of literal bytes. A patch is used when it is smaller than the
+// record. Literal bytes of patched records, and records stored whole, are
+// encoded by the base encoder as its records. This makes the data to compress
+// smaller, which saves compression time and finds repetitions across records
+// further apart than the compression window.
+//
+// Records are compared at the same positions, so a patch is not found if a
+// change of size moves the rest of the record, e.g. a varint field changing
+// its length.
+//
+// Format of chunk data (ChunkType::kDelta):
+//  - Compression type of patches
+//  - Size of patches (compressed), varint64
+//  - Patches (compressed): for each record:
+//    - 0 if the record is stored whole as its base record, or 1 + the number
+//      of runs if the record is patched, varint64
+//    - If patched:
+//      - Record size, varint64
+//      - For each run:
+//        - Number of bytes copied from the previous record, varint64
+//        - Number of bytes taken from the base record, varint64
+//      - Remaining bytes up to the record size are copied from the previous
+//        record as far as it extends, and the rest are taken from the base
+//        record
+//  - Decoded size of base records, varint64
+//  - Chunk type of base records, ChunkType::kSimple or ChunkType::kTransposed
+//  - Chunk data of base records, without their chunk type
+//
+// The base chunk has one record for each record: the record stored whole, or
+// the concatenated literal bytes of its patch.
+class DeltaEncoder : public ChunkEncoder {
+ public:
+  // Creates an empty DeltaEncoder. Patches are compressed with options.
+  DeltaEncoder(CompressorOptions options,
+               std::unique_ptr<ChunkEncoder> base_encoder);
+
+  void Reset() override;
+
+  using ChunkEncoder::AddRecord;
+  bool AddRecord(absl::string_view record) override;
+  bool AddRecord(std::string&& record) override;
+  bool AddRecord(const Chain& record) override;
+  bool AddRecord(Chain&& record) override;
+
+  bool AddRecords(Chain records, std::vector<size_t> limits) override;
+
+  bool EncodeAndClose(Writer* dest, uint64_t* num_records,
+                      uint64_t* decoded_data_size) override;
+
+  ChunkType GetChunkType() const override;
+
+  void AddUniqueTo(MemoryEstimator* memory_estimator) const override;
+
+ protected:
+  void Done() override;
+
+ private:
+  struct Run {
+    size_t copy;
+    size_t literal;
+  };
+
+  template <typename Record>
+  bool AddRecordImpl(Record&& record);
+
+  // Sets runs_ to the patch of record against previous_, and returns true if
+  // the patch is smaller than storing record whole.
+  bool FindPatch(absl::string_view record);
+
+  // Writes the patch in runs_ to patches_compressor_, and the literal bytes to
+  // base_encoder_.
+  bool WritePatch(absl::string_view record);
+
+  CompressorOptions options_;
+  std::unique_ptr<ChunkEncoder> base_encoder_;
+  uint64_t decoded_data_size_ = 0;
+  // Total size of records passed to base_encoder_.
+  uint64_t base_decoded_data_size_ = 0;
+  // The previous record of the chunk, or empty for the first record.
+  std::string previous_;
+  // Record flattened for comparing with previous_.
+  std::string record_scratch_;
+  // Concatenated literal bytes of a patch.
+  std::string literals_;
+  std::vector<Run> runs_;
+  // Patches, written as varints.
+  internal::Compressor patches_compressor_;
+};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_CHUNK_ENCODING_DELTA_ENCODER_H_
@@ -0,0 +1,211 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/chunk_encoding/field_projection.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
+#include "riegeli/base/base.h"
+#include "riegeli/bytes/reader_utils.h"
+#include "riegeli/chunk_encoding/field_filter.h"
+#include "riegeli/chunk_encoding/transpose_internal.h"
+
+namespace riegeli {
+
+namespace {
+
+inline bool ReadVarint(const char** cursor, const char* limit,
+                       uint64_t* value) {
+  if (ABSL_PREDICT_TRUE(PtrDistance(*cursor, limit) >= kMaxLengthVarint64())) {
+    return ReadVarint64(cursor, value);
+  }
+  uint64_t result = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (ABSL_PREDICT_FALSE(*cursor == limit)) return false;
+    const uint8_t byte = static_cast<uint8_t>(*(*cursor)++);
+    result |= (uint64_t{byte} & 0x7f) << shift;
+    if (byte < 0x80) {
+      *value = result;
+      return true;
+    }
+  }
+  return false;
+}
+
+inline bool ReadFixed(const char** cursor, const char* limit, size_t length,
+                      uint64_t* value) {
+  if (ABSL_PREDICT_FALSE(PtrDistance(*cursor, limit) < length)) return false;
+  *value = length == 4 ? uint64_t{internal::LoadLittleEndian32(*cursor)}
+                       : internal::LoadLittleEndian64(*cursor);
+  *cursor += length;
+  return true;
+}
+
+// Scans fields of a message in [*cursor, limit), appending values of fields
+// matching path to *column. If path is empty, the message is only skipped.
+//
+// If end_group_field is not 0, the message is a group which ends with an end
+// group tag with this field number. *cursor is set after that tag, and
+// *group_end (if not nullptr) is set to the beginning of that tag.
+bool ScanMessage(const char** cursor, const char* limit,
+                 uint32_t end_group_field, absl::Span<const uint32_t> path,
+                 FieldColumn* column, const char** group_end = nullptr) {
+  while (*cursor != limit) {
+    const char* const field_begin = *cursor;
+    uint64_t tag;
+    if (ABSL_PREDICT_FALSE(!ReadVarint(cursor, limit, &tag))) return false;
+    if (ABSL_PREDICT_FALSE(tag > std::numeric_limits<uint32_t>::max())) {
+      return false;
+    }
+    const uint32_t field = IntCast<uint32_t>(tag >> 3);
+    const bool matches = !path.empty() && field == path[0];
+    const bool leaf = matches && path.size() == 1;
+    switch (static_cast<internal::WireType>(tag & 7)) {
+      case internal::WireType::kVarint: {
+        uint64_t value;
+        if (ABSL_PREDICT_FALSE(!ReadVarint(cursor, limit, &value))) {
+          return false;
+        }
+        if (leaf) column->numbers.push_back(value);
+      } break;
+      case internal::WireType::kFixed32:
+      case internal::WireType::kFixed64: {
+        const size_t length = static_cast<internal::WireType>(tag & 7) ==
+                                      internal::WireType::kFixed32
+                                  ? size_t{4}
+                                  : size_t{8};
+        uint64_t value;
+        if (ABSL_PREDICT_FALSE(!ReadFixed(cursor, limit, length, &value))) {
+          return false;
+        }
+        if (leaf) column->numbers.push_back(value);
+      } break;
+      case internal::WireType::kLengthDelimited: {
+        uint64_t length;
+        if (ABSL_PREDICT_FALSE(!ReadVarint(cursor, limit, &length))) {
+          return false;
+        }
+        if (ABSL_PREDICT_FALSE(length > PtrDistance(*cursor, limit))) {
+          return false;
+        }
+        const char* const value_limit = *cursor + IntCast<size_t>(length);
+        if (leaf) {
+          column->strings.emplace_back(*cursor, IntCast<size_t>(length));
+        } else if (matches) {
+          const char* value_cursor = *cursor;
+          // A length-delimited field which is not a valid message is not a
+          // submessage on the path, e.g. a string with the same field number.
+          // Values found so far in it are dropped.
+          const size_t numbers_size = column->numbers.size();
+          const size_t strings_size = column->strings.size();
+          if (!ScanMessage(&value_cursor, value_limit, 0, path.subspan(1),
+                           column)) {
+            column->numbers.resize(numbers_size);
+            column->strings.resize(strings_size);
+          }
+        }
+        *cursor = value_limit;
+      } break;
+      case internal::WireType::kStartGroup: {
+        const char* const group_begin = *cursor;
+        const char* group_end;
+        if (ABSL_PREDICT_FALSE(
+                !ScanMessage(cursor, limit, field,
+                             matches && !leaf ? path.subspan(1)
+                                              : absl::Span<const uint32_t>(),
+                             column, &group_end))) {
+          return false;
+        }
+        if (leaf) {
+          column->strings.emplace_back(group_begin,
+                                       PtrDistance(group_begin, group_end));
+        }
+      } break;
+      case internal::WireType::kEndGroup:
+        if (ABSL_PREDICT_FALSE(end_group_field == 0 ||
+                               field != end_group_field)) {
+          return false;
+        }
+        if (group_end != nullptr) *group_end = field_begin;
+        return true;
+      default:
+        return false;
+    }
+  }
+  return end_group_field == 0;
+}
+
+}  // namespace
+
+bool ProjectField(const Field& field,
+                  absl::Span<const absl::string_view> records,
+                  FieldColumn* column) {
+  RIEGELI_ASSERT(!field.path().empty())
+      << "Failed precondition of ProjectField(): empty field path";
+  const absl::Span<const uint32_t> path(field.path().data(),
+                                        field.path().size());
+  column->number_limits.reserve(column->number_limits.size() + records.size());
+  column->string_limits.reserve(column->string_limits.size() + records.size());
+  for (const absl::string_view record : records) {
+    const size_t numbers_size = column->numbers.size();
+    const size_t strings_size = column->strings.size();
+    const char* cursor = record.data();
+    if (ABSL_PREDICT_FALSE(
+            !ScanMessage(&cursor, record.data() + record.size(), 0, path,
+                         column))) {
+      column->numbers.resize(numbers_size);
+      column->strings.resize(strings_size);
+      return false;
+    }
+    column->number_limits.push_back(column->numbers.size());
+    column->string_limits.push_back(column->strings.size());
+  }
+  return true;
+}
+
+void ExportToArrow(const FieldColumn& column, ArrowFieldColumn* dest) {
+  dest->Clear();
+  const size_t num_records = column.num_records();
+  dest->number_offsets.reserve(num_records + 1);
+  dest->number_offsets.push_back(0);
+  for (const size_t limit : column.number_limits) {
+    dest->number_offsets.push_back(IntCast<int64_t>(limit));
+  }
+  dest->numbers = column.numbers;
+  dest->string_list_offsets.reserve(num_records + 1);
+  dest->string_list_offsets.push_back(0);
+  for (const size_t limit : column.string_limits) {
+    dest->string_list_offsets.push_back(IntCast<int64_t>(limit));
+  }
+  size_t data_size = 0;
+  for (const absl::string_view string : column.strings) {
+    data_size += string.size();
+  }
+  dest->string_offsets.reserve(column.strings.size() + 1);
+  dest->string_offsets.push_back(0);
+  dest->string_data.reserve(data_size);
+  for (const absl::string_view string : column.strings) {
+    dest->string_data.append(string.data(), string.size());
+    dest->string_offsets.push_back(IntCast<int64_t>(dest->string_data.size()));
+  }
+}
+
+}  // namespace riegeli
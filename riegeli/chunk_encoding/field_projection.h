@@ -0,0 +1,131 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_CHUNK_ENCODING_FIELD_PROJECTION_H_
+#define RIEGELI_CHUNK_ENCODING_FIELD_PROJECTION_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
+#include "riegeli/chunk_encoding/field_filter.h"
+
+namespace riegeli {
+
+// Values of one proto field in a sequence of records, in record order.
+//
+// Values of record i are numbers[number_begin(i) .. number_limits[i]) and
+// strings[string_begin(i) .. string_limits[i]).
+struct FieldColumn {
+  // Resets the FieldColumn to no records.
+  void Clear();
+
+  // Returns the number of records.
+  size_t num_records() const { return number_limits.size(); }
+
+  size_t number_begin(size_t record_index) const {
+    return record_index == 0 ? size_t{0} : number_limits[record_index - 1];
+  }
+  size_t string_begin(size_t record_index) const {
+    return record_index == 0 ? size_t{0} : string_limits[record_index - 1];
+  }
+
+  // Values of varint, fixed32, and fixed64 occurrences of the field. Fixed32
+  // and fixed64 values are stored as their bits, zero-extended. Varint values
+  // are stored as on the wire, i.e. zigzag encoding of sint32 and sint64 is
+  // not undone.
+  std::vector<uint64_t> numbers;
+  // Values of length-delimited occurrences of the field (strings, bytes,
+  // submessages, and packed repeated fields), and contents of groups. They
+  // point into the records.
+  std::vector<absl::string_view> strings;
+  // Sorted end indices of numbers for each record.
+  std::vector<size_t> number_limits;
+  // Sorted end indices of strings for each record.
+  std::vector<size_t> string_limits;
+};
+
+// Extracts values of field from serialized proto messages, appending them to
+// *column, without parsing the messages.
+//
+// This is meant for reading a few fields of records written with
+// RecordWriter::Options::set_transpose(true): with
+// RecordReader::Options::set_field_filter() including the same fields, records
+// returned by RecordReader::ReadRecords() are reconstructed only from buckets
+// containing these fields, and are small, so extracting values of a field from
+// them is much cheaper than parsing them into proto messages.
+//
+// Occurrences of the field are found on every path matching field.path(),
+// e.g. in each element of a repeated submessage.
+//
+// Precondition: !field.path().empty()
+//
+// Return values:
+//  * true  - success
+//  * false - some record is not a valid serialized proto message (values of
+//            records before it are appended)
+bool ProjectField(const Field& field,
+                  absl::Span<const absl::string_view> records,
+                  FieldColumn* column);
+
+// Values of one proto field in a sequence of records, in the memory layout of
+// Apache Arrow arrays, so that an Arrow-based consumer can wrap the vectors as
+// Arrow buffers without copying or parsing records:
+//
+//  * number_offsets and numbers are the offsets and values of a
+//    LargeList<UInt64> array, with one list of numbers per record.
+//  * string_list_offsets, string_offsets, and string_data are the offsets of a
+//    LargeList<LargeBinary> array, the offsets of its LargeBinary child, and
+//    the data of that child, with one list of strings per record.
+//
+// Offsets have num_records + 1 elements, starting with 0. Arrays have no nulls:
+// a record without occurrences of the field has an empty list.
+struct ArrowFieldColumn {
+  // Resets the ArrowFieldColumn to no records.
+  void Clear();
+
+  std::vector<int64_t> number_offsets;
+  std::vector<uint64_t> numbers;
+  std::vector<int64_t> string_list_offsets;
+  std::vector<int64_t> string_offsets;
+  std::string string_data;
+};
+
+// Converts values of column to the layout of Arrow arrays. Strings are copied
+// into one contiguous buffer, which is the only copy of data made.
+void ExportToArrow(const FieldColumn& column, ArrowFieldColumn* dest);
+
+// Implementation details follow.
+
+inline void FieldColumn::Clear() {
+  numbers.clear();
+  strings.clear();
+  number_limits.clear();
+  string_limits.clear();
+}
+
+inline void ArrowFieldColumn::Clear() {
+  number_offsets.clear();
+  numbers.clear();
+  string_list_offsets.clear();
+  string_offsets.clear();
+  string_data.clear();
+}
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_CHUNK_ENCODING_FIELD_PROJECTION_H_
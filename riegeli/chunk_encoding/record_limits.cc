@@ -0,0 +1,108 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/chunk_encoding/record_limits.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/memory_estimator.h"
+
+namespace riegeli {
+
+namespace {
+
+// The number of sizes summed by AppendSizes() before checking the sum. Sizes
+// of a block are below 2^32 each, so their sum cannot overflow uint64_t.
+constexpr size_t kSizesBlock = 1024;
+
+}  // namespace
+
+void RecordLimits::Reset(size_t max_limit) {
+  const bool wide = max_limit > kMaxCompactLimit();
+  if (wide != wide_) {
+    if (wide) {
+      limits_ = std::vector<uint32_t>();
+    } else {
+      wide_limits_ = std::vector<size_t>();
+    }
+    wide_ = wide;
+  }
+  clear();
+}
+
+void RecordLimits::Widen() {
+  RIEGELI_ASSERT(!wide_)
+      << "Failed precondition of RecordLimits::Widen(): already wide";
+  wide_limits_.assign(limits_.begin(), limits_.end());
+  limits_ = std::vector<uint32_t>();
+  wide_ = true;
+}
+
+bool RecordLimits::AppendSizes(const uint64_t* sizes, size_t num_sizes,
+                               size_t max_limit) {
+  size_t limit = empty() ? size_t{0} : back();
+  if (ABSL_PREDICT_FALSE(limit > max_limit)) return false;
+  if (wide_ || max_limit > kMaxCompactLimit()) {
+    for (size_t i = 0; i < num_sizes; ++i) {
+      if (ABSL_PREDICT_FALSE(sizes[i] > max_limit - limit)) return false;
+      limit += IntCast<size_t>(sizes[i]);
+      push_back(limit);
+    }
+    return true;
+  }
+  // All limits fit in 32 bits. Limits are computed without branches, which
+  // lets the compiler unroll the loops, and since they only grow, checking
+  // the last limit of a block is enough.
+  const size_t old_size = limits_.size();
+  limits_.resize(old_size + num_sizes);
+  uint32_t* dest = limits_.data() + old_size;
+  uint64_t sum = limit;
+  while (num_sizes > 0) {
+    const size_t block_size = UnsignedMin(num_sizes, kSizesBlock);
+    uint64_t all_sizes = 0;
+    for (size_t i = 0; i < block_size; ++i) all_sizes |= sizes[i];
+    if (ABSL_PREDICT_FALSE(all_sizes > kMaxCompactLimit())) {
+      limits_.resize(old_size);
+      return false;
+    }
+    for (size_t i = 0; i < block_size; ++i) {
+      sum += sizes[i];
+      dest[i] = static_cast<uint32_t>(sum);
+    }
+    if (ABSL_PREDICT_FALSE(sum > max_limit)) {
+      limits_.resize(old_size);
+      return false;
+    }
+    sizes += block_size;
+    dest += block_size;
+    num_sizes -= block_size;
+  }
+  return true;
+}
+
+std::vector<size_t> RecordLimits::ToVector() const {
+  if (wide_) return wide_limits_;
+  return std::vector<size_t>(limits_.begin(), limits_.end());
+}
+
+void RecordLimits::AddUniqueTo(MemoryEstimator* memory_estimator) const {
+  memory_estimator->AddMemory(sizeof(uint32_t) * limits_.capacity() +
+                              sizeof(size_t) * wide_limits_.capacity());
+}
+
+}  // namespace riegeli
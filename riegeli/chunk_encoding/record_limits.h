@@ -0,0 +1,171 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_CHUNK_ENCODING_RECORD_LIMITS_H_
+#define RIEGELI_CHUNK_ENCODING_RECORD_LIMITS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/memory_estimator.h"
+
+namespace riegeli {
+
+// Record end positions of a chunk: the record with index i ends at position
+// (*this)[i] in concatenated record values, and begins where the previous
+// record ends, or at 0.
+//
+// Limits are stored as 32-bit offsets as long as they fit, i.e. as long as
+// concatenated record values are smaller than 4 GiB, which halves their memory
+// for chunks of many small records. Larger limits switch to size_t.
+class RecordLimits {
+ public:
+  RecordLimits() noexcept {}
+
+  RecordLimits(const RecordLimits& that) = default;
+  RecordLimits& operator=(const RecordLimits& that) = default;
+
+  RecordLimits(RecordLimits&& src) noexcept;
+  RecordLimits& operator=(RecordLimits&& src) noexcept;
+
+  // Removes all limits, keeping allocated memory.
+  void clear();
+
+  // Removes all limits, choosing the representation so that limits up to
+  // max_limit can be appended without converting it. Memory of the other
+  // representation is freed.
+  void Reset(size_t max_limit);
+
+  void reserve(size_t new_capacity);
+
+  bool empty() const { return size() == 0; }
+  size_t size() const { return wide_ ? wide_limits_.size() : limits_.size(); }
+  size_t max_size() const { return wide_limits_.max_size(); }
+
+  size_t operator[](size_t index) const;
+  size_t back() const;
+
+  // Appends a limit.
+  //
+  // Precondition: empty() || limit >= back()
+  void push_back(size_t limit);
+
+  // Replaces a limit.
+  //
+  // Precondition: limit <= back()
+  void set(size_t index, size_t limit);
+
+  // Appends limits of consecutive records with the given sizes, following the
+  // last limit: a prefix sum of sizes.
+  //
+  // Returns false if a limit would exceed max_limit, possibly having appended
+  // some limits.
+  bool AppendSizes(const uint64_t* sizes, size_t num_sizes, size_t max_limit);
+
+  // Returns limits as a vector of size_t, as expected by
+  // ChunkEncoder::AddRecords().
+  std::vector<size_t> ToVector() const;
+
+  // Returns true if limits are stored as 32-bit offsets.
+  bool compact() const { return !wide_; }
+
+  // Registers memory allocated for limits with MemoryEstimator.
+  void AddUniqueTo(MemoryEstimator* memory_estimator) const;
+
+ private:
+  static constexpr size_t kMaxCompactLimit() {
+    return size_t{std::numeric_limits<uint32_t>::max()};
+  }
+
+  // Converts limits_ to wide_limits_.
+  void Widen();
+
+  // If false, limits are stored in limits_. If true, in wide_limits_.
+  bool wide_ = false;
+  std::vector<uint32_t> limits_;
+  std::vector<size_t> wide_limits_;
+};
+
+// Implementation details follow.
+
+inline RecordLimits::RecordLimits(RecordLimits&& src) noexcept
+    : wide_(riegeli::exchange(src.wide_, false)),
+      limits_(std::move(src.limits_)),
+      wide_limits_(std::move(src.wide_limits_)) {}
+
+inline RecordLimits& RecordLimits::operator=(RecordLimits&& src) noexcept {
+  wide_ = riegeli::exchange(src.wide_, false);
+  limits_ = std::move(src.limits_);
+  wide_limits_ = std::move(src.wide_limits_);
+  return *this;
+}
+
+inline void RecordLimits::clear() {
+  limits_.clear();
+  wide_limits_.clear();
+}
+
+inline void RecordLimits::reserve(size_t new_capacity) {
+  if (wide_) {
+    wide_limits_.reserve(new_capacity);
+  } else {
+    limits_.reserve(new_capacity);
+  }
+}
+
+inline size_t RecordLimits::operator[](size_t index) const {
+  RIEGELI_ASSERT_LT(index, size())
+      << "Failed precondition of RecordLimits::operator[]: "
+         "index out of range";
+  return wide_ ? wide_limits_[index] : size_t{limits_[index]};
+}
+
+inline size_t RecordLimits::back() const {
+  RIEGELI_ASSERT(!empty())
+      << "Failed precondition of RecordLimits::back(): no limits";
+  return wide_ ? wide_limits_.back() : size_t{limits_.back()};
+}
+
+inline void RecordLimits::push_back(size_t limit) {
+  RIEGELI_ASSERT(empty() || limit >= back())
+      << "Failed precondition of RecordLimits::push_back(): "
+         "limits not sorted";
+  if (ABSL_PREDICT_FALSE(!wide_ && limit > kMaxCompactLimit())) Widen();
+  if (wide_) {
+    wide_limits_.push_back(limit);
+  } else {
+    limits_.push_back(IntCast<uint32_t>(limit));
+  }
+}
+
+inline void RecordLimits::set(size_t index, size_t limit) {
+  RIEGELI_ASSERT_LT(index, size())
+      << "Failed precondition of RecordLimits::set(): index out of range";
+  RIEGELI_ASSERT_LE(limit, back())
+      << "Failed precondition of RecordLimits::set(): limit too large";
+  if (wide_) {
+    wide_limits_[index] = limit;
+  } else {
+    limits_[index] = IntCast<uint32_t>(limit);
+  }
+}
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_CHUNK_ENCODING_RECORD_LIMITS_H_
@@ -16,31 +16,116 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <algorithm>
 #include <limits>
 #include <memory>
+#include <vector>
 
 #include "absl/base/optimization.h"
 #include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
 #include "riegeli/base/memory.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
+#include "riegeli/bytes/chain_reader.h"
 #include "riegeli/bytes/limiting_reader.h"
 #include "riegeli/bytes/reader.h"
 #include "riegeli/bytes/reader_utils.h"
+#include "riegeli/bytes/zstd_dictionary.h"
 #include "riegeli/chunk_encoding/decompressor.h"
+#include "riegeli/chunk_encoding/record_limits.h"
 #include "riegeli/chunk_encoding/types.h"
 
 namespace riegeli {
 
+namespace {
+
+// The number of record sizes decoded before accumulating them to limits.
+constexpr size_t kSizesBatch = 256;
+
+}  // namespace
+
 void SimpleDecoder::Done() {
   if (ABSL_PREDICT_FALSE(!values_decompressor_.Close())) {
     Fail(values_decompressor_);
   }
+  blocks_ = std::vector<Block>();
+  compressed_blocks_ = Chain();
 }
 
 bool SimpleDecoder::Reset(Reader* src, uint64_t num_records,
                           uint64_t decoded_data_size,
-                          std::vector<size_t>* limits) {
+                          const ZstdDictionaryRegistry* zstd_dictionaries,
+                          RecordLimits* limits) {
+  if (ABSL_PREDICT_FALSE(!ReadSizes(src, num_records, decoded_data_size,
+                                    zstd_dictionaries, limits))) {
+    return false;
+  }
+  values_decompressor_ =
+      internal::Decompressor(src, compression_type_, zstd_dictionaries);
+  if (ABSL_PREDICT_FALSE(!values_decompressor_.healthy())) {
+    return Fail(values_decompressor_);
+  }
+  return true;
+}
+
+bool SimpleDecoder::ResetBlocked(
+    Reader* src, uint64_t num_records, uint64_t decoded_data_size,
+    const ZstdDictionaryRegistry* zstd_dictionaries,
+    RecordLimits* limits) {
+  if (ABSL_PREDICT_FALSE(!ReadSizes(src, num_records, decoded_data_size,
+                                    zstd_dictionaries, limits))) {
+    return false;
+  }
+  uint64_t num_blocks;
+  if (ABSL_PREDICT_FALSE(!ReadVarint64(src, &num_blocks))) {
+    return Fail("Reading number of blocks failed", *src);
+  }
+  if (ABSL_PREDICT_FALSE(num_blocks > num_records)) {
+    return Fail("Too many blocks");
+  }
+  blocks_.reserve(IntCast<size_t>(num_blocks));
+  uint64_t end_index = 0;
+  Position compressed_limit = 0;
+  for (uint64_t i = 0; i < num_blocks; ++i) {
+    uint64_t block_num_records, compressed_size;
+    if (ABSL_PREDICT_FALSE(!ReadVarint64(src, &block_num_records)) ||
+        ABSL_PREDICT_FALSE(!ReadVarint64(src, &compressed_size))) {
+      return Fail("Reading block location failed", *src);
+    }
+    if (ABSL_PREDICT_FALSE(block_num_records == 0 ||
+                           block_num_records > num_records - end_index)) {
+      return Fail("Invalid number of records in a block");
+    }
+    if (ABSL_PREDICT_FALSE(compressed_size >
+                           std::numeric_limits<size_t>::max() -
+                               compressed_limit)) {
+      return Fail("Compressed blocks too large");
+    }
+    end_index += block_num_records;
+    compressed_limit += compressed_size;
+    blocks_.push_back(Block{end_index,
+                            (*limits)[IntCast<size_t>(end_index - 1)],
+                            compressed_limit});
+  }
+  if (ABSL_PREDICT_FALSE(end_index != num_records)) {
+    return Fail("Blocks do not cover all records");
+  }
+  if (ABSL_PREDICT_FALSE(!src->Read(&compressed_blocks_,
+                                    IntCast<size_t>(compressed_limit)))) {
+    return Fail("Reading compressed blocks failed", *src);
+  }
+  return true;
+}
+
+inline bool SimpleDecoder::ReadSizes(
+    Reader* src, uint64_t num_records, uint64_t decoded_data_size,
+    const ZstdDictionaryRegistry* zstd_dictionaries,
+    RecordLimits* limits) {
   MarkHealthy();
+  zstd_dictionaries_ = zstd_dictionaries;
+  blocks_.clear();
+  compressed_blocks_.Clear();
   if (ABSL_PREDICT_FALSE(num_records > limits->max_size())) {
     return Fail("Too many records");
   }
@@ -48,44 +133,86 @@ bool SimpleDecoder::Reset(Reader* src, uint64_t num_records,
                          std::numeric_limits<size_t>::max())) {
     return Fail("Records too large");
   }
+  limits->Reset(IntCast<size_t>(decoded_data_size));
 
   uint8_t compression_type_byte;
   if (ABSL_PREDICT_FALSE(!ReadByte(src, &compression_type_byte))) {
     return Fail("Reading compression type failed", *src);
   }
-  const CompressionType compression_type =
-      static_cast<CompressionType>(compression_type_byte);
+  compression_type_ = static_cast<CompressionType>(compression_type_byte);
 
   uint64_t sizes_size;
   if (ABSL_PREDICT_FALSE(!ReadVarint64(src, &sizes_size))) {
     return Fail("Reading size of sizes failed", *src);
   }
 
+  if (sizes_size == 0 && num_records > 0) {
+    // All records have the same size, stored once.
+    uint64_t size;
+    if (ABSL_PREDICT_FALSE(!ReadVarint64(src, &size))) {
+      return Fail("Reading record size failed", *src);
+    }
+    if (ABSL_PREDICT_FALSE(
+            size == 0 ? decoded_data_size != 0
+                      : decoded_data_size % num_records != 0 ||
+                            decoded_data_size / num_records != size)) {
+      return Fail("Decoded data size does not match record sizes");
+    }
+    const size_t record_size = IntCast<size_t>(size);
+    limits->reserve(IntCast<size_t>(num_records));
+    for (size_t i = 0; i < IntCast<size_t>(num_records); ++i) {
+      limits->push_back((i + 1) * record_size);
+    }
+    return true;
+  }
+
   if (ABSL_PREDICT_FALSE(sizes_size >
                          std::numeric_limits<Position>::max() - src->pos())) {
     return Fail("Size of sizes too large");
   }
   LimitingReader compressed_sizes_reader(src, src->pos() + sizes_size);
-  internal::Decompressor sizes_decompressor(&compressed_sizes_reader,
-                                            compression_type);
+  internal::Decompressor sizes_decompressor(
+      &compressed_sizes_reader, compression_type_, zstd_dictionaries);
   if (ABSL_PREDICT_FALSE(!sizes_decompressor.healthy())) {
     compressed_sizes_reader.Close();
     return Fail(sizes_decompressor);
   }
-  limits->clear();
-  size_t limit = 0;
-  while (limits->size() != num_records) {
-    uint64_t size;
-    if (ABSL_PREDICT_FALSE(!ReadVarint64(sizes_decompressor.reader(), &size))) {
+  limits->reserve(IntCast<size_t>(num_records));
+  // Record sizes are decoded in batches, and then accumulated to limits by a
+  // prefix sum, which keeps both loops tight.
+  Reader* const sizes_reader = sizes_decompressor.reader();
+  uint64_t sizes[kSizesBatch];
+  uint64_t remaining = num_records;
+  while (remaining > 0) {
+    const size_t batch_size =
+        IntCast<size_t>(UnsignedMin(remaining, uint64_t{kSizesBatch}));
+    size_t i = 0;
+    while (i < batch_size) {
+      if (ABSL_PREDICT_TRUE(sizes_reader->available() >=
+                            kMaxLengthVarint64())) {
+        // Decode from the buffer directly while a whole varint fits there.
+        const char* cursor = sizes_reader->cursor();
+        const char* const safe_limit =
+            sizes_reader->limit() - kMaxLengthVarint64();
+        bool ok;
+        do {
+          ok = ReadVarint64(&cursor, &sizes[i++]);
+        } while (ABSL_PREDICT_TRUE(ok) && i < batch_size &&
+                 cursor <= safe_limit);
+        sizes_reader->set_cursor(cursor);
+        if (ABSL_PREDICT_TRUE(ok)) continue;
+      } else if (ABSL_PREDICT_TRUE(ReadVarint64(sizes_reader, &sizes[i++]))) {
+        continue;
+      }
       compressed_sizes_reader.Close();
-      return Fail("Reading record size failed", *sizes_decompressor.reader());
+      return Fail("Reading record size failed", *sizes_reader);
     }
-    if (ABSL_PREDICT_FALSE(size > decoded_data_size - limit)) {
+    if (ABSL_PREDICT_FALSE(!limits->AppendSizes(
+            sizes, batch_size, IntCast<size_t>(decoded_data_size)))) {
       compressed_sizes_reader.Close();
       return Fail("Decoded data size larger than expected");
     }
-    limit += IntCast<size_t>(size);
-    limits->push_back(limit);
+    remaining -= batch_size;
   }
   if (ABSL_PREDICT_FALSE(!sizes_decompressor.VerifyEndAndClose())) {
     compressed_sizes_reader.Close();
@@ -94,13 +221,65 @@ bool SimpleDecoder::Reset(Reader* src, uint64_t num_records,
   if (ABSL_PREDICT_FALSE(!compressed_sizes_reader.VerifyEndAndClose())) {
     return Fail(compressed_sizes_reader);
   }
-  if (ABSL_PREDICT_FALSE(limit != decoded_data_size)) {
+  if (ABSL_PREDICT_FALSE(
+          (limits->empty() ? size_t{0} : limits->back()) !=
+          decoded_data_size)) {
     return Fail("Decoded data size smaller than expected");
   }
+  return true;
+}
 
-  values_decompressor_ = internal::Decompressor(src, compression_type);
-  if (ABSL_PREDICT_FALSE(!values_decompressor_.healthy())) {
-    return Fail(values_decompressor_);
+size_t SimpleDecoder::FindBlock(uint64_t index, uint64_t* begin_index,
+                                uint64_t* end_index) const {
+  RIEGELI_ASSERT(healthy())
+      << "Failed precondition of SimpleDecoder::FindBlock(): " << message();
+  RIEGELI_ASSERT(!blocks_.empty() && index < blocks_.back().end_index)
+      << "Failed precondition of SimpleDecoder::FindBlock(): "
+         "record index out of range";
+  const std::vector<Block>::const_iterator block = std::upper_bound(
+      blocks_.begin(), blocks_.end(), index,
+      [](uint64_t index, const Block& block) {
+        return index < block.end_index;
+      });
+  *begin_index =
+      block == blocks_.begin() ? uint64_t{0} : (block - 1)->end_index;
+  *end_index = block->end_index;
+  return IntCast<size_t>(block - blocks_.begin());
+}
+
+bool SimpleDecoder::ReadBlock(size_t block, Chain* dest) {
+  RIEGELI_ASSERT(healthy())
+      << "Failed precondition of SimpleDecoder::ReadBlock(): " << message();
+  RIEGELI_ASSERT_LT(block, blocks_.size())
+      << "Failed precondition of SimpleDecoder::ReadBlock(): "
+         "block index out of range";
+  const size_t values_start =
+      block == 0 ? size_t{0} : blocks_[block - 1].values_limit;
+  const Position compressed_start =
+      block == 0 ? Position{0} : blocks_[block - 1].compressed_limit;
+  ChainReader compressed_blocks_reader(&compressed_blocks_);
+  if (!compressed_blocks_reader.Seek(compressed_start)) {
+    RIEGELI_ASSERT_UNREACHABLE()
+        << "Seeking compressed blocks failed: "
+        << compressed_blocks_reader.message();
+  }
+  LimitingReader compressed_block_reader(&compressed_blocks_reader,
+                                         blocks_[block].compressed_limit);
+  internal::Decompressor block_decompressor(
+      &compressed_block_reader, compression_type_, zstd_dictionaries_);
+  if (ABSL_PREDICT_FALSE(!block_decompressor.healthy())) {
+    return Fail(block_decompressor);
+  }
+  dest->Clear();
+  if (ABSL_PREDICT_FALSE(!block_decompressor.reader()->Read(
+          dest, blocks_[block].values_limit - values_start))) {
+    return Fail("Reading record values failed", *block_decompressor.reader());
+  }
+  if (ABSL_PREDICT_FALSE(!block_decompressor.VerifyEndAndClose())) {
+    return Fail(block_decompressor);
+  }
+  if (ABSL_PREDICT_FALSE(!compressed_block_reader.VerifyEndAndClose())) {
+    return Fail(compressed_block_reader);
   }
   return true;
 }
@@ -112,4 +291,12 @@ bool SimpleDecoder::VerifyEndAndClose() {
   return Close();
 }
 
+void SimpleDecoder::AddUniqueTo(MemoryEstimator* memory_estimator) const {
+  memory_estimator->AddMemory(sizeof(SimpleDecoder) -
+                              sizeof(internal::Decompressor) - sizeof(Chain));
+  values_decompressor_.AddUniqueTo(memory_estimator);
+  memory_estimator->AddMemory(sizeof(Block) * blocks_.capacity());
+  compressed_blocks_.AddUniqueTo(memory_estimator);
+}
+
 }  // namespace riegeli
@@ -20,9 +20,14 @@
 #include <vector>
 
 #include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
 #include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/zstd_dictionary.h"
 #include "riegeli/chunk_encoding/decompressor.h"
+#include "riegeli/chunk_encoding/record_limits.h"
+#include "riegeli/chunk_encoding/types.h"
 
 namespace riegeli {
 
@@ -38,20 +43,61 @@ class SimpleDecoder final : public Object {
   // Makes concatenated record values available for reading from reader().
   // Sets *limits to sorted record end positions.
   //
-  // src is not owned by this SimpleDecoder and must be kept alive but not
-  // accessed until closing the SimpleDecoder.
+  // zstd_dictionaries (if not nullptr) provide Zstd dictionaries named by
+  // compressed buffers.
+  //
+  // src and zstd_dictionaries are not owned by this SimpleDecoder and must be
+  // kept alive but not accessed until closing the SimpleDecoder.
   //
   // Return values:
   //  * true  - success (healthy())
   //  * false - failure (!healthy())
   bool Reset(Reader* src, uint64_t num_records, uint64_t decoded_data_size,
-             std::vector<size_t>* limits);
+             const ZstdDictionaryRegistry* zstd_dictionaries,
+             RecordLimits* limits);
+
+  // Resets the SimpleDecoder and parses a chunk with blocks of record values
+  // compressed independently (ChunkType::kBlockedSimple). Reads src to its
+  // end, keeping compressed blocks to be decompressed by ReadBlock().
+  //
+  // Sets *limits to sorted record end positions.
+  //
+  // zstd_dictionaries (if not nullptr) provide Zstd dictionaries named by
+  // compressed buffers. They are not owned by this SimpleDecoder and must be
+  // kept alive until closing the SimpleDecoder.
+  //
+  // Return values:
+  //  * true  - success (healthy())
+  //  * false - failure (!healthy())
+  bool ResetBlocked(Reader* src, uint64_t num_records,
+                    uint64_t decoded_data_size,
+                    const ZstdDictionaryRegistry* zstd_dictionaries,
+                    RecordLimits* limits);
 
   // Returns the Reader from which concatenated record values should be read.
   //
-  // Precondition: healthy()
+  // Precondition: healthy(), and the SimpleDecoder was reset by Reset()
   Reader* reader() const;
 
+  // Returns the index of the block containing the record with the given index,
+  // and sets *begin_index and *end_index to the range of record indices of the
+  // block.
+  //
+  // Precondition: healthy(), the SimpleDecoder was reset by ResetBlocked(), and
+  // index < num_records
+  size_t FindBlock(uint64_t index, uint64_t* begin_index,
+                   uint64_t* end_index) const;
+
+  // Decompresses concatenated record values of the given block, replacing
+  // *dest.
+  //
+  // Precondition: healthy(), and block was returned by FindBlock()
+  //
+  // Return values:
+  //  * true  - success (healthy())
+  //  * false - failure (!healthy())
+  bool ReadBlock(size_t block, Chain* dest);
+
   // Verifies that the concatenated record values end at the current position,
   // failing the SimpleDecoder if not. Closes the SimpleDecoder.
   //
@@ -62,11 +108,36 @@ class SimpleDecoder final : public Object {
   //            position or the SimpleDecoder was not healthy before closing)
   bool VerifyEndAndClose();
 
+  // Registers this SimpleDecoder with MemoryEstimator, including compressed
+  // blocks kept by ResetBlocked().
+  void AddUniqueTo(MemoryEstimator* memory_estimator) const;
+
  protected:
   void Done() override;
 
  private:
+  // Location of a compressed block of record values.
+  struct Block {
+    // Index of the record after the block.
+    uint64_t end_index;
+    // Position after record values of the block.
+    size_t values_limit;
+    // Position in compressed_blocks_ after the compressed block.
+    Position compressed_limit;
+  };
+
+  // Reads the compression type and record sizes, common to Reset() and
+  // ResetBlocked().
+  bool ReadSizes(Reader* src, uint64_t num_records, uint64_t decoded_data_size,
+                 const ZstdDictionaryRegistry* zstd_dictionaries,
+                 RecordLimits* limits);
+
+  CompressionType compression_type_ = CompressionType::kNone;
+  const ZstdDictionaryRegistry* zstd_dictionaries_ = nullptr;
   internal::Decompressor values_decompressor_;
+  // Used only after ResetBlocked().
+  std::vector<Block> blocks_;
+  Chain compressed_blocks_;
 };
 
 // Implementation details follow.
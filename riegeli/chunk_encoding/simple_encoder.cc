@@ -16,6 +16,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <algorithm>
 #include <limits>
 #include <memory>
 #include <string>
@@ -26,10 +27,13 @@
 #include "absl/base/optimization.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/string_view.h"
+#include "absl/types/span.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/memory.h"
 #include "riegeli/base/object.h"
+#include "riegeli/bytes/chain_reader.h"
 #include "riegeli/bytes/chain_writer.h"
 #include "riegeli/bytes/message_serialize.h"
 #include "riegeli/bytes/writer.h"
@@ -39,21 +43,103 @@
 
 namespace riegeli {
 
+namespace {
+
+// The number of record sizes collected on the stack to be written in bulk.
+constexpr size_t kSizesBatch = 256;
+
+}  // namespace
+
 SimpleEncoder::SimpleEncoder(CompressorOptions options, uint64_t size_hint)
+    : SimpleEncoder(std::move(options), size_hint, 0) {}
+
+SimpleEncoder::SimpleEncoder(CompressorOptions options, uint64_t size_hint,
+                             uint64_t values_block_size,
+                             bool fixed_record_sizes)
     : compression_type_(options.compression_type()),
+      values_block_size_(values_block_size),
+      fixed_record_sizes_(fixed_record_sizes),
       sizes_compressor_(options),
-      values_compressor_(options, size_hint) {}
+      sizes_deferred_(fixed_record_sizes),
+      values_compressor_(options, values_block_size == 0
+                                      ? size_hint
+                                      : UnsignedMin(size_hint,
+                                                    values_block_size)) {}
 
 void SimpleEncoder::Done() {
   if (ABSL_PREDICT_FALSE(!sizes_compressor_.Close())) Fail(sizes_compressor_);
   if (ABSL_PREDICT_FALSE(!values_compressor_.Close())) Fail(values_compressor_);
+  blocks_ = std::vector<ValuesBlock>();
+  compressed_blocks_ = Chain();
   ChunkEncoder::Done();
 }
 
 void SimpleEncoder::Reset() {
   ChunkEncoder::Reset();
   sizes_compressor_.Reset();
+  sizes_deferred_ = fixed_record_sizes_;
+  deferred_size_ = 0;
+  num_deferred_sizes_ = 0;
   values_compressor_.Reset();
+  block_num_records_ = 0;
+  closed_blocks_size_ = 0;
+  blocks_.clear();
+  compressed_blocks_.Clear();
+}
+
+inline bool SimpleEncoder::WriteSize(uint64_t size) {
+  if (sizes_deferred_) {
+    if (num_deferred_sizes_ == 0 || size == deferred_size_) {
+      deferred_size_ = size;
+      ++num_deferred_sizes_;
+      return true;
+    }
+    // Sizes differ. Write the sizes deferred so far.
+    sizes_deferred_ = false;
+    if (ABSL_PREDICT_FALSE(!WriteDeferredSizes())) return false;
+  }
+  if (ABSL_PREDICT_FALSE(!WriteVarint64(sizes_compressor_.writer(), size))) {
+    return Fail(*sizes_compressor_.writer());
+  }
+  return true;
+}
+
+bool SimpleEncoder::WriteSizes(absl::Span<const uint64_t> sizes) {
+  while (sizes_deferred_) {
+    if (sizes.empty()) return true;
+    if (ABSL_PREDICT_FALSE(!WriteSize(sizes.front()))) return false;
+    sizes.remove_prefix(1);
+  }
+  if (ABSL_PREDICT_FALSE(!WriteVarints64(sizes_compressor_.writer(), sizes))) {
+    return Fail(*sizes_compressor_.writer());
+  }
+  return true;
+}
+
+bool SimpleEncoder::WriteDeferredSizes() {
+  uint64_t sizes[kSizesBatch];
+  std::fill(sizes,
+            sizes + UnsignedMin(num_deferred_sizes_, uint64_t{kSizesBatch}),
+            deferred_size_);
+  uint64_t remaining = num_deferred_sizes_;
+  while (remaining > 0) {
+    const size_t length =
+        IntCast<size_t>(UnsignedMin(remaining, uint64_t{kSizesBatch}));
+    if (ABSL_PREDICT_FALSE(!WriteVarints64(
+            sizes_compressor_.writer(),
+            absl::Span<const uint64_t>(sizes, length)))) {
+      return Fail(*sizes_compressor_.writer());
+    }
+    remaining -= length;
+  }
+  return true;
+}
+
+inline bool SimpleEncoder::MaybeCloseBlock() {
+  if (values_block_size_ == 0) return true;
+  ++block_num_records_;
+  if (values_compressor_.writer()->pos() < values_block_size_) return true;
+  return CloseBlock();
 }
 
 bool SimpleEncoder::AddRecord(const google::protobuf::MessageLite& record) {
@@ -75,15 +161,13 @@ bool SimpleEncoder::AddRecord(const google::protobuf::MessageLite& record) {
     return Fail("Too many records");
   }
   ++num_records_;
-  if (ABSL_PREDICT_FALSE(!WriteVarint64(sizes_compressor_.writer(),
-                                        IntCast<uint64_t>(size)))) {
-    return Fail(*sizes_compressor_.writer());
-  }
-  if (ABSL_PREDICT_FALSE(
-          !SerializePartialToWriter(record, values_compressor_.writer()))) {
+  if (ABSL_PREDICT_FALSE(!WriteSize(IntCast<uint64_t>(size)))) return false;
+  // ByteSizeLong() above cached the sizes of the message and its submessages.
+  if (ABSL_PREDICT_FALSE(!SerializePartialWithCachedSizesToWriter(
+          record, values_compressor_.writer()))) {
     return Fail(*values_compressor_.writer());
   }
-  return true;
+  return MaybeCloseBlock();
 }
 
 bool SimpleEncoder::AddRecord(absl::string_view record) {
@@ -110,15 +194,14 @@ bool SimpleEncoder::AddRecordImpl(Record&& record) {
     return Fail("Too many records");
   }
   ++num_records_;
-  if (ABSL_PREDICT_FALSE(!WriteVarint64(sizes_compressor_.writer(),
-                                        IntCast<uint64_t>(record.size())))) {
-    return Fail(*sizes_compressor_.writer());
+  if (ABSL_PREDICT_FALSE(!WriteSize(IntCast<uint64_t>(record.size())))) {
+    return false;
   }
   if (ABSL_PREDICT_FALSE(
           !values_compressor_.writer()->Write(std::forward<Record>(record)))) {
     return Fail(*values_compressor_.writer());
   }
-  return true;
+  return MaybeCloseBlock();
 }
 
 bool SimpleEncoder::AddRecords(Chain records, std::vector<size_t> limits) {
@@ -132,6 +215,8 @@ bool SimpleEncoder::AddRecords(Chain records, std::vector<size_t> limits) {
   }
   num_records_ += IntCast<uint64_t>(limits.size());
   size_t start = 0;
+  uint64_t sizes[kSizesBatch];
+  size_t num_sizes = 0;
   for (const auto limit : limits) {
     RIEGELI_ASSERT_GE(limit, start)
         << "Failed precondition of ChunkEncoder::AddRecords(): "
@@ -139,47 +224,127 @@ bool SimpleEncoder::AddRecords(Chain records, std::vector<size_t> limits) {
     RIEGELI_ASSERT_LE(limit, records.size())
         << "Failed precondition of ChunkEncoder::AddRecords(): "
            "record end positions do not match concatenated record values";
-    if (ABSL_PREDICT_FALSE(!WriteVarint64(sizes_compressor_.writer(),
-                                          IntCast<uint64_t>(limit - start)))) {
-      return Fail(*sizes_compressor_.writer());
-    }
+    sizes[num_sizes++] = IntCast<uint64_t>(limit - start);
     start = limit;
+    if (num_sizes == kSizesBatch) {
+      if (ABSL_PREDICT_FALSE(
+              !WriteSizes(absl::Span<const uint64_t>(sizes, num_sizes)))) {
+        return false;
+      }
+      num_sizes = 0;
+    }
   }
   if (ABSL_PREDICT_FALSE(
-          !values_compressor_.writer()->Write(std::move(records)))) {
-    return Fail(*values_compressor_.writer());
+          !WriteSizes(absl::Span<const uint64_t>(sizes, num_sizes)))) {
+    return false;
+  }
+  if (values_block_size_ == 0) {
+    if (ABSL_PREDICT_FALSE(
+            !values_compressor_.writer()->Write(std::move(records)))) {
+      return Fail(*values_compressor_.writer());
+    }
+    return true;
   }
+  // Blocks end at record boundaries, so write records one by one.
+  ChainReader records_reader(&records);
+  for (const auto limit : limits) {
+    if (ABSL_PREDICT_FALSE(!records_reader.CopyTo(
+            values_compressor_.writer(),
+            IntCast<Position>(limit - records_reader.pos())))) {
+      return Fail(*values_compressor_.writer());
+    }
+    if (ABSL_PREDICT_FALSE(!MaybeCloseBlock())) return false;
+  }
+  if (!records_reader.Close()) {
+    RIEGELI_ASSERT_UNREACHABLE()
+        << "Closing records reader failed: " << records_reader.message();
+  }
+  return true;
+}
+
+bool SimpleEncoder::CloseBlock() {
+  const Position block_size = values_compressor_.writer()->pos();
+  if (ABSL_PREDICT_FALSE(block_size > std::numeric_limits<uint64_t>::max() -
+                                          closed_blocks_size_)) {
+    return Fail("Decoded data size too large");
+  }
+  closed_blocks_size_ += IntCast<uint64_t>(block_size);
+  const Position compressed_blocks_size_before = compressed_blocks_.size();
+  ChainWriter compressed_blocks_writer(&compressed_blocks_);
+  if (ABSL_PREDICT_FALSE(
+          !values_compressor_.EncodeAndClose(&compressed_blocks_writer))) {
+    return Fail(values_compressor_);
+  }
+  if (ABSL_PREDICT_FALSE(!compressed_blocks_writer.Close())) {
+    return Fail(compressed_blocks_writer);
+  }
+  blocks_.push_back(ValuesBlock{
+      block_num_records_,
+      IntCast<uint64_t>(compressed_blocks_.size() -
+                        compressed_blocks_size_before)});
+  block_num_records_ = 0;
+  values_compressor_.Reset();
   return true;
 }
 
 bool SimpleEncoder::EncodeAndClose(Writer* dest, uint64_t* num_records,
                                    uint64_t* decoded_data_size) {
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (values_block_size_ > 0 && block_num_records_ > 0) {
+    if (ABSL_PREDICT_FALSE(!CloseBlock())) return false;
+  }
   if (ABSL_PREDICT_FALSE(values_compressor_.writer()->pos() >
-                         std::numeric_limits<uint64_t>::max())) {
+                         std::numeric_limits<uint64_t>::max() -
+                             closed_blocks_size_)) {
     return Fail("Decoded data size too large");
   }
   *num_records = num_records_;
-  *decoded_data_size = values_compressor_.writer()->pos();
+  *decoded_data_size = closed_blocks_size_ +
+                       IntCast<uint64_t>(values_compressor_.writer()->pos());
 
   if (ABSL_PREDICT_FALSE(
           !WriteByte(dest, static_cast<uint8_t>(compression_type_)))) {
     return Fail(*dest);
   }
 
-  Chain compressed_sizes;
-  ChainWriter compressed_sizes_writer(&compressed_sizes);
-  if (ABSL_PREDICT_FALSE(
-          !sizes_compressor_.EncodeAndClose(&compressed_sizes_writer))) {
-    return Fail(sizes_compressor_);
-  }
-  if (ABSL_PREDICT_FALSE(!compressed_sizes_writer.Close())) {
-    return Fail(compressed_sizes_writer);
+  if (sizes_deferred_ && num_deferred_sizes_ > 0) {
+    // All records have the same size. Store it once, marked by empty sizes.
+    if (ABSL_PREDICT_FALSE(!WriteVarint64(dest, 0)) ||
+        ABSL_PREDICT_FALSE(!WriteVarint64(dest, deferred_size_))) {
+      return Fail(*dest);
+    }
+  } else {
+    Chain compressed_sizes;
+    ChainWriter compressed_sizes_writer(&compressed_sizes);
+    if (ABSL_PREDICT_FALSE(
+            !sizes_compressor_.EncodeAndClose(&compressed_sizes_writer))) {
+      return Fail(sizes_compressor_);
+    }
+    if (ABSL_PREDICT_FALSE(!compressed_sizes_writer.Close())) {
+      return Fail(compressed_sizes_writer);
+    }
+    if (ABSL_PREDICT_FALSE(!WriteVarint64(
+            dest, IntCast<uint64_t>(compressed_sizes.size()))) ||
+        ABSL_PREDICT_FALSE(!dest->Write(std::move(compressed_sizes)))) {
+      return Fail(*dest);
+    }
   }
-  if (ABSL_PREDICT_FALSE(
-          !WriteVarint64(dest, IntCast<uint64_t>(compressed_sizes.size()))) ||
-      ABSL_PREDICT_FALSE(!dest->Write(std::move(compressed_sizes)))) {
-    return Fail(*dest);
+
+  if (values_block_size_ > 0) {
+    if (ABSL_PREDICT_FALSE(
+            !WriteVarint64(dest, IntCast<uint64_t>(blocks_.size())))) {
+      return Fail(*dest);
+    }
+    for (const ValuesBlock& block : blocks_) {
+      if (ABSL_PREDICT_FALSE(!WriteVarint64(dest, block.num_records)) ||
+          ABSL_PREDICT_FALSE(!WriteVarint64(dest, block.compressed_size))) {
+        return Fail(*dest);
+      }
+    }
+    if (ABSL_PREDICT_FALSE(!dest->Write(std::move(compressed_blocks_)))) {
+      return Fail(*dest);
+    }
+    return Close();
   }
 
   if (ABSL_PREDICT_FALSE(!values_compressor_.EncodeAndClose(dest))) {
@@ -188,6 +353,19 @@ bool SimpleEncoder::EncodeAndClose(Writer* dest, uint64_t* num_records,
   return Close();
 }
 
-ChunkType SimpleEncoder::GetChunkType() const { return ChunkType::kSimple; }
+ChunkType SimpleEncoder::GetChunkType() const {
+  return values_block_size_ == 0 ? ChunkType::kSimple
+                                 : ChunkType::kBlockedSimple;
+}
+
+void SimpleEncoder::AddUniqueTo(MemoryEstimator* memory_estimator) const {
+  ChunkEncoder::AddUniqueTo(memory_estimator);
+  memory_estimator->AddMemory(sizeof(SimpleEncoder) - sizeof(ChunkEncoder) -
+                              2 * sizeof(internal::Compressor) - sizeof(Chain));
+  sizes_compressor_.AddUniqueTo(memory_estimator);
+  values_compressor_.AddUniqueTo(memory_estimator);
+  memory_estimator->AddMemory(sizeof(ValuesBlock) * blocks_.capacity());
+  compressed_blocks_.AddUniqueTo(memory_estimator);
+}
 
 }  // namespace riegeli
@@ -23,7 +23,9 @@
 
 #include "google/protobuf/message_lite.h"
 #include "absl/strings/string_view.h"
+#include "absl/types/span.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
 #include "riegeli/bytes/writer.h"
 #include "riegeli/chunk_encoding/chunk_encoder.h"
@@ -43,11 +45,40 @@ namespace riegeli {
 //
 // If compression is used, a compressed block is prefixed by its varint-encoded
 // uncompressed size.
+//
+// If fixed_record_sizes is true and all records have the same size, which is
+// common for fixed-width binary records, record sizes are replaced with:
+//  - Size of record sizes: 0
+//  - Size of each record
+// This is unambiguous because record sizes of a non-empty chunk take at least
+// one byte otherwise.
+//
+// If values_block_size is positive, the chunk has type kBlockedSimple instead,
+// and record values are split into blocks compressed independently, so that
+// reading a single record decompresses only its block. Format:
+//  - Compression type
+//  - Size of record sizes (compressed if applicable)
+//  - Record sizes (possibly compressed), as above
+//  - Number of blocks
+//  - For each block:
+//    - Number of records in the block
+//    - Size of compressed block
+//  - For each block, record values (possibly compressed):
+//    - Concatenated record data (bytes)
 class SimpleEncoder final : public ChunkEncoder {
  public:
   // Creates an empty SimpleEncoder.
   SimpleEncoder(CompressorOptions options, uint64_t size_hint);
 
+  // Creates an empty SimpleEncoder which closes a block of record values after
+  // a record which makes the block reach values_block_size bytes, or which does
+  // not use blocks if values_block_size is 0.
+  //
+  // If fixed_record_sizes is true, the size of records is stored once if all
+  // records have the same size.
+  SimpleEncoder(CompressorOptions options, uint64_t size_hint,
+                uint64_t values_block_size, bool fixed_record_sizes = false);
+
   void Reset() override;
 
   using ChunkEncoder::AddRecord;
@@ -64,16 +95,55 @@ class SimpleEncoder final : public ChunkEncoder {
 
   ChunkType GetChunkType() const override;
 
+  void AddUniqueTo(MemoryEstimator* memory_estimator) const override;
+
  protected:
   void Done() override;
 
  private:
+  // Location of a compressed block of record values.
+  struct ValuesBlock {
+    uint64_t num_records;
+    uint64_t compressed_size;
+  };
+
   template <typename Record>
   bool AddRecordImpl(Record&& record);
 
+  // Writes the size of a record to sizes_compressor_, or defers it while all
+  // sizes are the same.
+  bool WriteSize(uint64_t size);
+  // Like WriteSize() for each size, but writes sizes in bulk once they are not
+  // deferred.
+  bool WriteSizes(absl::Span<const uint64_t> sizes);
+  // Writes num_deferred_sizes_ copies of deferred_size_ to sizes_compressor_.
+  bool WriteDeferredSizes();
+
+  // Closes the current block of record values if it is large enough.
+  bool MaybeCloseBlock();
+  // Compresses the current block of record values into compressed_blocks_.
+  bool CloseBlock();
+
   CompressionType compression_type_;
+  uint64_t values_block_size_;
+  bool fixed_record_sizes_;
   internal::Compressor sizes_compressor_;
+  // If true, all record sizes so far were deferred_size_, and they were not
+  // written to sizes_compressor_.
+  bool sizes_deferred_;
+  uint64_t deferred_size_ = 0;
+  uint64_t num_deferred_sizes_ = 0;
+  // If values_block_size_ > 0, compresses the current block of record values.
   internal::Compressor values_compressor_;
+  // Fields used if values_block_size_ > 0.
+  //
+  // Number of records of the current block.
+  uint64_t block_num_records_ = 0;
+  // Uncompressed size of closed blocks.
+  uint64_t closed_blocks_size_ = 0;
+  std::vector<ValuesBlock> blocks_;
+  // Concatenated closed blocks.
+  Chain compressed_blocks_;
 };
 
 }  // namespace riegeli
@@ -16,8 +16,11 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <algorithm>
+#include <atomic>
 #include <cstring>
 #include <limits>
+#include <memory>
 #include <string>
 #include <unordered_map>
 #include <utility>
@@ -25,20 +28,29 @@
 
 #include "absl/base/attributes.h"
 #include "absl/base/optimization.h"
+#include "absl/base/thread_annotations.h"
 #include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
 #include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
 #include "riegeli/base/memory.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
+#include "riegeli/base/parallelism.h"
 #include "riegeli/bytes/backward_writer.h"
 #include "riegeli/bytes/backward_writer_utils.h"
 #include "riegeli/bytes/chain_reader.h"
 #include "riegeli/bytes/limiting_backward_writer.h"
 #include "riegeli/bytes/reader.h"
 #include "riegeli/bytes/reader_utils.h"
+#include "riegeli/bytes/string_reader.h"
 #include "riegeli/bytes/writer_utils.h"
+#include "riegeli/bytes/zstd_dictionary.h"
+#include "riegeli/chunk_encoding/bucket_cache.h"
 #include "riegeli/chunk_encoding/decompressor.h"
+#include "riegeli/chunk_encoding/record_limits.h"
 #include "riegeli/chunk_encoding/transpose_internal.h"
 #include "riegeli/chunk_encoding/types.h"
 
@@ -74,6 +86,17 @@ struct DataBucket {
   bool decompressed = false;
 };
 
+// Returns true if buffers cached for a bucket have the sizes recorded in the
+// chunk, which guards against a chunk hash collision in a BucketCache.
+bool BufferSizesMatch(const BucketCache::Buffers& buffers,
+                      const std::vector<size_t>& buffer_sizes) {
+  if (buffers.size() != buffer_sizes.size()) return false;
+  for (size_t i = 0; i < buffers.size(); ++i) {
+    if (buffers[i].size() != buffer_sizes[i]) return false;
+  }
+  return true;
+}
+
 // Should the data content of the field be decoded?
 enum class FieldIncluded {
   kYes,
@@ -81,19 +104,91 @@ enum class FieldIncluded {
   kExistenceOnly,
 };
 
-// Return true if "tag" is a valid protocol buffer tag.
-bool ValidTag(uint32_t tag) {
-  switch (static_cast<internal::WireType>(tag & 7)) {
-    case internal::WireType::kVarint:
-    case internal::WireType::kFixed32:
-    case internal::WireType::kFixed64:
-    case internal::WireType::kLengthDelimited:
-    case internal::WireType::kStartGroup:
-    case internal::WireType::kEndGroup:
-      return tag >= 8;
-    default:
-      return false;
+// Rearranges "columns", which stores records of "width" bytes each column by
+// column, to store them record by record.
+//
+// Precondition: columns.size() % width == 0
+std::string ColumnsToRows(const std::string& columns, size_t width) {
+  const size_t num_rows = columns.size() / width;
+  std::string rows(columns.size(), '\0');
+  for (size_t row = 0; row < num_rows; ++row) {
+    for (size_t column = 0; column < width; ++column) {
+      rows[row * width + column] = columns[column * num_rows + row];
+    }
+  }
+  return rows;
+}
+
+// Rearranges the contents of "*buffer", which stores records of "width" bytes
+// each column by column (see internal::MessageId::kNonProtoColumns), to store
+// them record by record.
+bool ColumnsToRows(ChainReader* buffer, uint32_t width) {
+  Position size;
+  if (ABSL_PREDICT_FALSE(!buffer->Size(&size))) return false;
+  size -= buffer->pos();
+  if (ABSL_PREDICT_FALSE(size % width != 0)) return false;
+  std::string columns;
+  if (ABSL_PREDICT_FALSE(!buffer->Read(&columns, IntCast<size_t>(size)))) {
+    return false;
+  }
+  *buffer = ChainReader(Chain(ColumnsToRows(columns, width)));
+  return true;
+}
+
+// Rearranges the contents of "*buffer", which stores packed repeated numeric
+// values with "layout" (see internal::WireType::kPackedString), to store them
+// as string or bytes values, each preceded by its length.
+bool PackedToStrings(ChainReader* buffer, internal::PackedLayout layout) {
+  Position size;
+  if (ABSL_PREDICT_FALSE(!buffer->Size(&size))) return false;
+  uint64_t num_values;
+  if (ABSL_PREDICT_FALSE(!ReadVarint64(buffer, &num_values))) return false;
+  // Each number of elements takes at least one byte.
+  if (ABSL_PREDICT_FALSE(num_values > size - buffer->pos())) return false;
+  std::vector<uint64_t> counts;
+  counts.reserve(IntCast<size_t>(num_values));
+  for (uint64_t i = 0; i < num_values; ++i) {
+    uint64_t count;
+    if (ABSL_PREDICT_FALSE(!ReadVarint64(buffer, &count))) return false;
+    counts.push_back(count);
+  }
+  std::string elements;
+  if (ABSL_PREDICT_FALSE(
+          !buffer->Read(&elements, IntCast<size_t>(size - buffer->pos())))) {
+    return false;
   }
+  const size_t width = static_cast<size_t>(layout);
+  if (width != 0) {
+    if (ABSL_PREDICT_FALSE(elements.size() % width != 0)) return false;
+    elements = ColumnsToRows(elements, width);
+  }
+  std::string strings;
+  strings.reserve(elements.size() + counts.size());
+  const char* cursor = elements.data();
+  const char* const limit = elements.data() + elements.size();
+  for (const uint64_t count : counts) {
+    const char* const value = cursor;
+    if (width == 0) {
+      for (uint64_t i = 0; i < count; ++i) {
+        do {
+          if (ABSL_PREDICT_FALSE(cursor == limit)) return false;
+        } while (static_cast<uint8_t>(*cursor++) >= 0x80);
+      }
+    } else {
+      if (ABSL_PREDICT_FALSE(count > PtrDistance(cursor, limit) / width)) {
+        return false;
+      }
+      cursor += count * width;
+    }
+    char length[kMaxLengthVarint64()];
+    char* const length_end =
+        WriteVarint64(length, IntCast<uint64_t>(PtrDistance(value, cursor)));
+    strings.append(length, PtrDistance(length, length_end));
+    strings.append(value, PtrDistance(value, cursor));
+  }
+  if (ABSL_PREDICT_FALSE(cursor != limit)) return false;
+  *buffer = ChainReader(Chain(std::move(strings)));
+  return true;
 }
 
 }  // namespace
@@ -351,6 +446,19 @@ inline bool IsImplicit(CallbackType callback_type) {
 struct TransposeDecoder::Context {
   // Compression type of the input.
   CompressionType compression_type = CompressionType::kNone;
+  // If true, buckets have their own compression types, stored in the header.
+  bool per_bucket_compression = false;
+  // Compression types of buckets.
+  std::vector<CompressionType> bucket_compression_types;
+  // Zstd dictionaries for decompression, or nullptr.
+  const ZstdDictionaryRegistry* zstd_dictionaries = nullptr;
+  // Maximum number of buckets decompressed in parallel by other threads.
+  // Note: Used only when filtering is disabled.
+  int parallelism = 0;
+  // Cache of decompressed buckets, or nullptr, and the key of the chunk there.
+  // Note: Used only when filtering is enabled.
+  BucketCache* bucket_cache = nullptr;
+  uint64_t chunk_hash = 0;
   // Buffer containing all the data.
   // Note: Used only when filtering is disabled.
   std::vector<ChainReader> buffers;
@@ -379,16 +487,21 @@ struct TransposeDecoder::Context {
   std::vector<StateMachineNodeTemplate> node_templates;
 };
 
-void TransposeDecoder::Done() {}
+void TransposeDecoder::Done() { state_machine_cache_ = StateMachineCache(); }
 
 bool TransposeDecoder::Reset(Reader* src, uint64_t num_records,
                              uint64_t decoded_data_size,
                              const FieldFilter& field_filter,
-                             BackwardWriter* dest,
-                             std::vector<size_t>* limits) {
+                             const ZstdDictionaryRegistry* zstd_dictionaries,
+                             int parallelism, BackwardWriter* dest,
+                             RecordLimits* limits,
+                             BucketCache* bucket_cache, uint64_t chunk_hash) {
   RIEGELI_ASSERT_EQ(dest->pos(), 0u)
       << "Failed precondition of TransposeDecoder::Reset(): "
          "non-zero destination position";
+  RIEGELI_ASSERT_GE(parallelism, 0)
+      << "Failed precondition of TransposeDecoder::Reset(): "
+         "negative parallelism";
   MarkHealthy();
   if (ABSL_PREDICT_FALSE(num_records > limits->max_size())) {
     return Fail("Too many records");
@@ -397,12 +510,22 @@ bool TransposeDecoder::Reset(Reader* src, uint64_t num_records,
                          std::numeric_limits<size_t>::max())) {
     return Fail("Records too large");
   }
+  limits->Reset(IntCast<size_t>(decoded_data_size));
 
   Context context;
+  context.zstd_dictionaries = zstd_dictionaries;
+  context.parallelism = parallelism;
+  context.bucket_cache = bucket_cache;
+  context.chunk_hash = chunk_hash;
   if (ABSL_PREDICT_FALSE(!Parse(&context, src, field_filter))) return false;
   LimitingBackwardWriter limiting_dest(dest, decoded_data_size);
-  if (ABSL_PREDICT_FALSE(
-          !Decode(&context, num_records, &limiting_dest, limits))) {
+  const bool ok = Decode(&context, num_records, &limiting_dest, limits);
+  if (field_filter.include_all()) {
+    // Keep the state machine for the next chunk. Decoding has not changed it,
+    // except for callbacks which are set again by Decode().
+    state_machine_cache_.nodes = std::move(context.state_machine_nodes);
+  }
+  if (ABSL_PREDICT_FALSE(!ok)) {
     limiting_dest.Close();
     return false;
   }
@@ -437,8 +560,10 @@ inline bool TransposeDecoder::Parse(Context* context, Reader* src,
   if (ABSL_PREDICT_FALSE(!ReadByte(src, &compression_type_byte))) {
     return Fail("Reading compression type failed", *src);
   }
-  context->compression_type =
-      static_cast<CompressionType>(compression_type_byte);
+  context->per_bucket_compression =
+      (compression_type_byte & internal::kPerBucketCompression()) != 0;
+  context->compression_type = static_cast<CompressionType>(
+      compression_type_byte & ~internal::kPerBucketCompression());
 
   uint64_t header_size;
   if (ABSL_PREDICT_FALSE(!ReadVarint64(src, &header_size))) {
@@ -449,7 +574,8 @@ inline bool TransposeDecoder::Parse(Context* context, Reader* src,
     return Fail("Reading header failed", *src);
   }
   internal::Decompressor header_decompressor(
-      absl::make_unique<ChainReader>(&header), context->compression_type);
+      absl::make_unique<ChainReader>(&header), context->compression_type,
+      context->zstd_dictionaries);
   if (ABSL_PREDICT_FALSE(!header_decompressor.healthy())) {
     return Fail(header_decompressor);
   }
@@ -472,11 +598,49 @@ inline bool TransposeDecoder::Parse(Context* context, Reader* src,
     num_buffers = IntCast<uint32_t>(context->buffers.size());
   }
 
-  uint32_t state_machine_size;
+  // The rest of the header describes the state machine. Without filtering,
+  // the state machine does not depend on anything else in the chunk, so it is
+  // reused if it is the same as in the previous chunk.
+  std::string state_machine_header;
   if (ABSL_PREDICT_FALSE(
-          !ReadVarint32(header_decompressor.reader(), &state_machine_size))) {
-    return Fail("Reading state machine size failed",
-                *header_decompressor.reader());
+          !ReadAll(header_decompressor.reader(), &state_machine_header))) {
+    return Fail("Reading header failed", *header_decompressor.reader());
+  }
+  if (ABSL_PREDICT_FALSE(!header_decompressor.VerifyEndAndClose())) {
+    return Fail(header_decompressor);
+  }
+  if (!filtering_enabled && !state_machine_cache_.nodes.empty() &&
+      state_machine_cache_.header == state_machine_header) {
+    if (ABSL_PREDICT_FALSE(!ReuseStateMachine(context, num_buffers))) {
+      return false;
+    }
+  } else {
+    state_machine_cache_ = StateMachineCache();
+    StringReader header_reader(&state_machine_header);
+    if (ABSL_PREDICT_FALSE(!ParseStateMachine(
+            context, &header_reader, filtering_enabled, num_buffers,
+            first_buffer_indices, bucket_indices))) {
+      return false;
+    }
+    if (!filtering_enabled) {
+      state_machine_cache_.header = std::move(state_machine_header);
+    }
+  }
+  context->transitions = internal::Decompressor(
+      src, context->compression_type, context->zstd_dictionaries);
+  if (ABSL_PREDICT_FALSE(!context->transitions.healthy())) {
+    return Fail(context->transitions);
+  }
+  return true;
+}
+
+inline bool TransposeDecoder::ParseStateMachine(
+    Context* context, Reader* header_reader, bool filtering_enabled,
+    uint32_t num_buffers, const std::vector<uint32_t>& first_buffer_indices,
+    const std::vector<uint32_t>& bucket_indices) {
+  uint32_t state_machine_size;
+  if (ABSL_PREDICT_FALSE(!ReadVarint32(header_reader, &state_machine_size))) {
+    return Fail("Reading state machine size failed", *header_reader);
   }
   // Additional 0xff nodes to correctly handle invalid/malicious inputs.
   // TODO: Handle overflow.
@@ -486,33 +650,37 @@ inline bool TransposeDecoder::Parse(Context* context, Reader* src,
   }
   std::vector<StateMachineNode>& state_machine_nodes =
       context->state_machine_nodes;
+  if (!filtering_enabled) {
+    state_machine_cache_.buffer_indices.assign(state_machine_size, kInvalidPos);
+  }
   bool has_nonproto_op = false;
+  // Buffers of non-proto records already rearranged from columns to rows.
+  std::vector<ChainReader*> nonproto_columns_buffers;
+  // Buffers of packed repeated numeric values already rearranged to strings.
+  std::vector<ChainReader*> packed_buffers;
   size_t num_subtypes = 0;
   std::vector<uint32_t> tags;
   tags.reserve(state_machine_size);
   for (size_t i = 0; i < state_machine_size; ++i) {
     uint32_t tag;
-    if (ABSL_PREDICT_FALSE(!ReadVarint32(header_decompressor.reader(), &tag))) {
-      return Fail("Reading field tag failed", *header_decompressor.reader());
+    if (ABSL_PREDICT_FALSE(!ReadVarint32(header_reader, &tag))) {
+      return Fail("Reading field tag failed", *header_reader);
     }
     tags.push_back(tag);
-    if (ValidTag(tag) && internal::HasSubtype(tag)) ++num_subtypes;
+    if (internal::ValidTag(tag) && internal::HasSubtype(tag)) ++num_subtypes;
   }
   std::vector<uint32_t> next_node_indices;
   next_node_indices.reserve(state_machine_size);
   for (size_t i = 0; i < state_machine_size; ++i) {
     uint32_t next_node;
-    if (ABSL_PREDICT_FALSE(
-            !ReadVarint32(header_decompressor.reader(), &next_node))) {
-      return Fail("Reading next node index failed",
-                  *header_decompressor.reader());
+    if (ABSL_PREDICT_FALSE(!ReadVarint32(header_reader, &next_node))) {
+      return Fail("Reading next node index failed", *header_reader);
     }
     next_node_indices.push_back(next_node);
   }
   std::string subtypes;
-  if (ABSL_PREDICT_FALSE(
-          !header_decompressor.reader()->Read(&subtypes, num_subtypes))) {
-    return Fail("Reading subtypes failed", *header_decompressor.reader());
+  if (ABSL_PREDICT_FALSE(!header_reader->Read(&subtypes, num_subtypes))) {
+    return Fail("Reading subtypes failed", *header_reader);
   }
   size_t subtype_index = 0;
   for (size_t i = 0; i < state_machine_size; ++i) {
@@ -523,13 +691,12 @@ inline bool TransposeDecoder::Parse(Context* context, Reader* src,
       case internal::MessageId::kNoOp:
         state_machine_node.callback_type = internal::CallbackType::kNoOp;
         break;
-      case internal::MessageId::kNonProto: {
+      case internal::MessageId::kNonProto:
+      case internal::MessageId::kNonProtoColumns: {
         state_machine_node.callback_type = internal::CallbackType::kNonProto;
         uint32_t buffer_index;
-        if (ABSL_PREDICT_FALSE(
-                !ReadVarint32(header_decompressor.reader(), &buffer_index))) {
-          return Fail("Reading buffer index failed",
-                      *header_decompressor.reader());
+        if (ABSL_PREDICT_FALSE(!ReadVarint32(header_reader, &buffer_index))) {
+          return Fail("Reading buffer index failed", *header_reader);
         }
         if (ABSL_PREDICT_FALSE(buffer_index >= num_buffers)) {
           return Fail("Buffer index too large");
@@ -543,6 +710,33 @@ inline bool TransposeDecoder::Parse(Context* context, Reader* src,
           }
         } else {
           state_machine_node.buffer = &context->buffers[buffer_index];
+          state_machine_cache_.buffer_indices[i] = buffer_index;
+        }
+        if (static_cast<internal::MessageId>(tag) ==
+            internal::MessageId::kNonProtoColumns) {
+          uint32_t width;
+          if (ABSL_PREDICT_FALSE(!ReadVarint32(header_reader, &width))) {
+            return Fail("Reading non-proto record size failed",
+                        *header_reader);
+          }
+          if (ABSL_PREDICT_FALSE(width == 0)) {
+            return Fail("Invalid non-proto record size");
+          }
+          // Several states can share the buffer, it must be rearranged once.
+          if (std::find(nonproto_columns_buffers.begin(),
+                        nonproto_columns_buffers.end(),
+                        state_machine_node.buffer) ==
+              nonproto_columns_buffers.end()) {
+            if (ABSL_PREDICT_FALSE(
+                    !ColumnsToRows(state_machine_node.buffer, width))) {
+              return Fail("Invalid buffer of non-proto records");
+            }
+            nonproto_columns_buffers.push_back(state_machine_node.buffer);
+            if (!filtering_enabled) {
+              state_machine_cache_.nonproto_columns.emplace_back(buffer_index,
+                                                                 width);
+            }
+          }
         }
         has_nonproto_op = true;
       } break;
@@ -575,7 +769,16 @@ inline bool TransposeDecoder::Parse(Context* context, Reader* src,
                  internal::WireType::kLengthDelimited;
           subtype = internal::Subtype::kLengthDelimitedEndOfSubmessage;
         }
-        if (ABSL_PREDICT_FALSE((!ValidTag(tag)))) return Fail("Invalid tag");
+        // A string with a packed buffer is encoded as WireType::kPackedString.
+        const bool is_packed = static_cast<internal::WireType>(tag & 7) ==
+                               internal::WireType::kPackedString;
+        if (is_packed) {
+          tag -= internal::WireType::kPackedString -
+                 internal::WireType::kLengthDelimited;
+        }
+        if (ABSL_PREDICT_FALSE(!internal::ValidTag(tag))) {
+          return Fail("Invalid tag");
+        }
         char* const tag_end =
             WriteVarint32(state_machine_node.tag_data.data, tag);
         const size_t tag_length =
@@ -583,13 +786,12 @@ inline bool TransposeDecoder::Parse(Context* context, Reader* src,
         if (internal::HasSubtype(tag)) {
           subtype = static_cast<internal::Subtype>(subtypes[subtype_index++]);
         }
+        uint32_t buffer_index = kInvalidPos;
         if (filtering_enabled) {
           if (internal::HasDataBuffer(tag, subtype)) {
-            uint32_t buffer_index;
-            if (ABSL_PREDICT_FALSE(!ReadVarint32(header_decompressor.reader(),
-                                                 &buffer_index))) {
-              return Fail("Reading buffer index failed",
-                          *header_decompressor.reader());
+            if (ABSL_PREDICT_FALSE(
+                    !ReadVarint32(header_reader, &buffer_index))) {
+              return Fail("Reading buffer index failed", *header_reader);
             }
             if (ABSL_PREDICT_FALSE(buffer_index >= num_buffers)) {
               return Fail("Buffer index too large");
@@ -609,16 +811,15 @@ inline bool TransposeDecoder::Parse(Context* context, Reader* src,
               internal::CallbackType::kSelectCallback;
         } else {
           if (internal::HasDataBuffer(tag, subtype)) {
-            uint32_t buffer_index;
-            if (ABSL_PREDICT_FALSE(!ReadVarint32(header_decompressor.reader(),
-                                                 &buffer_index))) {
-              return Fail("Reading buffer index failed",
-                          *header_decompressor.reader());
+            if (ABSL_PREDICT_FALSE(
+                    !ReadVarint32(header_reader, &buffer_index))) {
+              return Fail("Reading buffer index failed", *header_reader);
             }
             if (ABSL_PREDICT_FALSE(buffer_index >= num_buffers)) {
               return Fail("Buffer index too large");
             }
             state_machine_node.buffer = &context->buffers[buffer_index];
+            state_machine_cache_.buffer_indices[i] = buffer_index;
           }
           state_machine_node.callback_type = internal::GetCallbackType(
               FieldIncluded::kYes, tag, subtype, tag_length, filtering_enabled);
@@ -627,6 +828,42 @@ inline bool TransposeDecoder::Parse(Context* context, Reader* src,
             return Fail("Invalid node");
           }
         }
+        if (is_packed) {
+          uint32_t layout;
+          if (ABSL_PREDICT_FALSE(!ReadVarint32(header_reader, &layout))) {
+            return Fail("Reading packed layout failed", *header_reader);
+          }
+          if (ABSL_PREDICT_FALSE(!internal::ValidPackedLayout(layout))) {
+            return Fail("Invalid packed layout");
+          }
+          if (ABSL_PREDICT_FALSE(buffer_index == kInvalidPos)) {
+            return Fail("Invalid packed string node");
+          }
+          ChainReader* buffer;
+          if (filtering_enabled) {
+            // The buffer is needed now even if the field is not included,
+            // because it must be rearranged before it is read.
+            const uint32_t bucket = bucket_indices[buffer_index];
+            buffer = GetBuffer(context, bucket,
+                               buffer_index - first_buffer_indices[bucket]);
+            if (ABSL_PREDICT_FALSE(buffer == nullptr)) return false;
+          } else {
+            buffer = &context->buffers[buffer_index];
+          }
+          // Several states can share the buffer, it must be rearranged once.
+          if (std::find(packed_buffers.begin(), packed_buffers.end(),
+                        buffer) == packed_buffers.end()) {
+            if (ABSL_PREDICT_FALSE(!PackedToStrings(
+                    buffer, static_cast<internal::PackedLayout>(layout)))) {
+              return Fail("Invalid buffer of packed values");
+            }
+            packed_buffers.push_back(buffer);
+            if (!filtering_enabled) {
+              state_machine_cache_.packed_buffers.emplace_back(
+                  buffer_index, static_cast<internal::PackedLayout>(layout));
+            }
+          }
+        }
         // Store subtype right past tag in case this is inline numeric.
         if (static_cast<internal::WireType>(tag & 7) ==
                 internal::WireType::kVarint &&
@@ -671,10 +908,8 @@ inline bool TransposeDecoder::Parse(Context* context, Reader* src,
     }
   }
 
-  if (ABSL_PREDICT_FALSE(
-          !ReadVarint32(header_decompressor.reader(), &context->first_node))) {
-    return Fail("Reading first node index failed",
-                *header_decompressor.reader());
+  if (ABSL_PREDICT_FALSE(!ReadVarint32(header_reader, &context->first_node))) {
+    return Fail("Reading first node index failed", *header_reader);
   }
   if (ABSL_PREDICT_FALSE(context->first_node >= state_machine_size)) {
     return Fail("First node index too large");
@@ -689,13 +924,53 @@ inline bool TransposeDecoder::Parse(Context* context, Reader* src,
     return Fail("Nodes contain an implicit loop");
   }
 
-  if (ABSL_PREDICT_FALSE(!header_decompressor.VerifyEndAndClose())) {
-    return Fail(header_decompressor);
+  if (ABSL_PREDICT_FALSE(!header_reader->VerifyEndAndClose())) {
+    return Fail(*header_reader);
   }
-  context->transitions = internal::Decompressor(src, context->compression_type);
-  if (ABSL_PREDICT_FALSE(!context->transitions.healthy())) {
-    return Fail(context->transitions);
+  if (!filtering_enabled) {
+    state_machine_cache_.first_node = context->first_node;
+    state_machine_cache_.has_nonproto_op = has_nonproto_op;
+  }
+  return true;
+}
+
+inline bool TransposeDecoder::ReuseStateMachine(Context* context,
+                                                uint32_t num_buffers) {
+  context->state_machine_nodes = std::move(state_machine_cache_.nodes);
+  state_machine_cache_.nodes.clear();
+  // Point nodes to buffers of this chunk. Other fields of nodes do not depend
+  // on the chunk.
+  for (size_t i = 0; i < state_machine_cache_.buffer_indices.size(); ++i) {
+    const uint32_t buffer_index = state_machine_cache_.buffer_indices[i];
+    if (buffer_index == kInvalidPos) continue;
+    if (ABSL_PREDICT_FALSE(buffer_index >= num_buffers)) {
+      return Fail("Buffer index too large");
+    }
+    context->state_machine_nodes[i].buffer = &context->buffers[buffer_index];
+  }
+  for (const auto& buffer_index_and_width :
+       state_machine_cache_.nonproto_columns) {
+    if (ABSL_PREDICT_FALSE(!ColumnsToRows(
+            &context->buffers[buffer_index_and_width.first],
+            buffer_index_and_width.second))) {
+      return Fail("Invalid buffer of non-proto records");
+    }
+  }
+  for (const auto& buffer_index_and_layout :
+       state_machine_cache_.packed_buffers) {
+    if (ABSL_PREDICT_FALSE(!PackedToStrings(
+            &context->buffers[buffer_index_and_layout.first],
+            buffer_index_and_layout.second))) {
+      return Fail("Invalid buffer of packed values");
+    }
   }
+  if (state_machine_cache_.has_nonproto_op) {
+    if (ABSL_PREDICT_FALSE(num_buffers == 0)) {
+      return Fail("Missing buffer for non-proto records");
+    }
+    context->nonproto_lengths = &context->buffers.back();
+  }
+  context->first_node = state_machine_cache_.first_node;
   return true;
 }
 
@@ -722,6 +997,8 @@ inline bool TransposeDecoder::ParseBuffers(Context* context,
     return Fail("Too many buckets");
   }
   bucket_decompressors.reserve(num_buckets);
+  std::vector<Chain> buckets;
+  buckets.reserve(num_buckets);
   for (uint32_t bucket_index = 0; bucket_index < num_buckets; ++bucket_index) {
     uint64_t bucket_length;
     if (ABSL_PREDICT_FALSE(!ReadVarint64(header_reader, &bucket_length))) {
@@ -731,14 +1008,34 @@ inline bool TransposeDecoder::ParseBuffers(Context* context,
                            std::numeric_limits<size_t>::max())) {
       return Fail("Bucket too large");
     }
-    Chain bucket;
+    buckets.emplace_back();
     if (ABSL_PREDICT_FALSE(
-            !src->Read(&bucket, IntCast<size_t>(bucket_length)))) {
+            !src->Read(&buckets.back(), IntCast<size_t>(bucket_length)))) {
       return Fail("Reading bucket failed", *src);
     }
+  }
+  if (ABSL_PREDICT_FALSE(
+          !ReadBucketCompressionTypes(context, header_reader, num_buckets))) {
+    return false;
+  }
+  std::vector<CompressionType>& bucket_compression_types =
+      context->bucket_compression_types;
+  if (context->parallelism > 0 && num_buckets > 1 &&
+      std::any_of(bucket_compression_types.begin(),
+                  bucket_compression_types.end(),
+                  [](CompressionType compression_type) {
+                    return compression_type != CompressionType::kNone;
+                  })) {
+    if (ABSL_PREDICT_FALSE(!DecompressBucketsInParallel(context, &buckets))) {
+      return false;
+    }
+    std::fill(bucket_compression_types.begin(), bucket_compression_types.end(),
+              CompressionType::kNone);
+  }
+  for (uint32_t bucket_index = 0; bucket_index < num_buckets; ++bucket_index) {
     bucket_decompressors.emplace_back(
-        absl::make_unique<ChainReader>(std::move(bucket)),
-        context->compression_type);
+        absl::make_unique<ChainReader>(std::move(buckets[bucket_index])),
+        bucket_compression_types[bucket_index], context->zstd_dictionaries);
     if (ABSL_PREDICT_FALSE(!bucket_decompressors.back().healthy())) {
       return Fail(bucket_decompressors.back());
     }
@@ -780,6 +1077,96 @@ inline bool TransposeDecoder::ParseBuffers(Context* context,
   return true;
 }
 
+inline bool TransposeDecoder::ReadBucketCompressionTypes(
+    Context* context, Reader* header_reader, uint32_t num_buckets) {
+  if (!context->per_bucket_compression) {
+    context->bucket_compression_types.assign(num_buckets,
+                                              context->compression_type);
+    return true;
+  }
+  context->bucket_compression_types.reserve(num_buckets);
+  for (uint32_t bucket_index = 0; bucket_index < num_buckets; ++bucket_index) {
+    uint8_t compression_type_byte;
+    if (ABSL_PREDICT_FALSE(!ReadByte(header_reader, &compression_type_byte))) {
+      return Fail("Reading bucket compression type failed", *header_reader);
+    }
+    context->bucket_compression_types.push_back(
+        static_cast<CompressionType>(compression_type_byte));
+  }
+  return true;
+}
+
+bool TransposeDecoder::DecompressBucketsInParallel(
+    Context* context, std::vector<Chain>* buckets) {
+  // Buckets are claimed by index by the calling thread and by tasks in the
+  // thread pool, as in TransposeEncoder::WriteBucketsInParallel(). The calling
+  // thread waits only for buckets already claimed, so decoding a chunk in a
+  // task of the same thread pool does not deadlock.
+  struct SharedState {
+    SharedState(std::vector<Chain> compressed,
+                std::vector<CompressionType> compression_types)
+        : compressed(std::move(compressed)),
+          compression_types(std::move(compression_types)),
+          decompressed(this->compressed.size()),
+          messages(this->compressed.size()) {}
+
+    // Only decompressed[i] and messages[i] are written by the thread claiming
+    // bucket i.
+    const std::vector<Chain> compressed;
+    const std::vector<CompressionType> compression_types;
+    std::vector<Chain> decompressed;
+    std::vector<std::string> messages;
+    std::atomic<size_t> next_bucket{0};
+    absl::Mutex mutex;
+    size_t num_done GUARDED_BY(mutex) = 0;
+  };
+  const auto state = std::make_shared<SharedState>(
+      std::move(*buckets), context->bucket_compression_types);
+  // zstd_dictionaries are used only while the calling thread waits for claimed
+  // buckets.
+  const ZstdDictionaryRegistry* const zstd_dictionaries =
+      context->zstd_dictionaries;
+  const auto work = [state, zstd_dictionaries] {
+    for (;;) {
+      const size_t index =
+          state->next_bucket.fetch_add(1, std::memory_order_relaxed);
+      if (index >= state->compressed.size()) return;
+      internal::Decompressor decompressor(
+          absl::make_unique<ChainReader>(&state->compressed[index]),
+          state->compression_types[index], zstd_dictionaries);
+      if (ABSL_PREDICT_FALSE(!decompressor.healthy())) {
+        state->messages[index] = std::string(decompressor.message());
+      } else if (ABSL_PREDICT_FALSE(!ReadAll(decompressor.reader(),
+                                             &state->decompressed[index]))) {
+        state->messages[index] = absl::StrCat(
+            "Reading bucket failed: ", decompressor.reader()->message());
+      } else if (ABSL_PREDICT_FALSE(!decompressor.VerifyEndAndClose())) {
+        state->messages[index] = std::string(decompressor.message());
+      }
+      absl::MutexLock lock(&state->mutex);
+      ++state->num_done;
+    }
+  };
+  ThreadPool& thread_pool = internal::DefaultThreadPool();
+  const size_t num_tasks = UnsignedMin(IntCast<size_t>(context->parallelism),
+                                       state->compressed.size() - 1);
+  for (size_t i = 0; i < num_tasks; ++i) thread_pool.Schedule(work);
+  work();
+  {
+    absl::MutexLock lock(&state->mutex);
+    state->mutex.Await(absl::Condition(
+        +[](SharedState* state) EXCLUSIVE_LOCKS_REQUIRED(state->mutex) {
+          return state->num_done == state->compressed.size();
+        },
+        state.get()));
+  }
+  for (const std::string& message : state->messages) {
+    if (ABSL_PREDICT_FALSE(!message.empty())) return Fail(message);
+  }
+  *buckets = std::move(state->decompressed);
+  return true;
+}
+
 inline bool TransposeDecoder::ParseBuffersForFitering(
     Context* context, Reader* header_reader, Reader* src,
     std::vector<uint32_t>* first_buffer_indices,
@@ -823,12 +1210,17 @@ inline bool TransposeDecoder::ParseBuffersForFitering(
     }
   }
 
+  if (ABSL_PREDICT_FALSE(
+          !ReadBucketCompressionTypes(context, header_reader, num_buckets))) {
+    return false;
+  }
+
   uint32_t bucket_index = 0;
   uint64_t remaining_bucket_size = 0;
   first_buffer_indices->push_back(0);
   if (ABSL_PREDICT_FALSE(!internal::Decompressor::UncompressedSize(
-          context->buckets[0].compressed_data, context->compression_type,
-          &remaining_bucket_size))) {
+          context->buckets[0].compressed_data,
+          context->bucket_compression_types[0], &remaining_bucket_size))) {
     return Fail("Reading uncompressed size failed");
   }
   for (uint32_t buffer_index = 0; buffer_index < num_buffers; ++buffer_index) {
@@ -852,7 +1244,8 @@ inline bool TransposeDecoder::ParseBuffersForFitering(
       first_buffer_indices->push_back(buffer_index + 1);
       if (ABSL_PREDICT_FALSE(!internal::Decompressor::UncompressedSize(
               context->buckets[bucket_index].compressed_data,
-              context->compression_type, &remaining_bucket_size))) {
+              context->bucket_compression_types[bucket_index],
+              &remaining_bucket_size))) {
         return Fail("Reading uncompressed size failed");
       }
     }
@@ -878,9 +1271,23 @@ inline ChainReader* TransposeDecoder::GetBuffer(Context* context,
   } else {
     RIEGELI_ASSERT_LT(index_within_bucket, bucket.buffer_sizes.size())
         << "Index within bucket out of range";
+    if (context->bucket_cache != nullptr) {
+      const std::shared_ptr<const BucketCache::Buffers> cached =
+          context->bucket_cache->Find(context->chunk_hash, bucket_index);
+      if (cached != nullptr && BufferSizesMatch(*cached, bucket.buffer_sizes)) {
+        // Chain copies share large blocks, so this does not copy the data.
+        bucket.buffers.reserve(cached->size());
+        for (const Chain& buffer : *cached) bucket.buffers.emplace_back(buffer);
+        bucket.buffer_sizes = std::vector<size_t>();
+        bucket.compressed_data = Chain();
+        bucket.decompressed = true;
+        return &bucket.buffers[index_within_bucket];
+      }
+    }
     internal::Decompressor decompressor(
         absl::make_unique<ChainReader>(&bucket.compressed_data),
-        context->compression_type);
+        context->bucket_compression_types[bucket_index],
+        context->zstd_dictionaries);
     if (ABSL_PREDICT_FALSE(!decompressor.healthy())) {
       Fail(decompressor);
       return nullptr;
@@ -899,6 +1306,16 @@ inline ChainReader* TransposeDecoder::GetBuffer(Context* context,
       Fail(decompressor);
       return nullptr;
     }
+    if (context->bucket_cache != nullptr) {
+      std::shared_ptr<BucketCache::Buffers> buffers =
+          std::make_shared<BucketCache::Buffers>();
+      buffers->reserve(bucket.buffers.size());
+      for (const ChainReader& buffer : bucket.buffers) {
+        buffers->push_back(*buffer.src());
+      }
+      context->bucket_cache->Insert(context->chunk_hash, bucket_index,
+                                    std::move(buffers));
+    }
     // Free memory of fields which are no longer needed.
     bucket.buffer_sizes = std::vector<size_t>();
     bucket.compressed_data = Chain();
@@ -1040,7 +1457,7 @@ inline bool TransposeDecoder::ContainsImplicitLoop(
 
 inline bool TransposeDecoder::Decode(Context* context, uint64_t num_records,
                                      BackwardWriter* dest,
-                                     std::vector<size_t>* limits) {
+                                     RecordLimits* limits) {
   // For now positions reported by *dest are pushed to limits directly.
   // Later limits will be reversed and complemented.
   limits->clear();
@@ -1052,6 +1469,12 @@ inline bool TransposeDecoder::Decode(Context* context, uint64_t num_records,
   int skipped_submessage_level = 0;
 
   Reader* const transitions_reader = context->transitions.reader();
+  // Transitions are read through local copies of transitions_reader->cursor()
+  // and limit(), so that they can be kept in registers. Writing to dest does
+  // not let the compiler assume that they are unchanged in *transitions_reader.
+  // transitions_reader->cursor() is synchronized before pulling more data.
+  const char* transitions_cursor = transitions_reader->cursor();
+  const char* transitions_limit = transitions_reader->limit();
   // Stack of all open sub-messages.
   std::vector<SubmessageStackElement> submessage_stack;
   // Number of following iteration that go directly to node->next_node without
@@ -1229,11 +1652,20 @@ message_start:
 do_transition:
   node = node->next_node;
   if (num_iters == 0) {
-    uint8_t transition_byte;
-    if (ABSL_PREDICT_FALSE(!ReadByte(transitions_reader, &transition_byte))) {
-      goto done;
+    if (ABSL_PREDICT_FALSE(transitions_cursor == transitions_limit)) {
+      transitions_reader->set_cursor(transitions_cursor);
+      if (ABSL_PREDICT_FALSE(!transitions_reader->Pull())) goto done;
+      transitions_cursor = transitions_reader->cursor();
+      transitions_limit = transitions_reader->limit();
     }
+    const uint8_t transition_byte =
+        static_cast<uint8_t>(*transitions_cursor++);
     node += (transition_byte >> 2);
+    // With large state machines, nodes and their buffers are often not in L1
+    // cache. Start loading the buffer of this node and the likely next node
+    // before dispatching to the callback.
+    __builtin_prefetch(node->buffer);
+    __builtin_prefetch(node->next_node);
     num_iters = transition_byte & 3;
     if (internal::IsImplicit(node->callback_type)) ++num_iters;
     goto * node->callback;
@@ -1264,15 +1696,14 @@ done:
   // (because both old and new limits exclude 0 at the beginning and include
   // size at the end), e.g. for records of sizes {10, 20, 30, 40}:
   // {40, 70, 90, 100} -> {10, 30, 60, 100}.
-  auto first = limits->begin();
-  auto last = limits->end();
-  if (first != last) {
-    --last;
+  if (!limits->empty()) {
+    size_t first = 0;
+    size_t last = limits->size() - 1;
     while (first < last) {
       --last;
-      const size_t tmp = size - *first;
-      *first = size - *last;
-      *last = tmp;
+      const size_t tmp = size - (*limits)[first];
+      limits->set(first, size - (*limits)[last]);
+      limits->set(last, tmp);
       ++first;
     }
   }
@@ -1368,4 +1799,15 @@ ABSL_ATTRIBUTE_NOINLINE inline bool TransposeDecoder::SetCallbackType(
   return true;
 }
 
+void TransposeDecoder::AddUniqueTo(MemoryEstimator* memory_estimator) const {
+  memory_estimator->AddMemory(
+      sizeof(TransposeDecoder) + state_machine_cache_.header.capacity() +
+      sizeof(StateMachineNode) * state_machine_cache_.nodes.capacity() +
+      sizeof(uint32_t) * state_machine_cache_.buffer_indices.capacity() +
+      sizeof(std::pair<uint32_t, uint32_t>) *
+          state_machine_cache_.nonproto_columns.capacity() +
+      sizeof(std::pair<uint32_t, internal::PackedLayout>) *
+          state_machine_cache_.packed_buffers.capacity());
+}
+
 }  // namespace riegeli
@@ -17,14 +17,21 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <string>
+#include <utility>
 #include <vector>
 
+#include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
 #include "riegeli/bytes/backward_writer.h"
 #include "riegeli/bytes/chain_reader.h"
 #include "riegeli/bytes/reader.h"
 #include "riegeli/bytes/reader_utils.h"
+#include "riegeli/bytes/zstd_dictionary.h"
+#include "riegeli/chunk_encoding/bucket_cache.h"
 #include "riegeli/chunk_encoding/field_filter.h"
+#include "riegeli/chunk_encoding/record_limits.h"
 #include "riegeli/chunk_encoding/transpose_internal.h"
 
 namespace riegeli {
@@ -42,18 +49,44 @@ class TransposeDecoder final : public Object {
 
   // Resets the TransposeDecoder and parses the chunk.
   //
+  // If field_filter includes all fields, the state machine of the chunk is
+  // kept, and it is reused by the next Reset() if the next chunk has the same
+  // one, which is common when records have a stable structure. Reusing the
+  // same TransposeDecoder for consecutive chunks avoids parsing and validating
+  // the state machine again.
+  //
   // Writes concatenated record values to *dest. Sets *limits to sorted record
   // end positions.
   //
-  // Precondition: dest->pos() == 0
+  // zstd_dictionaries (if not nullptr) provide Zstd dictionaries named by
+  // compressed buffers.
+  //
+  // If parallelism > 0 and field_filter includes all fields, buckets are
+  // decompressed concurrently by the calling thread and up to parallelism
+  // threads of the default thread pool.
+  //
+  // If bucket_cache is not nullptr and field_filter does not include all
+  // fields, buckets decompressed for filtering are looked up in bucket_cache
+  // and added to it, identified by chunk_hash, which should be the data hash
+  // of the chunk.
+  //
+  // Preconditions:
+  //   dest->pos() == 0
+  //   parallelism >= 0
   //
   // Return values:
   //  * true  - success (healthy())
   //  * false - failure (!healthy());
   //            if !dest->healthy() then the problem was at dest
   bool Reset(Reader* src, uint64_t num_records, uint64_t decoded_data_size,
-             const FieldFilter& field_filter, BackwardWriter* dest,
-             std::vector<size_t>* limits);
+             const FieldFilter& field_filter,
+             const ZstdDictionaryRegistry* zstd_dictionaries, int parallelism,
+             BackwardWriter* dest, RecordLimits* limits,
+             BucketCache* bucket_cache = nullptr, uint64_t chunk_hash = 0);
+
+  // Registers this TransposeDecoder with MemoryEstimator, including the state
+  // machine kept for reuse.
+  void AddUniqueTo(MemoryEstimator* memory_estimator) const;
 
  protected:
   void Done() override;
@@ -122,19 +155,63 @@ class TransposeDecoder final : public Object {
   };
 
   // Note: If more bytes is needed in StateMachineNode, callback_type can be
-  // moved to a separate vector with some refactoring.
+  // moved to a separate vector with some refactoring. Two nodes fit in a cache
+  // line; for state machines with thousands of states, Decode() prefetches the
+  // buffer and the next node when a transition is taken.
   static_assert(sizeof(StateMachineNode) == 3 * sizeof(void*) + 8,
                 "Unexpected padding in StateMachineNode.");
 
+  // State machine of the last chunk decoded without filtering.
+  struct StateMachineCache {
+    // Serialized state machine from the chunk header. Empty if none.
+    std::string header;
+    // Parsed state machine. Empty while it is being used by decoding.
+    std::vector<StateMachineNode> nodes;
+    // Index of the data buffer of each state, or kInvalidPos if none.
+    std::vector<uint32_t> buffer_indices;
+    // Indices and record sizes of data buffers of non-proto records stored
+    // column by column.
+    std::vector<std::pair<uint32_t, uint32_t>> nonproto_columns;
+    // Indices and layouts of data buffers of packed repeated numeric values.
+    std::vector<std::pair<uint32_t, internal::PackedLayout>> packed_buffers;
+    // Node to start decoding from.
+    uint32_t first_node = 0;
+    // Whether there is a non-proto state.
+    bool has_nonproto_op = false;
+  };
+
   struct Context;
 
   bool Parse(Context* context, Reader* src, const FieldFilter& field_filter);
 
+  // Parse the state machine from "header_reader" into "context". If filtering
+  // is disabled, store what is needed to reuse it in "state_machine_cache_".
+  bool ParseStateMachine(Context* context, Reader* header_reader,
+                         bool filtering_enabled, uint32_t num_buffers,
+                         const std::vector<uint32_t>& first_buffer_indices,
+                         const std::vector<uint32_t>& bucket_indices);
+
+  // Move the state machine from "state_machine_cache_" to "context", pointing
+  // its states to data buffers of this chunk.
+  //
+  // Precondition: filtering is disabled.
+  bool ReuseStateMachine(Context* context, uint32_t num_buffers);
+
+  // Sets "context->bucket_compression_types" for "num_buckets" buckets, reading
+  // them from "header_reader" if "context->per_bucket_compression".
+  bool ReadBucketCompressionTypes(Context* context, Reader* header_reader,
+                                  uint32_t num_buckets);
+
   // Parse data buffers in "header_reader" and "reader" into
   // "context_->buffers". This method is used when filtering is disabled and all
   // filters are initially decompressed.
   bool ParseBuffers(Context* context, Reader* header_reader, Reader* src);
 
+  // Replaces compressed "buckets" with their decompressed contents. Buckets are
+  // decompressed in parallel according to "context->parallelism".
+  bool DecompressBucketsInParallel(Context* context,
+                                   std::vector<Chain>* buckets);
+
   // Parse data buffers in "header_reader" and "reader" into
   // "context_->data_buckets". When filtering is enabled, buckets are
   // decompressed on demand. "bucket_indices" contains bucket index for each
@@ -153,7 +230,7 @@ class TransposeDecoder final : public Object {
       std::vector<StateMachineNode>* state_machine_nodes);
 
   bool Decode(Context* context, uint64_t num_records, BackwardWriter* dest,
-              std::vector<size_t>* limits);
+              RecordLimits* limits);
 
   // Set callback_type in "node" based on "skipped_submessage_level",
   // "submessage_stack" and "node->node_template".
@@ -161,6 +238,8 @@ class TransposeDecoder final : public Object {
       Context* context, int skipped_submessage_level,
       const std::vector<SubmessageStackElement>& submessage_stack,
       StateMachineNode* node);
+
+  StateMachineCache state_machine_cache_;
 };
 
 }  // namespace riegeli
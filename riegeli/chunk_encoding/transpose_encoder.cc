@@ -17,19 +17,28 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <limits>
+#include <memory>
 #include <queue>
 #include <string>
 #include <type_traits>
-#include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include "google/protobuf/message_lite.h"
 #include "absl/base/optimization.h"
+#include "absl/base/thread_annotations.h"
 #include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
 #include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/flat_hash_map.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/base/parallelism.h"
 #include "riegeli/bytes/backward_writer.h"
 #include "riegeli/bytes/backward_writer_utils.h"
 #include "riegeli/bytes/chain_backward_writer.h"
@@ -114,6 +123,227 @@ bool IsProtoMessage(Reader* record) {
   return started_groups.empty();
 }
 
+// Reads a varint from "*cursor", which may have fewer than
+// kMaxLengthVarint32() bytes available before "limit", and advances "*cursor".
+bool ReadVarint32Bounded(const char** cursor, const char* limit,
+                         uint32_t* data) {
+  const size_t available = PtrDistance(*cursor, limit);
+  if (ABSL_PREDICT_TRUE(available >= kMaxLengthVarint32())) {
+    return ReadVarint32(cursor, data);
+  }
+  // Pad with zeros: a varint which would continue past "limit" then ends with
+  // a zero byte, which is rejected as an overlong representation.
+  char buffer[kMaxLengthVarint32()] = {};
+  std::memcpy(buffer, *cursor, available);
+  const char* buffer_cursor = buffer;
+  if (!ReadVarint32(&buffer_cursor, data)) return false;
+  const size_t length = PtrDistance(static_cast<const char*>(buffer),
+                                    buffer_cursor);
+  if (length > available) return false;
+  *cursor += length;
+  return true;
+}
+
+// Reads a varint from "*cursor", which may have fewer than
+// kMaxLengthVarint64() bytes available before "limit", and advances "*cursor".
+bool ReadVarint64Bounded(const char** cursor, const char* limit,
+                         uint64_t* data) {
+  const size_t available = PtrDistance(*cursor, limit);
+  if (ABSL_PREDICT_TRUE(available >= kMaxLengthVarint64())) {
+    return ReadVarint64(cursor, data);
+  }
+  // Pad with zeros: a varint which would continue past "limit" then ends with
+  // a zero byte, which is rejected as an overlong representation.
+  char buffer[kMaxLengthVarint64()] = {};
+  std::memcpy(buffer, *cursor, available);
+  const char* buffer_cursor = buffer;
+  if (!ReadVarint64(&buffer_cursor, data)) return false;
+  const size_t length = PtrDistance(static_cast<const char*>(buffer),
+                                    buffer_cursor);
+  if (length > available) return false;
+  *cursor += length;
+  return true;
+}
+
+// Like IsProtoMessage(Reader*), but "record" is flat, e.g. a string or a Chain
+// with a single block, which makes validating it much faster: varints are
+// decoded directly from memory, and fields are skipped by moving a pointer.
+bool IsProtoMessage(absl::string_view record) {
+  // We validate that all started proto groups are closed with endgroup tag.
+  std::vector<uint32_t> started_groups;
+  const char* cursor = record.data();
+  const char* const limit = record.data() + record.size();
+  while (cursor < limit) {
+    uint32_t tag;
+    if (!ReadVarint32Bounded(&cursor, limit, &tag)) return false;
+    const uint32_t field = tag >> 3;
+    if (field == 0) return false;
+    switch (static_cast<internal::WireType>(tag & 7)) {
+      case internal::WireType::kVarint: {
+        uint64_t value;
+        if (!ReadVarint64Bounded(&cursor, limit, &value)) return false;
+      } break;
+      case internal::WireType::kFixed32:
+        if (PtrDistance(cursor, limit) < sizeof(uint32_t)) return false;
+        cursor += sizeof(uint32_t);
+        break;
+      case internal::WireType::kFixed64:
+        if (PtrDistance(cursor, limit) < sizeof(uint64_t)) return false;
+        cursor += sizeof(uint64_t);
+        break;
+      case internal::WireType::kLengthDelimited: {
+        uint32_t length;
+        if (!ReadVarint32Bounded(&cursor, limit, &length)) return false;
+        if (PtrDistance(cursor, limit) < length) return false;
+        cursor += length;
+      } break;
+      case internal::WireType::kStartGroup:
+        started_groups.push_back(field);
+        break;
+      case internal::WireType::kEndGroup:
+        if (started_groups.empty() || started_groups.back() != field) {
+          return false;
+        }
+        started_groups.pop_back();
+        break;
+      default:
+        return false;
+    }
+  }
+  return started_groups.empty();
+}
+
+// Rearranges "rows", which consists of records of "width" bytes each, to store
+// them column by column: first bytes of all records, then their second bytes,
+// etc.
+Chain RowsToColumns(const Chain& rows, size_t width) {
+  RIEGELI_ASSERT_EQ(rows.size() % width, 0u)
+      << "Failed precondition of RowsToColumns(): "
+         "size not divisible by width";
+  const std::string flat_rows(rows);
+  const size_t num_rows = flat_rows.size() / width;
+  std::string columns(flat_rows.size(), '\0');
+  for (size_t row = 0; row < num_rows; ++row) {
+    for (size_t column = 0; column < width; ++column) {
+      columns[column * num_rows + row] = flat_rows[row * width + column];
+    }
+  }
+  return Chain(std::move(columns));
+}
+
+// Splits "strings", which consists of string or bytes values each preceded by
+// its length, into the values.
+std::vector<absl::string_view> SplitStrings(const std::string& strings) {
+  std::vector<absl::string_view> values;
+  const char* cursor = strings.data();
+  const char* const limit = strings.data() + strings.size();
+  while (cursor < limit) {
+    uint64_t length;
+    if (!ReadVarint64(&cursor, &length)) {
+      RIEGELI_ASSERT_UNREACHABLE() << "Invalid string length";
+    }
+    RIEGELI_ASSERT_LE(length, PtrDistance(cursor, limit))
+        << "String value exceeds the buffer";
+    values.emplace_back(cursor, IntCast<size_t>(length));
+    cursor += length;
+  }
+  return values;
+}
+
+// Returns true if "value" is a sequence of valid varints.
+bool IsPackedVarints(absl::string_view value) {
+  size_t varint_length = 0;
+  for (const char byte : value) {
+    if (++varint_length > kMaxLengthVarint64()) return false;
+    if (static_cast<uint8_t>(byte) < 0x80) varint_length = 0;
+  }
+  return varint_length == 0;
+}
+
+// Chooses the layout of "values" as packed repeated numeric values. Returns
+// false if they do not look like packed repeated numeric values.
+//
+// Fixed width layouts are preferred to varints, because numbers which are not
+// small (e.g. floats) can look like valid varints. Between fixed64 and fixed32,
+// fixed64 is chosen if the middle byte of an element (the fourth one) varies
+// more than its highest byte, which holds the exponent of a double.
+bool ChoosePackedLayout(const std::vector<absl::string_view>& values,
+                        internal::PackedLayout* layout) {
+  size_t total_size = 0;
+  bool fixed32 = true;
+  bool fixed64 = true;
+  bool varints = true;
+  for (const absl::string_view value : values) {
+    total_size += value.size();
+    if (value.size() % 4 != 0) fixed32 = false;
+    if (value.size() % 8 != 0) fixed64 = false;
+    if (varints && !IsPackedVarints(value)) varints = false;
+  }
+  if (total_size == 0) return false;
+  if (fixed64) {
+    bool seen[2][256] = {};
+    size_t num_distinct[2] = {0, 0};
+    for (const absl::string_view value : values) {
+      for (size_t i = 0; i < value.size(); i += 8) {
+        for (size_t j = 0; j < 2; ++j) {
+          const uint8_t byte = static_cast<uint8_t>(value[i + 3 + 4 * j]);
+          if (!seen[j][byte]) {
+            seen[j][byte] = true;
+            ++num_distinct[j];
+          }
+        }
+      }
+    }
+    if (num_distinct[0] > 2 * num_distinct[1]) {
+      *layout = internal::PackedLayout::kFixed64;
+      return true;
+    }
+  }
+  if (fixed32) {
+    *layout = internal::PackedLayout::kFixed32;
+    return true;
+  }
+  if (varints) {
+    *layout = internal::PackedLayout::kVarint;
+    return true;
+  }
+  return false;
+}
+
+// Stores "values" as packed repeated numeric values with "layout" (see the
+// format description in transpose_encoder.h).
+Chain StringsToPacked(const std::vector<absl::string_view>& values,
+                      internal::PackedLayout layout) {
+  const size_t width = static_cast<size_t>(layout);
+  std::string counts;
+  std::string elements;
+  const auto append_count = [&counts](size_t count) {
+    char varint[kMaxLengthVarint64()];
+    char* const varint_end = WriteVarint64(varint, IntCast<uint64_t>(count));
+    counts.append(varint, PtrDistance(varint, varint_end));
+  };
+  append_count(values.size());
+  for (const absl::string_view value : values) {
+    size_t count;
+    if (width == 0) {
+      count = IntCast<size_t>(std::count_if(
+          value.begin(), value.end(),
+          [](char byte) { return static_cast<uint8_t>(byte) < 0x80; }));
+    } else {
+      count = value.size() / width;
+    }
+    append_count(count);
+    elements.append(value.data(), value.size());
+  }
+  Chain packed(std::move(counts));
+  if (width == 0) {
+    packed.Append(std::move(elements));
+  } else {
+    packed.Append(RowsToColumns(Chain(std::move(elements)), width));
+  }
+  return packed;
+}
+
 // PriorityQueueEntry is used in priority_queue to order destinations by the
 // number of transitions into them.
 struct PriorityQueueEntry {
@@ -137,6 +367,38 @@ bool operator<(PriorityQueueEntry a, PriorityQueueEntry b) {
   return a.dest_index < b.dest_index;
 }
 
+// Compresses "bucket" with "compressor", which compresses with
+// "compression_type", to "*dest", and sets "*bucket_compression_type" to
+// "compression_type". If "store_incompressible" is true and compression saves
+// less than 1/8 of the size, "bucket" is stored uncompressed instead, and
+// "*bucket_compression_type" is set to CompressionType::kNone.
+//
+// Returns an empty string on success, or a failure message.
+std::string CompressBucket(const Chain& bucket,
+                           CompressionType compression_type,
+                           bool store_incompressible,
+                           internal::Compressor* compressor, Chain* dest,
+                           CompressionType* bucket_compression_type) {
+  dest->Clear();
+  ChainWriter dest_writer(dest);
+  if (ABSL_PREDICT_FALSE(!compressor->writer()->Write(bucket))) {
+    return std::string(compressor->writer()->message());
+  }
+  if (ABSL_PREDICT_FALSE(!compressor->EncodeAndClose(&dest_writer))) {
+    return std::string(compressor->message());
+  }
+  if (ABSL_PREDICT_FALSE(!dest_writer.Close())) {
+    return std::string(dest_writer.message());
+  }
+  *bucket_compression_type = compression_type;
+  if (store_incompressible && compression_type != CompressionType::kNone &&
+      dest->size() > bucket.size() - bucket.size() / 8) {
+    *dest = bucket;
+    *bucket_compression_type = CompressionType::kNone;
+  }
+  return std::string();
+}
+
 }  // namespace
 
 inline TransposeEncoder::MessageNode::MessageNode(
@@ -192,30 +454,81 @@ inline TransposeEncoder::BufferWithMetadata::BufferWithMetadata(
 
 TransposeEncoder::TransposeEncoder(CompressorOptions options,
                                    uint64_t bucket_size)
+    : TransposeEncoder(std::move(options), bucket_size, false) {}
+
+TransposeEncoder::TransposeEncoder(CompressorOptions options,
+                                   uint64_t bucket_size,
+                                   bool transpose_nonproto)
+    : TransposeEncoder(std::move(options), bucket_size, transpose_nonproto,
+                       std::vector<Field>()) {}
+
+TransposeEncoder::TransposeEncoder(CompressorOptions options,
+                                   uint64_t bucket_size,
+                                   bool transpose_nonproto,
+                                   std::vector<Field> separate_fields)
+    : TransposeEncoder(std::move(options), bucket_size, transpose_nonproto,
+                       std::move(separate_fields), BucketCompression()) {}
+
+TransposeEncoder::TransposeEncoder(CompressorOptions options,
+                                   uint64_t bucket_size,
+                                   bool transpose_nonproto,
+                                   std::vector<Field> separate_fields,
+                                   BucketCompression bucket_compression)
+    : TransposeEncoder(std::move(options), bucket_size, transpose_nonproto,
+                       std::move(separate_fields),
+                       std::move(bucket_compression), false) {}
+
+TransposeEncoder::TransposeEncoder(CompressorOptions options,
+                                   uint64_t bucket_size,
+                                   bool transpose_nonproto,
+                                   std::vector<Field> separate_fields,
+                                   BucketCompression bucket_compression,
+                                   bool transpose_packed)
     : compression_type_(options.compression_type()),
       bucket_size_(options.compression_type() == CompressionType::kNone
                        ? std::numeric_limits<uint64_t>::max()
                        : bucket_size),
+      parallelism_(options.compression_type() == CompressionType::kNone
+                       ? 0
+                       : options.parallelism()),
+      transpose_nonproto_(transpose_nonproto &&
+                          options.compression_type() != CompressionType::kNone),
+      transpose_packed_(transpose_packed &&
+                        options.compression_type() != CompressionType::kNone),
+      separate_fields_(std::move(separate_fields)),
+      bucket_compressor_options_(CompressorOptions(options).set_parallelism(0)),
+      per_bucket_compression_(
+          options.compression_type() != CompressionType::kNone &&
+          (bucket_compression.has_separate_fields_options ||
+           bucket_compression.store_incompressible)),
+      bucket_compression_(std::move(bucket_compression)),
       compressor_(options),
-      nonproto_lengths_writer_(&nonproto_lengths_) {}
+      nonproto_lengths_writer_(&nonproto_lengths_) {
+  bucket_compression_.separate_fields_options.set_parallelism(0);
+}
 
 TransposeEncoder::~TransposeEncoder() {}
 
 void TransposeEncoder::Done() {
   decoded_data_size_ = 0;
   if (ABSL_PREDICT_FALSE(!compressor_.Close())) Fail(compressor_);
-  tags_list_ = std::vector<EncodedTagInfo>();
-  encoded_tags_ = std::vector<uint32_t>();
-  encoded_tag_pos_ =
-      std::unordered_map<EncodedTag, uint32_t, EncodedTagHasher>();
-  for (auto& buffers : data_) buffers = std::vector<BufferWithMetadata>();
-  group_stack_ = std::vector<internal::MessageId>();
-  message_nodes_ = std::unordered_map<NodeId, MessageNode, NodeIdHasher>();
+  // Containers are cleared rather than freed, so that Reset() after
+  // EncodeAndClose() reuses their memory for the next chunk.
+  tags_list_.clear();
+  encoded_tags_.clear();
+  encoded_tag_pos_.clear();
+  for (auto& buffers : data_) buffers.clear();
+  group_stack_.clear();
+  message_nodes_.clear();
+  last_buffer_ = nullptr;
   if (ABSL_PREDICT_FALSE(!nonproto_lengths_writer_.Close())) {
     Fail(nonproto_lengths_writer_);
   }
   nonproto_lengths_ = Chain();
+  num_nonproto_records_ = 0;
+  nonproto_record_size_ = 0;
   next_message_id_ = internal::MessageId::kRoot + 1;
+  serialized_message_.clear();
   ChunkEncoder::Done();
 }
 
@@ -229,8 +542,11 @@ void TransposeEncoder::Reset() {
   for (auto& buffers : data_) buffers.clear();
   group_stack_.clear();
   message_nodes_.clear();
+  last_buffer_ = nullptr;
   nonproto_lengths_.Clear();
   nonproto_lengths_writer_ = ChainBackwardWriter(&nonproto_lengths_);
+  num_nonproto_records_ = 0;
+  nonproto_record_size_ = 0;
   next_message_id_ = internal::MessageId::kRoot + 1;
 }
 
@@ -250,6 +566,30 @@ inline size_t TransposeEncoder::EncodedTagHasher::operator()(
       static_cast<uint64_t>(encoded_tag.subtype));
 }
 
+bool TransposeEncoder::AddRecord(const google::protobuf::MessageLite& record) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(!record.IsInitialized())) {
+    return Fail(absl::StrCat("Failed to serialize message of type ",
+                             record.GetTypeName(),
+                             " because it is missing required fields: ",
+                             record.InitializationErrorString()));
+  }
+  const size_t size = record.ByteSizeLong();
+  if (ABSL_PREDICT_FALSE(size > size_t{std::numeric_limits<int>::max()})) {
+    return Fail(absl::StrCat(
+        "Failed to serialize message of type ", record.GetTypeName(),
+        " because it exceeds maximum protobuf size of 2GB: ", size));
+  }
+  // Transposition needs the whole message flat, so serialize it with the sizes
+  // cached by ByteSizeLong() into a buffer which is reused across records,
+  // instead of allocating a string or a Chain for each large message.
+  serialized_message_.resize(size);
+  record.SerializeWithCachedSizesToArray(
+      reinterpret_cast<uint8_t*>(&serialized_message_[0]));
+  StringReader reader(serialized_message_.data(), serialized_message_.size());
+  return AddRecordInternal(&reader);
+}
+
 bool TransposeEncoder::AddRecord(absl::string_view record) {
   StringReader reader(record.data(), record.size());
   return AddRecordInternal(&reader);
@@ -316,18 +656,26 @@ inline bool TransposeEncoder::AddRecordInternal(Reader* record) {
   }
   ++num_records_;
   decoded_data_size_ += size;
-  const bool is_proto = IsProtoMessage(record);
-  if (!record->Seek(pos_before)) {
-    RIEGELI_ASSERT_UNREACHABLE()
-        << "Seeking reader of a record failed: " << record->message();
+  bool is_proto;
+  record->Pull();
+  if (record->available() >= size) {
+    // The whole record is in the buffer, so it is validated in place.
+    is_proto = IsProtoMessage(
+        absl::string_view(record->cursor(), IntCast<size_t>(size)));
+  } else {
+    is_proto = IsProtoMessage(record);
+    if (!record->Seek(pos_before)) {
+      RIEGELI_ASSERT_UNREACHABLE()
+          << "Seeking reader of a record failed: " << record->message();
+    }
   }
   if (is_proto) {
-    encoded_tags_.push_back(GetPosInTagsList(EncodedTag(
-        internal::MessageId::kStartOfMessage, 0, internal::Subtype::kTrivial)));
+    AddEncodedTag(EncodedTag(internal::MessageId::kStartOfMessage, 0,
+                             internal::Subtype::kTrivial));
     return AddMessage(record, internal::MessageId::kRoot, 0);
   } else {
-    encoded_tags_.push_back(GetPosInTagsList(EncodedTag(
-        internal::MessageId::kNonProto, 0, internal::Subtype::kTrivial)));
+    AddEncodedTag(EncodedTag(internal::MessageId::kNonProto, 0,
+                             internal::Subtype::kTrivial));
     ChainBackwardWriter* const buffer =
         GetBuffer(internal::MessageId::kNonProto, 0, BufferType::kNonProto);
     if (ABSL_PREDICT_FALSE(!record->CopyTo(buffer, IntCast<size_t>(size)))) {
@@ -337,14 +685,35 @@ inline bool TransposeEncoder::AddRecordInternal(Reader* record) {
                                           IntCast<uint64_t>(size)))) {
       return Fail(nonproto_lengths_writer_);
     }
+    if (num_nonproto_records_ == 0) {
+      nonproto_record_size_ = size;
+    } else if (size != nonproto_record_size_) {
+      nonproto_record_size_ = 0;
+    }
+    ++num_nonproto_records_;
     return true;
   }
 }
 
+inline uint32_t TransposeEncoder::NonProtoColumnsWidth() const {
+  // Storing a single record or records of single bytes column by column would
+  // not change them.
+  if (!transpose_nonproto_ || num_nonproto_records_ < 2 ||
+      nonproto_record_size_ < 2 ||
+      nonproto_record_size_ > std::numeric_limits<uint32_t>::max()) {
+    return 0;
+  }
+  return IntCast<uint32_t>(nonproto_record_size_);
+}
+
 inline ChainBackwardWriter* TransposeEncoder::GetBuffer(
     internal::MessageId parent_message_id, uint32_t field, BufferType type) {
-  const auto insert_result = message_nodes_.emplace(
-      NodeId(parent_message_id, field), MessageNode(next_message_id_));
+  const NodeId node_id(parent_message_id, field);
+  if (last_buffer_ != nullptr && last_buffer_node_id_ == node_id) {
+    return last_buffer_;
+  }
+  const auto insert_result =
+      message_nodes_.emplace(node_id, MessageNode(next_message_id_));
   if (insert_result.second) {
     // New node was added.
     ++next_message_id_;
@@ -356,7 +725,9 @@ inline ChainBackwardWriter* TransposeEncoder::GetBuffer(
     node.writer =
         absl::make_unique<ChainBackwardWriter>(data.back().buffer.get());
   }
-  return node.writer.get();
+  last_buffer_node_id_ = node_id;
+  last_buffer_ = node.writer.get();
+  return last_buffer_;
 }
 
 inline uint32_t TransposeEncoder::GetPosInTagsList(EncodedTag etag) {
@@ -367,6 +738,18 @@ inline uint32_t TransposeEncoder::GetPosInTagsList(EncodedTag etag) {
   return insert_result.first->second;
 }
 
+inline void TransposeEncoder::AddEncodedTag(EncodedTag etag) {
+  const uint32_t pos = GetPosInTagsList(etag);
+  if (!encoded_tags_.empty()) {
+    // Transitions are decoded from back to front, so this is a transition from
+    // "pos" to the previous tag.
+    const uint32_t prev_pos = encoded_tags_.back();
+    ++tags_list_[pos].dest_info[prev_pos].num_transitions;
+    ++tags_list_[prev_pos].num_incoming_transitions;
+  }
+  encoded_tags_.push_back(pos);
+}
+
 // Precondition: IsProtoMessage returns true for this record.
 // Note: EncodedTags are appended into "encoded_tags_" but data is prepended
 // into respective buffers. "encoded_tags_" will be reversed later in
@@ -397,15 +780,15 @@ inline bool TransposeEncoder::AddMessage(Reader* record,
             PtrDistance(reinterpret_cast<char*>(value), value_end);
         if (reinterpret_cast<const unsigned char*>(value)[0] <=
             kMaxVarintInline) {
-          encoded_tags_.push_back(GetPosInTagsList(EncodedTag(
+          AddEncodedTag(EncodedTag(
               parent_message_id, tag,
               internal::Subtype::kVarintInline0 +
-                  reinterpret_cast<const unsigned char*>(value)[0])));
+                  reinterpret_cast<const unsigned char*>(value)[0]));
         } else {
-          encoded_tags_.push_back(GetPosInTagsList(
+          AddEncodedTag(
               EncodedTag(parent_message_id, tag,
                          internal::Subtype::kVarint1 +
-                             IntCast<uint8_t>(value_length - 1))));
+                             IntCast<uint8_t>(value_length - 1)));
           // Clear high bit of each byte.
           for (auto& word : value) word &= ~uint64_t{0x8080808080808080};
           ChainBackwardWriter* const buffer =
@@ -417,8 +800,8 @@ inline bool TransposeEncoder::AddMessage(Reader* record,
         }
       } break;
       case internal::WireType::kFixed32: {
-        encoded_tags_.push_back(GetPosInTagsList(
-            EncodedTag(parent_message_id, tag, internal::Subtype::kTrivial)));
+        AddEncodedTag(
+            EncodedTag(parent_message_id, tag, internal::Subtype::kTrivial));
         ChainBackwardWriter* const buffer =
             GetBuffer(parent_message_id, field, BufferType::kFixed32);
         if (ABSL_PREDICT_FALSE(!record->CopyTo(buffer, sizeof(uint32_t)))) {
@@ -426,8 +809,8 @@ inline bool TransposeEncoder::AddMessage(Reader* record,
         }
       } break;
       case internal::WireType::kFixed64: {
-        encoded_tags_.push_back(GetPosInTagsList(
-            EncodedTag(parent_message_id, tag, internal::Subtype::kTrivial)));
+        AddEncodedTag(
+            EncodedTag(parent_message_id, tag, internal::Subtype::kTrivial));
         ChainBackwardWriter* const buffer =
             GetBuffer(parent_message_id, field, BufferType::kFixed64);
         if (ABSL_PREDICT_FALSE(!record->CopyTo(buffer, sizeof(uint64_t)))) {
@@ -442,43 +825,53 @@ inline bool TransposeEncoder::AddMessage(Reader* record,
               << "Invalid length: " << record->message();
         }
         const Position value_pos = record->pos();
-        LimitingReader value(record, value_pos + length);
         // Non-toplevel empty strings are treated as strings, not messages.
         // They have a simpler encoding this way (one node instead of two).
-        if (depth < kMaxRecursionDepth && length != 0 &&
-            IsProtoMessage(&value)) {
-          encoded_tags_.push_back(GetPosInTagsList(EncodedTag(
+        bool is_message = false;
+        if (depth < kMaxRecursionDepth && length != 0) {
+          if (record->available() >= length) {
+            // The whole value is in the buffer, so it is validated in place.
+            is_message =
+                IsProtoMessage(absl::string_view(record->cursor(), length));
+          } else {
+            LimitingReader value(record, value_pos + length);
+            is_message = IsProtoMessage(&value);
+            if (!value.Close()) {
+              RIEGELI_ASSERT_UNREACHABLE()
+                  << "Closing submessage reader failed: " << value.message();
+            }
+            if (!record->Seek(value_pos)) {
+              RIEGELI_ASSERT_UNREACHABLE()
+                  << "Seeking message reader failed: " << record->message();
+            }
+          }
+        }
+        if (is_message) {
+          AddEncodedTag(EncodedTag(
               parent_message_id, tag,
-              internal::Subtype::kLengthDelimitedStartOfSubmessage)));
+              internal::Subtype::kLengthDelimitedStartOfSubmessage));
           const auto insert_result = message_nodes_.emplace(
               NodeId(parent_message_id, field), MessageNode(next_message_id_));
           if (insert_result.second) {
             // New node was added.
             ++next_message_id_;
           }
-          if (!value.Seek(value_pos)) {
-            RIEGELI_ASSERT_UNREACHABLE()
-                << "Seeking submessage reader failed: " << value.message();
-          }
+          LimitingReader value(record, value_pos + length);
           if (ABSL_PREDICT_FALSE(!AddMessage(
                   &value, insert_result.first->second.message_id, depth + 1))) {
             return false;
           }
-          encoded_tags_.push_back(GetPosInTagsList(
+          AddEncodedTag(
               EncodedTag(parent_message_id, tag,
-                         internal::Subtype::kLengthDelimitedEndOfSubmessage)));
+                         internal::Subtype::kLengthDelimitedEndOfSubmessage));
           if (!value.Close()) {
             RIEGELI_ASSERT_UNREACHABLE()
                 << "Closing submessage reader failed: " << value.message();
           }
         } else {
-          if (ABSL_PREDICT_FALSE(!value.Close())) {
-            RIEGELI_ASSERT_UNREACHABLE()
-                << "Closing submessage reader failed: " << value.message();
-          }
-          encoded_tags_.push_back(GetPosInTagsList(
+          AddEncodedTag(
               EncodedTag(parent_message_id, tag,
-                         internal::Subtype::kLengthDelimitedString)));
+                         internal::Subtype::kLengthDelimitedString));
           if (!record->Seek(length_pos)) {
             RIEGELI_ASSERT_UNREACHABLE()
                 << "Seeking message reader failed: " << record->message();
@@ -492,8 +885,8 @@ inline bool TransposeEncoder::AddMessage(Reader* record,
         }
       } break;
       case internal::WireType::kStartGroup: {
-        encoded_tags_.push_back(GetPosInTagsList(
-            EncodedTag(parent_message_id, tag, internal::Subtype::kTrivial)));
+        AddEncodedTag(
+            EncodedTag(parent_message_id, tag, internal::Subtype::kTrivial));
         const auto insert_result = message_nodes_.emplace(
             NodeId(parent_message_id, field), MessageNode(next_message_id_));
         if (insert_result.second) {
@@ -508,8 +901,8 @@ inline bool TransposeEncoder::AddMessage(Reader* record,
         parent_message_id = group_stack_.back();
         group_stack_.pop_back();
         --depth;
-        encoded_tags_.push_back(GetPosInTagsList(
-            EncodedTag(parent_message_id, tag, internal::Subtype::kTrivial)));
+        AddEncodedTag(
+            EncodedTag(parent_message_id, tag, internal::Subtype::kTrivial));
         break;
       default:
         RIEGELI_ASSERT_UNREACHABLE() << "Invalid wire type: " << (tag & 7);
@@ -520,16 +913,67 @@ inline bool TransposeEncoder::AddMessage(Reader* record,
   return true;
 }
 
-inline bool TransposeEncoder::AddBuffer(bool force_new_bucket,
+inline void TransposeEncoder::AddBuffer(bool force_new_bucket,
                                         const Chain& next_chunk,
-                                        Writer* data_writer,
-                                        std::vector<size_t>* bucket_lengths,
+                                        std::vector<Chain>* buckets,
                                         std::vector<size_t>* buffer_lengths) {
   buffer_lengths->push_back(next_chunk.size());
-  if (ABSL_PREDICT_FALSE(force_new_bucket ||
-                         compressor_.writer()->pos() + next_chunk.size() >
-                             bucket_size_) &&
-      compressor_.writer()->pos() > 0) {
+  if (buckets->empty() ||
+      ((force_new_bucket ||
+        buckets->back().size() + next_chunk.size() > bucket_size_) &&
+       !buckets->back().empty())) {
+    buckets->emplace_back();
+  }
+  buckets->back().Append(next_chunk);
+}
+
+inline bool TransposeEncoder::WriteBuckets(
+    const std::vector<Chain>& buckets, const std::vector<size_t>& bucket_groups,
+    Writer* data_writer, std::vector<size_t>* bucket_lengths,
+    std::vector<CompressionType>* bucket_compression_types) {
+  if (parallelism_ > 0 && buckets.size() > 1) {
+    return WriteBucketsInParallel(buckets, bucket_groups, data_writer,
+                                  bucket_lengths, bucket_compression_types);
+  }
+  bucket_lengths->reserve(buckets.size());
+  if (per_bucket_compression_) {
+    bucket_compression_types->reserve(buckets.size());
+    // Created when a bucket of separate fields is found.
+    std::unique_ptr<internal::Compressor> separate_fields_compressor;
+    Chain compressed;
+    for (size_t i = 0; i < buckets.size(); ++i) {
+      internal::Compressor* compressor = &compressor_;
+      CompressionType compression_type = compression_type_;
+      if (bucket_compression_.has_separate_fields_options &&
+          bucket_groups[i] > 0) {
+        if (separate_fields_compressor == nullptr) {
+          separate_fields_compressor = absl::make_unique<internal::Compressor>(
+              bucket_compression_.separate_fields_options);
+        }
+        compressor = separate_fields_compressor.get();
+        compression_type =
+            bucket_compression_.separate_fields_options.compression_type();
+      }
+      compressor->Reset();
+      CompressionType bucket_compression_type;
+      const std::string message =
+          CompressBucket(buckets[i], compression_type,
+                         bucket_compression_.store_incompressible, compressor,
+                         &compressed, &bucket_compression_type);
+      if (ABSL_PREDICT_FALSE(!message.empty())) return Fail(message);
+      bucket_lengths->push_back(compressed.size());
+      bucket_compression_types->push_back(bucket_compression_type);
+      if (ABSL_PREDICT_FALSE(!data_writer->Write(std::move(compressed)))) {
+        return Fail(*data_writer);
+      }
+    }
+    return true;
+  }
+  for (const Chain& bucket : buckets) {
+    compressor_.Reset();
+    if (ABSL_PREDICT_FALSE(!compressor_.writer()->Write(bucket))) {
+      return Fail(*compressor_.writer());
+    }
     const Position pos_before = data_writer->pos();
     if (ABSL_PREDICT_FALSE(!compressor_.EncodeAndClose(data_writer))) {
       return Fail(compressor_);
@@ -537,23 +981,165 @@ inline bool TransposeEncoder::AddBuffer(bool force_new_bucket,
     RIEGELI_ASSERT_GE(data_writer->pos(), pos_before)
         << "Data writer position decreased";
     bucket_lengths->push_back(IntCast<size_t>(data_writer->pos() - pos_before));
-    compressor_.Reset();
+    bucket_compression_types->push_back(compression_type_);
   }
-  if (ABSL_PREDICT_FALSE(!compressor_.writer()->Write(next_chunk))) {
-    return Fail(compressor_);
+  return true;
+}
+
+bool TransposeEncoder::WriteBucketsInParallel(
+    const std::vector<Chain>& buckets, const std::vector<size_t>& bucket_groups,
+    Writer* data_writer, std::vector<size_t>* bucket_lengths,
+    std::vector<CompressionType>* bucket_compression_types) {
+  // Buckets are claimed by index by the calling thread and by tasks in the
+  // thread pool. The calling thread waits only for buckets already claimed, so
+  // it does not depend on tasks being scheduled if all threads of the pool are
+  // busy, e.g. encoding other chunks. Tasks scheduled late find no buckets to
+  // claim, and keep the shared state alive on their own.
+  struct SharedState {
+    explicit SharedState(size_t num_buckets)
+        : compressed(num_buckets),
+          compression_types(num_buckets),
+          messages(num_buckets) {}
+
+    // Only compressed[i], compression_types[i], and messages[i] are written by
+    // the thread claiming bucket i.
+    std::vector<Chain> compressed;
+    std::vector<CompressionType> compression_types;
+    std::vector<std::string> messages;
+    std::atomic<size_t> next_bucket{0};
+    absl::Mutex mutex;
+    size_t num_done GUARDED_BY(mutex) = 0;
+  };
+  const auto state = std::make_shared<SharedState>(buckets.size());
+  // Uncompressed buckets are copied as Chains, which shares their blocks, so
+  // that late tasks do not refer to "buckets".
+  const auto inputs = std::make_shared<const std::vector<Chain>>(buckets);
+  // Options of each bucket, as indices into "options".
+  const auto options_indices = std::make_shared<std::vector<size_t>>(
+      buckets.size(), 0);
+  if (per_bucket_compression_ &&
+      bucket_compression_.has_separate_fields_options) {
+    for (size_t i = 0; i < buckets.size(); ++i) {
+      if (bucket_groups[i] > 0) (*options_indices)[i] = 1;
+    }
+  }
+  const auto options = std::make_shared<const std::vector<CompressorOptions>>(
+      std::vector<CompressorOptions>{
+          bucket_compressor_options_,
+          bucket_compression_.separate_fields_options});
+  const bool store_incompressible =
+      per_bucket_compression_ && bucket_compression_.store_incompressible;
+  const auto work = [state, inputs, options_indices, options,
+                     store_incompressible] {
+    for (;;) {
+      const size_t index =
+          state->next_bucket.fetch_add(1, std::memory_order_relaxed);
+      if (index >= inputs->size()) return;
+      const CompressorOptions& bucket_options =
+          (*options)[(*options_indices)[index]];
+      // No size hint is passed, so that compressed buckets are the same as
+      // without parallelism.
+      internal::Compressor compressor(bucket_options);
+      state->messages[index] = CompressBucket(
+          (*inputs)[index], bucket_options.compression_type(),
+          store_incompressible, &compressor, &state->compressed[index],
+          &state->compression_types[index]);
+      absl::MutexLock lock(&state->mutex);
+      ++state->num_done;
+    }
+  };
+  ThreadPool& thread_pool = internal::DefaultThreadPool();
+  const size_t num_tasks =
+      UnsignedMin(IntCast<size_t>(parallelism_), buckets.size() - 1);
+  for (size_t i = 0; i < num_tasks; ++i) thread_pool.Schedule(work);
+  work();
+  {
+    absl::MutexLock lock(&state->mutex);
+    state->mutex.Await(absl::Condition(
+        +[](SharedState* state) EXCLUSIVE_LOCKS_REQUIRED(state->mutex) {
+          return state->num_done == state->compressed.size();
+        },
+        state.get()));
+  }
+  bucket_lengths->reserve(buckets.size());
+  bucket_compression_types->reserve(buckets.size());
+  for (size_t i = 0; i < buckets.size(); ++i) {
+    if (ABSL_PREDICT_FALSE(!state->messages[i].empty())) {
+      return Fail(state->messages[i]);
+    }
+    bucket_lengths->push_back(state->compressed[i].size());
+    bucket_compression_types->push_back(state->compression_types[i]);
+    if (ABSL_PREDICT_FALSE(
+            !data_writer->Write(std::move(state->compressed[i])))) {
+      return Fail(*data_writer);
+    }
   }
   return true;
 }
 
+inline void TransposeEncoder::AssignBucketGroups() {
+  // Maps a message ID to the node of the field containing the message.
+  FlatHashMap<uint32_t, NodeId, Uint32Hasher> parent_nodes;
+  for (const auto& node : message_nodes_) {
+    parent_nodes.emplace(static_cast<uint32_t>(node.second.message_id),
+                         node.first);
+  }
+  std::vector<uint32_t> reversed_path;
+  for (size_t i = 0; i < kNumBufferTypes; ++i) {
+    for (BufferWithMetadata& x : data_[i]) {
+      reversed_path.clear();
+      NodeId node_id(x.message_id, x.field);
+      for (;;) {
+        reversed_path.push_back(node_id.field);
+        if (node_id.parent_message_id == internal::MessageId::kRoot) break;
+        const auto parent =
+            parent_nodes.find(static_cast<uint32_t>(node_id.parent_message_id));
+        if (parent == parent_nodes.end()) {
+          // Non-proto records have no field path.
+          reversed_path.clear();
+          break;
+        }
+        node_id = parent->second;
+      }
+      if (reversed_path.empty()) continue;
+      for (size_t k = 0; k < separate_fields_.size(); ++k) {
+        const Field::Path& path = separate_fields_[k].path();
+        if (path.size() <= reversed_path.size() &&
+            std::equal(path.begin(), path.end(), reversed_path.rbegin())) {
+          x.bucket_group = k + 1;
+          break;
+        }
+      }
+    }
+  }
+}
+
 inline bool TransposeEncoder::WriteBuffers(
     Writer* header_writer, Writer* data_writer,
-    std::unordered_map<TransposeEncoder::NodeId, uint32_t,
-                       TransposeEncoder::NodeIdHasher>* buffer_pos) {
+    FlatHashMap<NodeId, uint32_t, NodeIdHasher>* buffer_pos,
+    FlatHashMap<NodeId, internal::PackedLayout, NodeIdHasher>*
+        packed_layouts) {
+  if (!separate_fields_.empty()) AssignBucketGroups();
+  if (transpose_packed_) {
+    // Packing changes buffer sizes, so it precedes sorting by size.
+    for (auto& x : data_[static_cast<size_t>(BufferType::kString)]) {
+      const std::string strings(*x.buffer);
+      const std::vector<absl::string_view> values = SplitStrings(strings);
+      internal::PackedLayout layout;
+      if (ChoosePackedLayout(values, &layout)) {
+        *x.buffer = StringsToPacked(values, layout);
+        packed_layouts->emplace(NodeId(x.message_id, x.field), layout);
+      }
+    }
+  }
   size_t num_buffers = 0;
   for (size_t i = 0; i < kNumBufferTypes; ++i) {
-    // Sort data_ by length, largest to smallest.
+    // Sort data_ by bucket group, and then by length, largest to smallest.
     std::sort(data_[i].begin(), data_[i].end(),
               [](const BufferWithMetadata& a, const BufferWithMetadata& b) {
+                if (a.bucket_group != b.bucket_group) {
+                  return a.bucket_group < b.bucket_group;
+                }
                 if (a.buffer->size() != b.buffer->size()) {
                   return a.buffer->size() > b.buffer->size();
                 }
@@ -566,19 +1152,27 @@ inline bool TransposeEncoder::WriteBuffers(
     num_buffers += data_[i].size();
   }
   if (!nonproto_lengths_.empty()) ++num_buffers;
+  const uint32_t nonproto_columns_width = NonProtoColumnsWidth();
+  if (nonproto_columns_width != 0) {
+    for (auto& x : data_[static_cast<size_t>(BufferType::kNonProto)]) {
+      *x.buffer = RowsToColumns(*x.buffer, nonproto_columns_width);
+    }
+  }
 
   std::vector<size_t> buffer_lengths;
   buffer_lengths.reserve(num_buffers);
-  std::vector<size_t> bucket_lengths;
+  std::vector<Chain> buckets;
+  // Bucket groups of "buckets". Buffers of different groups do not share a
+  // bucket.
+  std::vector<size_t> bucket_groups;
 
-  // Write all buffer lengths to the header and data to "bucket_buffer".
+  // Write all buffer lengths to the header and data to "buckets".
   for (size_t i = 0; i < kNumBufferTypes; ++i) {
     for (size_t j = 0; j < data_[i].size(); ++j) {
       const auto& x = data_[i][j];
-      if (ABSL_PREDICT_FALSE(!AddBuffer(j == 0, *x.buffer, data_writer,
-                                        &bucket_lengths, &buffer_lengths))) {
-        return false;
-      }
+      AddBuffer(j == 0 || x.bucket_group != data_[i][j - 1].bucket_group,
+                *x.buffer, &buckets, &buffer_lengths);
+      bucket_groups.resize(buckets.size(), x.bucket_group);
       const auto insert_result = buffer_pos->emplace(
           NodeId(x.message_id, x.field), IntCast<uint32_t>(buffer_pos->size()));
       RIEGELI_ASSERT(insert_result.second)
@@ -588,23 +1182,21 @@ inline bool TransposeEncoder::WriteBuffers(
   }
   if (!nonproto_lengths_.empty()) {
     // nonproto_lengths_ is the last buffer if non-empty.
-    if (ABSL_PREDICT_FALSE(!AddBuffer(
-            /*force_new_bucket=*/true, nonproto_lengths_, data_writer,
-            &bucket_lengths, &buffer_lengths))) {
-      return false;
-    }
+    AddBuffer(/*force_new_bucket=*/true, nonproto_lengths_, &buckets,
+              &buffer_lengths);
+    bucket_groups.resize(buckets.size(), 0);
     // Note: nonproto_lengths_ needs no buffer_pos.
   }
 
-  if (compressor_.writer()->pos() > 0) {
-    // Last bucket.
-    const Position pos_before = data_writer->pos();
-    if (ABSL_PREDICT_FALSE(!compressor_.EncodeAndClose(data_writer))) {
-      return Fail(compressor_);
-    }
-    RIEGELI_ASSERT_GE(data_writer->pos(), pos_before)
-        << "Data writer position decreased";
-    bucket_lengths.push_back(IntCast<size_t>(data_writer->pos() - pos_before));
+  // The last bucket can be empty if it got only empty buffers.
+  if (!buckets.empty() && buckets.back().empty()) buckets.pop_back();
+  bucket_groups.resize(buckets.size());
+  std::vector<size_t> bucket_lengths;
+  std::vector<CompressionType> bucket_compression_types;
+  if (ABSL_PREDICT_FALSE(!WriteBuckets(buckets, bucket_groups, data_writer,
+                                       &bucket_lengths,
+                                       &bucket_compression_types))) {
+    return false;
   }
 
   if (ABSL_PREDICT_FALSE(!WriteVarint32(
@@ -619,6 +1211,14 @@ inline bool TransposeEncoder::WriteBuffers(
       return Fail(*header_writer);
     }
   }
+  if (per_bucket_compression_) {
+    for (CompressionType compression_type : bucket_compression_types) {
+      if (ABSL_PREDICT_FALSE(!WriteByte(
+              header_writer, static_cast<uint8_t>(compression_type)))) {
+        return Fail(*header_writer);
+      }
+    }
+  }
   for (size_t length : buffer_lengths) {
     if (ABSL_PREDICT_FALSE(
             !WriteVarint64(header_writer, IntCast<uint64_t>(length)))) {
@@ -643,12 +1243,14 @@ inline bool TransposeEncoder::WriteStatesAndData(
     RIEGELI_ASSERT_NE(tags_list_[encoded_tags_[0]].dest_info.size(), 1u)
         << "Number of transitions from the last state did not increase";
   }
-  std::unordered_map<NodeId, uint32_t, NodeIdHasher> buffer_pos;
-  if (ABSL_PREDICT_FALSE(
-          !WriteBuffers(header_writer, data_writer, &buffer_pos))) {
+  FlatHashMap<NodeId, uint32_t, NodeIdHasher> buffer_pos;
+  FlatHashMap<NodeId, internal::PackedLayout, NodeIdHasher> packed_layouts;
+  if (ABSL_PREDICT_FALSE(!WriteBuffers(header_writer, data_writer,
+                                       &buffer_pos, &packed_layouts))) {
     return false;
   }
 
+  const uint32_t nonproto_columns_width = NonProtoColumnsWidth();
   std::string subtype_to_write;
   std::vector<uint32_t> buffer_index_to_write;
   std::vector<uint32_t> base_to_write;
@@ -694,7 +1296,18 @@ inline bool TransposeEncoder::WriteStatesAndData(
           return Fail(*header_writer);
         }
       } else {
-        if (ABSL_PREDICT_FALSE(!WriteVarint32(header_writer, etag.tag))) {
+        const auto packed_iter =
+            is_string ? packed_layouts.find(NodeId(etag.message_id,
+                                                   etag.tag >> 3))
+                      : packed_layouts.end();
+        const bool is_packed = packed_iter != packed_layouts.end();
+        // A string with a packed buffer is encoded as WireType::kPackedString
+        // instead of WireType::kLengthDelimited.
+        if (ABSL_PREDICT_FALSE(!WriteVarint32(
+                header_writer,
+                is_packed ? etag.tag + (internal::WireType::kPackedString -
+                                        internal::WireType::kLengthDelimited)
+                          : etag.tag))) {
           return Fail(*header_writer);
         }
         if (internal::HasSubtype(etag.tag)) {
@@ -707,12 +1320,23 @@ inline bool TransposeEncoder::WriteStatesAndData(
               << "Buffer not found: " << static_cast<uint32_t>(etag.message_id)
               << "/" << (etag.tag >> 3);
           buffer_index_to_write.push_back(iter->second);
+          // PackedString is followed by the layout of its buffer.
+          if (is_packed) {
+            buffer_index_to_write.push_back(
+                static_cast<uint32_t>(packed_iter->second));
+          }
         }
       }
     } else {
-      // NonProto and StartOfMessage special IDs.
+      // NonProto, NonProtoColumns, and StartOfMessage special IDs.
+      const bool is_nonproto_columns =
+          etag.message_id == internal::MessageId::kNonProto &&
+          nonproto_columns_width != 0;
       if (ABSL_PREDICT_FALSE(!WriteVarint32(
-              header_writer, static_cast<uint32_t>(etag.message_id)))) {
+              header_writer,
+              static_cast<uint32_t>(is_nonproto_columns
+                                        ? internal::MessageId::kNonProtoColumns
+                                        : etag.message_id)))) {
         return Fail(*header_writer);
       }
       if (etag.message_id == internal::MessageId::kNonProto) {
@@ -722,6 +1346,10 @@ inline bool TransposeEncoder::WriteStatesAndData(
         RIEGELI_ASSERT(iter != buffer_pos.end())
             << "Buffer of non-proto records not found";
         buffer_index_to_write.push_back(iter->second);
+        // NonProtoColumns is followed by the record size.
+        if (is_nonproto_columns) {
+          buffer_index_to_write.push_back(nonproto_columns_width);
+        }
       } else {
         RIEGELI_ASSERT_EQ(
             static_cast<uint32_t>(etag.message_id),
@@ -913,17 +1541,7 @@ inline bool TransposeEncoder::WriteTransitions(
   return true;
 }
 
-inline void TransposeEncoder::CollectTransitionStatistics() {
-  // Go through all the transitions from back to front and collect transition
-  // distribution statistics.
-  uint32_t prev_pos = encoded_tags_.back();
-  for (size_t i = encoded_tags_.size() - 1; i > 0; --i) {
-    const uint32_t pos = encoded_tags_[i - 1];
-    ++tags_list_[prev_pos].dest_info[pos].num_transitions;
-    ++tags_list_[pos].num_incoming_transitions;
-    prev_pos = pos;
-  }
-
+inline void TransposeEncoder::FinishTransitionStatistics() {
   if (tags_list_[encoded_tags_.back()].num_incoming_transitions == 0) {
     // This guarantees that the initial state is created even if it has no other
     // incoming transition.
@@ -1083,7 +1701,7 @@ TransposeEncoder::CreateStateMachine(uint32_t max_transition,
     return state_machine;
   }
 
-  CollectTransitionStatistics();
+  FinishTransitionStatistics();
 
   // Go through all the tag infos and update transitions that will be included
   // in the private list for the node.
@@ -1323,8 +1941,12 @@ bool TransposeEncoder::EncodeAndCloseInternal(uint32_t max_transition,
     return Fail(nonproto_lengths_writer_);
   }
 
-  if (ABSL_PREDICT_FALSE(
-          !WriteByte(dest, static_cast<uint8_t>(compression_type_)))) {
+  if (ABSL_PREDICT_FALSE(!WriteByte(
+          dest, static_cast<uint8_t>(
+                    static_cast<uint8_t>(compression_type_) |
+                    (per_bucket_compression_
+                         ? internal::kPerBucketCompression()
+                         : uint8_t{0}))))) {
     return Fail(*dest);
   }
 
@@ -1372,4 +1994,40 @@ ChunkType TransposeEncoder::GetChunkType() const {
   return ChunkType::kTransposed;
 }
 
+void TransposeEncoder::AddUniqueTo(MemoryEstimator* memory_estimator) const {
+  ChunkEncoder::AddUniqueTo(memory_estimator);
+  memory_estimator->AddMemory(
+      sizeof(TransposeEncoder) - sizeof(ChunkEncoder) -
+      sizeof(internal::Compressor) - sizeof(encoded_tag_pos_) -
+      sizeof(message_nodes_) - sizeof(Chain));
+  compressor_.AddUniqueTo(memory_estimator);
+  memory_estimator->AddMemory(
+      sizeof(EncodedTagInfo) * (tags_list_.capacity() - tags_list_.size()));
+  for (const EncodedTagInfo& tag_info : tags_list_) {
+    memory_estimator->AddMemory(sizeof(EncodedTagInfo) -
+                                sizeof(tag_info.dest_info));
+    tag_info.dest_info.AddUniqueTo(memory_estimator);
+  }
+  memory_estimator->AddMemory(sizeof(uint32_t) * encoded_tags_.capacity());
+  encoded_tag_pos_.AddUniqueTo(memory_estimator);
+  for (const std::vector<BufferWithMetadata>& buffers : data_) {
+    memory_estimator->AddMemory(sizeof(BufferWithMetadata) *
+                                buffers.capacity());
+    for (const BufferWithMetadata& buffer : buffers) {
+      buffer.buffer->AddUniqueTo(memory_estimator);
+    }
+  }
+  memory_estimator->AddMemory(sizeof(internal::MessageId) *
+                              group_stack_.capacity());
+  message_nodes_.AddUniqueTo(memory_estimator);
+  for (const auto& entry : message_nodes_) {
+    // The writer writes to a buffer in data_, which is already registered.
+    if (entry.second.writer != nullptr) {
+      memory_estimator->AddMemory(sizeof(ChainBackwardWriter));
+    }
+  }
+  nonproto_lengths_.AddUniqueTo(memory_estimator);
+  memory_estimator->AddMemory(serialized_message_.capacity());
+}
+
 }  // namespace riegeli
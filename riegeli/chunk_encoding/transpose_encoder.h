@@ -19,18 +19,22 @@
 #include <stdint.h>
 #include <memory>
 #include <string>
-#include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include "google/protobuf/message_lite.h"
 #include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/base/flat_hash_map.h"
 #include "riegeli/base/object.h"
 #include "riegeli/bytes/chain_backward_writer.h"
 #include "riegeli/bytes/writer.h"
 #include "riegeli/chunk_encoding/chunk_encoder.h"
 #include "riegeli/chunk_encoding/compressor.h"
 #include "riegeli/chunk_encoding/compressor_options.h"
+#include "riegeli/chunk_encoding/field_filter.h"
 #include "riegeli/chunk_encoding/transpose_internal.h"
 #include "riegeli/chunk_encoding/types.h"
 
@@ -39,7 +43,8 @@ namespace riegeli {
 class Reader;
 
 // Format (values are varint encoded unless indicated otherwise):
-//  - Compression type
+//  - Compression type (byte), with internal::kPerBucketCompression() set if
+//    buckets have their own compression types
 //  - Header length (compressed length if applicable)
 //  - Header (possibly compressed):
 //    - Number of separately compressed buckets that data buffers are split into
@@ -47,24 +52,95 @@ class Reader;
 //    - Number of data buffers [num_buffers]
 //    - Array of "num_buckets" varints: sizes of buckets (compressed size
 //      if applicable)
+//    - Only with per-bucket compression: array of "num_buckets" bytes:
+//      compression types of buckets
 //    - Array of "num_buffers" varints: lengths of buffers (uncompressed)
 //    - Number of state machine states [num_state]
 //    - States encoded in 4 blocks:
 //      - Array of "num_state" Tags/ReservedIDs
 //      - Array of "num_state" next node indices
 //      - Array of subtypes (for all tags where applicable)
-//      - Array of data buffer indices (for all tags/subtypes where applicable)
+//      - Array of data buffer indices (for all tags/subtypes where applicable),
+//        followed by the record size for the NonProtoColumns reserved ID, and
+//        by the internal::PackedLayout for tags with
+//        internal::WireType::kPackedString
 //    - Initial state index
 //  - "num_buckets" buckets:
 //    - Bucket data (possibly compressed):
 //      - Concatenated data buffers in this bucket (bytes)
+//
+// A data buffer of a string or bytes field contains its values, each preceded
+// by its length. With internal::WireType::kPackedString, the values are packed
+// repeated numeric values, and the buffer contains instead:
+//  - Number of values
+//  - Array of numbers of elements of values
+//  - Elements of all values: concatenated varints, or for fixed width elements,
+//    their first bytes, then their second bytes, etc.
 //  - Transitions (possibly compressed):
 //    - State machine transitions (bytes)
 class TransposeEncoder : public ChunkEncoder {
  public:
+  // Choices of compression made per bucket instead of compressing all buckets
+  // like the rest of the chunk. Making any of them stores the compression type
+  // of each bucket in the chunk, which then requires a reader which supports
+  // this. They are ignored if compression is disabled.
+  struct BucketCompression {
+    // If true, buckets of "separate_fields" are compressed with
+    // "separate_fields_options" instead, e.g. with faster compression for
+    // fields which are frequently read alone.
+    bool has_separate_fields_options = false;
+    CompressorOptions separate_fields_options;
+    // If true, a bucket which compression would shrink by less than 1/8 is
+    // stored uncompressed, e.g. a bucket of random hashes, so that reading it
+    // does not spend time decompressing it.
+    bool store_incompressible = false;
+  };
+
   // Creates an empty TransposeEncoder.
   TransposeEncoder(CompressorOptions options, uint64_t bucket_size);
 
+  // Creates an empty TransposeEncoder.
+  //
+  // If "transpose_nonproto" is true and compression is enabled, records which
+  // are not protocol messages are stored column by column if they all have the
+  // same size, e.g. fixed-width binary structs. This compresses better because
+  // bytes at the same offset in different records tend to be similar, but it
+  // requires a reader which supports this.
+  TransposeEncoder(CompressorOptions options, uint64_t bucket_size,
+                   bool transpose_nonproto);
+
+  // Creates an empty TransposeEncoder.
+  //
+  // Values of each field in "separate_fields", including fields of its
+  // submessages, are put in buckets of their own, not shared with other
+  // fields. This lets reading with a FieldFilter skip decompressing them, or
+  // decompress only them, regardless of "bucket_size". This does not change
+  // the format.
+  TransposeEncoder(CompressorOptions options, uint64_t bucket_size,
+                   bool transpose_nonproto, std::vector<Field> separate_fields);
+
+  // Creates an empty TransposeEncoder.
+  //
+  // "bucket_compression" chooses compression of some buckets differently from
+  // the rest of the chunk.
+  TransposeEncoder(CompressorOptions options, uint64_t bucket_size,
+                   bool transpose_nonproto, std::vector<Field> separate_fields,
+                   BucketCompression bucket_compression);
+
+  // Creates an empty TransposeEncoder.
+  //
+  // If "transpose_packed" is true and compression is enabled, a string or
+  // bytes field whose values all look like packed repeated numeric fields
+  // (sequences of varints, or of fixed width numbers) has its elements stored
+  // separately from numbers of elements of values, fixed width elements column
+  // by column, e.g. for feature vectors of floats. This compresses better
+  // because bytes at the same offset in different elements tend to be similar,
+  // but it requires a reader which supports this. Values are restored exactly
+  // even if the guess is wrong.
+  TransposeEncoder(CompressorOptions options, uint64_t bucket_size,
+                   bool transpose_nonproto, std::vector<Field> separate_fields,
+                   BucketCompression bucket_compression, bool transpose_packed);
+
   ~TransposeEncoder();
 
   void Reset() override;
@@ -74,6 +150,7 @@ class TransposeEncoder : public ChunkEncoder {
   // string. Such records are internally stored separately -- these are not
   // broken down into columns.
   using ChunkEncoder::AddRecord;
+  bool AddRecord(const google::protobuf::MessageLite& record) override;
   bool AddRecord(absl::string_view record) override;
   bool AddRecord(std::string&& record) override;
   bool AddRecord(const Chain& record) override;
@@ -85,6 +162,8 @@ class TransposeEncoder : public ChunkEncoder {
 
   ChunkType GetChunkType() const override;
 
+  void AddUniqueTo(MemoryEstimator* memory_estimator) const override;
+
  protected:
   void Done() override;
 
@@ -144,6 +223,10 @@ class TransposeEncoder : public ChunkEncoder {
     size_t operator()(NodeId node_id) const;
   };
 
+  // Returns the size of each non-proto record if they should be stored column
+  // by column, otherwise 0.
+  uint32_t NonProtoColumnsWidth() const;
+
   // Get ChainBackwardWriter for field "field" in message "parent_message_id".
   // "type" is used to select the right category for the buffer if not created
   // yet.
@@ -157,13 +240,19 @@ class TransposeEncoder : public ChunkEncoder {
   bool AddMessage(Reader* record, internal::MessageId parent_message_id,
                   int depth);
 
+  // Assigns BufferWithMetadata::bucket_group of buffers in "data_" according
+  // to "separate_fields_".
+  void AssignBucketGroups();
+
   // Write all buffer lengths to "header_writer" and data buffers in "data_" to
   // "data_writer" (compressed using compressor_). Fill map with the sequential
-  // position of each buffer written.
+  // position of each buffer written, and "packed_layouts" with the layout of
+  // each string buffer stored as packed repeated numeric values.
   bool WriteBuffers(
       Writer* header_writer, Writer* data_writer,
-      std::unordered_map<TransposeEncoder::NodeId, uint32_t,
-                         TransposeEncoder::NodeIdHasher>* buffer_pos);
+      FlatHashMap<NodeId, uint32_t, NodeIdHasher>* buffer_pos,
+      FlatHashMap<NodeId, internal::PackedLayout, NodeIdHasher>*
+          packed_layouts);
 
   // One state of the state machine created in encoder.
   struct StateInfo {
@@ -182,13 +271,30 @@ class TransposeEncoder : public ChunkEncoder {
     uint32_t canonical_source;
   };
 
-  // Add "next_chunk" to compressor_.writer(). If either the current bucket
-  // would become too large or "force_new_bucket" is true, flush the current
-  // bucket to "data_writer" first and create a new bucket.
-  bool AddBuffer(bool force_new_bucket, const Chain& next_chunk,
-                 Writer* data_writer, std::vector<size_t>* bucket_lengths,
+  // Add "next_chunk" to the last bucket in "buckets". If either the last
+  // bucket would become too large or "force_new_bucket" is true, create a new
+  // bucket first.
+  void AddBuffer(bool force_new_bucket, const Chain& next_chunk,
+                 std::vector<Chain>* buckets,
                  std::vector<size_t>* buffer_lengths);
 
+  // Write "buckets" to "data_writer" (compressed using compressor_, or in
+  // parallel if "parallelism_" > 0), their compressed lengths to
+  // "bucket_lengths", and their compression types to
+  // "bucket_compression_types". "bucket_groups" are bucket groups of
+  // "buckets", which choose their compression if "per_bucket_compression_".
+  bool WriteBuckets(const std::vector<Chain>& buckets,
+                    const std::vector<size_t>& bucket_groups,
+                    Writer* data_writer, std::vector<size_t>* bucket_lengths,
+                    std::vector<CompressionType>* bucket_compression_types);
+
+  // Implementation of WriteBuckets() if "parallelism_" > 0.
+  bool WriteBucketsInParallel(
+      const std::vector<Chain>& buckets,
+      const std::vector<size_t>& bucket_groups, Writer* data_writer,
+      std::vector<size_t>* bucket_lengths,
+      std::vector<CompressionType>* bucket_compression_types);
+
   // Compute base indices for states in "state_machine" that don't have one yet.
   // "public_list_base" is the index of the start of the public list.
   // "public_list_noops" is the list of NoOp states that don't have a base set
@@ -198,9 +304,9 @@ class TransposeEncoder : public ChunkEncoder {
       const std::vector<std::pair<uint32_t, uint32_t>>& public_list_noops,
       std::vector<StateInfo>* state_machine);
 
-  // Traverse "encoded_tags_" and populate "num_incoming_transitions" and
-  // "dest_info" in "tags_list_" based on transition distribution.
-  void CollectTransitionStatistics();
+  // Finish "num_incoming_transitions" and "dest_info" in "tags_list_", which
+  // are collected by AddEncodedTag() as tags are added.
+  void FinishTransitionStatistics();
 
   // Create a state machine for "encoded_tags_".
   std::vector<StateInfo> CreateStateMachine(uint32_t max_transition,
@@ -240,6 +346,10 @@ class TransposeEncoder : public ChunkEncoder {
   // list yet.
   uint32_t GetPosInTagsList(EncodedTag etag);
 
+  // Append the position of the encoded tag in "tags_list_" to "encoded_tags_",
+  // and account for the transition from it in "tags_list_".
+  void AddEncodedTag(EncodedTag etag);
+
   // Information about the state machine transition destination.
   struct DestInfo {
     DestInfo();
@@ -260,7 +370,7 @@ class TransposeEncoder : public ChunkEncoder {
     explicit EncodedTagInfo(EncodedTag tag);
     EncodedTag tag;
     // Maps all destinations reachable from this encoded tag to DestInfo.
-    std::unordered_map<uint32_t, DestInfo, Uint32Hasher> dest_info;
+    FlatHashMap<uint32_t, DestInfo, Uint32Hasher> dest_info;
     // Number of incoming tranitions into this state.
     size_t num_incoming_transitions = 0;
     // Index of this state in the state machine.
@@ -287,6 +397,9 @@ class TransposeEncoder : public ChunkEncoder {
     internal::MessageId message_id;
     // Field number in message with ID "message_id" that the buffer belongs to.
     uint32_t field;
+    // 1 + index in "separate_fields_" of the field containing this buffer, or 0
+    // if none. Buffers of different groups are not put in the same bucket.
+    size_t bucket_group = 0;
   };
 
   CompressionType compression_type_;
@@ -294,6 +407,23 @@ class TransposeEncoder : public ChunkEncoder {
   // Finer bucket granularity (i.e. smaller size) worsens compression density
   // but makes field filtering more effective.
   uint64_t bucket_size_;
+  // Number of threads compressing buckets in parallel, in addition to the
+  // encoding thread.
+  int parallelism_;
+  // If true, non-proto records of the same size are stored column by column.
+  bool transpose_nonproto_;
+  // If true, string buffers which look like packed repeated numeric fields are
+  // stored as such.
+  bool transpose_packed_;
+  // Fields whose values are put in buckets of their own.
+  std::vector<Field> separate_fields_;
+  // Options for compressing buckets in parallel.
+  CompressorOptions bucket_compressor_options_;
+  // If true, buckets have their own compression types, stored in the header.
+  bool per_bucket_compression_;
+  // Per-bucket compression choices, used if "per_bucket_compression_".
+  // "separate_fields_options" have parallelism 0.
+  BucketCompression bucket_compression_;
 
   uint64_t decoded_data_size_ = 0;
   internal::Compressor compressor_;
@@ -302,18 +432,28 @@ class TransposeEncoder : public ChunkEncoder {
   // Sequence of tags on input as indices into "tags_list_".
   std::vector<uint32_t> encoded_tags_;
   // Position of encoded tag in "tags_list_".
-  std::unordered_map<EncodedTag, uint32_t, EncodedTagHasher> encoded_tag_pos_;
+  FlatHashMap<EncodedTag, uint32_t, EncodedTagHasher> encoded_tag_pos_;
   // Data buffers in separate vectors per buffer type.
   std::vector<BufferWithMetadata> data_[kNumBufferTypes];
   // Every group creates a new message ID. We keep track of open groups in this
   // vector.
   std::vector<internal::MessageId> group_stack_;
   // Tree of message nodes.
-  std::unordered_map<NodeId, MessageNode, NodeIdHasher> message_nodes_;
+  FlatHashMap<NodeId, MessageNode, NodeIdHasher> message_nodes_;
+  // NodeId and result of the last GetBuffer() call, which is likely to be
+  // repeated for repeated fields. last_buffer_ == nullptr if there is none.
+  NodeId last_buffer_node_id_{internal::MessageId::kNoOp, 0};
+  ChainBackwardWriter* last_buffer_ = nullptr;
   Chain nonproto_lengths_;
   ChainBackwardWriter nonproto_lengths_writer_;
+  uint64_t num_nonproto_records_ = 0;
+  // Size of each non-proto record if they all have the same size, otherwise 0.
+  Position nonproto_record_size_ = 0;
   // Counter used to assign unique IDs to the message nodes.
   internal::MessageId next_message_id_ = internal::MessageId::kRoot + 1;
+  // Buffer reused by AddRecord(const MessageLite&) for serialized messages, so
+  // that their transposition does not allocate per record.
+  std::string serialized_message_;
 };
 
 }  // namespace riegeli
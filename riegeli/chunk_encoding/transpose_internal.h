@@ -28,6 +28,10 @@ enum class MessageId : uint32_t {
   kNonProto,
   kStartOfSubmessage,
   kStartOfMessage,
+  // Like kNonProto, but non-proto records all have the same size, given after
+  // the buffer index, and are stored in the buffer column by column: first
+  // bytes of all records, then their second bytes, etc.
+  kNonProtoColumns,
   // kRoot marks the root node in memory. It is never encoded.
   kRoot,
   // Remaining message ids are proto tags (field << 3 | wire_type).
@@ -42,8 +46,8 @@ inline MessageId& operator++(MessageId& a) { return a = a + 1; }
 static_assert(static_cast<uint32_t>(MessageId::kRoot) <= 8,
               "Reserved ids must not overlap valid proto tags");
 
-// This matches google::protobuf::internal::WireFormatLite::WireType, except for an
-// addition of kSubmessage.
+// This matches google::protobuf::internal::WireFormatLite::WireType, except for
+// additions of kSubmessage and kPackedString.
 enum class WireType : uint32_t {
   kVarint = 0,
   kFixed64 = 1,
@@ -54,6 +58,10 @@ enum class WireType : uint32_t {
   // kSubmessage does marks the end of a submessage, distinguishing it from the
   // end of a string or bytes field, which is encoded using kLengthDelimited.
   kSubmessage = 6,
+  // kPackedString marks a string or bytes field whose data buffer stores packed
+  // repeated numeric values rearranged into columns, with the PackedLayout
+  // given after the buffer index. It is decoded as kLengthDelimited.
+  kPackedString = 7,
 };
 
 inline uint32_t operator-(WireType a, WireType b) {
@@ -81,6 +89,26 @@ enum class Subtype : uint8_t {
   kLengthDelimitedEndOfSubmessage = 2,
 };
 
+// Layout of packed repeated numeric values in the data buffer of a
+// WireType::kPackedString field. The value is the width of an element, or 0
+// for varints.
+enum class PackedLayout : uint32_t {
+  kVarint = 0,
+  kFixed32 = 4,
+  kFixed64 = 8,
+};
+
+// Returns true if "layout" is a valid PackedLayout.
+inline bool ValidPackedLayout(uint32_t layout) {
+  switch (static_cast<PackedLayout>(layout)) {
+    case PackedLayout::kVarint:
+    case PackedLayout::kFixed32:
+    case PackedLayout::kFixed64:
+      return true;
+  }
+  return false;
+}
+
 inline Subtype operator+(Subtype a, uint8_t b) {
   return static_cast<Subtype>(static_cast<uint8_t>(a) + b);
 }
@@ -89,6 +117,21 @@ inline uint8_t operator-(Subtype a, Subtype b) {
   return static_cast<uint8_t>(a) - static_cast<uint8_t>(b);
 }
 
+// Returns true if "tag" is a valid protocol buffer tag.
+inline bool ValidTag(uint32_t tag) {
+  switch (static_cast<WireType>(tag & 7)) {
+    case WireType::kVarint:
+    case WireType::kFixed32:
+    case WireType::kFixed64:
+    case WireType::kLengthDelimited:
+    case WireType::kStartGroup:
+    case WireType::kEndGroup:
+      return tag >= 8;
+    default:
+      return false;
+  }
+}
+
 // Returns whether "tag"/"subtype" pair has a data buffer.
 // Precondition: "tag" is a valid proto tag.
 inline bool HasDataBuffer(uint32_t tag, Subtype subtype) {
@@ -23,7 +23,13 @@ namespace riegeli {
 enum class ChunkType : uint8_t {
   kPadding = 0,
   kSimple = 's',
+  kBlockedSimple = 'b',
   kTransposed = 't',
+  kIndex = 'i',
+  kSummary = 'm',
+  kDeduplicated = 'd',
+  kDelta = 'p',
+  kFragment = 'f',
 };
 
 // These values are frozen in the file format.
@@ -31,8 +37,33 @@ enum class CompressionType : uint8_t {
   kNone = 0,
   kBrotli = 'b',
   kZstd = 'z',
+  kLz4 = '4',
 };
 
+namespace internal {
+
+// Flag in the compression type byte of a transposed chunk, set if each bucket
+// has its own compression type, stored in the header after bucket lengths. The
+// remaining bits are the compression type of the header and transitions.
+//
+// This value is frozen in the file format.
+constexpr uint8_t kPerBucketCompression() { return 0x80; }
+
+// Format of chunk data (ChunkType::kFragment), holding a fragment of a record
+// written incrementally, split across consecutive chunks:
+//  - Fragment flags, a combination of kFirstFragment and kLastFragment
+//  - Compression type
+//  - Fragment (compressed)
+//
+// num_records is 1 for the first fragment, where the record begins, and 0 for
+// the remaining fragments. decoded_data_size is the size of the fragment.
+//
+// These values are frozen in the file format.
+constexpr uint8_t kFirstFragment = 1;
+constexpr uint8_t kLastFragment = 2;
+
+}  // namespace internal
+
 }  // namespace riegeli
 
 #endif  // RIEGELI_CHUNK_ENCODING_INTERNAL_TYPES_H_
@@ -0,0 +1,157 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/chunk_encoding/zstd_dictionary_trainer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <limits>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/object.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/chunk_decoder.h"
+#include "riegeli/chunk_encoding/chunk_describer.h"
+#include "riegeli/chunk_encoding/field_filter.h"
+#include "zdict.h"
+
+namespace riegeli {
+
+ZstdDictionaryTrainer::ZstdDictionaryTrainer(Options options)
+    : Object(State::kOpen),
+      max_dictionary_size_(options.max_dictionary_size_),
+      max_samples_(options.max_samples_),
+      max_sample_size_(options.max_sample_size_),
+      field_filter_(std::move(options.field_filter_)),
+      random_(options.seed_),
+      describer_(ChunkDescriber::Options().set_zstd_dictionaries(
+          options.zstd_dictionaries_)),
+      decoder_(ChunkDecoder::Options().set_zstd_dictionaries(
+          options.zstd_dictionaries_)) {}
+
+void ZstdDictionaryTrainer::Done() {
+  describer_.Close();
+  decoder_.Close();
+  buffers_ = std::vector<TransposedBuffer>();
+  samples_ = std::vector<std::string>();
+}
+
+bool ZstdDictionaryTrainer::AddChunk(const Chunk& chunk) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(!describer_.ReadTransposedBuffers(chunk, &buffers_))) {
+    return Fail(describer_);
+  }
+  if (!buffers_.empty()) {
+    for (const TransposedBuffer& buffer : buffers_) {
+      if (!buffer.data.empty() && IncludesField(buffer.path)) {
+        AddChainSample(buffer.data);
+      }
+    }
+    buffers_.clear();
+    return true;
+  }
+  if (chunk.header.num_records() == 0) return true;
+  if (ABSL_PREDICT_FALSE(!decoder_.Reset(chunk))) return Fail(decoder_);
+  absl::string_view record;
+  while (decoder_.ReadRecord(&record)) {
+    if (!record.empty()) AddSample(record);
+  }
+  if (ABSL_PREDICT_FALSE(!decoder_.healthy())) return Fail(decoder_);
+  return true;
+}
+
+void ZstdDictionaryTrainer::AddSample(absl::string_view sample) {
+  const size_t index = SampleIndex();
+  if (index == max_samples_) return;
+  sample = sample.substr(0, max_sample_size_);
+  if (index == samples_.size()) {
+    samples_.emplace_back(sample.data(), sample.size());
+  } else {
+    samples_[index].assign(sample.data(), sample.size());
+  }
+}
+
+inline void ZstdDictionaryTrainer::AddChainSample(const Chain& sample) {
+  const size_t index = SampleIndex();
+  if (index == max_samples_) return;
+  if (index == samples_.size()) samples_.emplace_back();
+  std::string& dest = samples_[index];
+  dest.clear();
+  for (const absl::string_view fragment : sample.blocks()) {
+    const size_t length =
+        UnsignedMin(fragment.size(), max_sample_size_ - dest.size());
+    dest.append(fragment.data(), length);
+    if (dest.size() == max_sample_size_) break;
+  }
+}
+
+inline size_t ZstdDictionaryTrainer::SampleIndex() {
+  ++num_samples_seen_;
+  if (samples_.size() < max_samples_) return samples_.size();
+  // Reservoir sampling: the new sample replaces a random kept sample with
+  // probability max_samples_ / num_samples_seen_.
+  const uint64_t index = std::uniform_int_distribution<uint64_t>(
+      0, num_samples_seen_ - 1)(random_);
+  return index < max_samples_ ? IntCast<size_t>(index) : max_samples_;
+}
+
+inline bool ZstdDictionaryTrainer::IncludesField(
+    const Field::Path& path) const {
+  if (field_filter_.include_all()) return true;
+  for (const Field& field : field_filter_.fields()) {
+    if (field.path().size() <= path.size() &&
+        std::equal(field.path().begin(), field.path().end(), path.begin())) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ZstdDictionaryTrainer::Train(std::string* dictionary) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(samples_.empty())) return Fail("No samples");
+  if (ABSL_PREDICT_FALSE(samples_.size() >
+                         std::numeric_limits<unsigned>::max())) {
+    return Fail("Too many samples");
+  }
+  std::string samples;
+  std::vector<size_t> sample_sizes;
+  sample_sizes.reserve(samples_.size());
+  for (const std::string& sample : samples_) {
+    samples.append(sample);
+    sample_sizes.push_back(sample.size());
+  }
+  dictionary->resize(max_dictionary_size_);
+  const size_t result = ZDICT_trainFromBuffer(
+      &(*dictionary)[0], dictionary->size(), samples.data(),
+      sample_sizes.data(), IntCast<unsigned>(sample_sizes.size()));
+  if (ABSL_PREDICT_FALSE(ZDICT_isError(result))) {
+    dictionary->clear();
+    return Fail(absl::StrCat("ZDICT_trainFromBuffer() failed: ",
+                             ZDICT_getErrorName(result)));
+  }
+  dictionary->resize(result);
+  return true;
+}
+
+}  // namespace riegeli
@@ -0,0 +1,218 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_CHUNK_ENCODING_ZSTD_DICTIONARY_TRAINER_H_
+#define RIEGELI_CHUNK_ENCODING_ZSTD_DICTIONARY_TRAINER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/object.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/chunk_decoder.h"
+#include "riegeli/chunk_encoding/chunk_describer.h"
+#include "riegeli/chunk_encoding/field_filter.h"
+
+namespace riegeli {
+
+class ZstdDictionaryRegistry;
+
+// Trains a Zstd dictionary on samples of existing Riegeli/records files, to be
+// used with RecordWriter::Options::set_zstd_dictionary() for writing similar
+// files. The trained dictionary carries an id, so that reading the files
+// needs only registering the dictionary in a ZstdDictionaryRegistry passed to
+// RecordReader::Options::set_zstd_dictionaries().
+//
+// Samples are taken from chunks: from data buffers of transposed chunks, which
+// is what their buckets compress, and from records of other chunks. Training
+// on records would fit transposed chunks poorly. Samples are prefixes of
+// buffers or records, because a dictionary helps mostly at the beginning of
+// data compressed together. If there are more samples than
+// Options::set_max_samples(), a uniform random subset of them is kept.
+//
+// A dictionary is meant for one compression method, so files to be written
+// with set_transpose(true) and set_transpose(false) should use separate
+// dictionaries, trained on files written accordingly.
+//
+// A ZstdDictionaryTrainer is thread-compatible.
+class ZstdDictionaryTrainer : public Object {
+ public:
+  class Options {
+   public:
+    // Not defaulted because of a C++ defect:
+    // https://stackoverflow.com/questions/17430377
+    Options() noexcept {}
+
+    // Sets the maximal size of the trained dictionary. Zstd suggests about
+    // 100 KiB, and about 100 times more samples.
+    //
+    // Default: 110K
+    Options& set_max_dictionary_size(size_t max_dictionary_size) & {
+      RIEGELI_ASSERT_GT(max_dictionary_size, 0u)
+          << "Failed precondition of "
+             "ZstdDictionaryTrainer::Options::set_max_dictionary_size(): "
+             "zero size";
+      max_dictionary_size_ = max_dictionary_size;
+      return *this;
+    }
+    Options&& set_max_dictionary_size(size_t max_dictionary_size) && {
+      return std::move(set_max_dictionary_size(max_dictionary_size));
+    }
+
+    // Sets the maximal number of samples kept for training.
+    //
+    // Default: 16K
+    Options& set_max_samples(size_t max_samples) & {
+      RIEGELI_ASSERT_GT(max_samples, 0u)
+          << "Failed precondition of "
+             "ZstdDictionaryTrainer::Options::set_max_samples(): "
+             "zero samples";
+      max_samples_ = max_samples;
+      return *this;
+    }
+    Options&& set_max_samples(size_t max_samples) && {
+      return std::move(set_max_samples(max_samples));
+    }
+
+    // Sets the maximal size of a sample. Longer buffers and records are
+    // truncated.
+    //
+    // Default: 8K
+    Options& set_max_sample_size(size_t max_sample_size) & {
+      RIEGELI_ASSERT_GT(max_sample_size, 0u)
+          << "Failed precondition of "
+             "ZstdDictionaryTrainer::Options::set_max_sample_size(): "
+             "zero size";
+      max_sample_size_ = max_sample_size;
+      return *this;
+    }
+    Options&& set_max_sample_size(size_t max_sample_size) && {
+      return std::move(set_max_sample_size(max_sample_size));
+    }
+
+    // Specifies fields whose buffers of transposed chunks are sampled, e.g.
+    // fields which dominate the size of chunks, as reported by ChunkDescriber.
+    // A field includes its subfields. Non-proto records are sampled only if
+    // all fields are included. Records of chunks which are not transposed are
+    // sampled whole regardless of this filter.
+    //
+    // Default: FieldFilter::All()
+    Options& set_field_filter(FieldFilter field_filter) & {
+      field_filter_ = std::move(field_filter);
+      return *this;
+    }
+    Options&& set_field_filter(FieldFilter field_filter) && {
+      return std::move(set_field_filter(std::move(field_filter)));
+    }
+
+    // Sets the seed of the random choice of samples. The same seed and the same
+    // chunks give the same dictionary.
+    //
+    // Default: 0
+    Options& set_seed(uint64_t seed) & {
+      seed_ = seed;
+      return *this;
+    }
+    Options&& set_seed(uint64_t seed) && { return std::move(set_seed(seed)); }
+
+    // Specifies Zstd dictionaries used to decompress chunks compressed with a
+    // dictionary. The registry must be kept alive until the
+    // ZstdDictionaryTrainer is closed.
+    //
+    // Default: nullptr
+    Options& set_zstd_dictionaries(
+        const ZstdDictionaryRegistry* zstd_dictionaries) & {
+      zstd_dictionaries_ = zstd_dictionaries;
+      return *this;
+    }
+    Options&& set_zstd_dictionaries(
+        const ZstdDictionaryRegistry* zstd_dictionaries) && {
+      return std::move(set_zstd_dictionaries(zstd_dictionaries));
+    }
+
+   private:
+    friend class ZstdDictionaryTrainer;
+
+    size_t max_dictionary_size_ = size_t{110} << 10;
+    size_t max_samples_ = size_t{16} << 10;
+    size_t max_sample_size_ = size_t{8} << 10;
+    FieldFilter field_filter_ = FieldFilter::All();
+    uint64_t seed_ = 0;
+    const ZstdDictionaryRegistry* zstd_dictionaries_ = nullptr;
+  };
+
+  explicit ZstdDictionaryTrainer(Options options = Options());
+
+  ZstdDictionaryTrainer(const ZstdDictionaryTrainer&) = delete;
+  ZstdDictionaryTrainer& operator=(const ZstdDictionaryTrainer&) = delete;
+
+  // Adds samples from a chunk, as read by ChunkReader.
+  //
+  // Return values:
+  //  * true  - success (healthy())
+  //  * false - failure (!healthy())
+  bool AddChunk(const Chunk& chunk);
+
+  // Adds a sample, e.g. a record read by RecordReader.
+  void AddSample(absl::string_view sample);
+
+  // Returns the number of samples offered so far, and the number kept.
+  uint64_t num_samples_seen() const { return num_samples_seen_; }
+  size_t num_samples() const { return samples_.size(); }
+
+  // Trains a dictionary on the samples kept, and sets *dictionary to it,
+  // suitable for ZstdDictionary. Samples are kept, so more can be added and
+  // training repeated.
+  //
+  // Return values:
+  //  * true  - success (*dictionary is set, healthy())
+  //  * false - failure (!healthy()), e.g. too few samples
+  bool Train(std::string* dictionary);
+
+ protected:
+  void Done() override;
+
+ private:
+  // Returns true if buffers of the field on path are sampled.
+  bool IncludesField(const Field::Path& path) const;
+
+  // Like AddSample(), taking a prefix of sample without flattening it.
+  void AddChainSample(const Chain& sample);
+
+  // Returns the index in samples_ where a new sample should be stored, or
+  // max_samples_ if it should be skipped.
+  size_t SampleIndex();
+
+  size_t max_dictionary_size_;
+  size_t max_samples_;
+  size_t max_sample_size_;
+  FieldFilter field_filter_;
+  std::mt19937_64 random_;
+  ChunkDescriber describer_;
+  ChunkDecoder decoder_;
+  std::vector<TransposedBuffer> buffers_;
+  uint64_t num_samples_seen_ = 0;
+  std::vector<std::string> samples_;
+};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_CHUNK_ENCODING_ZSTD_DICTIONARY_TRAINER_H_
@@ -19,13 +19,10 @@
 #include <getopt.h>
 #include <stddef.h>
 #include <stdint.h>
-#include <sys/stat.h>
 #include <sys/types.h>
-#include <time.h>
 #include <unistd.h>
 #include <algorithm>
 #include <array>
-#include <cerrno>
 #include <cmath>
 #include <cstdlib>
 #include <functional>
@@ -35,18 +32,20 @@
 #include <memory>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
 #include "absl/strings/numbers.h"
 #include "absl/base/optimization.h"
 #include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/options_parser.h"
-#include "riegeli/base/str_error.h"
 #include "riegeli/bytes/fd_reader.h"
 #include "riegeli/bytes/fd_writer.h"
 #include "riegeli/bytes/writer_utils.h"
+#include "riegeli/records/benchmarks/benchmark_utils.h"
 #include "riegeli/records/benchmarks/tfrecord_recognizer.h"
 #include "riegeli/records/chunk_reader.h"
 #include "riegeli/records/record_reader.h"
@@ -61,45 +60,13 @@
 
 namespace {
 
-uint64_t FileSize(const std::string& filename) {
-  struct stat stat_info;
-  const int result = stat(filename.c_str(), &stat_info);
-  RIEGELI_CHECK_EQ(result, 0) << "stat() failed: " << riegeli::StrError(errno);
-  return riegeli::IntCast<uint64_t>(stat_info.st_size);
-}
-
-uint64_t CpuTimeNow_ns() {
-  struct timespec time_info;
-  RIEGELI_CHECK_EQ(clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time_info), 0);
-  return riegeli::IntCast<uint64_t>(time_info.tv_sec) * uint64_t{1000000000} +
-         riegeli::IntCast<uint64_t>(time_info.tv_nsec);
-}
-
-uint64_t RealTimeNow_ns() {
-  struct timespec time_info;
-  RIEGELI_CHECK_EQ(clock_gettime(CLOCK_MONOTONIC, &time_info), 0);
-  return riegeli::IntCast<uint64_t>(time_info.tv_sec) * uint64_t{1000000000} +
-         riegeli::IntCast<uint64_t>(time_info.tv_nsec);
-}
-
-class Stats {
- public:
-  void Add(double value);
-
-  double Median();
-
- private:
-  std::vector<double> samples_;
-};
-
-void Stats::Add(double value) { samples_.push_back(value); }
-
-double Stats::Median() {
-  RIEGELI_CHECK(!samples_.empty()) << "No data";
-  const size_t middle = samples_.size() / 2;
-  std::nth_element(samples_.begin(), samples_.begin() + middle, samples_.end());
-  return samples_[middle];
-}
+using riegeli::CpuTimeNow_ns;
+using riegeli::FileSize;
+using riegeli::PeakRss_bytes;
+using riegeli::RealTimeNow_ns;
+using riegeli::ResetPeakRss;
+using riegeli::Stats;
+using riegeli::ThreadCpuTimeNow_ns;
 
 class Benchmarks {
  public:
@@ -113,7 +80,28 @@ class Benchmarks {
 
   void RunAll();
 
+  // Runs each registered scaling benchmark with each combination of the
+  // number of concurrent threads, RecordWriter parallelism, and chunk size.
+  //
+  // Each thread writes all records to its own file, calling Flush() after
+  // every flush_every records (if flush_every > 0), and then each thread reads
+  // its own file.
+  void RegisterScaling(std::string riegeli_options);
+  void RunScaling(const std::vector<int>& num_threads,
+                  const std::vector<int>& parallelisms,
+                  const std::vector<uint64_t>& chunk_sizes,
+                  size_t flush_every);
+
  private:
+  // Measurements of one thread of a scaling benchmark.
+  struct ThreadResult {
+    uint64_t cpu_time_ns = 0;
+    // Latencies in microseconds.
+    Stats write_record_latency;
+    Stats flush_latency;
+    Stats read_record_latency;
+  };
+
   static void WriteTFRecord(
       const std::string& filename,
       const tensorflow::io::RecordWriterOptions& record_writer_options,
@@ -137,6 +125,20 @@ class Benchmarks {
           write_records,
       std::function<void(const std::string&, std::vector<std::string>*)> read_records);
 
+  void RunScalingOne(
+      const std::string& name,
+      const riegeli::RecordWriter::Options& record_writer_options,
+      int num_threads, size_t flush_every);
+
+  static void WriteRiegeliTimed(
+      const std::string& filename,
+      riegeli::RecordWriter::Options record_writer_options,
+      const std::vector<std::string>& records, size_t flush_every,
+      ThreadResult* result);
+  static void ReadRiegeliTimed(const std::string& filename,
+                               const std::vector<std::string>& records,
+                               bool verify, ThreadResult* result);
+
   static std::string Filename(std::string name);
 
   std::vector<std::string> records_;
@@ -146,6 +148,8 @@ class Benchmarks {
   std::vector<std::pair<std::string, const char*>> tfrecord_benchmarks_;
   std::vector<std::pair<std::string, riegeli::RecordWriter::Options>>
       riegeli_benchmarks_;
+  std::vector<std::pair<std::string, riegeli::RecordWriter::Options>>
+      scaling_benchmarks_;
   int max_name_width_ = 0;
 };
 
@@ -322,6 +326,14 @@ void Benchmarks::RegisterRiegeli(std::string riegeli_options) {
                                    std::move(options));
 }
 
+void Benchmarks::RegisterScaling(std::string riegeli_options) {
+  riegeli::RecordWriter::Options options;
+  std::string message;
+  RIEGELI_CHECK(options.Parse(riegeli_options, &message)) << message;
+  scaling_benchmarks_.emplace_back(std::move(riegeli_options),
+                                   std::move(options));
+}
+
 void Benchmarks::RunAll() {
   std::cout << "Original uncompressed size: " << std::fixed
             << std::setprecision(3)
@@ -437,6 +449,196 @@ void Benchmarks::RunOne(
   std::cout << std::endl;
 }
 
+void Benchmarks::WriteRiegeliTimed(
+    const std::string& filename,
+    riegeli::RecordWriter::Options record_writer_options,
+    const std::vector<std::string>& records, size_t flush_every,
+    ThreadResult* result) {
+  const uint64_t cpu_time_before_ns = ThreadCpuTimeNow_ns();
+  riegeli::FdWriter file_writer(filename, O_WRONLY | O_CREAT | O_TRUNC);
+  riegeli::RecordWriter record_writer(&file_writer,
+                                      std::move(record_writer_options));
+  size_t num_written = 0;
+  for (const auto& record : records) {
+    const uint64_t time_before_ns = RealTimeNow_ns();
+    RIEGELI_CHECK(record_writer.WriteRecord(record)) << record_writer.message();
+    const uint64_t time_after_ns = RealTimeNow_ns();
+    result->write_record_latency.Add(
+        static_cast<double>(time_after_ns - time_before_ns) / 1000.0);
+    if (flush_every > 0 && ++num_written % flush_every == 0) {
+      const uint64_t time_before_ns = RealTimeNow_ns();
+      RIEGELI_CHECK(record_writer.Flush(riegeli::FlushType::kFromProcess))
+          << record_writer.message();
+      const uint64_t time_after_ns = RealTimeNow_ns();
+      result->flush_latency.Add(
+          static_cast<double>(time_after_ns - time_before_ns) / 1000.0);
+    }
+  }
+  RIEGELI_CHECK(record_writer.Close()) << record_writer.message();
+  RIEGELI_CHECK(file_writer.Close()) << file_writer.message();
+  result->cpu_time_ns += ThreadCpuTimeNow_ns() - cpu_time_before_ns;
+}
+
+void Benchmarks::ReadRiegeliTimed(const std::string& filename,
+                                  const std::vector<std::string>& records,
+                                  bool verify, ThreadResult* result) {
+  const uint64_t cpu_time_before_ns = ThreadCpuTimeNow_ns();
+  riegeli::FdReader file_reader(filename, O_RDONLY);
+  riegeli::RecordReader record_reader(&file_reader);
+  std::string record;
+  size_t num_read = 0;
+  for (;;) {
+    const uint64_t time_before_ns = RealTimeNow_ns();
+    const bool ok = record_reader.ReadRecord(&record);
+    const uint64_t time_after_ns = RealTimeNow_ns();
+    if (!ok) break;
+    result->read_record_latency.Add(
+        static_cast<double>(time_after_ns - time_before_ns) / 1000.0);
+    if (verify) {
+      RIEGELI_CHECK_LT(num_read, records.size()) << "Too many records read";
+      RIEGELI_CHECK(record == records[num_read])
+          << "Decoded record " << num_read << " does not match";
+    }
+    ++num_read;
+  }
+  RIEGELI_CHECK(record_reader.Close()) << record_reader.message();
+  RIEGELI_CHECK(file_reader.Close()) << file_reader.message();
+  RIEGELI_CHECK_EQ(num_read, records.size()) << "Wrong number of records read";
+  result->cpu_time_ns += ThreadCpuTimeNow_ns() - cpu_time_before_ns;
+}
+
+void Benchmarks::RunScaling(const std::vector<int>& num_threads,
+                            const std::vector<int>& parallelisms,
+                            const std::vector<uint64_t>& chunk_sizes,
+                            size_t flush_every) {
+  std::cout << "Scaling: each thread writes and reads " << std::fixed
+            << std::setprecision(3)
+            << (static_cast<double>(original_size_) / 1000000.0)
+            << " MB, latencies in microseconds" << std::endl;
+  for (const auto& scaling_options : scaling_benchmarks_) {
+    for (const uint64_t chunk_size : chunk_sizes) {
+      for (const int parallelism : parallelisms) {
+        riegeli::RecordWriter::Options options = scaling_options.second;
+        options.set_chunk_size(chunk_size).set_parallelism(parallelism);
+        const std::string name =
+            absl::StrCat("riegeli ", scaling_options.first,
+                         " chunk_size:", chunk_size, " parallelism:",
+                         parallelism);
+        for (const int threads : num_threads) {
+          RunScalingOne(name, options, threads, flush_every);
+        }
+      }
+    }
+  }
+}
+
+void Benchmarks::RunScalingOne(
+    const std::string& name,
+    const riegeli::RecordWriter::Options& record_writer_options,
+    int num_threads, size_t flush_every) {
+  std::vector<std::string> filenames;
+  for (int i = 0; i < num_threads; ++i) {
+    filenames.push_back(absl::StrCat(output_dir_, "/record_benchmark_scaling_",
+                                     Filename(name), "_", i));
+  }
+  const double total_size =
+      static_cast<double>(original_size_) * static_cast<double>(num_threads);
+
+  Stats writing_real_speed;
+  Stats writing_process_cpu_s;
+  Stats writing_thread_cpu_s;
+  Stats reading_real_speed;
+  Stats reading_process_cpu_s;
+  Stats reading_thread_cpu_s;
+  ThreadResult merged;
+  uint64_t writing_peak_rss = 0;
+  uint64_t reading_peak_rss = 0;
+  for (int i = 0; i < repetitions_ + 1; ++i) {
+    for (const bool writing : {true, false}) {
+      std::vector<ThreadResult> results(riegeli::IntCast<size_t>(num_threads));
+      std::vector<std::thread> threads;
+      ResetPeakRss();
+      const uint64_t cpu_time_before_ns = CpuTimeNow_ns();
+      const uint64_t real_time_before_ns = RealTimeNow_ns();
+      for (int j = 0; j < num_threads; ++j) {
+        const std::string* const filename =
+            &filenames[riegeli::IntCast<size_t>(j)];
+        ThreadResult* const result = &results[riegeli::IntCast<size_t>(j)];
+        if (writing) {
+          threads.emplace_back([&, filename, result] {
+            WriteRiegeliTimed(*filename, record_writer_options, records_,
+                              flush_every, result);
+          });
+        } else {
+          // Records are verified during warm-up.
+          threads.emplace_back([&, filename, result, i] {
+            ReadRiegeliTimed(*filename, records_, i == 0, result);
+          });
+        }
+      }
+      for (auto& thread : threads) thread.join();
+      const uint64_t cpu_time_after_ns = CpuTimeNow_ns();
+      const uint64_t real_time_after_ns = RealTimeNow_ns();
+      const uint64_t peak_rss = PeakRss_bytes();
+      if (i == 0) continue;  // Warm-up.
+      const double speed =
+          total_size /
+          static_cast<double>(real_time_after_ns - real_time_before_ns) *
+          1000.0;
+      const double process_cpu_s =
+          static_cast<double>(cpu_time_after_ns - cpu_time_before_ns) / 1e9;
+      double thread_cpu_s = 0.0;
+      for (auto& result : results) {
+        thread_cpu_s += static_cast<double>(result.cpu_time_ns) / 1e9;
+        merged.write_record_latency.Add(result.write_record_latency);
+        merged.flush_latency.Add(result.flush_latency);
+        merged.read_record_latency.Add(result.read_record_latency);
+      }
+      thread_cpu_s /= static_cast<double>(num_threads);
+      if (writing) {
+        writing_real_speed.Add(speed);
+        writing_process_cpu_s.Add(process_cpu_s);
+        writing_thread_cpu_s.Add(thread_cpu_s);
+        writing_peak_rss = std::max(writing_peak_rss, peak_rss);
+      } else {
+        reading_real_speed.Add(speed);
+        reading_process_cpu_s.Add(process_cpu_s);
+        reading_thread_cpu_s.Add(thread_cpu_s);
+        reading_peak_rss = std::max(reading_peak_rss, peak_rss);
+      }
+    }
+  }
+
+  std::cout << name << " threads:" << num_threads << std::endl;
+  const auto print_phase = [](absl::string_view phase, Stats* real_speed,
+                              Stats* process_cpu_s, Stats* thread_cpu_s,
+                              uint64_t peak_rss) {
+    std::cout << "  " << phase << std::fixed << std::setprecision(0)
+              << std::setw(7) << real_speed->Median() << " MB/s real, "
+              << std::setprecision(3) << process_cpu_s->Median()
+              << " s process CPU, " << thread_cpu_s->Median()
+              << " s CPU per thread, " << std::setprecision(0)
+              << (static_cast<double>(peak_rss) / 1000000.0)
+              << " MB peak RSS" << std::endl;
+  };
+  print_phase("write:", &writing_real_speed, &writing_process_cpu_s,
+              &writing_thread_cpu_s, writing_peak_rss);
+  print_phase("read: ", &reading_real_speed, &reading_process_cpu_s,
+              &reading_thread_cpu_s, reading_peak_rss);
+  for (const auto& latency :
+       {std::make_pair("WriteRecord", &merged.write_record_latency),
+        std::make_pair("Flush", &merged.flush_latency),
+        std::make_pair("ReadRecord", &merged.read_record_latency)}) {
+    if (latency.second->empty()) continue;
+    std::cout << "  " << std::left << std::setw(12) << latency.first
+              << std::right << std::setprecision(2) << " p50 "
+              << latency.second->Percentile(0.5) << " p99 "
+              << latency.second->Percentile(0.99) << " p99.9 "
+              << latency.second->Percentile(0.999) << " max "
+              << latency.second->Percentile(1.0) << std::endl;
+  }
+}
+
 const char kUsage[] =
     "Usage: benchmark (OPTION|FILE)...\n"
     "\n"
@@ -453,7 +655,21 @@ const char kUsage[] =
     "      Directory to write files to (files are named record_benchmark_*),\n"
     "      default /tmp\n"
     "  --repetitions=N\n"
-    "      Number of times to repeat each benchmark, default 5";
+    "      Number of times to repeat each benchmark, default 5\n"
+    "  --scaling_benchmarks=BENCHMARKS\n"
+    "      Whitespace-separated Riegeli RecordWriter options to run with\n"
+    "      concurrent threads, each writing and reading its own file,\n"
+    "      default none\n"
+    "  --scaling_threads=NS\n"
+    "      Whitespace-separated numbers of concurrent threads,\n"
+    "      default 1 2 4 8\n"
+    "  --scaling_parallelism=NS\n"
+    "      Whitespace-separated RecordWriter parallelism values, default 0 2\n"
+    "  --scaling_chunk_sizes=BYTES\n"
+    "      Whitespace-separated chunk sizes, default 1048576\n"
+    "  --scaling_flush_every=N\n"
+    "      Number of records between RecordWriter::Flush() calls, or 0 for no\n"
+    "      flushing, default 10000";
 
 const struct option kOptions[] = {
     {"help", no_argument, nullptr, 0},
@@ -462,6 +678,11 @@ const struct option kOptions[] = {
     {"max_size", required_argument, nullptr, 3},
     {"output_dir", required_argument, nullptr, 4},
     {"repetitions", required_argument, nullptr, 5},
+    {"scaling_benchmarks", required_argument, nullptr, 6},
+    {"scaling_threads", required_argument, nullptr, 7},
+    {"scaling_parallelism", required_argument, nullptr, 8},
+    {"scaling_chunk_sizes", required_argument, nullptr, 9},
+    {"scaling_flush_every", required_argument, nullptr, 10},
     {nullptr, 0, nullptr, 0}};
 
 template <typename Function>
@@ -471,9 +692,27 @@ void ForEachWord(const std::string& words, Function f) {
   while (in >> word) f(std::move(word));
 }
 
+// Parses whitespace-separated integers, exiting on failure.
+template <typename T>
+std::vector<T> ParseIntegers(const char* program, const char* option,
+                             const std::string& words) {
+  std::vector<T> values;
+  ForEachWord(words, [&](std::string word) {
+    T value;
+    if (ABSL_PREDICT_FALSE(!absl::SimpleAtoi(word, &value))) {
+      std::cerr << program << ": option '--" << option
+                << "' requires whitespace-separated integers\n";
+      std::exit(1);
+    }
+    values.push_back(value);
+  });
+  return values;
+}
+
 }  // namespace
 
 int main(int argc, char** argv) {
+  const char* const program = argv[0];
   std::string tfrecord_benchmarks = "uncompressed gzip";
   std::string riegeli_benchmarks =
       "uncompressed "
@@ -487,6 +726,11 @@ int main(int argc, char** argv) {
   size_t max_size = size_t{100} * 1000 * 1000;
   std::string output_dir = "/tmp";
   int repetitions = 5;
+  std::string scaling_benchmarks;
+  std::string scaling_threads = "1 2 4 8";
+  std::string scaling_parallelism = "0 2";
+  std::string scaling_chunk_sizes = "1048576";
+  size_t scaling_flush_every = 10000;
   for (;;) {
     int option_index;
     const int option =
@@ -515,6 +759,25 @@ int main(int argc, char** argv) {
         std::cerr << argv[0]
                   << ": option '--repetitions' requires an integer argument\n";
         return 1;
+      case 6:  // --scaling_benchmarks
+        scaling_benchmarks = optarg;
+        break;
+      case 7:  // --scaling_threads
+        scaling_threads = optarg;
+        break;
+      case 8:  // --scaling_parallelism
+        scaling_parallelism = optarg;
+        break;
+      case 9:  // --scaling_chunk_sizes
+        scaling_chunk_sizes = optarg;
+        break;
+      case 10:  // --scaling_flush_every
+        if (ABSL_PREDICT_TRUE(absl::SimpleAtoi(optarg, &scaling_flush_every))) {
+          break;
+        }
+        std::cerr << argv[0] << ": option '--scaling_flush_every' requires an "
+                                "integer argument\n";
+        return 1;
       case '?':
         return 1;
       default:
@@ -540,5 +803,18 @@ int main(int argc, char** argv) {
   ForEachWord(riegeli_benchmarks, [&](std::string riegeli_options) {
     benchmarks.RegisterRiegeli(std::move(riegeli_options));
   });
+  ForEachWord(scaling_benchmarks, [&](std::string riegeli_options) {
+    benchmarks.RegisterScaling(std::move(riegeli_options));
+  });
   benchmarks.RunAll();
+  if (!scaling_benchmarks.empty()) {
+    std::cout << std::endl;
+    benchmarks.RunScaling(
+        ParseIntegers<int>(program, "scaling_threads", scaling_threads),
+        ParseIntegers<int>(program, "scaling_parallelism",
+                           scaling_parallelism),
+        ParseIntegers<uint64_t>(program, "scaling_chunk_sizes",
+                                scaling_chunk_sizes),
+        scaling_flush_every);
+  }
 }
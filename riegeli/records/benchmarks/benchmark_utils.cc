@@ -0,0 +1,101 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/benchmarks/benchmark_utils.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <time.h>
+#include <algorithm>
+#include <cerrno>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "absl/strings/match.h"
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/str_error.h"
+
+namespace riegeli {
+
+uint64_t FileSize(const std::string& filename) {
+  struct stat stat_info;
+  const int result = stat(filename.c_str(), &stat_info);
+  RIEGELI_CHECK_EQ(result, 0) << "stat() failed: " << StrError(errno);
+  return IntCast<uint64_t>(stat_info.st_size);
+}
+
+uint64_t CpuTimeNow_ns() {
+  struct timespec time_info;
+  RIEGELI_CHECK_EQ(clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time_info), 0);
+  return IntCast<uint64_t>(time_info.tv_sec) * uint64_t{1000000000} +
+         IntCast<uint64_t>(time_info.tv_nsec);
+}
+
+uint64_t RealTimeNow_ns() {
+  struct timespec time_info;
+  RIEGELI_CHECK_EQ(clock_gettime(CLOCK_MONOTONIC, &time_info), 0);
+  return IntCast<uint64_t>(time_info.tv_sec) * uint64_t{1000000000} +
+         IntCast<uint64_t>(time_info.tv_nsec);
+}
+
+uint64_t ThreadCpuTimeNow_ns() {
+  struct timespec time_info;
+  RIEGELI_CHECK_EQ(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time_info), 0);
+  return IntCast<uint64_t>(time_info.tv_sec) * uint64_t{1000000000} +
+         IntCast<uint64_t>(time_info.tv_nsec);
+}
+
+void ResetPeakRss() { std::ofstream("/proc/self/clear_refs") << "5"; }
+
+uint64_t PeakRss_bytes() {
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    static constexpr absl::string_view kPrefix = "VmHWM:";
+    if (absl::StartsWith(line, kPrefix)) {
+      std::stringstream in(line.substr(kPrefix.size()));
+      uint64_t peak_rss_kb;
+      if (in >> peak_rss_kb) return peak_rss_kb * 1024;
+    }
+  }
+  struct rusage usage;
+  RIEGELI_CHECK_EQ(getrusage(RUSAGE_SELF, &usage), 0);
+  return IntCast<uint64_t>(usage.ru_maxrss) * 1024;
+}
+
+void Stats::Add(double value) { samples_.push_back(value); }
+
+void Stats::Add(const Stats& src) {
+  samples_.insert(samples_.end(), src.samples_.begin(), src.samples_.end());
+}
+
+double Stats::Median() { return Percentile(0.5); }
+
+double Stats::Percentile(double fraction) {
+  RIEGELI_CHECK(!samples_.empty()) << "No data";
+  const size_t index = std::min(
+      static_cast<size_t>(fraction * static_cast<double>(samples_.size())),
+      samples_.size() - 1);
+  std::nth_element(samples_.begin(), samples_.begin() + index, samples_.end());
+  return samples_[index];
+}
+
+}  // namespace riegeli
@@ -0,0 +1,60 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_BENCHMARKS_BENCHMARK_UTILS_H_
+#define RIEGELI_RECORDS_BENCHMARKS_BENCHMARK_UTILS_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace riegeli {
+
+// Measurement helpers shared by benchmarks. Failures of system calls are fatal.
+
+uint64_t FileSize(const std::string& filename);
+
+uint64_t CpuTimeNow_ns();
+uint64_t RealTimeNow_ns();
+uint64_t ThreadCpuTimeNow_ns();
+
+// Resets the peak resident set size reported by PeakRss_bytes(). This is
+// supported on Linux; elsewhere the peak covers the whole process lifetime.
+void ResetPeakRss();
+
+uint64_t PeakRss_bytes();
+
+// Collects samples of a measurement to report their percentiles.
+class Stats {
+ public:
+  void Add(double value);
+
+  void Add(const Stats& src);
+
+  bool empty() const { return samples_.empty(); }
+
+  double Median();
+
+  // Returns the value below which the given fraction of samples lies.
+  //
+  // Precondition: 0.0 <= fraction <= 1.0
+  double Percentile(double fraction);
+
+ private:
+  std::vector<double> samples_;
+};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_BENCHMARKS_BENCHMARK_UTILS_H_
@@ -0,0 +1,671 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Make file offsets 64-bit even on 32-bit systems.
+#undef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/memory/memory.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/bytes/fd_reader.h"
+#include "riegeli/bytes/fd_writer.h"
+#include "riegeli/bytes/writer.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/records/benchmarks/benchmark_utils.h"
+#include "riegeli/records/chunk_reader.h"
+#include "riegeli/records/record_position.h"
+#include "riegeli/records/record_reader.h"
+#include "riegeli/records/record_writer.h"
+
+namespace {
+
+using riegeli::CpuTimeNow_ns;
+using riegeli::FileSize;
+using riegeli::PeakRss_bytes;
+using riegeli::RealTimeNow_ns;
+using riegeli::ResetPeakRss;
+using riegeli::Stats;
+using riegeli::ThreadCpuTimeNow_ns;
+
+// A WriteRecord() or Flush() call of the traced writer.
+struct WriterEvent {
+  // Time since the beginning of the trace, in microseconds.
+  uint64_t time_us;
+  bool flush;
+  // If !flush: record size.
+  uint64_t size;
+  // If flush: flush type.
+  riegeli::FlushType flush_type;
+};
+
+// A seek of a traced reader, followed by reading consecutive records.
+struct ReaderEvent {
+  // Time since the beginning of the trace, in microseconds.
+  uint64_t time_us;
+  // Index of the first record to read, counting records written by the trace.
+  uint64_t record_index;
+  uint64_t num_records;
+};
+
+struct Trace {
+  std::vector<WriterEvent> writer_events;
+  // Events of each reader, by reader number.
+  std::vector<std::vector<ReaderEvent>> reader_events;
+  // Sizes of records written by the trace.
+  std::vector<uint64_t> record_sizes;
+  // Whether a reader seeks to the record with the given index, so its position
+  // needs to be known.
+  std::vector<bool> record_sought;
+  uint64_t total_size = 0;
+};
+
+// Readers are numbered densely enough for a vector indexed by their number.
+constexpr size_t kMaxReaders = 1024;
+
+// Reads a trace in the format described in kUsage. Returns false on failure,
+// setting *message.
+bool ReadTrace(const std::string& filename, Trace* trace,
+               std::string* message) {
+  std::ifstream in(filename);
+  if (ABSL_PREDICT_FALSE(!in)) {
+    *message = absl::StrCat("Could not open trace: ", filename);
+    return false;
+  }
+  std::string line;
+  size_t line_number = 0;
+  uint64_t last_time_us = 0;
+  while (std::getline(in, line)) {
+    ++line_number;
+    const size_t comment = line.find('#');
+    if (comment != std::string::npos) line.erase(comment);
+    std::stringstream words(line);
+    std::vector<std::string> event;
+    std::string word;
+    while (words >> word) event.push_back(std::move(word));
+    if (event.empty()) continue;
+    const auto fail = [&](absl::string_view reason) {
+      *message = absl::StrCat(filename, ":", line_number, ": ", reason);
+      return false;
+    };
+    uint64_t time_us;
+    if (ABSL_PREDICT_FALSE(event.size() < 2 ||
+                           !absl::SimpleAtoi(event[0], &time_us))) {
+      return fail("expected time and event");
+    }
+    if (ABSL_PREDICT_FALSE(time_us < last_time_us)) {
+      return fail("time goes backwards");
+    }
+    last_time_us = time_us;
+    if (event[1] == "write") {
+      uint64_t size;
+      if (ABSL_PREDICT_FALSE(event.size() != 3 ||
+                             !absl::SimpleAtoi(event[2], &size))) {
+        return fail("expected: TIME write SIZE");
+      }
+      trace->writer_events.push_back(
+          WriterEvent{time_us, false, size, riegeli::FlushType::kFromObject});
+      trace->record_sizes.push_back(size);
+      trace->total_size += size;
+    } else if (event[1] == "flush") {
+      riegeli::FlushType flush_type;
+      if (event.size() == 3 && event[2] == "object") {
+        flush_type = riegeli::FlushType::kFromObject;
+      } else if (event.size() == 3 && event[2] == "process") {
+        flush_type = riegeli::FlushType::kFromProcess;
+      } else if (event.size() == 3 && event[2] == "machine") {
+        flush_type = riegeli::FlushType::kFromMachine;
+      } else {
+        return fail("expected: TIME flush (object|process|machine)");
+      }
+      trace->writer_events.push_back(WriterEvent{time_us, true, 0, flush_type});
+    } else if (event[1] == "read") {
+      size_t reader;
+      uint64_t record_index;
+      uint64_t num_records;
+      if (ABSL_PREDICT_FALSE(event.size() != 5 ||
+                             !absl::SimpleAtoi(event[2], &reader) ||
+                             !absl::SimpleAtoi(event[3], &record_index) ||
+                             !absl::SimpleAtoi(event[4], &num_records))) {
+        return fail("expected: TIME read READER RECORD_INDEX NUM_RECORDS");
+      }
+      if (ABSL_PREDICT_FALSE(reader >= kMaxReaders)) {
+        return fail(absl::StrCat("reader number must be below ", kMaxReaders));
+      }
+      if (reader >= trace->reader_events.size()) {
+        trace->reader_events.resize(reader + 1);
+      }
+      trace->reader_events[reader].push_back(
+          ReaderEvent{time_us, record_index, num_records});
+    } else {
+      return fail(absl::StrCat("unknown event: ", event[1]));
+    }
+  }
+  trace->record_sought.assign(trace->record_sizes.size(), false);
+  for (const std::vector<ReaderEvent>& events : trace->reader_events) {
+    for (const ReaderEvent& event : events) {
+      if (event.record_index < trace->record_sought.size()) {
+        trace->record_sought[riegeli::IntCast<size_t>(event.record_index)] =
+            true;
+      }
+    }
+  }
+  return true;
+}
+
+// Contents of records of the trace, which records only their sizes.
+class RecordSource {
+ public:
+  // Records are taken from samples, repeated as needed.
+  RecordSource(std::vector<std::string> samples, uint64_t max_size);
+
+  // Returns the contents of the record with the given index and size, valid
+  // until the RecordSource is destroyed.
+  absl::string_view Record(uint64_t index, uint64_t size) const;
+
+ private:
+  // Samples concatenated, repeated to be longer by at least max_size, so that
+  // a record of any size can begin at any sample.
+  std::string data_;
+  std::vector<size_t> sample_begins_;
+};
+
+RecordSource::RecordSource(std::vector<std::string> samples,
+                           uint64_t max_size) {
+  size_t samples_size = 0;
+  for (const std::string& sample : samples) {
+    sample_begins_.push_back(samples_size);
+    samples_size += sample.size();
+  }
+  RIEGELI_CHECK_GT(samples_size, 0u) << "No sample data";
+  const size_t size = samples_size + riegeli::IntCast<size_t>(max_size);
+  data_.reserve(size);
+  while (data_.size() < size) {
+    for (const std::string& sample : samples) data_.append(sample);
+  }
+}
+
+absl::string_view RecordSource::Record(uint64_t index, uint64_t size) const {
+  return absl::string_view(data_).substr(
+      sample_begins_[riegeli::IntCast<size_t>(index % sample_begins_.size())],
+      riegeli::IntCast<size_t>(size));
+}
+
+// Reads records from a Riegeli/records file to be used as samples, up to
+// max_size bytes in total.
+std::vector<std::string> ReadSamples(const std::string& filename,
+                                     uint64_t max_size) {
+  std::vector<std::string> samples;
+  riegeli::RecordReader record_reader(
+      absl::make_unique<riegeli::FdReader>(filename, O_RDONLY));
+  std::string record;
+  uint64_t size = 0;
+  while (size < max_size && record_reader.ReadRecord(&record)) {
+    if (record.empty()) continue;
+    size += record.size();
+    samples.push_back(std::move(record));
+  }
+  RIEGELI_CHECK(record_reader.Close()) << record_reader.message();
+  return samples;
+}
+
+// Returns pseudo-random samples, which are incompressible.
+std::vector<std::string> RandomSamples() {
+  std::mt19937 random;
+  std::uniform_int_distribution<int> byte(0, 255);
+  std::string sample(size_t{1} << 20, '\0');
+  for (char& ch : sample) ch = static_cast<char>(byte(random));
+  std::vector<std::string> samples;
+  samples.push_back(std::move(sample));
+  return samples;
+}
+
+// Measurements of one replay.
+struct ReplayResult {
+  uint64_t real_time_ns = 0;
+  uint64_t process_cpu_time_ns = 0;
+  uint64_t writer_cpu_time_ns = 0;
+  uint64_t peak_rss = 0;
+  uint64_t file_size = 0;
+  uint64_t num_chunks = 0;
+  // Reads of records not flushed yet, which are skipped or shortened.
+  uint64_t unflushed_reads = 0;
+  // Latencies in microseconds.
+  Stats write_record_latency;
+  Stats flush_latency[3];
+  Stats read_latency;
+  // Delays of events after their time in the trace, in microseconds. Large
+  // delays mean that the configuration does not keep up with the workload.
+  Stats schedule_lag;
+};
+
+class Replay {
+ public:
+  Replay(const Trace* trace, const RecordSource* source, double time_scale)
+      : trace_(trace), source_(source), time_scale_(time_scale) {}
+
+  // Replays the trace once, writing filename.
+  void Run(const std::string& filename,
+           riegeli::RecordWriter::Options record_writer_options,
+           ReplayResult* result);
+
+ private:
+  // Waits until the time of an event, and returns the delay after it in
+  // microseconds.
+  double WaitUntil(uint64_t time_us) const;
+
+  void Write(const std::string& filename,
+             riegeli::RecordWriter::Options record_writer_options,
+             ReplayResult* result);
+  void Read(const std::string& filename,
+            const std::vector<ReaderEvent>& events, ReplayResult* result);
+
+  const Trace* trace_;
+  const RecordSource* source_;
+  double time_scale_;
+  uint64_t start_ns_ = 0;
+  // Positions of records sought by readers, set when they are flushed.
+  std::vector<riegeli::RecordPosition> positions_;
+  // The number of records flushed, whose positions are set.
+  std::atomic<uint64_t> flushed_records_{0};
+};
+
+double Replay::WaitUntil(uint64_t time_us) const {
+  const uint64_t target_ns =
+      start_ns_ + static_cast<uint64_t>(static_cast<double>(time_us) *
+                                        time_scale_ * 1000.0);
+  const uint64_t now_ns = RealTimeNow_ns();
+  if (now_ns >= target_ns) {
+    return static_cast<double>(now_ns - target_ns) / 1000.0;
+  }
+  std::this_thread::sleep_for(std::chrono::nanoseconds(target_ns - now_ns));
+  return 0.0;
+}
+
+void Replay::Run(const std::string& filename,
+                 riegeli::RecordWriter::Options record_writer_options,
+                 ReplayResult* result) {
+  positions_.assign(trace_->record_sizes.size(), riegeli::RecordPosition());
+  flushed_records_.store(0, std::memory_order_relaxed);
+  std::vector<ReplayResult> reader_results(trace_->reader_events.size());
+  ResetPeakRss();
+  const uint64_t cpu_time_before_ns = CpuTimeNow_ns();
+  start_ns_ = RealTimeNow_ns();
+  {
+    // The file is created before readers start.
+    riegeli::FdWriter file_writer(filename, O_WRONLY | O_CREAT | O_TRUNC);
+    std::vector<std::thread> readers;
+    for (size_t i = 0; i < trace_->reader_events.size(); ++i) {
+      if (trace_->reader_events[i].empty()) continue;
+      const std::vector<ReaderEvent>* const events = &trace_->reader_events[i];
+      ReplayResult* const reader_result = &reader_results[i];
+      readers.emplace_back([this, &filename, events, reader_result] {
+        Read(filename, *events, reader_result);
+      });
+    }
+    const uint64_t writer_cpu_time_before_ns = ThreadCpuTimeNow_ns();
+    riegeli::RecordWriter record_writer(&file_writer,
+                                        std::move(record_writer_options));
+    uint64_t record_index = 0;
+    // Records written since the last flush whose positions will be needed.
+    std::vector<std::pair<uint64_t, riegeli::FutureRecordPosition>>
+        pending_positions;
+    for (const WriterEvent& event : trace_->writer_events) {
+      result->schedule_lag.Add(WaitUntil(event.time_us));
+      if (!event.flush) {
+        const absl::string_view record =
+            source_->Record(record_index, event.size);
+        riegeli::FutureRecordPosition key;
+        const bool sought =
+            trace_->record_sought[riegeli::IntCast<size_t>(record_index)];
+        const uint64_t time_before_ns = RealTimeNow_ns();
+        RIEGELI_CHECK(
+            record_writer.WriteRecord(record, sought ? &key : nullptr))
+            << record_writer.message();
+        const uint64_t time_after_ns = RealTimeNow_ns();
+        result->write_record_latency.Add(
+            static_cast<double>(time_after_ns - time_before_ns) / 1000.0);
+        if (sought) pending_positions.emplace_back(record_index, key);
+        ++record_index;
+      } else {
+        const uint64_t time_before_ns = RealTimeNow_ns();
+        RIEGELI_CHECK(record_writer.Flush(event.flush_type))
+            << record_writer.message();
+        const uint64_t time_after_ns = RealTimeNow_ns();
+        result->flush_latency[static_cast<int>(event.flush_type)].Add(
+            static_cast<double>(time_after_ns - time_before_ns) / 1000.0);
+        for (const auto& pending : pending_positions) {
+          positions_[riegeli::IntCast<size_t>(pending.first)] =
+              pending.second.get();
+        }
+        pending_positions.clear();
+        flushed_records_.store(record_index, std::memory_order_release);
+      }
+    }
+    RIEGELI_CHECK(record_writer.Close()) << record_writer.message();
+    RIEGELI_CHECK(file_writer.Close()) << file_writer.message();
+    for (const auto& pending : pending_positions) {
+      positions_[riegeli::IntCast<size_t>(pending.first)] =
+          pending.second.get();
+    }
+    flushed_records_.store(record_index, std::memory_order_release);
+    result->writer_cpu_time_ns =
+        ThreadCpuTimeNow_ns() - writer_cpu_time_before_ns;
+    for (std::thread& reader : readers) reader.join();
+  }
+  result->real_time_ns = RealTimeNow_ns() - start_ns_;
+  result->process_cpu_time_ns = CpuTimeNow_ns() - cpu_time_before_ns;
+  result->peak_rss = PeakRss_bytes();
+  for (const ReplayResult& reader_result : reader_results) {
+    result->unflushed_reads += reader_result.unflushed_reads;
+    result->read_latency.Add(reader_result.read_latency);
+    result->schedule_lag.Add(reader_result.schedule_lag);
+  }
+  result->file_size = FileSize(filename);
+  riegeli::ChunkReader chunk_reader(
+      absl::make_unique<riegeli::FdReader>(filename, O_RDONLY));
+  riegeli::Chunk chunk;
+  while (chunk_reader.ReadChunk(&chunk)) ++result->num_chunks;
+  RIEGELI_CHECK(chunk_reader.Close()) << chunk_reader.message();
+}
+
+void Replay::Read(const std::string& filename,
+                  const std::vector<ReaderEvent>& events,
+                  ReplayResult* result) {
+  // The reader is opened when there is something to read, because a file
+  // without a complete chunk is not yet a valid Riegeli/records file.
+  std::unique_ptr<riegeli::RecordReader> record_reader;
+  std::string record;
+  for (const ReaderEvent& event : events) {
+    result->schedule_lag.Add(WaitUntil(event.time_us));
+    const uint64_t flushed_records =
+        flushed_records_.load(std::memory_order_acquire);
+    if (event.record_index >= flushed_records) {
+      ++result->unflushed_reads;
+      continue;
+    }
+    uint64_t num_records = event.num_records;
+    if (num_records > flushed_records - event.record_index) {
+      ++result->unflushed_reads;
+      num_records = flushed_records - event.record_index;
+    }
+    const uint64_t time_before_ns = RealTimeNow_ns();
+    if (record_reader == nullptr) {
+      record_reader = absl::make_unique<riegeli::RecordReader>(
+          absl::make_unique<riegeli::FdReader>(filename, O_RDONLY));
+    }
+    RIEGELI_CHECK(record_reader->Seek(
+        positions_[riegeli::IntCast<size_t>(event.record_index)]))
+        << record_reader->message();
+    for (uint64_t i = 0; i < num_records; ++i) {
+      RIEGELI_CHECK(record_reader->ReadRecord(&record))
+          << record_reader->message();
+    }
+    const uint64_t time_after_ns = RealTimeNow_ns();
+    result->read_latency.Add(
+        static_cast<double>(time_after_ns - time_before_ns) / 1000.0);
+    // Verify the last record read, outside of the measured time.
+    if (num_records > 0) {
+      const uint64_t index = event.record_index + num_records - 1;
+      RIEGELI_CHECK(record ==
+                    source_->Record(index, trace_->record_sizes[index]))
+          << "Record " << index << " does not match";
+    }
+  }
+  if (record_reader != nullptr) {
+    RIEGELI_CHECK(record_reader->Close()) << record_reader->message();
+  }
+}
+
+void PrintLatency(absl::string_view name, Stats* latency) {
+  if (latency->empty()) return;
+  std::cout << "  " << std::left << std::setw(14) << name << std::right
+            << std::fixed << std::setprecision(2) << " p50 "
+            << latency->Percentile(0.5) << " p99 "
+            << latency->Percentile(0.99) << " p99.9 "
+            << latency->Percentile(0.999) << " max "
+            << latency->Percentile(1.0) << std::endl;
+}
+
+void RunConfiguration(const Trace& trace, const RecordSource& source,
+                      double time_scale, const std::string& output_dir,
+                      int repetitions, const std::string& writer_options) {
+  riegeli::RecordWriter::Options record_writer_options;
+  std::string message;
+  RIEGELI_CHECK(record_writer_options.Parse(writer_options, &message))
+      << message;
+  std::string name = writer_options;
+  for (char& ch : name) {
+    if (!(ch == '-' || ch == '.' || (ch >= '0' && ch <= '9') ||
+          (ch >= 'A' && ch <= 'Z') || ch == '_' || (ch >= 'a' && ch <= 'z'))) {
+      ch = '_';
+    }
+  }
+  const std::string filename =
+      absl::StrCat(output_dir, "/record_replay_benchmark_", name);
+
+  Replay replay(&trace, &source, time_scale);
+  Stats write_speed;
+  Stats process_cpu_s;
+  Stats writer_cpu_s;
+  uint64_t peak_rss = 0;
+  ReplayResult merged;
+  for (int i = 0; i < repetitions; ++i) {
+    ReplayResult result;
+    replay.Run(filename, record_writer_options, &result);
+    write_speed.Add(static_cast<double>(trace.total_size) /
+                    static_cast<double>(result.real_time_ns) * 1000.0);
+    process_cpu_s.Add(static_cast<double>(result.process_cpu_time_ns) / 1e9);
+    writer_cpu_s.Add(static_cast<double>(result.writer_cpu_time_ns) / 1e9);
+    peak_rss = std::max(peak_rss, result.peak_rss);
+    merged.file_size = result.file_size;
+    merged.num_chunks = result.num_chunks;
+    merged.unflushed_reads += result.unflushed_reads;
+    merged.write_record_latency.Add(result.write_record_latency);
+    for (int j = 0; j < 3; ++j) {
+      merged.flush_latency[j].Add(result.flush_latency[j]);
+    }
+    merged.read_latency.Add(result.read_latency);
+    merged.schedule_lag.Add(result.schedule_lag);
+  }
+
+  std::cout << "riegeli " << writer_options << std::endl;
+  std::cout << "  " << std::fixed << std::setprecision(0)
+            << write_speed.Median() << " MB/s real, " << std::setprecision(3)
+            << process_cpu_s.Median() << " s process CPU, "
+            << writer_cpu_s.Median() << " s writer CPU, "
+            << std::setprecision(0)
+            << (static_cast<double>(peak_rss) / 1000000.0) << " MB peak RSS"
+            << std::endl;
+  std::cout << "  " << std::setprecision(3)
+            << (static_cast<double>(merged.file_size) / 1000000.0)
+            << " MB file, " << merged.num_chunks << " chunks, "
+            << std::setprecision(0)
+            << (merged.num_chunks == 0
+                    ? 0.0
+                    : static_cast<double>(merged.file_size) /
+                          static_cast<double>(merged.num_chunks))
+            << " bytes per chunk" << std::endl;
+  if (merged.unflushed_reads > 0) {
+    std::cout << "  " << merged.unflushed_reads
+              << " reads of unflushed records skipped or shortened"
+              << std::endl;
+  }
+  PrintLatency("WriteRecord", &merged.write_record_latency);
+  PrintLatency("Flush object", &merged.flush_latency[0]);
+  PrintLatency("Flush process", &merged.flush_latency[1]);
+  PrintLatency("Flush machine", &merged.flush_latency[2]);
+  PrintLatency("Seek+Read", &merged.read_latency);
+  PrintLatency("Schedule lag", &merged.schedule_lag);
+}
+
+const char kUsage[] =
+    "Usage: replay_benchmark (OPTION|TRACE)\n"
+    "\n"
+    "Replays a workload trace against RecordWriter/RecordReader\n"
+    "configurations, and reports throughput, latency percentiles (in\n"
+    "microseconds), memory, and the resulting chunks.\n"
+    "\n"
+    "TRACE is a text file with one event per line, in nondecreasing order of\n"
+    "time; '#' begins a comment:\n"
+    "  TIME write SIZE\n"
+    "      The writer writes a record of SIZE bytes\n"
+    "  TIME flush (object|process|machine)\n"
+    "      The writer calls Flush() with the given FlushType\n"
+    "  TIME read READER RECORD_INDEX NUM_RECORDS\n"
+    "      Reader number READER (below 1024) seeks to the record written by\n"
+    "      the trace with the given index (counting from 0), and reads\n"
+    "      NUM_RECORDS records; each reader runs in its own thread, and can\n"
+    "      read only records flushed before\n"
+    "TIME is in microseconds since the beginning of the trace.\n"
+    "\n"
+    "OPTIONs:\n"
+    "  --configs=CONFIGS\n"
+    "      Whitespace-separated Riegeli RecordWriter options, default\n"
+    "      'default'\n"
+    "  --time_scale=X\n"
+    "      Factor applied to event times, e.g. 0.5 to replay twice as fast;\n"
+    "      0 replays as fast as possible, default 1\n"
+    "  --records_file=FILE\n"
+    "      Riegeli/records file whose records are used, repeated and cut to\n"
+    "      the traced sizes, as record contents; default pseudo-random\n"
+    "      (incompressible) contents\n"
+    "  --output_dir=DIR\n"
+    "      Directory to write files to (files are named\n"
+    "      record_replay_benchmark_*), default /tmp\n"
+    "  --repetitions=N\n"
+    "      Number of times to replay the trace for each configuration,\n"
+    "      default 1";
+
+const struct option kOptions[] = {
+    {"help", no_argument, nullptr, 0},
+    {"configs", required_argument, nullptr, 1},
+    {"time_scale", required_argument, nullptr, 2},
+    {"records_file", required_argument, nullptr, 3},
+    {"output_dir", required_argument, nullptr, 4},
+    {"repetitions", required_argument, nullptr, 5},
+    {nullptr, 0, nullptr, 0}};
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const char* const program = argv[0];
+  std::string configs = "default";
+  double time_scale = 1.0;
+  std::string records_file;
+  std::string output_dir = "/tmp";
+  int repetitions = 1;
+  for (;;) {
+    int option_index;
+    const int option =
+        getopt_long_only(argc, argv, "", kOptions, &option_index);
+    if (option == -1) break;
+    switch (option) {
+      case 0:  // --help
+        std::cout << kUsage << std::endl;
+        return 0;
+      case 1:  // --configs
+        configs = optarg;
+        break;
+      case 2:  // --time_scale
+        if (ABSL_PREDICT_TRUE(absl::SimpleAtod(optarg, &time_scale) &&
+                              time_scale >= 0.0)) {
+          break;
+        }
+        std::cerr << program << ": option '--time_scale' requires "
+                                "a non-negative number\n";
+        return 1;
+      case 3:  // --records_file
+        records_file = optarg;
+        break;
+      case 4:  // --output_dir
+        output_dir = optarg;
+        break;
+      case 5:  // --repetitions
+        if (ABSL_PREDICT_TRUE(absl::SimpleAtoi(optarg, &repetitions) &&
+                              repetitions > 0)) {
+          break;
+        }
+        std::cerr << program << ": option '--repetitions' requires "
+                                "a positive integer argument\n";
+        return 1;
+      case '?':
+        return 1;
+      default:
+        RIEGELI_ASSERT_UNREACHABLE()
+            << "getopt_long_only() returned " << option;
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+  if (argc != 2) {
+    std::cerr << kUsage << std::endl;
+    return 1;
+  }
+
+  Trace trace;
+  std::string message;
+  if (ABSL_PREDICT_FALSE(!ReadTrace(argv[1], &trace, &message))) {
+    std::cerr << program << ": " << message << std::endl;
+    return 1;
+  }
+  const uint64_t max_size =
+      trace.record_sizes.empty() ? uint64_t{0}
+                                 : *std::max_element(trace.record_sizes.begin(),
+                                                     trace.record_sizes.end());
+  const RecordSource source(records_file.empty()
+                                ? RandomSamples()
+                                : ReadSamples(records_file, uint64_t{1} << 26),
+                            max_size);
+  size_t num_readers = 0;
+  size_t num_reads = 0;
+  for (const std::vector<ReaderEvent>& events : trace.reader_events) {
+    if (!events.empty()) ++num_readers;
+    num_reads += events.size();
+  }
+  std::cout << "Trace: " << trace.record_sizes.size() << " records, "
+            << std::fixed << std::setprecision(3)
+            << (static_cast<double>(trace.total_size) / 1000000.0) << " MB, "
+            << (trace.writer_events.size() - trace.record_sizes.size())
+            << " flushes, " << num_reads << " reads by " << num_readers
+            << " readers" << std::endl;
+  std::stringstream config_words(configs);
+  std::string writer_options;
+  while (config_words >> writer_options) {
+    RunConfiguration(trace, source, time_scale, output_dir, repetitions,
+                     writer_options);
+  }
+}
@@ -0,0 +1,84 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/chunk_cache.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "riegeli/base/base.h"
+
+namespace riegeli {
+
+ChunkCache::ChunkCache(size_t max_bytes) : max_bytes_(max_bytes) {}
+
+inline size_t ChunkCache::EntrySize(const Key& key, const DecodedChunk& chunk) {
+  return sizeof(Entry) + key.file_id.size() +
+         chunk.limits.size() *
+             (chunk.limits.compact() ? sizeof(uint32_t) : sizeof(size_t)) +
+         chunk.values.size();
+}
+
+std::shared_ptr<const ChunkCache::DecodedChunk> ChunkCache::Find(
+    absl::string_view file_id, Position chunk_begin) {
+  const Key key{std::string(file_id), chunk_begin};
+  absl::MutexLock lock(&mutex_);
+  const auto iter = index_.find(key);
+  if (iter == index_.end()) return nullptr;
+  // Mark the entry as the most recently used.
+  entries_.splice(entries_.begin(), entries_, iter->second);
+  return iter->second->chunk;
+}
+
+void ChunkCache::Insert(absl::string_view file_id, Position chunk_begin,
+                        std::shared_ptr<const DecodedChunk> chunk) {
+  Key key{std::string(file_id), chunk_begin};
+  const size_t size_bytes = EntrySize(key, *chunk);
+  // A chunk larger than the whole cache would only evict everything else.
+  if (size_bytes > max_bytes_) return;
+  absl::MutexLock lock(&mutex_);
+  const auto iter = index_.find(key);
+  if (iter != index_.end()) {
+    size_bytes_ -= iter->second->size_bytes;
+    entries_.erase(iter->second);
+    index_.erase(iter);
+  }
+  entries_.push_front(Entry{key, std::move(chunk), size_bytes});
+  index_.emplace(std::move(key), entries_.begin());
+  size_bytes_ += size_bytes;
+  EvictExcess();
+}
+
+size_t ChunkCache::size_bytes() const {
+  absl::MutexLock lock(&mutex_);
+  return size_bytes_;
+}
+
+void ChunkCache::EvictExcess() {
+  while (size_bytes_ > max_bytes_) {
+    RIEGELI_ASSERT(!entries_.empty())
+        << "Failed invariant of ChunkCache: positive size without entries";
+    const Entry& entry = entries_.back();
+    size_bytes_ -= entry.size_bytes;
+    index_.erase(entry.key);
+    entries_.pop_back();
+  }
+}
+
+}  // namespace riegeli
@@ -0,0 +1,117 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_CHUNK_CACHE_H_
+#define RIEGELI_RECORDS_CHUNK_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/chunk_encoding/record_limits.h"
+
+namespace riegeli {
+
+// A cache of decoded chunks, which lets RecordReaders reading the same chunks
+// avoid reading and decoding them again. Least recently used chunks are evicted
+// when the total size of cached chunks exceeds the given limit.
+//
+// A ChunkCache is attached with RecordReader::Options::set_chunk_cache(),
+// together with a string identifying the file, and must be kept alive until
+// the reader is closed. It may be shared between several readers, of the same
+// file or of different files.
+//
+// ChunkCache is thread-safe.
+class ChunkCache {
+ public:
+  // Record end positions and record values of a decoded chunk.
+  struct DecodedChunk {
+    Position chunk_end;
+    RecordLimits limits;
+    Chain values;
+  };
+
+  // Creates an empty ChunkCache holding chunks of at most max_bytes in total.
+  explicit ChunkCache(size_t max_bytes);
+
+  ChunkCache(const ChunkCache&) = delete;
+  ChunkCache& operator=(const ChunkCache&) = delete;
+
+  // Returns the chunk beginning at chunk_begin in the given file, or nullptr
+  // if it is not cached.
+  std::shared_ptr<const DecodedChunk> Find(absl::string_view file_id,
+                                           Position chunk_begin);
+
+  // Caches a chunk beginning at chunk_begin in the given file, evicting least
+  // recently used chunks as needed. If the chunk is already cached, it is
+  // replaced.
+  void Insert(absl::string_view file_id, Position chunk_begin,
+              std::shared_ptr<const DecodedChunk> chunk);
+
+  // Returns the total size of cached chunks.
+  size_t size_bytes() const;
+
+ private:
+  struct Key {
+    std::string file_id;
+    Position chunk_begin;
+
+    friend bool operator==(const Key& a, const Key& b) {
+      return a.chunk_begin == b.chunk_begin && a.file_id == b.file_id;
+    }
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key& key) const {
+      return std::hash<std::string>()(key.file_id) ^
+             static_cast<size_t>(uint64_t{key.chunk_begin} *
+                                 uint64_t{0x9e3779b97f4a7c15});
+    }
+  };
+
+  struct Entry {
+    Key key;
+    std::shared_ptr<const DecodedChunk> chunk;
+    size_t size_bytes;
+  };
+
+  // Returns the number of bytes accounted for an entry.
+  static size_t EntrySize(const Key& key, const DecodedChunk& chunk);
+
+  // Evicts least recently used entries until size_bytes_ <= max_bytes_.
+  void EvictExcess() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  const size_t max_bytes_;
+  mutable absl::Mutex mutex_;
+  // Entries ordered from the most recently used.
+  std::list<Entry> entries_ GUARDED_BY(mutex_);
+  std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index_
+      GUARDED_BY(mutex_);
+  // Invariant: size_bytes_ is the sum of entries_[].size_bytes
+  size_t size_bytes_ GUARDED_BY(mutex_) = 0;
+};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_CHUNK_CACHE_H_
@@ -0,0 +1,398 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/chunk_index.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/endian.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/bytes/chain_reader.h"
+#include "riegeli/bytes/chain_writer.h"
+#include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/reader_utils.h"
+#include "riegeli/bytes/writer.h"
+#include "riegeli/bytes/writer_utils.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/hash.h"
+#include "riegeli/chunk_encoding/types.h"
+
+namespace riegeli {
+
+namespace {
+
+void WriteDouble(Writer* dest, double value) {
+  uint64_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  const uint64_t word = WriteLittleEndian64(bits);
+  char bytes[sizeof(word)];
+  std::memcpy(bytes, &word, sizeof(word));
+  dest->Write(absl::string_view(bytes, sizeof(bytes)));
+}
+
+bool ReadDouble(Reader* src, double* value) {
+  uint64_t word;
+  if (ABSL_PREDICT_FALSE(
+          !src->Read(reinterpret_cast<char*>(&word), sizeof(word)))) {
+    return false;
+  }
+  const uint64_t bits = ReadLittleEndian64(word);
+  std::memcpy(value, &bits, sizeof(*value));
+  return true;
+}
+
+// The number of bits set per key in a Bloom filter with bits_per_key bits per
+// key which minimizes the false positive rate, i.e. bits_per_key * ln(2),
+// bounded to 1..30.
+int KeyFilterNumProbes(int bits_per_key) {
+  RIEGELI_ASSERT_GT(bits_per_key, 0)
+      << "Failed precondition of KeyFilterNumProbes(): "
+         "non-positive bits per key";
+  // Computed in uint64_t, so that a large bits_per_key does not overflow.
+  const uint64_t num_probes = IntCast<uint64_t>(bits_per_key) * 69 / 100;
+  return IntCast<int>(
+      UnsignedMax(uint64_t{1}, UnsignedMin(num_probes, uint64_t{30})));
+}
+
+}  // namespace
+
+ChunkIndex::ChunkIndex(bool has_keys, int key_filter_bits_per_key) noexcept
+    : has_keys_(has_keys),
+      key_filter_num_probes_(key_filter_bits_per_key > 0
+                                 ? KeyFilterNumProbes(key_filter_bits_per_key)
+                                 : 0) {
+  RIEGELI_ASSERT(key_filter_bits_per_key <= 0 || has_keys)
+      << "Failed precondition of ChunkIndex::ChunkIndex(): "
+         "key filters without keys";
+}
+
+void ChunkIndex::AddChunk(Position chunk_begin, const ChunkHeader& header,
+                          std::vector<FieldRange> field_ranges,
+                          std::string first_key, std::string key_filter) {
+  RIEGELI_ASSERT(entries_.empty() || chunk_begin > entries_.back().chunk_begin)
+      << "Failed precondition of ChunkIndex::AddChunk(): "
+         "chunks not added in the order of positions";
+  RIEGELI_ASSERT(entries_.empty() || field_ranges.size() == num_fields_)
+      << "Failed precondition of ChunkIndex::AddChunk(): "
+         "different number of field ranges than in previous chunks";
+  if (header.num_records() == 0) return;
+  RIEGELI_ASSERT(!has_keys_ || entries_.empty() ||
+                 first_key >= entries_.back().first_key)
+      << "Failed precondition of ChunkIndex::AddChunk(): "
+         "keys not sorted";
+  num_fields_ = field_ranges.size();
+  entries_.push_back(Entry{chunk_begin, header.num_records(),
+                           header.decoded_data_size(), num_records(),
+                           std::move(field_ranges),
+                           has_keys_ ? std::move(first_key) : std::string(),
+                           key_filter_num_probes_ > 0 ? std::move(key_filter)
+                                                      : std::string()});
+}
+
+uint64_t ChunkIndex::HashKey(absl::string_view key) {
+  return internal::Hash(key);
+}
+
+// Probes are derived from one hash by double hashing, as in LevelDB.
+std::string ChunkIndex::MakeKeyFilter(const std::vector<uint64_t>& key_hashes,
+                                      int bits_per_key) {
+  RIEGELI_ASSERT_GT(bits_per_key, 0)
+      << "Failed precondition of ChunkIndex::MakeKeyFilter(): "
+         "non-positive bits per key";
+  const int num_probes = KeyFilterNumProbes(bits_per_key);
+  // At least 64 bits, to keep the false positive rate low for few keys.
+  const size_t num_bytes = UnsignedMax(
+      size_t{8},
+      (key_hashes.size() * IntCast<size_t>(bits_per_key) + 7) / 8);
+  const uint64_t num_bits = uint64_t{num_bytes} * 8;
+  std::string filter(num_bytes, '\0');
+  for (uint64_t hash : key_hashes) {
+    const uint64_t delta = (hash >> 33) | (hash << 31);
+    for (int i = 0; i < num_probes; ++i) {
+      const uint64_t bit = hash % num_bits;
+      filter[IntCast<size_t>(bit / 8)] |= static_cast<char>(1 << (bit % 8));
+      hash += delta;
+    }
+  }
+  return filter;
+}
+
+bool ChunkIndex::MayContainKey(const Entry& entry,
+                               absl::string_view key) const {
+  if (key_filter_num_probes_ == 0 || entry.key_filter.empty()) return true;
+  const uint64_t num_bits = uint64_t{entry.key_filter.size()} * 8;
+  uint64_t hash = HashKey(key);
+  const uint64_t delta = (hash >> 33) | (hash << 31);
+  for (int i = 0; i < key_filter_num_probes_; ++i) {
+    const uint64_t bit = hash % num_bits;
+    if ((static_cast<unsigned char>(entry.key_filter[IntCast<size_t>(
+             bit / 8)]) &
+         (1u << (bit % 8))) == 0) {
+      return false;
+    }
+    hash += delta;
+  }
+  return true;
+}
+
+const ChunkIndex::Entry* ChunkIndex::FindChunkBefore(Position pos) const {
+  const std::vector<Entry>::const_iterator next = std::upper_bound(
+      entries_.begin(), entries_.end(), pos,
+      [](Position pos, const Entry& entry) { return pos < entry.chunk_begin; });
+  if (next == entries_.begin()) return nullptr;
+  return &*(next - 1);
+}
+
+const ChunkIndex::Entry* ChunkIndex::FindChunkWithRecord(
+    uint64_t record_ordinal) const {
+  if (ABSL_PREDICT_FALSE(record_ordinal >= num_records())) return nullptr;
+  const std::vector<Entry>::const_iterator next = std::upper_bound(
+      entries_.begin(), entries_.end(), record_ordinal,
+      [](uint64_t record_ordinal, const Entry& entry) {
+        return record_ordinal < entry.first_record;
+      });
+  RIEGELI_ASSERT(next != entries_.begin())
+      << "The first chunk does not begin with record 0";
+  return &*(next - 1);
+}
+
+const ChunkIndex::Entry* ChunkIndex::FindChunkWithKeyAtLeast(
+    absl::string_view key) const {
+  RIEGELI_ASSERT(has_keys_)
+      << "Failed precondition of ChunkIndex::FindChunkWithKeyAtLeast(): "
+         "keys not stored";
+  const std::vector<Entry>::const_iterator next = std::lower_bound(
+      entries_.begin(), entries_.end(), key,
+      [](const Entry& entry, absl::string_view key) {
+        return absl::string_view(entry.first_key) < key;
+      });
+  if (next == entries_.end()) return nullptr;
+  return &*next;
+}
+
+// The format of an index chunk, after the chunk type:
+//  * number of entries (varint64)
+//  * for each entry:
+//    * chunk_begin minus chunk_begin of the previous entry, or chunk_begin
+//      itself for the first entry (varint64)
+//    * num_records (varint64)
+//    * decoded_data_size (varint64)
+//  * only if fields or keys are indexed:
+//    * number of fields (varint64), 0 only if keys are indexed
+//    * for each entry, for each field:
+//      * num_values (varint64)
+//      * only if num_values > 0: min, max (IEEE 754 double, little endian)
+//  * only if keys are indexed:
+//    * for each entry:
+//      * size of first_key (varint64)
+//      * first_key (bytes)
+//  * only if key filters are stored:
+//    * number of probes (varint64), non-zero
+//    * for each entry:
+//      * size of key_filter (varint64), 0 if none
+//      * key_filter (bytes)
+//
+// Indices without indexed fields or keys are thus compatible with indices
+// written before indexed fields were supported. Indices with keys are rejected
+// by readers which do not support keys.
+void ChunkIndex::EncodeToChunk(Chunk* chunk) const {
+  chunk->data.Clear();
+  ChainWriter data_writer(&chunk->data);
+  WriteByte(&data_writer, static_cast<uint8_t>(ChunkType::kIndex));
+  WriteVarint64(&data_writer, IntCast<uint64_t>(entries_.size()));
+  Position prev_chunk_begin = 0;
+  for (const Entry& entry : entries_) {
+    WriteVarint64(&data_writer,
+                  IntCast<uint64_t>(entry.chunk_begin - prev_chunk_begin));
+    WriteVarint64(&data_writer, entry.num_records);
+    WriteVarint64(&data_writer, entry.decoded_data_size);
+    prev_chunk_begin = entry.chunk_begin;
+  }
+  if (num_fields_ > 0 || has_keys_) {
+    WriteVarint64(&data_writer, IntCast<uint64_t>(num_fields_));
+    for (const Entry& entry : entries_) {
+      for (const FieldRange& field_range : entry.field_ranges) {
+        WriteVarint64(&data_writer, field_range.num_values);
+        if (field_range.num_values > 0) {
+          WriteDouble(&data_writer, field_range.min);
+          WriteDouble(&data_writer, field_range.max);
+        }
+      }
+    }
+  }
+  if (has_keys_) {
+    for (const Entry& entry : entries_) {
+      WriteVarint64(&data_writer, IntCast<uint64_t>(entry.first_key.size()));
+      data_writer.Write(entry.first_key);
+    }
+  }
+  if (key_filter_num_probes_ > 0) {
+    WriteVarint64(&data_writer, IntCast<uint64_t>(key_filter_num_probes_));
+    for (const Entry& entry : entries_) {
+      WriteVarint64(&data_writer, IntCast<uint64_t>(entry.key_filter.size()));
+      data_writer.Write(entry.key_filter);
+    }
+  }
+  if (!data_writer.Close()) {
+    RIEGELI_ASSERT_UNREACHABLE()
+        << "Writing chunk index failed: " << data_writer.message();
+  }
+  chunk->header = ChunkHeader(chunk->data, 0, 0);
+}
+
+bool ChunkIndex::DecodeFromChunk(const Chunk& chunk) {
+  Clear();
+  if (ABSL_PREDICT_FALSE(chunk.header.num_records() != 0)) return false;
+  ChainReader data_reader(&chunk.data);
+  uint8_t chunk_type_byte;
+  if (ABSL_PREDICT_FALSE(!ReadByte(&data_reader, &chunk_type_byte) ||
+                         static_cast<ChunkType>(chunk_type_byte) !=
+                             ChunkType::kIndex)) {
+    return false;
+  }
+  uint64_t num_entries;
+  if (ABSL_PREDICT_FALSE(!ReadVarint64(&data_reader, &num_entries))) {
+    return false;
+  }
+  // Each entry takes at least 3 bytes. Check this before reserving memory.
+  if (ABSL_PREDICT_FALSE(num_entries > chunk.data.size() / 3)) return false;
+  entries_.reserve(IntCast<size_t>(num_entries));
+  Position chunk_begin = 0;
+  uint64_t first_record = 0;
+  while (entries_.size() < num_entries) {
+    uint64_t chunk_begin_delta, num_records, decoded_data_size;
+    if (ABSL_PREDICT_FALSE(!ReadVarint64(&data_reader, &chunk_begin_delta) ||
+                           !ReadVarint64(&data_reader, &num_records) ||
+                           !ReadVarint64(&data_reader, &decoded_data_size))) {
+      Clear();
+      return false;
+    }
+    if (ABSL_PREDICT_FALSE(
+            (chunk_begin_delta == 0 && !entries_.empty()) ||
+            chunk_begin_delta >
+                std::numeric_limits<Position>::max() - chunk_begin ||
+            num_records == 0 ||
+            num_records >
+                std::numeric_limits<uint64_t>::max() - first_record)) {
+      Clear();
+      return false;
+    }
+    chunk_begin += chunk_begin_delta;
+    entries_.push_back(Entry{chunk_begin, num_records, decoded_data_size,
+                             first_record, std::vector<FieldRange>(),
+                             std::string(), std::string()});
+    first_record += num_records;
+  }
+  if (data_reader.Pull()) {
+    uint64_t num_fields;
+    // Each field range takes at least 1 byte. Check this before reserving
+    // memory.
+    if (ABSL_PREDICT_FALSE(!ReadVarint64(&data_reader, &num_fields) ||
+                           (num_entries > 0 &&
+                            num_fields > chunk.data.size() / num_entries))) {
+      Clear();
+      return false;
+    }
+    num_fields_ = IntCast<size_t>(num_fields);
+    for (Entry& entry : entries_) {
+      entry.field_ranges.reserve(num_fields_);
+      while (entry.field_ranges.size() < num_fields_) {
+        FieldRange field_range;
+        if (ABSL_PREDICT_FALSE(
+                !ReadVarint64(&data_reader, &field_range.num_values))) {
+          Clear();
+          return false;
+        }
+        if (field_range.num_values > 0) {
+          if (ABSL_PREDICT_FALSE(!ReadDouble(&data_reader, &field_range.min) ||
+                                 !ReadDouble(&data_reader, &field_range.max))) {
+            Clear();
+            return false;
+          }
+        } else {
+          field_range.min = std::numeric_limits<double>::infinity();
+          field_range.max = -std::numeric_limits<double>::infinity();
+        }
+        entry.field_ranges.push_back(field_range);
+      }
+    }
+    // Keys follow if there are remaining data, and they must follow if the
+    // number of fields is 0.
+    if (num_fields == 0 || data_reader.Pull()) {
+      has_keys_ = true;
+      for (Entry& entry : entries_) {
+        uint64_t key_size;
+        if (ABSL_PREDICT_FALSE(!ReadVarint64(&data_reader, &key_size) ||
+                               key_size > chunk.data.size()) ||
+            ABSL_PREDICT_FALSE(!data_reader.Read(
+                &entry.first_key, IntCast<size_t>(key_size)))) {
+          Clear();
+          return false;
+        }
+        if (ABSL_PREDICT_FALSE(&entry != &entries_.front() &&
+                               entry.first_key < (&entry - 1)->first_key)) {
+          Clear();
+          return false;
+        }
+      }
+      if (data_reader.Pull()) {
+        uint64_t num_probes;
+        if (ABSL_PREDICT_FALSE(!ReadVarint64(&data_reader, &num_probes) ||
+                               num_probes == 0 || num_probes > 30)) {
+          Clear();
+          return false;
+        }
+        key_filter_num_probes_ = IntCast<int>(num_probes);
+        for (Entry& entry : entries_) {
+          uint64_t filter_size;
+          if (ABSL_PREDICT_FALSE(!ReadVarint64(&data_reader, &filter_size) ||
+                                 filter_size > chunk.data.size()) ||
+              ABSL_PREDICT_FALSE(!data_reader.Read(
+                  &entry.key_filter, IntCast<size_t>(filter_size)))) {
+            Clear();
+            return false;
+          }
+        }
+      }
+    }
+  }
+  if (ABSL_PREDICT_FALSE(!data_reader.VerifyEndAndClose())) {
+    Clear();
+    return false;
+  }
+  return true;
+}
+
+void ChunkIndex::AddUniqueTo(MemoryEstimator* memory_estimator) const {
+  memory_estimator->AddMemory(sizeof(ChunkIndex) +
+                              sizeof(Entry) * entries_.capacity());
+  for (const Entry& entry : entries_) {
+    memory_estimator->AddMemory(sizeof(FieldRange) *
+                                entry.field_ranges.capacity());
+    memory_estimator->AddMemory(entry.first_key.capacity() +
+                                entry.key_filter.capacity());
+  }
+}
+
+}  // namespace riegeli
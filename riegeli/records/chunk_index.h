@@ -0,0 +1,199 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_CHUNK_INDEX_H_
+#define RIEGELI_RECORDS_CHUNK_INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/chunk_encoding/chunk.h"
+
+namespace riegeli {
+
+// ChunkIndex lists chunks of a Riegeli/records file which contain records. It
+// allows to locate the chunk containing a file position or a record ordinal
+// without reading chunk headers.
+//
+// RecordWriter with Options::set_chunk_index(true) writes the index as the last
+// chunk of the file, and RecordReader::ReadChunkIndex() reads it.
+//
+// With RecordWriter::Options::set_chunk_index_fields(), the index also stores
+// ranges of values of some numeric fields in each chunk, which allows
+// RecordReader::Options::set_chunk_filter() to skip chunks without reading
+// them.
+//
+// With RecordWriter::Options::set_key_function(), records are sorted by key,
+// and the index also stores the key of the first record of each chunk, which
+// allows RecordReader::Lookup() to find a record by key decoding one chunk.
+// With RecordWriter::Options::set_key_filter_bits_per_key(), the index also
+// stores a Bloom filter of keys of each chunk, which allows to rule out most
+// chunks not containing a key without reading them.
+class ChunkIndex {
+ public:
+  // Range of values of an indexed field in records of a chunk.
+  struct FieldRange {
+    // Returns true if some value of the field might be between min_value and
+    // max_value inclusive.
+    bool Overlaps(double min_value, double max_value) const {
+      return num_values > 0 && min <= max_value && max >= min_value;
+    }
+
+    // The number of values of the field.
+    uint64_t num_values;
+    // The minimum and maximum value, meaningful only if num_values > 0. If a
+    // record is not a valid serialized proto message, the range is unbounded.
+    double min;
+    double max;
+  };
+
+  struct Entry {
+    // Position of the beginning of the chunk.
+    Position chunk_begin;
+    // The number of records in the chunk.
+    uint64_t num_records;
+    // The sum of record sizes in the chunk.
+    uint64_t decoded_data_size;
+    // The ordinal of the first record of the chunk, i.e. the number of records
+    // in preceding chunks.
+    uint64_t first_record;
+    // Ranges of values of indexed fields, in the order of fields given to
+    // RecordWriter::Options::set_chunk_index_fields(). Empty if no fields are
+    // indexed.
+    std::vector<FieldRange> field_ranges;
+    // The key of the first record of the chunk, meaningful only if has_keys().
+    std::string first_key;
+    // Bloom filter of keys of records of the chunk, built by MakeKeyFilter(),
+    // or empty if none.
+    std::string key_filter;
+  };
+
+  ChunkIndex() noexcept {}
+
+  // Creates an empty ChunkIndex which stores first keys of chunks if has_keys
+  // is true, and key filters of chunks built with key_filter_bits_per_key if it
+  // is positive.
+  //
+  // Precondition: if key_filter_bits_per_key > 0 then has_keys
+  explicit ChunkIndex(bool has_keys, int key_filter_bits_per_key = 0) noexcept;
+
+  ChunkIndex(const ChunkIndex&) = default;
+  ChunkIndex& operator=(const ChunkIndex&) = default;
+
+  ChunkIndex(ChunkIndex&&) noexcept = default;
+  ChunkIndex& operator=(ChunkIndex&&) noexcept = default;
+
+  void Clear();
+
+  // Registers a chunk. Chunks without records are skipped.
+  //
+  // Preconditions:
+  //   chunk_begin is greater than chunk_begin of chunks added before
+  //   field_ranges.size() is the same for all chunks
+  //   if has_keys(), first_key is not less than first_key of chunks added
+  //       before
+  void AddChunk(Position chunk_begin, const ChunkHeader& header,
+                std::vector<FieldRange> field_ranges = {},
+                std::string first_key = std::string(),
+                std::string key_filter = std::string());
+
+  // Returns the registered chunks, sorted by chunk_begin.
+  const std::vector<Entry>& entries() const { return entries_; }
+
+  // Returns the total number of records.
+  uint64_t num_records() const;
+
+  // Returns the number of indexed fields.
+  size_t num_fields() const { return num_fields_; }
+
+  // Returns true if Entry::first_key is stored.
+  bool has_keys() const { return has_keys_; }
+
+  // Returns the number of bits set per key in key filters, or 0 if key filters
+  // are not stored.
+  int key_filter_num_probes() const { return key_filter_num_probes_; }
+
+  // Returns the hash of a key used by key filters.
+  static uint64_t HashKey(absl::string_view key);
+
+  // Builds a Bloom filter of keys with the given hashes, using about
+  // bits_per_key bits per key, for Entry::key_filter.
+  //
+  // Precondition: bits_per_key > 0
+  static std::string MakeKeyFilter(const std::vector<uint64_t>& key_hashes,
+                                   int bits_per_key);
+
+  // Returns false if the key filter of entry proves that the chunk contains no
+  // record with the given key. Returns true if it might contain such a record,
+  // including when key filters are not stored.
+  bool MayContainKey(const Entry& entry, absl::string_view key) const;
+
+  // Returns the last chunk beginning at or before pos, or nullptr if there is
+  // no such chunk.
+  const Entry* FindChunkBefore(Position pos) const;
+
+  // Returns the chunk containing the record with the given ordinal, or nullptr
+  // if record_ordinal >= num_records().
+  const Entry* FindChunkWithRecord(uint64_t record_ordinal) const;
+
+  // Returns the first chunk whose first key is not less than key, or nullptr
+  // if there is no such chunk. The first record with a key not less than key
+  // is either in the chunk before it, or is the first record of this chunk.
+  //
+  // Precondition: has_keys()
+  const Entry* FindChunkWithKeyAtLeast(absl::string_view key) const;
+
+  // Encodes the index as an index chunk.
+  void EncodeToChunk(Chunk* chunk) const;
+
+  // Decodes the index from an index chunk, replacing the current contents.
+  //
+  // Return values:
+  //  * true  - success
+  //  * false - chunk is not a valid index chunk (the index is cleared)
+  bool DecodeFromChunk(const Chunk& chunk);
+
+  // Registers this ChunkIndex with MemoryEstimator.
+  void AddUniqueTo(MemoryEstimator* memory_estimator) const;
+
+ private:
+  std::vector<Entry> entries_;
+  size_t num_fields_ = 0;
+  bool has_keys_ = false;
+  int key_filter_num_probes_ = 0;
+};
+
+// Implementation details follow.
+
+inline void ChunkIndex::Clear() {
+  entries_.clear();
+  num_fields_ = 0;
+  has_keys_ = false;
+  key_filter_num_probes_ = 0;
+}
+
+inline uint64_t ChunkIndex::num_records() const {
+  return entries_.empty()
+             ? uint64_t{0}
+             : entries_.back().first_record + entries_.back().num_records;
+}
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_CHUNK_INDEX_H_
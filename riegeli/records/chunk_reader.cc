@@ -21,7 +21,10 @@
 
 #include "absl/base/optimization.h"
 #include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
+#include "riegeli/bytes/chain_reader.h"
 #include "riegeli/bytes/reader.h"
 #include "riegeli/chunk_encoding/chunk.h"
 #include "riegeli/chunk_encoding/hash.h"
@@ -29,6 +32,15 @@
 
 namespace riegeli {
 
+namespace {
+
+// The maximum number of bytes read by ChunkReader::ReadChunkSpan() at once.
+// This bounds memory allocated ahead of reading if a chunk header claims more
+// data than the file has.
+constexpr Position kMaxChunkSpan() { return Position{64} << 20; }
+
+}  // namespace
+
 inline void ChunkReader::Reading::Reset() {
   chunk.Reset();
   chunk_header_read = 0;
@@ -49,6 +61,7 @@ ChunkReader::ChunkReader(Reader* byte_reader, Options options)
     : Object(State::kOpen),
       byte_reader_(RIEGELI_ASSERT_NOTNULL(byte_reader)),
       skip_errors_(options.skip_errors_),
+      verify_data_hashes_(options.verify_data_hashes_),
       pos_(byte_reader_->pos()),
       is_recovering_(
           internal::IsBlockBoundary(pos_) ||
@@ -96,6 +109,7 @@ void ChunkReader::Done() {
   }
   byte_reader_ = nullptr;
   skip_errors_ = false;
+  verify_data_hashes_ = true;
   pos_ = 0;
   current_chunk_is_incomplete_ = false;
   // skipped_bytes_ is not cleared.
@@ -148,6 +162,16 @@ again:
 }
 
 bool ChunkReader::ReadChunk(Chunk* chunk, Position* chunk_begin) {
+  return ReadChunkImpl(chunk, chunk_begin, verify_data_hashes_);
+}
+
+bool ChunkReader::ReadChunkWithoutVerifying(Chunk* chunk,
+                                            Position* chunk_begin) {
+  return ReadChunkImpl(chunk, chunk_begin, false);
+}
+
+inline bool ChunkReader::ReadChunkImpl(Chunk* chunk, Position* chunk_begin,
+                                       bool verify_data_hash) {
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
   current_chunk_is_incomplete_ = false;
   if (is_recovering_ && !Recover()) return false;
@@ -163,17 +187,10 @@ again:
   }
 
   while (reading_.chunk.data.size() < reading_.chunk.header.data_size()) {
-    if (ABSL_PREDICT_FALSE(!ReadBlockHeader())) {
+    if (ABSL_PREDICT_FALSE(!ReadChunkSpan())) {
       if (is_recovering_ && Recover()) goto again;
       return false;
     }
-    if (ABSL_PREDICT_FALSE(!byte_reader_->Read(
-            &reading_.chunk.data,
-            IntCast<size_t>(UnsignedMin(
-                reading_.chunk.header.data_size() - reading_.chunk.data.size(),
-                internal::RemainingInBlock(byte_reader_->pos())))))) {
-      return ReadingFailed();
-    }
   }
 
   const Position chunk_end = internal::ChunkEnd(reading_.chunk.header, pos_);
@@ -181,7 +198,8 @@ again:
     return ReadingFailed();
   }
 
-  if (ABSL_PREDICT_FALSE(internal::Hash(reading_.chunk.data) !=
+  if (verify_data_hash &&
+      ABSL_PREDICT_FALSE(internal::Hash(reading_.chunk.data) !=
                          reading_.chunk.header.data_hash())) {
     if (!skip_errors_) return Fail("Corrupted Riegeli/records file");
     PrepareForRecovering();
@@ -201,6 +219,35 @@ again:
   return true;
 }
 
+bool ChunkReader::SkipChunk(ChunkHeader* chunk_header, Position* chunk_begin) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  current_chunk_is_incomplete_ = false;
+  if (is_recovering_ && !Recover()) return false;
+again:
+  RIEGELI_ASSERT(!is_recovering_)
+      << "ChunkReader::Recover() did not complete recovering";
+
+  if (reading_.chunk_header_read < reading_.chunk.header.size()) {
+    if (ABSL_PREDICT_FALSE(!ReadChunkHeader())) {
+      if (is_recovering_ && Recover()) goto again;
+      return false;
+    }
+  }
+
+  // Block headers inside chunk data are not verified. Seeking to chunk_end
+  // verifies only that the source is long enough.
+  const Position chunk_end = internal::ChunkEnd(reading_.chunk.header, pos_);
+  if (ABSL_PREDICT_FALSE(!byte_reader_->Seek(chunk_end))) {
+    return ReadingFailed();
+  }
+
+  if (chunk_begin != nullptr) *chunk_begin = pos_;
+  *chunk_header = reading_.chunk.header;
+  pos_ = chunk_end;
+  PrepareForReading();
+  return true;
+}
+
 inline bool ChunkReader::ReadChunkHeader() {
   RIEGELI_ASSERT(healthy())
       << "Failed precondigion of ChunkReader::ReadChunkReader(): "
@@ -264,17 +311,64 @@ inline bool ChunkReader::ReadBlockHeader() {
           remaining_length))) {
     return ReadingFailed();
   }
+  return VerifyBlockHeader(byte_reader_->pos());
+}
+
+inline bool ChunkReader::VerifyBlockHeader(Position block_header_end) {
   if (ABSL_PREDICT_FALSE(block_header_.computed_header_hash() !=
                          block_header_.stored_header_hash())) {
     if (!skip_errors_) return Fail("Corrupted Riegeli/records file");
     PrepareForRecovering();
     recovering_.corrupted = true;
-    SeekOverCorruption(byte_reader_->pos());
+    SeekOverCorruption(block_header_end);
     return false;
   }
   return true;
 }
 
+inline bool ChunkReader::ReadChunkSpan() {
+  RIEGELI_ASSERT(!is_recovering_)
+      << "Failed precondition of ChunkReader::ReadChunkSpan(): recovering";
+  const Position span_begin = byte_reader_->pos();
+  const Position data_end = internal::AddWithOverhead(
+      pos_, reading_.chunk.header.size() + reading_.chunk.header.data_size());
+  RIEGELI_ASSERT_LT(span_begin, data_end)
+      << "Failed precondition of ChunkReader::ReadChunkSpan(): "
+         "chunk data already read";
+  Chain span;
+  const bool span_complete = byte_reader_->Read(
+      &span,
+      IntCast<size_t>(UnsignedMin(data_end - span_begin, kMaxChunkSpan())));
+  // If the span is incomplete, the data which were read are processed anyway,
+  // so that a later ReadChunk() continues after them like after a failed read
+  // from byte_reader_.
+  ChainReader span_reader(&span);
+  while (reading_.chunk.data.size() < reading_.chunk.header.data_size()) {
+    const size_t remaining_length =
+        internal::RemainingInBlockHeader(span_begin + span_reader.pos());
+    if (remaining_length > 0) {
+      if (!span_reader.Read(
+              block_header_.bytes() + block_header_.size() - remaining_length,
+              remaining_length)) {
+        break;
+      }
+      if (ABSL_PREDICT_FALSE(
+              !VerifyBlockHeader(span_begin + span_reader.pos()))) {
+        return false;
+      }
+    }
+    if (!span_reader.Read(
+            &reading_.chunk.data,
+            IntCast<size_t>(UnsignedMin(
+                reading_.chunk.header.data_size() - reading_.chunk.data.size(),
+                internal::RemainingInBlock(span_begin + span_reader.pos()))))) {
+      break;
+    }
+  }
+  if (ABSL_PREDICT_FALSE(!span_complete)) return ReadingFailed();
+  return true;
+}
+
 inline void ChunkReader::PrepareForReading() {
   if (is_recovering_) {
     recovering_.~Recovering();
@@ -396,14 +490,18 @@ bool ChunkReader::Seek(Position new_pos) {
 }
 
 bool ChunkReader::SeekToChunkContaining(Position new_pos) {
-  return SeekToChunk(new_pos, true);
+  return SeekToChunk(new_pos, WhichChunk::kContaining);
+}
+
+bool ChunkReader::SeekToChunkBefore(Position new_pos) {
+  return SeekToChunk(new_pos, WhichChunk::kBefore);
 }
 
 bool ChunkReader::SeekToChunkAfter(Position new_pos) {
-  return SeekToChunk(new_pos, false);
+  return SeekToChunk(new_pos, WhichChunk::kAfter);
 }
 
-inline bool ChunkReader::SeekToChunk(Position new_pos, bool containing) {
+inline bool ChunkReader::SeekToChunk(Position new_pos, WhichChunk which_chunk) {
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
   current_chunk_is_incomplete_ = false;
   const Position block_begin = new_pos - new_pos % internal::kBlockSize();
@@ -423,7 +521,9 @@ inline bool ChunkReader::SeekToChunk(Position new_pos, bool containing) {
       // The current chunk ends too early. Skip to block_begin.
       goto read_block_header;
     }
-    if (containing && pos_ + reading_.chunk.header.num_records() > new_pos) {
+    if (which_chunk == WhichChunk::kContaining
+            ? pos_ + reading_.chunk.header.num_records() > new_pos
+            : which_chunk == WhichChunk::kBefore && chunk_end > new_pos) {
       return true;
     }
     chunk_begin = chunk_end;
@@ -451,7 +551,7 @@ inline bool ChunkReader::SeekToChunk(Position new_pos, bool containing) {
       goto check_current_chunk;
     }
     chunk_begin = block_begin + block_header_.next_chunk();
-    if (containing && chunk_begin > new_pos) {
+    if (which_chunk != WhichChunk::kAfter && chunk_begin > new_pos) {
       // new_pos is inside the chunk which contains this block boundary, so
       // start the search from this chunk instead of the next chunk.
       if (ABSL_PREDICT_FALSE(block_header_.previous_chunk() > block_begin)) {
@@ -478,10 +578,27 @@ inline bool ChunkReader::SeekToChunk(Position new_pos, bool containing) {
     if (ABSL_PREDICT_FALSE(!ReadChunkHeader())) {
       return is_recovering_ && Recover();
     }
-    if (containing && pos_ + reading_.chunk.header.num_records() > new_pos) {
+    const Position chunk_end = internal::ChunkEnd(reading_.chunk.header, pos_);
+    if (which_chunk == WhichChunk::kContaining
+            ? pos_ + reading_.chunk.header.num_records() > new_pos
+            : which_chunk == WhichChunk::kBefore && chunk_end > new_pos) {
       return true;
     }
-    chunk_begin = internal::ChunkEnd(reading_.chunk.header, pos_);
+    chunk_begin = chunk_end;
+  }
+}
+
+void ChunkReader::AddUniqueTo(MemoryEstimator* memory_estimator) const {
+  memory_estimator->AddMemory(sizeof(ChunkReader) - sizeof(Chain));
+  if (is_recovering_) {
+    memory_estimator->AddMemory(sizeof(Chain));
+  } else {
+    reading_.chunk.data.AddUniqueTo(memory_estimator);
+  }
+  if (owned_byte_reader_ != nullptr) {
+    owned_byte_reader_->AddUniqueTo(memory_estimator);
+  } else if (byte_reader_ != nullptr) {
+    byte_reader_->AddSharedTo(memory_estimator);
   }
 }
 
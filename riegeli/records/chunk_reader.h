@@ -21,6 +21,7 @@
 
 #include "absl/base/optimization.h"
 #include "riegeli/base/base.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
 #include "riegeli/bytes/reader.h"
 #include "riegeli/chunk_encoding/chunk.h"
@@ -56,10 +57,28 @@ class ChunkReader final : public Object {
       return std::move(set_skip_errors(skip_errors));
     }
 
+    // If false, hashes of chunk data are not verified by ReadChunk(). Chunk
+    // headers are still verified. This makes reading faster when data are
+    // already protected from corruption otherwise, e.g. by filesystem
+    // checksums. Chunk::VerifyData() can be used to verify chunks on demand.
+    //
+    // Corruption of chunk data is then not detected by ChunkReader, and is not
+    // skipped even if set_skip_errors(true).
+    //
+    // Default: true
+    Options& set_verify_data_hashes(bool verify_data_hashes) & {
+      verify_data_hashes_ = verify_data_hashes;
+      return *this;
+    }
+    Options&& set_verify_data_hashes(bool verify_data_hashes) && {
+      return std::move(set_verify_data_hashes(verify_data_hashes));
+    }
+
    private:
     friend class ChunkReader;
 
     bool skip_errors_ = false;
+    bool verify_data_hashes_ = true;
   };
 
   // Will read chunks from the byte Reader which is owned by this ChunkReader
@@ -99,6 +118,30 @@ class ChunkReader final : public Object {
   //  * false (when !healthy()) - failure
   bool ReadChunk(Chunk* chunk, Position* chunk_begin = nullptr);
 
+  // Like ReadChunk(), but does not verify the hash of chunk data even if
+  // Options::set_verify_data_hashes(true). This lets the caller verify it
+  // elsewhere, e.g. in a background thread together with decoding the chunk
+  // (see ChunkDecoder::Options::set_verify_data()). Corruption of chunk data is
+  // then not skipped by ChunkReader.
+  bool ReadChunkWithoutVerifying(Chunk* chunk, Position* chunk_begin = nullptr);
+
+  // Reads the header of the next chunk and skips its data without reading
+  // them. The header hash is verified, but corruption of chunk data is not
+  // detected.
+  //
+  // This is useful when only chunk headers are needed, e.g. for counting
+  // records: the Reader can seek over chunk data, so that only a small
+  // fraction of the file is read if seeking is efficient.
+  //
+  // If chunk_begin != nullptr, *chunk_begin is set to the chunk beginning
+  // position on success.
+  //
+  // Return values:
+  //  * true                    - success (*chunk_header is set)
+  //  * false (when healthy())  - source ends
+  //  * false (when !healthy()) - failure
+  bool SkipChunk(ChunkHeader* chunk_header, Position* chunk_begin = nullptr);
+
   // Returns true if reading from the current position might succeed, possibly
   // after some data is appended to the source. Returns false if reading from
   // the current position will always return false.
@@ -134,6 +177,18 @@ class ChunkReader final : public Object {
   //  * false (when !healthy()) - failure
   bool SeekToChunkContaining(Position new_pos);
 
+  // Seeks to the nearest chunk boundary before or at new_pos, i.e. to the
+  // beginning of the chunk which contains the byte at new_pos.
+  //
+  // Return values:
+  //  * true                    - success (position is set to the chunk
+  //                              boundary)
+  //  * false (when healthy())  - source ends before new_pos (position is set to
+  //                              the end) or seeking backwards is not supported
+  //                              (position is unchanged)
+  //  * false (when !healthy()) - failure
+  bool SeekToChunkBefore(Position new_pos);
+
   // Seeks to the nearest chunk boundary at or after new_pos.
   //
   // Return values:
@@ -154,6 +209,10 @@ class ChunkReader final : public Object {
   // Returns the number of bytes skipped because of corrupted regions.
   Position skipped_bytes() const { return skipped_bytes_; }
 
+  // Registers this ChunkReader with MemoryEstimator, including the chunk being
+  // read and the byte Reader.
+  void AddUniqueTo(MemoryEstimator* memory_estimator) const;
+
  protected:
   void Done() override;
 
@@ -178,6 +237,10 @@ class ChunkReader final : public Object {
     Position chunk_begin = 0;
   };
 
+  // Implements ReadChunk() and ReadChunkWithoutVerifying().
+  bool ReadChunkImpl(Chunk* chunk, Position* chunk_begin,
+                     bool verify_data_hash);
+
   // Interprets a false result from a byte_reader_ reading function. Always
   // returns false.
   bool ReadingFailed();
@@ -194,6 +257,23 @@ class ChunkReader final : public Object {
   // changed to begin a new recovery past this block header.
   bool ReadBlockHeader();
 
+  // Verifies block_header_ after reading it, ending at block_header_end.
+  //
+  // If the block header is invalid, this is treated as corruption like in
+  // ReadBlockHeader().
+  bool VerifyBlockHeader(Position block_header_end);
+
+  // Reads or continues reading chunk data of reading_.chunk, up to the end of
+  // chunk data or kMaxChunkSpan() bytes including interleaved block headers.
+  //
+  // The span is read from byte_reader_ with a single Read(Chain*), so that a
+  // buffered byte_reader_ can read a large chunk directly into the Chain
+  // instead of copying it through its buffer in pieces of a block. Block
+  // headers are then verified and skipped in memory.
+  //
+  // Precondition: !is_recovering_
+  bool ReadChunkSpan();
+
   // Prepares for reading a new chunk.
   void PrepareForReading();
 
@@ -219,14 +299,22 @@ class ChunkReader final : public Object {
   // attempted.
   bool InvalidChunkBoundary();
 
-  // Shared implementation of SeekToChunkContaining() (containing = true) and
-  // SeekToChunkAfter() (containing = false).
-  bool SeekToChunk(Position new_pos, bool containing);
+  // Which chunk SeekToChunk() should locate.
+  enum class WhichChunk {
+    kContaining,  // SeekToChunkContaining()
+    kBefore,      // SeekToChunkBefore()
+    kAfter,       // SeekToChunkAfter()
+  };
+
+  // Shared implementation of SeekToChunkContaining(), SeekToChunkBefore(), and
+  // SeekToChunkAfter().
+  bool SeekToChunk(Position new_pos, WhichChunk which_chunk);
 
   std::unique_ptr<Reader> owned_byte_reader_;
   // Invariant: if healthy() then byte_reader_ != nullptr
   Reader* byte_reader_;
   bool skip_errors_;
+  bool verify_data_hashes_;
 
   // Current position, excluding data buffered in reading_ or implied by
   // recovering_.
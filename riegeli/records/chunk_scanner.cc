@@ -0,0 +1,188 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/chunk_scanner.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/synchronization/mutex.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/object.h"
+#include "riegeli/base/parallelism.h"
+#include "riegeli/bytes/reader.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/records/block.h"
+#include "riegeli/records/chunk_reader.h"
+
+namespace riegeli {
+
+ChunkScanner::ChunkScanner(std::function<std::unique_ptr<Reader>()> open_reader,
+                           Options options)
+    : Object(State::kOpen),
+      open_reader_(std::move(open_reader)),
+      parallelism_(options.parallelism_),
+      segment_size_(
+          SaturatingAdd(options.segment_size_, internal::kBlockSize() - 1) /
+          internal::kBlockSize() * internal::kBlockSize()),
+      thread_pool_(options.thread_pool_) {}
+
+ChunkScanner::ChunkScanner(ChunkScanner&& src) noexcept
+    : Object(std::move(src)),
+      open_reader_(std::move(src.open_reader_)),
+      parallelism_(riegeli::exchange(src.parallelism_, 0)),
+      segment_size_(riegeli::exchange(src.segment_size_, 0)),
+      thread_pool_(riegeli::exchange(src.thread_pool_, nullptr)),
+      size_(riegeli::exchange(src.size_, 0)),
+      valid_chunks_(std::move(src.valid_chunks_)),
+      corrupted_ranges_(std::move(src.corrupted_ranges_)) {}
+
+ChunkScanner& ChunkScanner::operator=(ChunkScanner&& src) noexcept {
+  Object::operator=(std::move(src));
+  open_reader_ = std::move(src.open_reader_);
+  parallelism_ = riegeli::exchange(src.parallelism_, 0);
+  segment_size_ = riegeli::exchange(src.segment_size_, 0);
+  thread_pool_ = riegeli::exchange(src.thread_pool_, nullptr);
+  size_ = riegeli::exchange(src.size_, 0);
+  valid_chunks_ = std::move(src.valid_chunks_);
+  corrupted_ranges_ = std::move(src.corrupted_ranges_);
+  return *this;
+}
+
+void ChunkScanner::Done() {
+  open_reader_ = nullptr;
+  parallelism_ = 0;
+  segment_size_ = 0;
+  thread_pool_ = nullptr;
+}
+
+bool ChunkScanner::ScanSegment(Reader* byte_reader, Position begin,
+                               Position end, std::vector<ValidChunk>* chunks,
+                               std::string* message) const {
+  // Starting at a block boundary makes ChunkReader locate the first chunk
+  // using the block header.
+  if (ABSL_PREDICT_FALSE(!byte_reader->Seek(begin))) {
+    *message = byte_reader->healthy() ? "Seeking failed"
+                                      : std::string(byte_reader->message());
+    return false;
+  }
+  ChunkReader chunk_reader(byte_reader,
+                           ChunkReader::Options().set_skip_errors(true));
+  if (chunk_reader.SeekToChunkAfter(begin)) {
+    Chunk chunk;
+    Position chunk_begin;
+    while (chunk_reader.pos() < end &&
+           chunk_reader.ReadChunk(&chunk, &chunk_begin) && chunk_begin < end) {
+      chunks->push_back(ValidChunk{chunk_begin, chunk_reader.pos(),
+                                   chunk.header.num_records()});
+    }
+  }
+  if (ABSL_PREDICT_FALSE(!chunk_reader.Close())) {
+    *message = std::string(chunk_reader.message());
+    return false;
+  }
+  return true;
+}
+
+bool ChunkScanner::Scan() {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  valid_chunks_.clear();
+  corrupted_ranges_.clear();
+  {
+    const std::unique_ptr<Reader> byte_reader = open_reader_();
+    if (ABSL_PREDICT_FALSE(byte_reader == nullptr)) {
+      return Fail("Opening file failed");
+    }
+    if (ABSL_PREDICT_FALSE(!byte_reader->Size(&size_))) {
+      if (!byte_reader->healthy()) return Fail(*byte_reader);
+      return Fail("File size is unknown");
+    }
+  }
+  const size_t num_segments =
+      IntCast<size_t>((size_ + segment_size_ - 1) / segment_size_);
+  std::vector<std::vector<ValidChunk>> segments(num_segments);
+
+  absl::Mutex mutex;
+  absl::CondVar workers_done;
+  size_t next_segment = 0;
+  size_t num_workers = 0;
+  std::string failure;
+  const auto worker = [&] {
+    std::unique_ptr<Reader> byte_reader = open_reader_();
+    std::string message;
+    if (ABSL_PREDICT_FALSE(byte_reader == nullptr)) {
+      message = "Opening file failed";
+    } else {
+      for (;;) {
+        size_t segment;
+        {
+          absl::MutexLock lock(&mutex);
+          if (next_segment == num_segments || !failure.empty()) break;
+          segment = next_segment++;
+        }
+        const Position begin = Position{segment} * segment_size_;
+        const Position end = UnsignedMin(SaturatingAdd(begin, segment_size_),
+                                         size_);
+        if (ABSL_PREDICT_FALSE(!ScanSegment(byte_reader.get(), begin, end,
+                                            &segments[segment], &message))) {
+          break;
+        }
+      }
+      if (ABSL_PREDICT_FALSE(!byte_reader->Close()) && message.empty()) {
+        message = std::string(byte_reader->message());
+      }
+    }
+    absl::MutexLock lock(&mutex);
+    if (ABSL_PREDICT_FALSE(!message.empty()) && failure.empty()) {
+      failure = std::move(message);
+    }
+    if (--num_workers == 0) workers_done.Signal();
+  };
+  ThreadPool& thread_pool = thread_pool_ != nullptr
+                                ? *thread_pool_
+                                : internal::DefaultThreadPool();
+  {
+    absl::MutexLock lock(&mutex);
+    num_workers = UnsignedMin(num_segments, IntCast<size_t>(parallelism_));
+    for (size_t i = 0; i < num_workers; ++i) thread_pool.Schedule(worker);
+    while (num_workers > 0) workers_done.Wait(&mutex);
+  }
+  if (ABSL_PREDICT_FALSE(!failure.empty())) return Fail(failure);
+
+  Position pos = 0;
+  for (std::vector<ValidChunk>& segment : segments) {
+    for (const ValidChunk& chunk : segment) {
+      // Segments are scanned independently. A chunk claiming to overlap the
+      // previous one could have been found only by skipping corruption, and
+      // the chunk found first is trusted.
+      if (ABSL_PREDICT_FALSE(chunk.chunk_begin < pos)) continue;
+      if (chunk.chunk_begin > pos) {
+        corrupted_ranges_.push_back(CorruptedRange{pos, chunk.chunk_begin});
+      }
+      valid_chunks_.push_back(chunk);
+      pos = chunk.chunk_end;
+    }
+    segment = std::vector<ValidChunk>();
+  }
+  if (pos < size_) corrupted_ranges_.push_back(CorruptedRange{pos, size_});
+  return true;
+}
+
+}  // namespace riegeli
@@ -0,0 +1,167 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_CHUNK_SCANNER_H_
+#define RIEGELI_RECORDS_CHUNK_SCANNER_H_
+
+#include <stdint.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "riegeli/base/base.h"
+#include "riegeli/base/object.h"
+#include "riegeli/bytes/reader.h"
+
+namespace riegeli {
+
+class ThreadPool;
+
+// ChunkScanner verifies the integrity of a whole Riegeli/records file and
+// produces a map of its valid chunks and corrupted regions.
+//
+// The file is divided into segments which are scanned concurrently, each by
+// reading chunks beginning in it, verifying their headers and data hashes, and
+// skipping corrupted regions like ChunkReader with skip_errors. A segment is
+// entered using the block header at its beginning, so segments are
+// independent.
+//
+// Corrupted regions are the parts of the file not covered by valid chunks.
+class ChunkScanner final : public Object {
+ public:
+  class Options {
+   public:
+    // Not defaulted because of a C++ defect:
+    // https://stackoverflow.com/questions/17430377
+    Options() noexcept {}
+
+    // Sets the maximum number of segments scanned concurrently.
+    //
+    // Default: 8
+    Options& set_parallelism(int parallelism) & {
+      RIEGELI_ASSERT_GT(parallelism, 0)
+          << "Failed precondition of ChunkScanner::Options::set_parallelism(): "
+             "non-positive parallelism";
+      parallelism_ = parallelism;
+      return *this;
+    }
+    Options&& set_parallelism(int parallelism) && {
+      return std::move(set_parallelism(parallelism));
+    }
+
+    // Sets the size of a segment scanned as a unit. It is rounded up to a
+    // multiple of the block size (64KB).
+    //
+    // Default: 64M
+    Options& set_segment_size(uint64_t segment_size) & {
+      RIEGELI_ASSERT_GT(segment_size, 0u)
+          << "Failed precondition of "
+             "ChunkScanner::Options::set_segment_size(): "
+             "zero segment size";
+      segment_size_ = segment_size;
+      return *this;
+    }
+    Options&& set_segment_size(uint64_t segment_size) && {
+      return std::move(set_segment_size(segment_size));
+    }
+
+    // Specifies the thread pool used for scanning. If nullptr, a thread pool
+    // shared by the process is used.
+    //
+    // Default: nullptr
+    Options& set_thread_pool(ThreadPool* thread_pool) & {
+      thread_pool_ = thread_pool;
+      return *this;
+    }
+    Options&& set_thread_pool(ThreadPool* thread_pool) && {
+      return std::move(set_thread_pool(thread_pool));
+    }
+
+   private:
+    friend class ChunkScanner;
+
+    int parallelism_ = 8;
+    uint64_t segment_size_ = uint64_t{64} << 20;
+    ThreadPool* thread_pool_ = nullptr;
+  };
+
+  // A chunk which passed verification.
+  struct ValidChunk {
+    Position chunk_begin;
+    Position chunk_end;
+    uint64_t num_records;
+  };
+
+  // A region of the file not covered by valid chunks.
+  struct CorruptedRange {
+    Position begin;
+    Position end;
+  };
+
+  // Creates a closed ChunkScanner.
+  ChunkScanner() noexcept : Object(State::kClosed) {}
+
+  // Will scan the file read by Readers returned by open_reader(). It is called
+  // once per concurrent scan, possibly concurrently, and returns nullptr on
+  // failure. Readers should support random access and Size().
+  explicit ChunkScanner(std::function<std::unique_ptr<Reader>()> open_reader,
+                        Options options = Options());
+
+  ChunkScanner(ChunkScanner&& src) noexcept;
+  ChunkScanner& operator=(ChunkScanner&& src) noexcept;
+
+  // Scans the whole file, blocking until scanning completes. Afterwards
+  // valid_chunks() and corrupted_ranges() are available.
+  //
+  // Corruption of the file does not cause failure, only failures to read it.
+  //
+  // Return values:
+  //  * true  - success (healthy())
+  //  * false - failure (!healthy())
+  bool Scan();
+
+  // Returns valid chunks found by Scan(), in the order of their positions.
+  const std::vector<ValidChunk>& valid_chunks() const { return valid_chunks_; }
+
+  // Returns corrupted regions found by Scan(), in the order of their
+  // positions.
+  const std::vector<CorruptedRange>& corrupted_ranges() const {
+    return corrupted_ranges_;
+  }
+
+  // Returns the size of the file scanned by Scan().
+  Position size() const { return size_; }
+
+ protected:
+  void Done() override;
+
+ private:
+  // Scans chunks beginning in [begin, end), appending them to *chunks.
+  bool ScanSegment(Reader* byte_reader, Position begin, Position end,
+                   std::vector<ValidChunk>* chunks, std::string* message) const;
+
+  std::function<std::unique_ptr<Reader>()> open_reader_;
+  int parallelism_ = 0;
+  uint64_t segment_size_ = 0;
+  ThreadPool* thread_pool_ = nullptr;
+  Position size_ = 0;
+  std::vector<ValidChunk> valid_chunks_;
+  std::vector<CorruptedRange> corrupted_ranges_;
+};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_CHUNK_SCANNER_H_
@@ -21,18 +21,92 @@
 #include "absl/base/optimization.h"
 #include "absl/strings/string_view.h"
 #include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
 #include "riegeli/bytes/chain_reader.h"
 #include "riegeli/bytes/reader.h"
 #include "riegeli/bytes/string_reader.h"
 #include "riegeli/bytes/writer.h"
-#include "riegeli/bytes/writer_utils.h"
 #include "riegeli/chunk_encoding/chunk.h"
 #include "riegeli/chunk_encoding/hash.h"
 #include "riegeli/records/block.h"
 
 namespace riegeli {
 
+namespace {
+
+// Appends the contents of *src to *dest, inserting a block header at each
+// block boundary. *dest holds the chunk framed so far, beginning at
+// chunk_begin.
+//
+// Reading from a ChainReader shares its blocks instead of copying them, so
+// the payload is not copied here.
+void AppendSection(Reader* src, Position chunk_begin, Position chunk_end,
+                   Chain* dest) {
+  const size_t size_hint = IntCast<size_t>(chunk_end - chunk_begin);
+  for (;;) {
+    const Position pos = chunk_begin + dest->size();
+    if (internal::IsBlockBoundary(IntCast<uint64_t>(pos))) {
+      if (!src->Pull()) break;
+      internal::BlockHeader block_header(IntCast<uint64_t>(pos - chunk_begin),
+                                         IntCast<uint64_t>(chunk_end - pos));
+      dest->Append(absl::string_view(block_header.bytes(), block_header.size()),
+                   size_hint);
+    }
+    if (!src->Read(dest, IntCast<size_t>(internal::RemainingInBlock(
+                             IntCast<uint64_t>(chunk_begin + dest->size()))))) {
+      break;
+    }
+  }
+  if (!src->Close()) {
+    RIEGELI_ASSERT_UNREACHABLE()
+        << "Closing section reader failed: " << src->message();
+  }
+}
+
+// Appends zeros to *dest up to chunk_end, inserting a block header at each
+// block boundary.
+void AppendPadding(Position chunk_begin, Position chunk_end, Chain* dest) {
+  static constexpr char kZeros[4096] = {};
+  const size_t size_hint = IntCast<size_t>(chunk_end - chunk_begin);
+  for (;;) {
+    const Position pos = chunk_begin + dest->size();
+    if (pos >= chunk_end) break;
+    if (internal::IsBlockBoundary(IntCast<uint64_t>(pos))) {
+      internal::BlockHeader block_header(IntCast<uint64_t>(pos - chunk_begin),
+                                         IntCast<uint64_t>(chunk_end - pos));
+      dest->Append(absl::string_view(block_header.bytes(), block_header.size()),
+                   size_hint);
+      continue;
+    }
+    const size_t length = IntCast<size_t>(UnsignedMin(
+        chunk_end - pos, internal::RemainingInBlock(IntCast<uint64_t>(pos)),
+        sizeof(kZeros)));
+    dest->Append(absl::string_view(kZeros, length), size_hint);
+  }
+}
+
+}  // namespace
+
+namespace internal {
+
+Position FrameChunk(const Chunk& chunk, Position chunk_begin, Chain* dest) {
+  RIEGELI_ASSERT(dest->empty())
+      << "Failed precondition of FrameChunk(): non-empty destination";
+  const Position chunk_end = ChunkEnd(chunk.header, chunk_begin);
+  StringReader header_reader(chunk.header.bytes(), chunk.header.size());
+  AppendSection(&header_reader, chunk_begin, chunk_end, dest);
+  ChainReader data_reader(&chunk.data);
+  AppendSection(&data_reader, chunk_begin, chunk_end, dest);
+  AppendPadding(chunk_begin, chunk_end, dest);
+  RIEGELI_ASSERT_EQ(chunk_begin + dest->size(), chunk_end)
+      << "Unexpected size of framed chunk";
+  return chunk_end;
+}
+
+}  // namespace internal
+
 ChunkWriter::~ChunkWriter() {}
 
 DefaultChunkWriter::DefaultChunkWriter(std::unique_ptr<Writer> byte_writer)
@@ -63,21 +137,15 @@ bool DefaultChunkWriter::WriteChunk(const Chunk& chunk) {
   RIEGELI_ASSERT_EQ(chunk.header.data_hash(), internal::Hash(chunk.data))
       << "Failed precondition of ChunkWriter::WriteChunk(): "
          "Wrong chunk data hash";
-  StringReader header_reader(chunk.header.bytes(), chunk.header.size());
-  ChainReader data_reader(&chunk.data);
   const Position chunk_begin = pos_;
-  const Position chunk_end = internal::ChunkEnd(chunk.header, chunk_begin);
   RIEGELI_ASSERT_EQ(byte_writer_->pos(), chunk_begin)
       << "Unexpected position before writing chunk";
-  if (ABSL_PREDICT_FALSE(
-          !WriteSection(&header_reader, chunk_begin, chunk_end))) {
-    return false;
-  }
-  if (ABSL_PREDICT_FALSE(!WriteSection(&data_reader, chunk_begin, chunk_end))) {
-    return false;
-  }
-  if (ABSL_PREDICT_FALSE(!WritePadding(chunk_begin, chunk_end))) {
-    return false;
+  // Frame the whole chunk in memory and write it at once, so that a Writer
+  // which accepts a Chain by reference does not copy the payload.
+  Chain framed;
+  const Position chunk_end = internal::FrameChunk(chunk, chunk_begin, &framed);
+  if (ABSL_PREDICT_FALSE(!byte_writer_->Write(std::move(framed)))) {
+    return Fail(*byte_writer_);
   }
   RIEGELI_ASSERT_EQ(byte_writer_->pos(), chunk_end)
       << "Unexpected position after writing chunk";
@@ -85,59 +153,30 @@ bool DefaultChunkWriter::WriteChunk(const Chunk& chunk) {
   return true;
 }
 
-inline bool DefaultChunkWriter::WriteSection(Reader* src, Position chunk_begin,
-                                             Position chunk_end) {
-  while (src->Pull()) {
-    if (internal::IsBlockBoundary(IntCast<uint64_t>(byte_writer_->pos()))) {
-      internal::BlockHeader block_header(
-          IntCast<uint64_t>(byte_writer_->pos() - chunk_begin),
-          IntCast<uint64_t>(chunk_end - byte_writer_->pos()));
-      if (ABSL_PREDICT_FALSE(!byte_writer_->Write(
-              absl::string_view(block_header.bytes(), block_header.size())))) {
-        return Fail(*byte_writer_);
-      }
-    }
-    if (!src->CopyTo(byte_writer_, internal::RemainingInBlock(IntCast<uint64_t>(
-                                       byte_writer_->pos())))) {
-      if (ABSL_PREDICT_TRUE(byte_writer_->healthy())) break;
-      return Fail(*byte_writer_);
-    }
-  }
-  if (!src->Close()) {
-    RIEGELI_ASSERT_UNREACHABLE()
-        << "Closing section reader failed: " << src->message();
+bool DefaultChunkWriter::Flush(FlushType flush_type) {
+  if (ABSL_PREDICT_FALSE(!byte_writer_->Flush(flush_type))) {
+    if (byte_writer_->healthy()) return false;
+    return Fail(*byte_writer_);
   }
   return true;
 }
 
-inline bool DefaultChunkWriter::WritePadding(Position chunk_begin,
-                                             Position chunk_end) {
-  while (byte_writer_->pos() < chunk_end) {
-    if (internal::IsBlockBoundary(IntCast<uint64_t>(byte_writer_->pos()))) {
-      internal::BlockHeader block_header(
-          IntCast<uint64_t>(byte_writer_->pos() - chunk_begin),
-          IntCast<uint64_t>(chunk_end - byte_writer_->pos()));
-      if (ABSL_PREDICT_FALSE(!byte_writer_->Write(
-              absl::string_view(block_header.bytes(), block_header.size())))) {
-        return Fail(*byte_writer_);
-      }
-    }
-    const Position slice_size = UnsignedMin(
-        chunk_end - byte_writer_->pos(),
-        internal::RemainingInBlock(IntCast<uint64_t>(byte_writer_->pos())));
-    if (ABSL_PREDICT_FALSE(!WriteZeros(byte_writer_, slice_size))) {
-      return Fail(*byte_writer_);
-    }
-  }
-  return true;
+void ChunkWriter::AddUniqueTo(MemoryEstimator* memory_estimator) const {
+  memory_estimator->AddMemory(sizeof(ChunkWriter));
 }
 
-bool DefaultChunkWriter::Flush(FlushType flush_type) {
-  if (ABSL_PREDICT_FALSE(!byte_writer_->Flush(flush_type))) {
-    if (byte_writer_->healthy()) return false;
-    return Fail(*byte_writer_);
+void ChunkWriter::AddSharedTo(MemoryEstimator* memory_estimator) const {
+  if (memory_estimator->AddObject(this)) AddUniqueTo(memory_estimator);
+}
+
+void DefaultChunkWriter::AddUniqueTo(MemoryEstimator* memory_estimator) const {
+  ChunkWriter::AddUniqueTo(memory_estimator);
+  memory_estimator->AddMemory(sizeof(DefaultChunkWriter) - sizeof(ChunkWriter));
+  if (owned_byte_writer_ != nullptr) {
+    owned_byte_writer_->AddUniqueTo(memory_estimator);
+  } else if (byte_writer_ != nullptr) {
+    byte_writer_->AddSharedTo(memory_estimator);
   }
-  return true;
 }
 
 }  // namespace riegeli
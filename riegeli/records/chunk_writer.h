@@ -18,6 +18,8 @@
 #include <memory>
 
 #include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
 #include "riegeli/bytes/writer.h"
 #include "riegeli/chunk_encoding/chunk.h"
@@ -74,6 +76,15 @@ class ChunkWriter : public Object {
   // Returns the current byte position.
   Position pos() const { return pos_; }
 
+  // Registers this ChunkWriter with MemoryEstimator, including its buffers and
+  // the destination it writes to.
+  //
+  // By default only sizeof(ChunkWriter) is registered. Derived classes override
+  // this, calling AddUniqueTo() of their base class and adding the rest of
+  // their size and their subobjects.
+  virtual void AddUniqueTo(MemoryEstimator* memory_estimator) const;
+  void AddSharedTo(MemoryEstimator* memory_estimator) const;
+
  protected:
   void Done() override;
 
@@ -95,18 +106,30 @@ class DefaultChunkWriter final : public ChunkWriter {
   bool WriteChunk(const Chunk& chunk) override;
   bool Flush(FlushType flush_type) override;
 
+  void AddUniqueTo(MemoryEstimator* memory_estimator) const override;
+
  protected:
   void Done() override;
 
  private:
-  bool WriteSection(Reader* src, Position chunk_begin, Position chunk_end);
-  bool WritePadding(Position chunk_begin, Position chunk_end);
-
   std::unique_ptr<Writer> owned_byte_writer_;
   // Invariant: if healthy() then byte_writer_ != nullptr
   Writer* byte_writer_;
 };
 
+namespace internal {
+
+// Appends to *dest the chunk as stored in a file beginning at chunk_begin:
+// header, data, and padding, interleaved with block headers. Blocks of
+// chunk.data are shared rather than copied.
+//
+// Returns the position after the chunk.
+//
+// Precondition: dest->empty()
+Position FrameChunk(const Chunk& chunk, Position chunk_begin, Chain* dest);
+
+}  // namespace internal
+
 // Implementation details follow.
 
 inline void ChunkWriter::Done() { pos_ = 0; }
@@ -0,0 +1,307 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/circular_log.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <limits>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/endian.h"
+#include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/writer.h"
+#include "riegeli/bytes/writer_utils.h"
+#include "riegeli/chunk_encoding/hash.h"
+#include "riegeli/records/block.h"
+
+namespace riegeli {
+
+namespace {
+
+constexpr uint64_t kLogHeaderMagic = uint64_t{0x676f6c7261637269};
+
+// The log header at the beginning of a circular log. The rest of the first
+// block is unused.
+class LogHeader {
+ public:
+  LogHeader() noexcept {}
+
+  LogHeader(Position capacity, Position begin, Position end) {
+    words_[1] = WriteLittleEndian64(kLogHeaderMagic);
+    words_[2] = WriteLittleEndian64(capacity);
+    words_[3] = WriteLittleEndian64(begin);
+    words_[4] = WriteLittleEndian64(end);
+    words_[0] = WriteLittleEndian64(computed_header_hash());
+  }
+
+  LogHeader(const LogHeader&) = delete;
+  LogHeader& operator=(const LogHeader&) = delete;
+
+  char* bytes() { return reinterpret_cast<char*>(words_); }
+  const char* bytes() const { return reinterpret_cast<const char*>(words_); }
+  static constexpr size_t size() { return sizeof(words_); }
+
+  uint64_t computed_header_hash() const {
+    return internal::Hash(absl::string_view(
+        reinterpret_cast<const char*>(words_ + 1), size() - sizeof(uint64_t)));
+  }
+  uint64_t stored_header_hash() const { return ReadLittleEndian64(words_[0]); }
+  uint64_t magic() const { return ReadLittleEndian64(words_[1]); }
+  Position capacity() const { return ReadLittleEndian64(words_[2]); }
+  Position begin() const { return ReadLittleEndian64(words_[3]); }
+  Position end() const { return ReadLittleEndian64(words_[4]); }
+
+ private:
+  uint64_t words_[5];
+};
+
+// The amount by which the beginning of the valid range is advanced beyond what
+// is immediately needed, so that the log header is not written before each
+// write to the destination.
+inline Position ReclaimStep(Position capacity) {
+  return UnsignedMax(capacity / 8, internal::kBlockSize());
+}
+
+}  // namespace
+
+CircularLogWriter::CircularLogWriter(Writer* dest, Options options)
+    : BufferedWriter(options.buffer_size_),
+      dest_(RIEGELI_ASSERT_NOTNULL(dest)),
+      capacity_(options.capacity_),
+      begin_(options.begin_),
+      end_(options.end_) {
+  RIEGELI_ASSERT_LE(end_ - begin_, capacity_)
+      << "Failed precondition of CircularLogWriter::CircularLogWriter(): "
+         "existing range larger than capacity";
+  start_pos_ = end_;
+  if (ABSL_PREDICT_FALSE(!dest_->SupportsRandomAccess())) {
+    limit_ = start_;
+    Fail("Circular log requires a destination which supports random access");
+    return;
+  }
+  if (!options.existing_) {
+    // Fill the first block, so that data can be written after it, and if
+    // preallocating, the whole capacity.
+    if (ABSL_PREDICT_FALSE(!WriteLogHeader())) return;
+    const Position size =
+        options.preallocate_ ? internal::kBlockSize() + capacity_
+                             : internal::kBlockSize();
+    if (ABSL_PREDICT_FALSE(!WriteZeros(dest_, size - LogHeader::size()))) {
+      limit_ = start_;
+      Fail("Writing circular log failed", *dest_);
+    }
+  }
+}
+
+void CircularLogWriter::Done() {
+  if (ABSL_PREDICT_TRUE(PushInternal())) {
+    end_ = start_pos_;
+    WriteLogHeader();
+  }
+  dest_ = nullptr;
+  capacity_ = 0;
+  begin_ = 0;
+  end_ = 0;
+  BufferedWriter::Done();
+}
+
+inline bool CircularLogWriter::SeekDest(Position new_pos) {
+  // Seeking backwards inside the buffer of dest_ would make dest_ forget
+  // buffered data after new_pos, so they are pushed first.
+  if (new_pos < dest_->pos() &&
+      ABSL_PREDICT_FALSE(!dest_->Flush(FlushType::kFromObject))) {
+    limit_ = start_;
+    return Fail("Flushing circular log failed", *dest_);
+  }
+  if (ABSL_PREDICT_FALSE(!dest_->Seek(new_pos))) {
+    limit_ = start_;
+    return Fail("Seeking circular log failed", *dest_);
+  }
+  return true;
+}
+
+inline bool CircularLogWriter::WriteLogHeader() {
+  if (ABSL_PREDICT_FALSE(!SeekDest(0))) return false;
+  const LogHeader header(capacity_, begin_, end_);
+  if (ABSL_PREDICT_FALSE(
+          !dest_->Write(absl::string_view(header.bytes(), header.size())))) {
+    limit_ = start_;
+    return Fail("Writing circular log header failed", *dest_);
+  }
+  return true;
+}
+
+inline bool CircularLogWriter::Reclaim(Position new_end) {
+  if (new_end <= begin_ + capacity_) return true;
+  const Position new_begin = new_end - capacity_ + ReclaimStep(capacity_);
+  begin_ = new_begin + internal::RemainingInBlock(new_begin);
+  if (ABSL_PREDICT_FALSE(!WriteLogHeader())) return false;
+  // The log header must reach the file before data which it no longer covers
+  // are overwritten, so that a process crash does not leave a log header which
+  // covers data of a newer generation.
+  if (ABSL_PREDICT_FALSE(!dest_->Flush(FlushType::kFromProcess))) {
+    limit_ = start_;
+    return Fail("Flushing circular log header failed", *dest_);
+  }
+  return true;
+}
+
+bool CircularLogWriter::WriteInternal(absl::string_view src) {
+  RIEGELI_ASSERT(!src.empty())
+      << "Failed precondition of BufferedWriter::WriteInternal(): "
+         "nothing to write";
+  RIEGELI_ASSERT(healthy())
+      << "Failed precondition of BufferedWriter::WriteInternal(): "
+         "Object unhealthy";
+  RIEGELI_ASSERT_EQ(written_to_buffer(), 0u)
+      << "Failed precondition of BufferedWriter::WriteInternal(): "
+         "buffer not cleared";
+  if (ABSL_PREDICT_FALSE(src.size() >
+                         std::numeric_limits<Position>::max() - start_pos_)) {
+    limit_ = start_;
+    return FailOverflow();
+  }
+  // The valid range is reclaimed before its data are overwritten.
+  if (ABSL_PREDICT_FALSE(!Reclaim(start_pos_ + src.size()))) return false;
+  do {
+    const Position offset = start_pos_ % capacity_;
+    const size_t length =
+        IntCast<size_t>(UnsignedMin(src.size(), capacity_ - offset));
+    if (dest_->pos() != internal::kBlockSize() + offset) {
+      if (ABSL_PREDICT_FALSE(!SeekDest(internal::kBlockSize() + offset))) {
+        return false;
+      }
+    }
+    if (ABSL_PREDICT_FALSE(!dest_->Write(src.substr(0, length)))) {
+      limit_ = start_;
+      return Fail("Writing circular log failed", *dest_);
+    }
+    start_pos_ += length;
+    src.remove_prefix(length);
+  } while (!src.empty());
+  return true;
+}
+
+bool CircularLogWriter::Flush(FlushType flush_type) {
+  if (ABSL_PREDICT_FALSE(!PushInternal())) return false;
+  // Data are flushed before the log header which covers them.
+  if (ABSL_PREDICT_FALSE(!dest_->Flush(flush_type))) {
+    limit_ = start_;
+    return Fail("Flushing circular log failed", *dest_);
+  }
+  end_ = start_pos_;
+  if (ABSL_PREDICT_FALSE(!WriteLogHeader())) return false;
+  if (ABSL_PREDICT_FALSE(!dest_->Flush(flush_type))) {
+    limit_ = start_;
+    return Fail("Flushing circular log header failed", *dest_);
+  }
+  return true;
+}
+
+CircularLogReader::CircularLogReader(Reader* src, Options options)
+    : BufferedReader(options.buffer_size_), src_(RIEGELI_ASSERT_NOTNULL(src)) {
+  LogHeader header;
+  if (ABSL_PREDICT_FALSE(!src_->Seek(0)) ||
+      ABSL_PREDICT_FALSE(!src_->Read(header.bytes(), header.size()))) {
+    if (ABSL_PREDICT_FALSE(!src_->healthy())) {
+      Fail(*src_);
+      return;
+    }
+    Fail("Truncated circular log header");
+    return;
+  }
+  if (ABSL_PREDICT_FALSE(header.stored_header_hash() !=
+                         header.computed_header_hash()) ||
+      ABSL_PREDICT_FALSE(header.magic() != kLogHeaderMagic)) {
+    Fail("Corrupted circular log header");
+    return;
+  }
+  capacity_ = header.capacity();
+  begin_ = header.begin();
+  // The beginning can be advanced past the end if more than the capacity was
+  // written since the last flush. Then there are no valid data.
+  end_ = UnsignedMax(header.end(), begin_);
+  if (ABSL_PREDICT_FALSE(capacity_ == 0) ||
+      ABSL_PREDICT_FALSE(!internal::IsBlockBoundary(capacity_)) ||
+      ABSL_PREDICT_FALSE(!internal::IsBlockBoundary(begin_)) ||
+      ABSL_PREDICT_FALSE(end_ - begin_ > capacity_)) {
+    Fail("Invalid circular log header");
+    return;
+  }
+  limit_pos_ = begin_;
+}
+
+void CircularLogReader::Done() {
+  src_ = nullptr;
+  capacity_ = 0;
+  begin_ = 0;
+  end_ = 0;
+  BufferedReader::Done();
+}
+
+bool CircularLogReader::ReadInternal(char* dest, size_t min_length,
+                                     size_t max_length) {
+  RIEGELI_ASSERT_GT(min_length, 0u)
+      << "Failed precondition of BufferedReader::ReadInternal(): "
+         "nothing to read";
+  RIEGELI_ASSERT_GE(max_length, min_length)
+      << "Failed precondition of BufferedReader::ReadInternal(): "
+         "max_length < min_length";
+  RIEGELI_ASSERT(healthy())
+      << "Failed precondition of BufferedReader::ReadInternal(): "
+         "Object unhealthy";
+  max_length = IntCast<size_t>(UnsignedMin(max_length, end_ - limit_pos_));
+  while (max_length > 0) {
+    const Position offset = limit_pos_ % capacity_;
+    const size_t length =
+        IntCast<size_t>(UnsignedMin(max_length, capacity_ - offset));
+    if (ABSL_PREDICT_FALSE(!src_->Seek(internal::kBlockSize() + offset)) ||
+        ABSL_PREDICT_FALSE(!src_->Read(dest, length))) {
+      if (ABSL_PREDICT_FALSE(!src_->healthy())) return Fail(*src_);
+      return Fail("Truncated circular log");
+    }
+    limit_pos_ += length;
+    if (length >= min_length) return true;
+    dest += length;
+    min_length -= length;
+    max_length -= length;
+  }
+  // The valid range ends.
+  return false;
+}
+
+bool CircularLogReader::SeekSlow(Position new_pos) {
+  RIEGELI_ASSERT(new_pos < start_pos() || new_pos > limit_pos_)
+      << "Failed precondition of Reader::SeekSlow(): "
+         "position in the buffer, use Seek() instead";
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  ClearBuffer();
+  if (ABSL_PREDICT_FALSE(new_pos < begin_)) {
+    // Data before begin_ have been overwritten.
+    limit_pos_ = begin_;
+    return false;
+  }
+  if (ABSL_PREDICT_FALSE(new_pos > end_)) {
+    // The valid range ends.
+    limit_pos_ = end_;
+    return false;
+  }
+  limit_pos_ = new_pos;
+  return true;
+}
+
+}  // namespace riegeli
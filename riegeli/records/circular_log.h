@@ -0,0 +1,323 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_CIRCULAR_LOG_H_
+#define RIEGELI_RECORDS_CIRCULAR_LOG_H_
+
+#include <stddef.h>
+#include <utility>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/object.h"
+#include "riegeli/bytes/buffered_reader.h"
+#include "riegeli/bytes/buffered_writer.h"
+#include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/writer.h"
+#include "riegeli/records/block.h"
+
+namespace riegeli {
+
+// A circular log keeps the most recent part of a Riegeli/records file in a
+// file of a fixed size. The Riegeli/records file is written to a
+// CircularLogWriter with a RecordWriter, and read from a CircularLogReader with
+// a RecordReader.
+//
+// Positions of the Riegeli/records file (logical positions) grow forever.
+// The logical position pos is stored at the physical position
+// kBlockSize() + pos % capacity, so the file stops growing at
+// kBlockSize() + capacity, and then the oldest data are overwritten. Because
+// capacity is a multiple of kBlockSize(), logical and physical block
+// boundaries coincide, and block headers remain valid after wrapping.
+//
+// The first kBlockSize() bytes of the file hold a log header with the logical
+// range of valid data: its beginning (a block boundary), and its end (the
+// position at the last flush, a chunk boundary). The end divided by the
+// capacity is the generation of the data, i.e. how many times the writer
+// wrapped around. The beginning is advanced and the log header is written
+// before data there are overwritten, so the range never covers data of a newer
+// generation, even if the writer is interrupted.
+//
+// CircularLogReader reads the valid range, beginning at a block boundary which
+// is generally inside a chunk. RecordReader then finds the oldest complete
+// chunk using the block header there, in the same way as when it recovers from
+// a corrupted region.
+
+// A Writer which writes a circular log to another Writer.
+//
+// The destination must support random access. It is not owned by this
+// CircularLogWriter and must be kept alive but not accessed until closing the
+// CircularLogWriter. Data written after the last Flush() may be lost if the
+// CircularLogWriter is not closed.
+class CircularLogWriter final : public BufferedWriter {
+ public:
+  class Options {
+   public:
+    // Not defaulted because of a C++ defect:
+    // https://stackoverflow.com/questions/17430377
+    Options() noexcept {}
+
+    // Sets the maximal size of the logical data kept, excluding the log
+    // header.
+    //
+    // capacity must be a positive multiple of kBlockSize().
+    //
+    // Default: 64M
+    Options& set_capacity(Position capacity) & {
+      RIEGELI_ASSERT_GT(capacity, 0u)
+          << "Failed precondition of "
+             "CircularLogWriter::Options::set_capacity(): "
+             "zero capacity";
+      RIEGELI_ASSERT(internal::IsBlockBoundary(capacity))
+          << "Failed precondition of "
+             "CircularLogWriter::Options::set_capacity(): "
+             "capacity not a multiple of block size";
+      capacity_ = capacity;
+      return *this;
+    }
+    Options&& set_capacity(Position capacity) && {
+      return std::move(set_capacity(capacity));
+    }
+
+    // Continues an existing circular log with the given logical range, as
+    // returned by CircularLogReader::begin() and CircularLogReader::end().
+    // The capacity must be the same as in the existing log.
+    //
+    // If not called, a new circular log is started, overwriting the
+    // destination from its beginning.
+    Options& set_existing_range(Position begin, Position end) & {
+      RIEGELI_ASSERT(internal::IsBlockBoundary(begin))
+          << "Failed precondition of "
+             "CircularLogWriter::Options::set_existing_range(): "
+             "begin not at a block boundary";
+      RIEGELI_ASSERT_LE(begin, end)
+          << "Failed precondition of "
+             "CircularLogWriter::Options::set_existing_range(): "
+             "begin after end";
+      existing_ = true;
+      begin_ = begin;
+      end_ = end;
+      return *this;
+    }
+    Options&& set_existing_range(Position begin, Position end) && {
+      return std::move(set_existing_range(begin, end));
+    }
+
+    // If true, a new circular log is extended to its full size, i.e.
+    // kBlockSize() + capacity, with zeros when it is started, so that space for
+    // it is allocated at once instead of failing or fragmenting the file while
+    // the log grows.
+    //
+    // This has no effect with set_existing_range().
+    //
+    // Default: true
+    Options& set_preallocate(bool preallocate) & {
+      preallocate_ = preallocate;
+      return *this;
+    }
+    Options&& set_preallocate(bool preallocate) && {
+      return std::move(set_preallocate(preallocate));
+    }
+
+    // Tunes how much data should be buffered before writing to the
+    // destination.
+    //
+    // Default: kDefaultBufferSize()
+    Options& set_buffer_size(size_t buffer_size) & {
+      RIEGELI_ASSERT_GT(buffer_size, 0u)
+          << "Failed precondition of "
+             "CircularLogWriter::Options::set_buffer_size(): "
+             "zero buffer size";
+      buffer_size_ = buffer_size;
+      return *this;
+    }
+    Options&& set_buffer_size(size_t buffer_size) && {
+      return std::move(set_buffer_size(buffer_size));
+    }
+
+   private:
+    friend class CircularLogWriter;
+
+    Position capacity_ = Position{64} << 20;
+    bool existing_ = false;
+    Position begin_ = 0;
+    Position end_ = 0;
+    bool preallocate_ = true;
+    size_t buffer_size_ = kDefaultBufferSize();
+  };
+
+  // Creates a closed CircularLogWriter.
+  CircularLogWriter() noexcept {}
+
+  // Will write to the Writer which is not owned by this CircularLogWriter and
+  // must be kept alive but not accessed until closing the CircularLogWriter.
+  explicit CircularLogWriter(Writer* dest, Options options = Options());
+
+  CircularLogWriter(CircularLogWriter&& src) noexcept;
+  CircularLogWriter& operator=(CircularLogWriter&& src) noexcept;
+
+  // Writes buffered data and the log header to the destination, and flushes
+  // the destination.
+  bool Flush(FlushType flush_type) override;
+
+ protected:
+  void Done() override;
+  bool WriteInternal(absl::string_view src) override;
+
+ private:
+  // Advances begin_ if needed so that the logical range [begin_, new_end)
+  // fits in the capacity, writing and flushing the log header if begin_
+  // changed.
+  bool Reclaim(Position new_end);
+
+  // Seeks the destination to the physical position new_pos, pushing its
+  // buffer first if seeking backwards.
+  bool SeekDest(Position new_pos);
+
+  // Writes the log header with begin_ and end_ to the destination.
+  bool WriteLogHeader();
+
+  // Invariant: if healthy() then dest_ != nullptr
+  Writer* dest_ = nullptr;
+  Position capacity_ = 0;
+  // The logical range of valid data in the log header.
+  //
+  // Invariant: begin_ is a block boundary
+  Position begin_ = 0;
+  Position end_ = 0;
+
+  // Invariant if healthy(): start_pos_ <= begin_ + capacity_
+};
+
+// A Reader which reads the valid range of a circular log written by
+// CircularLogWriter from another Reader.
+//
+// The source must support random access. It is not owned by this
+// CircularLogReader and must be kept alive but not accessed until closing the
+// CircularLogReader.
+//
+// Reading starts at begin(). Positions are logical; seeking before begin() or
+// after end() fails. The source is expected not to be written while it is being
+// read.
+class CircularLogReader final : public BufferedReader {
+ public:
+  class Options {
+   public:
+    // Not defaulted because of a C++ defect:
+    // https://stackoverflow.com/questions/17430377
+    Options() noexcept {}
+
+    // Tunes how much data is buffered after reading from the source.
+    //
+    // Default: kDefaultBufferSize()
+    Options& set_buffer_size(size_t buffer_size) & {
+      RIEGELI_ASSERT_GT(buffer_size, 0u)
+          << "Failed precondition of "
+             "CircularLogReader::Options::set_buffer_size(): "
+             "zero buffer size";
+      buffer_size_ = buffer_size;
+      return *this;
+    }
+    Options&& set_buffer_size(size_t buffer_size) && {
+      return std::move(set_buffer_size(buffer_size));
+    }
+
+   private:
+    friend class CircularLogReader;
+
+    size_t buffer_size_ = kDefaultBufferSize();
+  };
+
+  // Creates a closed CircularLogReader.
+  CircularLogReader() noexcept {}
+
+  // Will read from the Reader which is not owned by this CircularLogReader and
+  // must be kept alive but not accessed until closing the CircularLogReader.
+  explicit CircularLogReader(Reader* src, Options options = Options());
+
+  CircularLogReader(CircularLogReader&& src) noexcept;
+  CircularLogReader& operator=(CircularLogReader&& src) noexcept;
+
+  // The capacity of the log and the logical range of its valid data, read from
+  // the log header.
+  //
+  // These can be passed to CircularLogWriter::Options to continue the log.
+  Position capacity() const { return capacity_; }
+  Position begin() const { return begin_; }
+  Position end() const { return end_; }
+
+  bool SupportsRandomAccess() const override { return true; }
+  bool Size(Position* size) const override;
+
+ protected:
+  void Done() override;
+  bool ReadInternal(char* dest, size_t min_length, size_t max_length) override;
+  bool SeekSlow(Position new_pos) override;
+
+ private:
+  // Invariant: if healthy() then src_ != nullptr
+  Reader* src_ = nullptr;
+  Position capacity_ = 0;
+  Position begin_ = 0;
+  Position end_ = 0;
+
+  // Invariant if healthy(): begin_ <= limit_pos_ <= end_
+};
+
+// Implementation details follow.
+
+inline CircularLogWriter::CircularLogWriter(CircularLogWriter&& src) noexcept
+    : BufferedWriter(std::move(src)),
+      dest_(riegeli::exchange(src.dest_, nullptr)),
+      capacity_(riegeli::exchange(src.capacity_, 0)),
+      begin_(riegeli::exchange(src.begin_, 0)),
+      end_(riegeli::exchange(src.end_, 0)) {}
+
+inline CircularLogWriter& CircularLogWriter::operator=(
+    CircularLogWriter&& src) noexcept {
+  BufferedWriter::operator=(std::move(src));
+  dest_ = riegeli::exchange(src.dest_, nullptr);
+  capacity_ = riegeli::exchange(src.capacity_, 0);
+  begin_ = riegeli::exchange(src.begin_, 0);
+  end_ = riegeli::exchange(src.end_, 0);
+  return *this;
+}
+
+inline CircularLogReader::CircularLogReader(CircularLogReader&& src) noexcept
+    : BufferedReader(std::move(src)),
+      src_(riegeli::exchange(src.src_, nullptr)),
+      capacity_(riegeli::exchange(src.capacity_, 0)),
+      begin_(riegeli::exchange(src.begin_, 0)),
+      end_(riegeli::exchange(src.end_, 0)) {}
+
+inline CircularLogReader& CircularLogReader::operator=(
+    CircularLogReader&& src) noexcept {
+  BufferedReader::operator=(std::move(src));
+  src_ = riegeli::exchange(src.src_, nullptr);
+  capacity_ = riegeli::exchange(src.capacity_, 0);
+  begin_ = riegeli::exchange(src.begin_, 0);
+  end_ = riegeli::exchange(src.end_, 0);
+  return *this;
+}
+
+inline bool CircularLogReader::Size(Position* size) const {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  *size = end_;
+  return true;
+}
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_CIRCULAR_LOG_H_
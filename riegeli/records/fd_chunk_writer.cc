@@ -0,0 +1,224 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Make pwrite() available.
+#if !defined(_XOPEN_SOURCE) || _XOPEN_SOURCE < 500
+#undef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 500
+#endif
+
+// Make file offsets 64-bit even on 32-bit systems.
+#undef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+
+#include "riegeli/records/fd_chunk_writer.h"
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <cerrno>
+#include <limits>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/base/parallelism.h"
+#include "riegeli/base/str_error.h"
+#include "riegeli/bytes/writer.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/hash.h"
+#include "riegeli/records/block.h"
+#include "riegeli/records/chunk_writer.h"
+
+namespace riegeli {
+
+FdChunkWriter::FdChunkWriter(int fd, Options options)
+    : ChunkWriter(State::kOpen),
+      fd_(fd),
+      owns_fd_(options.owns_fd_),
+      filename_(absl::StrCat("/proc/self/fd/", fd)),
+      thread_pool_(options.thread_pool_ != nullptr
+                       ? options.thread_pool_
+                       : &internal::DefaultThreadPool()),
+      max_pending_writes_(options.max_pending_writes_) {
+  RIEGELI_ASSERT_GE(fd, 0)
+      << "Failed precondition of FdChunkWriter::FdChunkWriter(int): "
+         "negative file descriptor";
+  RIEGELI_ASSERT(internal::IsPossibleChunkBoundary(options.initial_pos_))
+      << "Failed precondition of FdChunkWriter::FdChunkWriter(int): "
+         "initial position is not a valid chunk boundary";
+  pos_ = options.initial_pos_;
+}
+
+FdChunkWriter::~FdChunkWriter() {
+  // Writes must not outlive the FdChunkWriter even if it was not closed.
+  WaitForWrites();
+  // Done() sets fd_ to -1, so this closes the fd only if Close() was not
+  // called, like FdHolder does for FdWriter.
+  if (owns_fd_ && fd_ >= 0) close(fd_);
+}
+
+void FdChunkWriter::Done() {
+  WaitForWrites();
+  if (ABSL_PREDICT_TRUE(healthy())) CheckWriteError();
+  if (owns_fd_ && fd_ >= 0) {
+    // EINTR from close() leaves the fd closed on Linux, so it is not retried.
+    if (ABSL_PREDICT_FALSE(close(fd_) < 0) && ABSL_PREDICT_TRUE(healthy())) {
+      const int error_code = errno;
+      if (error_code != EINTR) FailOperation("close()", error_code);
+    }
+  }
+  fd_ = -1;
+  // filename_ and error_code_ are not cleared.
+  ChunkWriter::Done();
+}
+
+inline bool FdChunkWriter::FailOperation(absl::string_view operation,
+                                         int error_code) {
+  error_code_ = error_code;
+  return Fail(absl::StrCat(operation, " failed: ", StrError(error_code),
+                           ", writing ", filename_));
+}
+
+bool FdChunkWriter::WriteChunk(const Chunk& chunk) {
+  RIEGELI_ASSERT_EQ(chunk.header.data_hash(), internal::Hash(chunk.data))
+      << "Failed precondition of ChunkWriter::WriteChunk(): "
+         "Wrong chunk data hash";
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  const Position chunk_begin = pos_;
+  // The Chain shares blocks of chunk.data, so chunk may be destroyed while
+  // the write is still in progress.
+  Chain* const framed = new Chain();
+  const Position chunk_end = internal::FrameChunk(chunk, chunk_begin, framed);
+  if (ABSL_PREDICT_FALSE(chunk_end >
+                         Position{std::numeric_limits<off_t>::max()})) {
+    delete framed;
+    return Fail("File position overflow");
+  }
+  int write_error_code;
+  {
+    absl::MutexLock lock(&mutex_);
+    mutex_.Await(absl::Condition(
+        +[](FdChunkWriter* self) {
+          self->mutex_.AssertHeld();
+          return self->pending_writes_ < self->max_pending_writes_ ||
+                 self->write_error_code_ != 0;
+        },
+        this));
+    write_error_code = write_error_code_;
+    if (ABSL_PREDICT_TRUE(write_error_code == 0)) {
+      ++pending_writes_;
+      pending_bytes_ += framed->size();
+    }
+  }
+  if (ABSL_PREDICT_FALSE(write_error_code != 0)) {
+    delete framed;
+    return FailOperation("pwrite()", write_error_code);
+  }
+  thread_pool_->Schedule([this, framed, chunk_begin] {
+    WriteFramed(*framed, chunk_begin);
+    const size_t size = framed->size();
+    delete framed;
+    absl::MutexLock lock(&mutex_);
+    --pending_writes_;
+    pending_bytes_ -= size;
+  });
+  pos_ = chunk_end;
+  return true;
+}
+
+void FdChunkWriter::WriteFramed(const Chain& data, Position pos) {
+  for (const absl::string_view fragment : data.blocks()) {
+    absl::string_view src = fragment;
+    while (!src.empty()) {
+      const ssize_t result = pwrite(
+          fd_, src.data(),
+          UnsignedMin(src.size(), size_t{std::numeric_limits<ssize_t>::max()}),
+          IntCast<off_t>(pos));
+      if (ABSL_PREDICT_FALSE(result < 0)) {
+        const int error_code = errno;
+        if (error_code == EINTR) continue;
+        absl::MutexLock lock(&mutex_);
+        if (write_error_code_ == 0) write_error_code_ = error_code;
+        return;
+      }
+      RIEGELI_ASSERT_GT(result, 0) << "pwrite() returned 0";
+      RIEGELI_ASSERT_LE(IntCast<size_t>(result), src.size())
+          << "pwrite() wrote more than requested";
+      pos += IntCast<size_t>(result);
+      src.remove_prefix(IntCast<size_t>(result));
+    }
+  }
+}
+
+void FdChunkWriter::WaitForWrites() {
+  absl::MutexLock lock(&mutex_);
+  mutex_.Await(absl::Condition(
+      +[](FdChunkWriter* self) {
+        self->mutex_.AssertHeld();
+        return self->pending_writes_ == 0;
+      },
+      this));
+}
+
+inline bool FdChunkWriter::CheckWriteError() {
+  int write_error_code;
+  {
+    absl::MutexLock lock(&mutex_);
+    RIEGELI_ASSERT_EQ(pending_writes_, 0)
+        << "Failed precondition of FdChunkWriter::CheckWriteError(): "
+           "chunks are being written";
+    write_error_code = write_error_code_;
+  }
+  if (ABSL_PREDICT_FALSE(write_error_code != 0)) {
+    return FailOperation("pwrite()", write_error_code);
+  }
+  return true;
+}
+
+bool FdChunkWriter::Flush(FlushType flush_type) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  WaitForWrites();
+  if (ABSL_PREDICT_FALSE(!CheckWriteError())) return false;
+  switch (flush_type) {
+    case FlushType::kFromObject:
+    case FlushType::kFromProcess:
+      return true;
+    case FlushType::kFromMachine:
+      while (ABSL_PREDICT_FALSE(fsync(fd_) < 0)) {
+        const int error_code = errno;
+        if (error_code != EINTR) return FailOperation("fsync()", error_code);
+      }
+      return true;
+  }
+  RIEGELI_ASSERT_UNREACHABLE()
+      << "Unknown flush type: " << static_cast<int>(flush_type);
+}
+
+void FdChunkWriter::AddUniqueTo(MemoryEstimator* memory_estimator) const {
+  ChunkWriter::AddUniqueTo(memory_estimator);
+  memory_estimator->AddMemory(sizeof(FdChunkWriter) - sizeof(ChunkWriter) +
+                              filename_.capacity());
+  absl::MutexLock lock(&mutex_);
+  memory_estimator->AddMemory(pending_bytes_);
+}
+
+}  // namespace riegeli
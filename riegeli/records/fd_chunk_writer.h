@@ -0,0 +1,175 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_FD_CHUNK_WRITER_H_
+#define RIEGELI_RECORDS_FD_CHUNK_WRITER_H_
+
+#include <string>
+#include <utility>
+
+#include "absl/base/attributes.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
+#include "riegeli/bytes/writer.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/records/chunk_writer.h"
+
+namespace riegeli {
+
+class ThreadPool;
+
+// A ChunkWriter which writes chunks to a file descriptor with pwrite(), with
+// several chunks being written concurrently.
+//
+// The position of a chunk in the file depends only on the position and sizes
+// of chunks before it, so WriteChunk() assigns positions in order, but leaves
+// the actual writing to threads of a thread pool. This lifts the limit of a
+// single thread copying all data, which matters for fast storage.
+//
+// Until Flush() or Close(), the file can have holes where chunks are still
+// being written. Flush() waits for all chunks written so far, so that the file
+// has a contiguous prefix of complete chunks.
+//
+// The fd must support pwrite(). Nothing else may write to the fd while the
+// FdChunkWriter is open.
+class FdChunkWriter final : public ChunkWriter {
+ public:
+  class Options {
+   public:
+    // Not defaulted because of a C++ defect:
+    // https://stackoverflow.com/questions/17430377
+    Options() noexcept {}
+
+    // If true, the fd will be owned by the FdChunkWriter and will be closed
+    // when the FdChunkWriter is closed.
+    //
+    // If false, the fd must be kept alive until closing the FdChunkWriter.
+    //
+    // Default: true.
+    Options& set_owns_fd(bool owns_fd) & {
+      owns_fd_ = owns_fd;
+      return *this;
+    }
+    Options&& set_owns_fd(bool owns_fd) && {
+      return std::move(set_owns_fd(owns_fd));
+    }
+
+    // The position in the file where the first chunk is written, e.g. the
+    // size of an existing file being appended to. It must be a valid chunk
+    // boundary.
+    //
+    // Default: 0.
+    Options& set_initial_pos(Position initial_pos) & {
+      initial_pos_ = initial_pos;
+      return *this;
+    }
+    Options&& set_initial_pos(Position initial_pos) && {
+      return std::move(set_initial_pos(initial_pos));
+    }
+
+    // Specifies the thread pool used for writing. The thread pool must be kept
+    // alive until the FdChunkWriter is closed.
+    //
+    // If nullptr, a thread pool shared by the process is used.
+    //
+    // Default: nullptr.
+    Options& set_thread_pool(ThreadPool* thread_pool) & {
+      thread_pool_ = thread_pool;
+      return *this;
+    }
+    Options&& set_thread_pool(ThreadPool* thread_pool) && {
+      return std::move(set_thread_pool(thread_pool));
+    }
+
+    // The maximal number of chunks being written concurrently. WriteChunk()
+    // waits if this is reached, which also bounds the memory held by chunks
+    // being written.
+    //
+    // Default: 16.
+    Options& set_max_pending_writes(int max_pending_writes) & {
+      RIEGELI_ASSERT_GT(max_pending_writes, 0)
+          << "Failed precondition of "
+             "FdChunkWriter::Options::set_max_pending_writes(): "
+             "number of writes not positive";
+      max_pending_writes_ = max_pending_writes;
+      return *this;
+    }
+    Options&& set_max_pending_writes(int max_pending_writes) && {
+      return std::move(set_max_pending_writes(max_pending_writes));
+    }
+
+   private:
+    friend class FdChunkWriter;
+
+    bool owns_fd_ = true;
+    Position initial_pos_ = 0;
+    ThreadPool* thread_pool_ = nullptr;
+    int max_pending_writes_ = 16;
+  };
+
+  // Will write chunks to fd.
+  explicit FdChunkWriter(int fd, Options options = Options());
+
+  FdChunkWriter(const FdChunkWriter&) = delete;
+  FdChunkWriter& operator=(const FdChunkWriter&) = delete;
+
+  ~FdChunkWriter();
+
+  bool WriteChunk(const Chunk& chunk) override;
+  bool Flush(FlushType flush_type) override;
+
+  const std::string& filename() const { return filename_; }
+  int error_code() const { return error_code_; }
+
+  void AddUniqueTo(MemoryEstimator* memory_estimator) const override;
+
+ protected:
+  void Done() override;
+
+ private:
+  // Writes data at pos. Called from a thread of the thread pool.
+  void WriteFramed(const Chain& data, Position pos);
+  // Waits until no chunks are being written.
+  void WaitForWrites();
+  // Propagates a failure reported by a write to this FdChunkWriter.
+  //
+  // Precondition: no chunks are being written
+  bool CheckWriteError();
+  ABSL_ATTRIBUTE_COLD bool FailOperation(absl::string_view operation,
+                                         int error_code);
+
+  int fd_;
+  bool owns_fd_;
+  std::string filename_;
+  ThreadPool* thread_pool_;
+  int max_pending_writes_;
+  // errno value from a failed operation, or 0 if none.
+  //
+  // Invariant: if healthy() then error_code_ == 0
+  int error_code_ = 0;
+
+  mutable absl::Mutex mutex_;
+  int pending_writes_ GUARDED_BY(mutex_) = 0;
+  Position pending_bytes_ GUARDED_BY(mutex_) = 0;
+  // errno value from the first failed write, or 0 if none.
+  int write_error_code_ GUARDED_BY(mutex_) = 0;
+};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_FD_CHUNK_WRITER_H_
@@ -0,0 +1,155 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/field_aggregator.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/chunk_encoding/field_filter.h"
+#include "riegeli/chunk_encoding/field_projection.h"
+#include "riegeli/records/record_position.h"
+#include "riegeli/records/record_reader.h"
+
+namespace riegeli {
+
+FieldAggregator::FieldAggregator(NumericType numeric_type,
+                                 std::vector<double> histogram_boundaries)
+    : numeric_type_(numeric_type),
+      histogram_boundaries_(std::move(histogram_boundaries)) {
+  RIEGELI_ASSERT(std::is_sorted(histogram_boundaries_.begin(),
+                                histogram_boundaries_.end()))
+      << "Failed precondition of FieldAggregator::FieldAggregator(): "
+         "histogram boundaries not sorted";
+  if (!histogram_boundaries_.empty()) {
+    histogram_.resize(histogram_boundaries_.size() + 1);
+  }
+}
+
+void FieldAggregator::Clear() {
+  count_ = 0;
+  sum_ = 0.0;
+  min_ = std::numeric_limits<double>::infinity();
+  max_ = -std::numeric_limits<double>::infinity();
+  std::fill(histogram_.begin(), histogram_.end(), uint64_t{0});
+}
+
+inline double FieldAggregator::Interpret(uint64_t raw) const {
+  switch (numeric_type_) {
+    case NumericType::kInt32:
+      return static_cast<double>(
+          static_cast<int32_t>(static_cast<uint32_t>(raw)));
+    case NumericType::kInt64:
+      return static_cast<double>(static_cast<int64_t>(raw));
+    case NumericType::kUint64:
+      return static_cast<double>(raw);
+    case NumericType::kSint64:
+      return static_cast<double>(static_cast<int64_t>(raw >> 1) ^
+                                 -static_cast<int64_t>(raw & 1));
+    case NumericType::kFloat: {
+      const uint32_t bits = static_cast<uint32_t>(raw);
+      float value;
+      std::memcpy(&value, &bits, sizeof(value));
+      return value;
+    }
+    case NumericType::kDouble: {
+      double value;
+      std::memcpy(&value, &raw, sizeof(value));
+      return value;
+    }
+  }
+  RIEGELI_ASSERT_UNREACHABLE()
+      << "Unknown numeric type: " << static_cast<int>(numeric_type_);
+}
+
+void FieldAggregator::Add(const FieldColumn& column) {
+  for (const uint64_t raw : column.numbers) AddRaw(raw);
+}
+
+void FieldAggregator::AddRaw(uint64_t raw) { Add(Interpret(raw)); }
+
+void FieldAggregator::Add(double value) {
+  ++count_;
+  sum_ += value;
+  min_ = std::min(min_, value);
+  max_ = std::max(max_, value);
+  if (!histogram_.empty()) {
+    const size_t bucket = IntCast<size_t>(
+        std::upper_bound(histogram_boundaries_.begin(),
+                         histogram_boundaries_.end(), value) -
+        histogram_boundaries_.begin());
+    ++histogram_[bucket];
+  }
+}
+
+void FieldAggregator::Merge(const FieldAggregator& other) {
+  RIEGELI_ASSERT(histogram_boundaries_ == other.histogram_boundaries_)
+      << "Failed precondition of FieldAggregator::Merge(): "
+         "different histogram boundaries";
+  count_ += other.count_;
+  sum_ += other.sum_;
+  min_ = std::min(min_, other.min_);
+  max_ = std::max(max_, other.max_);
+  for (size_t i = 0; i < histogram_.size(); ++i) {
+    histogram_[i] += other.histogram_[i];
+  }
+}
+
+bool AggregateField(RecordReader* record_reader, const Field& field,
+                    FieldAggregator* aggregator,
+                    std::vector<FieldAggregator>* chunk_aggregates) {
+  std::vector<absl::string_view> records;
+  FieldColumn column;
+  // A batch is taken from a single chunk, but a chunk can span several batches,
+  // e.g. if it is read in sub-blocks. Batches are grouped by chunk_begin.
+  FieldAggregator chunk_aggregator = *aggregator;
+  chunk_aggregator.Clear();
+  bool has_chunk = false;
+  uint64_t chunk_begin = 0;
+  RecordPosition first_key;
+  while (record_reader->ReadRecords(std::numeric_limits<size_t>::max(),
+                                    &records, &first_key)) {
+    column.Clear();
+    if (ABSL_PREDICT_FALSE(!ProjectField(field, records, &column))) {
+      return false;
+    }
+    if (chunk_aggregates == nullptr) {
+      aggregator->Add(column);
+      continue;
+    }
+    if (has_chunk && first_key.chunk_begin() != chunk_begin) {
+      aggregator->Merge(chunk_aggregator);
+      chunk_aggregates->push_back(chunk_aggregator);
+      chunk_aggregator.Clear();
+    }
+    has_chunk = true;
+    chunk_begin = first_key.chunk_begin();
+    chunk_aggregator.Add(column);
+  }
+  if (has_chunk) {
+    aggregator->Merge(chunk_aggregator);
+    chunk_aggregates->push_back(std::move(chunk_aggregator));
+  }
+  return record_reader->healthy();
+}
+
+}  // namespace riegeli
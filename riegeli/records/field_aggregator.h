@@ -0,0 +1,128 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_FIELD_AGGREGATOR_H_
+#define RIEGELI_RECORDS_FIELD_AGGREGATOR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <limits>
+#include <vector>
+
+#include "riegeli/chunk_encoding/field_filter.h"
+#include "riegeli/chunk_encoding/field_projection.h"
+#include "riegeli/records/record_reader.h"
+
+namespace riegeli {
+
+// FieldAggregator computes count, sum, minimum, maximum, and optionally a
+// histogram of values of a numeric proto field.
+//
+// Values are taken from a FieldColumn (see ProjectField()), or directly from a
+// RecordReader by AggregateField().
+class FieldAggregator {
+ public:
+  // How to interpret raw numbers of a FieldColumn.
+  enum class NumericType {
+    kInt32,   // int32, sfixed32, enum
+    kInt64,   // int64, sfixed64
+    kUint64,  // uint32, uint64, fixed32, fixed64, bool
+    kSint64,  // sint32, sint64 (zigzag encoded)
+    kFloat,   // float
+    kDouble,  // double
+  };
+
+  // Creates an empty FieldAggregator.
+  //
+  // If histogram_boundaries is not empty, values are counted in
+  // histogram_boundaries.size() + 1 buckets: bucket i counts values v with
+  // histogram_boundaries[i - 1] <= v < histogram_boundaries[i], where missing
+  // boundaries are infinite.
+  //
+  // Precondition: histogram_boundaries are sorted
+  explicit FieldAggregator(NumericType numeric_type,
+                           std::vector<double> histogram_boundaries = {});
+
+  FieldAggregator(const FieldAggregator&) = default;
+  FieldAggregator& operator=(const FieldAggregator&) = default;
+
+  // Resets aggregates to no values, keeping numeric type and histogram
+  // boundaries.
+  void Clear();
+
+  // Adds all numbers of column.
+  void Add(const FieldColumn& column);
+
+  // Adds a raw number as stored in FieldColumn::numbers.
+  void AddRaw(uint64_t raw);
+
+  // Adds a value.
+  void Add(double value);
+
+  // Adds aggregates of other, which must have the same histogram boundaries.
+  void Merge(const FieldAggregator& other);
+
+  // Returns the number of values.
+  uint64_t count() const { return count_; }
+  // Returns the sum of values.
+  double sum() const { return sum_; }
+  // Returns the minimum value, or +infinity if count() == 0.
+  double min() const { return min_; }
+  // Returns the maximum value, or -infinity if count() == 0.
+  double max() const { return max_; }
+
+  // Returns bucket boundaries given to the constructor.
+  const std::vector<double>& histogram_boundaries() const {
+    return histogram_boundaries_;
+  }
+  // Returns counts of values in each bucket, or an empty vector if
+  // histogram_boundaries() is empty.
+  const std::vector<uint64_t>& histogram() const { return histogram_; }
+
+ private:
+  double Interpret(uint64_t raw) const;
+
+  NumericType numeric_type_;
+  std::vector<double> histogram_boundaries_;
+  uint64_t count_ = 0;
+  double sum_ = 0.0;
+  double min_ = std::numeric_limits<double>::infinity();
+  double max_ = -std::numeric_limits<double>::infinity();
+  std::vector<uint64_t> histogram_;
+};
+
+// Reads the remaining records from record_reader and adds values of field to
+// *aggregator, without parsing records to proto messages.
+//
+// For records written with RecordWriter::Options::set_transpose(true), only
+// buckets containing the field are decompressed if record_reader was created
+// with RecordReader::Options::set_field_filter() including the field.
+//
+// If chunk_aggregates != nullptr, aggregates of each chunk are also appended to
+// *chunk_aggregates.
+//
+// Values of packed repeated fields are not aggregated, because ProjectField()
+// returns them as strings.
+//
+// Return values:
+//  * true  - success (source ends)
+//  * false - failure (!record_reader->healthy(), or a record is not a valid
+//            serialized proto message)
+bool AggregateField(RecordReader* record_reader, const Field& field,
+                    FieldAggregator* aggregator,
+                    std::vector<FieldAggregator>* chunk_aggregates = nullptr);
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_FIELD_AGGREGATOR_H_
@@ -0,0 +1,82 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/file_summary.h"
+
+#include <stdint.h>
+#include <string>
+
+#include "absl/base/optimization.h"
+#include "riegeli/base/base.h"
+#include "riegeli/bytes/chain_reader.h"
+#include "riegeli/bytes/chain_writer.h"
+#include "riegeli/bytes/reader_utils.h"
+#include "riegeli/bytes/writer_utils.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/types.h"
+
+namespace riegeli {
+
+void FileSummary::AddChunk(const ChunkHeader& header) {
+  num_records += header.num_records();
+  decoded_data_size += header.decoded_data_size();
+  ++num_chunks;
+}
+
+// The format of a summary chunk, after the chunk type:
+//  * num_records (varint64)
+//  * decoded_data_size (varint64)
+//  * num_chunks (varint64)
+//  * size of writer_options (varint64)
+//  * writer_options (bytes)
+void FileSummary::EncodeToChunk(Chunk* chunk) const {
+  chunk->data.Clear();
+  ChainWriter data_writer(&chunk->data);
+  WriteByte(&data_writer, static_cast<uint8_t>(ChunkType::kSummary));
+  WriteVarint64(&data_writer, num_records);
+  WriteVarint64(&data_writer, decoded_data_size);
+  WriteVarint64(&data_writer, num_chunks);
+  WriteVarint64(&data_writer, IntCast<uint64_t>(writer_options.size()));
+  data_writer.Write(writer_options);
+  if (!data_writer.Close()) {
+    RIEGELI_ASSERT_UNREACHABLE()
+        << "Writing file summary failed: " << data_writer.message();
+  }
+  chunk->header = ChunkHeader(chunk->data, 0, 0);
+}
+
+bool FileSummary::DecodeFromChunk(const Chunk& chunk) {
+  *this = FileSummary();
+  if (ABSL_PREDICT_FALSE(chunk.header.num_records() != 0)) return false;
+  ChainReader data_reader(&chunk.data);
+  uint8_t chunk_type_byte;
+  uint64_t writer_options_size;
+  if (ABSL_PREDICT_FALSE(
+          !ReadByte(&data_reader, &chunk_type_byte) ||
+          static_cast<ChunkType>(chunk_type_byte) != ChunkType::kSummary ||
+          !ReadVarint64(&data_reader, &num_records) ||
+          !ReadVarint64(&data_reader, &decoded_data_size) ||
+          !ReadVarint64(&data_reader, &num_chunks) ||
+          !ReadVarint64(&data_reader, &writer_options_size) ||
+          writer_options_size > chunk.data.size() ||
+          !data_reader.Read(&writer_options,
+                            IntCast<size_t>(writer_options_size)) ||
+          !data_reader.VerifyEndAndClose())) {
+    *this = FileSummary();
+    return false;
+  }
+  return true;
+}
+
+}  // namespace riegeli
@@ -0,0 +1,60 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_FILE_SUMMARY_H_
+#define RIEGELI_RECORDS_FILE_SUMMARY_H_
+
+#include <stdint.h>
+#include <string>
+
+#include "riegeli/chunk_encoding/chunk.h"
+
+namespace riegeli {
+
+// FileSummary holds totals of a Riegeli/records file, so that the number of
+// records and their size can be known without reading chunk headers.
+//
+// RecordWriter with Options::set_file_summary(true) writes the summary as the
+// last chunk of the file, and RecordReader::ReadFileSummary() reads it. This
+// costs one seek and a small read.
+struct FileSummary {
+  // Adds a chunk to the totals.
+  void AddChunk(const ChunkHeader& header);
+
+  // Encodes the summary as a summary chunk.
+  void EncodeToChunk(Chunk* chunk) const;
+
+  // Decodes the summary from a summary chunk, replacing the current contents.
+  //
+  // Return values:
+  //  * true  - success
+  //  * false - chunk is not a valid summary chunk (the summary is cleared)
+  bool DecodeFromChunk(const Chunk& chunk);
+
+  // The number of records in the file.
+  uint64_t num_records = 0;
+  // The sum of record sizes in the file.
+  uint64_t decoded_data_size = 0;
+  // The number of chunks written by RecordWriter, excluding the file
+  // signature, the chunk index, and the summary itself.
+  uint64_t num_chunks = 0;
+  // Options of the RecordWriter which wrote the file, in the syntax of
+  // RecordWriter::Options::Parse(). Options which cannot be expressed there,
+  // e.g. functions, are omitted.
+  std::string writer_options;
+};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_FILE_SUMMARY_H_
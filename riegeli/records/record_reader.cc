@@ -14,50 +14,142 @@
 
 #include "riegeli/records/record_reader.h"
 
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <limits>
 #include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 
+#include "google/protobuf/arena.h"
 #include "google/protobuf/message_lite.h"
 #include "absl/base/optimization.h"
 #include "absl/memory/memory.h"
 #include "absl/strings/string_view.h"
+#include "absl/types/span.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
+#include "riegeli/base/parallelism.h"
+#include "riegeli/bytes/chain_reader.h"
+#include "riegeli/bytes/message_parse.h"
 #include "riegeli/bytes/reader.h"
 #include "riegeli/chunk_encoding/chunk.h"
 #include "riegeli/chunk_encoding/chunk_decoder.h"
+#include "riegeli/chunk_encoding/record_limits.h"
+#include "riegeli/records/block.h"
+#include "riegeli/records/chunk_index.h"
 #include "riegeli/records/chunk_reader.h"
+#include "riegeli/records/file_summary.h"
 #include "riegeli/records/record_position.h"
+#include "riegeli/records/record_stats.h"
 
 namespace riegeli {
 
+namespace {
+
+// Everything needed by a background task decoding a chunk. Owned by the task.
+struct ChunkToDecode {
+  ChunkDecoder::Options chunk_decoder_options;
+  RecordStats* stats;
+  RecordTracer* tracer;
+  Position chunk_begin;
+  Chunk chunk;
+  std::promise<ChunkDecoder> chunk_decoder;
+  // If not nullptr, records are parsed too.
+  const google::protobuf::MessageLite* parse_prototype = nullptr;
+  std::promise<std::vector<std::unique_ptr<google::protobuf::MessageLite>>>
+      parsed_records;
+};
+
+// Waits until chunks being decoded for Search() are ready. Background tasks
+// use objects owned by the caller of RecordReader, so they must not outlive
+// the search.
+void WaitForProbes(
+    const std::vector<std::future<ChunkDecoder>>& chunk_decoders) {
+  for (const std::future<ChunkDecoder>& chunk_decoder : chunk_decoders) {
+    chunk_decoder.wait();
+  }
+}
+
+}  // namespace
+
+std::string RecordReaderCheckpoint::Serialize() const {
+  std::string serialized = pos_.Serialize();
+  serialized.push_back(file_signature_verified_ ? '\1' : '\0');
+  return serialized;
+}
+
+bool RecordReaderCheckpoint::Parse(absl::string_view serialized) {
+  if (ABSL_PREDICT_FALSE(serialized.empty())) return false;
+  const char flags = serialized.back();
+  serialized.remove_suffix(1);
+  if (ABSL_PREDICT_FALSE(flags != '\0' && flags != '\1')) return false;
+  RecordPosition pos;
+  if (ABSL_PREDICT_FALSE(!pos.Parse(serialized))) return false;
+  pos_ = pos;
+  file_signature_verified_ = flags == '\1';
+  return true;
+}
+
 RecordReader::RecordReader() noexcept : Object(State::kClosed) {}
 
 RecordReader::RecordReader(std::unique_ptr<Reader> byte_reader, Options options)
     : RecordReader(
           absl::make_unique<ChunkReader>(
               std::move(byte_reader),
-              ChunkReader::Options().set_skip_errors(options.skip_errors_)),
-          std::move(options)) {}
+              ChunkReader::Options()
+                  .set_skip_errors(options.skip_errors_)
+                  .set_verify_data_hashes(options.verify_data_hashes_)),
+          std::move(options), ChunkDecoder()) {}
 
 RecordReader::RecordReader(Reader* byte_reader, Options options)
-    : RecordReader(absl::make_unique<ChunkReader>(
-                       byte_reader, ChunkReader::Options().set_skip_errors(
-                                        options.skip_errors_)),
-                   std::move(options)) {}
+    : RecordReader(
+          absl::make_unique<ChunkReader>(
+              byte_reader,
+              ChunkReader::Options()
+                  .set_skip_errors(options.skip_errors_)
+                  .set_verify_data_hashes(options.verify_data_hashes_)),
+          std::move(options), ChunkDecoder()) {}
 
 inline RecordReader::RecordReader(std::unique_ptr<ChunkReader> chunk_reader,
-                                  Options options)
+                                  Options options, ChunkDecoder chunk_decoder)
     : Object(State::kOpen),
       chunk_reader_(std::move(chunk_reader)),
       skip_errors_(options.skip_errors_),
+      verify_data_hashes_(options.verify_data_hashes_),
+      parallelism_(options.parallelism_),
+      thread_pool_(options.thread_pool_),
+      parse_prototype_(options.parse_prototype_),
+      chunk_cache_(options.field_filter_.include_all() ? options.chunk_cache_
+                                                       : nullptr),
+      chunk_cache_file_id_(std::move(options.chunk_cache_file_id_)),
+      chunk_decoder_options_(
+          ChunkDecoder::Options()
+              .set_skip_errors(options.skip_errors_)
+              .set_field_filter(std::move(options.field_filter_))
+              .set_zstd_dictionaries(options.zstd_dictionaries_)
+              .set_verify_data_on_failure(!options.verify_data_hashes_)
+              .set_parallelism(options.decompression_parallelism_)
+              .set_streaming_block_size(options.streaming_block_size_)
+              .set_flat_values(options.flat_values_)
+              .set_bucket_cache(options.bucket_cache_)),
+      stats_(options.stats_),
+      tracer_(options.tracer_),
+      chunk_filter_(std::move(options.chunk_filter_)),
+      tail_wait_(std::move(options.tail_wait_)),
+      file_signature_verified_(options.has_checkpoint_ &&
+                               options.checkpoint_.file_signature_verified()),
       chunk_begin_(chunk_reader_->pos()),
-      chunk_decoder_(ChunkDecoder::Options()
-                         .set_skip_errors(options.skip_errors_)
-                         .set_field_filter(std::move(options.field_filter_))) {
-  if (chunk_begin_ == 0 && !skip_errors_) {
+      chunk_end_(chunk_begin_),
+      chunk_decoder_(std::move(chunk_decoder)) {
+  chunk_decoder_.Reset(chunk_decoder_options_);
+  if (chunk_begin_ == 0 && !skip_errors_ && !file_signature_verified_) {
     // Verify file signature before any records are read, done proactively here
     // in case the caller calls Seek() before ReadRecord(). This is not done if
     // skip_errors_ is true because in this case invalid file beginning would
@@ -65,38 +157,171 @@ inline RecordReader::RecordReader(std::unique_ptr<ChunkReader> chunk_reader,
     // intended.
     ReadChunk();
   }
+  if (options.has_checkpoint_) Seek(options.checkpoint_.pos());
+}
+
+inline RecordReader::RecordReader(std::unique_ptr<ChunkReader> chunk_reader,
+                                  const RecordReader& src)
+    : Object(State::kOpen),
+      chunk_reader_(std::move(chunk_reader)),
+      skip_errors_(src.skip_errors_),
+      verify_data_hashes_(src.verify_data_hashes_),
+      parallelism_(src.parallelism_),
+      thread_pool_(src.thread_pool_),
+      parse_prototype_(src.parse_prototype_),
+      chunk_cache_(src.chunk_cache_),
+      chunk_cache_file_id_(src.chunk_cache_file_id_),
+      chunk_decoder_options_(src.chunk_decoder_options_),
+      stats_(src.stats_),
+      tracer_(src.tracer_),
+      chunk_filter_(src.chunk_filter_),
+      tail_wait_(src.tail_wait_),
+      file_signature_verified_(src.file_signature_verified_),
+      chunk_begin_(chunk_reader_->pos()),
+      chunk_end_(chunk_begin_),
+      chunk_decoder_(chunk_decoder_options_),
+      chunk_index_(src.chunk_index_),
+      chunk_index_begin_(src.chunk_index_begin_),
+      range_end_(src.range_end_) {
+  if (ABSL_PREDICT_FALSE(!src.healthy())) {
+    Fail(src);
+    return;
+  }
+  Seek(src.pos());
 }
 
 RecordReader::RecordReader(RecordReader&& src) noexcept
     : Object(std::move(src)),
       chunk_reader_(std::move(src.chunk_reader_)),
       skip_errors_(riegeli::exchange(src.skip_errors_, false)),
+      verify_data_hashes_(riegeli::exchange(src.verify_data_hashes_, true)),
+      parallelism_(riegeli::exchange(src.parallelism_, 0)),
+      thread_pool_(riegeli::exchange(src.thread_pool_, nullptr)),
+      parse_prototype_(riegeli::exchange(src.parse_prototype_, nullptr)),
+      chunk_cache_(riegeli::exchange(src.chunk_cache_, nullptr)),
+      chunk_cache_file_id_(
+          riegeli::exchange(src.chunk_cache_file_id_, std::string())),
+      chunk_decoder_options_(std::move(src.chunk_decoder_options_)),
+      stats_(riegeli::exchange(src.stats_, nullptr)),
+      tracer_(riegeli::exchange(src.tracer_, nullptr)),
+      chunk_filter_(std::move(src.chunk_filter_)),
+      tail_wait_(std::move(src.tail_wait_)),
+      file_signature_verified_(
+          riegeli::exchange(src.file_signature_verified_, false)),
       chunk_begin_(riegeli::exchange(src.chunk_begin_, 0)),
+      chunk_end_(riegeli::exchange(src.chunk_end_, 0)),
       chunk_decoder_(std::move(src.chunk_decoder_)),
+      decoding_chunks_(std::move(src.decoding_chunks_)),
+      parsed_chunk_begin_(riegeli::exchange(src.parsed_chunk_begin_, 0)),
+      parsed_records_(std::move(src.parsed_records_)),
+      chunk_index_(std::move(src.chunk_index_)),
+      chunk_index_begin_(riegeli::exchange(src.chunk_index_begin_, 0)),
+      range_end_(riegeli::exchange(src.range_end_,
+                                   std::numeric_limits<Position>::max())),
       skipped_bytes_(riegeli::exchange(src.skipped_bytes_, 0)) {}
 
 RecordReader& RecordReader::operator=(RecordReader&& src) noexcept {
   Object::operator=(std::move(src));
   chunk_reader_ = std::move(src.chunk_reader_);
   skip_errors_ = riegeli::exchange(src.skip_errors_, false);
+  verify_data_hashes_ = riegeli::exchange(src.verify_data_hashes_, true);
+  parallelism_ = riegeli::exchange(src.parallelism_, 0);
+  thread_pool_ = riegeli::exchange(src.thread_pool_, nullptr);
+  parse_prototype_ = riegeli::exchange(src.parse_prototype_, nullptr);
+  chunk_cache_ = riegeli::exchange(src.chunk_cache_, nullptr);
+  chunk_cache_file_id_ =
+      riegeli::exchange(src.chunk_cache_file_id_, std::string());
+  chunk_decoder_options_ = std::move(src.chunk_decoder_options_);
+  stats_ = riegeli::exchange(src.stats_, nullptr);
+  tracer_ = riegeli::exchange(src.tracer_, nullptr);
+  chunk_filter_ = std::move(src.chunk_filter_);
+  tail_wait_ = std::move(src.tail_wait_);
+  file_signature_verified_ =
+      riegeli::exchange(src.file_signature_verified_, false);
   chunk_begin_ = riegeli::exchange(src.chunk_begin_, 0);
+  chunk_end_ = riegeli::exchange(src.chunk_end_, 0);
   chunk_decoder_ = std::move(src.chunk_decoder_);
+  DiscardDecodingChunks();
+  decoding_chunks_ = std::move(src.decoding_chunks_);
+  parsed_chunk_begin_ = riegeli::exchange(src.parsed_chunk_begin_, 0);
+  parsed_records_ = std::move(src.parsed_records_);
+  chunk_index_ = std::move(src.chunk_index_);
+  chunk_index_begin_ = riegeli::exchange(src.chunk_index_begin_, 0);
+  range_end_ =
+      riegeli::exchange(src.range_end_, std::numeric_limits<Position>::max());
   skipped_bytes_ = riegeli::exchange(src.skipped_bytes_, 0);
+  // A record being read incrementally refers to this RecordReader, and cannot
+  // be moved.
+  record_stream_.reset();
   return *this;
 }
 
+bool RecordReader::Reset(std::unique_ptr<Reader> byte_reader,
+                         Options options) {
+  // Done() would free the chunk decoder, so it is taken out beforehand.
+  ChunkDecoder chunk_decoder = std::move(chunk_decoder_);
+  if (!closed() && ABSL_PREDICT_FALSE(!Close())) return false;
+  std::unique_ptr<ChunkReader> chunk_reader = absl::make_unique<ChunkReader>(
+      std::move(byte_reader),
+      ChunkReader::Options()
+          .set_skip_errors(options.skip_errors_)
+          .set_verify_data_hashes(options.verify_data_hashes_));
+  *this = RecordReader(std::move(chunk_reader), std::move(options),
+                       std::move(chunk_decoder));
+  return true;
+}
+
+bool RecordReader::Reset(Reader* byte_reader, Options options) {
+  // Done() would free the chunk decoder, so it is taken out beforehand.
+  ChunkDecoder chunk_decoder = std::move(chunk_decoder_);
+  if (!closed() && ABSL_PREDICT_FALSE(!Close())) return false;
+  std::unique_ptr<ChunkReader> chunk_reader = absl::make_unique<ChunkReader>(
+      byte_reader,
+      ChunkReader::Options()
+          .set_skip_errors(options.skip_errors_)
+          .set_verify_data_hashes(options.verify_data_hashes_));
+  *this = RecordReader(std::move(chunk_reader), std::move(options),
+                       std::move(chunk_decoder));
+  return true;
+}
+
 void RecordReader::Done() {
   if (chunk_reader_ != nullptr) {
     if (ABSL_PREDICT_FALSE(!chunk_reader_->Close())) Fail(*chunk_reader_);
     // Do not reset chunk_reader_ so that skipped_bytes() remains
     // available.
   }
+  if (stats_ != nullptr) {
+    RecordStats::Add(&stats_->skipped_bytes_, skipped_bytes());
+    stats_ = nullptr;
+  }
+  tracer_ = nullptr;
   skip_errors_ = false;
+  verify_data_hashes_ = true;
+  parallelism_ = 0;
+  thread_pool_ = nullptr;
+  parse_prototype_ = nullptr;
+  chunk_cache_ = nullptr;
+  chunk_cache_file_id_ = std::string();
+  chunk_decoder_options_ = ChunkDecoder::Options();
+  chunk_filter_ = nullptr;
+  tail_wait_ = nullptr;
+  file_signature_verified_ = false;
   chunk_begin_ = 0;
+  chunk_end_ = 0;
   chunk_decoder_ = ChunkDecoder();
+  DiscardDecodingChunks();
+  record_stream_.reset();
+  parsed_chunk_begin_ = 0;
+  parsed_records_ =
+      std::vector<std::unique_ptr<google::protobuf::MessageLite>>();
+  chunk_index_.reset();
+  chunk_index_begin_ = 0;
+  range_end_ = std::numeric_limits<Position>::max();
 }
 
 bool RecordReader::ReadRecordSlow(google::protobuf::MessageLite* record,
+                                  AliasedFields* aliased_fields,
                                   RecordPosition* key, uint64_t index_before) {
   RIEGELI_ASSERT_EQ(chunk_decoder_.index(), chunk_decoder_.num_records())
       << "Failed precondition of RecordReader::ReadRecordSlow(): "
@@ -115,9 +340,9 @@ bool RecordReader::ReadRecordSlow(google::protobuf::MessageLite* record,
       if (ABSL_PREDICT_FALSE(chunk_decoder_.index() > index_before)) {
         // Last records of the chunk were skipped. In skipped_bytes_, account
         // for them as the rest of the chunk size.
-        RIEGELI_ASSERT_GE(chunk_reader_->pos(), chunk_begin_)
+        RIEGELI_ASSERT_GE(chunk_end_, chunk_begin_)
             << "Failed invariant of RecordReader: negative chunk size";
-        const Position chunk_size = chunk_reader_->pos() - chunk_begin_;
+        const Position chunk_size = chunk_end_ - chunk_begin_;
         RIEGELI_ASSERT_LE(chunk_decoder_.index(), chunk_size)
             << "Failed invariant of RecordReader: "
                "number of records greater than chunk size";
@@ -125,9 +350,10 @@ bool RecordReader::ReadRecordSlow(google::protobuf::MessageLite* record,
             SaturatingAdd(skipped_bytes_, chunk_size - index_before);
       }
     }
-    if (ABSL_PREDICT_FALSE(!ReadChunk())) return false;
+    if (ABSL_PREDICT_FALSE(!ReadNextChunk())) return false;
     index_before = chunk_decoder_.index();
-    if (ABSL_PREDICT_TRUE(chunk_decoder_.ReadRecord(record))) {
+    if (ABSL_PREDICT_TRUE(
+            chunk_decoder_.ReadRecordAliasing(record, aliased_fields))) {
       RIEGELI_ASSERT_GT(chunk_decoder_.index(), index_before)
           << "ChunkDecoder::ReadRecord() did not increment record index";
       if (key != nullptr) {
@@ -152,10 +378,14 @@ bool RecordReader::ReadRecordSlow(Record* record, RecordPosition* key) {
          "records available, use ReadRecord() instead";
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
   for (;;) {
-    RIEGELI_ASSERT(chunk_decoder_.healthy())
-        << "ChunkDecoder::ReadRecord() made ChunkDecoder unhealthy "
-           "but record was not being parsed to a proto message";
-    if (ABSL_PREDICT_FALSE(!ReadChunk())) return false;
+    if (ABSL_PREDICT_FALSE(!chunk_decoder_.healthy())) {
+      // A block of record values could not be decompressed.
+      RIEGELI_ASSERT(!skip_errors_)
+          << "ChunkDecoder::ReadRecord() made ChunkDecoder unhealthy "
+             "but skip_errors is true";
+      return Fail(chunk_decoder_);
+    }
+    if (ABSL_PREDICT_FALSE(!ReadNextChunk())) return false;
     if (ABSL_PREDICT_TRUE(chunk_decoder_.ReadRecord(record))) {
       if (key != nullptr) {
         RIEGELI_ASSERT_GT(chunk_decoder_.index(), 0u)
@@ -172,35 +402,226 @@ template bool RecordReader::ReadRecordSlow(absl::string_view* record,
 template bool RecordReader::ReadRecordSlow(std::string* record, RecordPosition* key);
 template bool RecordReader::ReadRecordSlow(Chain* record, RecordPosition* key);
 
+bool RecordReader::ReadRecord(const google::protobuf::MessageLite& prototype,
+                              google::protobuf::Arena* arena,
+                              google::protobuf::MessageLite** record,
+                              RecordPosition* key) {
+  std::unique_ptr<google::protobuf::MessageLite> owned_message;
+  google::protobuf::MessageLite* const message = prototype.New(arena);
+  if (arena == nullptr) owned_message.reset(message);
+  if (ABSL_PREDICT_FALSE(!ReadRecord(message, key))) return false;
+  owned_message.release();
+  *record = message;
+  return true;
+}
+
+bool RecordReader::ReadRecord(
+    std::unique_ptr<google::protobuf::MessageLite>* record,
+    RecordPosition* key) {
+  RIEGELI_ASSERT(parse_prototype_ != nullptr)
+      << "Failed precondition of "
+         "RecordReader::ReadRecord(unique_ptr<MessageLite>*): "
+         "no parse prototype";
+  for (;;) {
+    const uint64_t index = chunk_decoder_.index();
+    if (index < chunk_decoder_.num_records()) {
+      if (parsed_chunk_begin_ == chunk_begin_ &&
+          index < parsed_records_.size() &&
+          parsed_records_[IntCast<size_t>(index)] != nullptr) {
+        *record = std::move(parsed_records_[IntCast<size_t>(index)]);
+        chunk_decoder_.SetIndex(index + 1);
+        if (key != nullptr) *key = RecordPosition(chunk_begin_, index);
+        return true;
+      }
+      break;
+    }
+    // Read the next chunk here rather than in ReadRecordSlow(), so that its
+    // first record can be taken from parsed_records_ too.
+    if (ABSL_PREDICT_FALSE(!healthy())) return false;
+    if (ABSL_PREDICT_FALSE(!chunk_decoder_.healthy())) {
+      return Fail(chunk_decoder_);
+    }
+    if (ABSL_PREDICT_FALSE(!ReadNextChunk())) return false;
+  }
+  std::unique_ptr<google::protobuf::MessageLite> message(
+      parse_prototype_->New());
+  if (ABSL_PREDICT_FALSE(!ReadRecord(message.get(), key))) return false;
+  *record = std::move(message);
+  return true;
+}
+
+// The Reader returned by RecordReader::ReadRecordStream() for a record written
+// incrementally. Fragments after the first one are read from the RecordReader
+// as they are needed.
+class RecordReader::RecordStreamReader final : public Reader {
+ public:
+  RecordStreamReader(RecordReader* record_reader, Chain first_fragment)
+      : Reader(State::kOpen),
+        record_reader_(record_reader),
+        fragment_(std::move(first_fragment)) {}
+
+ protected:
+  void Done() override;
+  bool PullSlow() override;
+
+ private:
+  RecordReader* record_reader_;
+  Chain fragment_;
+  // The index of the next block of fragment_ to make available.
+  size_t block_index_ = 0;
+  // If true, fragment_ is the last fragment of the record.
+  bool last_ = false;
+};
+
+void RecordReader::RecordStreamReader::Done() {
+  fragment_ = Chain();
+  block_index_ = 0;
+  Reader::Done();
+}
+
+bool RecordReader::RecordStreamReader::PullSlow() {
+  RIEGELI_ASSERT_EQ(available(), 0u)
+      << "Failed precondition of Reader::PullSlow(): "
+         "data available, use Pull() instead";
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  for (;;) {
+    while (block_index_ < fragment_.blocks().size()) {
+      const absl::string_view block = fragment_.blocks()[block_index_++];
+      if (block.empty()) continue;
+      if (ABSL_PREDICT_FALSE(block.size() >
+                             std::numeric_limits<Position>::max() -
+                                 limit_pos_)) {
+        return FailOverflow();
+      }
+      start_ = block.data();
+      cursor_ = start_;
+      limit_ = start_ + block.size();
+      limit_pos_ += block.size();
+      return true;
+    }
+    if (last_) return false;
+    start_ = nullptr;
+    cursor_ = nullptr;
+    limit_ = nullptr;
+    block_index_ = 0;
+    if (ABSL_PREDICT_FALSE(!record_reader_->ReadFragment(&fragment_, &last_))) {
+      fragment_.Clear();
+      if (ABSL_PREDICT_FALSE(!record_reader_->healthy())) {
+        return Fail(*record_reader_);
+      }
+      return Fail("Incomplete fragmented record");
+    }
+  }
+}
+
+Reader* RecordReader::ReadRecordStream(RecordPosition* key) {
+  record_stream_.reset();
+  while (chunk_decoder_.index() == chunk_decoder_.num_records()) {
+    // Read the next chunk here rather than in ReadRecord(), so that fragments
+    // of a record written incrementally are not joined.
+    if (ABSL_PREDICT_FALSE(!healthy())) return nullptr;
+    if (ABSL_PREDICT_FALSE(!chunk_decoder_.healthy())) {
+      Fail(chunk_decoder_);
+      return nullptr;
+    }
+    streaming_record_ = true;
+    const bool read = ReadNextChunk();
+    streaming_record_ = false;
+    if (ABSL_PREDICT_FALSE(!read)) return nullptr;
+  }
+  if (chunk_decoder_.record_continues()) {
+    Chain first_fragment;
+    if (!chunk_decoder_.ReadRecord(&first_fragment)) {
+      RIEGELI_ASSERT_UNREACHABLE() << "Failed reading the first fragment: "
+                                   << chunk_decoder_.message();
+    }
+    if (key != nullptr) *key = RecordPosition(chunk_begin_, 0);
+    record_stream_ =
+        absl::make_unique<RecordStreamReader>(this, std::move(first_fragment));
+    return record_stream_.get();
+  }
+  Chain record;
+  if (ABSL_PREDICT_FALSE(!ReadRecord(&record, key))) return nullptr;
+  record_stream_ = absl::make_unique<ChainReader>(std::move(record));
+  return record_stream_.get();
+}
+
+bool RecordReader::ReadRecords(size_t max_num_records,
+                               std::vector<absl::string_view>* records,
+                               RecordPosition* first_key) {
+  RIEGELI_ASSERT_GT(max_num_records, 0u)
+      << "Failed precondition of RecordReader::ReadRecords(): "
+         "no records requested";
+  for (;;) {
+    while (chunk_decoder_.index() == chunk_decoder_.num_records()) {
+      records->clear();
+      if (ABSL_PREDICT_FALSE(!healthy())) return false;
+      RIEGELI_ASSERT(chunk_decoder_.healthy())
+          << "ChunkDecoder::ReadRecords() made ChunkDecoder unhealthy "
+             "but RecordReader is healthy";
+      if (ABSL_PREDICT_FALSE(!ReadNextChunk())) return false;
+    }
+    if (first_key != nullptr) {
+      *first_key = RecordPosition(chunk_begin_, chunk_decoder_.index());
+    }
+    if (ABSL_PREDICT_TRUE(
+            chunk_decoder_.ReadRecords(max_num_records, records) > 0)) {
+      return true;
+    }
+    // A block of record values could not be decompressed. If skip_errors is
+    // true, the rest of the chunk was skipped.
+    if (ABSL_PREDICT_FALSE(!chunk_decoder_.healthy())) {
+      return Fail(chunk_decoder_);
+    }
+  }
+}
+
 bool RecordReader::Seek(RecordPosition new_pos) {
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
   if (new_pos.chunk_begin() == chunk_begin_) {
-    if (new_pos.record_index() == 0 || chunk_reader_->pos() > chunk_begin_) {
+    if (new_pos.record_index() == 0 || chunk_end_ > chunk_begin_) {
       // Seeking to the beginning of a chunk does not need reading the chunk nor
       // checking its size, which is important because it may be non-existent at
       // end of file, corrupted, or empty.
       //
-      // If chunk_reader_->pos() > chunk_begin_, the chunk is already read.
+      // If chunk_end_ > chunk_begin_, the chunk is already read.
       goto skip_reading_chunk;
     }
   } else {
-    if (ABSL_PREDICT_FALSE(!chunk_reader_->Seek(new_pos.chunk_begin()))) {
-      chunk_begin_ = chunk_reader_->pos();
-      chunk_decoder_.Reset();
-      if (ABSL_PREDICT_TRUE(chunk_reader_->healthy())) return false;
-      return Fail(*chunk_reader_);
+    // Chunks read ahead before new_pos will not be needed.
+    while (!decoding_chunks_.empty() &&
+           decoding_chunks_.front().chunk_begin < new_pos.chunk_begin()) {
+      DiscardFirstDecodingChunk();
     }
-    if (new_pos.record_index() == 0 ||
-        ABSL_PREDICT_FALSE(chunk_reader_->pos() > new_pos.chunk_begin())) {
-      // Seeking to the beginning of a chunk does not need reading the chunk nor
-      // checking its size, which is important because it may be non-existent at
-      // end of file, corrupted, or empty.
-      //
-      // If chunk_reader_->pos() > new_pos.chunk_begin(), corruption was
-      // skipped.
-      chunk_begin_ = chunk_reader_->pos();
+    if (!decoding_chunks_.empty() &&
+        decoding_chunks_.front().chunk_begin == new_pos.chunk_begin()) {
+      // The chunk has been read ahead. ReadChunk() will take it.
+      chunk_begin_ = new_pos.chunk_begin();
+      chunk_end_ = chunk_begin_;
       chunk_decoder_.Reset();
-      return true;
+      if (new_pos.record_index() == 0) return true;
+    } else {
+      DiscardDecodingChunks();
+      if (ABSL_PREDICT_FALSE(!chunk_reader_->Seek(new_pos.chunk_begin()))) {
+        chunk_begin_ = chunk_reader_->pos();
+        chunk_end_ = chunk_begin_;
+        chunk_decoder_.Reset();
+        if (ABSL_PREDICT_TRUE(chunk_reader_->healthy())) return false;
+        return Fail(*chunk_reader_);
+      }
+      if (new_pos.record_index() == 0 ||
+          ABSL_PREDICT_FALSE(chunk_reader_->pos() > new_pos.chunk_begin())) {
+        // Seeking to the beginning of a chunk does not need reading the chunk
+        // nor checking its size, which is important because it may be
+        // non-existent at end of file, corrupted, or empty.
+        //
+        // If chunk_reader_->pos() > new_pos.chunk_begin(), corruption was
+        // skipped.
+        chunk_begin_ = chunk_reader_->pos();
+        chunk_end_ = chunk_begin_;
+        chunk_decoder_.Reset();
+        return true;
+      }
     }
   }
   if (ABSL_PREDICT_FALSE(!ReadChunk())) return false;
@@ -215,26 +636,62 @@ skip_reading_chunk:
 
 bool RecordReader::Seek(Position new_pos) {
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
-  if (new_pos >= chunk_begin_ && new_pos <= chunk_reader_->pos()) {
+  if (new_pos >= chunk_begin_ && new_pos <= chunk_end_) {
     // Seeking inside or just after the current chunk which has been read,
     // or to the beginning of the current chunk which has been located,
     // or to the end of file which has been reached.
   } else {
-    if (ABSL_PREDICT_FALSE(!chunk_reader_->SeekToChunkContaining(new_pos))) {
-      chunk_begin_ = chunk_reader_->pos();
-      chunk_decoder_.Reset();
-      if (ABSL_PREDICT_TRUE(chunk_reader_->healthy())) return false;
-      return Fail(*chunk_reader_);
+    if (chunk_index_ != nullptr) {
+      // Locate the chunk using the index. If new_pos points between records,
+      // the next record is at the beginning of the next chunk.
+      const ChunkIndex::Entry* entry = chunk_index_->FindChunkBefore(new_pos);
+      if (entry != nullptr &&
+          new_pos - entry->chunk_begin < entry->num_records) {
+        return Seek(
+            RecordPosition(entry->chunk_begin,
+                           IntCast<uint64_t>(new_pos - entry->chunk_begin)));
+      }
+      const ChunkIndex::Entry* const next_entry =
+          entry == nullptr ? chunk_index_->entries().data() : entry + 1;
+      if (next_entry != chunk_index_->entries().data() +
+                            chunk_index_->entries().size()) {
+        return Seek(RecordPosition(next_entry->chunk_begin, 0));
+      }
+      // new_pos is after the last record. Continue without the index.
     }
-    if (chunk_reader_->pos() >= new_pos) {
-      // If chunk_reader_->pos() == new_pos, seeking to the beginning of a
-      // chunk. This does not need reading the chunk, which is important because
-      // it may be non-existent at end of file or corrupted.
-      //
-      // If chunk_reader_->pos() > new_pos, corruption was skipped.
-      chunk_begin_ = chunk_reader_->pos();
+    // Chunks read ahead before new_pos will not be needed.
+    while (!decoding_chunks_.empty() &&
+           decoding_chunks_.front().chunk_end <= new_pos) {
+      DiscardFirstDecodingChunk();
+    }
+    if (!decoding_chunks_.empty() &&
+        decoding_chunks_.front().chunk_begin <= new_pos) {
+      // The chunk containing new_pos has been read ahead. ReadChunk() will
+      // take it.
+      chunk_begin_ = decoding_chunks_.front().chunk_begin;
+      chunk_end_ = chunk_begin_;
       chunk_decoder_.Reset();
-      return true;
+      if (new_pos == chunk_begin_) return true;
+    } else {
+      DiscardDecodingChunks();
+      if (ABSL_PREDICT_FALSE(!chunk_reader_->SeekToChunkContaining(new_pos))) {
+        chunk_begin_ = chunk_reader_->pos();
+        chunk_end_ = chunk_begin_;
+        chunk_decoder_.Reset();
+        if (ABSL_PREDICT_TRUE(chunk_reader_->healthy())) return false;
+        return Fail(*chunk_reader_);
+      }
+      if (chunk_reader_->pos() >= new_pos) {
+        // If chunk_reader_->pos() == new_pos, seeking to the beginning of a
+        // chunk. This does not need reading the chunk, which is important
+        // because it may be non-existent at end of file or corrupted.
+        //
+        // If chunk_reader_->pos() > new_pos, corruption was skipped.
+        chunk_begin_ = chunk_reader_->pos();
+        chunk_end_ = chunk_begin_;
+        chunk_decoder_.Reset();
+        return true;
+      }
     }
     if (ABSL_PREDICT_FALSE(!ReadChunk())) return false;
     if (ABSL_PREDICT_FALSE(chunk_begin_ > new_pos)) {
@@ -246,31 +703,877 @@ bool RecordReader::Seek(Position new_pos) {
   return true;
 }
 
-inline bool RecordReader::ReadChunk() {
-  Chunk chunk;
-  for (;;) {
-    if (ABSL_PREDICT_FALSE(!chunk_reader_->ReadChunk(&chunk, &chunk_begin_))) {
+bool RecordReader::ReadRecordsAt(absl::Span<const RecordPosition> positions,
+                                 std::vector<std::string>* records) {
+  records->clear();
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  std::vector<size_t> order(positions.size());
+  for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return positions[a] < positions[b];
+  });
+  records->resize(positions.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    const size_t index = order[i];
+    if (i > 0 && positions[index] == positions[order[i - 1]]) {
+      // A repeated position is copied instead of seeking back to it.
+      (*records)[index] = (*records)[order[i - 1]];
+      continue;
+    }
+    if (ABSL_PREDICT_FALSE(!Seek(positions[index]) ||
+                           !ReadRecord(&(*records)[index]))) {
+      records->clear();
+      return false;
+    }
+  }
+  return true;
+}
+
+bool RecordReader::SeekBack() {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  const RecordPosition pos_before = pos();
+  if (chunk_decoder_.index() > 0) {
+    // The previous record is in the current chunk.
+    chunk_decoder_.SetIndex(chunk_decoder_.index() - 1);
+    return true;
+  }
+  // The previous record is the last record of the nearest preceding chunk
+  // which has records. If there is none, the position is restored.
+  Position chunk_begin = chunk_begin_;
+  while (chunk_begin > 0) {
+    DiscardDecodingChunks();
+    if (ABSL_PREDICT_FALSE(
+            !chunk_reader_->SeekToChunkBefore(chunk_begin - 1))) {
+      if (ABSL_PREDICT_FALSE(!chunk_reader_->healthy())) {
+        return Fail(*chunk_reader_);
+      }
+      Seek(pos_before);
+      return false;
+    }
+    const Position previous_chunk_begin = chunk_reader_->pos();
+    // If corruption was skipped, the position did not move backwards.
+    if (ABSL_PREDICT_FALSE(previous_chunk_begin >= chunk_begin)) break;
+    chunk_begin_ = previous_chunk_begin;
+    chunk_end_ = chunk_begin_;
+    chunk_decoder_.Reset();
+    if (ABSL_PREDICT_FALSE(!ReadChunk(false))) {
+      if (ABSL_PREDICT_FALSE(!healthy())) return false;
+      Seek(pos_before);
+      return false;
+    }
+    // If the chunk was filtered out or corrupted, a later chunk could have been
+    // read instead.
+    if (chunk_begin_ < chunk_begin && chunk_decoder_.num_records() > 0) {
+      chunk_decoder_.SetIndex(chunk_decoder_.num_records() - 1);
+      return true;
+    }
+    chunk_begin = previous_chunk_begin;
+  }
+  // There is no previous record.
+  Seek(pos_before);
+  return false;
+}
+
+template <typename Record>
+bool RecordReader::ReadPreviousRecordImpl(Record* record,
+                                          RecordPosition* key) {
+  if (ABSL_PREDICT_FALSE(!SeekBack())) return false;
+  const RecordPosition record_pos = pos();
+  if (ABSL_PREDICT_FALSE(!ReadRecord(record, key))) return false;
+  // The record was read from the current chunk, so this only moves the record
+  // index.
+  return Seek(record_pos);
+}
+
+template bool RecordReader::ReadPreviousRecordImpl(absl::string_view* record,
+                                                   RecordPosition* key);
+template bool RecordReader::ReadPreviousRecordImpl(std::string* record,
+                                                   RecordPosition* key);
+template bool RecordReader::ReadPreviousRecordImpl(Chain* record,
+                                                   RecordPosition* key);
+
+RecordReader RecordReader::Clone(std::unique_ptr<Reader> byte_reader) const {
+  return RecordReader(
+      absl::make_unique<ChunkReader>(
+          std::move(byte_reader),
+          ChunkReader::Options()
+              .set_skip_errors(skip_errors_)
+              .set_verify_data_hashes(verify_data_hashes_)),
+      *this);
+}
+
+RecordReader RecordReader::Clone(Reader* byte_reader) const {
+  return RecordReader(
+      absl::make_unique<ChunkReader>(
+          byte_reader, ChunkReader::Options()
+                           .set_skip_errors(skip_errors_)
+                           .set_verify_data_hashes(verify_data_hashes_)),
+      *this);
+}
+
+bool RecordReader::ReadChunkIndex() {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  Position size;
+  if (ABSL_PREDICT_FALSE(!chunk_reader_->Size(&size))) return false;
+  if (ABSL_PREDICT_FALSE(size == 0)) return false;
+  // The chunk reader is moved to the end of the file. Chunks read ahead would
+  // no longer follow chunk_reader_->pos(), so they are discarded, and the
+  // current chunk is kept.
+  DiscardDecodingChunks();
+  std::unique_ptr<ChunkIndex> chunk_index;
+  Position chunk_index_begin = 0;
+  // The index is the last chunk, or the chunk before a summary chunk.
+  Position chunk_index_end = size;
+  while (chunk_reader_->SeekToChunkBefore(chunk_index_end - 1)) {
+    chunk_index_begin = chunk_reader_->pos();
+    Chunk chunk;
+    if (!chunk_reader_->ReadChunk(&chunk) ||
+        chunk_reader_->pos() != chunk_index_end) {
+      break;
+    }
+    if (chunk_index_end == size && chunk_index_begin > 0 &&
+        FileSummary().DecodeFromChunk(chunk)) {
+      chunk_index_end = chunk_index_begin;
+      continue;
+    }
+    // DecodeFromChunk() fails if this is not an index chunk.
+    chunk_index = absl::make_unique<ChunkIndex>();
+    if (!chunk_index->DecodeFromChunk(chunk)) chunk_index.reset();
+    break;
+  }
+  if (ABSL_PREDICT_FALSE(!chunk_reader_->healthy())) {
+    chunk_begin_ = chunk_reader_->pos();
+    chunk_end_ = chunk_begin_;
+    chunk_decoder_.Reset();
+    return Fail(*chunk_reader_);
+  }
+  if (ABSL_PREDICT_FALSE(!chunk_reader_->Seek(chunk_end_))) {
+    chunk_begin_ = chunk_reader_->pos();
+    chunk_end_ = chunk_begin_;
+    chunk_decoder_.Reset();
+    if (ABSL_PREDICT_TRUE(chunk_reader_->healthy())) return false;
+    return Fail(*chunk_reader_);
+  }
+  if (chunk_index == nullptr) return false;
+  chunk_index_ = std::move(chunk_index);
+  chunk_index_begin_ = chunk_index_begin;
+  return true;
+}
+
+bool RecordReader::ReadFileSummary(FileSummary* summary) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  Position size;
+  if (ABSL_PREDICT_FALSE(!chunk_reader_->Size(&size))) return false;
+  if (ABSL_PREDICT_FALSE(size == 0)) return false;
+  // The chunk reader is moved to the end of the file. Chunks read ahead would
+  // no longer follow chunk_reader_->pos(), so they are discarded, and the
+  // current chunk is kept.
+  DiscardDecodingChunks();
+  bool found = false;
+  if (chunk_reader_->SeekToChunkBefore(size - 1)) {
+    Chunk chunk;
+    if (chunk_reader_->ReadChunk(&chunk) && chunk_reader_->pos() == size) {
+      // DecodeFromChunk() fails if this is not a summary chunk.
+      found = summary->DecodeFromChunk(chunk);
+    }
+  }
+  if (ABSL_PREDICT_FALSE(!chunk_reader_->healthy())) {
+    chunk_begin_ = chunk_reader_->pos();
+    chunk_end_ = chunk_begin_;
+    chunk_decoder_.Reset();
+    return Fail(*chunk_reader_);
+  }
+  if (ABSL_PREDICT_FALSE(!chunk_reader_->Seek(chunk_end_))) {
+    chunk_begin_ = chunk_reader_->pos();
+    chunk_end_ = chunk_begin_;
+    chunk_decoder_.Reset();
+    if (ABSL_PREDICT_TRUE(chunk_reader_->healthy())) return false;
+    return Fail(*chunk_reader_);
+  }
+  return found;
+}
+
+bool RecordReader::SeekToRecordOrdinal(uint64_t record_ordinal) {
+  RIEGELI_ASSERT(chunk_index_ != nullptr)
+      << "Failed precondition of RecordReader::SeekToRecordOrdinal(): "
+         "chunk index not read";
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  const ChunkIndex::Entry* const entry =
+      chunk_index_->FindChunkWithRecord(record_ordinal);
+  if (ABSL_PREDICT_FALSE(entry == nullptr)) {
+    Position size;
+    if (ABSL_PREDICT_FALSE(!chunk_reader_->Size(&size))) return false;
+    Seek(RecordPosition(size, 0));
+    return false;
+  }
+  return Seek(
+      RecordPosition(entry->chunk_begin, record_ordinal - entry->first_record));
+}
+
+bool RecordReader::Lookup(
+    absl::string_view key,
+    const std::function<std::string(absl::string_view record)>& key_function) {
+  RIEGELI_ASSERT(chunk_index_ != nullptr)
+      << "Failed precondition of RecordReader::Lookup(): "
+         "chunk index not read";
+  RIEGELI_ASSERT(chunk_index_->has_keys())
+      << "Failed precondition of RecordReader::Lookup(): "
+         "chunk index has no keys";
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  const std::vector<ChunkIndex::Entry>& entries = chunk_index_->entries();
+  const ChunkIndex::Entry* const next =
+      chunk_index_->FindChunkWithKeyAtLeast(key);
+  // The first record with a key not less than key is in the chunk before next,
+  // or is the first record of next.
+  const ChunkIndex::Entry* const candidate =
+      next == nullptr ? (entries.empty() ? nullptr : &entries.back())
+                      : next == &entries.front() ? nullptr : next - 1;
+  if (candidate != nullptr) {
+    if (!chunk_index_->MayContainKey(*candidate, key)) {
+      // The key is not in the candidate chunk. If it is not the first key of
+      // next either, it is absent, which is known without reading any chunk,
+      // and the position is left unchanged.
+      if (next == nullptr || next->first_key != key) return false;
+    } else {
+      if (ABSL_PREDICT_FALSE(
+              !Seek(RecordPosition(candidate->chunk_begin, 0)))) {
+        return false;
+      }
+      for (uint64_t i = 0; i < candidate->num_records; ++i) {
+        absl::string_view record;
+        RecordPosition pos;
+        if (ABSL_PREDICT_FALSE(!ReadRecord(&record, &pos))) return false;
+        const std::string record_key = key_function(record);
+        if (record_key >= key) {
+          if (ABSL_PREDICT_FALSE(!Seek(pos))) return false;
+          return record_key == key;
+        }
+      }
+    }
+  }
+  if (next == nullptr) {
+    Position size;
+    if (ABSL_PREDICT_FALSE(!chunk_reader_->Size(&size))) return false;
+    Seek(RecordPosition(size, 0));
+    return false;
+  }
+  if (ABSL_PREDICT_FALSE(!Seek(RecordPosition(next->chunk_begin, 0)))) {
+    return false;
+  }
+  return next->first_key == key;
+}
+
+bool RecordReader::SetReadRange(Position begin, Position end) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  range_end_ = end;
+  DiscardDecodingChunks();
+  chunk_decoder_.Reset();
+  const bool ok = chunk_reader_->SeekToChunkAfter(begin);
+  chunk_begin_ = chunk_reader_->pos();
+  chunk_end_ = chunk_begin_;
+  if (ABSL_PREDICT_FALSE(!ok)) {
+    if (ABSL_PREDICT_TRUE(chunk_reader_->healthy())) return false;
+    return Fail(*chunk_reader_);
+  }
+  return true;
+}
+
+bool RecordReader::FindSplitPoints(size_t num_splits,
+                                   std::vector<Position>* split_points) {
+  RIEGELI_ASSERT_GT(num_splits, 0u)
+      << "Failed precondition of RecordReader::FindSplitPoints(): "
+         "no splits";
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  Position size;
+  if (ABSL_PREDICT_FALSE(!chunk_reader_->Size(&size))) return false;
+  // The chunk reader is moved around the file. Chunks read ahead would no
+  // longer follow chunk_reader_->pos(), so they are discarded, and the current
+  // chunk is kept.
+  DiscardDecodingChunks();
+  split_points->clear();
+  split_points->push_back(0);
+  for (size_t i = 1; i < num_splits; ++i) {
+    // Round the target down to a block boundary, so that locating the next
+    // chunk needs to read only the block header.
+    const Position target =
+        size / num_splits * i + size % num_splits * i / num_splits;
+    const Position block_begin = target - target % internal::kBlockSize();
+    if (block_begin <= split_points->back()) continue;
+    if (!chunk_reader_->SeekToChunkAfter(block_begin)) break;
+    const Position split_point = chunk_reader_->pos();
+    if (split_point >= size) break;
+    if (split_point > split_points->back()) {
+      split_points->push_back(split_point);
+    }
+  }
+  if (split_points->size() == 1 || split_points->back() < size) {
+    split_points->push_back(size);
+  }
+  if (ABSL_PREDICT_FALSE(!chunk_reader_->healthy())) {
+    chunk_begin_ = chunk_reader_->pos();
+    chunk_end_ = chunk_begin_;
+    chunk_decoder_.Reset();
+    return Fail(*chunk_reader_);
+  }
+  if (ABSL_PREDICT_FALSE(!chunk_reader_->Seek(chunk_end_))) {
+    chunk_begin_ = chunk_reader_->pos();
+    chunk_end_ = chunk_begin_;
+    chunk_decoder_.Reset();
+    if (ABSL_PREDICT_TRUE(chunk_reader_->healthy())) return false;
+    return Fail(*chunk_reader_);
+  }
+  return true;
+}
+
+bool RecordReader::Search(
+    const std::function<int(absl::string_view record)>& test,
+    size_t num_probes) {
+  RIEGELI_ASSERT_GT(num_probes, 0u)
+      << "Failed precondition of RecordReader::Search(): no probes";
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  const RecordPosition start = pos();
+  Position size;
+  if (ABSL_PREDICT_FALSE(!chunk_reader_->Size(&size))) return false;
+  // The chunk reader is moved around the file. Chunks read ahead would no
+  // longer follow chunk_reader_->pos(), so they are discarded.
+  DiscardDecodingChunks();
+  // Desired records are not before the chunk beginning at low (or before start
+  // in that chunk), and the first desired record, if any, is not after the
+  // first record of the first chunk beginning at or after high.
+  Position low = start.chunk_begin();
+  Position high = size;
+  std::vector<Position> probes;
+  std::vector<std::future<ChunkDecoder>> chunk_decoders;
+  std::vector<Position> probe_ends;
+  while (high - low > 1) {
+    const Position old_low = low;
+    const Position old_high = high;
+    // Locate chunks beginning at or after evenly spaced targets in
+    // (low, high).
+    probes.clear();
+    const Position span = old_high - old_low;
+    const Position num_parts = IntCast<Position>(num_probes) + 1;
+    for (size_t i = 1; i <= num_probes; ++i) {
+      const Position target = old_low + span / num_parts * i +
+                              span % num_parts * i / num_parts;
+      if (target <= old_low || (!probes.empty() && target <= probes.back())) {
+        continue;
+      }
+      if (target >= high || !chunk_reader_->SeekToChunkAfter(target)) break;
+      const Position chunk_begin = chunk_reader_->pos();
+      if (chunk_begin >= high) {
+        // No chunk begins in [target, high).
+        high = target;
+        break;
+      }
+      if (probes.empty() || chunk_begin > probes.back()) {
+        probes.push_back(chunk_begin);
+      }
+    }
+    if (ABSL_PREDICT_FALSE(!chunk_reader_->healthy()) ||
+        ABSL_PREDICT_FALSE(
+            !ReadProbes(probes, &chunk_decoders, &probe_ends))) {
       chunk_begin_ = chunk_reader_->pos();
+      chunk_end_ = chunk_begin_;
       chunk_decoder_.Reset();
-      if (ABSL_PREDICT_TRUE(chunk_reader_->healthy())) return false;
       return Fail(*chunk_reader_);
     }
-    if (chunk_begin_ == 0) {
-      // Verify file signature.
-      if (ABSL_PREDICT_FALSE(chunk.header.data_size() != 0 ||
-                             chunk.header.num_records() != 0 ||
-                             chunk.header.decoded_data_size() != 0)) {
+    // Narrow the region using first records of probed chunks.
+    for (size_t i = 0; i < probes.size(); ++i) {
+      ChunkDecoder chunk_decoder = chunk_decoders[i].get();
+      absl::string_view record;
+      if (!chunk_decoder.ReadRecord(&record)) {
+        if (ABSL_PREDICT_FALSE(!chunk_decoder.healthy())) {
+          if (!skip_errors_) {
+            chunk_begin_ = probes[i];
+            chunk_end_ = chunk_begin_;
+            chunk_decoder_.Reset();
+            return Fail(chunk_decoder);
+          }
+          skipped_bytes_ =
+              SaturatingAdd(skipped_bytes_, probe_ends[i] - probes[i]);
+        }
+        // The chunk has no records to compare.
+        continue;
+      }
+      if (test(record) < 0) {
+        low = probes[i];
+      } else {
+        high = probes[i];
+        break;
+      }
+    }
+    // If probed chunks had no records, the rest is found by reading.
+    if (low == old_low && high == old_high) break;
+  }
+  // Probes moved chunk_reader_ away from the chunk at low, so the current
+  // chunk is forgotten, and Seek() below reads it again from chunk_reader_
+  // instead of taking the shortcut for the same chunk.
+  if (ABSL_PREDICT_FALSE(!chunk_reader_->Seek(low))) {
+    chunk_begin_ = chunk_reader_->pos();
+    chunk_end_ = chunk_begin_;
+    chunk_decoder_.Reset();
+    if (ABSL_PREDICT_TRUE(chunk_reader_->healthy())) return false;
+    return Fail(*chunk_reader_);
+  }
+  chunk_begin_ = chunk_reader_->pos();
+  chunk_end_ = chunk_begin_;
+  chunk_decoder_.Reset();
+  // Read records from the chunk beginning at low until a record which is not
+  // before desired records.
+  if (ABSL_PREDICT_FALSE(!Seek(low == start.chunk_begin()
+                                   ? start
+                                   : RecordPosition(low, 0)))) {
+    return false;
+  }
+  for (;;) {
+    absl::string_view record;
+    RecordPosition pos;
+    if (!ReadRecord(&record, &pos)) return false;
+    const int result = test(record);
+    if (result >= 0) {
+      if (ABSL_PREDICT_FALSE(!Seek(pos))) return false;
+      return result == 0;
+    }
+  }
+}
+
+bool RecordReader::ReadProbes(
+    const std::vector<Position>& probes,
+    std::vector<std::future<ChunkDecoder>>* chunk_decoders,
+    std::vector<Position>* probe_ends) {
+  chunk_decoders->clear();
+  probe_ends->clear();
+  for (const Position probe : probes) {
+    ChunkToDecode* const chunk_to_decode = new ChunkToDecode();
+    if (!chunk_reader_->Seek(probe) ||
+        !chunk_reader_->ReadChunk(&chunk_to_decode->chunk)) {
+      delete chunk_to_decode;
+      if (ABSL_PREDICT_FALSE(!chunk_reader_->healthy())) {
+        WaitForProbes(*chunk_decoders);
+        return false;
+      }
+      probe_ends->push_back(probe);
+      // The chunk is truncated, so it has no records to compare.
+      std::promise<ChunkDecoder> no_chunk;
+      no_chunk.set_value(ChunkDecoder());
+      chunk_decoders->push_back(no_chunk.get_future());
+      continue;
+    }
+    probe_ends->push_back(UnsignedMax(chunk_reader_->pos(), probe));
+    chunk_to_decode->chunk_decoder_options = chunk_decoder_options_;
+    chunk_to_decode->stats = stats_;
+    chunk_to_decode->tracer = tracer_;
+    chunk_to_decode->chunk_begin = probe;
+    chunk_decoders->push_back(chunk_to_decode->chunk_decoder.get_future());
+    const auto decode = [](ChunkToDecode* chunk_to_decode) {
+      ChunkDecoder chunk_decoder(
+          std::move(chunk_to_decode->chunk_decoder_options));
+      DecodeChunk(chunk_to_decode->stats, chunk_to_decode->tracer,
+                  chunk_to_decode->chunk_begin, chunk_to_decode->chunk,
+                  &chunk_decoder);
+      chunk_to_decode->chunk_decoder.set_value(std::move(chunk_decoder));
+      delete chunk_to_decode;
+    };
+    if (probes.size() == 1) {
+      // There is nothing to decode concurrently.
+      decode(chunk_to_decode);
+      continue;
+    }
+    ThreadPool& thread_pool = thread_pool_ != nullptr
+                                  ? *thread_pool_
+                                  : internal::DefaultThreadPool();
+    thread_pool.Schedule(
+        [decode, chunk_to_decode] { decode(chunk_to_decode); });
+  }
+  // Search() may return before examining all probes, so they are not left
+  // decoding in the background.
+  WaitForProbes(*chunk_decoders);
+  return true;
+}
+
+bool RecordReader::ReadyToRead() {
+  if (ABSL_PREDICT_FALSE(!healthy())) return true;
+  if (chunk_decoder_.index() < chunk_decoder_.num_records()) return true;
+  // ReadChunk() reads the chunk at the beginning of the file synchronously.
+  if (parallelism_ == 0 || chunk_reader_->pos() == 0) return true;
+  if (decoding_chunks_.empty()) {
+    ReadChunksAhead();
+    // If no chunk could be read ahead, ReadChunk() will not wait either.
+    if (decoding_chunks_.empty()) return true;
+  }
+  return decoding_chunks_.front().chunk_decoder.wait_for(
+             std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+inline bool RecordReader::ReadChunk(bool read_ahead) {
+  for (;;) {
+    if (decoding_chunks_.empty() && ReadChunkFromCache()) return true;
+    if (decoding_chunks_.empty() &&
+        (parallelism_ == 0 || !read_ahead || chunk_reader_->pos() == 0)) {
+      // Read and decode the chunk synchronously. This is always done at the
+      // beginning of the file, so that the file signature is verified here.
+      Chunk chunk;
+      if (ABSL_PREDICT_FALSE(!ReadChunkFromReader(&chunk, &chunk_begin_))) {
+        chunk_begin_ = chunk_reader_->pos();
+        chunk_end_ = chunk_begin_;
         chunk_decoder_.Reset();
-        return Fail("Invalid Riegeli/records file: missing file signature");
+        if (ABSL_PREDICT_TRUE(chunk_reader_->healthy())) return false;
+        return Fail(*chunk_reader_);
       }
-      // Decoding this chunk will yield no records and ReadChunk() will be
-      // called again if needed.
+      chunk_end_ = chunk_reader_->pos();
+      if (chunk_begin_ == 0) {
+        // Verify file signature.
+        if (ABSL_PREDICT_FALSE(chunk.header.data_size() != 0 ||
+                               chunk.header.num_records() != 0 ||
+                               chunk.header.decoded_data_size() != 0)) {
+          chunk_decoder_.Reset();
+          return Fail("Invalid Riegeli/records file: missing file signature");
+        }
+        file_signature_verified_ = true;
+        // Decoding this chunk will yield no records and ReadChunk() will be
+        // called again if needed.
+      }
+      if (ABSL_PREDICT_TRUE(DecodeChunk(stats_, tracer_, chunk_begin_, chunk,
+                                        &chunk_decoder_))) {
+        if (ABSL_PREDICT_FALSE(chunk_decoder_.record_continues()) &&
+            !streaming_record_) {
+          return JoinFragments();
+        }
+        AddChunkToCache();
+        return true;
+      }
+    } else {
+      ReadChunksAhead();
+      if (ABSL_PREDICT_FALSE(decoding_chunks_.empty())) {
+        chunk_begin_ = chunk_reader_->pos();
+        chunk_end_ = chunk_begin_;
+        chunk_decoder_.Reset();
+        if (ABSL_PREDICT_TRUE(chunk_reader_->healthy())) return false;
+        return Fail(*chunk_reader_);
+      }
+      DecodingChunk& decoding_chunk = decoding_chunks_.front();
+      chunk_begin_ = decoding_chunk.chunk_begin;
+      chunk_end_ = decoding_chunk.chunk_end;
+      {
+        RecordTracer::Span span(tracer_, TraceStage::kDecodeWait,
+                                chunk_begin_);
+        RecordStats::Timer timer(stats_, &RecordStats::decode_wait_nanos_);
+        chunk_decoder_ = decoding_chunk.chunk_decoder.get();
+        if (decoding_chunk.parsed_records.valid()) {
+          parsed_chunk_begin_ = chunk_begin_;
+          parsed_records_ = decoding_chunk.parsed_records.get();
+        }
+      }
+      decoding_chunks_.pop_front();
+      if (ABSL_PREDICT_TRUE(chunk_decoder_.healthy())) {
+        if (ABSL_PREDICT_FALSE(chunk_decoder_.record_continues()) &&
+            !streaming_record_) {
+          return JoinFragments();
+        }
+        AddChunkToCache();
+        return true;
+      }
+    }
+    if (!skip_errors_) {
+      DiscardDecodingChunks();
+      return Fail(chunk_decoder_);
     }
-    if (ABSL_PREDICT_TRUE(chunk_decoder_.Reset(chunk))) return true;
-    if (!skip_errors_) return Fail(chunk_decoder_);
     chunk_decoder_.Reset();
-    skipped_bytes_ =
-        SaturatingAdd(skipped_bytes_, chunk_reader_->pos() - chunk_begin_);
+    skipped_bytes_ = SaturatingAdd(skipped_bytes_, chunk_end_ - chunk_begin_);
+  }
+}
+
+bool RecordReader::ReadNextChunk() {
+  while (ABSL_PREDICT_FALSE(!ReadChunk())) {
+    if (tail_wait_ == nullptr || !healthy() ||
+        chunk_reader_->pos() >= range_end_ || !chunk_reader_->HopeForMore() ||
+        !tail_wait_()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool RecordReader::JoinFragments() {
+  for (;;) {
+    RIEGELI_ASSERT(chunk_decoder_.record_continues())
+        << "Failed precondition of RecordReader::JoinFragments(): "
+           "no fragment to join";
+    const Position record_begin = chunk_begin_;
+    Chain record;
+    if (!chunk_decoder_.ReadRecord(&record)) {
+      RIEGELI_ASSERT_UNREACHABLE() << "Failed reading the first fragment: "
+                                   << chunk_decoder_.message();
+    }
+    Chain fragment;
+    bool last = false;
+    streaming_record_ = true;
+    do {
+      if (ABSL_PREDICT_FALSE(!ReadNextChunk())) {
+        streaming_record_ = false;
+        if (ABSL_PREDICT_FALSE(!healthy())) return false;
+        // The source ends inside the record. Return to its beginning, so that
+        // it is read again if more data are appended.
+        if (ABSL_PREDICT_FALSE(!chunk_reader_->Seek(record_begin))) {
+          chunk_decoder_.Reset();
+          return Fail(*chunk_reader_);
+        }
+        chunk_begin_ = record_begin;
+        chunk_end_ = record_begin;
+        chunk_decoder_.Reset();
+        return false;
+      }
+      if (ABSL_PREDICT_FALSE(!chunk_decoder_.ReadContinuation(&fragment,
+                                                              &last))) {
+        break;
+      }
+      record.Append(std::move(fragment));
+      fragment.Clear();
+    } while (!last);
+    streaming_record_ = false;
+    if (ABSL_PREDICT_TRUE(last)) {
+      // Joined records are not added to chunk_cache_ because they can be
+      // large.
+      RecordLimits limits;
+      limits.Reset(record.size());
+      limits.push_back(record.size());
+      chunk_begin_ = record_begin;
+      chunk_decoder_.Reset(std::move(limits), std::move(record));
+      return true;
+    }
+    // The chunk following a fragment does not continue the record.
+    if (!skip_errors_) {
+      chunk_decoder_.Reset();
+      return Fail("Incomplete fragmented record");
+    }
+    skipped_bytes_ = SaturatingAdd(skipped_bytes_, chunk_begin_ - record_begin);
+    if (!chunk_decoder_.record_continues()) return true;
+  }
+}
+
+bool RecordReader::ReadFragment(Chain* fragment, bool* last) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  streaming_record_ = true;
+  const bool read = ReadNextChunk();
+  streaming_record_ = false;
+  if (ABSL_PREDICT_FALSE(!read)) return false;
+  if (ABSL_PREDICT_TRUE(chunk_decoder_.ReadContinuation(fragment, last))) {
+    return true;
+  }
+  // The record is incomplete. Records of the chunk just read are left to be
+  // read normally.
+  if (chunk_decoder_.record_continues()) JoinFragments();
+  return false;
+}
+
+inline bool RecordReader::ReadChunkFromReader(Chunk* chunk,
+                                              Position* chunk_begin,
+                                              bool verify_data_hash) {
+  RecordTracer::Span span(tracer_, TraceStage::kRead, chunk_reader_->pos());
+  RecordStats::Timer timer(stats_, &RecordStats::read_nanos_);
+  if (ABSL_PREDICT_FALSE(!SkipFilteredChunks())) return false;
+  if (chunk_reader_->pos() >= range_end_) return false;
+  if (ABSL_PREDICT_FALSE(
+          !(verify_data_hash
+                ? chunk_reader_->ReadChunk(chunk, chunk_begin)
+                : chunk_reader_->ReadChunkWithoutVerifying(chunk,
+                                                           chunk_begin)))) {
+    return false;
+  }
+  if (stats_ != nullptr) stats_->AddReadChunk(*chunk);
+  return true;
+}
+
+inline bool RecordReader::SkipFilteredChunks() {
+  if (chunk_index_ == nullptr || chunk_filter_ == nullptr) return true;
+  const std::vector<ChunkIndex::Entry>& entries = chunk_index_->entries();
+  const Position pos = chunk_reader_->pos();
+  std::vector<ChunkIndex::Entry>::const_iterator entry = std::lower_bound(
+      entries.begin(), entries.end(), pos,
+      [](const ChunkIndex::Entry& entry, Position pos) {
+        return entry.chunk_begin < pos;
+      });
+  Position new_pos = pos;
+  uint64_t filtered_chunks = 0;
+  while (entry != entries.end() && entry->chunk_begin == new_pos &&
+         !chunk_filter_(*entry)) {
+    ++filtered_chunks;
+    ++entry;
+    new_pos = entry == entries.end() ? chunk_index_begin_ : entry->chunk_begin;
+  }
+  if (filtered_chunks == 0) return true;
+  if (stats_ != nullptr) {
+    RecordStats::Add(&stats_->filtered_chunks_, filtered_chunks);
+  }
+  return chunk_reader_->Seek(new_pos);
+}
+
+inline bool RecordReader::ReadChunkFromCache() {
+  if (chunk_cache_ == nullptr) return false;
+  // The chunk at the beginning of the file is always read, so that the file
+  // signature is verified.
+  if (chunk_reader_->pos() == 0) return false;
+  if (ABSL_PREDICT_FALSE(!SkipFilteredChunks())) return false;
+  const Position chunk_begin = chunk_reader_->pos();
+  if (chunk_begin >= range_end_) return false;
+  std::shared_ptr<const ChunkCache::DecodedChunk> decoded_chunk =
+      chunk_cache_->Find(chunk_cache_file_id_, chunk_begin);
+  if (decoded_chunk == nullptr) return false;
+  if (ABSL_PREDICT_FALSE(!chunk_reader_->Seek(decoded_chunk->chunk_end))) {
+    // Let reading from chunk_reader_ report the failure.
+    return false;
+  }
+  chunk_begin_ = chunk_begin;
+  chunk_end_ = decoded_chunk->chunk_end;
+  chunk_decoder_.Reset(decoded_chunk->limits, decoded_chunk->values);
+  return true;
+}
+
+inline void RecordReader::AddChunkToCache() {
+  if (chunk_cache_ == nullptr || chunk_decoder_.num_records() == 0 ||
+      chunk_decoder_.record_continues()) {
+    return;
+  }
+  const std::shared_ptr<ChunkCache::DecodedChunk> decoded_chunk =
+      std::make_shared<ChunkCache::DecodedChunk>();
+  decoded_chunk->chunk_end = chunk_end_;
+  if (!chunk_decoder_.GetDecoded(&decoded_chunk->limits,
+                                 &decoded_chunk->values)) {
+    return;
+  }
+  chunk_cache_->Insert(chunk_cache_file_id_, chunk_begin_,
+                       std::move(decoded_chunk));
+}
+
+bool RecordReader::DecodeChunk(RecordStats* stats, RecordTracer* tracer,
+                               Position chunk_begin, const Chunk& chunk,
+                               ChunkDecoder* chunk_decoder) {
+  RecordTracer::Span span(tracer, TraceStage::kDecode, chunk_begin);
+  RecordStats::Timer timer(stats, &RecordStats::decode_nanos_);
+  return chunk_decoder->Reset(chunk);
+}
+
+std::vector<std::unique_ptr<google::protobuf::MessageLite>>
+RecordReader::ParseChunk(const google::protobuf::MessageLite& prototype,
+                         const ChunkDecoder& chunk_decoder) {
+  std::vector<std::unique_ptr<google::protobuf::MessageLite>> parsed_records;
+  RecordLimits limits;
+  Chain values;
+  // The first fragment of a record is parsed only after it is joined with
+  // following fragments.
+  if (!chunk_decoder.healthy() || chunk_decoder.record_continues() ||
+      !chunk_decoder.GetDecoded(&limits, &values)) {
+    return parsed_records;
+  }
+  parsed_records.reserve(limits.size());
+  ChainReader values_reader(&values);
+  std::string scratch;
+  for (size_t i = 0; i < limits.size(); ++i) {
+    absl::string_view value;
+    if (!values_reader.Read(&value, &scratch,
+                            limits[i] - IntCast<size_t>(values_reader.pos()))) {
+      RIEGELI_ASSERT_UNREACHABLE()
+          << "Failed reading record values: " << values_reader.message();
+    }
+    std::unique_ptr<google::protobuf::MessageLite> record(prototype.New());
+    if (ABSL_PREDICT_FALSE(!ParsePartialFromStringView(record.get(), value)) ||
+        ABSL_PREDICT_FALSE(!record->IsInitialized())) {
+      // ReadRecord() parses this record again and reports the failure.
+      record.reset();
+    }
+    parsed_records.push_back(std::move(record));
+  }
+  return parsed_records;
+}
+
+void RecordReader::ReadChunksAhead() {
+  while (decoding_chunks_.size() < IntCast<size_t>(parallelism_)) {
+    ChunkToDecode* const chunk_to_decode = new ChunkToDecode();
+    Position chunk_begin;
+    // The hash of chunk data is verified by the background task, so that the
+    // reading thread does not spend time on it. Corruption is then reported
+    // by ReadChunk() in order, like a decoding failure.
+    if (ABSL_PREDICT_FALSE(!ReadChunkFromReader(&chunk_to_decode->chunk,
+                                                &chunk_begin, false))) {
+      // Failures of chunk_reader_ are reported by ReadChunk() after chunks
+      // read ahead are consumed.
+      delete chunk_to_decode;
+      return;
+    }
+    RIEGELI_ASSERT_GT(chunk_begin, 0u)
+        << "The chunk at the beginning of the file should have been read "
+           "synchronously";
+    chunk_to_decode->chunk_decoder_options = chunk_decoder_options_;
+    chunk_to_decode->chunk_decoder_options.set_verify_data(verify_data_hashes_);
+    chunk_to_decode->stats = stats_;
+    chunk_to_decode->tracer = tracer_;
+    chunk_to_decode->chunk_begin = chunk_begin;
+    chunk_to_decode->parse_prototype = parse_prototype_;
+    std::future<std::vector<std::unique_ptr<google::protobuf::MessageLite>>>
+        parsed_records;
+    if (parse_prototype_ != nullptr) {
+      parsed_records = chunk_to_decode->parsed_records.get_future();
+    }
+    decoding_chunks_.push_back(
+        DecodingChunk{chunk_begin, chunk_reader_->pos(),
+                      chunk_to_decode->chunk_decoder.get_future(),
+                      std::move(parsed_records)});
+    ThreadPool& thread_pool = thread_pool_ != nullptr
+                                  ? *thread_pool_
+                                  : internal::DefaultThreadPool();
+    thread_pool.Schedule([chunk_to_decode] {
+      ChunkDecoder chunk_decoder(
+          std::move(chunk_to_decode->chunk_decoder_options));
+      DecodeChunk(chunk_to_decode->stats, chunk_to_decode->tracer,
+                  chunk_to_decode->chunk_begin, chunk_to_decode->chunk,
+                  &chunk_decoder);
+      if (chunk_to_decode->parse_prototype != nullptr) {
+        RecordTracer::Span span(chunk_to_decode->tracer, TraceStage::kParse,
+                                chunk_to_decode->chunk_begin);
+        chunk_to_decode->parsed_records.set_value(
+            ParseChunk(*chunk_to_decode->parse_prototype, chunk_decoder));
+      }
+      chunk_to_decode->chunk_decoder.set_value(std::move(chunk_decoder));
+      delete chunk_to_decode;
+    });
+  }
+}
+
+void RecordReader::DiscardDecodingChunks() {
+  for (const DecodingChunk& decoding_chunk : decoding_chunks_) {
+    decoding_chunk.chunk_decoder.wait();
+  }
+  decoding_chunks_.clear();
+}
+
+void RecordReader::DiscardFirstDecodingChunk() {
+  decoding_chunks_.front().chunk_decoder.wait();
+  decoding_chunks_.pop_front();
+}
+
+size_t RecordReader::EstimateMemory() const {
+  MemoryEstimator memory_estimator;
+  AddUniqueTo(&memory_estimator);
+  return memory_estimator.TotalMemory();
+}
+
+void RecordReader::AddUniqueTo(MemoryEstimator* memory_estimator) const {
+  memory_estimator->AddMemory(sizeof(RecordReader) - sizeof(ChunkDecoder));
+  if (chunk_reader_ != nullptr) chunk_reader_->AddUniqueTo(memory_estimator);
+  memory_estimator->AddMemory(chunk_cache_file_id_.capacity());
+  chunk_decoder_.AddUniqueTo(memory_estimator);
+  for (const DecodingChunk& decoding_chunk : decoding_chunks_) {
+    memory_estimator->AddMemory(
+        sizeof(DecodingChunk) +
+        IntCast<size_t>(decoding_chunk.chunk_end - decoding_chunk.chunk_begin));
+  }
+  memory_estimator->AddMemory(
+      sizeof(std::unique_ptr<google::protobuf::MessageLite>) *
+      parsed_records_.capacity());
+  if (chunk_index_ != nullptr &&
+      memory_estimator->AddObject(chunk_index_.get())) {
+    chunk_index_->AddUniqueTo(memory_estimator);
   }
 }
 
@@ -15,30 +15,80 @@
 #ifndef RIEGELI_RECORDS_RECORD_READER_H_
 #define RIEGELI_RECORDS_RECORD_READER_H_
 
+#include <stddef.h>
 #include <stdint.h>
+#include <deque>
+#include <functional>
+#include <future>
+#include <limits>
 #include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 
+#include "google/protobuf/message_lite.h"
 #include "absl/base/optimization.h"
 #include "absl/strings/string_view.h"
+#include "absl/types/span.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
 #include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/zstd_dictionary.h"
+#include "riegeli/chunk_encoding/aliased_fields.h"
+#include "riegeli/chunk_encoding/bucket_cache.h"
 #include "riegeli/chunk_encoding/chunk_decoder.h"
 #include "riegeli/chunk_encoding/field_filter.h"
+#include "riegeli/records/chunk_cache.h"
+#include "riegeli/records/chunk_index.h"
 #include "riegeli/records/chunk_reader.h"
+#include "riegeli/records/file_summary.h"
 #include "riegeli/records/record_position.h"
+#include "riegeli/records/record_stats.h"
+#include "riegeli/records/record_tracer.h"
 
 namespace google {
 namespace protobuf {
-class MessageLite;
+class Arena;
 }  // namespace protobuf
 }  // namespace google
 
 namespace riegeli {
 
+class ThreadPool;
+
+// State of a RecordReader from which reading can resume in another
+// RecordReader of the same file, e.g. after the process restarts. Obtained
+// from RecordReader::checkpoint() and passed to
+// RecordReader::Options::set_checkpoint().
+//
+// Besides the position, a checkpoint remembers that the file signature was
+// verified, so that resuming does not read the beginning of the file again.
+class RecordReaderCheckpoint {
+ public:
+  // Creates a checkpoint at the beginning of the file.
+  RecordReaderCheckpoint() noexcept {}
+
+  RecordReaderCheckpoint(RecordPosition pos, bool file_signature_verified)
+      : pos_(pos), file_signature_verified_(file_signature_verified) {}
+
+  // The position of the next record to read.
+  RecordPosition pos() const { return pos_; }
+
+  // Whether the file signature was verified by the RecordReader.
+  bool file_signature_verified() const { return file_signature_verified_; }
+
+  // Converts the checkpoint to a string and back, e.g. to store it together
+  // with the state of a job.
+  std::string Serialize() const;
+  bool Parse(absl::string_view serialized);
+
+ private:
+  RecordPosition pos_;
+  bool file_signature_verified_ = false;
+};
+
 // RecordReader reads records of a Riegeli/records file. A record is
 // conceptually a binary string; usually it is a serialized proto message.
 //
@@ -82,6 +132,23 @@ class RecordReader final : public Object {
       return std::move(set_skip_errors(skip_errors));
     }
 
+    // If false, hashes of chunk data are verified only when decoding a chunk
+    // fails, so that corruption is reported as such. This makes reading faster
+    // when data are already protected from corruption otherwise, e.g. by
+    // filesystem checksums. Chunk headers are always verified.
+    //
+    // Corrupted chunk data are then not detected if the chunk can still be
+    // decoded, and records of such a chunk may be wrong.
+    //
+    // Default: true
+    Options& set_verify_data_hashes(bool verify_data_hashes) & {
+      verify_data_hashes_ = verify_data_hashes;
+      return *this;
+    }
+    Options&& set_verify_data_hashes(bool verify_data_hashes) && {
+      return std::move(set_verify_data_hashes(verify_data_hashes));
+    }
+
     // Specifies the set of fields to be included in returned records, allowing
     // to exclude the remaining fields (but does not guarantee that they will be
     // excluded). Excluding data makes reading faster.
@@ -97,11 +164,304 @@ class RecordReader final : public Object {
       return std::move(set_field_filter(std::move(field_filter)));
     }
 
+    // Sets the maximum number of chunks being decoded in parallel in the
+    // background. Chunks are read ahead from the byte Reader by the thread
+    // calling ReadRecord(), and are decoded by other threads. Records are
+    // returned in the same order and with the same positions as without
+    // parallelism. Hashes of chunk data of chunks read ahead are verified by
+    // the decoding threads too, and corruption is reported or skipped when
+    // the chunk is reached.
+    //
+    // If parallelism is 0, chunks are decoded synchronously when needed.
+    //
+    // Seeking discards chunks read ahead, unless the target is among them, so
+    // parallelism pays off mostly for sequential reading.
+    //
+    // Default: 0
+    Options& set_parallelism(int parallelism) & {
+      RIEGELI_ASSERT_GE(parallelism, 0)
+          << "Failed precondition of RecordReader::Options::set_parallelism(): "
+             "negative parallelism";
+      parallelism_ = parallelism;
+      return *this;
+    }
+    Options&& set_parallelism(int parallelism) && {
+      return std::move(set_parallelism(parallelism));
+    }
+
+    // Sets the maximum number of additional threads decompressing buckets of a
+    // single transposed chunk in parallel (written with
+    // RecordWriter::Options::set_transpose(true)). Unlike set_parallelism(),
+    // this reduces the latency of decoding one large chunk, e.g. for
+    // interactive tools reading few records. It has no effect if the field
+    // filter excludes some fields, because then buckets are decompressed on
+    // demand.
+    //
+    // Buckets are decompressed on the default thread pool, by the thread
+    // decoding the chunk together with up to decompression_parallelism other
+    // threads.
+    //
+    // Default: 0
+    Options& set_decompression_parallelism(int decompression_parallelism) & {
+      RIEGELI_ASSERT_GE(decompression_parallelism, 0)
+          << "Failed precondition of "
+             "RecordReader::Options::set_decompression_parallelism(): "
+             "negative parallelism";
+      decompression_parallelism_ = decompression_parallelism;
+      return *this;
+    }
+    Options&& set_decompression_parallelism(int decompression_parallelism) && {
+      return std::move(
+          set_decompression_parallelism(decompression_parallelism));
+    }
+
+    // If positive, record values of a chunk written with
+    // RecordWriter::Options::set_transpose(false) are decompressed
+    // incrementally, about this many bytes at a time, as records are read.
+    // This bounds memory usage by the compressed chunk instead of the decoded
+    // chunk, and makes the first record of a chunk available sooner.
+    //
+    // See ChunkDecoder::Options::set_streaming_block_size() for details.
+    //
+    // Default: 0
+    Options& set_streaming_block_size(size_t streaming_block_size) & {
+      streaming_block_size_ = streaming_block_size;
+      return *this;
+    }
+    Options&& set_streaming_block_size(size_t streaming_block_size) && {
+      return std::move(set_streaming_block_size(streaming_block_size));
+    }
+
+    // If true, record values of a chunk are kept in contiguous memory, so that
+    // ReadRecord(absl::string_view*) never copies a record to scratch space.
+    //
+    // See ChunkDecoder::Options::set_flat_values() for details.
+    //
+    // Default: false
+    Options& set_flat_values(bool flat_values) & {
+      flat_values_ = flat_values;
+      return *this;
+    }
+    Options&& set_flat_values(bool flat_values) && {
+      return std::move(set_flat_values(flat_values));
+    }
+
+    // Specifies the thread pool used for background work if parallelism > 0.
+    // The thread pool must be kept alive until the RecordReader is closed.
+    //
+    // If nullptr, a thread pool shared by the process is used.
+    //
+    // Default: nullptr
+    Options& set_thread_pool(ThreadPool* thread_pool) & {
+      thread_pool_ = thread_pool;
+      return *this;
+    }
+    Options&& set_thread_pool(ThreadPool* thread_pool) && {
+      return std::move(set_thread_pool(thread_pool));
+    }
+
+    // If not nullptr and parallelism > 0, records of chunks decoded in the
+    // background are also parsed there, as new messages of the same type as
+    // parse_prototype. ReadRecord(std::unique_ptr<MessageLite>*) then hands
+    // them out in order, so that parsing does not take time of the thread
+    // calling it.
+    //
+    // Records which are parsed synchronously instead: records of chunks read
+    // synchronously (e.g. the first chunk after a seek, or from chunk_cache),
+    // of kBlockedSimple chunks and kSimple chunks decompressed incrementally,
+    // and records which failed to parse (so that the failure is reported or
+    // skipped as usual).
+    //
+    // parse_prototype must be kept alive until the RecordReader is closed.
+    //
+    // Default: nullptr
+    Options& set_parse_prototype(
+        const google::protobuf::MessageLite* parse_prototype) & {
+      parse_prototype_ = parse_prototype;
+      return *this;
+    }
+    Options&& set_parse_prototype(
+        const google::protobuf::MessageLite* parse_prototype) && {
+      return std::move(set_parse_prototype(parse_prototype));
+    }
+
+    // Specifies a RecordStats which accumulates counters of chunks read and
+    // times of reading and decoding them. The RecordStats must be kept alive
+    // until the RecordReader is closed.
+    //
+    // If nullptr, counters are not collected.
+    //
+    // Default: nullptr
+    Options& set_stats(RecordStats* stats) & {
+      stats_ = stats;
+      return *this;
+    }
+    Options&& set_stats(RecordStats* stats) && {
+      return std::move(set_stats(stats));
+    }
+
+    // Specifies a RecordTracer which collects timelines of reading, decoding,
+    // and waiting for chunks. The RecordTracer must be kept alive until the
+    // RecordReader is closed.
+    //
+    // If nullptr, only static tracepoints are fired (if compiled in).
+    //
+    // Default: nullptr
+    Options& set_tracer(RecordTracer* tracer) & {
+      tracer_ = tracer;
+      return *this;
+    }
+    Options&& set_tracer(RecordTracer* tracer) && {
+      return std::move(set_tracer(tracer));
+    }
+
+    // Specifies Zstd dictionaries used to decompress chunks written with
+    // RecordWriter::Options::set_zstd_dictionary(). Dictionaries are looked up
+    // by ids stored in compressed data. The registry must be kept alive until
+    // the RecordReader is closed.
+    //
+    // If nullptr, reading chunks compressed with a dictionary fails.
+    //
+    // Default: nullptr
+    Options& set_zstd_dictionaries(
+        const ZstdDictionaryRegistry* zstd_dictionaries) & {
+      zstd_dictionaries_ = zstd_dictionaries;
+      return *this;
+    }
+    Options&& set_zstd_dictionaries(
+        const ZstdDictionaryRegistry* zstd_dictionaries) && {
+      return std::move(set_zstd_dictionaries(zstd_dictionaries));
+    }
+
+    // Specifies a predicate telling whether a chunk, described by its
+    // ChunkIndex entry, might contain interesting records. Chunks for which it
+    // returns false are skipped without reading them, and their records are
+    // not returned.
+    //
+    // The filter applies only after ReadChunkIndex() succeeded. It can use
+    // ChunkIndex::Entry::field_ranges stored by RecordWriter with
+    // Options::set_chunk_index_fields(), e.g.
+    //
+    //   [](const ChunkIndex::Entry& entry) {
+    //     return entry.field_ranges[0].Overlaps(min_time, max_time);
+    //   }
+    //
+    // If nullptr, all chunks are read.
+    //
+    // Default: nullptr
+    Options& set_chunk_filter(
+        std::function<bool(const ChunkIndex::Entry&)> chunk_filter) & {
+      chunk_filter_ = std::move(chunk_filter);
+      return *this;
+    }
+    Options&& set_chunk_filter(
+        std::function<bool(const ChunkIndex::Entry&)> chunk_filter) && {
+      return std::move(set_chunk_filter(std::move(chunk_filter)));
+    }
+
+    // Specifies a ChunkCache holding decoded chunks, which may be shared with
+    // other RecordReaders. A chunk found in the cache is neither read nor
+    // decoded again. file_id identifies the file among files whose chunks are
+    // in the same cache; readers of the same file must use the same file_id.
+    // The cache must be kept alive until the RecordReader is closed.
+    //
+    // The cache is not used if the field filter excludes some fields, because
+    // then decoded chunks depend on the filter.
+    //
+    // If nullptr, chunks are not cached.
+    //
+    // Default: nullptr
+    Options& set_chunk_cache(ChunkCache* chunk_cache, std::string file_id) & {
+      chunk_cache_ = chunk_cache;
+      chunk_cache_file_id_ = std::move(file_id);
+      return *this;
+    }
+    Options&& set_chunk_cache(ChunkCache* chunk_cache, std::string file_id) && {
+      return std::move(set_chunk_cache(chunk_cache, std::move(file_id)));
+    }
+
+    // Specifies a BucketCache holding decompressed buckets of transposed
+    // chunks, which may be shared with other RecordReaders. It is used only if
+    // the field filter excludes some fields, complementing set_chunk_cache():
+    // reading the same chunks again with a field filter, e.g. with a different
+    // filter, does not decompress their buckets again. The cache must be kept
+    // alive until the RecordReader is closed.
+    //
+    // If nullptr, buckets are not cached.
+    //
+    // Default: nullptr
+    Options& set_bucket_cache(BucketCache* bucket_cache) & {
+      bucket_cache_ = bucket_cache;
+      return *this;
+    }
+    Options&& set_bucket_cache(BucketCache* bucket_cache) && {
+      return std::move(set_bucket_cache(bucket_cache));
+    }
+
+    // Specifies a function called by ReadRecord() and ReadRecords() when the
+    // file ends but more data may be appended to it, e.g. by a RecordWriter
+    // calling Flush(). It should block until more data may be available and
+    // return true to retry reading, or return false to let reading return false
+    // as usual at the end of the file.
+    //
+    // Reading is resumed where it stopped: data already read are not read or
+    // verified again, and an incomplete chunk at the end of the file is kept
+    // until the rest of it is appended.
+    //
+    // FdGrowthWaiter::Wait() is a suitable building block for following a file
+    // without polling it at a high rate.
+    //
+    // If nullptr, reading returns false at the end of the file.
+    //
+    // Default: nullptr
+    Options& set_tail_wait(std::function<bool()> tail_wait) & {
+      tail_wait_ = std::move(tail_wait);
+      return *this;
+    }
+    Options&& set_tail_wait(std::function<bool()> tail_wait) && {
+      return std::move(set_tail_wait(std::move(tail_wait)));
+    }
+
+    // Resumes reading from a checkpoint saved by RecordReader::checkpoint()
+    // for the same file: the RecordReader starts at checkpoint.pos(), and
+    // does not verify the file signature again if it was verified.
+    //
+    // A checkpoint inside a chunk still needs the chunk to be read and
+    // decoded, unless a ChunkCache given to set_chunk_cache() holds it.
+    //
+    // Default: none (reading starts at the current position of the byte
+    // Reader)
+    Options& set_checkpoint(const RecordReaderCheckpoint& checkpoint) & {
+      checkpoint_ = checkpoint;
+      has_checkpoint_ = true;
+      return *this;
+    }
+    Options&& set_checkpoint(const RecordReaderCheckpoint& checkpoint) && {
+      return std::move(set_checkpoint(checkpoint));
+    }
+
    private:
     friend class RecordReader;
 
     bool skip_errors_ = false;
+    bool verify_data_hashes_ = true;
     FieldFilter field_filter_ = FieldFilter::All();
+    int parallelism_ = 0;
+    int decompression_parallelism_ = 0;
+    size_t streaming_block_size_ = 0;
+    bool flat_values_ = false;
+    ThreadPool* thread_pool_ = nullptr;
+    const google::protobuf::MessageLite* parse_prototype_ = nullptr;
+    RecordStats* stats_ = nullptr;
+    RecordTracer* tracer_ = nullptr;
+    const ZstdDictionaryRegistry* zstd_dictionaries_ = nullptr;
+    std::function<bool(const ChunkIndex::Entry&)> chunk_filter_;
+    ChunkCache* chunk_cache_ = nullptr;
+    std::string chunk_cache_file_id_;
+    BucketCache* bucket_cache_ = nullptr;
+    std::function<bool()> tail_wait_;
+    bool has_checkpoint_ = false;
+    RecordReaderCheckpoint checkpoint_;
   };
 
   // Creates a closed RecordReader.
@@ -120,6 +480,20 @@ class RecordReader final : public Object {
   RecordReader(RecordReader&& src) noexcept;
   RecordReader& operator=(RecordReader&& src) noexcept;
 
+  // Closes the RecordReader if it is open, then makes it read from another
+  // byte Reader like a newly constructed RecordReader. This reuses the chunk
+  // decoder with memory allocated for the previous file, e.g. the parsed state
+  // machine of transposed chunks and buffers of records, which makes reading
+  // many short files cheaper.
+  //
+  // Return values:
+  //  * true  - success (the new byte Reader is used, which is reflected by
+  //            healthy() as after construction)
+  //  * false - closing the previous byte Reader failed (!healthy(),
+  //            the new byte Reader is not used)
+  bool Reset(std::unique_ptr<Reader> byte_reader, Options options = Options());
+  bool Reset(Reader* byte_reader, Options options = Options());
+
   // Reads the next record.
   //
   // ReadRecord(MessageLite*) parses raw bytes to a proto message after reading.
@@ -127,6 +501,11 @@ class RecordReader final : public Object {
   // string_view is valid until the next non-const operation on this
   // RecordReader.
   //
+  // Reading raw bytes of uncompressed chunks written with set_transpose(false)
+  // does not copy them if the byte Reader does not copy them either, e.g. if
+  // it is an FdMMapReader, except for records crossing a boundary of a 64 KiB
+  // block of the file.
+  //
   // If key != nullptr, *key is set to the canonical record position on success.
   //
   // Return values:
@@ -138,11 +517,128 @@ class RecordReader final : public Object {
   bool ReadRecord(std::string* record, RecordPosition* key = nullptr);
   bool ReadRecord(Chain* record, RecordPosition* key = nullptr);
 
+  // Like ReadRecord(MessageLite*), but string or bytes fields specified by
+  // *aliased_fields, e.g. large image payloads, are not copied into *record.
+  // Their values are stored in aliased_fields->values() as Chains sharing
+  // memory with decoded record values, which stays alive as long as the values
+  // do, even after this RecordReader moves to another chunk or is closed.
+  //
+  // If aliased_fields == nullptr, this is equivalent to
+  // ReadRecord(MessageLite*).
+  //
+  // Return values are as for ReadRecord().
+  bool ReadRecordAliasing(google::protobuf::MessageLite* record,
+                          AliasedFields* aliased_fields,
+                          RecordPosition* key = nullptr);
+
+  // Reads the next record, parsing it to a new proto message of the same type
+  // as prototype, allocated on arena. Submessages and strings of the message
+  // are allocated on arena too, which avoids per-field heap allocations.
+  //
+  // If arena is nullptr, the message is allocated on the heap and is owned by
+  // the caller. Otherwise it is owned by arena, and the caller may reset arena
+  // e.g. after processing each batch of records.
+  //
+  // If key != nullptr, *key is set to the canonical record position on success.
+  //
+  // Return values:
+  //  * true                    - success (*record is set)
+  //  * false (when healthy())  - source ends
+  //  * false (when !healthy()) - failure
+  bool ReadRecord(const google::protobuf::MessageLite& prototype,
+                  google::protobuf::Arena* arena,
+                  google::protobuf::MessageLite** record,
+                  RecordPosition* key = nullptr);
+
+  // Reads the next record as a new proto message of the same type as
+  // Options::set_parse_prototype(), owned by the caller.
+  //
+  // With parallelism > 0 the message has usually been parsed in the
+  // background, and it is handed out without copying.
+  //
+  // If key != nullptr, *key is set to the canonical record position on success.
+  //
+  // Precondition: Options::set_parse_prototype() was not nullptr
+  //
+  // Return values:
+  //  * true                    - success (*record is set)
+  //  * false (when healthy())  - source ends
+  //  * false (when !healthy()) - failure
+  bool ReadRecord(std::unique_ptr<google::protobuf::MessageLite>* record,
+                  RecordPosition* key = nullptr);
+
+  // Reads the next record incrementally from the returned Reader, e.g. a record
+  // too large to be kept in memory, written with RecordWriter::BeginRecord().
+  //
+  // Fragments of such a record are read and decompressed one chunk at a time as
+  // the Reader is read. Other records are read whole, and are returned through
+  // a Reader too. Other reading functions join the fragments instead.
+  //
+  // The returned Reader is owned by this RecordReader, and is valid until the
+  // next non-const operation on this RecordReader. If it is not read to its
+  // end, the rest of the record is skipped by the next read.
+  //
+  // If key != nullptr, *key is set to the canonical record position on success.
+  //
+  // Return values:
+  //  * non-nullptr               - success
+  //  * nullptr (when healthy())  - source ends
+  //  * nullptr (when !healthy()) - failure
+  Reader* ReadRecordStream(RecordPosition* key = nullptr);
+
+  // Reads up to max_num_records next records as raw bytes, replacing the
+  // contents of *records. This is faster than reading them one by one.
+  //
+  // Records are taken from a single chunk, so fewer than max_num_records
+  // records can be returned even if the source does not end. The string_views
+  // are valid until the next non-const operation on this RecordReader.
+  //
+  // If first_key != nullptr, *first_key is set to the canonical record
+  // position of the first record on success. Following records have
+  // consecutive record indices within the same chunk.
+  //
+  // Precondition: max_num_records > 0
+  //
+  // Return values:
+  //  * true                    - success (*records is not empty)
+  //  * false (when healthy())  - source ends
+  //  * false (when !healthy()) - failure
+  bool ReadRecords(size_t max_num_records,
+                   std::vector<absl::string_view>* records,
+                   RecordPosition* first_key = nullptr);
+
+  // Like ReadRecords(), but instead of collecting the records, calls
+  // function(absl::string_view record) for each of them. The string_view is
+  // valid only during the call, and function must not use this RecordReader.
+  //
+  // This is the fastest way to scan raw records: the per-record loop is
+  // instantiated for function, so the compiler can inline it and the decoder
+  // steps between records, without a call per record through ReadRecord().
+  //
+  // Precondition: max_num_records > 0
+  //
+  // Return values:
+  //  * true                    - success (function was called at least once)
+  //  * false (when healthy())  - source ends
+  //  * false (when !healthy()) - failure
+  template <typename Function>
+  bool ForEachRecord(size_t max_num_records, Function&& function,
+                     RecordPosition* first_key = nullptr);
+
   // Returns true if reading from the current position might succeed, possibly
   // after some data is appended to the source. Returns false if reading from
   // the current position will always return false.
   bool HopeForMore() const;
 
+  // Returns true if the next ReadRecord() or ReadRecords() would not wait for a
+  // chunk being decoded in the background (with parallelism > 0). If chunks are
+  // not being decoded, starts reading chunks ahead and decoding them first.
+  //
+  // Together with a non-blocking byte Reader (see HopeForMore()), this lets an
+  // event loop or a coroutine scheduler read records without blocking a thread:
+  // if false, the caller should retry later instead of reading.
+  bool ReadyToRead();
+
   // Returns the current position.
   //
   // pos().numeric() returns the position as an integer of type Position.
@@ -169,6 +665,91 @@ class RecordReader final : public Object {
   bool Seek(RecordPosition new_pos);
   bool Seek(Position new_pos);
 
+  // Returns the state needed to resume reading at pos() with
+  // Options::set_checkpoint(), possibly in another process.
+  RecordReaderCheckpoint checkpoint() const;
+
+  // Returns an independent RecordReader for the same file, reading from
+  // byte_reader and starting at pos(). This is cheaper than opening the file
+  // again, so that many threads can read the same file, each with its own
+  // clone.
+  //
+  // The clone has the same options, shares the ChunkCache and the chunk index
+  // read by ReadChunkIndex() (which stay valid as long as the file is not
+  // appended to), and does not verify the file signature again.
+  //
+  // byte_reader can share the file descriptor of the original byte Reader
+  // without sharing its file position, e.g. an FdReader created with
+  // FdReader::Options().set_owns_fd(false), which reads with pread().
+  //
+  // The first overload: the byte Reader is owned by the clone.
+  //
+  // The second overload: the byte Reader is not owned by the clone and must be
+  // kept alive but not accessed until closing the clone.
+  //
+  // If !healthy(), the clone fails with the same message.
+  RecordReader Clone(std::unique_ptr<Reader> byte_reader) const;
+  RecordReader Clone(Reader* byte_reader) const;
+
+  // Seeks to the previous record, i.e. the record before pos().
+  //
+  // Within a chunk this only moves the record index of the decoded chunk.
+  // Crossing to the previous chunk locates its beginning using block headers,
+  // which point back to the beginning of the chunk they are in, and decodes
+  // it. Chunks are read synchronously even with Options::set_parallelism(),
+  // because reading ahead goes forwards.
+  //
+  // This lets the end of a large file be read without scanning it, e.g.:
+  //
+  //   Position size;
+  //   if (!reader.Size(&size) || !reader.Seek(size)) ...
+  //   std::string record;
+  //   while (n-- > 0 && reader.ReadPreviousRecord(&record)) ...
+  //
+  // Return values:
+  //  * true                    - success
+  //  * false (when healthy())  - there is no previous record or seeking
+  //                              backwards is not supported (position is
+  //                              unchanged)
+  //  * false (when !healthy()) - failure
+  bool SeekBack();
+
+  // Reads the previous record, i.e. SeekBack() followed by ReadRecord(),
+  // leaving the position before the record read. Calling this repeatedly reads
+  // records in the reverse order.
+  //
+  // If key != nullptr, *key is set to the canonical record position on success.
+  //
+  // Return values:
+  //  * true                    - success (*record is set)
+  //  * false (when healthy())  - there is no previous record or seeking
+  //                              backwards is not supported
+  //  * false (when !healthy()) - failure
+  bool ReadPreviousRecord(absl::string_view* record,
+                          RecordPosition* key = nullptr);
+  bool ReadPreviousRecord(std::string* record, RecordPosition* key = nullptr);
+  bool ReadPreviousRecord(Chain* record, RecordPosition* key = nullptr);
+
+  // Reads records at multiple positions, replacing the contents of *records
+  // with records in the order of positions. Positions may repeat.
+  //
+  // This is faster than Seek() and ReadRecord() for each position: positions
+  // are visited in the order of the file, so each chunk containing requested
+  // records is read and decoded once, and chunks are read forwards, which lets
+  // consecutive chunks be read ahead with Options::set_parallelism().
+  //
+  // Positions should have been obtained by pos() or ReadRecord() for the same
+  // file. Afterwards the current position is after the last record read in the
+  // order of the file.
+  //
+  // Return values:
+  //  * true                    - success
+  //                              (records->size() == positions.size())
+  //  * false (when healthy())  - source ends before some position
+  //  * false (when !healthy()) - failure
+  bool ReadRecordsAt(absl::Span<const RecordPosition> positions,
+                     std::vector<std::string>* records);
+
   // Returns the size of the file, i.e. the position corresponding to its end.
   //
   // Return values:
@@ -176,21 +757,129 @@ class RecordReader final : public Object {
   //  * false - failure (healthy() is unchanged)
   bool Size(Position* size) const;
 
-#if 0
-  // Searches the region between the current position and end of file for a
-  // desired record. What is desired is specified by a function, which should
-  // read a record and set the argument pointer to a value < 0, == 0, or > 0,
-  // depending on whether the record read is before, among, or after desired
-  // records. If it returns false, the search is aborted.
+  // Reads the ChunkIndex written as the last chunk of the file by RecordWriter
+  // with Options::set_chunk_index(true). The current position is preserved.
+  //
+  // Afterwards chunk_index() is available, SeekToRecordOrdinal() can be used,
+  // and Seek(Position) locates chunks using the index instead of reading chunk
+  // headers. The index is valid as long as the file is not appended to.
+  //
+  // Return values:
+  //  * true                    - success (chunk_index() != nullptr)
+  //  * false (when healthy())  - the file does not end with a chunk index or
+  //                              its size is unknown
+  //  * false (when !healthy()) - failure
+  bool ReadChunkIndex();
+
+  // Reads the FileSummary written as the last chunk of the file by
+  // RecordWriter with Options::set_file_summary(true). The current position is
+  // preserved.
+  //
+  // This costs one seek and a small read, and does not require reading the
+  // chunk index.
   //
-  // If a desired record has been found, the position is left before the first
-  // desired record, otherwise it is left at end of file. If found != nullptr,
-  // then *found is set to true if the desired record has been found, or false
-  // if it has not been found or the search was aborted.
+  // Return values:
+  //  * true                    - success (*summary is set)
+  //  * false (when healthy())  - the file does not end with a summary or its
+  //                              size is unknown
+  //  * false (when !healthy()) - failure
+  bool ReadFileSummary(FileSummary* summary);
+
+  // Returns the ChunkIndex read by ReadChunkIndex(), or nullptr if it has not
+  // been read.
+  const ChunkIndex* chunk_index() const { return chunk_index_.get(); }
+
+  // Seeks to the record with the given ordinal, i.e. the number of records
+  // preceding it in the file.
   //
-  // TODO: This is not implemented yet.
-  bool Search(std::function<bool(int*)>, bool* found);
-#endif
+  // Precondition: chunk_index() != nullptr
+  //
+  // Return values:
+  //  * true                    - success
+  //  * false (when healthy())  - record_ordinal >= chunk_index()->num_records()
+  //                              (position is set to the end)
+  //  * false (when !healthy()) - failure
+  bool SeekToRecordOrdinal(uint64_t record_ordinal);
+
+  // Seeks to the first record whose key is not less than key, using first keys
+  // of chunks stored in the chunk index by RecordWriter with
+  // Options::set_key_function(). key_function must extract keys like the one
+  // given to the RecordWriter. At most one chunk is decoded, and none if key
+  // filters stored with RecordWriter::Options::set_key_filter_bits_per_key()
+  // rule out the chunk.
+  //
+  // Precondition: chunk_index() != nullptr && chunk_index()->has_keys()
+  //
+  // Return values:
+  //  * true                    - success (the next record has the given key)
+  //  * false (when healthy())  - there is no record with the given key
+  //                              (position is set to the first record with a
+  //                              greater key, or to the end; if a key filter
+  //                              ruled out the key, position is unchanged)
+  //  * false (when !healthy()) - failure
+  bool Lookup(
+      absl::string_view key,
+      const std::function<std::string(absl::string_view record)>& key_function);
+
+  // Restricts reading to records of chunks beginning in [begin, end), and
+  // seeks to the first chunk beginning at or after begin. Afterwards
+  // ReadRecord() returns false (when healthy()) instead of reading a chunk
+  // beginning at or after end, as if the file ended there. The restriction
+  // stays in effect after Seek().
+  //
+  // begin and end can be any positions, not necessarily chunk boundaries, so
+  // adjacent ranges read each record exactly once. This allows to process one
+  // file in parallel by workers reading different ranges, e.g. between split
+  // points from FindSplitPoints().
+  //
+  // Return values:
+  //  * true                    - success
+  //  * false (when healthy())  - source ends before begin (position is set to
+  //                              the end)
+  //  * false (when !healthy()) - failure
+  bool SetReadRange(Position begin, Position end);
+
+  // Sets *split_points to positions dividing the file into at most num_splits
+  // ranges of similar sizes, for SetReadRange(). Split points are increasing
+  // chunk boundaries, beginning with 0 and ending with the file size. There
+  // are fewer ranges if the file is small, because ranges are aligned to
+  // blocks (64KB).
+  //
+  // Only one block header per split point is read, not whole chunks. The
+  // current position is preserved.
+  //
+  // Precondition: num_splits > 0
+  //
+  // Return values:
+  //  * true                    - success
+  //  * false (when healthy())  - the size of the file is unknown
+  //  * false (when !healthy()) - failure
+  bool FindSplitPoints(size_t num_splits, std::vector<Position>* split_points);
+
+  // Searches the region between the current position and end of file for
+  // desired records, in a file whose records are ordered so that test() is
+  // non-decreasing. test() returns a value < 0, == 0, or > 0, depending on
+  // whether the record is before, among, or after desired records.
+  //
+  // Chunks are located by bisecting the region by positions, testing the first
+  // record of a chunk at each probe, without needing a chunk index. With
+  // num_probes > 1, each round probes num_probes evenly spaced chunks, which
+  // are read together and decoded concurrently by the thread pool of
+  // Options::set_thread_pool(). This needs about log(num_probes + 1) times
+  // fewer rounds than bisection, which helps if reading a chunk has a high
+  // latency, especially with a byte Reader which reads ahead like RangeReader.
+  //
+  // Precondition: num_probes > 0
+  //
+  // Return values:
+  //  * true                    - success (position is set to the first desired
+  //                              record)
+  //  * false (when healthy())  - there is no desired record (position is set to
+  //                              the first record after desired records, or to
+  //                              the end)
+  //  * false (when !healthy()) - failure
+  bool Search(const std::function<int(absl::string_view record)>& test,
+              size_t num_probes = 1);
 
   // Returns the number of bytes skipped because of corrupted regions or
   // unparsable records.
@@ -201,35 +890,213 @@ class RecordReader final : public Object {
   // chunk size.
   Position skipped_bytes() const;
 
+  // Estimates the amount of memory used by this RecordReader, including the
+  // current chunk, chunks read ahead, the chunk index, and the ChunkReader and
+  // byte Reader.
+  //
+  // Chunks being decoded in the background are counted by their encoded size,
+  // because their decoders are not accessible until decoding finishes. The
+  // ChunkCache is shared between readers and is not included.
+  size_t EstimateMemory() const;
+  // Registers this RecordReader with MemoryEstimator.
+  void AddUniqueTo(MemoryEstimator* memory_estimator) const;
+
  protected:
   void Done() override;
 
  private:
-  RecordReader(std::unique_ptr<ChunkReader> chunk_reader, Options options);
+  // A chunk read ahead, being decoded in the background.
+  struct DecodingChunk {
+    Position chunk_begin;
+    Position chunk_end;
+    std::future<ChunkDecoder> chunk_decoder;
+    // Valid if parse_prototype_ != nullptr.
+    std::future<std::vector<std::unique_ptr<google::protobuf::MessageLite>>>
+        parsed_records;
+  };
+
+  class RecordStreamReader;
+
+  // Reuses chunk_decoder, resetting it to options.
+  RecordReader(std::unique_ptr<ChunkReader> chunk_reader, Options options,
+               ChunkDecoder chunk_decoder);
+
+  // Used by Clone().
+  RecordReader(std::unique_ptr<ChunkReader> chunk_reader,
+               const RecordReader& src);
 
   // Precondition: chunk_decoder_.index() == chunk_decoder_.num_records()
-  bool ReadRecordSlow(google::protobuf::MessageLite* record, RecordPosition* key,
+  bool ReadRecordSlow(google::protobuf::MessageLite* record,
+                      AliasedFields* aliased_fields, RecordPosition* key,
                       uint64_t index_before);
   template <typename Record>
   bool ReadRecordSlow(Record* record, RecordPosition* key);
 
-  // Reads the next chunk from chunk_reader_ and decodes it into chunk_decoder_
-  // and chunk_begin_. On failure resets chunk_decoder_.
-  bool ReadChunk();
+  template <typename Record>
+  bool ReadPreviousRecordImpl(Record* record, RecordPosition* key);
+
+  // Reads the next chunk from chunk_reader_ and decodes it into chunk_decoder_,
+  // chunk_begin_, and chunk_end_. On failure resets chunk_decoder_.
+  //
+  // If read_ahead is false, the chunk is read synchronously even if
+  // parallelism_ > 0, because following chunks will not be needed.
+  bool ReadChunk(bool read_ahead = true);
+
+  // Like ReadChunk(), but if the file ends and more data may be appended,
+  // waits using tail_wait_ and retries.
+  bool ReadNextChunk();
+
+  // Joins the first fragment of a record in chunk_decoder_ with its following
+  // fragments, making chunk_decoder_ hold the whole record, as if it was a
+  // chunk from chunk_begin_ to chunk_end_ of the last fragment.
+  //
+  // Precondition: chunk_decoder_.record_continues()
+  //
+  // Return values are as for ReadChunk().
+  bool JoinFragments();
+
+  // Reads the next fragment of a record being read by record_stream_.
+  //
+  // Return values:
+  //  * true                    - success
+  //  * false (when healthy())  - source ends, or the next chunk does not
+  //                              continue the record
+  //  * false (when !healthy()) - failure
+  bool ReadFragment(Chain* fragment, bool* last);
+
+  // Reads a chunk from chunk_reader_, registering it in stats_ if counters are
+  // being collected. Chunks rejected by chunk_filter_ are skipped first.
+  //
+  // If verify_data_hash is false, the hash of chunk data is left to be
+  // verified by the ChunkDecoder.
+  bool ReadChunkFromReader(Chunk* chunk, Position* chunk_begin,
+                           bool verify_data_hash = true);
+
+  // Moves chunk_reader_ over chunks rejected by chunk_filter_, if
+  // chunk_index_ has been read.
+  bool SkipFilteredChunks();
+
+  // Takes the chunk at chunk_reader_->pos() from chunk_cache_ if it is there,
+  // setting chunk_decoder_, chunk_begin_, and chunk_end_, and moving
+  // chunk_reader_ after the chunk.
+  //
+  // Return values:
+  //  * true  - the chunk was taken from the cache
+  //  * false - the chunk should be read from chunk_reader_
+  bool ReadChunkFromCache();
+
+  // Adds the current chunk to chunk_cache_ if it is used.
+  void AddChunkToCache();
+
+  // Calls chunk_decoder->Reset(chunk), measuring time in stats if
+  // stats != nullptr, and tracing it in tracer if tracer != nullptr. Used also
+  // by background tasks.
+  static bool DecodeChunk(RecordStats* stats, RecordTracer* tracer,
+                          Position chunk_begin, const Chunk& chunk,
+                          ChunkDecoder* chunk_decoder);
+
+  // Parses records of the whole chunk decoded by chunk_decoder as new messages
+  // of the same type as prototype, leaving nullptr for records which failed to
+  // parse. Returns an empty vector if the whole chunk is not available. Used by
+  // background tasks.
+  static std::vector<std::unique_ptr<google::protobuf::MessageLite>>
+  ParseChunk(const google::protobuf::MessageLite& prototype,
+             const ChunkDecoder& chunk_decoder);
+
+  // Reads chunks beginning at probes for Search() and decodes them, in the
+  // background if there are several, setting (*chunk_decoders)[i] to the
+  // decoder of the chunk at probes[i], ready when ReadProbes() returns, and
+  // (*probe_ends)[i] to the end of that chunk.
+  bool ReadProbes(const std::vector<Position>& probes,
+                  std::vector<std::future<ChunkDecoder>>* chunk_decoders,
+                  std::vector<Position>* probe_ends);
+
+  // Reads chunks from chunk_reader_ and schedules decoding them in the
+  // background, until parallelism_ chunks are pending or chunk_reader_ has no
+  // more chunks available.
+  void ReadChunksAhead();
+
+  // Discards chunks read ahead, after waiting for their background tasks.
+  //
+  // Background tasks use stats_, tracer_, parse_prototype_, and Zstd
+  // dictionaries and the bucket cache from chunk_decoder_options_, which are
+  // owned by the caller and may be destroyed as soon as the RecordReader is
+  // closed, so the tasks must not outlive the chunks they decode.
+  void DiscardDecodingChunks();
+  void DiscardFirstDecodingChunk();
 
   // Invariant: if healthy() then chunk_reader_ != nullptr
   std::unique_ptr<ChunkReader> chunk_reader_;
   bool skip_errors_ = false;
+  // If true, chunks read ahead have their data hashes verified in the
+  // background together with decoding, instead of by chunk_reader_.
+  bool verify_data_hashes_ = true;
+  int parallelism_ = 0;
+  // Used if parallelism_ > 0. If nullptr, internal::DefaultThreadPool() is
+  // used.
+  ThreadPool* thread_pool_ = nullptr;
+  // If not nullptr, chunks decoded in the background are parsed there too.
+  const google::protobuf::MessageLite* parse_prototype_ = nullptr;
+  // nullptr if chunks are not cached.
+  ChunkCache* chunk_cache_ = nullptr;
+  std::string chunk_cache_file_id_;
+  // Options for ChunkDecoders created in the background, used if
+  // parallelism_ > 0.
+  ChunkDecoder::Options chunk_decoder_options_;
+  // nullptr if counters are not being collected.
+  RecordStats* stats_ = nullptr;
+  // nullptr if timelines are not being collected.
+  RecordTracer* tracer_ = nullptr;
+  // nullptr if all chunks are read.
+  std::function<bool(const ChunkIndex::Entry&)> chunk_filter_;
+  // nullptr if reading does not wait for data appended to the file.
+  std::function<bool()> tail_wait_;
+  // If true, the chunk at the beginning of the file was read and verified as
+  // the file signature, here or by the RecordReader which saved the checkpoint
+  // this one resumed from.
+  bool file_signature_verified_ = false;
   // Position of the beginning of the current chunk or end of file, except when
   // Seek(Position) failed to locate the chunk containing the position, in which
   // case this is that position.
   Position chunk_begin_ = 0;
+  // Position of the end of the current chunk, or chunk_begin_ if there is no
+  // current chunk.
+  //
+  // Invariant: if decoding_chunks_.empty() then
+  //                chunk_end_ == chunk_reader_->pos()
+  Position chunk_end_ = 0;
   // Current chunk if a chunk has been read, empty otherwise.
   //
   // Invariants:
   //   if healthy() then chunk_decoder_.healthy()
   //   if !healthy() then chunk_decoder_.index() == chunk_decoder_.num_records()
   ChunkDecoder chunk_decoder_;
+  // Chunks following the current chunk, read ahead and being decoded in the
+  // background, at most parallelism_ of them.
+  //
+  // Invariant: if !decoding_chunks_.empty() then
+  //                decoding_chunks_.back().chunk_end == chunk_reader_->pos()
+  std::deque<DecodingChunk> decoding_chunks_;
+  // If true, ReadChunk() leaves the first fragment of a record in
+  // chunk_decoder_ instead of joining fragments, for ReadRecordStream().
+  bool streaming_record_ = false;
+  // The Reader returned by ReadRecordStream(), or nullptr.
+  std::unique_ptr<Reader> record_stream_;
+  // Records of the chunk beginning at parsed_chunk_begin_, parsed in the
+  // background, indexed by record index. Elements are nullptr for records
+  // which were not parsed or were already handed out.
+  Position parsed_chunk_begin_ = 0;
+  std::vector<std::unique_ptr<google::protobuf::MessageLite>> parsed_records_;
+  // Set by ReadChunkIndex(), nullptr if the index has not been read. Shared
+  // with clones.
+  std::shared_ptr<const ChunkIndex> chunk_index_;
+  // Position of the index chunk, set together with chunk_index_. Chunks after
+  // the last entry of chunk_index_ and before the index chunk contain no
+  // records.
+  Position chunk_index_begin_ = 0;
+  // Chunks beginning at or after this position are not read, set by
+  // SetReadRange().
+  Position range_end_ = std::numeric_limits<Position>::max();
   // The number of bytes skipped because of corrupted regions or unparsable
   // records, in addition to chunk_reader_->skipped_bytes().
   Position skipped_bytes_ = 0;
@@ -239,8 +1106,15 @@ class RecordReader final : public Object {
 
 inline bool RecordReader::ReadRecord(google::protobuf::MessageLite* record,
                                      RecordPosition* key) {
+  return ReadRecordAliasing(record, nullptr, key);
+}
+
+inline bool RecordReader::ReadRecordAliasing(
+    google::protobuf::MessageLite* record, AliasedFields* aliased_fields,
+    RecordPosition* key) {
   const uint64_t index_before = chunk_decoder_.index();
-  if (ABSL_PREDICT_TRUE(chunk_decoder_.ReadRecord(record))) {
+  if (ABSL_PREDICT_TRUE(
+          chunk_decoder_.ReadRecordAliasing(record, aliased_fields))) {
     RIEGELI_ASSERT_GT(chunk_decoder_.index(), index_before)
         << "ChunkDecoder::ReadRecord() did not increment record index";
     if (key != nullptr) {
@@ -252,7 +1126,7 @@ inline bool RecordReader::ReadRecord(google::protobuf::MessageLite* record,
     }
     return true;
   }
-  return ReadRecordSlow(record, key, index_before);
+  return ReadRecordSlow(record, aliased_fields, key, index_before);
 }
 
 inline bool RecordReader::ReadRecord(absl::string_view* record,
@@ -292,9 +1166,54 @@ inline bool RecordReader::ReadRecord(Chain* record, RecordPosition* key) {
   return ReadRecordSlow(record, key);
 }
 
+template <typename Function>
+bool RecordReader::ForEachRecord(size_t max_num_records, Function&& function,
+                                 RecordPosition* first_key) {
+  RIEGELI_ASSERT_GT(max_num_records, 0u)
+      << "Failed precondition of RecordReader::ForEachRecord(): "
+         "no records requested";
+  for (;;) {
+    while (chunk_decoder_.index() == chunk_decoder_.num_records()) {
+      if (ABSL_PREDICT_FALSE(!healthy())) return false;
+      RIEGELI_ASSERT(chunk_decoder_.healthy())
+          << "ChunkDecoder::ForEachRecord() made ChunkDecoder unhealthy "
+             "but RecordReader is healthy";
+      if (ABSL_PREDICT_FALSE(!ReadNextChunk())) return false;
+    }
+    if (first_key != nullptr) {
+      *first_key = RecordPosition(chunk_begin_, chunk_decoder_.index());
+    }
+    if (ABSL_PREDICT_TRUE(chunk_decoder_.ForEachRecord(max_num_records,
+                                                       function) > 0)) {
+      return true;
+    }
+    // A block of record values could not be decompressed. If skip_errors is
+    // true, the rest of the chunk was skipped.
+    if (ABSL_PREDICT_FALSE(!chunk_decoder_.healthy())) {
+      return Fail(chunk_decoder_);
+    }
+  }
+}
+
+inline bool RecordReader::ReadPreviousRecord(absl::string_view* record,
+                                             RecordPosition* key) {
+  return ReadPreviousRecordImpl(record, key);
+}
+
+inline bool RecordReader::ReadPreviousRecord(std::string* record,
+                                             RecordPosition* key) {
+  return ReadPreviousRecordImpl(record, key);
+}
+
+inline bool RecordReader::ReadPreviousRecord(Chain* record,
+                                             RecordPosition* key) {
+  return ReadPreviousRecordImpl(record, key);
+}
+
 inline bool RecordReader::HopeForMore() const {
   return chunk_decoder_.index() < chunk_decoder_.num_records() ||
-         (healthy() && chunk_reader_->HopeForMore());
+         (healthy() &&
+          (!decoding_chunks_.empty() || chunk_reader_->HopeForMore()));
 }
 
 inline RecordPosition RecordReader::pos() const {
@@ -302,7 +1221,11 @@ inline RecordPosition RecordReader::pos() const {
                         chunk_decoder_.num_records())) {
     return RecordPosition(chunk_begin_, chunk_decoder_.index());
   }
-  return RecordPosition(chunk_reader_->pos(), 0);
+  return RecordPosition(chunk_end_, 0);
+}
+
+inline RecordReaderCheckpoint RecordReader::checkpoint() const {
+  return RecordReaderCheckpoint(pos(), file_signature_verified_);
 }
 
 inline bool RecordReader::Size(Position* size) const {
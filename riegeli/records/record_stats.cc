@@ -0,0 +1,269 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/record_stats.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+
+#include "absl/base/optimization.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/port.h"
+#include "riegeli/bytes/chain_reader.h"
+#include "riegeli/bytes/reader_utils.h"
+#include "riegeli/bytes/writer.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/types.h"
+
+namespace riegeli {
+
+constexpr size_t LatencyHistogram::kNumBuckets;
+
+uint64_t LatencyHistogram::bucket_count(size_t index) const {
+  RIEGELI_ASSERT_LT(index, kNumBuckets)
+      << "Failed precondition of LatencyHistogram::bucket_count(): "
+         "index out of range";
+  return Get(buckets_[index]);
+}
+
+uint64_t LatencyHistogram::Percentile(double fraction) const {
+  RIEGELI_ASSERT(fraction >= 0.0 && fraction <= 1.0)
+      << "Failed precondition of LatencyHistogram::Percentile(): "
+         "fraction out of range";
+  uint64_t total = 0;
+  for (const std::atomic<uint64_t>& bucket : buckets_) total += Get(bucket);
+  if (total == 0) return 0;
+  // The number of durations which must be covered, at least 1.
+  const uint64_t rank = std::max(
+      uint64_t{1},
+      static_cast<uint64_t>(std::ceil(fraction * static_cast<double>(total))));
+  uint64_t covered = 0;
+  for (size_t index = 0; index < kNumBuckets; ++index) {
+    covered += Get(buckets_[index]);
+    if (covered >= rank) {
+      // The upper bound of the bucket, capped by the largest duration.
+      const uint64_t upper_bound =
+          index == 0 ? uint64_t{0}
+                     : index == 64 ? std::numeric_limits<uint64_t>::max()
+                                   : (uint64_t{1} << index) - 1;
+      return std::min(upper_bound, max_nanos());
+    }
+  }
+  return max_nanos();
+}
+
+inline size_t LatencyHistogram::BucketIndex(uint64_t nanos) {
+  if (nanos == 0) return 0;
+#if RIEGELI_INTERNAL_HAS_BUILTIN(__builtin_clzll) || \
+    RIEGELI_INTERNAL_IS_GCC_VERSION(3, 4)
+  return IntCast<size_t>(64 - __builtin_clzll(nanos));
+#else
+  size_t index = 0;
+  while (nanos != 0) {
+    ++index;
+    nanos >>= 1;
+  }
+  return index;
+#endif
+}
+
+void LatencyHistogram::Reset() {
+  count_.store(0, std::memory_order_relaxed);
+  total_nanos_.store(0, std::memory_order_relaxed);
+  max_nanos_.store(0, std::memory_order_relaxed);
+  for (std::atomic<uint64_t>& bucket : buckets_) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+}
+
+void LatencyHistogram::Add(uint64_t nanos) {
+  count_.fetch_add(1, std::memory_order_relaxed);
+  total_nanos_.fetch_add(nanos, std::memory_order_relaxed);
+  uint64_t max_nanos = max_nanos_.load(std::memory_order_relaxed);
+  while (nanos > max_nanos &&
+         !max_nanos_.compare_exchange_weak(max_nanos, nanos,
+                                           std::memory_order_relaxed)) {
+  }
+  buckets_[BucketIndex(nanos)].fetch_add(1, std::memory_order_relaxed);
+}
+
+constexpr size_t RecordStats::kNumCompressionTypes;
+
+void RecordStats::Reset() {
+  for (std::atomic<uint64_t>* counter :
+       {&written_chunks_, &written_records_, &written_[0].decoded_bytes,
+        &written_[0].encoded_bytes, &written_[1].decoded_bytes,
+        &written_[1].encoded_bytes, &written_[2].decoded_bytes,
+        &written_[2].encoded_bytes, &written_[3].decoded_bytes,
+        &written_[3].encoded_bytes, &encode_nanos_, &write_nanos_,
+        &queue_wait_nanos_, &encode_wait_nanos_, &read_chunks_, &read_records_,
+        &read_[0].decoded_bytes, &read_[0].encoded_bytes,
+        &read_[1].decoded_bytes, &read_[1].encoded_bytes,
+        &read_[2].decoded_bytes, &read_[2].encoded_bytes,
+        &read_[3].decoded_bytes, &read_[3].encoded_bytes, &read_nanos_,
+        &decode_nanos_, &decode_wait_nanos_, &filtered_chunks_,
+        &skipped_bytes_}) {
+    counter->store(0, std::memory_order_relaxed);
+  }
+  for (LatencyHistogram* histogram :
+       {&encode_latency_, &write_latency_, &write_stall_latency_,
+        &flush_from_object_latency_, &flush_from_process_latency_,
+        &flush_from_machine_latency_}) {
+    histogram->Reset();
+  }
+}
+
+size_t RecordStats::Index(CompressionType compression_type) {
+  switch (compression_type) {
+    case CompressionType::kNone:
+      return 0;
+    case CompressionType::kBrotli:
+      return 1;
+    case CompressionType::kZstd:
+      return 2;
+    case CompressionType::kLz4:
+      return 3;
+  }
+  RIEGELI_ASSERT_UNREACHABLE()
+      << "Unknown compression type: "
+      << static_cast<unsigned>(compression_type);
+}
+
+LatencyHistogram RecordStats::*RecordStats::FlushLatency(
+    FlushType flush_type) {
+  switch (flush_type) {
+    case FlushType::kFromObject:
+      return &RecordStats::flush_from_object_latency_;
+    case FlushType::kFromProcess:
+      return &RecordStats::flush_from_process_latency_;
+    case FlushType::kFromMachine:
+      return &RecordStats::flush_from_machine_latency_;
+  }
+  RIEGELI_ASSERT_UNREACHABLE()
+      << "Unknown flush type: " << static_cast<int>(flush_type);
+}
+
+bool RecordStats::ChunkCompressionType(const Chunk& chunk,
+                                       CompressionType* compression_type) {
+  ChainReader data_reader(&chunk.data);
+  uint8_t chunk_type_byte;
+  if (ABSL_PREDICT_FALSE(!ReadByte(&data_reader, &chunk_type_byte))) {
+    return false;
+  }
+  switch (static_cast<ChunkType>(chunk_type_byte)) {
+    case ChunkType::kSimple:
+    case ChunkType::kBlockedSimple:
+    case ChunkType::kTransposed:
+      // The compression type follows the chunk type.
+      break;
+    case ChunkType::kFragment: {
+      // The compression type follows fragment flags.
+      uint8_t fragment_flags;
+      if (ABSL_PREDICT_FALSE(!ReadByte(&data_reader, &fragment_flags))) {
+        return false;
+      }
+      break;
+    }
+    case ChunkType::kDeduplicated:
+    case ChunkType::kDelta: {
+      // Most data are in the nested chunk of distinct or base records, which
+      // follows compressed references or patches. Its compression type follows
+      // its chunk type.
+      uint8_t outer_compression_type_byte;
+      uint64_t size;
+      if (ABSL_PREDICT_FALSE(
+              !ReadByte(&data_reader, &outer_compression_type_byte) ||
+              !ReadVarint64(&data_reader, &size) || !data_reader.Skip(size))) {
+        return false;
+      }
+      if (static_cast<ChunkType>(chunk_type_byte) ==
+          ChunkType::kDeduplicated) {
+        uint64_t num_distinct_records;
+        if (ABSL_PREDICT_FALSE(
+                !ReadVarint64(&data_reader, &num_distinct_records))) {
+          return false;
+        }
+      }
+      uint64_t decoded_data_size;
+      uint8_t nested_chunk_type_byte;
+      if (ABSL_PREDICT_FALSE(
+              !ReadVarint64(&data_reader, &decoded_data_size) ||
+              !ReadByte(&data_reader, &nested_chunk_type_byte))) {
+        return false;
+      }
+      switch (static_cast<ChunkType>(nested_chunk_type_byte)) {
+        case ChunkType::kSimple:
+        case ChunkType::kBlockedSimple:
+        case ChunkType::kTransposed:
+          break;
+        default:
+          return false;
+      }
+      break;
+    }
+    default:
+      // Unknown chunk type, or a chunk type whose data do not start with a
+      // compression type.
+      return false;
+  }
+  uint8_t compression_type_byte;
+  if (ABSL_PREDICT_FALSE(!ReadByte(&data_reader, &compression_type_byte))) {
+    return false;
+  }
+  // A transposed chunk with compression chosen per bucket is counted under the
+  // compression type of its header and transitions.
+  *compression_type = static_cast<CompressionType>(
+      compression_type_byte & ~internal::kPerBucketCompression());
+  switch (*compression_type) {
+    case CompressionType::kNone:
+    case CompressionType::kBrotli:
+    case CompressionType::kZstd:
+    case CompressionType::kLz4:
+      return true;
+  }
+  // Unknown compression type: decoding the chunk will fail.
+  return false;
+}
+
+void RecordStats::AddWrittenChunk(const Chunk& chunk) {
+  if (chunk.header.num_records() == 0) return;
+  Add(&written_chunks_, 1);
+  Add(&written_records_, chunk.header.num_records());
+  CompressionType compression_type;
+  if (ABSL_PREDICT_FALSE(!ChunkCompressionType(chunk, &compression_type))) {
+    return;
+  }
+  CompressedBytes& bytes = written_[Index(compression_type)];
+  Add(&bytes.decoded_bytes, chunk.header.decoded_data_size());
+  Add(&bytes.encoded_bytes, chunk.header.data_size());
+}
+
+void RecordStats::AddReadChunk(const Chunk& chunk) {
+  if (chunk.header.num_records() == 0) return;
+  Add(&read_chunks_, 1);
+  Add(&read_records_, chunk.header.num_records());
+  CompressionType compression_type;
+  if (ABSL_PREDICT_FALSE(!ChunkCompressionType(chunk, &compression_type))) {
+    return;
+  }
+  CompressedBytes& bytes = read_[Index(compression_type)];
+  Add(&bytes.decoded_bytes, chunk.header.decoded_data_size());
+  Add(&bytes.encoded_bytes, chunk.header.data_size());
+}
+
+}  // namespace riegeli
@@ -0,0 +1,276 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_RECORD_STATS_H_
+#define RIEGELI_RECORDS_RECORD_STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+
+#include "riegeli/base/base.h"
+#include "riegeli/bytes/writer.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/types.h"
+
+namespace riegeli {
+
+// LatencyHistogram counts durations of an operation in buckets of powers of 2
+// nanoseconds. It is a part of RecordStats.
+//
+// LatencyHistogram is thread-safe. Counters are read independently of each
+// other, so while samples are being added they do not form a consistent
+// snapshot.
+class LatencyHistogram {
+ public:
+  // The number of buckets. Bucket 0 counts durations of 0 ns, bucket i > 0
+  // counts durations in [2^(i-1), 2^i) ns.
+  static constexpr size_t kNumBuckets = 65;
+
+  LatencyHistogram() noexcept {}
+
+  LatencyHistogram(const LatencyHistogram&) = delete;
+  LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+  // The number of durations added.
+  uint64_t count() const { return Get(count_); }
+  // The sum of durations added.
+  uint64_t total_nanos() const { return Get(total_nanos_); }
+  // The largest duration added, or 0 if none.
+  uint64_t max_nanos() const { return Get(max_nanos_); }
+  // The number of durations in the given bucket.
+  //
+  // Precondition: index < kNumBuckets
+  uint64_t bucket_count(size_t index) const;
+
+  // Returns an upper bound of the duration below which the given fraction of
+  // durations lies, accurate to a factor of 2, or 0 if none were added.
+  //
+  // Precondition: 0.0 <= fraction <= 1.0
+  uint64_t Percentile(double fraction) const;
+
+ private:
+  friend class RecordStats;
+
+  static uint64_t Get(const std::atomic<uint64_t>& counter) {
+    return counter.load(std::memory_order_relaxed);
+  }
+
+  static size_t BucketIndex(uint64_t nanos);
+
+  void Reset();
+  void Add(uint64_t nanos);
+
+  std::atomic<uint64_t> count_{0};
+  std::atomic<uint64_t> total_nanos_{0};
+  std::atomic<uint64_t> max_nanos_{0};
+  std::atomic<uint64_t> buckets_[kNumBuckets] = {};
+};
+
+// RecordStats accumulates counters describing where RecordWriter and
+// RecordReader spend their work. It helps to tune options like chunk_size,
+// bucket_fraction, and parallelism.
+//
+// A RecordStats is attached with RecordWriter::Options::set_stats() or
+// RecordReader::Options::set_stats(), and must be kept alive until the writer
+// or reader is closed. It may be shared between several writers and readers.
+//
+// RecordStats is thread-safe. Counters are read independently of each other,
+// so while a writer or reader is active they do not form a consistent snapshot.
+//
+// Times are wall times in nanoseconds. With parallelism > 0, times of stages
+// running in the background overlap each other and the caller's work.
+class RecordStats {
+ public:
+  RecordStats() noexcept {}
+
+  RecordStats(const RecordStats&) = delete;
+  RecordStats& operator=(const RecordStats&) = delete;
+
+  // Sets all counters to 0.
+  void Reset();
+
+  // Counters of RecordWriter.
+
+  // The number of chunks containing records written.
+  uint64_t written_chunks() const { return Get(written_chunks_); }
+  // The number of records written.
+  uint64_t written_records() const { return Get(written_records_); }
+  // The sum of sizes of records (decoded) and of chunk data (encoded) of chunks
+  // written with the given compression type.
+  uint64_t written_decoded_bytes(CompressionType compression_type) const {
+    return Get(written_[Index(compression_type)].decoded_bytes);
+  }
+  uint64_t written_encoded_bytes(CompressionType compression_type) const {
+    return Get(written_[Index(compression_type)].encoded_bytes);
+  }
+  // Time of ChunkEncoder::EncodeAndClose(): transposition, compression, and
+  // hashing of the chunk data.
+  uint64_t encode_nanos() const { return Get(encode_nanos_); }
+  // Time of ChunkWriter::WriteChunk().
+  uint64_t write_nanos() const { return Get(write_nanos_); }
+  // With parallelism > 0: time WriteRecord() and Flush() waited for one of
+  // parallelism chunks being encoded or written to finish.
+  uint64_t queue_wait_nanos() const { return Get(queue_wait_nanos_); }
+  // With parallelism > 0: time the chunk writer thread waited for the next
+  // chunk to be encoded.
+  uint64_t encode_wait_nanos() const { return Get(encode_wait_nanos_); }
+
+  // Latency histograms of RecordWriter, for attributing spikes of tail latency
+  // to encoding or I/O.
+
+  // Times of encoding individual chunks, as included in encode_nanos().
+  const LatencyHistogram& encode_latency() const { return encode_latency_; }
+  // Times of writing individual chunks, as included in write_nanos().
+  const LatencyHistogram& write_latency() const { return write_latency_; }
+  // With parallelism > 0: times WriteRecord(), Flush(), or Close() stalled
+  // before a chunk could be queued because parallelism chunks were
+  // outstanding, as included in queue_wait_nanos().
+  const LatencyHistogram& write_stall_latency() const {
+    return write_stall_latency_;
+  }
+  // Times of RecordWriter::Flush() with the given FlushType, including closing
+  // the current chunk and, with parallelism > 0, waiting for pending chunks.
+  const LatencyHistogram& flush_latency(FlushType flush_type) const {
+    return this->*FlushLatency(flush_type);
+  }
+
+  // Counters of RecordReader.
+
+  // The number of chunks containing records read.
+  uint64_t read_chunks() const { return Get(read_chunks_); }
+  // The number of records in chunks read, including records skipped or not
+  // reached.
+  uint64_t read_records() const { return Get(read_records_); }
+  // The sum of sizes of records (decoded) and of chunk data (encoded) of chunks
+  // read with the given compression type.
+  uint64_t read_decoded_bytes(CompressionType compression_type) const {
+    return Get(read_[Index(compression_type)].decoded_bytes);
+  }
+  uint64_t read_encoded_bytes(CompressionType compression_type) const {
+    return Get(read_[Index(compression_type)].encoded_bytes);
+  }
+  // Time of ChunkReader::ReadChunk(): reading, hash verification, and
+  // recovery from skipped errors.
+  uint64_t read_nanos() const { return Get(read_nanos_); }
+  // Time of decompression and transposition of chunks, in ChunkDecoder.
+  uint64_t decode_nanos() const { return Get(decode_nanos_); }
+  // With parallelism > 0: time ReadRecord() and Seek() waited for a chunk
+  // being decoded in the background.
+  uint64_t decode_wait_nanos() const { return Get(decode_wait_nanos_); }
+  // The number of chunks skipped without reading them because of
+  // RecordReader::Options::set_chunk_filter().
+  uint64_t filtered_chunks() const { return Get(filtered_chunks_); }
+  // The number of bytes skipped because of corrupted regions or unparsable
+  // records, as RecordReader::skipped_bytes(), added when the reader is closed.
+  uint64_t skipped_bytes() const { return Get(skipped_bytes_); }
+
+ private:
+  friend class RecordWriter;
+  friend class RecordReader;
+
+  // Adds time elapsed between construction and destruction to a counter of
+  // stats and optionally to a histogram, unless stats is nullptr.
+  class Timer;
+
+  struct CompressedBytes {
+    std::atomic<uint64_t> decoded_bytes{0};
+    std::atomic<uint64_t> encoded_bytes{0};
+  };
+
+  // The number of supported compression types.
+  static constexpr size_t kNumCompressionTypes = 4;
+
+  static size_t Index(CompressionType compression_type);
+  static LatencyHistogram RecordStats::*FlushLatency(FlushType flush_type);
+  // Reads the compression type from the chunk data. For deduplicated and delta
+  // chunks, this is the compression type of the nested chunk, which holds most
+  // data. Returns false if the chunk type or the compression type is unknown,
+  // or if the chunk data are too short.
+  static bool ChunkCompressionType(const Chunk& chunk,
+                                   CompressionType* compression_type);
+
+  static uint64_t Get(const std::atomic<uint64_t>& counter) {
+    return counter.load(std::memory_order_relaxed);
+  }
+  static void Add(std::atomic<uint64_t>* counter, uint64_t value) {
+    counter->fetch_add(value, std::memory_order_relaxed);
+  }
+
+  // Registers a chunk written by RecordWriter. The compression type is read
+  // from the chunk data, because it can vary between chunks.
+  void AddWrittenChunk(const Chunk& chunk);
+  // Registers a chunk read by RecordReader. The compression type is read from
+  // the chunk data.
+  void AddReadChunk(const Chunk& chunk);
+
+  std::atomic<uint64_t> written_chunks_{0};
+  std::atomic<uint64_t> written_records_{0};
+  CompressedBytes written_[kNumCompressionTypes];
+  std::atomic<uint64_t> encode_nanos_{0};
+  std::atomic<uint64_t> write_nanos_{0};
+  std::atomic<uint64_t> queue_wait_nanos_{0};
+  std::atomic<uint64_t> encode_wait_nanos_{0};
+  LatencyHistogram encode_latency_;
+  LatencyHistogram write_latency_;
+  LatencyHistogram write_stall_latency_;
+  LatencyHistogram flush_from_object_latency_;
+  LatencyHistogram flush_from_process_latency_;
+  LatencyHistogram flush_from_machine_latency_;
+  std::atomic<uint64_t> read_chunks_{0};
+  std::atomic<uint64_t> read_records_{0};
+  CompressedBytes read_[kNumCompressionTypes];
+  std::atomic<uint64_t> read_nanos_{0};
+  std::atomic<uint64_t> decode_nanos_{0};
+  std::atomic<uint64_t> decode_wait_nanos_{0};
+  std::atomic<uint64_t> filtered_chunks_{0};
+  std::atomic<uint64_t> skipped_bytes_{0};
+};
+
+// Implementation details follow.
+
+class RecordStats::Timer {
+ public:
+  // nanos or histogram can be nullptr to skip them.
+  Timer(RecordStats* stats, std::atomic<uint64_t> RecordStats::*nanos,
+        LatencyHistogram RecordStats::*histogram = nullptr)
+      : stats_(stats), nanos_(nanos), histogram_(histogram) {
+    if (stats_ != nullptr) start_ = std::chrono::steady_clock::now();
+  }
+
+  Timer(const Timer&) = delete;
+  Timer& operator=(const Timer&) = delete;
+
+  ~Timer() {
+    if (stats_ != nullptr) {
+      const uint64_t elapsed_nanos = IntCast<uint64_t>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - start_)
+              .count());
+      if (nanos_ != nullptr) Add(&(stats_->*nanos_), elapsed_nanos);
+      if (histogram_ != nullptr) (stats_->*histogram_).Add(elapsed_nanos);
+    }
+  }
+
+ private:
+  RecordStats* stats_;
+  std::atomic<uint64_t> RecordStats::*nanos_;
+  LatencyHistogram RecordStats::*histogram_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_RECORD_STATS_H_
@@ -0,0 +1,146 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/record_tracer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "riegeli/base/base.h"
+#include "riegeli/bytes/writer.h"
+
+namespace riegeli {
+
+namespace {
+
+// Formats nanoseconds as microseconds with a fraction, as expected by Chrome
+// traces.
+std::string Micros(uint64_t nanos) {
+  const uint64_t fraction = nanos % 1000;
+  const char* const separator =
+      fraction < 10 ? ".00" : fraction < 100 ? ".0" : ".";
+  return absl::StrCat(nanos / 1000, separator, fraction);
+}
+
+}  // namespace
+
+RecordTracer::RecordTracer(size_t max_events)
+    : start_(std::chrono::steady_clock::now()), max_events_(max_events) {}
+
+void RecordTracer::Clear() {
+  absl::MutexLock lock(&mutex_);
+  events_ = std::vector<Event>();
+  dropped_events_ = 0;
+}
+
+size_t RecordTracer::num_events() const {
+  absl::MutexLock lock(&mutex_);
+  return events_.size();
+}
+
+uint64_t RecordTracer::dropped_events() const {
+  absl::MutexLock lock(&mutex_);
+  return dropped_events_;
+}
+
+uint64_t RecordTracer::CurrentThreadId() {
+  static std::atomic<uint64_t> next_thread_id(1);
+  thread_local uint64_t thread_id = 0;
+  if (ABSL_PREDICT_FALSE(thread_id == 0)) {
+    thread_id = next_thread_id.fetch_add(1, std::memory_order_relaxed);
+  }
+  return thread_id;
+}
+
+void RecordTracer::AddEvent(TraceStage stage, uint64_t chunk_id,
+                            uint64_t begin_nanos) {
+  const uint64_t end_nanos = NowNanos();
+  const uint64_t thread_id = CurrentThreadId();
+  absl::MutexLock lock(&mutex_);
+  if (ABSL_PREDICT_FALSE(events_.size() >= max_events_)) {
+    ++dropped_events_;
+    return;
+  }
+  events_.push_back(Event{stage, chunk_id, thread_id, begin_nanos, end_nanos});
+}
+
+void RecordTracer::AddInstant(TraceStage stage, uint64_t chunk_id) {
+  AddEvent(stage, chunk_id, NowNanos());
+}
+
+const char* RecordTracer::StageName(TraceStage stage) {
+  switch (stage) {
+    case TraceStage::kOpenChunk:
+      return "open_chunk";
+    case TraceStage::kEncode:
+      return "encode";
+    case TraceStage::kQueue:
+      return "queue";
+    case TraceStage::kQueueWait:
+      return "queue_wait";
+    case TraceStage::kEncodeWait:
+      return "encode_wait";
+    case TraceStage::kWrite:
+      return "write";
+    case TraceStage::kFlush:
+      return "flush";
+    case TraceStage::kRead:
+      return "read";
+    case TraceStage::kDecode:
+      return "decode";
+    case TraceStage::kDecodeWait:
+      return "decode_wait";
+    case TraceStage::kParse:
+      return "parse";
+  }
+  RIEGELI_ASSERT_UNREACHABLE()
+      << "Unknown trace stage: " << static_cast<uint32_t>(stage);
+}
+
+bool RecordTracer::WriteChromeTrace(Writer* dest) const {
+  std::vector<Event> events;
+  {
+    absl::MutexLock lock(&mutex_);
+    events = events_;
+  }
+  if (ABSL_PREDICT_FALSE(!dest->Write("{\"traceEvents\":["))) return false;
+  bool first = true;
+  for (const Event& event : events) {
+    const bool reader = event.stage >= TraceStage::kRead;
+    std::string json = absl::StrCat(
+        first ? "\n" : ",\n", "{\"name\":\"", StageName(event.stage),
+        "\",\"cat\":\"", reader ? "reader" : "writer", "\",\"pid\":1,\"tid\":",
+        event.thread_id, ",\"ts\":", Micros(event.begin_nanos));
+    if (event.stage == TraceStage::kOpenChunk) {
+      absl::StrAppend(&json, ",\"ph\":\"i\",\"s\":\"t\"");
+    } else {
+      absl::StrAppend(&json, ",\"ph\":\"X\",\"dur\":",
+                      Micros(event.end_nanos - event.begin_nanos));
+    }
+    absl::StrAppend(&json, ",\"args\":{\"", reader ? "chunk_begin" : "chunk",
+                    "\":", event.chunk_id, "}}");
+    if (ABSL_PREDICT_FALSE(!dest->Write(json))) return false;
+    first = false;
+  }
+  return dest->Write("\n]}\n");
+}
+
+}  // namespace riegeli
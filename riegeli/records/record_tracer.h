@@ -0,0 +1,209 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_RECORD_TRACER_H_
+#define RIEGELI_RECORDS_RECORD_TRACER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <chrono>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "riegeli/base/base.h"
+#include "riegeli/bytes/writer.h"
+
+// Static tracepoints are compiled in if RIEGELI_USDT is defined, which needs
+// <sys/sdt.h> (SystemTap). They can then be attached to with perf, bpftrace,
+// etc. without a RecordTracer, e.g.
+//   bpftrace -e 'usdt:./binary:riegeli:stage_end { @[arg0] = count(); }'
+//
+// Probes riegeli:stage_begin and riegeli:stage_end have arguments:
+//  - stage, as the value of TraceStage
+//  - chunk id, as in RecordTracer
+#ifdef RIEGELI_USDT
+#include <sys/sdt.h>
+#define RIEGELI_INTERNAL_TRACEPOINT(name, stage, id) \
+  DTRACE_PROBE2(riegeli, name, stage, id)
+#else
+#define RIEGELI_INTERNAL_TRACEPOINT(name, stage, id) \
+  do {                                               \
+  } while (false)
+#endif
+
+namespace riegeli {
+
+// Stages of the pipelines of RecordWriter and RecordReader.
+enum class TraceStage : uint32_t {
+  // RecordWriter, instant: a chunk is opened for adding records.
+  kOpenChunk = 0,
+  // RecordWriter: ChunkEncoder::EncodeAndClose(), including transposition,
+  // compression, and hashing of chunk data.
+  kEncode = 1,
+  // RecordWriter with parallelism > 0: a chunk waits in the queue from being
+  // closed until the chunk writer thread starts handling it.
+  kQueue = 2,
+  // RecordWriter with parallelism > 0: WriteRecord(), Flush(), or Close()
+  // waits for space in the queue.
+  kQueueWait = 3,
+  // RecordWriter with parallelism > 0: the chunk writer thread waits for the
+  // chunk to be encoded.
+  kEncodeWait = 4,
+  // RecordWriter: ChunkWriter::WriteChunk().
+  kWrite = 5,
+  // RecordWriter: flushing the ChunkWriter. The chunk id is 0.
+  kFlush = 6,
+  // RecordReader: ChunkReader::ReadChunk(), including hash verification of
+  // chunks read synchronously.
+  kRead = 7,
+  // RecordReader: decoding a chunk, including hash verification of chunks
+  // read ahead with parallelism > 0.
+  kDecode = 8,
+  // RecordReader with parallelism > 0: waiting for a chunk being decoded in
+  // the background.
+  kDecodeWait = 9,
+  // RecordReader with RecordReader::Options::set_parse_prototype(): parsing
+  // records of a chunk in the background.
+  kParse = 10,
+};
+
+// RecordTracer collects timelines of stages of RecordWriter and RecordReader,
+// and exports them as a Chrome trace (viewable in chrome://tracing or
+// Perfetto). Unlike RecordStats, which aggregates times, this shows when each
+// stage of each chunk happened on which thread, e.g. to find pipeline bubbles
+// such as the chunk writer thread being idle while encoders are saturated.
+//
+// A RecordTracer is attached with RecordWriter::Options::set_tracer() or
+// RecordReader::Options::set_tracer(), and must be kept alive until the writer
+// or reader is closed. It may be shared between several writers and readers.
+//
+// Chunks are identified by chunk ids: for RecordWriter, consecutive numbers of
+// chunks of that writer starting from 1 (a chunk id is known before the chunk
+// position is); for RecordReader, the chunk position (for kRead, the position
+// where reading started).
+//
+// RecordTracer is thread-safe.
+class RecordTracer {
+ public:
+  // Creates a RecordTracer keeping up to max_events events. Further events are
+  // dropped and counted by dropped_events().
+  explicit RecordTracer(size_t max_events = size_t{1} << 20);
+
+  RecordTracer(const RecordTracer&) = delete;
+  RecordTracer& operator=(const RecordTracer&) = delete;
+
+  // Removes all events.
+  void Clear();
+
+  // Returns the number of events kept.
+  size_t num_events() const;
+  // Returns the number of events dropped because max_events were kept.
+  uint64_t dropped_events() const;
+
+  // Writes the events in the Chrome trace event format (JSON). Times are in
+  // microseconds since the RecordTracer was created.
+  //
+  // Return values:
+  //  * true  - success
+  //  * false - failure (!dest->healthy())
+  bool WriteChromeTrace(Writer* dest) const;
+
+  // Returns the name of the stage, as used in Chrome traces.
+  static const char* StageName(TraceStage stage);
+
+ private:
+  friend class RecordWriter;
+  friend class RecordReader;
+
+  // Traces a stage from construction to destruction, firing static
+  // tracepoints, and adding an event to tracer unless tracer is nullptr.
+  class Span;
+
+  struct Event {
+    TraceStage stage;
+    uint64_t chunk_id;
+    uint64_t thread_id;
+    uint64_t begin_nanos;
+    uint64_t end_nanos;
+  };
+
+  // Returns a small number identifying the current thread in traces.
+  static uint64_t CurrentThreadId();
+
+  uint64_t NowNanos() const;
+
+  // Adds an event which began at begin_nanos and ends now, in the current
+  // thread.
+  void AddEvent(TraceStage stage, uint64_t chunk_id, uint64_t begin_nanos);
+  // Adds an instant event.
+  void AddInstant(TraceStage stage, uint64_t chunk_id);
+
+  // Like AddInstant(), but tracer may be nullptr, and static tracepoints are
+  // fired.
+  static void Instant(RecordTracer* tracer, TraceStage stage,
+                      uint64_t chunk_id);
+
+  const std::chrono::steady_clock::time_point start_;
+  const size_t max_events_;
+  mutable absl::Mutex mutex_;
+  std::vector<Event> events_ GUARDED_BY(mutex_);
+  uint64_t dropped_events_ GUARDED_BY(mutex_) = 0;
+};
+
+// Implementation details follow.
+
+class RecordTracer::Span {
+ public:
+  Span(RecordTracer* tracer, TraceStage stage, uint64_t chunk_id)
+      : tracer_(tracer), stage_(stage), chunk_id_(chunk_id) {
+    RIEGELI_INTERNAL_TRACEPOINT(stage_begin, static_cast<uint32_t>(stage_),
+                                chunk_id_);
+    if (tracer_ != nullptr) begin_nanos_ = tracer_->NowNanos();
+  }
+
+  Span(const Span&) = delete;
+  Span& operator=(const Span&) = delete;
+
+  ~Span() {
+    RIEGELI_INTERNAL_TRACEPOINT(stage_end, static_cast<uint32_t>(stage_),
+                                chunk_id_);
+    if (tracer_ != nullptr) tracer_->AddEvent(stage_, chunk_id_, begin_nanos_);
+  }
+
+ private:
+  RecordTracer* tracer_;
+  TraceStage stage_;
+  uint64_t chunk_id_;
+  uint64_t begin_nanos_ = 0;
+};
+
+inline uint64_t RecordTracer::NowNanos() const {
+  return IntCast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               std::chrono::steady_clock::now() - start_)
+                               .count());
+}
+
+inline void RecordTracer::Instant(RecordTracer* tracer, TraceStage stage,
+                                  uint64_t chunk_id) {
+  RIEGELI_INTERNAL_TRACEPOINT(stage_begin, static_cast<uint32_t>(stage),
+                              chunk_id);
+  RIEGELI_INTERNAL_TRACEPOINT(stage_end, static_cast<uint32_t>(stage),
+                              chunk_id);
+  if (tracer != nullptr) tracer->AddInstant(stage, chunk_id);
+}
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_RECORD_TRACER_H_
@@ -15,13 +15,17 @@
 #include "riegeli/records/record_writer.h"
 
 #include <stddef.h>
+#include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <deque>
+#include <functional>
 #include <future>
 #include <limits>
 #include <memory>
 #include <new>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -29,27 +33,62 @@
 #include "google/protobuf/message_lite.h"
 #include "absl/base/optimization.h"
 #include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
 #include "absl/strings/string_view.h"
 #include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
 #include "riegeli/base/options_parser.h"
 #include "riegeli/base/parallelism.h"
+#include "riegeli/base/str_error.h"
+#include "riegeli/bytes/buffered_writer.h"
+#include "riegeli/bytes/chain_reader.h"
+#include "riegeli/bytes/chain_writer.h"
+#include "riegeli/bytes/fd_group_committer.h"
+#include "riegeli/bytes/message_serialize.h"
+#include "riegeli/bytes/rate_limiter.h"
 #include "riegeli/bytes/writer.h"
+#include "riegeli/bytes/writer_utils.h"
+#include "riegeli/chunk_encoding/adaptive_encoder.h"
 #include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/chunk_decoder.h"
 #include "riegeli/chunk_encoding/chunk_encoder.h"
+#include "riegeli/chunk_encoding/chunk_transcoder.h"
+#include "riegeli/chunk_encoding/compressor.h"
+#include "riegeli/chunk_encoding/compressor_options.h"
+#include "riegeli/chunk_encoding/deduplicating_encoder.h"
 #include "riegeli/chunk_encoding/deferred_encoder.h"
+#include "riegeli/chunk_encoding/delta_encoder.h"
+#include "riegeli/chunk_encoding/field_projection.h"
+#include "riegeli/chunk_encoding/record_limits.h"
 #include "riegeli/chunk_encoding/simple_encoder.h"
 #include "riegeli/chunk_encoding/transpose_encoder.h"
+#include "riegeli/chunk_encoding/types.h"
 #include "riegeli/records/block.h"
+#include "riegeli/records/chunk_index.h"
+#include "riegeli/records/chunk_reader.h"
 #include "riegeli/records/chunk_writer.h"
+#include "riegeli/records/field_aggregator.h"
+#include "riegeli/records/file_summary.h"
 #include "riegeli/records/record_position.h"
+#include "riegeli/records/record_stats.h"
 
 namespace riegeli {
 
 namespace {
 
+// Returns a future which is already ready with the given result.
+std::shared_future<bool> ReadyFuture(bool result) {
+  std::promise<bool> promise;
+  promise.set_value(result);
+  return promise.get_future().share();
+}
+
 template <typename Record>
 size_t RecordSize(const Record& record) {
   return record.size();
@@ -59,6 +98,14 @@ size_t RecordSize(const google::protobuf::MessageLite& record) {
   return record.ByteSizeLong();
 }
 
+// Returns true if chunk holds a fragment of a record written incrementally,
+// which is copied verbatim even if it has no records.
+bool IsFragment(const Chunk& chunk) {
+  return !chunk.data.empty() &&
+         static_cast<ChunkType>(chunk.data.blocks().front()[0]) ==
+             ChunkType::kFragment;
+}
+
 }  // namespace
 
 inline FutureRecordPosition::FutureChunkBegin::FutureChunkBegin(
@@ -67,7 +114,15 @@ inline FutureRecordPosition::FutureChunkBegin::FutureChunkBegin(
     : pos_before_chunks_(pos_before_chunks),
       chunk_headers_(std::move(chunk_headers)) {}
 
+inline FutureRecordPosition::FutureChunkBegin::FutureChunkBegin(
+    std::shared_future<Position> chunk_begin)
+    : chunk_begin_(std::move(chunk_begin)) {}
+
 void FutureRecordPosition::FutureChunkBegin::Resolve() const {
+  if (chunk_begin_.valid()) {
+    pos_before_chunks_ = chunk_begin_.get();
+    chunk_begin_ = std::shared_future<Position>();
+  }
   Position pos = pos_before_chunks_;
   for (const auto& chunk_header : chunk_headers_) {
     pos = internal::ChunkEnd(chunk_header.get(), pos);
@@ -89,42 +144,124 @@ inline FutureRecordPosition::FutureRecordPosition(
                                                     std::move(chunk_headers))),
       chunk_begin_(pos_before_chunks) {}
 
+inline FutureRecordPosition::FutureRecordPosition(
+    std::shared_future<Position> chunk_begin)
+    : future_chunk_begin_(
+          std::make_shared<FutureChunkBegin>(std::move(chunk_begin))) {}
+
 bool RecordWriter::Options::Parse(absl::string_view text, std::string* message) {
   std::string compressor_text;
+  uint64_t max_block_size = compressor_options_.max_block_size();
+  int compression_parallelism = compressor_options_.parallelism();
   OptionsParser options_parser;
   options_parser.AddOption("default", ValueParser::FailIfAnySeen());
   options_parser.AddOption(
       "transpose",
       ValueParser::Enum(&transpose_,
                         {{"", true}, {"true", true}, {"false", false}}));
+  options_parser.AddOption(
+      "transpose_nonproto",
+      ValueParser::Enum(&transpose_nonproto_,
+                        {{"", true}, {"true", true}, {"false", false}}));
+  options_parser.AddOption(
+      "transpose_packed",
+      ValueParser::Enum(&transpose_packed_,
+                        {{"", true}, {"true", true}, {"false", false}}));
   options_parser.AddOption("uncompressed",
                            ValueParser::CopyTo(&compressor_text));
   options_parser.AddOption("brotli", ValueParser::CopyTo(&compressor_text));
   options_parser.AddOption("zstd", ValueParser::CopyTo(&compressor_text));
+  options_parser.AddOption("lz4", ValueParser::CopyTo(&compressor_text));
   options_parser.AddOption("window_log", ValueParser::CopyTo(&compressor_text));
+  options_parser.AddOption(
+      "max_block_size",
+      ValueParser::Bytes(&max_block_size, 1,
+                         std::numeric_limits<size_t>::max()));
   options_parser.AddOption(
       "chunk_size", ValueParser::Bytes(&chunk_size_, 1,
                                        std::numeric_limits<uint64_t>::max()));
+  options_parser.AddOption(
+      "max_chunk_records",
+      ValueParser::UnsignedInt(&max_chunk_records_, 1,
+                               std::numeric_limits<uint64_t>::max()));
   options_parser.AddOption("bucket_fraction",
                            ValueParser::Real(&bucket_fraction_, 0.0, 1.0));
+  options_parser.AddOption(
+      "values_block_size",
+      ValueParser::Bytes(&values_block_size_, 0,
+                         std::numeric_limits<uint64_t>::max()));
+  options_parser.AddOption(
+      "fixed_record_sizes",
+      ValueParser::Enum(&fixed_record_sizes_,
+                        {{"", true}, {"true", true}, {"false", false}}));
+  options_parser.AddOption(
+      "deduplicate_records",
+      ValueParser::Enum(&deduplicate_records_,
+                        {{"", true}, {"true", true}, {"false", false}}));
+  options_parser.AddOption(
+      "delta_records",
+      ValueParser::Enum(&delta_records_,
+                        {{"", true}, {"true", true}, {"false", false}}));
+  options_parser.AddOption(
+      "store_incompressible_buckets",
+      ValueParser::Enum(&store_incompressible_buckets_,
+                        {{"", true}, {"true", true}, {"false", false}}));
   options_parser.AddOption(
       "parallelism",
       ValueParser::Int(&parallelism_, 0, std::numeric_limits<int>::max()));
+  options_parser.AddOption(
+      "compression_parallelism",
+      ValueParser::Int(&compression_parallelism, 0,
+                       std::numeric_limits<int>::max()));
+  options_parser.AddOption(
+      "max_pending_bytes",
+      ValueParser::Bytes(&max_pending_bytes_, 0,
+                         std::numeric_limits<uint64_t>::max()));
+  options_parser.AddOption(
+      "streaming_encoding",
+      ValueParser::Enum(&streaming_encoding_,
+                        {{"", true}, {"true", true}, {"false", false}}));
+  options_parser.AddOption(
+      "adaptive_compression",
+      ValueParser::Enum(&adaptive_compression_,
+                        {{"", true}, {"true", true}, {"false", false}}));
+  options_parser.AddOption(
+      "chunk_index",
+      ValueParser::Enum(&chunk_index_,
+                        {{"", true}, {"true", true}, {"false", false}}));
+  options_parser.AddOption(
+      "file_summary",
+      ValueParser::Enum(&file_summary_,
+                        {{"", true}, {"true", true}, {"false", false}}));
   if (ABSL_PREDICT_FALSE(!options_parser.Parse(text))) {
     *message = std::string(options_parser.message());
     return false;
   }
+  compressor_options_.set_max_block_size(IntCast<size_t>(max_block_size));
+  compressor_options_.set_parallelism(compression_parallelism);
   return compressor_options_.Parse(compressor_text, message);
 }
 
 inline std::unique_ptr<ChunkEncoder> RecordWriter::MakeChunkEncoder(
     const Options& options) {
-  std::unique_ptr<ChunkEncoder> chunk_encoder;
-  if (options.transpose_) {
+  const bool transpose = options.transpose_;
+  const bool transpose_nonproto = options.transpose_nonproto_;
+  const bool transpose_packed = options.transpose_packed_;
+  const uint64_t chunk_size = options.chunk_size_;
+  const bool delta_records = options.delta_records_;
+  const bool deduplicate_records =
+      !delta_records && options.deduplicate_records_;
+  // Base records of a deduplicated or delta chunk are not split into blocks.
+  const uint64_t values_block_size =
+      deduplicate_records || delta_records ? uint64_t{0}
+                                           : options.values_block_size_;
+  const bool fixed_record_sizes = options.fixed_record_sizes_;
+  uint64_t bucket_size = 0;
+  if (transpose) {
     const long double long_double_bucket_size =
         std::round(static_cast<long double>(options.chunk_size_) *
                    static_cast<long double>(options.bucket_fraction_));
-    const uint64_t bucket_size =
+    bucket_size =
         ABSL_PREDICT_FALSE(
             long_double_bucket_size >=
             static_cast<long double>(std::numeric_limits<uint64_t>::max()))
@@ -132,25 +269,107 @@ inline std::unique_ptr<ChunkEncoder> RecordWriter::MakeChunkEncoder(
             : ABSL_PREDICT_TRUE(long_double_bucket_size >= 1.0L)
                   ? static_cast<uint64_t>(long_double_bucket_size)
                   : uint64_t{1};
-    chunk_encoder = absl::make_unique<TransposeEncoder>(
-        options.compressor_options_, bucket_size);
-  } else {
-    chunk_encoder = absl::make_unique<SimpleEncoder>(
-        options.compressor_options_, options.chunk_size_);
   }
-  if (options.parallelism_ == 0) {
+  const std::vector<Field>& separate_bucket_fields =
+      options.separate_bucket_fields_;
+  TransposeEncoder::BucketCompression bucket_compression;
+  bucket_compression.has_separate_fields_options =
+      options.has_separate_bucket_compression_;
+  bucket_compression.separate_fields_options =
+      options.separate_bucket_compression_;
+  bucket_compression.store_incompressible =
+      options.store_incompressible_buckets_;
+  const auto make_encoder = [transpose, transpose_nonproto, transpose_packed,
+                             chunk_size, values_block_size, fixed_record_sizes,
+                             deduplicate_records, delta_records, bucket_size,
+                             separate_bucket_fields, bucket_compression](
+                                const CompressorOptions& compressor_options)
+      -> std::unique_ptr<ChunkEncoder> {
+    std::unique_ptr<ChunkEncoder> encoder;
+    if (transpose) {
+      encoder = absl::make_unique<TransposeEncoder>(
+          compressor_options, bucket_size, transpose_nonproto,
+          separate_bucket_fields, bucket_compression, transpose_packed);
+    } else {
+      encoder = absl::make_unique<SimpleEncoder>(compressor_options, chunk_size,
+                                                 values_block_size,
+                                                 fixed_record_sizes);
+    }
+    if (delta_records) {
+      encoder = absl::make_unique<DeltaEncoder>(compressor_options,
+                                                std::move(encoder));
+    } else if (deduplicate_records) {
+      encoder = absl::make_unique<DeduplicatingEncoder>(compressor_options,
+                                                        std::move(encoder));
+    }
+    return encoder;
+  };
+  if (options.adaptive_compression_) {
+    // AdaptiveEncoder defers encoding anyway.
+    ChunkType chunk_type;
+    if (delta_records) {
+      chunk_type = ChunkType::kDelta;
+    } else if (deduplicate_records) {
+      chunk_type = ChunkType::kDeduplicated;
+    } else if (transpose) {
+      chunk_type = ChunkType::kTransposed;
+    } else if (values_block_size > 0) {
+      chunk_type = ChunkType::kBlockedSimple;
+    } else {
+      chunk_type = ChunkType::kSimple;
+    }
+    return absl::make_unique<AdaptiveEncoder>(options.compressor_options_,
+                                              chunk_type, make_encoder);
+  }
+  std::unique_ptr<ChunkEncoder> chunk_encoder =
+      make_encoder(options.compressor_options_);
+  if (options.parallelism_ == 0 ||
+      (options.streaming_encoding_ && !transpose)) {
+    // Records are encoded as they arrive.
     return chunk_encoder;
   } else {
     return absl::make_unique<DeferredEncoder>(std::move(chunk_encoder));
   }
 }
 
+inline bool RecordWriter::SameChunkEncoding(const Options& a,
+                                            const Options& b) {
+  if (a.separate_bucket_fields_.size() != b.separate_bucket_fields_.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.separate_bucket_fields_.size(); ++i) {
+    if (a.separate_bucket_fields_[i].path() !=
+        b.separate_bucket_fields_[i].path()) {
+      return false;
+    }
+  }
+  return a.transpose_ == b.transpose_ &&
+         a.transpose_nonproto_ == b.transpose_nonproto_ &&
+         a.transpose_packed_ == b.transpose_packed_ &&
+         a.compressor_options_ == b.compressor_options_ &&
+         a.chunk_size_ == b.chunk_size_ &&
+         a.bucket_fraction_ == b.bucket_fraction_ &&
+         a.has_separate_bucket_compression_ ==
+             b.has_separate_bucket_compression_ &&
+         a.separate_bucket_compression_ == b.separate_bucket_compression_ &&
+         a.store_incompressible_buckets_ == b.store_incompressible_buckets_ &&
+         a.values_block_size_ == b.values_block_size_ &&
+         a.fixed_record_sizes_ == b.fixed_record_sizes_ &&
+         a.deduplicate_records_ == b.deduplicate_records_ &&
+         a.delta_records_ == b.delta_records_ &&
+         a.parallelism_ == b.parallelism_ &&
+         a.streaming_encoding_ == b.streaming_encoding_ &&
+         a.adaptive_compression_ == b.adaptive_compression_;
+}
+
 class RecordWriter::Impl : public Object {
  public:
-  Impl() : Object(State::kOpen) {}
+  explicit Impl(const Options& options);
 
-  explicit Impl(std::unique_ptr<ChunkEncoder> chunk_encoder)
-      : Object(State::kOpen), chunk_encoder_(std::move(chunk_encoder)) {}
+  Impl(std::unique_ptr<ChunkEncoder> chunk_encoder, const Options& options)
+      : Impl(options) {
+    chunk_encoder_ = std::move(chunk_encoder);
+  }
 
   ~Impl();
 
@@ -162,28 +381,513 @@ class RecordWriter::Impl : public Object {
   // Precondition: chunk is open.
   template <typename Record>
   bool AddRecord(Record&& record);
+  bool AddRecord(const google::protobuf::MessageLite& record);
+
+  // Precondition: chunk is open.
+  bool AddRecords(Chain records, std::vector<size_t> limits);
 
   // Precondition: chunk is open.
   //
+  // chunk_size is the size of records added to the chunk, as counted by
+  // RecordWriter against the desired chunk size.
+  //
+  // If the result is false then !healthy().
+  virtual bool CloseChunk(uint64_t chunk_size) = 0;
+
+  // Writes a chunk which is already encoded, e.g. copied from another file,
+  // registering it in the index with no field ranges or keys.
+  //
+  // Precondition: chunk is not open, !IndexesRecords()
+  //
+  // If the result is false then !healthy().
+  virtual bool CopyChunk(Chunk chunk) = 0;
+
+  // Encodes a fragment of a record written incrementally as a
+  // ChunkType::kFragment chunk compressed with compressor_options_, and writes
+  // it with CopyChunk().
+  //
+  // Precondition: chunk is not open, !IndexesRecords()
+  //
   // If the result is false then !healthy().
-  virtual bool CloseChunk() = 0;
+  bool WriteFragment(Chain fragment, bool first, bool last);
+
+  // Like CopyChunk(), but first recompresses the chunk with the compression of
+  // Options, decompressing it with zstd_dictionaries.
+  //
+  // Precondition: chunk is not open, !IndexesRecords()
+  //
+  // If the result is false then !healthy().
+  virtual bool TranscodeAndCopyChunk(
+      Chunk chunk, const ZstdDictionaryRegistry* zstd_dictionaries) = 0;
 
   // Precondition: chunk is not open.
   virtual bool Flush(FlushType flush_type) = 0;
 
+  // Like Flush(), but does not wait for background work. The returned future
+  // becomes ready with the result of Flush().
+  //
+  // If group_committer != nullptr, data are flushed like
+  // FlushType::kFromProcess, and then made durable through group_committer.
+  //
+  // Precondition: chunk is not open.
+  virtual std::shared_future<bool> FlushAsync(
+      FlushType flush_type, FdGroupCommitter* group_committer) = 0;
+
   FutureRecordPosition Pos();
 
+  // Returns the number of bytes of chunks closed but not written yet.
+  virtual uint64_t PendingBytes() { return 0; }
+
+  // Returns true if records are scanned by AddToIndex().
+  bool IndexesRecords() const {
+    return !chunk_index_fields_.empty() || key_function_ != nullptr;
+  }
+
+  // Returns true if Producers can hand over chunks to this Impl.
+  virtual bool SupportsProducers() const { return false; }
+
+  // Registers or unregisters a Producer which may hand over chunks to this
+  // Impl. Thread-safe.
+  void AddProducer() { num_producers_.fetch_add(1, std::memory_order_relaxed); }
+  void RemoveProducer() {
+    num_producers_.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  // Returns true if some Producers are registered.
+  bool HasProducers() const {
+    return num_producers_.load(std::memory_order_relaxed) > 0;
+  }
+
+  // Returns a chunk encoder for the open chunk of a Producer.
+  //
+  // This is thread-safe.
+  //
+  // Precondition: SupportsProducers()
+  virtual std::unique_ptr<ChunkEncoder> MakeProducerEncoder() {
+    RIEGELI_ASSERT_UNREACHABLE()
+        << "Failed precondition of "
+           "RecordWriter::Impl::MakeProducerEncoder(): "
+           "Producers not supported";
+  }
+
+  // Hands over a chunk of a Producer, to be written after chunks closed or
+  // handed over before. chunk_begin is set to the position of the chunk when
+  // it is written.
+  //
+  // This is thread-safe.
+  //
+  // Precondition: SupportsProducers()
+  //
+  // chunk_size is the size of records added to the chunk, as counted by
+  // RecordWriter against the desired chunk size.
+  //
+  // If the result is false then !healthy().
+  virtual bool CloseProducerChunk(std::unique_ptr<ChunkEncoder> chunk_encoder,
+                                  uint64_t chunk_size,
+                                  std::promise<Position> chunk_begin) {
+    RIEGELI_ASSERT_UNREACHABLE()
+        << "Failed precondition of RecordWriter::Impl::CloseProducerChunk(): "
+           "Producers not supported";
+  }
+
+  // Returns the chunk encoder for reuse by a RecordWriter with options, or
+  // nullptr if it does not encode chunks in the same way.
+  //
+  // Precondition: chunk is not open.
+  virtual std::unique_ptr<ChunkEncoder> TakeChunkEncoder(
+      const Options& options) {
+    return nullptr;
+  }
+
+  // Returns nullptr if counters are not being collected.
+  RecordStats* stats() const { return stats_; }
+
+  // Registers this Impl with MemoryEstimator, including the ChunkWriter.
+  virtual void AddUniqueTo(MemoryEstimator* memory_estimator) = 0;
+
  protected:
   virtual FutureRecordPosition ChunkBegin() = 0;
 
+  // Returns a new chunk id for tracer_, distinct from ids of other chunks of
+  // this RecordWriter. Thread-safe.
+  uint64_t NewChunkId() {
+    return last_chunk_id_.fetch_add(1, std::memory_order_relaxed) + 1;
+  }
+
+  // Sets open_chunk_id_ for a new open chunk, and traces opening it.
+  void TraceOpenChunk() {
+    open_chunk_id_ = NewChunkId();
+    RecordTracer::Instant(tracer_, TraceStage::kOpenChunk, open_chunk_id_);
+  }
+
+  // Encodes the chunk being built by chunk_encoder into chunk.
+  //
+  // Return values:
+  //  * true  - success
+  //  * false - failure (!chunk_encoder->healthy())
+  bool EncodeChunk(ChunkEncoder* chunk_encoder, Chunk* chunk,
+                   uint64_t chunk_id);
+
+  // Recompresses src into *dest with compressor_options_.
+  //
+  // If the result is false then !healthy().
+  bool TranscodeChunk(const Chunk& src,
+                      const ZstdDictionaryRegistry* zstd_dictionaries,
+                      Chunk* dest);
+
+  // Writes chunk to chunk_writer, registering it in chunk_index_ (with
+  // field_ranges, first_key, and key_filter) if the index is being collected,
+  // and in stats_ if counters are being collected.
+  //
+  // If the result is false then !healthy().
+  bool WriteChunk(ChunkWriter* chunk_writer, const Chunk& chunk,
+                  std::vector<ChunkIndex::FieldRange> field_ranges,
+                  std::string first_key, std::string key_filter,
+                  uint64_t chunk_id);
+
+  // Returns ranges of values of chunk_index_fields_ in records added since the
+  // last call, and resets them.
+  std::vector<ChunkIndex::FieldRange> TakeFieldRanges();
+
+  // Returns the key of the first record added since the last call, or an empty
+  // string if there is none or records are not keyed.
+  std::string TakeFirstKey();
+
+  // Returns the key filter of records added since the last call, and resets
+  // it. Returns an empty string if key filters are not being collected.
+  std::string TakeKeyFilter();
+
+  // Writes chunk_index_ to chunk_writer if the index is being collected.
+  //
+  // If the result is false then !healthy().
+  bool WriteChunkIndex(ChunkWriter* chunk_writer);
+
+  // Writes file_summary_ to chunk_writer if the summary is being collected.
+  //
+  // If the result is false then !healthy().
+  bool WriteFileSummary(ChunkWriter* chunk_writer);
+
+  // Registers members of Impl with MemoryEstimator, except for sizeof(Impl)
+  // and chunk_index_, which is written to by the chunk writer thread of
+  // ParallelImpl.
+  void AddMembersTo(MemoryEstimator* memory_estimator) const;
+
   std::unique_ptr<ChunkEncoder> chunk_encoder_;
+  // nullptr if the index is not being collected.
+  std::unique_ptr<ChunkIndex> chunk_index_;
+  // nullptr if the summary is not being collected. Like chunk_index_, it is
+  // written to by the chunk writer thread of ParallelImpl.
+  std::unique_ptr<FileSummary> file_summary_;
+  // nullptr if counters are not being collected.
+  RecordStats* stats_;
+  // nullptr if timelines are not being collected.
+  RecordTracer* tracer_;
+  // Chunk id of the open chunk, for tracer_.
+  uint64_t open_chunk_id_ = 0;
+  // nullptr if writing chunks is not limited.
+  RateLimiter* rate_limiter_;
+  RateLimiter::Priority rate_priority_;
+  // Compression of chunks, used for transcoding.
+  CompressorOptions compressor_options_;
+
+ private:
+  // Returns options in the syntax of Options::Parse(), for
+  // FileSummary::writer_options.
+  static std::string OptionsText(const Options& options);
+
+  // Adds values of chunk_index_fields_ in record to field_aggregators_, and
+  // checks the order of keys.
+  //
+  // If the result is false then !healthy().
+  bool AddToIndex(absl::string_view record);
+  bool AddToIndex(const Chain& record);
+
+  template <typename Record>
+  bool AddToEncoder(Record&& record);
+
+  // Fields whose ranges of values are stored in chunk_index_, empty if the
+  // index is not being collected.
+  std::vector<ChunkIndexField> chunk_index_fields_;
+  // Ranges of values of chunk_index_fields_ in the current chunk, parallel to
+  // chunk_index_fields_.
+  std::vector<FieldAggregator> field_aggregators_;
+  // Scratch space for AddToIndex(), kept to reuse its memory.
+  FieldColumn field_column_;
+  // Extracts the key of a record, or nullptr if records are not keyed.
+  std::function<std::string(absl::string_view record)> key_function_;
+  // The key of the last record added, meaningful if has_last_key_.
+  std::string last_key_;
+  bool has_last_key_ = false;
+  // The key of the first record of the current chunk, meaningful if
+  // has_first_key_.
+  std::string first_key_;
+  bool has_first_key_ = false;
+  // Bits per key of key filters, 0 if key filters are not being collected.
+  int key_filter_bits_per_key_ = 0;
+  // Hashes of keys of records of the current chunk, for the key filter.
+  std::vector<uint64_t> key_hashes_;
+  // The last chunk id returned by NewChunkId().
+  std::atomic<uint64_t> last_chunk_id_{0};
+  // The number of Producers registered by AddProducer().
+  std::atomic<int> num_producers_{0};
 };
 
+RecordWriter::Impl::Impl(const Options& options)
+    : Object(State::kOpen),
+      chunk_index_(options.chunk_index_
+                       ? absl::make_unique<ChunkIndex>(
+                             /*has_keys=*/options.key_function_ != nullptr,
+                             options.key_function_ != nullptr
+                                 ? options.key_filter_bits_per_key_
+                                 : 0)
+                       : nullptr),
+      stats_(options.stats_),
+      tracer_(options.tracer_),
+      rate_limiter_(options.rate_limiter_),
+      rate_priority_(options.rate_priority_),
+      compressor_options_(options.compressor_options_),
+      key_function_(options.key_function_) {
+  if (chunk_index_ != nullptr && key_function_ != nullptr) {
+    key_filter_bits_per_key_ = options.key_filter_bits_per_key_;
+  }
+  if (options.file_summary_) {
+    file_summary_ = absl::make_unique<FileSummary>();
+    file_summary_->writer_options = OptionsText(options);
+  }
+  if (chunk_index_ != nullptr) {
+    chunk_index_fields_ = options.chunk_index_fields_;
+    field_aggregators_.reserve(chunk_index_fields_.size());
+    for (const ChunkIndexField& chunk_index_field : chunk_index_fields_) {
+      field_aggregators_.emplace_back(chunk_index_field.numeric_type);
+    }
+  }
+}
+
+std::string RecordWriter::Impl::OptionsText(const Options& options) {
+  std::string text;
+  const auto append = [&text](absl::string_view option) {
+    if (!text.empty()) text.push_back(',');
+    absl::StrAppend(&text, option);
+  };
+  if (options.transpose_) append("transpose");
+  if (options.transpose_nonproto_) append("transpose_nonproto");
+  if (options.transpose_packed_) append("transpose_packed");
+  const CompressorOptions& compressor_options = options.compressor_options_;
+  switch (compressor_options.compression_type()) {
+    case CompressionType::kNone:
+      append("uncompressed");
+      break;
+    case CompressionType::kBrotli:
+      append(absl::StrCat("brotli:", compressor_options.compression_level()));
+      break;
+    case CompressionType::kZstd:
+      append(absl::StrCat("zstd:", compressor_options.compression_level()));
+      break;
+    case CompressionType::kLz4:
+      append(absl::StrCat("lz4:", compressor_options.compression_level()));
+      break;
+  }
+  if (compressor_options.window_log() !=
+      CompressorOptions::kDefaultWindowLog()) {
+    append(absl::StrCat("window_log:", compressor_options.window_log()));
+  }
+  append(absl::StrCat("chunk_size:", options.chunk_size_));
+  if (options.max_chunk_records_ != std::numeric_limits<uint64_t>::max()) {
+    append(absl::StrCat("max_chunk_records:", options.max_chunk_records_));
+  }
+  if (options.transpose_) {
+    append(absl::StrCat("bucket_fraction:", options.bucket_fraction_));
+  }
+  if (options.values_block_size_ > 0) {
+    append(absl::StrCat("values_block_size:", options.values_block_size_));
+  }
+  if (options.fixed_record_sizes_) append("fixed_record_sizes");
+  if (options.chunk_index_) append("chunk_index");
+  append("file_summary");
+  return text;
+}
+
 RecordWriter::Impl::~Impl() {}
 
-template <typename Record>
-bool RecordWriter::Impl::AddRecord(Record&& record) {
+bool RecordWriter::Impl::EncodeChunk(ChunkEncoder* chunk_encoder,
+                                     Chunk* chunk, uint64_t chunk_id) {
+  RecordTracer::Span span(tracer_, TraceStage::kEncode, chunk_id);
+  RecordStats::Timer timer(stats_, &RecordStats::encode_nanos_,
+                          &RecordStats::encode_latency_);
+  return chunk_encoder->EncodeAndClose(chunk);
+}
+
+bool RecordWriter::Impl::TranscodeChunk(
+    const Chunk& src, const ZstdDictionaryRegistry* zstd_dictionaries,
+    Chunk* dest) {
+  ChunkTranscoder transcoder(ChunkTranscoder::Options()
+                                 .set_compressor_options(compressor_options_)
+                                 .set_zstd_dictionaries(zstd_dictionaries));
+  if (ABSL_PREDICT_FALSE(!transcoder.Transcode(src, dest))) {
+    return Fail("Transcoding chunk failed", transcoder);
+  }
+  return true;
+}
+
+bool RecordWriter::Impl::WriteFragment(Chain fragment, bool first,
+                                       bool last) {
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  const uint64_t decoded_data_size = fragment.size();
+  Chunk chunk;
+  ChainWriter data_writer(&chunk.data);
+  internal::Compressor compressor(compressor_options_, decoded_data_size);
+  if (ABSL_PREDICT_FALSE(
+          !WriteByte(&data_writer,
+                     static_cast<uint8_t>(ChunkType::kFragment))) ||
+      ABSL_PREDICT_FALSE(!WriteByte(
+          &data_writer, (first ? internal::kFirstFragment : uint8_t{0}) |
+                            (last ? internal::kLastFragment : uint8_t{0}))) ||
+      ABSL_PREDICT_FALSE(!WriteByte(
+          &data_writer,
+          static_cast<uint8_t>(compressor_options_.compression_type())))) {
+    return Fail(data_writer);
+  }
+  if (ABSL_PREDICT_FALSE(!compressor.writer()->Write(std::move(fragment)))) {
+    return Fail(*compressor.writer());
+  }
+  if (ABSL_PREDICT_FALSE(!compressor.EncodeAndClose(&data_writer))) {
+    return Fail(compressor);
+  }
+  if (ABSL_PREDICT_FALSE(!data_writer.Close())) return Fail(data_writer);
+  chunk.header =
+      ChunkHeader(chunk.data, first ? uint64_t{1} : uint64_t{0},
+                  decoded_data_size);
+  return CopyChunk(std::move(chunk));
+}
+
+bool RecordWriter::Impl::WriteChunk(
+    ChunkWriter* chunk_writer, const Chunk& chunk,
+    std::vector<ChunkIndex::FieldRange> field_ranges, std::string first_key,
+    std::string key_filter, uint64_t chunk_id) {
+  const Position chunk_begin = chunk_writer->pos();
+  {
+    RecordTracer::Span span(tracer_, TraceStage::kWrite, chunk_id);
+    RecordStats::Timer timer(stats_, &RecordStats::write_nanos_,
+                             &RecordStats::write_latency_);
+    if (rate_limiter_ != nullptr) {
+      rate_limiter_->Acquire(ChunkHeader::size() + chunk.data.size(),
+                             rate_priority_);
+    }
+    if (ABSL_PREDICT_FALSE(!chunk_writer->WriteChunk(chunk))) {
+      return Fail(*chunk_writer);
+    }
+  }
+  if (chunk_index_ != nullptr) {
+    chunk_index_->AddChunk(chunk_begin, chunk.header, std::move(field_ranges),
+                           std::move(first_key), std::move(key_filter));
+  }
+  if (file_summary_ != nullptr) file_summary_->AddChunk(chunk.header);
+  if (stats_ != nullptr) {
+    stats_->AddWrittenChunk(chunk);
+  }
+  return true;
+}
+
+bool RecordWriter::Impl::WriteChunkIndex(ChunkWriter* chunk_writer) {
+  if (chunk_index_ == nullptr) return true;
+  Chunk chunk;
+  chunk_index_->EncodeToChunk(&chunk);
+  if (ABSL_PREDICT_FALSE(!chunk_writer->WriteChunk(chunk))) {
+    return Fail(*chunk_writer);
+  }
+  return true;
+}
+
+bool RecordWriter::Impl::WriteFileSummary(ChunkWriter* chunk_writer) {
+  if (file_summary_ == nullptr) return true;
+  Chunk chunk;
+  file_summary_->EncodeToChunk(&chunk);
+  if (ABSL_PREDICT_FALSE(!chunk_writer->WriteChunk(chunk))) {
+    return Fail(*chunk_writer);
+  }
+  return true;
+}
+
+void RecordWriter::Impl::AddMembersTo(MemoryEstimator* memory_estimator) const {
+  if (chunk_encoder_ != nullptr) chunk_encoder_->AddUniqueTo(memory_estimator);
+  memory_estimator->AddMemory(
+      sizeof(ChunkIndexField) * chunk_index_fields_.capacity() +
+      sizeof(FieldAggregator) * field_aggregators_.capacity() +
+      last_key_.capacity() + first_key_.capacity() +
+      sizeof(uint64_t) * key_hashes_.capacity());
+}
+
+std::vector<ChunkIndex::FieldRange> RecordWriter::Impl::TakeFieldRanges() {
+  std::vector<ChunkIndex::FieldRange> field_ranges;
+  field_ranges.reserve(field_aggregators_.size());
+  for (FieldAggregator& field_aggregator : field_aggregators_) {
+    field_ranges.push_back(ChunkIndex::FieldRange{
+        field_aggregator.count(), field_aggregator.min(),
+        field_aggregator.max()});
+    field_aggregator.Clear();
+  }
+  return field_ranges;
+}
+
+std::string RecordWriter::Impl::TakeFirstKey() {
+  if (!has_first_key_) return std::string();
+  has_first_key_ = false;
+  return std::move(first_key_);
+}
+
+std::string RecordWriter::Impl::TakeKeyFilter() {
+  if (key_filter_bits_per_key_ == 0 || key_hashes_.empty()) {
+    return std::string();
+  }
+  std::string key_filter =
+      ChunkIndex::MakeKeyFilter(key_hashes_, key_filter_bits_per_key_);
+  key_hashes_.clear();
+  return key_filter;
+}
+
+inline bool RecordWriter::Impl::AddToIndex(absl::string_view record) {
+  if (key_function_ != nullptr) {
+    std::string key = key_function_(record);
+    if (ABSL_PREDICT_FALSE(has_last_key_ && key < last_key_)) {
+      return Fail("Records are not sorted by key");
+    }
+    if (!has_first_key_) {
+      first_key_ = key;
+      has_first_key_ = true;
+    }
+    if (key_filter_bits_per_key_ > 0) {
+      key_hashes_.push_back(ChunkIndex::HashKey(key));
+    }
+    last_key_ = std::move(key);
+    has_last_key_ = true;
+  }
+  for (size_t i = 0; i < chunk_index_fields_.size(); ++i) {
+    field_column_.Clear();
+    if (ABSL_PREDICT_FALSE(!ProjectField(chunk_index_fields_[i].field,
+                                         absl::MakeConstSpan(&record, 1),
+                                         &field_column_))) {
+      // The record is not a valid serialized proto message. Make the range
+      // unbounded, so that the chunk is never skipped because of it.
+      field_aggregators_[i].Add(-std::numeric_limits<double>::infinity());
+      field_aggregators_[i].Add(std::numeric_limits<double>::infinity());
+      continue;
+    }
+    field_aggregators_[i].Add(field_column_);
+  }
+  return true;
+}
+
+inline bool RecordWriter::Impl::AddToIndex(const Chain& record) {
+  if (record.blocks().size() == 1) {
+    return AddToIndex(record.blocks().front());
+  } else {
+    const std::string flat_record(record);
+    return AddToIndex(absl::string_view(flat_record));
+  }
+}
+
+template <typename Record>
+inline bool RecordWriter::Impl::AddToEncoder(Record&& record) {
   if (ABSL_PREDICT_FALSE(
           !chunk_encoder_->AddRecord(std::forward<Record>(record)))) {
     return Fail(*chunk_encoder_);
@@ -191,6 +895,53 @@ bool RecordWriter::Impl::AddRecord(Record&& record) {
   return true;
 }
 
+template <typename Record>
+bool RecordWriter::Impl::AddRecord(Record&& record) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (IndexesRecords()) {
+    if (ABSL_PREDICT_FALSE(!AddToIndex(record))) return false;
+  }
+  return AddToEncoder(std::forward<Record>(record));
+}
+
+bool RecordWriter::Impl::AddRecord(
+    const google::protobuf::MessageLite& record) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (IndexesRecords()) {
+    // Serialize the record once for both the index and the chunk encoder.
+    // If this fails, the chunk encoder reports the failure below.
+    Chain serialized;
+    if (ABSL_PREDICT_TRUE(SerializeToChain(record, &serialized))) {
+      if (ABSL_PREDICT_FALSE(!AddToIndex(serialized))) return false;
+      return AddToEncoder(std::move(serialized));
+    }
+  }
+  return AddToEncoder(record);
+}
+
+bool RecordWriter::Impl::AddRecords(Chain records, std::vector<size_t> limits) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (IndexesRecords()) {
+    size_t begin = 0;
+    ChainReader records_reader(&records);
+    std::string scratch;
+    for (const size_t limit : limits) {
+      absl::string_view record;
+      if (!records_reader.Read(&record, &scratch, limit - begin)) {
+        RIEGELI_ASSERT_UNREACHABLE()
+            << "Failed reading records: " << records_reader.message();
+      }
+      if (ABSL_PREDICT_FALSE(!AddToIndex(record))) return false;
+      begin = limit;
+    }
+  }
+  if (ABSL_PREDICT_FALSE(!chunk_encoder_->AddRecords(std::move(records),
+                                                     std::move(limits)))) {
+    return Fail(*chunk_encoder_);
+  }
+  return true;
+}
+
 inline FutureRecordPosition RecordWriter::Impl::Pos() {
   FutureRecordPosition pos = ChunkBegin();
   pos.record_index_ = chunk_encoder_->num_records();
@@ -199,35 +950,69 @@ inline FutureRecordPosition RecordWriter::Impl::Pos() {
 
 class RecordWriter::SerialImpl final : public Impl {
  public:
-  SerialImpl(ChunkWriter* chunk_writer, const Options& options)
-      : Impl(MakeChunkEncoder(options)), chunk_writer_(chunk_writer) {}
-
-  void OpenChunk() override { chunk_encoder_->Reset(); }
-  bool CloseChunk() override;
+  // Reuses chunk_encoder unless it is nullptr.
+  SerialImpl(ChunkWriter* chunk_writer, const Options& options,
+             std::unique_ptr<ChunkEncoder> chunk_encoder)
+      : Impl(chunk_encoder != nullptr ? std::move(chunk_encoder)
+                                      : MakeChunkEncoder(options),
+             options),
+        chunk_writer_(chunk_writer),
+        options_(options) {}
+
+  void OpenChunk() override {
+    TraceOpenChunk();
+    chunk_encoder_->Reset();
+  }
+  bool CloseChunk(uint64_t chunk_size) override;
+  bool CopyChunk(Chunk chunk) override {
+    if (ABSL_PREDICT_FALSE(!healthy())) return false;
+    return WriteChunk(chunk_writer_, chunk, {}, std::string(), std::string(),
+                      NewChunkId());
+  }
+  bool TranscodeAndCopyChunk(
+      Chunk chunk, const ZstdDictionaryRegistry* zstd_dictionaries) override {
+    if (ABSL_PREDICT_FALSE(!healthy())) return false;
+    Chunk transcoded;
+    if (ABSL_PREDICT_FALSE(
+            !TranscodeChunk(chunk, zstd_dictionaries, &transcoded))) {
+      return false;
+    }
+    return CopyChunk(std::move(transcoded));
+  }
   bool Flush(FlushType flush_type) override;
+  std::shared_future<bool> FlushAsync(
+      FlushType flush_type, FdGroupCommitter* group_committer) override;
+  void AddUniqueTo(MemoryEstimator* memory_estimator) override;
+  std::unique_ptr<ChunkEncoder> TakeChunkEncoder(
+      const Options& options) override {
+    if (!SameChunkEncoding(options_, options)) return nullptr;
+    return std::move(chunk_encoder_);
+  }
 
  protected:
-  void Done() override {}
+  void Done() override;
   FutureRecordPosition ChunkBegin() override;
 
  private:
   ChunkWriter* chunk_writer_;
+  // Options which chunk_encoder_ was made with, compared by TakeChunkEncoder().
+  Options options_;
 };
 
-bool RecordWriter::SerialImpl::CloseChunk() {
+bool RecordWriter::SerialImpl::CloseChunk(uint64_t chunk_size) {
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
   Chunk chunk;
-  if (ABSL_PREDICT_FALSE(!chunk_encoder_->EncodeAndClose(&chunk))) {
+  if (ABSL_PREDICT_FALSE(
+          !EncodeChunk(chunk_encoder_.get(), &chunk, open_chunk_id_))) {
     return Fail("Encoding chunk failed", *chunk_encoder_);
   }
-  if (ABSL_PREDICT_FALSE(!chunk_writer_->WriteChunk(chunk))) {
-    return Fail(*chunk_writer_);
-  }
-  return true;
+  return WriteChunk(chunk_writer_, chunk, TakeFieldRanges(), TakeFirstKey(),
+                    TakeKeyFilter(), open_chunk_id_);
 }
 
 bool RecordWriter::SerialImpl::Flush(FlushType flush_type) {
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  RecordTracer::Span span(tracer_, TraceStage::kFlush, 0);
   if (ABSL_PREDICT_FALSE(!chunk_writer_->Flush(flush_type))) {
     if (chunk_writer_->healthy()) return false;
     return Fail(*chunk_writer_);
@@ -235,10 +1020,32 @@ bool RecordWriter::SerialImpl::Flush(FlushType flush_type) {
   return true;
 }
 
+std::shared_future<bool> RecordWriter::SerialImpl::FlushAsync(
+    FlushType flush_type, FdGroupCommitter* group_committer) {
+  if (group_committer == nullptr) return ReadyFuture(Flush(flush_type));
+  if (ABSL_PREDICT_FALSE(!Flush(FlushType::kFromProcess))) {
+    return ReadyFuture(false);
+  }
+  return group_committer->Commit();
+}
+
+void RecordWriter::SerialImpl::Done() {
+  if (ABSL_PREDICT_TRUE(healthy()) && WriteChunkIndex(chunk_writer_)) {
+    WriteFileSummary(chunk_writer_);
+  }
+}
+
 FutureRecordPosition RecordWriter::SerialImpl::ChunkBegin() {
   return FutureRecordPosition(chunk_writer_->pos());
 }
 
+void RecordWriter::SerialImpl::AddUniqueTo(MemoryEstimator* memory_estimator) {
+  memory_estimator->AddMemory(sizeof(SerialImpl));
+  AddMembersTo(memory_estimator);
+  if (chunk_index_ != nullptr) chunk_index_->AddUniqueTo(memory_estimator);
+  chunk_writer_->AddSharedTo(memory_estimator);
+}
+
 // ParallelImpl uses parallelism internally, but the class is still only
 // thread-compatible, not thread-safe.
 class RecordWriter::ParallelImpl final : public Impl {
@@ -247,9 +1054,23 @@ class RecordWriter::ParallelImpl final : public Impl {
 
   ~ParallelImpl();
 
-  void OpenChunk() override { chunk_encoder_ = MakeChunkEncoder(options_); }
-  bool CloseChunk() override;
+  void OpenChunk() override;
+  bool CloseChunk(uint64_t chunk_size) override;
   bool Flush(FlushType flush_type) override;
+  std::shared_future<bool> FlushAsync(
+      FlushType flush_type, FdGroupCommitter* group_committer) override;
+  uint64_t PendingBytes() override;
+  bool SupportsProducers() const override { return !IndexesRecords(); }
+  std::unique_ptr<ChunkEncoder> MakeProducerEncoder() override {
+    return MakeChunkEncoder(options_);
+  }
+  bool CloseProducerChunk(std::unique_ptr<ChunkEncoder> chunk_encoder,
+                          uint64_t chunk_size,
+                          std::promise<Position> chunk_begin) override;
+  bool CopyChunk(Chunk chunk) override;
+  bool TranscodeAndCopyChunk(
+      Chunk chunk, const ZstdDictionaryRegistry* zstd_dictionaries) override;
+  void AddUniqueTo(MemoryEstimator* memory_estimator) override;
 
  protected:
   void Done() override;
@@ -270,14 +1091,24 @@ class RecordWriter::ParallelImpl final : public Impl {
   struct WriteChunkRequest {
     std::shared_future<ChunkHeader> chunk_header;
     std::future<Chunk> chunk;
+    std::vector<ChunkIndex::FieldRange> field_ranges;
+    std::string first_key;
+    std::string key_filter;
+    // Set to the position of the chunk before writing it.
+    std::promise<Position> chunk_begin;
+    // Chunk id for tracer_.
+    uint64_t chunk_id = 0;
+    // When the chunk was queued, by tracer_->NowNanos(), or 0 if tracer_ is
+    // nullptr.
+    uint64_t queued_nanos = 0;
   };
   struct FlushRequest {
     FlushType flush_type;
+    // If not nullptr, the flush is completed by a sync through it.
+    FdGroupCommitter* group_committer;
     std::promise<bool> done;
   };
-  struct DoneRequest {
-    std::promise<void> done;
-  };
+  struct DoneRequest {};
   struct ChunkWriterRequest {
     explicit ChunkWriterRequest(WriteChunkRequest write_chunk_request);
     explicit ChunkWriterRequest(FlushRequest flush_request);
@@ -296,12 +1127,63 @@ class RecordWriter::ParallelImpl final : public Impl {
     };
   };
 
+  // Queues chunk_encoder to be encoded in the thread pool and then written by
+  // the chunk writer thread.
+  //
+  // This is thread-safe.
+  //
+  // If the result is false then !healthy().
+  bool QueueChunk(std::unique_ptr<ChunkEncoder> chunk_encoder,
+                  uint64_t chunk_size, WriteChunkRequest write_chunk_request);
+
+  // Traces the beginning of TraceStage::kQueue for write_chunk_request, which
+  // is about to be added to chunk_writer_requests_.
+  void TraceQueued(WriteChunkRequest* write_chunk_request);
+  // Traces the end of TraceStage::kQueue for write_chunk_request, which the
+  // chunk writer thread starts handling.
+  void TraceDequeued(const WriteChunkRequest& write_chunk_request);
+
+  // Returns the position after chunks in chunk_writer_requests_.
+  FutureRecordPosition ComputeChunkBegin() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Waits until a chunk of chunk_size can be added to chunk_writer_requests_
+  // according to parallelism and max_pending_bytes, and locks mutex_.
+  void LockWhenQueueHasSpace(uint64_t chunk_size)
+      EXCLUSIVE_LOCK_FUNCTION(mutex_);
+
+  // Returns true if chunks pending before queueing the next chunk indicate
+  // that encoding falls behind, see Options::set_backlog_compression().
+  bool FallsBehind() const EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  ThreadPool& thread_pool() const {
+    return options_.thread_pool_ != nullptr ? *options_.thread_pool_
+                                            : internal::DefaultThreadPool();
+  }
+
   Options options_;
+  // options_ with backlog_compression_ as the compression, used for chunks
+  // opened while falls_behind_, if options_.has_backlog_compression_.
+  Options backlog_options_;
   ChunkWriter* chunk_writer_;
+  // The chunk writer thread handles chunk_writer_requests_ until DoneRequest.
+  // It has its own thread rather than a task in the thread pool because it
+  // waits for chunks being encoded by tasks in the thread pool.
+  std::thread chunk_writer_thread_;
   absl::Mutex mutex_;
   std::deque<ChunkWriterRequest> chunk_writer_requests_ GUARDED_BY(mutex_);
   // Position before handling chunk_writer_requests_.
   Position pos_before_chunks_ GUARDED_BY(mutex_);
+  // Sizes of chunks of WriteChunkRequests in chunk_writer_requests_: record
+  // sizes while a chunk is being encoded, then the encoded size.
+  uint64_t pending_bytes_ GUARDED_BY(mutex_) = 0;
+  // Whether FallsBehind() was true when the last chunk was queued.
+  bool falls_behind_ GUARDED_BY(mutex_) = false;
+  // Position of the open chunk, computed by ChunkBegin() once per chunk, so
+  // that positions of its records share it instead of each collecting headers
+  // of pending chunks. Valid if has_open_chunk_begin_. Guarded by mutex_
+  // because FlushAsync() is also called by Producers.
+  FutureRecordPosition open_chunk_begin_ GUARDED_BY(mutex_);
+  bool has_open_chunk_begin_ GUARDED_BY(mutex_) = false;
 };
 
 inline RecordWriter::ParallelImpl::ChunkWriterRequest::ChunkWriterRequest(
@@ -366,12 +1248,21 @@ RecordWriter::ParallelImpl::ChunkWriterRequest::operator=(
 
 inline RecordWriter::ParallelImpl::ParallelImpl(ChunkWriter* chunk_writer,
                                                 const Options& options)
-    : options_(options),
+    : Impl(options),
+      options_(options),
       chunk_writer_(chunk_writer),
       pos_before_chunks_(chunk_writer_->pos()) {
-  internal::DefaultThreadPool().Schedule([this] {
+  if (options_.has_backlog_compression_) {
+    backlog_options_ = options_;
+    backlog_options_.compressor_options_ = options_.backlog_compression_;
+  }
+  chunk_writer_thread_ = std::thread([this] {
+    if (!options_.chunk_writer_cpus_.empty()) {
+      internal::SetCurrentThreadAffinity(options_.chunk_writer_cpus_);
+    }
     mutex_.Lock();
     for (;;) {
+      uint64_t written_bytes = 0;
       mutex_.Await(absl::Condition(
           +[](std::deque<ChunkWriterRequest>* chunk_writer_requests) {
             return !chunk_writer_requests->empty();
@@ -381,14 +1272,25 @@ inline RecordWriter::ParallelImpl::ParallelImpl(ChunkWriter* chunk_writer,
       mutex_.Unlock();
       switch (request.request_type) {
         case RequestType::kWriteChunkRequest: {
+          TraceDequeued(request.write_chunk_request);
           // If !healthy(), the chunk must still be waited for, to ensure that
           // the chunk encoder thread exits before the chunk writer thread
           // responds to DoneRequest.
-          const Chunk chunk = request.write_chunk_request.chunk.get();
+          const Chunk chunk = [&] {
+            RecordTracer::Span span(tracer_, TraceStage::kEncodeWait,
+                                    request.write_chunk_request.chunk_id);
+            RecordStats::Timer timer(stats_, &RecordStats::encode_wait_nanos_);
+            return request.write_chunk_request.chunk.get();
+          }();
+          written_bytes = chunk.data.size();
+          request.write_chunk_request.chunk_begin.set_value(
+              chunk_writer_->pos());
           if (ABSL_PREDICT_FALSE(!healthy())) goto handled;
-          if (ABSL_PREDICT_FALSE(!chunk_writer_->WriteChunk(chunk))) {
-            Fail(*chunk_writer_);
-          }
+          WriteChunk(chunk_writer_, chunk,
+                     std::move(request.write_chunk_request.field_ranges),
+                     std::move(request.write_chunk_request.first_key),
+                     std::move(request.write_chunk_request.key_filter),
+                     request.write_chunk_request.chunk_id);
           goto handled;
         }
         case RequestType::kFlushRequest: {
@@ -396,19 +1298,31 @@ inline RecordWriter::ParallelImpl::ParallelImpl(ChunkWriter* chunk_writer,
             request.flush_request.done.set_value(false);
             goto handled;
           }
-          if (ABSL_PREDICT_FALSE(
-                  !chunk_writer_->Flush(request.flush_request.flush_type))) {
+          FdGroupCommitter* const group_committer =
+              request.flush_request.group_committer;
+          bool flushed;
+          {
+            RecordTracer::Span span(tracer_, TraceStage::kFlush, 0);
+            flushed = chunk_writer_->Flush(
+                group_committer != nullptr ? FlushType::kFromProcess
+                                           : request.flush_request.flush_type);
+          }
+          if (ABSL_PREDICT_FALSE(!flushed)) {
             if (!chunk_writer_->healthy()) Fail(*chunk_writer_);
             request.flush_request.done.set_value(false);
             goto handled;
           }
+          if (group_committer != nullptr) {
+            // The sync runs in the thread of the FdGroupCommitter, so that
+            // writing further chunks does not wait for it.
+            group_committer->Commit(std::move(request.flush_request.done));
+            goto handled;
+          }
           request.flush_request.done.set_value(true);
           goto handled;
         }
-        case RequestType::kDoneRequest: {
-          request.done_request.done.set_value();
+        case RequestType::kDoneRequest:
           return;
-        }
       }
       RIEGELI_ASSERT_UNREACHABLE()
           << "Unknown request type: " << static_cast<int>(request.request_type);
@@ -416,6 +1330,7 @@ inline RecordWriter::ParallelImpl::ParallelImpl(ChunkWriter* chunk_writer,
       mutex_.Lock();
       chunk_writer_requests_.pop_front();
       pos_before_chunks_ = chunk_writer_->pos();
+      pending_bytes_ -= written_bytes;
     }
   });
 }
@@ -429,38 +1344,178 @@ RecordWriter::ParallelImpl::~ParallelImpl() {
 }
 
 void RecordWriter::ParallelImpl::Done() {
-  std::promise<void> done_promise;
-  std::future<void> done_future = done_promise.get_future();
   {
     absl::MutexLock lock(&mutex_);
-    chunk_writer_requests_.emplace_back(DoneRequest{std::move(done_promise)});
+    chunk_writer_requests_.emplace_back(DoneRequest());
+  }
+  chunk_writer_thread_.join();
+  if (ABSL_PREDICT_TRUE(healthy()) && WriteChunkIndex(chunk_writer_)) {
+    WriteFileSummary(chunk_writer_);
+  }
+}
+
+void RecordWriter::ParallelImpl::OpenChunk() {
+  TraceOpenChunk();
+  bool falls_behind;
+  {
+    absl::MutexLock lock(&mutex_);
+    has_open_chunk_begin_ = false;
+    falls_behind = falls_behind_;
+  }
+  if (options_.has_backlog_compression_ && falls_behind) {
+    chunk_encoder_ = MakeChunkEncoder(backlog_options_);
+    return;
+  }
+  chunk_encoder_ = MakeChunkEncoder(options_);
+}
+
+inline bool RecordWriter::ParallelImpl::FallsBehind() const {
+  size_t pending_chunks = 0;
+  for (const ChunkWriterRequest& request : chunk_writer_requests_) {
+    if (request.request_type == RequestType::kWriteChunkRequest) {
+      ++pending_chunks;
+    }
   }
-  done_future.get();
+  return pending_chunks * 2 >= IntCast<size_t>(options_.parallelism_) ||
+         pending_bytes_ > options_.max_pending_bytes_ / 2;
+}
+
+bool RecordWriter::ParallelImpl::CloseChunk(uint64_t chunk_size) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  WriteChunkRequest write_chunk_request;
+  write_chunk_request.field_ranges = TakeFieldRanges();
+  write_chunk_request.first_key = TakeFirstKey();
+  write_chunk_request.key_filter = TakeKeyFilter();
+  write_chunk_request.chunk_id = open_chunk_id_;
+  return QueueChunk(std::move(chunk_encoder_), chunk_size,
+                    std::move(write_chunk_request));
+}
+
+bool RecordWriter::ParallelImpl::CloseProducerChunk(
+    std::unique_ptr<ChunkEncoder> chunk_encoder, uint64_t chunk_size,
+    std::promise<Position> chunk_begin) {
+  if (ABSL_PREDICT_FALSE(!healthy())) {
+    // Positions of records in the chunk are meaningless, but resolving them
+    // must not fail with a broken promise.
+    chunk_begin.set_value(0);
+    return false;
+  }
+  WriteChunkRequest write_chunk_request;
+  write_chunk_request.chunk_begin = std::move(chunk_begin);
+  write_chunk_request.chunk_id = NewChunkId();
+  return QueueChunk(std::move(chunk_encoder), chunk_size,
+                    std::move(write_chunk_request));
+}
+
+inline void RecordWriter::ParallelImpl::LockWhenQueueHasSpace(
+    uint64_t chunk_size) {
+  RecordTracer::Span span(tracer_, TraceStage::kQueueWait, 0);
+  RecordStats::Timer timer(stats_, &RecordStats::queue_wait_nanos_,
+                           &RecordStats::write_stall_latency_);
+  struct Args {
+    ParallelImpl* self;
+    uint64_t chunk_size;
+  };
+  Args args{this, chunk_size};
+  mutex_.LockWhen(absl::Condition(
+      +[](Args* args) {
+        ParallelImpl* const self = args->self;
+        self->mutex_.AssertHeld();
+        // A chunk larger than max_pending_bytes_ is let through when nothing
+        // else is pending, otherwise it would wait forever.
+        return self->chunk_writer_requests_.size() <
+                   IntCast<size_t>(self->options_.parallelism_) &&
+               (self->pending_bytes_ == 0 ||
+                (args->chunk_size <= self->options_.max_pending_bytes_ &&
+                 self->pending_bytes_ <=
+                     self->options_.max_pending_bytes_ - args->chunk_size));
+      },
+      &args));
+}
+
+bool RecordWriter::ParallelImpl::CopyChunk(Chunk chunk) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  // The chunk is already encoded, so its futures are ready at once.
+  std::promise<ChunkHeader> chunk_header;
+  std::promise<Chunk> encoded_chunk;
+  WriteChunkRequest write_chunk_request;
+  write_chunk_request.chunk_header = chunk_header.get_future().share();
+  write_chunk_request.chunk = encoded_chunk.get_future();
+  write_chunk_request.chunk_id = NewChunkId();
+  const uint64_t chunk_size = chunk.data.size();
+  chunk_header.set_value(chunk.header);
+  encoded_chunk.set_value(std::move(chunk));
+  LockWhenQueueHasSpace(chunk_size);
+  TraceQueued(&write_chunk_request);
+  chunk_writer_requests_.emplace_back(std::move(write_chunk_request));
+  pending_bytes_ += chunk_size;
+  // The open chunk now follows the copied chunk.
+  has_open_chunk_begin_ = false;
+  mutex_.Unlock();
+  return true;
 }
 
-bool RecordWriter::ParallelImpl::CloseChunk() {
+bool RecordWriter::ParallelImpl::TranscodeAndCopyChunk(
+    Chunk chunk, const ZstdDictionaryRegistry* zstd_dictionaries) {
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
-  ChunkEncoder* const chunk_encoder = chunk_encoder_.release();
+  // The chunk is transcoded in the thread pool like a chunk being encoded, so
+  // that several chunks are transcoded in parallel.
   ChunkPromises* const chunk_promises = new ChunkPromises();
-  {
-    mutex_.LockWhen(absl::Condition(
-        +[](ParallelImpl* self) {
-          self->mutex_.AssertHeld();
-          return self->chunk_writer_requests_.size() <
-                 IntCast<size_t>(self->options_.parallelism_);
-        },
-        this));
-    chunk_writer_requests_.emplace_back(
-        WriteChunkRequest{chunk_promises->chunk_header.get_future(),
-                          chunk_promises->chunk.get_future()});
-    mutex_.Unlock();
-  }
-  internal::DefaultThreadPool().Schedule([this, chunk_encoder, chunk_promises] {
+  WriteChunkRequest write_chunk_request;
+  write_chunk_request.chunk_header =
+      chunk_promises->chunk_header.get_future().share();
+  write_chunk_request.chunk = chunk_promises->chunk.get_future();
+  write_chunk_request.chunk_id = NewChunkId();
+  const uint64_t chunk_size = chunk.data.size();
+  LockWhenQueueHasSpace(chunk_size);
+  TraceQueued(&write_chunk_request);
+  chunk_writer_requests_.emplace_back(std::move(write_chunk_request));
+  pending_bytes_ += chunk_size;
+  has_open_chunk_begin_ = false;
+  mutex_.Unlock();
+  Chunk* const src = new Chunk(std::move(chunk));
+  thread_pool().Schedule(
+      [this, chunk_size, src, zstd_dictionaries, chunk_promises] {
+        Chunk transcoded;
+        TranscodeChunk(*src, zstd_dictionaries, &transcoded);
+        delete src;
+        {
+          absl::MutexLock lock(&mutex_);
+          pending_bytes_ = pending_bytes_ - chunk_size + transcoded.data.size();
+        }
+        chunk_promises->chunk_header.set_value(transcoded.header);
+        chunk_promises->chunk.set_value(std::move(transcoded));
+        delete chunk_promises;
+      });
+  return true;
+}
+
+bool RecordWriter::ParallelImpl::QueueChunk(
+    std::unique_ptr<ChunkEncoder> chunk_encoder, uint64_t chunk_size,
+    WriteChunkRequest write_chunk_request) {
+  ChunkPromises* const chunk_promises = new ChunkPromises();
+  write_chunk_request.chunk_header =
+      chunk_promises->chunk_header.get_future().share();
+  write_chunk_request.chunk = chunk_promises->chunk.get_future();
+  const uint64_t chunk_id = write_chunk_request.chunk_id;
+  LockWhenQueueHasSpace(chunk_size);
+  falls_behind_ = FallsBehind();
+  TraceQueued(&write_chunk_request);
+  chunk_writer_requests_.emplace_back(std::move(write_chunk_request));
+  pending_bytes_ += chunk_size;
+  mutex_.Unlock();
+  ChunkEncoder* const encoder = chunk_encoder.release();
+  thread_pool().Schedule([this, chunk_size, chunk_id, encoder,
+                          chunk_promises] {
     Chunk chunk;
-    if (ABSL_PREDICT_FALSE(!chunk_encoder->EncodeAndClose(&chunk))) {
-      Fail("Encoding chunk failed", *chunk_encoder);
+    if (ABSL_PREDICT_FALSE(!EncodeChunk(encoder, &chunk, chunk_id))) {
+      Fail("Encoding chunk failed", *encoder);
+    }
+    delete encoder;
+    {
+      absl::MutexLock lock(&mutex_);
+      pending_bytes_ = pending_bytes_ - chunk_size + chunk.data.size();
     }
-    delete chunk_encoder;
     chunk_promises->chunk_header.set_value(chunk.header);
     chunk_promises->chunk.set_value(std::move(chunk));
     delete chunk_promises;
@@ -468,31 +1523,169 @@ bool RecordWriter::ParallelImpl::CloseChunk() {
   return true;
 }
 
+inline void RecordWriter::ParallelImpl::TraceQueued(
+    WriteChunkRequest* write_chunk_request) {
+  RIEGELI_INTERNAL_TRACEPOINT(stage_begin,
+                              static_cast<uint32_t>(TraceStage::kQueue),
+                              write_chunk_request->chunk_id);
+  if (tracer_ != nullptr) {
+    write_chunk_request->queued_nanos = tracer_->NowNanos();
+  }
+}
+
+inline void RecordWriter::ParallelImpl::TraceDequeued(
+    const WriteChunkRequest& write_chunk_request) {
+  RIEGELI_INTERNAL_TRACEPOINT(stage_end,
+                              static_cast<uint32_t>(TraceStage::kQueue),
+                              write_chunk_request.chunk_id);
+  if (tracer_ != nullptr) {
+    tracer_->AddEvent(TraceStage::kQueue, write_chunk_request.chunk_id,
+                      write_chunk_request.queued_nanos);
+  }
+}
+
 bool RecordWriter::ParallelImpl::Flush(FlushType flush_type) {
+  std::shared_future<bool> done_future = FlushAsync(flush_type, nullptr);
+  RecordTracer::Span span(tracer_, TraceStage::kQueueWait, 0);
+  RecordStats::Timer timer(stats_, &RecordStats::queue_wait_nanos_);
+  return done_future.get();
+}
+
+std::shared_future<bool> RecordWriter::ParallelImpl::FlushAsync(
+    FlushType flush_type, FdGroupCommitter* group_committer) {
   std::promise<bool> done_promise;
-  std::future<bool> done_future = done_promise.get_future();
-  {
-    absl::MutexLock lock(&mutex_);
-    chunk_writer_requests_.emplace_back(
-        FlushRequest{flush_type, std::move(done_promise)});
+  std::shared_future<bool> done_future = done_promise.get_future().share();
+  absl::MutexLock lock(&mutex_);
+  // The ChunkWriter is not expected to move its position when flushing, but
+  // this is not guaranteed.
+  has_open_chunk_begin_ = false;
+  chunk_writer_requests_.emplace_back(
+      FlushRequest{flush_type, group_committer, std::move(done_promise)});
+  return done_future;
+}
+
+uint64_t RecordWriter::ParallelImpl::PendingBytes() {
+  absl::MutexLock lock(&mutex_);
+  return pending_bytes_;
+}
+
+void RecordWriter::ParallelImpl::AddUniqueTo(
+    MemoryEstimator* memory_estimator) {
+  memory_estimator->AddMemory(sizeof(ParallelImpl));
+  AddMembersTo(memory_estimator);
+  absl::MutexLock lock(&mutex_);
+  // Chunk encoders and encoded chunks are owned by background tasks, so they
+  // are approximated by pending_bytes_.
+  memory_estimator->AddMemory(
+      sizeof(ChunkWriterRequest) * chunk_writer_requests_.size() +
+      IntCast<size_t>(pending_bytes_));
+  // If there are no requests, the chunk writer thread is waiting for one, and
+  // it cannot get one while mutex_ is held.
+  if (chunk_writer_requests_.empty()) {
+    if (chunk_index_ != nullptr) chunk_index_->AddUniqueTo(memory_estimator);
+    chunk_writer_->AddSharedTo(memory_estimator);
   }
-  return done_future.get();
 }
 
 FutureRecordPosition RecordWriter::ParallelImpl::ChunkBegin() {
   absl::MutexLock lock(&mutex_);
+  if (!has_open_chunk_begin_) {
+    open_chunk_begin_ = ComputeChunkBegin();
+    has_open_chunk_begin_ = true;
+  }
+  return open_chunk_begin_;
+}
+
+FutureRecordPosition RecordWriter::ParallelImpl::ComputeChunkBegin() {
   std::vector<std::shared_future<ChunkHeader>> chunk_headers;
   chunk_headers.reserve(chunk_writer_requests_.size());
   for (const auto& pending_request : chunk_writer_requests_) {
-    RIEGELI_ASSERT(pending_request.request_type ==
-                   RequestType::kWriteChunkRequest)
-        << "Unexpected type of request in the queue: "
-        << static_cast<int>(pending_request.request_type);
+    // FlushRequests can be queued by FlushAsync() or by Producers.
+    if (pending_request.request_type != RequestType::kWriteChunkRequest) {
+      continue;
+    }
     chunk_headers.push_back(pending_request.write_chunk_request.chunk_header);
   }
   return FutureRecordPosition(pos_before_chunks_, std::move(chunk_headers));
 }
 
+// The Writer returned by RecordWriter::BeginRecord(). It collects up to
+// fragment_size bytes of the record in fragment_, and writes a fragment only
+// when more data follow or when it is closed, so that the last fragment is
+// marked as such.
+class RecordWriter::RecordStreamWriter final : public BufferedWriter {
+ public:
+  RecordStreamWriter(RecordWriter* record_writer, size_t fragment_size)
+      : BufferedWriter(UnsignedMin(fragment_size, kDefaultBufferSize())),
+        record_writer_(record_writer),
+        fragment_size_(fragment_size) {}
+
+  // Fragments are not written before the next one is known to be needed, so
+  // this only moves buffered data to fragment_.
+  bool Flush(FlushType flush_type) override { return PushInternal(); }
+
+ protected:
+  void Done() override;
+  bool WriteInternal(absl::string_view src) override;
+
+ private:
+  // Writes fragment_ with record_writer_.
+  bool WriteFragment(bool last);
+
+  RecordWriter* record_writer_;
+  size_t fragment_size_;
+  Chain fragment_;
+  bool first_ = true;
+};
+
+void RecordWriter::RecordStreamWriter::Done() {
+  if (ABSL_PREDICT_TRUE(PushInternal())) WriteFragment(true);
+  fragment_ = Chain();
+  BufferedWriter::Done();
+}
+
+bool RecordWriter::RecordStreamWriter::WriteInternal(absl::string_view src) {
+  RIEGELI_ASSERT(!src.empty())
+      << "Failed precondition of BufferedWriter::WriteInternal(): "
+         "nothing to write";
+  RIEGELI_ASSERT(healthy())
+      << "Failed precondition of BufferedWriter::WriteInternal(): "
+         "Object unhealthy";
+  RIEGELI_ASSERT_EQ(written_to_buffer(), 0u)
+      << "Failed precondition of BufferedWriter::WriteInternal(): "
+         "buffer not cleared";
+  if (ABSL_PREDICT_FALSE(src.size() >
+                         std::numeric_limits<Position>::max() - start_pos_)) {
+    limit_ = start_;
+    return FailOverflow();
+  }
+  do {
+    if (fragment_.size() == fragment_size_) {
+      // More data follow, so this is not the last fragment.
+      if (ABSL_PREDICT_FALSE(!WriteFragment(false))) {
+        limit_ = start_;
+        return false;
+      }
+    }
+    const size_t length =
+        UnsignedMin(src.size(), fragment_size_ - fragment_.size());
+    fragment_.Append(src.substr(0, length), fragment_size_);
+    start_pos_ += length;
+    src.remove_prefix(length);
+  } while (!src.empty());
+  return true;
+}
+
+inline bool RecordWriter::RecordStreamWriter::WriteFragment(bool last) {
+  if (ABSL_PREDICT_FALSE(
+          !record_writer_->WriteFragment(std::move(fragment_), first_, last))) {
+    return Fail(*record_writer_);
+  }
+  fragment_.Clear();
+  first_ = false;
+  return true;
+}
+
 RecordWriter::RecordWriter() noexcept : Object(State::kClosed) {}
 
 RecordWriter::RecordWriter(std::unique_ptr<Writer> chunk_writer,
@@ -512,8 +1705,22 @@ RecordWriter::RecordWriter(std::unique_ptr<ChunkWriter> chunk_writer,
 }
 
 RecordWriter::RecordWriter(ChunkWriter* chunk_writer, Options options)
-    : Object(State::kOpen), desired_chunk_size_(options.chunk_size_) {
+    : RecordWriter(chunk_writer, std::move(options), nullptr) {}
+
+RecordWriter::RecordWriter(ChunkWriter* chunk_writer, Options options,
+                           std::unique_ptr<ChunkEncoder> chunk_encoder)
+    : Object(State::kOpen),
+      desired_chunk_size_(options.chunk_size_),
+      max_chunk_records_(options.max_chunk_records_),
+      max_chunk_latency_(options.max_chunk_latency_),
+      group_committer_(options.group_committer_) {
   RIEGELI_ASSERT_NOTNULL(chunk_writer);
+  // The index and the summary cover chunks written by this RecordWriter, so
+  // they would be incomplete for a file being appended to.
+  if (chunk_writer->pos() != 0) {
+    options.chunk_index_ = false;
+    options.file_summary_ = false;
+  }
   if (chunk_writer->pos() == 0) {
     // Write file signature.
     Chunk signature;
@@ -524,7 +1731,8 @@ RecordWriter::RecordWriter(ChunkWriter* chunk_writer, Options options)
     }
   }
   if (options.parallelism_ == 0) {
-    impl_ = absl::make_unique<SerialImpl>(chunk_writer, options);
+    impl_ = absl::make_unique<SerialImpl>(chunk_writer, options,
+                                          std::move(chunk_encoder));
   } else {
     impl_ = absl::make_unique<ParallelImpl>(chunk_writer, options);
   }
@@ -535,6 +1743,13 @@ RecordWriter::RecordWriter(RecordWriter&& src) noexcept
     : Object(std::move(src)),
       desired_chunk_size_(riegeli::exchange(src.desired_chunk_size_, 0)),
       chunk_size_so_far_(riegeli::exchange(src.chunk_size_so_far_, 0)),
+      max_chunk_records_(riegeli::exchange(src.max_chunk_records_, 0)),
+      chunk_records_so_far_(riegeli::exchange(src.chunk_records_so_far_, 0)),
+      max_chunk_latency_(riegeli::exchange(src.max_chunk_latency_,
+                                           absl::InfiniteDuration())),
+      chunk_deadline_(
+          riegeli::exchange(src.chunk_deadline_, absl::InfiniteFuture())),
+      group_committer_(riegeli::exchange(src.group_committer_, nullptr)),
       owned_chunk_writer_(std::move(src.owned_chunk_writer_)),
       impl_(std::move(src.impl_)) {}
 
@@ -542,18 +1757,103 @@ RecordWriter& RecordWriter::operator=(RecordWriter&& src) noexcept {
   Object::operator=(std::move(src));
   desired_chunk_size_ = riegeli::exchange(src.desired_chunk_size_, 0);
   chunk_size_so_far_ = riegeli::exchange(src.chunk_size_so_far_, 0);
+  max_chunk_records_ = riegeli::exchange(src.max_chunk_records_, 0);
+  chunk_records_so_far_ = riegeli::exchange(src.chunk_records_so_far_, 0);
+  max_chunk_latency_ =
+      riegeli::exchange(src.max_chunk_latency_, absl::InfiniteDuration());
+  chunk_deadline_ =
+      riegeli::exchange(src.chunk_deadline_, absl::InfiniteFuture());
+  group_committer_ = riegeli::exchange(src.group_committer_, nullptr);
   // impl_ must be assigned before owned_chunk_writer_ because background work
   // of impl_ may need owned_chunk_writer_.
   impl_ = std::move(src.impl_);
   owned_chunk_writer_ = std::move(src.owned_chunk_writer_);
+  // A record being written incrementally refers to this RecordWriter, and
+  // cannot be moved.
+  record_stream_.reset();
   return *this;
 }
 
 RecordWriter::~RecordWriter() {}
 
+bool RecordWriter::Reset(std::unique_ptr<Writer> byte_writer,
+                         Options options) {
+  std::unique_ptr<ChunkEncoder> chunk_encoder;
+  if (ABSL_PREDICT_FALSE(!CloseForReset(options, &chunk_encoder))) {
+    return false;
+  }
+  std::unique_ptr<ChunkWriter> chunk_writer =
+      absl::make_unique<DefaultChunkWriter>(std::move(byte_writer));
+  *this = RecordWriter(chunk_writer.get(), std::move(options),
+                       std::move(chunk_encoder));
+  owned_chunk_writer_ = std::move(chunk_writer);
+  return true;
+}
+
+bool RecordWriter::Reset(Writer* byte_writer, Options options) {
+  std::unique_ptr<ChunkEncoder> chunk_encoder;
+  if (ABSL_PREDICT_FALSE(!CloseForReset(options, &chunk_encoder))) {
+    return false;
+  }
+  std::unique_ptr<ChunkWriter> chunk_writer =
+      absl::make_unique<DefaultChunkWriter>(byte_writer);
+  *this = RecordWriter(chunk_writer.get(), std::move(options),
+                       std::move(chunk_encoder));
+  owned_chunk_writer_ = std::move(chunk_writer);
+  return true;
+}
+
+bool RecordWriter::Reset(std::unique_ptr<ChunkWriter> chunk_writer,
+                         Options options) {
+  std::unique_ptr<ChunkEncoder> chunk_encoder;
+  if (ABSL_PREDICT_FALSE(!CloseForReset(options, &chunk_encoder))) {
+    return false;
+  }
+  *this = RecordWriter(chunk_writer.get(), std::move(options),
+                       std::move(chunk_encoder));
+  owned_chunk_writer_ = std::move(chunk_writer);
+  return true;
+}
+
+bool RecordWriter::Reset(ChunkWriter* chunk_writer, Options options) {
+  std::unique_ptr<ChunkEncoder> chunk_encoder;
+  if (ABSL_PREDICT_FALSE(!CloseForReset(options, &chunk_encoder))) {
+    return false;
+  }
+  *this = RecordWriter(chunk_writer, std::move(options),
+                       std::move(chunk_encoder));
+  return true;
+}
+
+inline bool RecordWriter::CloseForReset(
+    const Options& options, std::unique_ptr<ChunkEncoder>* chunk_encoder) {
+  if (closed()) return true;
+  // Close the open chunk before Close(), so that its encoder is free to be
+  // taken for reuse.
+  if (ABSL_PREDICT_TRUE(healthy()) && chunk_size_so_far_ != 0) {
+    if (ABSL_PREDICT_FALSE(!impl_->CloseChunk(chunk_size_so_far_))) {
+      Fail(*impl_);
+    }
+    chunk_size_so_far_ = 0;
+    chunk_records_so_far_ = 0;
+  }
+  if (ABSL_PREDICT_TRUE(healthy())) {
+    *chunk_encoder = impl_->TakeChunkEncoder(options);
+  }
+  return Close();
+}
+
 void RecordWriter::Done() {
+  if (record_stream_ != nullptr) {
+    // Finish the record being written incrementally. A failure is propagated
+    // by WriteFragment().
+    record_stream_->Close();
+    record_stream_.reset();
+  }
   if (ABSL_PREDICT_TRUE(healthy()) && chunk_size_so_far_ != 0) {
-    if (ABSL_PREDICT_FALSE(!impl_->CloseChunk())) Fail(*impl_);
+    if (ABSL_PREDICT_FALSE(!impl_->CloseChunk(chunk_size_so_far_))) {
+      Fail(*impl_);
+    }
   }
   if (ABSL_PREDICT_TRUE(impl_ != nullptr)) {
     if (ABSL_PREDICT_TRUE(healthy())) {
@@ -571,11 +1871,30 @@ void RecordWriter::Done() {
   }
   desired_chunk_size_ = 0;
   chunk_size_so_far_ = 0;
+  max_chunk_records_ = 0;
+  chunk_records_so_far_ = 0;
+  max_chunk_latency_ = absl::InfiniteDuration();
+  chunk_deadline_ = absl::InfiniteFuture();
+}
+
+inline void RecordWriter::StartChunkDeadline() {
+  if (max_chunk_latency_ != absl::InfiniteDuration()) {
+    chunk_deadline_ = absl::Now() + max_chunk_latency_;
+  }
+}
+
+inline bool RecordWriter::CheckNoProducers() {
+  if (ABSL_PREDICT_FALSE(impl_->HasProducers())) {
+    return Fail(
+        "RecordWriter cannot write records directly while Producers are open");
+  }
+  return true;
 }
 
 template <typename Record>
 bool RecordWriter::WriteRecordImpl(Record&& record, FutureRecordPosition* key) {
-  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(!FlushExpiredChunk())) return false;
+  if (ABSL_PREDICT_FALSE(!CheckNoProducers())) return false;
   // Decoding a chunk writes records to one array, and their positions to
   // another array. We limit the size of both arrays together, to include
   // attempts to accumulate an unbounded number of empty records.
@@ -583,13 +1902,20 @@ bool RecordWriter::WriteRecordImpl(Record&& record, FutureRecordPosition* key) {
       IntCast<uint64_t>(RecordSize(record)), uint64_t{sizeof(uint64_t)});
   if (ABSL_PREDICT_FALSE(chunk_size_so_far_ > desired_chunk_size_ ||
                          added_size >
-                             desired_chunk_size_ - chunk_size_so_far_) &&
+                             desired_chunk_size_ - chunk_size_so_far_ ||
+                         chunk_records_so_far_ >= max_chunk_records_) &&
       chunk_size_so_far_ > 0) {
-    if (ABSL_PREDICT_FALSE(!impl_->CloseChunk())) return Fail(*impl_);
+    if (ABSL_PREDICT_FALSE(!impl_->CloseChunk(chunk_size_so_far_))) {
+      return Fail(*impl_);
+    }
     impl_->OpenChunk();
     chunk_size_so_far_ = 0;
+    chunk_records_so_far_ = 0;
+    chunk_deadline_ = absl::InfiniteFuture();
   }
+  if (chunk_size_so_far_ == 0) StartChunkDeadline();
   chunk_size_so_far_ += added_size;
+  ++chunk_records_so_far_;
   if (key != nullptr) *key = impl_->Pos();
   if (ABSL_PREDICT_FALSE(!impl_->AddRecord(std::forward<Record>(record)))) {
     return Fail(*impl_);
@@ -597,6 +1923,41 @@ bool RecordWriter::WriteRecordImpl(Record&& record, FutureRecordPosition* key) {
   return true;
 }
 
+Writer* RecordWriter::BeginRecord(FutureRecordPosition* key) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return nullptr;
+  RIEGELI_ASSERT(!impl_->IndexesRecords())
+      << "Failed precondition of RecordWriter::BeginRecord(): "
+         "fragmented records cannot be indexed";
+  RIEGELI_ASSERT(record_stream_ == nullptr || record_stream_->closed())
+      << "Failed precondition of RecordWriter::BeginRecord(): "
+         "the previous record is still being written";
+  if (ABSL_PREDICT_FALSE(!CheckNoProducers())) return nullptr;
+  if (chunk_size_so_far_ != 0) {
+    if (ABSL_PREDICT_FALSE(!impl_->CloseChunk(chunk_size_so_far_))) {
+      Fail(*impl_);
+      return nullptr;
+    }
+    impl_->OpenChunk();
+    chunk_size_so_far_ = 0;
+    chunk_records_so_far_ = 0;
+    chunk_deadline_ = absl::InfiniteFuture();
+  }
+  if (key != nullptr) *key = impl_->Pos();
+  record_stream_ = absl::make_unique<RecordStreamWriter>(
+      this, IntCast<size_t>(UnsignedMin(desired_chunk_size_,
+                                        std::numeric_limits<size_t>::max())));
+  return record_stream_.get();
+}
+
+bool RecordWriter::WriteFragment(Chain fragment, bool first, bool last) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(!impl_->WriteFragment(std::move(fragment), first,
+                                               last))) {
+    return Fail(*impl_);
+  }
+  return true;
+}
+
 template bool RecordWriter::WriteRecordImpl(const google::protobuf::MessageLite& record,
                                             FutureRecordPosition* key);
 template bool RecordWriter::WriteRecordImpl(const absl::string_view& record,
@@ -608,10 +1969,208 @@ template bool RecordWriter::WriteRecordImpl(const Chain& record,
 template bool RecordWriter::WriteRecordImpl(Chain&& record,
                                             FutureRecordPosition* key);
 
+bool RecordWriter::WriteRecords(absl::Span<const absl::string_view> records) {
+  size_t size = 0;
+  for (const absl::string_view record : records) {
+    size = SaturatingAdd(size, record.size());
+  }
+  Chain values;
+  std::vector<size_t> limits;
+  limits.reserve(records.size());
+  for (const absl::string_view record : records) {
+    values.Append(record, size);
+    limits.push_back(values.size());
+  }
+  return WriteRecords(std::move(values), std::move(limits));
+}
+
+bool RecordWriter::WriteRecords(Chain records, std::vector<size_t> limits) {
+  RIEGELI_ASSERT(std::is_sorted(limits.begin(), limits.end()))
+      << "Failed precondition of RecordWriter::WriteRecords(): "
+         "record end positions not sorted";
+  RIEGELI_ASSERT_EQ(limits.empty() ? size_t{0} : limits.back(), records.size())
+      << "Failed precondition of RecordWriter::WriteRecords(): "
+         "record end positions do not match concatenated record values";
+  if (ABSL_PREDICT_FALSE(!FlushExpiredChunk())) return false;
+  if (ABSL_PREDICT_FALSE(!CheckNoProducers())) return false;
+  ChainReader records_reader(&records);
+  size_t begin_index = 0;
+  size_t begin_pos = 0;
+  while (begin_index < limits.size()) {
+    // Take records which fit in the current chunk, using the same criterion as
+    // WriteRecordImpl().
+    size_t end_index = begin_index;
+    size_t end_pos = begin_pos;
+    uint64_t chunk_size = chunk_size_so_far_;
+    uint64_t chunk_records = chunk_records_so_far_;
+    while (end_index < limits.size()) {
+      const uint64_t added_size =
+          SaturatingAdd(IntCast<uint64_t>(limits[end_index] - end_pos),
+                        uint64_t{sizeof(uint64_t)});
+      if ((chunk_size > desired_chunk_size_ ||
+           added_size > desired_chunk_size_ - chunk_size ||
+           chunk_records >= max_chunk_records_) &&
+          chunk_size > 0) {
+        break;
+      }
+      chunk_size += added_size;
+      ++chunk_records;
+      end_pos = limits[end_index++];
+    }
+    if (end_index > begin_index) {
+      Chain batch_records;
+      if (!records_reader.Read(&batch_records, end_pos - begin_pos)) {
+        RIEGELI_ASSERT_UNREACHABLE()
+            << "Failed reading records: " << records_reader.message();
+      }
+      const bool last_batch = end_index == limits.size();
+      std::vector<size_t> batch_limits;
+      if (begin_index == 0 && last_batch) {
+        batch_limits = std::move(limits);
+      } else {
+        batch_limits.reserve(end_index - begin_index);
+        for (size_t i = begin_index; i < end_index; ++i) {
+          batch_limits.push_back(limits[i] - begin_pos);
+        }
+      }
+      if (chunk_size_so_far_ == 0) StartChunkDeadline();
+      chunk_size_so_far_ = chunk_size;
+      chunk_records_so_far_ = chunk_records;
+      if (ABSL_PREDICT_FALSE(!impl_->AddRecords(std::move(batch_records),
+                                                std::move(batch_limits)))) {
+        return Fail(*impl_);
+      }
+      if (last_batch) break;
+      begin_index = end_index;
+      begin_pos = end_pos;
+    }
+    if (ABSL_PREDICT_FALSE(!impl_->CloseChunk(chunk_size_so_far_))) {
+      return Fail(*impl_);
+    }
+    impl_->OpenChunk();
+    chunk_size_so_far_ = 0;
+    chunk_records_so_far_ = 0;
+    chunk_deadline_ = absl::InfiniteFuture();
+  }
+  return true;
+}
+
+bool RecordWriter::CopyChunks(ChunkReader* src, uint64_t reencode_below_size) {
+  RIEGELI_ASSERT(!impl_->IndexesRecords())
+      << "Failed precondition of RecordWriter::CopyChunks(): "
+         "copied chunks cannot be indexed";
+  return CopyChunksImpl(src, reencode_below_size, /*transcode=*/false,
+                        nullptr);
+}
+
+bool RecordWriter::TranscodeChunks(
+    ChunkReader* src, const ZstdDictionaryRegistry* zstd_dictionaries) {
+  RIEGELI_ASSERT(!impl_->IndexesRecords())
+      << "Failed precondition of RecordWriter::TranscodeChunks(): "
+         "copied chunks cannot be indexed";
+  return CopyChunksImpl(src, 0, /*transcode=*/true, zstd_dictionaries);
+}
+
+bool RecordWriter::CopyFields(
+    ChunkReader* src, FieldFilter field_filter,
+    const ZstdDictionaryRegistry* zstd_dictionaries) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  ChunkDecoder chunk_decoder(ChunkDecoder::Options()
+                                 .set_field_filter(std::move(field_filter))
+                                 .set_zstd_dictionaries(zstd_dictionaries));
+  Chunk chunk;
+  while (src->ReadChunk(&chunk)) {
+    // The signature, padding, and metadata chunks have no records.
+    if (chunk.header.num_records() == 0) continue;
+    if (ABSL_PREDICT_FALSE(!chunk_decoder.Reset(chunk))) {
+      return Fail("Decoding chunk to copy failed", chunk_decoder);
+    }
+    if (ABSL_PREDICT_FALSE(chunk_decoder.record_continues())) {
+      return Fail("Copying fields of fragmented records is not supported");
+    }
+    RecordLimits limits;
+    Chain values;
+    if (chunk_decoder.GetDecoded(&limits, &values)) {
+      if (ABSL_PREDICT_FALSE(
+              !WriteRecords(std::move(values), limits.ToVector()))) {
+        return false;
+      }
+      continue;
+    }
+    // Values of a blocked simple chunk are decompressed as records are read.
+    absl::string_view record;
+    while (chunk_decoder.ReadRecord(&record)) {
+      if (ABSL_PREDICT_FALSE(!WriteRecord(record))) return false;
+    }
+    if (ABSL_PREDICT_FALSE(!chunk_decoder.healthy())) {
+      return Fail("Decoding chunk to copy failed", chunk_decoder);
+    }
+  }
+  return src->healthy();
+}
+
+bool RecordWriter::CopyChunksImpl(
+    ChunkReader* src, uint64_t reencode_below_size, bool transcode,
+    const ZstdDictionaryRegistry* zstd_dictionaries) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  ChunkDecoder chunk_decoder(
+      ChunkDecoder::Options().set_zstd_dictionaries(zstd_dictionaries));
+  Chunk chunk;
+  while (src->ReadChunk(&chunk)) {
+    const bool fragment = IsFragment(chunk);
+    // The signature, padding, and metadata chunks have no records.
+    if (chunk.header.num_records() == 0 && !fragment) continue;
+    if (chunk.header.decoded_data_size() < reencode_below_size && !fragment) {
+      if (ABSL_PREDICT_FALSE(!chunk_decoder.Reset(chunk))) {
+        return Fail("Decoding chunk to copy failed", chunk_decoder);
+      }
+      absl::string_view record;
+      while (chunk_decoder.ReadRecord(&record)) {
+        if (ABSL_PREDICT_FALSE(!WriteRecord(record))) return false;
+      }
+      if (ABSL_PREDICT_FALSE(!chunk_decoder.healthy())) {
+        return Fail("Decoding chunk to copy failed", chunk_decoder);
+      }
+      continue;
+    }
+    if (chunk_size_so_far_ != 0) {
+      if (ABSL_PREDICT_FALSE(!impl_->CloseChunk(chunk_size_so_far_))) {
+        return Fail(*impl_);
+      }
+      impl_->OpenChunk();
+      chunk_size_so_far_ = 0;
+      chunk_records_so_far_ = 0;
+      chunk_deadline_ = absl::InfiniteFuture();
+    }
+    if (ABSL_PREDICT_FALSE(
+            !(transcode ? impl_->TranscodeAndCopyChunk(std::move(chunk),
+                                                       zstd_dictionaries)
+                        : impl_->CopyChunk(std::move(chunk))))) {
+      return Fail(*impl_);
+    }
+    chunk = Chunk();
+  }
+  return src->healthy();
+}
+
 bool RecordWriter::Flush(FlushType flush_type) {
   if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  RecordStats::Timer timer(impl_->stats(), nullptr,
+                           RecordStats::FlushLatency(flush_type));
+  if (group_committer_ != nullptr && flush_type == FlushType::kFromMachine) {
+    if (ABSL_PREDICT_FALSE(!FlushAsync(flush_type).get())) {
+      if (!impl_->healthy()) return Fail(*impl_);
+      const int error_code = group_committer_->error_code();
+      if (error_code == 0) return false;
+      return Fail(absl::StrCat("Syncing through FdGroupCommitter failed: ",
+                               StrError(error_code)));
+    }
+    return true;
+  }
   if (chunk_size_so_far_ != 0) {
-    if (ABSL_PREDICT_FALSE(!impl_->CloseChunk())) return Fail(*impl_);
+    if (ABSL_PREDICT_FALSE(!impl_->CloseChunk(chunk_size_so_far_))) {
+      return Fail(*impl_);
+    }
   }
   if (ABSL_PREDICT_FALSE(!impl_->Flush(flush_type))) {
     if (impl_->healthy()) return false;
@@ -620,13 +2179,201 @@ bool RecordWriter::Flush(FlushType flush_type) {
   if (chunk_size_so_far_ != 0) {
     impl_->OpenChunk();
     chunk_size_so_far_ = 0;
+    chunk_records_so_far_ = 0;
+    chunk_deadline_ = absl::InfiniteFuture();
   }
   return true;
 }
 
+std::shared_future<bool> RecordWriter::FlushAsync(FlushType flush_type) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return ReadyFuture(false);
+  if (chunk_size_so_far_ != 0) {
+    if (ABSL_PREDICT_FALSE(!impl_->CloseChunk(chunk_size_so_far_))) {
+      Fail(*impl_);
+      return ReadyFuture(false);
+    }
+  }
+  std::shared_future<bool> done = impl_->FlushAsync(
+      flush_type, flush_type == FlushType::kFromMachine ? group_committer_
+                                                        : nullptr);
+  if (chunk_size_so_far_ != 0) {
+    impl_->OpenChunk();
+    chunk_size_so_far_ = 0;
+    chunk_records_so_far_ = 0;
+    chunk_deadline_ = absl::InfiniteFuture();
+  }
+  return done;
+}
+
+bool RecordWriter::FlushExpiredChunk() {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_TRUE(chunk_deadline_ == absl::InfiniteFuture()) ||
+      absl::Now() < chunk_deadline_) {
+    return true;
+  }
+  // Failures are reported by healthy(). A failure to sync is not expected
+  // with FlushType::kFromObject, and it would not be actionable here.
+  FlushAsync(FlushType::kFromObject);
+  return healthy();
+}
+
 FutureRecordPosition RecordWriter::Pos() const {
   if (ABSL_PREDICT_FALSE(impl_ == nullptr)) return FutureRecordPosition();
   return impl_->Pos();
 }
 
+uint64_t RecordWriter::pending_bytes() const {
+  if (ABSL_PREDICT_FALSE(impl_ == nullptr)) return 0;
+  return impl_->PendingBytes();
+}
+
+size_t RecordWriter::EstimateMemory() const {
+  MemoryEstimator memory_estimator;
+  AddUniqueTo(&memory_estimator);
+  return memory_estimator.TotalMemory();
+}
+
+void RecordWriter::AddUniqueTo(MemoryEstimator* memory_estimator) const {
+  memory_estimator->AddMemory(sizeof(RecordWriter));
+  // impl_ registers the ChunkWriter, whether it is owned or not.
+  if (impl_ != nullptr) impl_->AddUniqueTo(memory_estimator);
+}
+
+RecordWriter::Producer::Producer() noexcept : Object(State::kClosed) {}
+
+RecordWriter::Producer::Producer(RecordWriter* record_writer)
+    : Object(State::kOpen) {
+  RIEGELI_ASSERT_NOTNULL(record_writer);
+  if (ABSL_PREDICT_FALSE(!record_writer->healthy())) {
+    Fail(*record_writer);
+    return;
+  }
+  if (ABSL_PREDICT_FALSE(!record_writer->impl_->SupportsProducers())) {
+    Fail(
+        "RecordWriter::Producer requires parallelism > 0, "
+        "and no chunk_index_fields nor key_function");
+    return;
+  }
+  impl_ = record_writer->impl_.get();
+  impl_->AddProducer();
+  desired_chunk_size_ = record_writer->desired_chunk_size_;
+  max_chunk_records_ = record_writer->max_chunk_records_;
+}
+
+RecordWriter::Producer::Producer(Producer&& src) noexcept
+    : Object(std::move(src)),
+      impl_(riegeli::exchange(src.impl_, nullptr)),
+      desired_chunk_size_(riegeli::exchange(src.desired_chunk_size_, 0)),
+      chunk_size_so_far_(riegeli::exchange(src.chunk_size_so_far_, 0)),
+      max_chunk_records_(riegeli::exchange(src.max_chunk_records_, 0)),
+      chunk_records_so_far_(riegeli::exchange(src.chunk_records_so_far_, 0)),
+      chunk_encoder_(std::move(src.chunk_encoder_)),
+      chunk_begin_(std::move(src.chunk_begin_)),
+      chunk_pos_(std::move(src.chunk_pos_)) {}
+
+RecordWriter::Producer& RecordWriter::Producer::operator=(
+    Producer&& src) noexcept {
+  if (impl_ != nullptr) impl_->RemoveProducer();
+  Object::operator=(std::move(src));
+  impl_ = riegeli::exchange(src.impl_, nullptr);
+  desired_chunk_size_ = riegeli::exchange(src.desired_chunk_size_, 0);
+  chunk_size_so_far_ = riegeli::exchange(src.chunk_size_so_far_, 0);
+  max_chunk_records_ = riegeli::exchange(src.max_chunk_records_, 0);
+  chunk_records_so_far_ = riegeli::exchange(src.chunk_records_so_far_, 0);
+  chunk_encoder_ = std::move(src.chunk_encoder_);
+  chunk_begin_ = std::move(src.chunk_begin_);
+  chunk_pos_ = std::move(src.chunk_pos_);
+  return *this;
+}
+
+RecordWriter::Producer::~Producer() {
+  if (impl_ != nullptr) impl_->RemoveProducer();
+}
+
+void RecordWriter::Producer::Done() {
+  if (ABSL_PREDICT_TRUE(healthy())) {
+    CloseChunk();
+  } else if (chunk_encoder_ != nullptr) {
+    // The chunk is abandoned. Positions of its records are meaningless, but
+    // resolving them must not fail with a broken promise.
+    chunk_begin_.set_value(0);
+  }
+  if (impl_ != nullptr) impl_->RemoveProducer();
+  impl_ = nullptr;
+  desired_chunk_size_ = 0;
+  chunk_size_so_far_ = 0;
+  max_chunk_records_ = 0;
+  chunk_records_so_far_ = 0;
+  chunk_encoder_.reset();
+  chunk_begin_ = std::promise<Position>();
+  chunk_pos_ = FutureRecordPosition();
+}
+
+bool RecordWriter::Producer::CloseChunk() {
+  if (chunk_encoder_ == nullptr) return true;
+  const uint64_t chunk_size = chunk_size_so_far_;
+  chunk_size_so_far_ = 0;
+  chunk_records_so_far_ = 0;
+  if (ABSL_PREDICT_FALSE(!impl_->CloseProducerChunk(
+          std::move(chunk_encoder_), chunk_size, std::move(chunk_begin_)))) {
+    return Fail(*impl_);
+  }
+  return true;
+}
+
+template <typename Record>
+bool RecordWriter::Producer::WriteRecordImpl(Record&& record,
+                                             FutureRecordPosition* key) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  // The same criterion as in RecordWriter::WriteRecordImpl().
+  const uint64_t added_size = SaturatingAdd(
+      IntCast<uint64_t>(RecordSize(record)), uint64_t{sizeof(uint64_t)});
+  if (ABSL_PREDICT_FALSE(chunk_size_so_far_ > desired_chunk_size_ ||
+                         added_size >
+                             desired_chunk_size_ - chunk_size_so_far_ ||
+                         chunk_records_so_far_ >= max_chunk_records_) &&
+      chunk_size_so_far_ > 0) {
+    if (ABSL_PREDICT_FALSE(!CloseChunk())) return false;
+  }
+  if (chunk_encoder_ == nullptr) {
+    chunk_encoder_ = impl_->MakeProducerEncoder();
+    chunk_begin_ = std::promise<Position>();
+    chunk_pos_ = FutureRecordPosition(chunk_begin_.get_future().share());
+  }
+  chunk_size_so_far_ += added_size;
+  ++chunk_records_so_far_;
+  if (key != nullptr) {
+    *key = chunk_pos_;
+    key->record_index_ = chunk_encoder_->num_records();
+  }
+  if (ABSL_PREDICT_FALSE(
+          !chunk_encoder_->AddRecord(std::forward<Record>(record)))) {
+    return Fail(*chunk_encoder_);
+  }
+  return true;
+}
+
+template bool RecordWriter::Producer::WriteRecordImpl(
+    const google::protobuf::MessageLite& record, FutureRecordPosition* key);
+template bool RecordWriter::Producer::WriteRecordImpl(
+    const absl::string_view& record, FutureRecordPosition* key);
+template bool RecordWriter::Producer::WriteRecordImpl(
+    std::string&& record, FutureRecordPosition* key);
+template bool RecordWriter::Producer::WriteRecordImpl(
+    const Chain& record, FutureRecordPosition* key);
+template bool RecordWriter::Producer::WriteRecordImpl(
+    Chain&& record, FutureRecordPosition* key);
+
+bool RecordWriter::Producer::Flush(FlushType flush_type) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(!CloseChunk())) return false;
+  if (ABSL_PREDICT_FALSE(!impl_->Flush(flush_type))) {
+    // A failure to sync leaves impl_ healthy, but the Producer fails anyway so
+    // that its caller gets a message.
+    if (impl_->healthy()) return Fail("RecordWriter failed to sync");
+    return Fail(*impl_);
+  }
+  return true;
+}
+
 }  // namespace riegeli
@@ -17,7 +17,9 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <functional>
 #include <future>
+#include <limits>
 #include <memory>
 #include <string>
 #include <utility>
@@ -25,13 +27,22 @@
 
 #include "absl/base/call_once.h"
 #include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
 #include "riegeli/base/base.h"
 #include "riegeli/base/chain.h"
+#include "riegeli/base/memory_estimator.h"
 #include "riegeli/base/object.h"
+#include "riegeli/bytes/rate_limiter.h"
 #include "riegeli/bytes/writer.h"
+#include "riegeli/bytes/zstd_dictionary.h"
 #include "riegeli/chunk_encoding/chunk.h"
 #include "riegeli/chunk_encoding/compressor_options.h"
+#include "riegeli/chunk_encoding/field_filter.h"
+#include "riegeli/records/field_aggregator.h"
 #include "riegeli/records/record_position.h"
+#include "riegeli/records/record_stats.h"
+#include "riegeli/records/record_tracer.h"
 
 namespace google {
 namespace protobuf {
@@ -42,7 +53,10 @@ class MessageLite;
 namespace riegeli {
 
 class ChunkEncoder;
+class ChunkReader;
 class ChunkWriter;
+class FdGroupCommitter;
+class ThreadPool;
 
 // FutureRecordPosition is similar to shared_future<RecordPosition>.
 //
@@ -75,6 +89,8 @@ class FutureRecordPosition {
       Position pos_before_chunks,
       std::vector<std::shared_future<ChunkHeader>> chunk_headers);
 
+  explicit FutureRecordPosition(std::shared_future<Position> chunk_begin);
+
   std::shared_ptr<FutureChunkBegin> future_chunk_begin_;
   // If future_chunk_begin_ == nullptr, chunk_begin_ is stored here, otherwise
   // it is future_chunk_begin_->get().
@@ -82,6 +98,13 @@ class FutureRecordPosition {
   uint64_t record_index_ = 0;
 };
 
+// A numeric proto field whose range of values in each chunk is stored in the
+// chunk index, see RecordWriter::Options::set_chunk_index_fields().
+struct ChunkIndexField {
+  Field field;
+  FieldAggregator::NumericType numeric_type;
+};
+
 // RecordWriter writes records to a Riegeli/records file. A record is
 // conceptually a binary string; usually it is a serialized proto message.
 //
@@ -104,7 +127,7 @@ class RecordWriter final : public Object {
    public:
     // Not defaulted because of a C++ defect:
     // https://stackoverflow.com/questions/17430377
-    constexpr Options() noexcept {}
+    Options() noexcept {}
 
     // Parses options from text:
     //
@@ -112,20 +135,45 @@ class RecordWriter final : public Object {
     //   option ::=
     //     "default" |
     //     "transpose" (":" ("true" | "false"))? |
+    //     "transpose_nonproto" (":" ("true" | "false"))? |
+    //     "transpose_packed" (":" ("true" | "false"))? |
     //     "uncompressed" |
     //     "brotli" (":" brotli_level)? |
     //     "zstd" (":" zstd_level)? |
+    //     "lz4" (":" lz4_level)? |
     //     "window_log" ":" window_log |
+    //     "max_block_size" ":" max_block_size |
     //     "chunk_size" ":" chunk_size |
+    //     "max_chunk_records" ":" max_chunk_records |
     //     "bucket_fraction" ":" bucket_fraction |
-    //     "parallelism" ":" parallelism
+    //     "values_block_size" ":" values_block_size |
+    //     "fixed_record_sizes" (":" ("true" | "false"))? |
+    //     "deduplicate_records" (":" ("true" | "false"))? |
+    //     "delta_records" (":" ("true" | "false"))? |
+    //     "store_incompressible_buckets" (":" ("true" | "false"))? |
+    //     "parallelism" ":" parallelism |
+    //     "compression_parallelism" ":" compression_parallelism |
+    //     "max_pending_bytes" ":" max_pending_bytes |
+    //     "streaming_encoding" (":" ("true" | "false"))? |
+    //     "adaptive_compression" (":" ("true" | "false"))? |
+    //     "chunk_index" (":" ("true" | "false"))? |
+    //     "file_summary" (":" ("true" | "false"))?
     //   brotli_level ::= integer 0..11 (default 9)
     //   zstd_level ::= integer 1..22 (default 9)
+    //   lz4_level ::= integer 0..12 (default 0)
     //   window_log ::= "auto" or integer 10..31
+    //   max_block_size ::=
+    //     integer expressed as real with optional suffix [BkKMGTPE], 1..
     //   chunk_size ::=
     //     integer expressed as real with optional suffix [BkKMGTPE], 1..
+    //   max_chunk_records ::= integer 1..
     //   bucket_fraction ::= real 0..1
+    //   values_block_size ::=
+    //     integer expressed as real with optional suffix [BkKMGTPE], 0..
     //   parallelism ::= integer 1..
+    //   compression_parallelism ::= integer 0..
+    //   max_pending_bytes ::=
+    //     integer expressed as real with optional suffix [BkKMGTPE], 0..
     //
     // Return values:
     //  * true  - success
@@ -139,6 +187,15 @@ class RecordWriter final : public Object {
     // If false, a chunk of records will be stored in a simpler format, directly
     // or with compression.
     //
+    // A transposed chunk is decoded as a whole before its first record is
+    // available: lengths of submessages are derived from their decoded
+    // contents, so records are produced from the last to the first. Emitting
+    // them front to back would require storing all submessage lengths, which
+    // would lose much of the compression benefit. If records are consumed as
+    // a stream and the latency of the first record matters more than density,
+    // use set_transpose(false) with set_values_block_size(): the reader then
+    // decompresses one block at a time, front to back.
+    //
     // Default: false.
     Options& set_transpose(bool transpose) & {
       transpose_ = transpose;
@@ -148,6 +205,42 @@ class RecordWriter final : public Object {
       return std::move(set_transpose(transpose));
     }
 
+    // If true, transpose is true, and compression is enabled, records which
+    // are not proto messages, but have the same size within a chunk (e.g.
+    // fixed-width binary structs), are stored column by column: first bytes of
+    // all records, then their second bytes, etc. This allows for better
+    // compression because bytes at the same offset tend to be similar.
+    //
+    // Files written with this option can be read only by readers which support
+    // it.
+    //
+    // Default: false.
+    Options& set_transpose_nonproto(bool transpose_nonproto) & {
+      transpose_nonproto_ = transpose_nonproto;
+      return *this;
+    }
+    Options&& set_transpose_nonproto(bool transpose_nonproto) && {
+      return std::move(set_transpose_nonproto(transpose_nonproto));
+    }
+
+    // If true, transpose is true, and compression is enabled, string or bytes
+    // fields whose values all look like packed repeated numeric fields (e.g.
+    // feature vectors of floats) have their elements stored separately from
+    // numbers of elements, fixed width elements column by column. This allows
+    // for better compression than storing the values as opaque strings.
+    //
+    // Files written with this option can be read only by readers which support
+    // it.
+    //
+    // Default: false.
+    Options& set_transpose_packed(bool transpose_packed) & {
+      transpose_packed_ = transpose_packed;
+      return *this;
+    }
+    Options&& set_transpose_packed(bool transpose_packed) && {
+      return std::move(set_transpose_packed(transpose_packed));
+    }
+
     // Changes compression algorithm to none.
     Options& set_uncompressed() & {
       compressor_options_.set_uncompressed();
@@ -199,6 +292,28 @@ class RecordWriter final : public Object {
       return std::move(set_zstd(compression_level));
     }
 
+    // Changes compression algorithm to LZ4. Sets compression level which tunes
+    // the tradeoff between compression density and compression speed (higher =
+    // better density but slower).
+    //
+    // LZ4 compresses less densely than Brotli and Zstd, but decompresses much
+    // faster.
+    //
+    // compression_level must be between kMinLz4() (0) and kMaxLz4() (12).
+    // Default: kDefaultLz4() (0).
+    static constexpr int kMinLz4() { return CompressorOptions::kMinLz4(); }
+    static constexpr int kMaxLz4() { return CompressorOptions::kMaxLz4(); }
+    static constexpr int kDefaultLz4() {
+      return CompressorOptions::kDefaultLz4();
+    }
+    Options& set_lz4(int compression_level = kDefaultLz4()) & {
+      compressor_options_.set_lz4(compression_level);
+      return *this;
+    }
+    Options&& set_lz4(int compression_level = kDefaultLz4()) && {
+      return std::move(set_lz4(compression_level));
+    }
+
     // Logarithm of the LZ77 sliding window size. This tunes the tradeoff
     // between compression density and memory usage (higher = better density but
     // more memory).
@@ -206,7 +321,7 @@ class RecordWriter final : public Object {
     // Special value kDefaultWindowLog() (-1) means to keep the default
     // (brotli: 22, zstd: derived from compression level and chunk size).
     //
-    // For uncompressed, window_log must be kDefaultWindowLog() (-1).
+    // For uncompressed and lz4, window_log must be kDefaultWindowLog() (-1).
     //
     // For brotli, window_log must be kDefaultWindowLog() (-1) or between
     // BrotliWriter::Options::kMinWindowLog() (10) and
@@ -231,6 +346,39 @@ class RecordWriter final : public Object {
       return std::move(set_window_log(window_log));
     }
 
+    // Specifies a Zstd dictionary used for compression if set_zstd() is used
+    // (otherwise ignored). The dictionary must be kept alive until the
+    // RecordWriter is closed.
+    //
+    // A dictionary improves compression density of small chunks. Reading
+    // requires the same dictionary in
+    // RecordReader::Options::set_zstd_dictionaries().
+    //
+    // If nullptr, no dictionary is used.
+    //
+    // Default: nullptr
+    Options& set_zstd_dictionary(const ZstdDictionary* zstd_dictionary) & {
+      compressor_options_.set_zstd_dictionary(zstd_dictionary);
+      return *this;
+    }
+    Options&& set_zstd_dictionary(const ZstdDictionary* zstd_dictionary) && {
+      return std::move(set_zstd_dictionary(zstd_dictionary));
+    }
+
+    // Sets the maximal size of a block of compressed chunk data buffered in
+    // memory. Larger blocks make hashing and writing chunks faster, at the cost
+    // of allocating more memory ahead of data. A value around chunk_size makes
+    // a chunk consist of few blocks.
+    //
+    // Default: Chain::Options::kDefaultMaxBlockSize() (64K)
+    Options& set_max_block_size(size_t max_block_size) & {
+      compressor_options_.set_max_block_size(max_block_size);
+      return *this;
+    }
+    Options&& set_max_block_size(size_t max_block_size) && {
+      return std::move(set_max_block_size(max_block_size));
+    }
+
     // Sets the desired uncompressed size of a chunk which groups messages to be
     // transposed, compressed, and written together.
     //
@@ -250,6 +398,54 @@ class RecordWriter final : public Object {
       return std::move(set_chunk_size(size));
     }
 
+    // Sets the maximal number of records in a chunk. A chunk is closed when
+    // either its size reaches chunk_size or it has this many records.
+    //
+    // Decoding a chunk is sequential, and reading any record of a chunk
+    // requires decoding the whole chunk, so this bounds the latency of reading
+    // one record when records are small. Chunks are decoded in parallel by
+    // RecordReader with Options::set_parallelism().
+    //
+    // Default: std::numeric_limits<uint64_t>::max() (no limit)
+    Options& set_max_chunk_records(uint64_t max_chunk_records) & {
+      RIEGELI_ASSERT_GT(max_chunk_records, 0u)
+          << "Failed precondition of "
+             "RecordWriter::Options::set_max_chunk_records(): "
+             "zero number of records";
+      max_chunk_records_ = max_chunk_records;
+      return *this;
+    }
+    Options&& set_max_chunk_records(uint64_t max_chunk_records) && {
+      return std::move(set_max_chunk_records(max_chunk_records));
+    }
+
+    // Sets the maximal time for which records wait in the open chunk. When the
+    // first record of the chunk was written at least this long ago, the chunk
+    // is closed and pushed to the byte Writer's destination as by
+    // FlushAsync(FlushType::kFromObject), even if it did not reach chunk_size.
+    //
+    // This lets a large chunk_size be used under load while bounding how long
+    // readers tailing the file wait for records at low traffic.
+    //
+    // The deadline is checked by WriteRecord(), WriteRecords(), and
+    // FlushExpiredChunk(). RecordWriter has no timer of its own because it is
+    // not thread-safe, so if records can stop arriving, FlushExpiredChunk()
+    // should be called periodically, with the same synchronization as
+    // WriteRecord().
+    //
+    // Default: absl::InfiniteDuration() (no limit)
+    Options& set_max_chunk_latency(absl::Duration max_chunk_latency) & {
+      RIEGELI_ASSERT(max_chunk_latency > absl::ZeroDuration())
+          << "Failed precondition of "
+             "RecordWriter::Options::set_max_chunk_latency(): "
+             "latency not positive";
+      max_chunk_latency_ = max_chunk_latency;
+      return *this;
+    }
+    Options&& set_max_chunk_latency(absl::Duration max_chunk_latency) && {
+      return std::move(set_max_chunk_latency(max_chunk_latency));
+    }
+
     // Sets the desired uncompressed size of a bucket which groups values of
     // several fields of the given wire type to be compressed together,
     // relatively to the desired chunk size, on the scale between 0.0 (compress
@@ -278,12 +474,149 @@ class RecordWriter final : public Object {
       return std::move(set_bucket_fraction(fraction));
     }
 
+    // Fields whose values are put in buckets of their own, not shared with
+    // other fields, e.g. fields which are frequently read alone, or which are
+    // frequently filtered out. Fields of submessages of a listed field share
+    // its buckets.
+    //
+    // This is meaningful if transpose and compression are enabled. It makes
+    // reading these fields with filtering faster, independently of
+    // bucket_fraction. Files remain readable by all readers.
+    //
+    // Default: {}
+    Options& set_separate_bucket_fields(std::vector<Field> fields) & {
+      separate_bucket_fields_ = std::move(fields);
+      return *this;
+    }
+    Options&& set_separate_bucket_fields(std::vector<Field> fields) && {
+      return std::move(set_separate_bucket_fields(std::move(fields)));
+    }
+
+    // Compression of buckets of separate_bucket_fields, instead of the main
+    // compression, e.g. faster compression for fields which are frequently
+    // read alone, so that reading them with filtering decompresses faster.
+    //
+    // This is meaningful if transpose and compression are enabled. Files
+    // written with this option can be read only by readers which support it.
+    //
+    // Default: none (the main compression is used)
+    Options& set_separate_bucket_compression(
+        const CompressorOptions& separate_bucket_compression) & {
+      has_separate_bucket_compression_ = true;
+      separate_bucket_compression_ = separate_bucket_compression;
+      return *this;
+    }
+    Options&& set_separate_bucket_compression(
+        const CompressorOptions& separate_bucket_compression) && {
+      return std::move(
+          set_separate_bucket_compression(separate_bucket_compression));
+    }
+
+    // If true, a bucket which compression would shrink by less than 1/8 is
+    // stored uncompressed, e.g. a bucket of random hashes, so that reading it
+    // does not spend time decompressing it.
+    //
+    // This is meaningful if transpose and compression are enabled. Files
+    // written with this option can be read only by readers which support it.
+    //
+    // Default: false
+    Options& set_store_incompressible_buckets(
+        bool store_incompressible_buckets) & {
+      store_incompressible_buckets_ = store_incompressible_buckets;
+      return *this;
+    }
+    Options&& set_store_incompressible_buckets(
+        bool store_incompressible_buckets) && {
+      return std::move(
+          set_store_incompressible_buckets(store_incompressible_buckets));
+    }
+
+    // If positive and transpose is false, record values of a chunk are split
+    // into blocks of about this uncompressed size, compressed independently.
+    // Reading a single record after RecordReader::Seek() then decompresses
+    // only its block instead of the whole chunk, at the cost of compression
+    // density. Reading sequentially, the first record of a chunk is available
+    // after decompressing its block, and later blocks are decompressed as
+    // records are consumed.
+    //
+    // Files written with this option can be read only by readers which support
+    // it.
+    //
+    // Default: 0 (no blocks)
+    Options& set_values_block_size(uint64_t size) & {
+      values_block_size_ = size;
+      return *this;
+    }
+    Options&& set_values_block_size(uint64_t size) && {
+      return std::move(set_values_block_size(size));
+    }
+
+    // If true, transpose is false, and all records of a chunk have the same
+    // size (e.g. fixed-width embeddings), the size is stored once instead of
+    // for each record. This makes such chunks smaller and faster to decode.
+    // Chunks with records of varying sizes are unaffected.
+    //
+    // Files written with this option can be read only by readers which support
+    // it.
+    //
+    // Default: false
+    Options& set_fixed_record_sizes(bool fixed_record_sizes) & {
+      fixed_record_sizes_ = fixed_record_sizes;
+      return *this;
+    }
+    Options&& set_fixed_record_sizes(bool fixed_record_sizes) && {
+      return std::move(set_fixed_record_sizes(fixed_record_sizes));
+    }
+
+    // If true, identical records of a chunk are stored once, and each record
+    // refers to its stored copy. This makes chunks of highly redundant records
+    // (e.g. repeated log entries) smaller, and saves compressing the
+    // repetitions, at the cost of hashing each record. See
+    // DeduplicatingEncoder for details.
+    //
+    // set_values_block_size() has no effect with this option.
+    //
+    // Files written with this option can be read only by readers which support
+    // it.
+    //
+    // Default: false
+    Options& set_deduplicate_records(bool deduplicate_records) & {
+      deduplicate_records_ = deduplicate_records;
+      return *this;
+    }
+    Options&& set_deduplicate_records(bool deduplicate_records) && {
+      return std::move(set_deduplicate_records(deduplicate_records));
+    }
+
+    // If true, a record which differs from the previous record of its chunk
+    // only in a few places (e.g. a timestamp or a counter) is stored as a
+    // patch against the previous record. This makes chunks of near-duplicate
+    // consecutive records smaller, and saves compressing the repeated bytes,
+    // at the cost of comparing each record with the previous one. See
+    // DeltaEncoder for details.
+    //
+    // set_deduplicate_records() and set_values_block_size() have no effect
+    // with this option.
+    //
+    // Files written with this option can be read only by readers which support
+    // it.
+    //
+    // Default: false
+    Options& set_delta_records(bool delta_records) & {
+      delta_records_ = delta_records;
+      return *this;
+    }
+    Options&& set_delta_records(bool delta_records) && {
+      return std::move(set_delta_records(delta_records));
+    }
+
     // Sets the maximum number of chunks being encoded in parallel in
     // background. Larger parallelism can increase throughput, up to a point
     // where it no longer matters; smaller parallelism reduces memory usage.
     //
     // If parallelism > 0, chunks are written to the byte Writer in background
-    // and reporting writing errors is delayed.
+    // and reporting writing errors is delayed. Records can then also be written
+    // from several threads through RecordWriter::Producer.
     //
     // Default: 0
     Options& set_parallelism(int parallelism) & {
@@ -297,14 +630,350 @@ class RecordWriter final : public Object {
       return std::move(set_parallelism(parallelism));
     }
 
+    // Sets the number of threads compressing a single chunk in parallel, in
+    // addition to the thread encoding the chunk. Unlike set_parallelism(), this
+    // reduces latency of encoding a single large chunk, e.g. one cut off by
+    // each Flush(). It applies to zstd compression, and to buckets of
+    // transposed chunks.
+    //
+    // Default: 0
+    Options& set_compression_parallelism(int compression_parallelism) & {
+      compressor_options_.set_parallelism(compression_parallelism);
+      return *this;
+    }
+    Options&& set_compression_parallelism(int compression_parallelism) && {
+      return std::move(set_compression_parallelism(compression_parallelism));
+    }
+
+    // Sets the maximum total size of chunks closed but not written yet, if
+    // parallelism > 0. A chunk is counted by the size of its records while it
+    // is being encoded, then by its encoded size until it is written.
+    //
+    // Closing a chunk, i.e. WriteRecord() or Flush(), blocks while adding the
+    // chunk would exceed the limit, unless no other chunks are pending. This
+    // bounds memory usage when the byte Writer is slower than records arrive,
+    // also for chunks of variable sizes cut off by Flush().
+    //
+    // Default: std::numeric_limits<uint64_t>::max()
+    Options& set_max_pending_bytes(uint64_t max_pending_bytes) & {
+      max_pending_bytes_ = max_pending_bytes;
+      return *this;
+    }
+    Options&& set_max_pending_bytes(uint64_t max_pending_bytes) && {
+      return std::move(set_max_pending_bytes(max_pending_bytes));
+    }
+
+    // Specifies compression used instead of the main compression for chunks
+    // started while encoding falls behind, if parallelism > 0. This trades
+    // compression density for throughput during load spikes, instead of
+    // building up a backlog, and returns to the main compression when the
+    // backlog drains. Typically this is a fast setting, e.g.
+    // CompressorOptions().set_lz4() or CompressorOptions().set_zstd(1).
+    //
+    // Encoding is considered to fall behind when, at the time a chunk is
+    // closed, at least half of parallelism earlier chunks are still being
+    // encoded or waiting to be written, or they take more than half of
+    // max_pending_bytes.
+    //
+    // The compression of each chunk is recorded in the chunk, so readers need
+    // no configuration.
+    //
+    // Default: none (the main compression is always used)
+    Options& set_backlog_compression(
+        const CompressorOptions& backlog_compression) & {
+      has_backlog_compression_ = true;
+      backlog_compression_ = backlog_compression;
+      return *this;
+    }
+    Options&& set_backlog_compression(
+        const CompressorOptions& backlog_compression) && {
+      return std::move(set_backlog_compression(backlog_compression));
+    }
+
+    // If true and parallelism > 0, records of a chunk which is not transposed
+    // are compressed in the thread calling WriteRecord() as they arrive,
+    // instead of being buffered uncompressed and compressed in background.
+    // Only assembling, hashing, and writing of the chunk happen in background.
+    //
+    // This bounds memory usage to compressed chunks (plus uncompressed chunks
+    // being filled), at the cost of compression no longer being parallelized.
+    // Transposed chunks are always buffered uncompressed, because the
+    // transposed layout is known only after all records are added.
+    //
+    // If parallelism == 0, records are compressed as they arrive anyway.
+    //
+    // Default: false
+    Options& set_streaming_encoding(bool streaming_encoding) & {
+      streaming_encoding_ = streaming_encoding;
+      return *this;
+    }
+    Options&& set_streaming_encoding(bool streaming_encoding) && {
+      return std::move(set_streaming_encoding(streaming_encoding));
+    }
+
+    // If true, compression is chosen separately for each chunk by sampling its
+    // records: incompressible chunks (e.g. of images which are already
+    // compressed) are written uncompressed, chunks which only LZ4 matching
+    // helps are compressed with LZ4, and other chunks use the compression from
+    // set_uncompressed(), set_brotli(), set_zstd(), or set_lz4(). See
+    // AdaptiveEncoder for details.
+    //
+    // Records are buffered uncompressed until the chunk is complete, so
+    // set_streaming_encoding() has no effect.
+    //
+    // The compression type of each chunk is recorded in the chunk, so readers
+    // need no configuration.
+    //
+    // Default: false
+    Options& set_adaptive_compression(bool adaptive_compression) & {
+      adaptive_compression_ = adaptive_compression;
+      return *this;
+    }
+    Options&& set_adaptive_compression(bool adaptive_compression) && {
+      return std::move(set_adaptive_compression(adaptive_compression));
+    }
+
+    // Specifies the thread pool used for background work if parallelism > 0.
+    // The thread pool must be kept alive until the RecordWriter is closed.
+    //
+    // If nullptr, a thread pool shared by the process is used.
+    //
+    // Default: nullptr
+    Options& set_thread_pool(ThreadPool* thread_pool) & {
+      thread_pool_ = thread_pool;
+      return *this;
+    }
+    Options&& set_thread_pool(ThreadPool* thread_pool) && {
+      return std::move(set_thread_pool(thread_pool));
+    }
+
+    // Specifies CPUs which the chunk writer thread is pinned to if
+    // parallelism > 0. Encoding tasks run in the thread pool, whose workers can
+    // be pinned by ThreadPool(int, std::vector<int>).
+    //
+    // Pinning is supported only on Linux, elsewhere this is ignored.
+    //
+    // If empty, the chunk writer thread is not pinned.
+    //
+    // Default: {}
+    Options& set_chunk_writer_cpus(std::vector<int> chunk_writer_cpus) & {
+      chunk_writer_cpus_ = std::move(chunk_writer_cpus);
+      return *this;
+    }
+    Options&& set_chunk_writer_cpus(std::vector<int> chunk_writer_cpus) && {
+      return std::move(set_chunk_writer_cpus(std::move(chunk_writer_cpus)));
+    }
+
+    // If true, a ChunkIndex listing chunks containing records is written as the
+    // last chunk of the file when the RecordWriter is closed. This allows
+    // RecordReader::ReadChunkIndex() to seek by record ordinal and to seek to a
+    // position without reading chunk headers.
+    //
+    // The index is written only if the file is written from the beginning,
+    // not when appending to an existing file.
+    //
+    // Such a file can be read only by a RecordReader which supports index
+    // chunks. Older readers fail at the index chunk with "Unknown chunk type".
+    //
+    // Default: false
+    Options& set_chunk_index(bool chunk_index) & {
+      chunk_index_ = chunk_index;
+      return *this;
+    }
+    Options&& set_chunk_index(bool chunk_index) && {
+      return std::move(set_chunk_index(chunk_index));
+    }
+
+    // If true, a FileSummary with the total number of records, their total
+    // size, the number of chunks, and these options is written as the last
+    // chunk of the file when the RecordWriter is closed. This allows
+    // RecordReader::ReadFileSummary() to learn them with one small read,
+    // without reading chunk headers.
+    //
+    // The summary is written only if the file is written from the beginning,
+    // not when appending to an existing file.
+    //
+    // Such a file can be read only by a RecordReader which supports summary
+    // chunks. Older readers fail at the summary chunk with "Unknown chunk
+    // type".
+    //
+    // Default: false
+    Options& set_file_summary(bool file_summary) & {
+      file_summary_ = file_summary;
+      return *this;
+    }
+    Options&& set_file_summary(bool file_summary) && {
+      return std::move(set_file_summary(file_summary));
+    }
+
+    // Specifies numeric fields whose ranges of values in each chunk are stored
+    // in the chunk index, if set_chunk_index(true). This allows
+    // RecordReader::Options::set_chunk_filter() to skip chunks which cannot
+    // contain interesting records, e.g. outside of a time range.
+    //
+    // Records should be serialized proto messages. Computing the ranges scans
+    // each record in the thread calling WriteRecord().
+    //
+    // Default: {}
+    Options& set_chunk_index_fields(
+        std::vector<ChunkIndexField> chunk_index_fields) & {
+      chunk_index_fields_ = std::move(chunk_index_fields);
+      return *this;
+    }
+    Options&& set_chunk_index_fields(
+        std::vector<ChunkIndexField> chunk_index_fields) && {
+      return std::move(set_chunk_index_fields(std::move(chunk_index_fields)));
+    }
+
+    // Specifies a function extracting the key of a record, e.g. from a field
+    // using ProjectField(). Records must be written in the order of their
+    // keys (duplicate keys are allowed), otherwise the RecordWriter fails.
+    //
+    // If set_chunk_index(true), the key of the first record of each chunk is
+    // stored in the chunk index. This allows RecordReader::Lookup() to find a
+    // record by key, decoding only one chunk. Extracting keys is done in the
+    // thread calling WriteRecord().
+    //
+    // If nullptr, records are not keyed.
+    //
+    // Default: nullptr
+    Options& set_key_function(
+        std::function<std::string(absl::string_view record)> key_function) & {
+      key_function_ = std::move(key_function);
+      return *this;
+    }
+    Options&& set_key_function(
+        std::function<std::string(absl::string_view record)> key_function) && {
+      return std::move(set_key_function(std::move(key_function)));
+    }
+
+    // If positive, set_key_function() is used, and set_chunk_index(true), a
+    // Bloom filter of keys of each chunk, with about this many bits per key, is
+    // stored in the chunk index. This allows RecordReader::Lookup() and
+    // ChunkIndex::MayContainKey() to rule out chunks not containing a key
+    // without reading them. 10 bits per key give about 1% false positives.
+    //
+    // Default: 0 (no key filters)
+    Options& set_key_filter_bits_per_key(int bits_per_key) & {
+      RIEGELI_ASSERT_GE(bits_per_key, 0)
+          << "Failed precondition of "
+             "RecordWriter::Options::set_key_filter_bits_per_key(): "
+             "negative bits per key";
+      key_filter_bits_per_key_ = bits_per_key;
+      return *this;
+    }
+    Options&& set_key_filter_bits_per_key(int bits_per_key) && {
+      return std::move(set_key_filter_bits_per_key(bits_per_key));
+    }
+
+    // Specifies a RecordStats which accumulates counters of chunks written and
+    // times of encoding and writing them. The RecordStats must be kept alive
+    // until the RecordWriter is closed.
+    //
+    // If nullptr, counters are not collected.
+    //
+    // Default: nullptr
+    Options& set_stats(RecordStats* stats) & {
+      stats_ = stats;
+      return *this;
+    }
+    Options&& set_stats(RecordStats* stats) && {
+      return std::move(set_stats(stats));
+    }
+
+    // Specifies a RecordTracer which collects timelines of opening, encoding,
+    // queueing, and writing chunks, and of flushing. The RecordTracer must be
+    // kept alive until the RecordWriter is closed.
+    //
+    // If nullptr, only static tracepoints are fired (if compiled in).
+    //
+    // Default: nullptr
+    Options& set_tracer(RecordTracer* tracer) & {
+      tracer_ = tracer;
+      return *this;
+    }
+    Options&& set_tracer(RecordTracer* tracer) && {
+      return std::move(set_tracer(tracer));
+    }
+
+    // Specifies an FdGroupCommitter for the file descriptor written to. Then
+    // Flush(FlushType::kFromMachine) makes data durable through it, sharing a
+    // sync with concurrent flushes, also with FlushAsync(). The
+    // FdGroupCommitter must be kept alive until the RecordWriter is closed.
+    //
+    // If nullptr, Flush(FlushType::kFromMachine) syncs through the byte Writer.
+    //
+    // Default: nullptr
+    Options& set_group_committer(FdGroupCommitter* group_committer) & {
+      group_committer_ = group_committer;
+      return *this;
+    }
+    Options&& set_group_committer(FdGroupCommitter* group_committer) && {
+      return std::move(set_group_committer(group_committer));
+    }
+
+    // Specifies a RateLimiter, possibly shared with other writers and readers,
+    // which limits the bandwidth of writing chunks with the given priority:
+    // each chunk waits for the RateLimiter before being written to the
+    // ChunkWriter. The RateLimiter must be kept alive until the RecordWriter
+    // is closed.
+    //
+    // This limits writing to any ChunkWriter. When writing to an FdWriter,
+    // FdWriter::Options::set_rate_limiter() can be used instead.
+    //
+    // If nullptr, writing is not limited.
+    //
+    // Default: nullptr
+    Options& set_rate_limiter(RateLimiter* rate_limiter,
+                              RateLimiter::Priority priority =
+                                  RateLimiter::Priority::kBackground) & {
+      rate_limiter_ = rate_limiter;
+      rate_priority_ = priority;
+      return *this;
+    }
+    Options&& set_rate_limiter(RateLimiter* rate_limiter,
+                               RateLimiter::Priority priority =
+                                   RateLimiter::Priority::kBackground) && {
+      return std::move(set_rate_limiter(rate_limiter, priority));
+    }
+
    private:
     friend class RecordWriter;
 
     bool transpose_ = false;
+    bool transpose_nonproto_ = false;
+    bool transpose_packed_ = false;
     CompressorOptions compressor_options_;
     uint64_t chunk_size_ = uint64_t{1} << 20;
+    uint64_t max_chunk_records_ = std::numeric_limits<uint64_t>::max();
+    absl::Duration max_chunk_latency_ = absl::InfiniteDuration();
     double bucket_fraction_ = 1.0;
+    std::vector<Field> separate_bucket_fields_;
+    bool has_separate_bucket_compression_ = false;
+    CompressorOptions separate_bucket_compression_;
+    bool store_incompressible_buckets_ = false;
+    uint64_t values_block_size_ = 0;
+    bool fixed_record_sizes_ = false;
+    bool deduplicate_records_ = false;
+    bool delta_records_ = false;
     int parallelism_ = 0;
+    uint64_t max_pending_bytes_ = std::numeric_limits<uint64_t>::max();
+    bool has_backlog_compression_ = false;
+    CompressorOptions backlog_compression_;
+    bool streaming_encoding_ = false;
+    bool adaptive_compression_ = false;
+    ThreadPool* thread_pool_ = nullptr;
+    std::vector<int> chunk_writer_cpus_;
+    bool chunk_index_ = false;
+    bool file_summary_ = false;
+    std::vector<ChunkIndexField> chunk_index_fields_;
+    std::function<std::string(absl::string_view record)> key_function_;
+    int key_filter_bits_per_key_ = 0;
+    RecordStats* stats_ = nullptr;
+    RecordTracer* tracer_ = nullptr;
+    FdGroupCommitter* group_committer_ = nullptr;
+    RateLimiter* rate_limiter_ = nullptr;
+    RateLimiter::Priority rate_priority_ = RateLimiter::Priority::kBackground;
   };
 
   // Creates a closed RecordWriter.
@@ -343,6 +1012,24 @@ class RecordWriter final : public Object {
 
   ~RecordWriter();
 
+  // Closes the RecordWriter if it is open, then makes it write to another
+  // destination like a newly constructed RecordWriter. If parallelism is 0 and
+  // options encode chunks in the same way as before, the chunk encoder is
+  // reused with memory allocated for the previous destination, e.g. hash
+  // tables and buffers of transposition and compressor state, which makes
+  // writing many short files cheaper.
+  //
+  // Return values:
+  //  * true  - success (the new destination is used, which is reflected by
+  //            healthy() as after construction)
+  //  * false - closing the previous destination failed (!healthy(),
+  //            the new destination is not used)
+  bool Reset(std::unique_ptr<Writer> byte_writer, Options options = Options());
+  bool Reset(Writer* byte_writer, Options options = Options());
+  bool Reset(std::unique_ptr<ChunkWriter> chunk_writer,
+             Options options = Options());
+  bool Reset(ChunkWriter* chunk_writer, Options options = Options());
+
   // Writes the next record.
   //
   // WriteRecord(MessageLite) serializes a proto message to raw bytes
@@ -362,6 +1049,119 @@ class RecordWriter final : public Object {
   bool WriteRecord(const Chain& record, FutureRecordPosition* key = nullptr);
   bool WriteRecord(Chain&& record, FutureRecordPosition* key = nullptr);
 
+  // Writes multiple records, which is faster than writing them one by one.
+  //
+  // WriteRecords(Chain, vector<size_t>) accepts records expressed as
+  // concatenated record values and sorted record end positions. Records are
+  // split between chunks in the same way as by WriteRecord().
+  //
+  // Preconditions for WriteRecords(Chain, vector<size_t>):
+  //   limits are sorted
+  //   (limits.empty() ? 0 : limits.back()) == records.size()
+  //
+  // Return values:
+  //  * true  - success (healthy())
+  //  * false - failure (!healthy())
+  bool WriteRecords(absl::Span<const absl::string_view> records);
+  bool WriteRecords(Chain records, std::vector<size_t> limits);
+
+  // Begins writing the next record incrementally, e.g. a record too large to be
+  // kept in memory. Its value is written to the returned Writer, and the record
+  // ends when the Writer is closed.
+  //
+  // The open chunk is closed, and the record is split into fragments of up to
+  // Options::set_chunk_size() bytes, each written as its own chunk, so that
+  // neither writing nor reading the record needs memory for all of it.
+  // RecordReader joins the fragments, or reads them incrementally with
+  // RecordReader::ReadRecordStream(). Fragments are compressed as chunks are
+  // (Options::set_brotli() etc.), in the calling thread.
+  //
+  // The returned Writer is owned by this RecordWriter. Other records must not
+  // be written, and this RecordWriter must not be moved, until the Writer is
+  // closed. Closing the RecordWriter closes the Writer too.
+  //
+  // If key != nullptr, *key is set to the canonical record position on success.
+  //
+  // Precondition: Options::set_chunk_index_fields() and
+  // Options::set_key_function() were not used, because fragments are not
+  // decoded to be indexed.
+  //
+  // Return values:
+  //  * non-nullptr - success (healthy())
+  //  * nullptr     - failure (!healthy())
+  Writer* BeginRecord(FutureRecordPosition* key = nullptr);
+
+  // Appends records of another file read by src, copying its chunks verbatim
+  // instead of decoding and encoding them again. This makes concatenating or
+  // merging files nearly as cheap as copying bytes. Only chunks containing
+  // records are copied; the signature and metadata chunks of src are dropped,
+  // and the records remain readable in the same order.
+  //
+  // Chunks with decoded size below reencode_below_size, e.g. small chunks at
+  // the ends of files, have their records written like by WriteRecord()
+  // instead, so that they are merged with neighboring records into chunks of
+  // the desired size. Other chunks keep their original encoding and
+  // compression, which need not match the Options of this RecordWriter.
+  //
+  // The open chunk is closed before each chunk copied verbatim.
+  //
+  // Precondition: Options::set_chunk_index_fields() and
+  // Options::set_key_function() were not used, because copied chunks are not
+  // decoded to be indexed.
+  //
+  // Return values:
+  //  * true                    - success (src ends, healthy())
+  //  * false (when healthy())  - reading from src failed (src is !healthy())
+  //  * false (when !healthy()) - failure
+  bool CopyChunks(ChunkReader* src, uint64_t reencode_below_size = 0);
+
+  // Like CopyChunks(), but recompresses copied chunks with the compression
+  // specified by Options of this RecordWriter, without decoding their records.
+  // Chunks keep their other parameters, in particular transposed chunks are
+  // not transposed again. See ChunkTranscoder.
+  //
+  // zstd_dictionaries decompress chunks compressed with a Zstd dictionary, and
+  // must be kept alive until the RecordWriter is flushed or closed.
+  //
+  // If Options::set_parallelism() > 0, chunks are transcoded in parallel.
+  //
+  // Precondition: Options::set_chunk_index_fields() and
+  // Options::set_key_function() were not used.
+  //
+  // Return values:
+  //  * true                    - success (src ends, healthy())
+  //  * false (when healthy())  - reading from src failed (src is !healthy())
+  //  * false (when !healthy()) - failure
+  bool TranscodeChunks(
+      ChunkReader* src,
+      const ZstdDictionaryRegistry* zstd_dictionaries = nullptr);
+
+  // Appends records of another file read by src, keeping only fields included
+  // by field_filter, e.g. to derive a smaller file with a few fields.
+  //
+  // Chunks of src are decoded with field_filter, so for transposed chunks only
+  // buckets containing included fields are decompressed, and pruned records
+  // are reconstructed from them without parsing. The pruned records are then
+  // written like by WriteRecords(). If field_filter keeps a small fraction of
+  // the data, this costs little more than reading the included buckets.
+  //
+  // Fields are pruned only from transposed chunks. Records of simple chunks,
+  // i.e. chunks written without Options::set_transpose(true), are copied whole,
+  // because their fields are not stored separately and pruning them would
+  // require parsing each record. A file is pruned fully only if it has been
+  // written with set_transpose(true).
+  //
+  // zstd_dictionaries decompress chunks compressed with a Zstd dictionary.
+  //
+  // Return values:
+  //  * true                    - success (src ends, healthy())
+  //  * false (when healthy())  - reading from src failed (src is !healthy())
+  //  * false (when !healthy()) - failure
+  bool CopyFields(ChunkReader* src, FieldFilter field_filter,
+                  const ZstdDictionaryRegistry* zstd_dictionaries = nullptr);
+
+  class Producer;
+
   // Finalizes any open chunk and pushes buffered data to the Writer.
   // If Options::set_parallelism() was used, waits for any background writing to
   // complete.
@@ -373,12 +1173,48 @@ class RecordWriter final : public Object {
   //  * FlushType::kFromProcess - data survives process crash
   //  * FlushType::kFromMachine - data survives operating system crash
   //
+  // With Options::set_group_committer(), a failure to sync through the
+  // FdGroupCommitter fails the RecordWriter.
+  //
   // Return values:
   //  * true                    - success (pushed and synced, healthy())
   //  * false (when healthy())  - failure to sync
   //  * false (when !healthy()) - failure to push
   bool Flush(FlushType flush_type);
 
+  // Like Flush(), but does not wait until the data reach the level requested
+  // by flush_type. The open chunk is finalized before FlushAsync() returns, so
+  // the caller can continue writing records while chunks are encoded, written,
+  // and synced in the background.
+  //
+  // The returned future becomes ready with true on success, or with false on
+  // failure. FlushAsync() does not fail the RecordWriter itself, because the
+  // flush may fail in the background: healthy() can still be true after the
+  // future becomes ready with false. A failure to push is reported by the next
+  // operation, e.g. Flush() or Close(). A failure to sync through the
+  // FdGroupCommitter is reported by FdGroupCommitter::error_code(), and by the
+  // next Flush(FlushType::kFromMachine), because later commits fail too.
+  //
+  // Without Options::set_parallelism() and Options::set_group_committer(), the
+  // flush completes before FlushAsync() returns.
+  //
+  // With Options::set_group_committer(), FlushType::kFromMachine is completed
+  // through the FdGroupCommitter. Waiting for the future after releasing locks
+  // which guard this RecordWriter lets flushes of concurrent requests share a
+  // sync.
+  std::shared_future<bool> FlushAsync(
+      FlushType flush_type = FlushType::kFromMachine);
+
+  // If Options::set_max_chunk_latency() has passed since the first record of
+  // the open chunk was written, closes the chunk and pushes it like
+  // FlushAsync(FlushType::kFromObject), without waiting. Otherwise does
+  // nothing.
+  //
+  // Return values:
+  //  * true  - success (healthy())
+  //  * false - failure (!healthy())
+  bool FlushExpiredChunk();
+
   // Returns the current position.
   //
   // Pos().get().numeric() returns the position as an integer of type Position.
@@ -391,6 +1227,22 @@ class RecordWriter final : public Object {
   // following WriteRecord() in *key.
   FutureRecordPosition Pos() const;
 
+  // Returns the total size of chunks closed but not written yet, counted as by
+  // Options::set_max_pending_bytes(). This is 0 if parallelism == 0.
+  uint64_t pending_bytes() const;
+
+  // Estimates the amount of memory used by this RecordWriter, including
+  // records of the open chunk, encoder and compressor state, the chunk index,
+  // and the ChunkWriter and byte Writer.
+  //
+  // If Options::set_parallelism() was used, chunks being encoded or waiting to
+  // be written are counted as by pending_bytes(), and the ChunkWriter and the
+  // chunk index are included only while no chunk is being written, because
+  // they are used by the background thread.
+  size_t EstimateMemory() const;
+  // Registers this RecordWriter with MemoryEstimator.
+  void AddUniqueTo(MemoryEstimator* memory_estimator) const;
+
  protected:
   void Done() override;
 
@@ -399,14 +1251,54 @@ class RecordWriter final : public Object {
   class SerialImpl;
   class ParallelImpl;
   class DummyImpl;
+  class RecordStreamWriter;
+
+  // Reuses chunk_encoder unless it is nullptr.
+  RecordWriter(ChunkWriter* chunk_writer, Options options,
+               std::unique_ptr<ChunkEncoder> chunk_encoder);
 
   static std::unique_ptr<ChunkEncoder> MakeChunkEncoder(const Options& options);
 
+  // Returns true if MakeChunkEncoder() makes equivalent chunk encoders for a
+  // and b.
+  static bool SameChunkEncoding(const Options& a, const Options& b);
+
+  // Closes the RecordWriter for Reset(), taking the chunk encoder to
+  // *chunk_encoder if it can be reused with options.
+  bool CloseForReset(const Options& options,
+                     std::unique_ptr<ChunkEncoder>* chunk_encoder);
+
   template <typename Record>
   bool WriteRecordImpl(Record&& record, FutureRecordPosition* key);
 
+  // Fails if Producers are open, because positions of records written directly
+  // would not account for chunks handed over by Producers.
+  //
+  // Return values:
+  //  * true  - success (no Producers)
+  //  * false - failure (!healthy())
+  bool CheckNoProducers();
+
+  // Implements CopyChunks() and TranscodeChunks().
+  bool CopyChunksImpl(ChunkReader* src, uint64_t reencode_below_size,
+                      bool transcode,
+                      const ZstdDictionaryRegistry* zstd_dictionaries);
+
+  // Sets chunk_deadline_ for a chunk getting its first record.
+  void StartChunkDeadline();
+
+  // Writes a fragment of a record being written by record_stream_.
+  bool WriteFragment(Chain fragment, bool first, bool last);
+
   uint64_t desired_chunk_size_ = 0;
   uint64_t chunk_size_so_far_ = 0;
+  uint64_t max_chunk_records_ = 0;
+  uint64_t chunk_records_so_far_ = 0;
+  absl::Duration max_chunk_latency_ = absl::InfiniteDuration();
+  // When the open chunk should be closed because of max_chunk_latency_, or
+  // absl::InfiniteFuture() if there is no limit or the chunk is empty.
+  absl::Time chunk_deadline_ = absl::InfiniteFuture();
+  FdGroupCommitter* group_committer_ = nullptr;
   std::unique_ptr<ChunkWriter> owned_chunk_writer_;
   // impl_ must be defined after owned_chunk_writer_ so that it is destroyed
   // before owned_chunk_writer_, because background work of impl_ may need
@@ -414,6 +1306,104 @@ class RecordWriter final : public Object {
   //
   // Invariant: if healthy() them impl_ != nullptr
   std::unique_ptr<Impl> impl_;
+  // The Writer returned by BeginRecord(), or nullptr.
+  std::unique_ptr<RecordStreamWriter> record_stream_;
+};
+
+// RecordWriter::Producer writes records to a RecordWriter from one of several
+// threads.
+//
+// RecordWriter is not thread-safe. With Options::set_parallelism() > 0,
+// several threads can instead write through their own Producers. Each Producer
+// collects records of its own chunk, so adding records does not take a lock
+// shared with other threads; only handing over a complete chunk to the
+// RecordWriter does. Chunks are encoded in the thread pool of the RecordWriter
+// and written in the order in which they were handed over, so records of
+// different Producers are interleaved at the granularity of chunks.
+//
+// Producers are not supported if the chunk index collects
+// Options::set_chunk_index_fields() or Options::set_key_function(), because
+// these need records of each chunk to come from a single sequence.
+//
+// A Producer is thread-compatible, so normally each thread has its own. The
+// thread owning the RecordWriter can continue to use it for Flush(), but
+// writing records to it directly while Producers are open fails the
+// RecordWriter, because positions of such records would not account for chunks
+// handed over by Producers. All Producers must be closed before the
+// RecordWriter is closed.
+class RecordWriter::Producer final : public Object {
+ public:
+  // Creates a closed Producer.
+  Producer() noexcept;
+
+  // Will write records to record_writer, which must be kept alive until
+  // closing the Producer.
+  //
+  // If record_writer does not support Producers, the Producer fails.
+  explicit Producer(RecordWriter* record_writer);
+
+  Producer(Producer&& src) noexcept;
+  Producer& operator=(Producer&& src) noexcept;
+
+  ~Producer();
+
+  // Writes the next record, like RecordWriter::WriteRecord().
+  //
+  // If key != nullptr, *key is set to the canonical record position on success.
+  // It can be resolved only after the chunk containing the record is handed
+  // over to the RecordWriter, i.e. after the chunk is full, or after Flush() or
+  // Close().
+  //
+  // Return values:
+  //  * true  - success (healthy())
+  //  * false - failure (!healthy())
+  bool WriteRecord(const google::protobuf::MessageLite& record,
+                   FutureRecordPosition* key = nullptr);
+  bool WriteRecord(absl::string_view record,
+                   FutureRecordPosition* key = nullptr);
+  bool WriteRecord(std::string&& record, FutureRecordPosition* key = nullptr);
+  bool WriteRecord(const char* record, FutureRecordPosition* key = nullptr);
+  bool WriteRecord(const Chain& record, FutureRecordPosition* key = nullptr);
+  bool WriteRecord(Chain&& record, FutureRecordPosition* key = nullptr);
+
+  // Hands over the open chunk to the RecordWriter, and then flushes the
+  // RecordWriter like RecordWriter::Flush(), including chunks handed over by
+  // other Producers.
+  //
+  // Unlike RecordWriter::Flush(), a failure to sync also fails the Producer,
+  // because the Producer has no other way to report it.
+  //
+  // Return values:
+  //  * true  - success (pushed and synced, healthy())
+  //  * false - failure (!healthy())
+  bool Flush(FlushType flush_type);
+
+ protected:
+  void Done() override;
+
+ private:
+  template <typename Record>
+  bool WriteRecordImpl(Record&& record, FutureRecordPosition* key);
+
+  // Hands over the open chunk, if any, to impl_.
+  //
+  // If the result is false then !healthy().
+  bool CloseChunk();
+
+  // Invariant: if healthy() then impl_ != nullptr
+  Impl* impl_ = nullptr;
+  uint64_t desired_chunk_size_ = 0;
+  uint64_t chunk_size_so_far_ = 0;
+  uint64_t max_chunk_records_ = 0;
+  uint64_t chunk_records_so_far_ = 0;
+  // The open chunk, or nullptr if no records were written since handing over
+  // the last chunk.
+  std::unique_ptr<ChunkEncoder> chunk_encoder_;
+  // Set to the position of the open chunk when it is written.
+  std::promise<Position> chunk_begin_;
+  // Position of the first record of the open chunk, resolved through
+  // chunk_begin_.
+  FutureRecordPosition chunk_pos_;
 };
 
 // Implementation details follow.
@@ -424,6 +1414,8 @@ class FutureRecordPosition::FutureChunkBegin {
       Position pos_before_chunks,
       std::vector<std::shared_future<ChunkHeader>> chunk_headers);
 
+  explicit FutureChunkBegin(std::shared_future<Position> chunk_begin);
+
   FutureChunkBegin(const FutureChunkBegin&) = delete;
   FutureChunkBegin& operator=(const FutureChunkBegin&) = delete;
 
@@ -437,6 +1429,9 @@ class FutureRecordPosition::FutureChunkBegin {
   mutable Position pos_before_chunks_ = 0;
   // Headers of chunks to be written after pos_before_chunks_.
   mutable std::vector<std::shared_future<ChunkHeader>> chunk_headers_;
+  // If valid, the chunk begin is taken from here instead of
+  // pos_before_chunks_ and chunk_headers_.
+  mutable std::shared_future<Position> chunk_begin_;
 };
 
 inline Position FutureRecordPosition::FutureChunkBegin::get() const {
@@ -444,6 +1439,9 @@ inline Position FutureRecordPosition::FutureChunkBegin::get() const {
   RIEGELI_ASSERT(chunk_headers_.empty())
       << "FutureRecordPosition::FutureChunkBegin::Resolve() "
          "did not clear chunk_headers_";
+  RIEGELI_ASSERT(!chunk_begin_.valid())
+      << "FutureRecordPosition::FutureChunkBegin::Resolve() "
+         "did not clear chunk_begin_";
   return pos_before_chunks_;
 }
 
@@ -515,6 +1513,36 @@ inline bool RecordWriter::WriteRecord(Chain&& record,
   return WriteRecordImpl(std::move(record), key);
 }
 
+inline bool RecordWriter::Producer::WriteRecord(
+    const google::protobuf::MessageLite& record, FutureRecordPosition* key) {
+  return WriteRecordImpl(record, key);
+}
+
+inline bool RecordWriter::Producer::WriteRecord(absl::string_view record,
+                                                FutureRecordPosition* key) {
+  return WriteRecordImpl<const absl::string_view&>(record, key);
+}
+
+inline bool RecordWriter::Producer::WriteRecord(std::string&& record,
+                                                FutureRecordPosition* key) {
+  return WriteRecordImpl(std::move(record), key);
+}
+
+inline bool RecordWriter::Producer::WriteRecord(const char* record,
+                                                FutureRecordPosition* key) {
+  return WriteRecordImpl<const absl::string_view&>(record, key);
+}
+
+inline bool RecordWriter::Producer::WriteRecord(const Chain& record,
+                                                FutureRecordPosition* key) {
+  return WriteRecordImpl(record, key);
+}
+
+inline bool RecordWriter::Producer::WriteRecord(Chain&& record,
+                                                FutureRecordPosition* key) {
+  return WriteRecordImpl(std::move(record), key);
+}
+
 }  // namespace riegeli
 
 #endif  // RIEGELI_RECORDS_RECORD_WRITER_H_
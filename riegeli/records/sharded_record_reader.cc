@@ -0,0 +1,271 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/sharded_record_reader.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "google/protobuf/message_lite.h"
+#include "absl/base/optimization.h"
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/object.h"
+#include "riegeli/base/parallelism.h"
+#include "riegeli/bytes/reader.h"
+#include "riegeli/records/record_reader.h"
+
+namespace riegeli {
+
+namespace {
+
+// A background task publishes records of a shard in batches of about this
+// size, to reduce contention on the mutex.
+constexpr uint64_t kBatchBytes = uint64_t{64} << 10;
+
+// The number of bytes accounted for a buffered record, including its overhead,
+// so that empty records also count.
+inline uint64_t RecordBytes(const std::string& record) {
+  return uint64_t{record.size()} + uint64_t{sizeof(std::string)};
+}
+
+}  // namespace
+
+// A shard being read. Fields other than index and record_reader are guarded
+// by ShardedRecordReader::mutex_.
+struct ShardedRecordReader::Shard {
+  explicit Shard(size_t index) : index(index) {}
+
+  const size_t index;
+  // Accessed only by the background task reading the shard, or while filling
+  // is false. nullptr before opening the shard and after it ends.
+  std::unique_ptr<RecordReader> record_reader;
+  // Records read and not yet returned.
+  std::deque<std::string> records;
+  // The sum of RecordBytes() of records.
+  uint64_t buffered_bytes = 0;
+  // True if a background task is reading the shard.
+  bool filling = false;
+  // True if the shard has no more records to read. Then filling is false.
+  bool ended = false;
+  // Non-empty if reading the shard failed, valid if ended is true.
+  std::string failure;
+};
+
+ShardedRecordReader::ShardedRecordReader() noexcept
+    : Object(State::kClosed) {}
+
+ShardedRecordReader::ShardedRecordReader(
+    size_t num_shards,
+    std::function<std::unique_ptr<Reader>(size_t shard)> open_shard,
+    Options options)
+    : Object(State::kOpen),
+      num_shards_(num_shards),
+      open_shard_(std::move(open_shard)),
+      record_reader_options_(std::move(options.record_reader_options_)),
+      interleaving_(options.interleaving_),
+      parallelism_(IntCast<size_t>(options.parallelism_)),
+      max_shard_buffered_bytes_(options.max_buffered_bytes_ /
+                                uint64_t{parallelism_}),
+      thread_pool_(options.thread_pool_ != nullptr
+                       ? options.thread_pool_
+                       : &internal::DefaultThreadPool()) {
+  // Shards are read by tasks on thread_pool_, which may be the same thread
+  // pool as the one decoding chunks read ahead. A shard waiting for its chunks
+  // while they wait for a thread would deadlock a fixed size pool.
+  record_reader_options_.set_parallelism(0);
+  absl::MutexLock lock(&mutex_);
+  ActivateShards();
+}
+
+ShardedRecordReader::~ShardedRecordReader() {
+  if (ABSL_PREDICT_FALSE(!closed())) {
+    // Ask background tasks to stop and wait for them.
+    Fail("Cancelled");
+    Done();
+  }
+}
+
+void ShardedRecordReader::Done() {
+  absl::MutexLock lock(&mutex_);
+  closing_ = true;
+  while (num_filling_ > 0) changed_.Wait(&mutex_);
+  active_.clear();
+}
+
+void ShardedRecordReader::ActivateShards() {
+  while (active_.size() < parallelism_ && next_shard_ < num_shards_) {
+    active_.push_back(absl::make_unique<Shard>(next_shard_++));
+    MaybeFill(active_.back().get());
+  }
+}
+
+void ShardedRecordReader::MaybeFill(Shard* shard) {
+  // Refilling only after the buffer drops to a half lets background tasks work
+  // in larger steps.
+  if (shard->filling || shard->ended || closing_ ||
+      shard->buffered_bytes > max_shard_buffered_bytes_ / 2) {
+    return;
+  }
+  shard->filling = true;
+  ++num_filling_;
+  thread_pool_->Schedule([this, shard] { Fill(shard); });
+}
+
+void ShardedRecordReader::Fill(Shard* shard) {
+  std::string failure;
+  bool ended = false;
+  if (shard->record_reader == nullptr) {
+    std::unique_ptr<Reader> byte_reader = open_shard_(shard->index);
+    if (ABSL_PREDICT_FALSE(byte_reader == nullptr)) {
+      failure = absl::StrCat("Opening shard ", shard->index, " failed");
+      ended = true;
+    } else {
+      shard->record_reader = absl::make_unique<RecordReader>(
+          std::move(byte_reader), record_reader_options_);
+    }
+  }
+  for (;;) {
+    std::vector<std::string> batch;
+    uint64_t batch_bytes = 0;
+    while (!ended && batch_bytes < kBatchBytes) {
+      std::string record;
+      if (ABSL_PREDICT_FALSE(!shard->record_reader->ReadRecord(&record))) {
+        if (ABSL_PREDICT_FALSE(!shard->record_reader->Close())) {
+          failure = absl::StrCat("Reading shard ", shard->index,
+                                 " failed: ", shard->record_reader->message());
+        }
+        shard->record_reader.reset();
+        ended = true;
+        break;
+      }
+      batch_bytes += RecordBytes(record);
+      batch.push_back(std::move(record));
+    }
+    absl::MutexLock lock(&mutex_);
+    for (std::string& record : batch) {
+      shard->records.push_back(std::move(record));
+    }
+    shard->buffered_bytes += batch_bytes;
+    if (ended) {
+      shard->ended = true;
+      shard->failure = std::move(failure);
+    }
+    if (ended || closing_ ||
+        shard->buffered_bytes >= max_shard_buffered_bytes_) {
+      shard->filling = false;
+      --num_filling_;
+      changed_.SignalAll();
+      return;
+    }
+    if (!batch.empty()) changed_.SignalAll();
+  }
+}
+
+size_t ShardedRecordReader::PickShard(bool* all_ended) {
+  *all_ended = false;
+  for (;;) {
+    if (active_.empty()) {
+      *all_ended = true;
+      return 0;
+    }
+    size_t first = 0;
+    size_t count = 1;
+    switch (interleaving_) {
+      case Interleaving::kByShard:
+        break;
+      case Interleaving::kRoundRobin:
+        first = next_active_ < active_.size() ? next_active_ : size_t{0};
+        break;
+      case Interleaving::kFirstAvailable:
+        first = next_active_ < active_.size() ? next_active_ : size_t{0};
+        count = active_.size();
+        break;
+    }
+    bool removed = false;
+    for (size_t i = 0; i < count; ++i) {
+      const size_t pos = (first + i) % active_.size();
+      Shard& shard = *active_[pos];
+      if (!shard.records.empty() || !shard.failure.empty()) return pos;
+      if (shard.ended) {
+        // All records of the shard were returned. Replace it with the next
+        // shard, which keeps shards of active_ in the order of their indices.
+        active_.erase(active_.begin() + pos);
+        next_active_ = pos;
+        ActivateShards();
+        removed = true;
+        break;
+      }
+    }
+    if (!removed) return active_.size();
+  }
+}
+
+bool ShardedRecordReader::ReadRecord(std::string* record, size_t* shard) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  absl::MutexLock lock(&mutex_);
+  for (;;) {
+    bool all_ended;
+    const size_t pos = PickShard(&all_ended);
+    if (all_ended) return false;
+    if (pos == active_.size()) {
+      // Wait for records of a suitable shard.
+      changed_.Wait(&mutex_);
+      continue;
+    }
+    Shard& picked = *active_[pos];
+    if (ABSL_PREDICT_FALSE(picked.records.empty())) {
+      return Fail(picked.failure);
+    }
+    *record = std::move(picked.records.front());
+    picked.records.pop_front();
+    picked.buffered_bytes -= RecordBytes(*record);
+    if (shard != nullptr) *shard = picked.index;
+    next_active_ = pos + 1;
+    MaybeFill(&picked);
+    return true;
+  }
+}
+
+bool ShardedRecordReader::ReadRecord(google::protobuf::MessageLite* record,
+                                     size_t* shard) {
+  std::string serialized;
+  size_t record_shard;
+  if (ABSL_PREDICT_FALSE(!ReadRecord(&serialized, &record_shard))) {
+    return false;
+  }
+  if (ABSL_PREDICT_FALSE(!record->ParsePartialFromString(serialized))) {
+    return Fail(absl::StrCat("Failed to parse message of type ",
+                             record->GetTypeName(), " in shard ",
+                             record_shard));
+  }
+  if (ABSL_PREDICT_FALSE(!record->IsInitialized())) {
+    return Fail(absl::StrCat("Failed to parse message of type ",
+                             record->GetTypeName(), " in shard ", record_shard,
+                             " because it is missing required fields: ",
+                             record->InitializationErrorString()));
+  }
+  if (shard != nullptr) *shard = record_shard;
+  return true;
+}
+
+}  // namespace riegeli
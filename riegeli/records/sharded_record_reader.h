@@ -0,0 +1,234 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_SHARDED_RECORD_READER_H_
+#define RIEGELI_RECORDS_SHARDED_RECORD_READER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/object.h"
+#include "riegeli/bytes/reader.h"
+#include "riegeli/records/record_reader.h"
+
+namespace google {
+namespace protobuf {
+class MessageLite;
+}  // namespace protobuf
+}  // namespace google
+
+namespace riegeli {
+
+class ThreadPool;
+
+// ShardedRecordReader reads records of a set of Riegeli/records files (shards)
+// as one stream. Several shards are read concurrently in the background by
+// RecordReaders, and records are buffered up to a limit.
+//
+// Shards are opened in order, at most parallelism at a time. The order of
+// records across shards depends on Options::set_interleaving(); records of the
+// same shard are always returned in their order.
+class ShardedRecordReader final : public Object {
+ public:
+  // How records of shards being read concurrently are interleaved.
+  enum class Interleaving {
+    // All records of a shard, then all records of the next shard, etc.
+    // The order of records is deterministic.
+    kByShard,
+    // One record of each shard being read in turn. The order of records is
+    // deterministic.
+    kRoundRobin,
+    // Records of any shard being read, whichever are available first. This
+    // does not wait for slow shards if others have records ready.
+    kFirstAvailable,
+  };
+
+  class Options {
+   public:
+    // Not defaulted because of a C++ defect:
+    // https://stackoverflow.com/questions/17430377
+    Options() noexcept {}
+
+    // Options for RecordReaders of shards.
+    //
+    // RecordReader::Options::set_parallelism() is ignored: chunks of a shard
+    // are decoded synchronously by the task reading the shard, because shards
+    // are already read in parallel, and decoding tasks waited for by shard
+    // tasks on the same thread pool could deadlock it.
+    //
+    // Default: RecordReader::Options()
+    Options& set_record_reader_options(
+        RecordReader::Options record_reader_options) & {
+      record_reader_options_ = std::move(record_reader_options);
+      return *this;
+    }
+    Options&& set_record_reader_options(
+        RecordReader::Options record_reader_options) && {
+      return std::move(
+          set_record_reader_options(std::move(record_reader_options)));
+    }
+
+    // Sets how records of shards being read concurrently are interleaved.
+    //
+    // Default: Interleaving::kByShard
+    Options& set_interleaving(Interleaving interleaving) & {
+      interleaving_ = interleaving;
+      return *this;
+    }
+    Options&& set_interleaving(Interleaving interleaving) && {
+      return std::move(set_interleaving(interleaving));
+    }
+
+    // Sets the maximum number of shards being read concurrently.
+    //
+    // Default: 8
+    Options& set_parallelism(int parallelism) & {
+      RIEGELI_ASSERT_GT(parallelism, 0)
+          << "Failed precondition of "
+             "ShardedRecordReader::Options::set_parallelism(): "
+             "non-positive parallelism";
+      parallelism_ = parallelism;
+      return *this;
+    }
+    Options&& set_parallelism(int parallelism) && {
+      return std::move(set_parallelism(parallelism));
+    }
+
+    // Sets the maximum total size of records read ahead from all shards and
+    // not yet returned, divided equally between shards being read. A shard
+    // can exceed its part by one batch of records.
+    //
+    // Default: 64M
+    Options& set_max_buffered_bytes(uint64_t max_buffered_bytes) & {
+      max_buffered_bytes_ = max_buffered_bytes;
+      return *this;
+    }
+    Options&& set_max_buffered_bytes(uint64_t max_buffered_bytes) && {
+      return std::move(set_max_buffered_bytes(max_buffered_bytes));
+    }
+
+    // Specifies the thread pool reading shards in the background. The thread
+    // pool must be kept alive until the ShardedRecordReader is closed.
+    //
+    // If nullptr, a thread pool shared by the process is used.
+    //
+    // Default: nullptr
+    Options& set_thread_pool(ThreadPool* thread_pool) & {
+      thread_pool_ = thread_pool;
+      return *this;
+    }
+    Options&& set_thread_pool(ThreadPool* thread_pool) && {
+      return std::move(set_thread_pool(thread_pool));
+    }
+
+   private:
+    friend class ShardedRecordReader;
+
+    RecordReader::Options record_reader_options_;
+    Interleaving interleaving_ = Interleaving::kByShard;
+    int parallelism_ = 8;
+    uint64_t max_buffered_bytes_ = uint64_t{64} << 20;
+    ThreadPool* thread_pool_ = nullptr;
+  };
+
+  // Creates a closed ShardedRecordReader.
+  ShardedRecordReader() noexcept;
+
+  // Will read records of num_shards shards. open_shard(shard) returns the byte
+  // Reader of the given shard, or nullptr on failure. It is called in the
+  // background, possibly concurrently for different shards.
+  ShardedRecordReader(
+      size_t num_shards,
+      std::function<std::unique_ptr<Reader>(size_t shard)> open_shard,
+      Options options = Options());
+
+  ShardedRecordReader(const ShardedRecordReader&) = delete;
+  ShardedRecordReader& operator=(const ShardedRecordReader&) = delete;
+
+  ~ShardedRecordReader();
+
+  // Reads the next record.
+  //
+  // ReadRecord(MessageLite*) parses raw bytes to a proto message after reading.
+  //
+  // If shard != nullptr, *shard is set to the index of the shard containing the
+  // record on success.
+  //
+  // Return values:
+  //  * true                    - success (*record is set)
+  //  * false (when healthy())  - all shards end
+  //  * false (when !healthy()) - failure
+  bool ReadRecord(google::protobuf::MessageLite* record,
+                  size_t* shard = nullptr);
+  bool ReadRecord(std::string* record, size_t* shard = nullptr);
+
+ protected:
+  void Done() override;
+
+ private:
+  struct Shard;
+
+  // Makes shards active until parallelism_ of them are active or all shards
+  // have been opened.
+  void ActivateShards() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Schedules reading more records of the shard if it is not being read, has
+  // not ended, and its buffer has room.
+  void MaybeFill(Shard* shard) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Reads records of the shard in the background until its buffer is full or
+  // the shard ends.
+  void Fill(Shard* shard) LOCKS_EXCLUDED(mutex_);
+
+  // Returns the index in active_ of the shard to read the next record from,
+  // or active_.size() if records of no suitable shard are available yet.
+  // Removes shards which ended. Sets *all_ended if there are no more records.
+  size_t PickShard(bool* all_ended) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  size_t num_shards_ = 0;
+  std::function<std::unique_ptr<Reader>(size_t shard)> open_shard_;
+  RecordReader::Options record_reader_options_;
+  Interleaving interleaving_ = Interleaving::kByShard;
+  size_t parallelism_ = 0;
+  uint64_t max_shard_buffered_bytes_ = 0;
+  ThreadPool* thread_pool_ = nullptr;
+
+  absl::Mutex mutex_;
+  // Signaled when records become available in some shard, a shard ends, or a
+  // background task finishes.
+  absl::CondVar changed_;
+  // The index of the next shard to make active.
+  size_t next_shard_ GUARDED_BY(mutex_) = 0;
+  // Shards being read, in the order of their indices.
+  std::deque<std::unique_ptr<Shard>> active_ GUARDED_BY(mutex_);
+  // For kRoundRobin and kFirstAvailable: the index in active_ of the shard to
+  // look at first when reading the next record.
+  size_t next_active_ GUARDED_BY(mutex_) = 0;
+  // The number of background tasks reading shards.
+  size_t num_filling_ GUARDED_BY(mutex_) = 0;
+  // Set when closing, to stop background tasks early.
+  bool closing_ GUARDED_BY(mutex_) = false;
+};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_SHARDED_RECORD_READER_H_
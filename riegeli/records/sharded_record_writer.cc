@@ -0,0 +1,182 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/sharded_record_writer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "google/protobuf/message_lite.h"
+#include "absl/base/optimization.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/object.h"
+#include "riegeli/bytes/writer.h"
+#include "riegeli/chunk_encoding/hash.h"
+#include "riegeli/records/record_writer.h"
+
+namespace riegeli {
+
+namespace {
+
+template <typename Record>
+size_t RecordSize(const Record& record) {
+  return record.size();
+}
+
+size_t RecordSize(const google::protobuf::MessageLite& record) {
+  return record.ByteSizeLong();
+}
+
+}  // namespace
+
+ShardedRecordWriter::ShardedRecordWriter() noexcept
+    : Object(State::kClosed) {}
+
+ShardedRecordWriter::ShardedRecordWriter(
+    size_t num_shards,
+    std::function<std::unique_ptr<Writer>(size_t shard, uint64_t file_index)>
+        open_file,
+    Options options)
+    : Object(State::kOpen),
+      open_file_(std::move(open_file)),
+      record_writer_options_(std::move(options.record_writer_options_)),
+      max_file_records_(options.max_file_records_),
+      max_file_bytes_(options.max_file_bytes_),
+      shards_(num_shards) {
+  RIEGELI_ASSERT_GT(num_shards, 0u)
+      << "Failed precondition of ShardedRecordWriter::ShardedRecordWriter(): "
+         "no shards";
+}
+
+ShardedRecordWriter::~ShardedRecordWriter() {}
+
+void ShardedRecordWriter::Done() {
+  for (size_t shard_index = 0; shard_index < shards_.size(); ++shard_index) {
+    RecordWriter& record_writer = shards_[shard_index].record_writer;
+    if (record_writer.closed()) continue;
+    if (ABSL_PREDICT_FALSE(!record_writer.Close())) {
+      Fail(absl::StrCat("Writing shard ", shard_index, " failed"),
+           record_writer);
+    }
+  }
+  shards_.clear();
+  next_shard_ = 0;
+}
+
+size_t ShardedRecordWriter::ShardForKey(absl::string_view shard_key) const {
+  // internal::Hash() is stable across processes, so the same key is assigned
+  // to the same shard when files are written again.
+  return IntCast<size_t>(internal::Hash(shard_key) %
+                         uint64_t{shards_.size()});
+}
+
+bool ShardedRecordWriter::OpenNextFile(size_t shard_index) {
+  Shard& shard = shards_[shard_index];
+  if (!shard.record_writer.closed()) {
+    if (ABSL_PREDICT_FALSE(!shard.record_writer.Close())) {
+      return Fail(absl::StrCat("Writing shard ", shard_index, " failed"),
+                  shard.record_writer);
+    }
+  }
+  shard.file_index = shard.next_file_index++;
+  shard.file_records = 0;
+  shard.file_bytes = 0;
+  std::unique_ptr<Writer> byte_writer =
+      open_file_(shard_index, shard.file_index);
+  if (ABSL_PREDICT_FALSE(byte_writer == nullptr)) {
+    return Fail(absl::StrCat("Opening file ", shard.file_index, " of shard ",
+                             shard_index, " failed"));
+  }
+  shard.record_writer =
+      RecordWriter(std::move(byte_writer), record_writer_options_);
+  if (ABSL_PREDICT_FALSE(!shard.record_writer.healthy())) {
+    return Fail(absl::StrCat("Writing shard ", shard_index, " failed"),
+                shard.record_writer);
+  }
+  return true;
+}
+
+template <typename Record>
+bool ShardedRecordWriter::WriteRecordImpl(size_t shard_index, Record&& record,
+                                          ShardedRecordPosition* pos) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  Shard& shard = shards_[shard_index];
+  // Computing the size of a proto message is not free, so it is skipped if
+  // files are not limited by size.
+  const uint64_t record_size =
+      max_file_bytes_ == std::numeric_limits<uint64_t>::max()
+          ? uint64_t{0}
+          : IntCast<uint64_t>(RecordSize(record));
+  if (shard.record_writer.closed() ||
+      (shard.file_records > 0 && (shard.file_records >= max_file_records_ ||
+                                  shard.file_bytes >= max_file_bytes_))) {
+    if (ABSL_PREDICT_FALSE(!OpenNextFile(shard_index))) return false;
+  }
+  if (ABSL_PREDICT_FALSE(!shard.record_writer.WriteRecord(
+          std::forward<Record>(record),
+          pos == nullptr ? nullptr : &pos->pos))) {
+    return Fail(absl::StrCat("Writing shard ", shard_index, " failed"),
+                shard.record_writer);
+  }
+  ++shard.file_records;
+  shard.file_bytes = SaturatingAdd(shard.file_bytes, record_size);
+  if (pos != nullptr) {
+    pos->shard = shard_index;
+    pos->file_index = shard.file_index;
+  }
+  return true;
+}
+
+template bool ShardedRecordWriter::WriteRecordImpl(
+    size_t shard_index, const google::protobuf::MessageLite& record,
+    ShardedRecordPosition* pos);
+template bool ShardedRecordWriter::WriteRecordImpl(
+    size_t shard_index, const absl::string_view& record,
+    ShardedRecordPosition* pos);
+template bool ShardedRecordWriter::WriteRecordImpl(size_t shard_index,
+                                                   std::string&& record,
+                                                   ShardedRecordPosition* pos);
+template bool ShardedRecordWriter::WriteRecordImpl(size_t shard_index,
+                                                   const Chain& record,
+                                                   ShardedRecordPosition* pos);
+template bool ShardedRecordWriter::WriteRecordImpl(size_t shard_index,
+                                                   Chain&& record,
+                                                   ShardedRecordPosition* pos);
+
+bool ShardedRecordWriter::Flush(FlushType flush_type) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  bool ok = true;
+  for (size_t shard_index = 0; shard_index < shards_.size(); ++shard_index) {
+    RecordWriter& record_writer = shards_[shard_index].record_writer;
+    if (record_writer.closed()) continue;
+    if (ABSL_PREDICT_FALSE(!record_writer.Flush(flush_type))) {
+      if (ABSL_PREDICT_FALSE(!record_writer.healthy())) {
+        return Fail(absl::StrCat("Writing shard ", shard_index, " failed"),
+                    record_writer);
+      }
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+}  // namespace riegeli
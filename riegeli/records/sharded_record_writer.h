@@ -0,0 +1,294 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_SHARDED_RECORD_WRITER_H_
+#define RIEGELI_RECORDS_SHARDED_RECORD_WRITER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/object.h"
+#include "riegeli/bytes/writer.h"
+#include "riegeli/records/record_writer.h"
+
+namespace google {
+namespace protobuf {
+class MessageLite;
+}  // namespace protobuf
+}  // namespace google
+
+namespace riegeli {
+
+// The position of a record written by ShardedRecordWriter: the shard, the file
+// of the shard, and the position of the record in that file.
+struct ShardedRecordPosition {
+  size_t shard = 0;
+  uint64_t file_index = 0;
+  FutureRecordPosition pos;
+};
+
+// ShardedRecordWriter distributes records between several Riegeli/records
+// files (shards), each written by its own RecordWriter. Records are assigned
+// to shards round-robin, or by a hash of a key.
+//
+// Each shard writes a sequence of files. A shard rotates to its next file when
+// the current file reaches a limit on the number or the total size of records,
+// see Options::set_max_file_records() and Options::set_max_file_bytes().
+//
+// With RecordWriter::Options::set_parallelism() > 0, shards encode and write
+// chunks in the background on the thread pool of their RecordWriter::Options,
+// so a single thread writing records can keep several destinations busy.
+class ShardedRecordWriter final : public Object {
+ public:
+  class Options {
+   public:
+    // Not defaulted because of a C++ defect:
+    // https://stackoverflow.com/questions/17430377
+    Options() noexcept {}
+
+    // Options for RecordWriters of shards. They share the thread pool
+    // specified there.
+    //
+    // Default: RecordWriter::Options()
+    Options& set_record_writer_options(
+        RecordWriter::Options record_writer_options) & {
+      record_writer_options_ = std::move(record_writer_options);
+      return *this;
+    }
+    Options&& set_record_writer_options(
+        RecordWriter::Options record_writer_options) && {
+      return std::move(
+          set_record_writer_options(std::move(record_writer_options)));
+    }
+
+    // Sets the maximum number of records in one file. A shard rotates to its
+    // next file before writing a record which would exceed this.
+    //
+    // Default: no limit
+    Options& set_max_file_records(uint64_t max_file_records) & {
+      RIEGELI_ASSERT_GT(max_file_records, 0u)
+          << "Failed precondition of "
+             "ShardedRecordWriter::Options::set_max_file_records(): "
+             "zero records";
+      max_file_records_ = max_file_records;
+      return *this;
+    }
+    Options&& set_max_file_records(uint64_t max_file_records) && {
+      return std::move(set_max_file_records(max_file_records));
+    }
+
+    // Sets the desired total size of records in one file, before compression.
+    // A shard rotates to its next file before writing a record if the current
+    // file already reached this size.
+    //
+    // Default: no limit
+    Options& set_max_file_bytes(uint64_t max_file_bytes) & {
+      max_file_bytes_ = max_file_bytes;
+      return *this;
+    }
+    Options&& set_max_file_bytes(uint64_t max_file_bytes) && {
+      return std::move(set_max_file_bytes(max_file_bytes));
+    }
+
+   private:
+    friend class ShardedRecordWriter;
+
+    RecordWriter::Options record_writer_options_;
+    uint64_t max_file_records_ = std::numeric_limits<uint64_t>::max();
+    uint64_t max_file_bytes_ = std::numeric_limits<uint64_t>::max();
+  };
+
+  // Creates a closed ShardedRecordWriter.
+  ShardedRecordWriter() noexcept;
+
+  // Will write records to num_shards shards. open_file(shard, file_index)
+  // returns the byte Writer of the given file of the given shard, or nullptr on
+  // failure. Files of a shard are numbered from 0, and a file is opened when
+  // the first record is written to it.
+  //
+  // Precondition: num_shards > 0
+  ShardedRecordWriter(
+      size_t num_shards,
+      std::function<std::unique_ptr<Writer>(size_t shard, uint64_t file_index)>
+          open_file,
+      Options options = Options());
+
+  ShardedRecordWriter(const ShardedRecordWriter&) = delete;
+  ShardedRecordWriter& operator=(const ShardedRecordWriter&) = delete;
+
+  ~ShardedRecordWriter();
+
+  // Writes the next record to the next shard in round-robin order.
+  //
+  // WriteRecord(MessageLite) serializes a proto message to raw bytes
+  // beforehand. The remaining overloads accept raw bytes.
+  //
+  // If pos != nullptr, *pos is set to the position of the record on success.
+  //
+  // Return values:
+  //  * true  - success (healthy())
+  //  * false - failure (!healthy())
+  bool WriteRecord(const google::protobuf::MessageLite& record,
+                   ShardedRecordPosition* pos = nullptr);
+  bool WriteRecord(absl::string_view record,
+                   ShardedRecordPosition* pos = nullptr);
+  bool WriteRecord(std::string&& record, ShardedRecordPosition* pos = nullptr);
+  bool WriteRecord(const char* record, ShardedRecordPosition* pos = nullptr);
+  bool WriteRecord(const Chain& record, ShardedRecordPosition* pos = nullptr);
+  bool WriteRecord(Chain&& record, ShardedRecordPosition* pos = nullptr);
+
+  // Writes the next record to the shard selected by a hash of shard_key.
+  // Records with the same key are written to the same shard, in the order of
+  // writing them.
+  //
+  // Return values are the same as for WriteRecord().
+  bool WriteRecordWithKey(absl::string_view shard_key,
+                          const google::protobuf::MessageLite& record,
+                          ShardedRecordPosition* pos = nullptr);
+  bool WriteRecordWithKey(absl::string_view shard_key,
+                          absl::string_view record,
+                          ShardedRecordPosition* pos = nullptr);
+  bool WriteRecordWithKey(absl::string_view shard_key, std::string&& record,
+                          ShardedRecordPosition* pos = nullptr);
+  bool WriteRecordWithKey(absl::string_view shard_key, const char* record,
+                          ShardedRecordPosition* pos = nullptr);
+  bool WriteRecordWithKey(absl::string_view shard_key, const Chain& record,
+                          ShardedRecordPosition* pos = nullptr);
+  bool WriteRecordWithKey(absl::string_view shard_key, Chain&& record,
+                          ShardedRecordPosition* pos = nullptr);
+
+  // Flushes all files being written, as RecordWriter::Flush() does.
+  //
+  // Return values:
+  //  * true                    - success (pushed and synced, healthy())
+  //  * false (when healthy())  - failure to sync
+  //  * false (when !healthy()) - failure to push
+  bool Flush(FlushType flush_type);
+
+ protected:
+  void Done() override;
+
+ private:
+  struct Shard {
+    // The index of the current file, valid if record_writer is open.
+    uint64_t file_index = 0;
+    // The index of the next file to open.
+    uint64_t next_file_index = 0;
+    // The number and the total size of records written to the current file.
+    uint64_t file_records = 0;
+    uint64_t file_bytes = 0;
+    // Closed before opening the first file.
+    RecordWriter record_writer;
+  };
+
+  // Returns the shard for the next record written with WriteRecord(), and
+  // advances next_shard_.
+  size_t NextShard();
+
+  size_t ShardForKey(absl::string_view shard_key) const;
+
+  // Closes the current file of the shard, if any, and opens its next file.
+  bool OpenNextFile(size_t shard_index);
+
+  template <typename Record>
+  bool WriteRecordImpl(size_t shard_index, Record&& record,
+                       ShardedRecordPosition* pos);
+
+  std::function<std::unique_ptr<Writer>(size_t shard, uint64_t file_index)>
+      open_file_;
+  RecordWriter::Options record_writer_options_;
+  uint64_t max_file_records_ = 0;
+  uint64_t max_file_bytes_ = 0;
+  std::vector<Shard> shards_;
+  // The shard for the next record written with WriteRecord().
+  size_t next_shard_ = 0;
+};
+
+// Implementation details follow.
+
+inline size_t ShardedRecordWriter::NextShard() {
+  const size_t shard_index = next_shard_;
+  next_shard_ = shard_index + 1 == shards_.size() ? size_t{0} : shard_index + 1;
+  return shard_index;
+}
+
+inline bool ShardedRecordWriter::WriteRecord(
+    const google::protobuf::MessageLite& record, ShardedRecordPosition* pos) {
+  return WriteRecordImpl(NextShard(), record, pos);
+}
+inline bool ShardedRecordWriter::WriteRecord(absl::string_view record,
+                                             ShardedRecordPosition* pos) {
+  return WriteRecordImpl<const absl::string_view&>(NextShard(), record, pos);
+}
+inline bool ShardedRecordWriter::WriteRecord(std::string&& record,
+                                             ShardedRecordPosition* pos) {
+  return WriteRecordImpl(NextShard(), std::move(record), pos);
+}
+inline bool ShardedRecordWriter::WriteRecord(const char* record,
+                                             ShardedRecordPosition* pos) {
+  return WriteRecordImpl<const absl::string_view&>(NextShard(), record, pos);
+}
+inline bool ShardedRecordWriter::WriteRecord(const Chain& record,
+                                             ShardedRecordPosition* pos) {
+  return WriteRecordImpl(NextShard(), record, pos);
+}
+inline bool ShardedRecordWriter::WriteRecord(Chain&& record,
+                                             ShardedRecordPosition* pos) {
+  return WriteRecordImpl(NextShard(), std::move(record), pos);
+}
+
+inline bool ShardedRecordWriter::WriteRecordWithKey(
+    absl::string_view shard_key, const google::protobuf::MessageLite& record,
+    ShardedRecordPosition* pos) {
+  return WriteRecordImpl(ShardForKey(shard_key), record, pos);
+}
+inline bool ShardedRecordWriter::WriteRecordWithKey(
+    absl::string_view shard_key, absl::string_view record,
+    ShardedRecordPosition* pos) {
+  return WriteRecordImpl<const absl::string_view&>(ShardForKey(shard_key),
+                                                   record, pos);
+}
+inline bool ShardedRecordWriter::WriteRecordWithKey(
+    absl::string_view shard_key, std::string&& record,
+    ShardedRecordPosition* pos) {
+  return WriteRecordImpl(ShardForKey(shard_key), std::move(record), pos);
+}
+inline bool ShardedRecordWriter::WriteRecordWithKey(
+    absl::string_view shard_key, const char* record,
+    ShardedRecordPosition* pos) {
+  return WriteRecordImpl<const absl::string_view&>(ShardForKey(shard_key),
+                                                   record, pos);
+}
+inline bool ShardedRecordWriter::WriteRecordWithKey(
+    absl::string_view shard_key, const Chain& record,
+    ShardedRecordPosition* pos) {
+  return WriteRecordImpl(ShardForKey(shard_key), record, pos);
+}
+inline bool ShardedRecordWriter::WriteRecordWithKey(
+    absl::string_view shard_key, Chain&& record, ShardedRecordPosition* pos) {
+  return WriteRecordImpl(ShardForKey(shard_key), std::move(record), pos);
+}
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_SHARDED_RECORD_WRITER_H_
@@ -0,0 +1,227 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/shuffled_record_reader.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <cmath>
+#include <future>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "google/protobuf/message_lite.h"
+#include "absl/base/optimization.h"
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/object.h"
+#include "riegeli/base/parallelism.h"
+#include "riegeli/bytes/reader.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/chunk_decoder.h"
+#include "riegeli/records/chunk_reader.h"
+
+namespace riegeli {
+
+namespace {
+
+// A chunk passed to a background task, owned by the task.
+struct ChunkToDecode {
+  ChunkDecoder::Options chunk_decoder_options;
+  Chunk chunk;
+  std::promise<ChunkDecoder> chunk_decoder;
+};
+
+}  // namespace
+
+ShuffledRecordReader::ShuffledRecordReader(std::unique_ptr<Reader> byte_reader,
+                                           Options options)
+    : ShuffledRecordReader(
+          absl::make_unique<ChunkReader>(std::move(byte_reader)),
+          std::move(options)) {}
+
+ShuffledRecordReader::ShuffledRecordReader(Reader* byte_reader,
+                                           Options options)
+    : ShuffledRecordReader(absl::make_unique<ChunkReader>(byte_reader),
+                           std::move(options)) {}
+
+ShuffledRecordReader::ShuffledRecordReader(
+    std::unique_ptr<ChunkReader> chunk_reader, Options options)
+    : Object(State::kOpen),
+      chunk_reader_(std::move(chunk_reader)),
+      shuffle_buffer_size_(options.shuffle_buffer_size_),
+      parallelism_(IntCast<size_t>(options.parallelism_)),
+      thread_pool_(options.thread_pool_),
+      chunk_decoder_options_(std::move(options.chunk_decoder_options_)),
+      random_(options.seed_),
+      chunk_decoder_(chunk_decoder_options_) {
+  if (ABSL_PREDICT_FALSE(!ListChunks(options.sample_fraction_))) return;
+  shuffle_buffer_.reserve(shuffle_buffer_size_);
+}
+
+ShuffledRecordReader::ShuffledRecordReader(ShuffledRecordReader&& src) noexcept
+    : Object(std::move(src)),
+      chunk_reader_(std::move(src.chunk_reader_)),
+      shuffle_buffer_size_(riegeli::exchange(src.shuffle_buffer_size_, 0)),
+      parallelism_(riegeli::exchange(src.parallelism_, 0)),
+      thread_pool_(riegeli::exchange(src.thread_pool_, nullptr)),
+      chunk_decoder_options_(std::move(src.chunk_decoder_options_)),
+      random_(std::move(src.random_)),
+      chunks_(riegeli::exchange(src.chunks_, std::vector<Position>())),
+      next_chunk_(riegeli::exchange(src.next_chunk_, 0)),
+      decoding_chunks_(std::move(src.decoding_chunks_)),
+      chunk_decoder_(std::move(src.chunk_decoder_)),
+      shuffle_buffer_(
+          riegeli::exchange(src.shuffle_buffer_, std::vector<std::string>())) {}
+
+ShuffledRecordReader& ShuffledRecordReader::operator=(
+    ShuffledRecordReader&& src) noexcept {
+  Object::operator=(std::move(src));
+  chunk_reader_ = std::move(src.chunk_reader_);
+  shuffle_buffer_size_ = riegeli::exchange(src.shuffle_buffer_size_, 0);
+  parallelism_ = riegeli::exchange(src.parallelism_, 0);
+  thread_pool_ = riegeli::exchange(src.thread_pool_, nullptr);
+  chunk_decoder_options_ = std::move(src.chunk_decoder_options_);
+  random_ = std::move(src.random_);
+  chunks_ = riegeli::exchange(src.chunks_, std::vector<Position>());
+  next_chunk_ = riegeli::exchange(src.next_chunk_, 0);
+  decoding_chunks_ = std::move(src.decoding_chunks_);
+  chunk_decoder_ = std::move(src.chunk_decoder_);
+  shuffle_buffer_ =
+      riegeli::exchange(src.shuffle_buffer_, std::vector<std::string>());
+  return *this;
+}
+
+void ShuffledRecordReader::Done() {
+  // Background tasks own their chunks, so pending results can be abandoned.
+  decoding_chunks_.clear();
+  if (chunk_reader_ != nullptr) {
+    if (ABSL_PREDICT_TRUE(healthy())) {
+      if (ABSL_PREDICT_FALSE(!chunk_reader_->Close())) Fail(*chunk_reader_);
+    }
+  }
+  chunks_ = std::vector<Position>();
+  next_chunk_ = 0;
+  chunk_decoder_.Reset();
+  shuffle_buffer_ = std::vector<std::string>();
+}
+
+bool ShuffledRecordReader::ListChunks(double sample_fraction) {
+  if (ABSL_PREDICT_FALSE(!chunk_reader_->CheckFileFormat())) {
+    if (chunk_reader_->healthy()) return true;
+    return Fail(*chunk_reader_);
+  }
+  // Only chunk headers are read, and chunk data are skipped by seeking.
+  ChunkHeader chunk_header;
+  Position chunk_begin;
+  while (chunk_reader_->SkipChunk(&chunk_header, &chunk_begin)) {
+    if (chunk_header.num_records() > 0) chunks_.push_back(chunk_begin);
+  }
+  if (ABSL_PREDICT_FALSE(!chunk_reader_->healthy())) {
+    return Fail(*chunk_reader_);
+  }
+  std::shuffle(chunks_.begin(), chunks_.end(), random_);
+  if (sample_fraction < 1.0) {
+    chunks_.resize(static_cast<size_t>(std::ceil(
+        static_cast<double>(chunks_.size()) * sample_fraction)));
+    chunks_.shrink_to_fit();
+  }
+  return true;
+}
+
+bool ShuffledRecordReader::ReadChunksAhead() {
+  while (decoding_chunks_.size() < parallelism_ &&
+         next_chunk_ < chunks_.size()) {
+    const Position chunk_begin = chunks_[next_chunk_++];
+    ChunkToDecode* const chunk_to_decode = new ChunkToDecode();
+    chunk_to_decode->chunk_decoder_options = chunk_decoder_options_;
+    if (ABSL_PREDICT_FALSE(
+            !chunk_reader_->Seek(chunk_begin) ||
+            !chunk_reader_->ReadChunk(&chunk_to_decode->chunk))) {
+      delete chunk_to_decode;
+      if (!chunk_reader_->healthy()) return Fail(*chunk_reader_);
+      return Fail(absl::StrCat("Chunk at ", chunk_begin, " disappeared"));
+    }
+    decoding_chunks_.push_back(chunk_to_decode->chunk_decoder.get_future());
+    ThreadPool& thread_pool = thread_pool_ != nullptr
+                                  ? *thread_pool_
+                                  : internal::DefaultThreadPool();
+    thread_pool.Schedule([chunk_to_decode] {
+      ChunkDecoder chunk_decoder(chunk_to_decode->chunk_decoder_options);
+      chunk_decoder.Reset(chunk_to_decode->chunk);
+      chunk_to_decode->chunk_decoder.set_value(std::move(chunk_decoder));
+      delete chunk_to_decode;
+    });
+  }
+  return true;
+}
+
+bool ShuffledRecordReader::FillShuffleBuffer() {
+  while (shuffle_buffer_.size() < shuffle_buffer_size_) {
+    std::string record;
+    if (chunk_decoder_.ReadRecord(&record)) {
+      shuffle_buffer_.push_back(std::move(record));
+      continue;
+    }
+    if (ABSL_PREDICT_FALSE(!chunk_decoder_.healthy())) {
+      return Fail(chunk_decoder_);
+    }
+    if (ABSL_PREDICT_FALSE(!ReadChunksAhead())) return false;
+    if (decoding_chunks_.empty()) return true;
+    chunk_decoder_ = decoding_chunks_.front().get();
+    decoding_chunks_.pop_front();
+    if (ABSL_PREDICT_FALSE(!chunk_decoder_.healthy())) {
+      return Fail(chunk_decoder_);
+    }
+    // Keep the next chunks being decoded while records of this one are used.
+    if (ABSL_PREDICT_FALSE(!ReadChunksAhead())) return false;
+  }
+  return true;
+}
+
+bool ShuffledRecordReader::ReadRecord(std::string* record) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(!FillShuffleBuffer())) return false;
+  if (shuffle_buffer_.empty()) return false;
+  const size_t index = std::uniform_int_distribution<size_t>(
+      0, shuffle_buffer_.size() - 1)(random_);
+  using std::swap;
+  swap(shuffle_buffer_[index], shuffle_buffer_.back());
+  *record = std::move(shuffle_buffer_.back());
+  shuffle_buffer_.pop_back();
+  return true;
+}
+
+bool ShuffledRecordReader::ReadRecord(google::protobuf::MessageLite* record) {
+  std::string serialized;
+  if (ABSL_PREDICT_FALSE(!ReadRecord(&serialized))) return false;
+  if (ABSL_PREDICT_FALSE(!record->ParsePartialFromString(serialized))) {
+    return Fail(absl::StrCat("Failed to parse message of type ",
+                             record->GetTypeName()));
+  }
+  if (ABSL_PREDICT_FALSE(!record->IsInitialized())) {
+    return Fail(absl::StrCat("Failed to parse message of type ",
+                             record->GetTypeName(),
+                             " because it is missing required fields: ",
+                             record->InitializationErrorString()));
+  }
+  return true;
+}
+
+}  // namespace riegeli
@@ -0,0 +1,255 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_SHUFFLED_RECORD_READER_H_
+#define RIEGELI_RECORDS_SHUFFLED_RECORD_READER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <future>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "riegeli/base/base.h"
+#include "riegeli/base/object.h"
+#include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/zstd_dictionary.h"
+#include "riegeli/chunk_encoding/chunk_decoder.h"
+#include "riegeli/chunk_encoding/field_filter.h"
+#include "riegeli/records/chunk_reader.h"
+
+namespace google {
+namespace protobuf {
+class MessageLite;
+}  // namespace protobuf
+}  // namespace google
+
+namespace riegeli {
+
+class ThreadPool;
+
+// ShuffledRecordReader reads records of a Riegeli/records file in a random
+// order, e.g. for input pipelines of training.
+//
+// Chunks containing records are listed by reading chunk headers, skipping over
+// chunk data. Chunks are then read in a random permutation and decoded
+// concurrently in the background, and their records are mixed by a shuffle
+// buffer: each record returned is picked at random from the buffer, which is
+// refilled from decoded chunks.
+//
+// The order is not a uniform permutation of all records: records of one chunk
+// stay close together unless the shuffle buffer is larger than a few chunks.
+//
+// With Options::set_sample_fraction(), only a random subset of chunks is read,
+// which samples records at the cost of reading only that fraction of the file.
+class ShuffledRecordReader final : public Object {
+ public:
+  class Options {
+   public:
+    // Not defaulted because of a C++ defect:
+    // https://stackoverflow.com/questions/17430377
+    Options() noexcept {}
+
+    // Sets the seed of the random order. The same seed gives the same order
+    // for the same file and options.
+    //
+    // Default: 0
+    Options& set_seed(uint64_t seed) & {
+      seed_ = seed;
+      return *this;
+    }
+    Options&& set_seed(uint64_t seed) && { return std::move(set_seed(seed)); }
+
+    // Sets the number of records in the shuffle buffer. A larger buffer mixes
+    // records of more chunks.
+    //
+    // Default: 10000
+    Options& set_shuffle_buffer_size(size_t shuffle_buffer_size) & {
+      RIEGELI_ASSERT_GT(shuffle_buffer_size, 0u)
+          << "Failed precondition of "
+             "ShuffledRecordReader::Options::set_shuffle_buffer_size(): "
+             "zero buffer size";
+      shuffle_buffer_size_ = shuffle_buffer_size;
+      return *this;
+    }
+    Options&& set_shuffle_buffer_size(size_t shuffle_buffer_size) && {
+      return std::move(set_shuffle_buffer_size(shuffle_buffer_size));
+    }
+
+    // Sets the fraction of chunks to read, chosen at random. The number of
+    // chunks read is rounded up, so that at least one chunk is read from a
+    // file with records.
+    //
+    // Default: 1.0
+    Options& set_sample_fraction(double sample_fraction) & {
+      RIEGELI_ASSERT(sample_fraction > 0.0 && sample_fraction <= 1.0)
+          << "Failed precondition of "
+             "ShuffledRecordReader::Options::set_sample_fraction(): "
+             "fraction out of range";
+      sample_fraction_ = sample_fraction;
+      return *this;
+    }
+    Options&& set_sample_fraction(double sample_fraction) && {
+      return std::move(set_sample_fraction(sample_fraction));
+    }
+
+    // Sets the maximum number of chunks being decoded in the background.
+    //
+    // Default: 8
+    Options& set_parallelism(int parallelism) & {
+      RIEGELI_ASSERT_GT(parallelism, 0)
+          << "Failed precondition of "
+             "ShuffledRecordReader::Options::set_parallelism(): "
+             "non-positive parallelism";
+      parallelism_ = parallelism;
+      return *this;
+    }
+    Options&& set_parallelism(int parallelism) && {
+      return std::move(set_parallelism(parallelism));
+    }
+
+    // Specifies the thread pool decoding chunks in the background. The thread
+    // pool must be kept alive until the ShuffledRecordReader is closed.
+    //
+    // If nullptr, a thread pool shared by the process is used.
+    //
+    // Default: nullptr
+    Options& set_thread_pool(ThreadPool* thread_pool) & {
+      thread_pool_ = thread_pool;
+      return *this;
+    }
+    Options&& set_thread_pool(ThreadPool* thread_pool) && {
+      return std::move(set_thread_pool(thread_pool));
+    }
+
+    // Specifies the set of fields to be included in returned records, like
+    // RecordReader::Options::set_field_filter().
+    //
+    // Default: FieldFilter::All()
+    Options& set_field_filter(FieldFilter field_filter) & {
+      chunk_decoder_options_.set_field_filter(std::move(field_filter));
+      return *this;
+    }
+    Options&& set_field_filter(FieldFilter field_filter) && {
+      return std::move(set_field_filter(std::move(field_filter)));
+    }
+
+    // Specifies Zstd dictionaries used to decompress chunks, like
+    // RecordReader::Options::set_zstd_dictionaries(). The registry must be
+    // kept alive until the ShuffledRecordReader is closed.
+    //
+    // Default: nullptr
+    Options& set_zstd_dictionaries(
+        const ZstdDictionaryRegistry* zstd_dictionaries) & {
+      chunk_decoder_options_.set_zstd_dictionaries(zstd_dictionaries);
+      return *this;
+    }
+    Options&& set_zstd_dictionaries(
+        const ZstdDictionaryRegistry* zstd_dictionaries) && {
+      return std::move(set_zstd_dictionaries(zstd_dictionaries));
+    }
+
+   private:
+    friend class ShuffledRecordReader;
+
+    uint64_t seed_ = 0;
+    size_t shuffle_buffer_size_ = 10000;
+    double sample_fraction_ = 1.0;
+    int parallelism_ = 8;
+    ThreadPool* thread_pool_ = nullptr;
+    ChunkDecoder::Options chunk_decoder_options_;
+  };
+
+  // Creates a closed ShuffledRecordReader.
+  ShuffledRecordReader() noexcept : Object(State::kClosed) {}
+
+  // Will read records from the byte Reader which is owned by this
+  // ShuffledRecordReader and will be closed and deleted when the
+  // ShuffledRecordReader is closed.
+  //
+  // The byte Reader should support random access.
+  explicit ShuffledRecordReader(std::unique_ptr<Reader> byte_reader,
+                                Options options = Options());
+
+  // Will read records from the byte Reader which is not owned by this
+  // ShuffledRecordReader and must be kept alive but not accessed until closing
+  // the ShuffledRecordReader.
+  //
+  // The byte Reader should support random access.
+  explicit ShuffledRecordReader(Reader* byte_reader,
+                                Options options = Options());
+
+  ShuffledRecordReader(const ShuffledRecordReader&) = delete;
+  ShuffledRecordReader& operator=(const ShuffledRecordReader&) = delete;
+
+  ShuffledRecordReader(ShuffledRecordReader&& src) noexcept;
+  ShuffledRecordReader& operator=(ShuffledRecordReader&& src) noexcept;
+
+  // Reads the next record in the random order.
+  //
+  // ReadRecord(MessageLite*) parses raw bytes to a proto message after reading.
+  //
+  // Return values:
+  //  * true                    - success (*record is set)
+  //  * false (when healthy())  - all records have been read
+  //  * false (when !healthy()) - failure
+  bool ReadRecord(google::protobuf::MessageLite* record);
+  bool ReadRecord(std::string* record);
+
+  // Returns the number of chunks which will be read, after sampling.
+  size_t num_chunks() const { return chunks_.size(); }
+
+ protected:
+  void Done() override;
+
+ private:
+  ShuffledRecordReader(std::unique_ptr<ChunkReader> chunk_reader,
+                       Options options);
+
+  // Lists beginnings of chunks with records into chunks_, and shuffles and
+  // samples them.
+  bool ListChunks(double sample_fraction);
+
+  // Reads chunks of chunks_ and schedules decoding them in the background,
+  // until parallelism_ chunks are pending or all chunks have been read.
+  bool ReadChunksAhead();
+
+  // Moves records to shuffle_buffer_ until it is full or all chunks have been
+  // consumed.
+  bool FillShuffleBuffer();
+
+  std::unique_ptr<ChunkReader> chunk_reader_;
+  size_t shuffle_buffer_size_ = 0;
+  size_t parallelism_ = 0;
+  ThreadPool* thread_pool_ = nullptr;
+  ChunkDecoder::Options chunk_decoder_options_;
+  std::mt19937_64 random_;
+  // Beginnings of chunks to read, in the order of reading.
+  std::vector<Position> chunks_;
+  // The index in chunks_ of the next chunk to read.
+  size_t next_chunk_ = 0;
+  // Chunks being decoded in the background, in the order of chunks_.
+  std::deque<std::future<ChunkDecoder>> decoding_chunks_;
+  // The chunk whose records are being moved to shuffle_buffer_.
+  ChunkDecoder chunk_decoder_;
+  std::vector<std::string> shuffle_buffer_;
+};
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_SHUFFLED_RECORD_READER_H_
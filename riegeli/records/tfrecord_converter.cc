@@ -0,0 +1,62 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/tfrecord_converter.h"
+
+#include <stddef.h>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/records/record_writer.h"
+#include "riegeli/records/tfrecord_reader.h"
+
+namespace riegeli {
+
+namespace {
+
+// Records are passed to RecordWriter::WriteRecords() in batches of about this
+// size, which amortizes the call while keeping the batch small compared to a
+// chunk.
+constexpr size_t kBatchSize = size_t{64} << 10;
+
+}  // namespace
+
+bool CopyTFRecords(TFRecordReader* src, RecordWriter* dest) {
+  Chain record;
+  Chain values;
+  std::vector<size_t> limits;
+  for (;;) {
+    const bool have_record = src->ReadRecord(&record);
+    if (have_record) {
+      values.Append(std::move(record));
+      limits.push_back(values.size());
+      if (values.size() < kBatchSize) continue;
+    } else if (ABSL_PREDICT_FALSE(!src->healthy())) {
+      return false;
+    }
+    if (!limits.empty()) {
+      if (ABSL_PREDICT_FALSE(
+              !dest->WriteRecords(std::move(values), std::move(limits)))) {
+        return false;
+      }
+      values = Chain();
+      limits = std::vector<size_t>();
+    }
+    if (!have_record) return true;
+  }
+}
+
+}  // namespace riegeli
@@ -0,0 +1,39 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_TFRECORD_CONVERTER_H_
+#define RIEGELI_RECORDS_TFRECORD_CONVERTER_H_
+
+#include "riegeli/records/record_writer.h"
+#include "riegeli/records/tfrecord_reader.h"
+
+namespace riegeli {
+
+// Copies all remaining records from a TFRecord file to a Riegeli/records file.
+//
+// Records are read in batches and written with RecordWriter::WriteRecords().
+// With RecordWriter::Options::set_parallelism() > 0, chunks are encoded in the
+// background while further records are read, so the conversion is limited by
+// reading and checksumming the TFRecord file rather than by encoding.
+//
+// Neither src nor dest is closed.
+//
+// Return values:
+//  * true  - success (src ends, dest->healthy())
+//  * false - failure (!src->healthy() or !dest->healthy())
+bool CopyTFRecords(TFRecordReader* src, RecordWriter* dest);
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_TFRECORD_CONVERTER_H_
@@ -0,0 +1,148 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/tfrecord_reader.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <limits>
+#include <memory>
+#include <string>
+
+#include "absl/base/optimization.h"
+#include "absl/memory/memory.h"
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/crc32c.h"
+#include "riegeli/base/endian.h"
+#include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/zlib_reader.h"
+
+namespace riegeli {
+
+namespace {
+
+size_t MaxRecordSize(const std::string& record) { return record.max_size(); }
+
+size_t MaxRecordSize(const Chain& record) {
+  return std::numeric_limits<size_t>::max();
+}
+
+void ClearRecord(std::string* record) { record->clear(); }
+
+void ClearRecord(Chain* record) { record->Clear(); }
+
+uint32_t DataCrc(const std::string& data) { return Crc32c(data); }
+
+uint32_t DataCrc(const Chain& data) {
+  uint32_t crc = 0;
+  for (const absl::string_view fragment : data.blocks()) {
+    crc = Crc32cExtend(crc, fragment);
+  }
+  return crc;
+}
+
+}  // namespace
+
+TFRecordReader::TFRecordReader(Reader* src, Options options)
+    : Object(State::kOpen),
+      reader_(RIEGELI_ASSERT_NOTNULL(src)),
+      verify_checksums_(options.verify_checksums_) {
+  if (options.compression_ == Compression::kZlib) {
+    decompressor_ = absl::make_unique<ZLibReader>(src);
+    reader_ = decompressor_.get();
+  }
+}
+
+void TFRecordReader::Done() {
+  if (decompressor_ != nullptr) {
+    if (ABSL_PREDICT_TRUE(healthy())) {
+      if (ABSL_PREDICT_FALSE(!decompressor_->Close())) Fail(*decompressor_);
+    }
+    decompressor_.reset();
+  }
+  if (owned_src_ != nullptr) {
+    if (ABSL_PREDICT_TRUE(healthy())) {
+      if (ABSL_PREDICT_FALSE(!owned_src_->Close())) Fail(*owned_src_);
+    }
+    owned_src_.reset();
+  }
+  reader_ = nullptr;
+}
+
+inline bool TFRecordReader::ReadHeader(uint64_t* length) {
+  if (ABSL_PREDICT_FALSE(!reader_->Pull())) {
+    if (ABSL_PREDICT_FALSE(!reader_->healthy())) return Fail(*reader_);
+    return false;
+  }
+  uint64_t length_word;
+  uint32_t masked_crc;
+  if (ABSL_PREDICT_FALSE(!reader_->Read(reinterpret_cast<char*>(&length_word),
+                                        sizeof(length_word))) ||
+      ABSL_PREDICT_FALSE(!reader_->Read(reinterpret_cast<char*>(&masked_crc),
+                                        sizeof(masked_crc)))) {
+    if (reader_->healthy()) return Fail("Truncated TFRecord file");
+    return Fail(*reader_);
+  }
+  if (ABSL_PREDICT_FALSE(
+          UnmaskCrc32c(ReadLittleEndian32(masked_crc)) !=
+          Crc32c(absl::string_view(reinterpret_cast<const char*>(&length_word),
+                                   sizeof(length_word))))) {
+    return Fail("Corrupted TFRecord file: record length checksum mismatch");
+  }
+  *length = ReadLittleEndian64(length_word);
+  return true;
+}
+
+inline bool TFRecordReader::ReadFooter(uint32_t data_crc) {
+  uint32_t masked_crc;
+  if (ABSL_PREDICT_FALSE(!reader_->Read(reinterpret_cast<char*>(&masked_crc),
+                                        sizeof(masked_crc)))) {
+    if (reader_->healthy()) return Fail("Truncated TFRecord file");
+    return Fail(*reader_);
+  }
+  if (verify_checksums_ &&
+      ABSL_PREDICT_FALSE(UnmaskCrc32c(ReadLittleEndian32(masked_crc)) !=
+                         data_crc)) {
+    return Fail("Corrupted TFRecord file: record data checksum mismatch");
+  }
+  return true;
+}
+
+template <typename Dest>
+inline bool TFRecordReader::ReadRecordImpl(Dest* record) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  uint64_t length;
+  if (ABSL_PREDICT_FALSE(!ReadHeader(&length))) return false;
+  if (ABSL_PREDICT_FALSE(length > MaxRecordSize(*record))) {
+    return Fail("TFRecord too large");
+  }
+  ClearRecord(record);
+  if (ABSL_PREDICT_FALSE(!reader_->Read(record, IntCast<size_t>(length)))) {
+    if (reader_->healthy()) return Fail("Truncated TFRecord file");
+    return Fail(*reader_);
+  }
+  return ReadFooter(verify_checksums_ ? DataCrc(*record) : uint32_t{0});
+}
+
+bool TFRecordReader::ReadRecord(std::string* record) {
+  return ReadRecordImpl(record);
+}
+
+bool TFRecordReader::ReadRecord(Chain* record) {
+  return ReadRecordImpl(record);
+}
+
+}  // namespace riegeli
@@ -0,0 +1,169 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_TFRECORD_READER_H_
+#define RIEGELI_RECORDS_TFRECORD_READER_H_
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/object.h"
+#include "riegeli/bytes/reader.h"
+#include "riegeli/bytes/zlib_reader.h"
+
+namespace riegeli {
+
+// Reads records of a TFRecord file, the format of tensorflow::io::RecordWriter,
+// without depending on TensorFlow. This is meant for migrating TFRecord files
+// to Riegeli/records, see CopyTFRecords().
+//
+// A TFRecord file is a sequence of records, each stored as:
+//  * length       - uint64 little endian
+//  * length CRC   - masked CRC-32C of length, uint32 little endian
+//  * data         - length bytes
+//  * data CRC     - masked CRC-32C of data, uint32 little endian
+//
+// The whole file may be compressed with zlib or gzip.
+class TFRecordReader final : public Object {
+ public:
+  enum class Compression {
+    kNone,  // uncompressed
+    kZlib,  // zlib or gzip, detected automatically
+  };
+
+  class Options {
+   public:
+    // Not defaulted because of a C++ defect:
+    // https://stackoverflow.com/questions/17430377
+    Options() noexcept {}
+
+    // Specifies how the file is compressed.
+    //
+    // Default: Compression::kNone
+    Options& set_compression(Compression compression) & {
+      compression_ = compression;
+      return *this;
+    }
+    Options&& set_compression(Compression compression) && {
+      return std::move(set_compression(compression));
+    }
+
+    // If true, checksums of lengths and data are verified, and a mismatch
+    // fails reading. If false, only checksums of lengths are verified, which
+    // is faster but does not detect corruption of data.
+    //
+    // Default: true
+    Options& set_verify_checksums(bool verify_checksums) & {
+      verify_checksums_ = verify_checksums;
+      return *this;
+    }
+    Options&& set_verify_checksums(bool verify_checksums) && {
+      return std::move(set_verify_checksums(verify_checksums));
+    }
+
+   private:
+    friend class TFRecordReader;
+
+    Compression compression_ = Compression::kNone;
+    bool verify_checksums_ = true;
+  };
+
+  // Creates a closed TFRecordReader.
+  TFRecordReader() noexcept : Object(State::kClosed) {}
+
+  // Will read from the byte Reader which is owned by this TFRecordReader and
+  // will be closed and deleted when the TFRecordReader is closed.
+  explicit TFRecordReader(std::unique_ptr<Reader> src,
+                          Options options = Options());
+
+  // Will read from the byte Reader which is not owned by this TFRecordReader
+  // and must be kept alive but not accessed until closing the TFRecordReader.
+  explicit TFRecordReader(Reader* src, Options options = Options());
+
+  TFRecordReader(TFRecordReader&& src) noexcept;
+  TFRecordReader& operator=(TFRecordReader&& src) noexcept;
+
+  // Reads the next record, replacing *record.
+  //
+  // Return values:
+  //  * true                    - success (*record is set)
+  //  * false (when healthy())  - source ends
+  //  * false (when !healthy()) - failure
+  bool ReadRecord(std::string* record);
+  bool ReadRecord(Chain* record);
+
+ protected:
+  void Done() override;
+
+ private:
+  // Reads the header of the next record, verifying its checksum.
+  //
+  // Return values:
+  //  * true                    - success (*length is set)
+  //  * false (when healthy())  - source ends
+  //  * false (when !healthy()) - failure
+  bool ReadHeader(uint64_t* length);
+
+  // Reads the footer of a record, verifying the checksum of data against
+  // data_crc if verify_checksums_.
+  //
+  // If the result is false then !healthy().
+  bool ReadFooter(uint32_t data_crc);
+
+  template <typename Dest>
+  bool ReadRecordImpl(Dest* record);
+
+  std::unique_ptr<Reader> owned_src_;
+  // Set if Compression::kZlib, reading from owned_src_ or from the Reader
+  // given to the constructor.
+  std::unique_ptr<ZLibReader> decompressor_;
+  // Invariant: if healthy() then reader_ != nullptr
+  Reader* reader_ = nullptr;
+  bool verify_checksums_ = true;
+};
+
+// Implementation details follow.
+
+inline TFRecordReader::TFRecordReader(std::unique_ptr<Reader> src,
+                                      Options options)
+    : TFRecordReader(src.get(), options) {
+  owned_src_ = std::move(src);
+}
+
+inline TFRecordReader::TFRecordReader(TFRecordReader&& src) noexcept
+    : Object(std::move(src)),
+      owned_src_(std::move(src.owned_src_)),
+      decompressor_(std::move(src.decompressor_)),
+      reader_(riegeli::exchange(src.reader_, nullptr)),
+      verify_checksums_(src.verify_checksums_) {}
+
+inline TFRecordReader& TFRecordReader::operator=(
+    TFRecordReader&& src) noexcept {
+  Object::operator=(std::move(src));
+  // decompressor_ must be assigned before owned_src_ because it may read from
+  // owned_src_.
+  decompressor_ = std::move(src.decompressor_);
+  owned_src_ = std::move(src.owned_src_);
+  reader_ = riegeli::exchange(src.reader_, nullptr);
+  verify_checksums_ = src.verify_checksums_;
+  return *this;
+}
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_TFRECORD_READER_H_
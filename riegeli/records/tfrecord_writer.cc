@@ -0,0 +1,119 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "riegeli/records/tfrecord_writer.h"
+
+#include <stdint.h>
+#include <cstring>
+#include <memory>
+
+#include "absl/base/optimization.h"
+#include "absl/memory/memory.h"
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/crc32c.h"
+#include "riegeli/base/endian.h"
+#include "riegeli/bytes/writer.h"
+#include "riegeli/bytes/zlib_writer.h"
+
+namespace riegeli {
+
+TFRecordWriter::TFRecordWriter(Writer* dest, Options options)
+    : Object(State::kOpen), writer_(RIEGELI_ASSERT_NOTNULL(dest)) {
+  switch (options.compression_) {
+    case Compression::kNone:
+      return;
+    case Compression::kZlib:
+      options.zlib_options_.set_header(ZLibWriter::Header::kZlib);
+      break;
+    case Compression::kGzip:
+      options.zlib_options_.set_header(ZLibWriter::Header::kGzip);
+      break;
+  }
+  compressor_ = absl::make_unique<ZLibWriter>(dest, options.zlib_options_);
+  writer_ = compressor_.get();
+}
+
+void TFRecordWriter::Done() {
+  if (compressor_ != nullptr) {
+    if (ABSL_PREDICT_TRUE(healthy())) {
+      if (ABSL_PREDICT_FALSE(!compressor_->Close())) Fail(*compressor_);
+    }
+    compressor_.reset();
+  }
+  if (owned_dest_ != nullptr) {
+    if (ABSL_PREDICT_TRUE(healthy())) {
+      if (ABSL_PREDICT_FALSE(!owned_dest_->Close())) Fail(*owned_dest_);
+    }
+    owned_dest_.reset();
+  }
+  writer_ = nullptr;
+}
+
+inline bool TFRecordWriter::WriteHeader(uint64_t length) {
+  char header[sizeof(uint64_t) + sizeof(uint32_t)];
+  const uint64_t length_word = WriteLittleEndian64(length);
+  std::memcpy(header, &length_word, sizeof(length_word));
+  const uint32_t masked_crc = WriteLittleEndian32(
+      MaskCrc32c(Crc32c(absl::string_view(header, sizeof(length_word)))));
+  std::memcpy(header + sizeof(length_word), &masked_crc, sizeof(masked_crc));
+  if (ABSL_PREDICT_FALSE(
+          !writer_->Write(absl::string_view(header, sizeof(header))))) {
+    return Fail(*writer_);
+  }
+  return true;
+}
+
+inline bool TFRecordWriter::WriteFooter(uint32_t data_crc) {
+  const uint32_t masked_crc = WriteLittleEndian32(MaskCrc32c(data_crc));
+  if (ABSL_PREDICT_FALSE(!writer_->Write(absl::string_view(
+          reinterpret_cast<const char*>(&masked_crc), sizeof(masked_crc))))) {
+    return Fail(*writer_);
+  }
+  return true;
+}
+
+bool TFRecordWriter::WriteRecord(absl::string_view record) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(!WriteHeader(IntCast<uint64_t>(record.size())))) {
+    return false;
+  }
+  if (ABSL_PREDICT_FALSE(!writer_->Write(record))) return Fail(*writer_);
+  return WriteFooter(Crc32c(record));
+}
+
+bool TFRecordWriter::WriteRecord(const Chain& record) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(!WriteHeader(IntCast<uint64_t>(record.size())))) {
+    return false;
+  }
+  if (ABSL_PREDICT_FALSE(!writer_->Write(record))) return Fail(*writer_);
+  uint32_t crc = 0;
+  for (const absl::string_view fragment : record.blocks()) {
+    crc = Crc32cExtend(crc, fragment);
+  }
+  return WriteFooter(crc);
+}
+
+bool TFRecordWriter::Flush(FlushType flush_type) {
+  if (ABSL_PREDICT_FALSE(!healthy())) return false;
+  if (ABSL_PREDICT_FALSE(!writer_->Flush(flush_type))) {
+    if (writer_->healthy()) return false;
+    return Fail(*writer_);
+  }
+  return true;
+}
+
+}  // namespace riegeli
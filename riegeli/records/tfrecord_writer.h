@@ -0,0 +1,149 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef RIEGELI_RECORDS_TFRECORD_WRITER_H_
+#define RIEGELI_RECORDS_TFRECORD_WRITER_H_
+
+#include <memory>
+#include <utility>
+
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/base/chain.h"
+#include "riegeli/base/object.h"
+#include "riegeli/bytes/writer.h"
+#include "riegeli/bytes/zlib_writer.h"
+
+namespace riegeli {
+
+// Writes records in the TFRecord format, see TFRecordReader, without
+// depending on TensorFlow.
+class TFRecordWriter final : public Object {
+ public:
+  enum class Compression {
+    kNone,  // uncompressed
+    kZlib,  // zlib format, as TFRecordCompressionType ZLIB
+    kGzip,  // gzip format, as TFRecordCompressionType GZIP
+  };
+
+  class Options {
+   public:
+    // Not defaulted because of a C++ defect:
+    // https://stackoverflow.com/questions/17430377
+    Options() noexcept {}
+
+    // Specifies how the file is compressed.
+    //
+    // Default: Compression::kNone
+    Options& set_compression(Compression compression) & {
+      compression_ = compression;
+      return *this;
+    }
+    Options&& set_compression(Compression compression) && {
+      return std::move(set_compression(compression));
+    }
+
+    // Tunes the tradeoff between compression density and compression speed
+    // if the file is compressed, see ZLibWriter::Options.
+    //
+    // Default: ZLibWriter::Options::kDefaultCompressionLevel() (6).
+    Options& set_compression_level(int compression_level) & {
+      zlib_options_.set_compression_level(compression_level);
+      return *this;
+    }
+    Options&& set_compression_level(int compression_level) && {
+      return std::move(set_compression_level(compression_level));
+    }
+
+   private:
+    friend class TFRecordWriter;
+
+    Compression compression_ = Compression::kNone;
+    ZLibWriter::Options zlib_options_;
+  };
+
+  // Creates a closed TFRecordWriter.
+  TFRecordWriter() noexcept : Object(State::kClosed) {}
+
+  // Will write to the byte Writer which is owned by this TFRecordWriter and
+  // will be closed and deleted when the TFRecordWriter is closed.
+  explicit TFRecordWriter(std::unique_ptr<Writer> dest,
+                          Options options = Options());
+
+  // Will write to the byte Writer which is not owned by this TFRecordWriter
+  // and must be kept alive but not accessed until closing the TFRecordWriter.
+  explicit TFRecordWriter(Writer* dest, Options options = Options());
+
+  TFRecordWriter(TFRecordWriter&& src) noexcept;
+  TFRecordWriter& operator=(TFRecordWriter&& src) noexcept;
+
+  // Writes the next record.
+  //
+  // Return values:
+  //  * true  - success (healthy())
+  //  * false - failure (!healthy())
+  bool WriteRecord(absl::string_view record);
+  bool WriteRecord(const Chain& record);
+
+  // Pushes buffered data to the destination, see Writer::Flush().
+  //
+  // Return values:
+  //  * true                    - success (pushed and synced, healthy())
+  //  * false (when healthy())  - failure to sync
+  //  * false (when !healthy()) - failure to push
+  bool Flush(FlushType flush_type);
+
+ protected:
+  void Done() override;
+
+ private:
+  bool WriteHeader(uint64_t length);
+  bool WriteFooter(uint32_t data_crc);
+
+  std::unique_ptr<Writer> owned_dest_;
+  // Set if the file is compressed, writing to owned_dest_ or to the Writer
+  // given to the constructor.
+  std::unique_ptr<ZLibWriter> compressor_;
+  // Invariant: if healthy() then writer_ != nullptr
+  Writer* writer_ = nullptr;
+};
+
+// Implementation details follow.
+
+inline TFRecordWriter::TFRecordWriter(std::unique_ptr<Writer> dest,
+                                      Options options)
+    : TFRecordWriter(dest.get(), std::move(options)) {
+  owned_dest_ = std::move(dest);
+}
+
+inline TFRecordWriter::TFRecordWriter(TFRecordWriter&& src) noexcept
+    : Object(std::move(src)),
+      owned_dest_(std::move(src.owned_dest_)),
+      compressor_(std::move(src.compressor_)),
+      writer_(riegeli::exchange(src.writer_, nullptr)) {}
+
+inline TFRecordWriter& TFRecordWriter::operator=(
+    TFRecordWriter&& src) noexcept {
+  Object::operator=(std::move(src));
+  // compressor_ must be assigned before owned_dest_ because it may write to
+  // owned_dest_.
+  compressor_ = std::move(src.compressor_);
+  owned_dest_ = std::move(src.owned_dest_);
+  writer_ = riegeli::exchange(src.writer_, nullptr);
+  return *this;
+}
+
+}  // namespace riegeli
+
+#endif  // RIEGELI_RECORDS_TFRECORD_WRITER_H_
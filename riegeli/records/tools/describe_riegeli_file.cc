@@ -0,0 +1,375 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Make file offsets 64-bit even on 32-bit systems.
+#undef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
+#include "riegeli/base/base.h"
+#include "riegeli/bytes/fd_reader.h"
+#include "riegeli/bytes/reader_utils.h"
+#include "riegeli/bytes/zstd_dictionary.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/chunk_describer.h"
+#include "riegeli/chunk_encoding/field_filter.h"
+#include "riegeli/chunk_encoding/types.h"
+#include "riegeli/records/chunk_reader.h"
+
+namespace {
+
+const char kUsage[] =
+    "Usage: describe_riegeli_file (OPTION|FILE)...\n"
+    "\n"
+    "Reports sizes of chunks, buckets, and fields of Riegeli/records files,\n"
+    "for tuning RecordWriter options.\n"
+    "\n"
+    "OPTIONs:\n"
+    "  --chunks\n"
+    "      Describe each chunk, not only totals of each file\n"
+    "  --decode_time\n"
+    "      Measure the time of decoding chunks, and of decoding each field of\n"
+    "      transposed chunks alone (slow)\n"
+    "  --zstd_dictionary=FILE\n"
+    "      Zstd dictionary used to decompress chunks compressed with it,\n"
+    "      e.g. written by train_zstd_dictionary; can be repeated";
+
+const struct option kOptions[] = {
+    {"help", no_argument, nullptr, 0},
+    {"chunks", no_argument, nullptr, 1},
+    {"decode_time", no_argument, nullptr, 2},
+    {"zstd_dictionary", required_argument, nullptr, 3},
+    {nullptr, 0, nullptr, 0}};
+
+std::string ChunkTypeName(riegeli::ChunkType chunk_type) {
+  switch (chunk_type) {
+    case riegeli::ChunkType::kPadding:
+      return "padding";
+    case riegeli::ChunkType::kSimple:
+      return "simple";
+    case riegeli::ChunkType::kBlockedSimple:
+      return "blocked_simple";
+    case riegeli::ChunkType::kTransposed:
+      return "transposed";
+    case riegeli::ChunkType::kIndex:
+      return "index";
+    case riegeli::ChunkType::kSummary:
+      return "summary";
+    case riegeli::ChunkType::kDelta:
+      return "delta";
+    case riegeli::ChunkType::kDeduplicated:
+      return "deduplicated";
+    case riegeli::ChunkType::kFragment:
+      return "fragment";
+  }
+  return absl::StrCat("unknown (", static_cast<unsigned>(chunk_type), ")");
+}
+
+std::string CompressionTypeName(riegeli::CompressionType compression_type) {
+  switch (compression_type) {
+    case riegeli::CompressionType::kNone:
+      return "none";
+    case riegeli::CompressionType::kBrotli:
+      return "brotli";
+    case riegeli::CompressionType::kZstd:
+      return "zstd";
+    case riegeli::CompressionType::kLz4:
+      return "lz4";
+  }
+  return absl::StrCat("unknown (", static_cast<unsigned>(compression_type),
+                      ")");
+}
+
+std::string PathName(const riegeli::Field::Path& path) {
+  if (path.empty()) return "(non-proto)";
+  return absl::StrJoin(path, ".");
+}
+
+double Millis(uint64_t nanos) { return static_cast<double>(nanos) * 1e-6; }
+
+double Ratio(double compressed_size, uint64_t size) {
+  return size == 0 ? 0.0 : compressed_size / static_cast<double>(size);
+}
+
+// Totals of chunks of one type.
+struct ChunkTypeTotals {
+  uint64_t num_chunks = 0;
+  uint64_t num_records = 0;
+  uint64_t data_size = 0;
+  uint64_t decoded_data_size = 0;
+  uint64_t decode_nanos = 0;
+};
+
+// Totals of transposed chunks.
+struct TransposedTotals {
+  uint64_t header_size = 0;
+  uint64_t transitions_size = 0;
+  uint64_t num_transitions = 0;
+  uint64_t state_machine_size = 0;
+  uint32_t max_state_machine_size = 0;
+  uint64_t num_buckets = 0;
+  uint64_t buckets_compressed_size = 0;
+  uint64_t buckets_decompressed_size = 0;
+  std::map<riegeli::Field::Path, riegeli::ChunkDescription::FieldDescription>
+      fields;
+};
+
+void PrintFields(
+    std::vector<riegeli::ChunkDescription::FieldDescription> fields,
+    bool decode_time, const char* indent) {
+  // The largest fields are the most interesting to tune.
+  std::sort(fields.begin(), fields.end(),
+            [](const riegeli::ChunkDescription::FieldDescription& a,
+               const riegeli::ChunkDescription::FieldDescription& b) {
+              return a.compressed_size > b.compressed_size;
+            });
+  std::cout << indent << std::left << std::setw(20) << "field"
+            << std::right << std::setw(14) << "occurrences" << std::setw(14)
+            << "buffer" << std::setw(14) << "compressed" << std::setw(8)
+            << "ratio";
+  if (decode_time) std::cout << std::setw(12) << "decode ms";
+  std::cout << "\n";
+  for (const riegeli::ChunkDescription::FieldDescription& field : fields) {
+    std::cout << indent << std::left << std::setw(20) << PathName(field.path)
+              << std::right << std::setw(14) << field.num_occurrences
+              << std::setw(14) << field.buffer_size << std::setw(14)
+              << std::fixed << std::setprecision(0) << field.compressed_size
+              << std::setw(8) << std::setprecision(3)
+              << Ratio(field.compressed_size, field.buffer_size);
+    if (decode_time) {
+      std::cout << std::setw(12) << std::setprecision(3)
+                << Millis(field.decode_nanos);
+    }
+    std::cout << "\n";
+  }
+}
+
+void PrintChunk(riegeli::Position chunk_begin,
+                const riegeli::ChunkDescription& description,
+                bool decode_time) {
+  std::cout << "  chunk at " << chunk_begin << ": "
+            << ChunkTypeName(description.chunk_type) << ", "
+            << description.num_records << " records, " << description.data_size
+            << " bytes, " << description.decoded_data_size << " decoded bytes";
+  if (decode_time) {
+    std::cout << ", " << std::fixed << std::setprecision(3)
+              << Millis(description.decode_nanos) << " ms";
+  }
+  std::cout << "\n";
+  if (description.chunk_type != riegeli::ChunkType::kTransposed) return;
+  std::cout << "    compression " << CompressionTypeName(
+                                         description.compression_type)
+            << ", header " << description.header_size << " bytes, transitions "
+            << description.transitions_size << " bytes ("
+            << description.num_transitions << " transitions), "
+            << description.state_machine_size << " states\n";
+  for (size_t i = 0; i < description.buckets.size(); ++i) {
+    const riegeli::ChunkDescription::Bucket& bucket = description.buckets[i];
+    std::cout << "    bucket " << i << ": "
+              << CompressionTypeName(bucket.compression_type) << ", "
+              << bucket.num_buffers << " buffers, " << bucket.compressed_size
+              << " / " << bucket.decompressed_size << " bytes\n";
+  }
+  PrintFields(description.fields, decode_time, "    ");
+}
+
+// Reads a Zstd dictionary from filename and registers it in
+// zstd_dictionaries.
+//
+// Returns false on failure, after reporting it.
+bool AddZstdDictionary(const char* program, const std::string& filename,
+                       riegeli::ZstdDictionaryRegistry* zstd_dictionaries) {
+  riegeli::FdReader reader(filename, O_RDONLY);
+  std::string data;
+  if (!riegeli::ReadAll(&reader, &data) || !reader.Close()) {
+    std::cerr << program << ": " << filename << ": " << reader.message()
+              << "\n";
+    return false;
+  }
+  if (!zstd_dictionaries->Add(
+          std::make_shared<const riegeli::ZstdDictionary>(std::move(data)))) {
+    std::cerr << program << ": " << filename
+              << ": not a Zstd dictionary with an id, or its id is repeated\n";
+    return false;
+  }
+  return true;
+}
+
+// Returns false on failure, after reporting it.
+bool DescribeFile(const char* program, const std::string& filename,
+                  bool chunks, bool decode_time,
+                  const riegeli::ZstdDictionaryRegistry* zstd_dictionaries) {
+  riegeli::ChunkReader chunk_reader(
+      absl::make_unique<riegeli::FdReader>(filename, O_RDONLY));
+  riegeli::ChunkDescriber describer(
+      riegeli::ChunkDescriber::Options()
+          .set_measure_decode_time(decode_time)
+          .set_zstd_dictionaries(zstd_dictionaries));
+  std::map<riegeli::ChunkType, ChunkTypeTotals> chunk_type_totals;
+  TransposedTotals transposed;
+  std::cout << filename << "\n";
+  riegeli::Chunk chunk;
+  riegeli::Position chunk_begin;
+  riegeli::ChunkDescription description;
+  while (chunk_reader.ReadChunk(&chunk, &chunk_begin)) {
+    if (!describer.Describe(chunk, &description)) {
+      std::cerr << program << ": " << filename << ": chunk at " << chunk_begin
+                << ": " << describer.message() << "\n";
+      return false;
+    }
+    if (chunks) PrintChunk(chunk_begin, description, decode_time);
+    ChunkTypeTotals& totals = chunk_type_totals[description.chunk_type];
+    ++totals.num_chunks;
+    totals.num_records += description.num_records;
+    totals.data_size += description.data_size;
+    totals.decoded_data_size += description.decoded_data_size;
+    totals.decode_nanos += description.decode_nanos;
+    if (description.chunk_type != riegeli::ChunkType::kTransposed) continue;
+    transposed.header_size += description.header_size;
+    transposed.transitions_size += description.transitions_size;
+    transposed.num_transitions += description.num_transitions;
+    transposed.state_machine_size += description.state_machine_size;
+    transposed.max_state_machine_size = std::max(
+        transposed.max_state_machine_size, description.state_machine_size);
+    for (const riegeli::ChunkDescription::Bucket& bucket :
+         description.buckets) {
+      ++transposed.num_buckets;
+      transposed.buckets_compressed_size += bucket.compressed_size;
+      transposed.buckets_decompressed_size += bucket.decompressed_size;
+    }
+    for (const riegeli::ChunkDescription::FieldDescription& field :
+         description.fields) {
+      riegeli::ChunkDescription::FieldDescription& total =
+          transposed.fields[field.path];
+      total.path = field.path;
+      total.num_occurrences += field.num_occurrences;
+      total.buffer_size += field.buffer_size;
+      total.compressed_size += field.compressed_size;
+      total.decode_nanos += field.decode_nanos;
+    }
+  }
+  if (!chunk_reader.Close()) {
+    std::cerr << program << ": " << filename << ": " << chunk_reader.message()
+              << "\n";
+    return false;
+  }
+
+  std::cout << "  " << std::left << std::setw(16) << "chunk type" << std::right
+            << std::setw(10) << "chunks" << std::setw(14) << "records"
+            << std::setw(14) << "bytes" << std::setw(14) << "decoded"
+            << std::setw(8) << "ratio";
+  if (decode_time) std::cout << std::setw(12) << "decode ms";
+  std::cout << "\n";
+  for (const auto& entry : chunk_type_totals) {
+    const ChunkTypeTotals& totals = entry.second;
+    std::cout << "  " << std::left << std::setw(16)
+              << ChunkTypeName(entry.first) << std::right << std::setw(10)
+              << totals.num_chunks << std::setw(14) << totals.num_records
+              << std::setw(14) << totals.data_size << std::setw(14)
+              << totals.decoded_data_size << std::setw(8) << std::fixed
+              << std::setprecision(3)
+              << Ratio(static_cast<double>(totals.data_size),
+                       totals.decoded_data_size);
+    if (decode_time) {
+      std::cout << std::setw(12) << std::setprecision(3)
+                << Millis(totals.decode_nanos);
+    }
+    std::cout << "\n";
+  }
+  const auto transposed_totals =
+      chunk_type_totals.find(riegeli::ChunkType::kTransposed);
+  if (transposed_totals == chunk_type_totals.end()) return true;
+  std::cout << "  transposed chunks: header " << transposed.header_size
+            << " bytes, transitions " << transposed.transitions_size
+            << " bytes (" << transposed.num_transitions
+            << " transitions), states " << std::setprecision(1)
+            << static_cast<double>(transposed.state_machine_size) /
+                   static_cast<double>(transposed_totals->second.num_chunks)
+            << " on average, " << transposed.max_state_machine_size
+            << " at most\n"
+            << "  buckets: " << transposed.num_buckets << ", "
+            << transposed.buckets_compressed_size << " / "
+            << transposed.buckets_decompressed_size << " bytes\n";
+  std::vector<riegeli::ChunkDescription::FieldDescription> fields;
+  fields.reserve(transposed.fields.size());
+  for (auto& entry : transposed.fields) {
+    fields.push_back(std::move(entry.second));
+  }
+  PrintFields(std::move(fields), decode_time, "  ");
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const char* const program = argv[0];
+  bool chunks = false;
+  bool decode_time = false;
+  riegeli::ZstdDictionaryRegistry zstd_dictionaries;
+  for (;;) {
+    int option_index;
+    const int option =
+        getopt_long_only(argc, argv, "", kOptions, &option_index);
+    if (option == -1) break;
+    switch (option) {
+      case 0:  // --help
+        std::cout << kUsage << std::endl;
+        return 0;
+      case 1:  // --chunks
+        chunks = true;
+        break;
+      case 2:  // --decode_time
+        decode_time = true;
+        break;
+      case 3:  // --zstd_dictionary
+        if (!AddZstdDictionary(program, optarg, &zstd_dictionaries)) return 1;
+        break;
+      case '?':
+        return 1;
+      default:
+        RIEGELI_ASSERT_UNREACHABLE()
+            << "getopt_long_only() returned " << option;
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+  if (argc == 1) {
+    std::cerr << kUsage << std::endl;
+    return 1;
+  }
+  bool ok = true;
+  for (int i = 1; i < argc; ++i) {
+    if (i > 1) std::cout << "\n";
+    if (!DescribeFile(program, argv[i], chunks, decode_time,
+                      &zstd_dictionaries)) {
+      ok = false;
+    }
+  }
+  return ok ? 0 : 1;
+}
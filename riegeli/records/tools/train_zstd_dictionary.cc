@@ -0,0 +1,205 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Make file offsets 64-bit even on 32-bit systems.
+#undef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <utility>
+
+#include "absl/base/optimization.h"
+#include "absl/memory/memory.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
+#include "riegeli/base/base.h"
+#include "riegeli/bytes/fd_reader.h"
+#include "riegeli/bytes/fd_writer.h"
+#include "riegeli/bytes/zstd_dictionary.h"
+#include "riegeli/chunk_encoding/chunk.h"
+#include "riegeli/chunk_encoding/field_filter.h"
+#include "riegeli/chunk_encoding/zstd_dictionary_trainer.h"
+#include "riegeli/records/chunk_reader.h"
+
+namespace {
+
+const char kUsage[] =
+    "Usage: train_zstd_dictionary --output=FILE (OPTION|FILE)...\n"
+    "\n"
+    "Trains a Zstd dictionary on samples of Riegeli/records FILEs: data\n"
+    "buffers of transposed chunks, and records of other chunks. The\n"
+    "dictionary can be passed to RecordWriter::Options::set_zstd_dictionary()\n"
+    "as ZstdDictionary(contents of the output file).\n"
+    "\n"
+    "OPTIONs:\n"
+    "  --output=FILE\n"
+    "      File to write the dictionary to\n"
+    "  --max_dictionary_size=BYTES\n"
+    "      Maximum size of the dictionary, default 112640\n"
+    "  --max_samples=N\n"
+    "      Maximum number of samples kept for training, default 16384\n"
+    "  --max_sample_size=BYTES\n"
+    "      Maximum size of a sample, default 8192\n"
+    "  --fields=PATHS\n"
+    "      Whitespace-separated field paths, with field numbers separated\n"
+    "      by '.', e.g. '1 2.3'; only buffers of these fields of transposed\n"
+    "      chunks are sampled, default all fields\n"
+    "  --seed=N\n"
+    "      Seed of the random choice of samples, default 0";
+
+const struct option kOptions[] = {
+    {"help", no_argument, nullptr, 0},
+    {"output", required_argument, nullptr, 1},
+    {"max_dictionary_size", required_argument, nullptr, 2},
+    {"max_samples", required_argument, nullptr, 3},
+    {"max_sample_size", required_argument, nullptr, 4},
+    {"fields", required_argument, nullptr, 5},
+    {"seed", required_argument, nullptr, 6},
+    {nullptr, 0, nullptr, 0}};
+
+// Parses whitespace-separated field paths. Returns false on failure.
+bool ParseFields(const std::string& text, riegeli::FieldFilter* dest) {
+  std::stringstream in(text);
+  std::string word;
+  while (in >> word) {
+    riegeli::Field field;
+    for (const absl::string_view number : absl::StrSplit(word, '.')) {
+      uint32_t field_number;
+      if (ABSL_PREDICT_FALSE(!absl::SimpleAtoi(number, &field_number)) ||
+          ABSL_PREDICT_FALSE(field_number == 0 ||
+                             field_number > (uint32_t{1} << 29) - 1)) {
+        return false;
+      }
+      field.AddTag(field_number);
+    }
+    dest->AddField(std::move(field));
+  }
+  return true;
+}
+
+// Parses a positive size option, exiting on failure.
+size_t ParseSize(const char* program, const char* option, const char* text) {
+  size_t value;
+  if (ABSL_PREDICT_FALSE(!absl::SimpleAtoi(text, &value)) ||
+      ABSL_PREDICT_FALSE(value == 0)) {
+    std::cerr << program << ": option '--" << option
+              << "' requires a positive integer argument\n";
+    std::exit(1);
+  }
+  return value;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const char* const program = argv[0];
+  std::string output;
+  riegeli::ZstdDictionaryTrainer::Options options;
+  for (;;) {
+    int option_index;
+    const int option =
+        getopt_long_only(argc, argv, "", kOptions, &option_index);
+    if (option == -1) break;
+    switch (option) {
+      case 0:  // --help
+        std::cout << kUsage << std::endl;
+        return 0;
+      case 1:  // --output
+        output = optarg;
+        break;
+      case 2:  // --max_dictionary_size
+        options.set_max_dictionary_size(
+            ParseSize(program, "max_dictionary_size", optarg));
+        break;
+      case 3:  // --max_samples
+        options.set_max_samples(ParseSize(program, "max_samples", optarg));
+        break;
+      case 4:  // --max_sample_size
+        options.set_max_sample_size(
+            ParseSize(program, "max_sample_size", optarg));
+        break;
+      case 5: {  // --fields
+        riegeli::FieldFilter field_filter;
+        if (ABSL_PREDICT_FALSE(!ParseFields(optarg, &field_filter))) {
+          std::cerr << program << ": option '--fields' requires field paths\n";
+          return 1;
+        }
+        options.set_field_filter(std::move(field_filter));
+      } break;
+      case 6: {  // --seed
+        uint64_t seed;
+        if (ABSL_PREDICT_FALSE(!absl::SimpleAtoi(optarg, &seed))) {
+          std::cerr << program
+                    << ": option '--seed' requires an integer argument\n";
+          return 1;
+        }
+        options.set_seed(seed);
+      } break;
+      case '?':
+        return 1;
+      default:
+        RIEGELI_ASSERT_UNREACHABLE()
+            << "getopt_long_only() returned " << option;
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+  if (argc == 1 || output.empty()) {
+    std::cerr << kUsage << std::endl;
+    return 1;
+  }
+
+  riegeli::ZstdDictionaryTrainer trainer(std::move(options));
+  for (int i = 1; i < argc; ++i) {
+    riegeli::ChunkReader chunk_reader(
+        absl::make_unique<riegeli::FdReader>(argv[i], O_RDONLY));
+    riegeli::Chunk chunk;
+    while (chunk_reader.ReadChunk(&chunk)) {
+      if (ABSL_PREDICT_FALSE(!trainer.AddChunk(chunk))) {
+        std::cerr << program << ": " << argv[i] << ": " << trainer.message()
+                  << "\n";
+        return 1;
+      }
+    }
+    if (ABSL_PREDICT_FALSE(!chunk_reader.Close())) {
+      std::cerr << program << ": " << argv[i] << ": "
+                << chunk_reader.message() << "\n";
+      return 1;
+    }
+  }
+  std::string dictionary;
+  if (ABSL_PREDICT_FALSE(!trainer.Train(&dictionary))) {
+    std::cerr << program << ": " << trainer.message() << "\n";
+    return 1;
+  }
+  riegeli::FdWriter writer(output, O_WRONLY | O_CREAT | O_TRUNC);
+  if (ABSL_PREDICT_FALSE(!writer.Write(dictionary)) ||
+      ABSL_PREDICT_FALSE(!writer.Close())) {
+    std::cerr << program << ": " << output << ": " << writer.message() << "\n";
+    return 1;
+  }
+  const uint32_t id = riegeli::ZstdDictionary(dictionary).id();
+  std::cout << "Trained on " << trainer.num_samples() << " samples out of "
+            << trainer.num_samples_seen() << ", wrote " << dictionary.size()
+            << " bytes to " << output << ", dictionary id " << id << std::endl;
+  return 0;
+}